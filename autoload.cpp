@@ -11,12 +11,311 @@ The classes responsible for autoloading functions and completions.
 #include "env.h"
 #include "builtin_scripts.h"
 #include "exec.h"
+#include "proc.h"
+#include "profiler.h"
+#include "dir_cache.h"
 #include <assert.h>
 #include <algorithm>
+#include <set>
+#include <map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 /* The time before we'll recheck an autoloaded file */
 static const int kAutoloadStalenessInterval = 15;
 
+/**
+   Keeps an index of the .fish files in each directory on the autoload
+   paths, and watches those directories so that the index can be
+   trusted until one of them changes. This lets us answer "is there a
+   foo.fish anywhere" without touching the file system, which matters
+   because most lookups are for commands that have no autoload file.
+
+   Every change to a watched directory drops its index and bumps a
+   generation counter, so that anything remembered about the watched
+   directories can be checked for staleness by comparing generations.
+   Where directories can't be watched, lookups fail and callers fall
+   back to checking the file system after kAutoloadStalenessInterval,
+   and listings come from the directory cache. Only interactive
+   sessions watch directories.
+*/
+class autoload_dir_watcher_t
+{
+#if HAVE_SYS_INOTIFY_H
+    /** Events that invalidate the index of a watched directory */
+    static const uint32_t kDirMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+    
+    /** Events on the parent of a missing directory that may create it */
+    static const uint32_t kParentMask = IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    
+    struct dir_index_t
+    {
+        /** Whether the directory exists */
+        bool exists;
+        
+        /** The names of the .fish files in the directory, without the suffix */
+        std::set<wcstring> names;
+    };
+    
+    pthread_mutex_t lock;
+    
+    /** The inotify descriptor, or -1 if we couldn't get one */
+    int fd;
+    
+    /** Whether we have tried to get an inotify descriptor */
+    bool initialized;
+    
+    /** The process that owns the descriptor. Forked children must not read events meant for their parent. */
+    pid_t owner;
+    
+    /** The number of times an index has been dropped */
+    unsigned int generation;
+    
+    /** Indexes of watched directories, by path */
+    std::map<wcstring, dir_index_t> indexes;
+    
+    /** The directories each watch descriptor is responsible for */
+    std::map<int, wcstring_list_t> watched_dirs;
+    
+    /** Gets our descriptor ready, returning false if there is none. Must be called with the lock held. */
+    bool prepare()
+    {
+        ASSERT_IS_LOCKED(lock);
+        if (! initialized)
+        {
+            initialized = true;
+            owner = getpid();
+            
+            /* Closing an inotify descriptor with watches waits for the kernel, which costs a short-lived script more than the watches save it */
+            fd = is_interactive_session ? inotify_init() : -1;
+            if (fd >= 0)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        return fd >= 0 && owner == getpid();
+    }
+    
+    /** Stops watching everything. Must be called with the lock held. */
+    void drop_all()
+    {
+        ASSERT_IS_LOCKED(lock);
+        for (std::map<int, wcstring_list_t>::const_iterator iter = watched_dirs.begin(); iter != watched_dirs.end(); ++iter)
+        {
+            inotify_rm_watch(fd, iter->first);
+        }
+        watched_dirs.clear();
+        indexes.clear();
+        generation++;
+    }
+    
+    /** Drops the indexes of the directories that a watch descriptor is responsible for, and the watch itself. It is added again the next time one of them is looked up. Must be called with the lock held. */
+    void drop_watch(int wd, bool still_watching)
+    {
+        ASSERT_IS_LOCKED(lock);
+        std::map<int, wcstring_list_t>::iterator iter = watched_dirs.find(wd);
+        if (iter == watched_dirs.end())
+            return;
+        
+        for (size_t i=0; i < iter->second.size(); i++)
+        {
+            indexes.erase(iter->second.at(i));
+        }
+        watched_dirs.erase(iter);
+        if (still_watching)
+            inotify_rm_watch(fd, wd);
+        generation++;
+    }
+    
+    /** Reads all pending events without blocking. Must be called with the lock held. */
+    void drain_events()
+    {
+        ASSERT_IS_LOCKED(lock);
+        char buff[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        for (;;)
+        {
+            ssize_t amt = read(fd, buff, sizeof buff);
+            if (amt <= 0)
+            {
+                /* Nothing more to read. An error other than EAGAIN means we can't trust our indexes any more. */
+                if (amt < 0 && errno != EAGAIN && errno != EINTR)
+                {
+                    drop_all();
+                }
+                break;
+            }
+            
+            for (ssize_t offset = 0; offset + (ssize_t)sizeof(struct inotify_event) <= amt; )
+            {
+                const struct inotify_event *event = (const struct inotify_event *)(buff + offset);
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    drop_all();
+                }
+                else
+                {
+                    drop_watch(event->wd, ! (event->mask & IN_IGNORED));
+                }
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+    
+    /** Starts watching a directory on behalf of a path. Returns false on failure. */
+    bool add_watch(const wcstring &watched, uint32_t mask, const wcstring &dir)
+    {
+        ASSERT_IS_LOCKED(lock);
+        int wd = inotify_add_watch(fd, wcs2string(watched).c_str(), mask | IN_MASK_ADD | IN_ONLYDIR);
+        if (wd < 0)
+            return false;
+        watched_dirs[wd].push_back(dir);
+        return true;
+    }
+    
+    /** Returns the index for a directory, reading and watching it if necessary. Returns NULL if it can't be watched. Must be called with the lock held. */
+    const dir_index_t *index_for_directory(const wcstring &dir)
+    {
+        ASSERT_IS_LOCKED(lock);
+        std::map<wcstring, dir_index_t>::const_iterator iter = indexes.find(dir);
+        if (iter != indexes.end())
+            return &iter->second;
+        
+        dir_index_t index;
+        
+        /* Watch before reading, so that nothing that happens in between is missed */
+        if (add_watch(dir, kDirMask, dir))
+        {
+            DIR *d = wopendir(dir);
+            if (! d)
+                return NULL;
+            
+            index.exists = true;
+            wcstring name;
+            while (wreaddir(d, name))
+            {
+                if (string_suffixes_string(L".fish", name))
+                    index.names.insert(wcstring(name, 0, name.size() - 5));
+            }
+            closedir(d);
+        }
+        else if (errno == ENOENT)
+        {
+            /* The directory doesn't exist. Watch the parent, so we notice if it is created. */
+            wcstring parent = wdirname(dir);
+            if (parent == dir || ! add_watch(parent, kParentMask, dir))
+                return NULL;
+            
+            /* Make sure it wasn't created before the watch was */
+            if (waccess(dir, F_OK) == 0)
+                return NULL;
+            index.exists = false;
+        }
+        else
+        {
+            /* Probably out of watches */
+            return NULL;
+        }
+        
+        return &(indexes[dir] = index);
+    }
+#endif
+    
+    public:
+    
+#if HAVE_SYS_INOTIFY_H
+    autoload_dir_watcher_t() : fd(-1), initialized(false), owner(0), generation(0)
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+#endif
+    
+    /**
+       Looks up whether the directory contains the file name + ".fish".
+       Returns false if this is not known, in which case the caller has
+       to check the file system itself.
+    */
+    bool lookup(const wcstring &dir, const wcstring &name, bool *out_exists)
+    {
+#if HAVE_SYS_INOTIFY_H
+        /* Names with slashes would be inside of subdirectories, which we don't index */
+        if (name.find(L'/') != wcstring::npos || dir.empty())
+            return false;
+        
+        scoped_lock locker(lock);
+        if (! prepare())
+            return false;
+        drain_events();
+        const dir_index_t *index = index_for_directory(dir);
+        if (! index)
+            return false;
+        *out_exists = index->exists && index->names.count(name) > 0;
+        return true;
+#else
+        return false;
+#endif
+    }
+    
+    /**
+       Inserts the names of the .fish files in the directory, without
+       the suffix, into names. Does nothing if it can't be read.
+    */
+    void list(const wcstring &dir, std::set<wcstring> &names)
+    {
+        if (dir.empty())
+            return;
+        
+#if HAVE_SYS_INOTIFY_H
+        {
+            scoped_lock locker(lock);
+            if (prepare())
+            {
+                drain_events();
+                const dir_index_t *index = index_for_directory(dir);
+                if (index)
+                {
+                    names.insert(index->names.begin(), index->names.end());
+                    return;
+                }
+            }
+        }
+#endif
+        
+        dir_listing_ref_t listing;
+        if (! dir_cache_get_listing(dir, &listing))
+            return;
+        for (size_t i=0; i < listing->size(); i++)
+        {
+            const wcstring &name = listing->at(i).name;
+            if (string_suffixes_string(L".fish", name))
+                names.insert(wcstring(name, 0, name.size() - 5));
+        }
+    }
+    
+    /**
+       Returns the number of changes to watched directories so far. A
+       lookup is out of date if the generation changed since.
+    */
+    unsigned int get_generation()
+    {
+#if HAVE_SYS_INOTIFY_H
+        scoped_lock locker(lock);
+        if (prepare())
+            drain_events();
+        return generation;
+#else
+        return 0;
+#endif
+    }
+};
+
+static autoload_dir_watcher_t s_dir_watcher;
+
 file_access_attempt_t access_file(const wcstring &path, int mode) {
     //printf("Touch %ls\n", path.c_str());
     file_access_attempt_t result = {0};
@@ -38,12 +337,23 @@ file_access_attempt_t access_file(const wcstring &path, int mode) {
     return result;
 }
 
+static bool script_name_precedes_script_name(const builtin_script_t &script1, const builtin_script_t &script2)
+{
+    return wcscmp(script1.name, script2.name) < 0;
+}
+
 autoload_t::autoload_t(const wcstring &env_var_name_var, const builtin_script_t * const scripts, size_t script_count) :
                        env_var_name(env_var_name_var),
                        builtin_scripts(scripts),
                        builtin_script_count(script_count)
 {
     pthread_mutex_init(&lock, NULL);
+    
+    /* Built-in scripts are found with a binary search, so internalize_scripts.py must have sorted them by name */
+    for (size_t i=1; i < script_count; i++)
+    {
+        assert(script_name_precedes_script_name(scripts[i-1], scripts[i]));
+    }
 }
 
 autoload_t::~autoload_t() {
@@ -70,6 +380,7 @@ int autoload_t::load( const wcstring &cmd, bool reload )
 	int res;
 	CHECK_BLOCK( 0 );
     ASSERT_IS_MAIN_THREAD();
+    startup_trace_scope_t trace( "autoload" );
     
 	env_var_t path_var = env_get_string( env_var_name );
     
@@ -126,9 +437,26 @@ bool autoload_t::can_load( const wcstring &cmd, const env_vars &vars )
     return this->locate_file_and_maybe_load_it( cmd, false, false, path_list );
 }
 
-static bool script_name_precedes_script_name(const builtin_script_t &script1, const builtin_script_t &script2)
+void autoload_t::get_names( std::set<wcstring> &names, bool get_hidden )
 {
-    return wcscmp(script1.name, script2.name) < 0;
+    const env_var_t path_var = env_get_string( env_var_name );
+    if( path_var.missing_or_empty() )
+        return;
+    
+    std::vector<wcstring> path_list;
+	tokenize_variable_array( path_var, path_list );
+    
+    std::set<wcstring> found;
+    for (size_t i=0; i < path_list.size(); i++)
+    {
+        s_dir_watcher.list(path_list.at(i), found);
+    }
+    
+    for (std::set<wcstring>::const_iterator iter = found.begin(); iter != found.end(); ++iter)
+    {
+        if (get_hidden || iter->empty() || iter->at(0) != L'_')
+            names.insert(*iter);
+    }
 }
 
 void autoload_t::unload_all(void) {
@@ -144,9 +472,24 @@ bool autoload_t::has_tried_loading( const wcstring &cmd )
     return func != NULL;
 }
 
+size_t autoload_t::memory_usage()
+{
+    scoped_lock locker(lock);
+    size_t result = memory_usage_of(last_path);
+    for (iterator iter = this->begin(); iter != this->end(); ++iter) {
+        /* The node itself, and its entry in the hash table */
+        result += sizeof(autoload_function_t) + 2 * sizeof(void *) + memory_usage_of((*iter)->key);
+    }
+    return result;
+}
+
 static bool is_stale(const autoload_function_t *func) {
-    /** Return whether this function is stale. Internalized functions can never be stale. */
-    return ! func->is_internalized && time(NULL) - func->access.last_checked > kAutoloadStalenessInterval;
+    /** Return whether this function is stale. Internalized functions can never be stale. Functions found in watched directories are stale once any of them changes. */
+    if (func->is_internalized)
+        return false;
+    if (func->is_watched)
+        return s_dir_watcher.get_generation() != func->watch_generation;
+    return time(NULL) - func->access.last_checked > kAutoloadStalenessInterval;
 }
 
 autoload_function_t *autoload_t::get_autoloaded_function_with_creation(const wcstring &cmd, bool allow_eviction)
@@ -235,7 +578,7 @@ bool autoload_t::locate_file_and_maybe_load_it( const wcstring &cmd, bool really
     }
     if (matching_builtin_script) {
         has_script_source = true;
-        script_source = str2wcstring(matching_builtin_script->def);
+        script_source = matching_builtin_script->def;
         
         /* Make a node representing this function */
         scoped_lock locker(lock);
@@ -250,10 +593,22 @@ bool autoload_t::locate_file_and_maybe_load_it( const wcstring &cmd, bool really
     
     if (! has_script_source)
     {
+        /* Note the generation before looking, so that changes made while we look make the result stale */
+        const unsigned int watch_generation = s_dir_watcher.get_generation();
+        bool all_watched = true;
+        
         /* Iterate over path searching for suitable completion files */
         for( i=0; i<path_list.size(); i++ )
         {
             wcstring next = path_list.at(i);
+            
+            /* Skip directories known not to have the file */
+            bool exists = false;
+            if (! s_dir_watcher.lookup(next, cmd, &exists))
+                all_watched = false;
+            else if (! exists)
+                continue;
+            
             wcstring path = next + L"/" + cmd + L".fish";
 
             const file_access_attempt_t access = access_file(path, R_OK);
@@ -294,6 +649,8 @@ bool autoload_t::locate_file_and_maybe_load_it( const wcstring &cmd, bool really
                                                                 
                 /* Unconditionally record our access time */
                 func->access = access;
+                func->is_watched = all_watched;
+                func->watch_generation = watch_generation;
 
                 break;
             }
@@ -319,6 +676,8 @@ bool autoload_t::locate_file_and_maybe_load_it( const wcstring &cmd, bool really
                 }
             }
             func->access.last_checked = time(NULL);
+            func->is_watched = all_watched;
+            func->watch_generation = watch_generation;
         }
     }
     
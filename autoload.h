@@ -26,11 +26,13 @@ file_access_attempt_t access_file(const wcstring &path, int mode);
 
 struct autoload_function_t : public lru_node_t
 {   
-    autoload_function_t(const wcstring &key) : lru_node_t(key), access(), is_loaded(false), is_placeholder(false), is_internalized(false) { }
+    autoload_function_t(const wcstring &key) : lru_node_t(key), access(), is_loaded(false), is_placeholder(false), is_internalized(false), is_watched(false), watch_generation(0) { }
     file_access_attempt_t access; /** The last access attempt */
     bool is_loaded; /** Whether we have actually loaded this function */
     bool is_placeholder; /** Whether we are a placeholder that stands in for "no such function". If this is true, then is_loaded must be false. */
     bool is_internalized; /** Whether this function came from a builtin "internalized" script */
+    bool is_watched; /** Whether all directories consulted by the last access attempt are being watched for changes */
+    unsigned int watch_generation; /** If is_watched, the number of changes to watched directories seen before the last access attempt */
 };
 
 
@@ -124,6 +126,17 @@ private:
     /** Check whether the given command could be loaded, but do not load it. */
     bool can_load( const wcstring &cmd, const env_vars &vars );
 
+    /**
+       Inserts the names of all files on the path that could be loaded,
+       without the suffix, into names. Names that start with an
+       underscore are only inserted if get_hidden is set. Directory
+       listings are cached, so this may be called often.
+    */
+    void get_names( std::set<wcstring> &names, bool get_hidden );
+
+    /** Returns the approximate number of bytes used by the records of loaded and missing files */
+    size_t memory_usage();
+
 };
 
 #endif
@@ -29,12 +29,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <limits.h>
 #include <string.h>
 #include <signal.h>
 #include <wctype.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/select.h>
 #include <time.h>
 #include <stack>
+#include <map>
 
 #include "fallback.h"
 #include "util.h"
@@ -58,12 +62,15 @@
 #include "event.h"
 #include "signal.h"
 #include "exec.h"
+#include "postfork.h"
 #include "highlight.h"
 #include "parse_util.h"
 #include "parser_keywords.h"
 #include "expand.h"
 #include "path.h"
 #include "history.h"
+#include "profiler.h"
+#include "trace.h"
 
 /**
    The default prompt for the read command
@@ -387,6 +394,8 @@ static void builtin_missing_argument( parser_t &parser, const wchar_t *cmd, cons
 #include "builtin_complete.cpp"
 #include "builtin_ulimit.cpp"
 #include "builtin_jobs.cpp"
+#include "builtin_math.cpp"
+#include "builtin_set_color.cpp"
 
 /* builtin_test lives in builtin_test.cpp */
 int builtin_test( parser_t &parser, wchar_t **argv );
@@ -1965,6 +1974,108 @@ static int builtin_random( parser_t &parser, wchar_t **argv )
 }
 
 
+/**
+   The number of bytes the read builtin reads at a time from files and pipes
+*/
+#define READ_CHUNK_SIZE 4096
+
+/**
+   Bytes that the read builtin read from a pipe or socket past the end
+   of a line. These can't be given back to the kernel, so they are kept
+   here, by file descriptor, for the next read from the same file. The
+   device and inode identify the file, so the bytes are not mistaken as
+   belonging to a later file that happens to get the same descriptor.
+*/
+struct read_pushback_t
+{
+	dev_t dev;
+	ino_t ino;
+	std::string bytes;
+};
+
+static std::map<int, read_pushback_t> read_pushbacks;
+
+/**
+   Reads the input of the read builtin in chunks instead of a byte at a
+   time. Bytes past the end of the line are handed back when the reader
+   is done: by seeking back for regular files, and by keeping them in
+   read_pushbacks for pipes and sockets. Anything else, like terminals,
+   is still read a byte at a time.
+*/
+class read_buffer_t
+{
+	int fd;
+	struct stat buf;
+	bool seekable;
+	bool pushable;
+	std::string bytes;
+	size_t pos;
+
+	public:
+
+	read_buffer_t(int f) : fd(f), seekable(false), pushable(false), pos(0)
+	{
+		if( fstat( fd, &buf ) )
+			return;
+
+		if( S_ISREG( buf.st_mode ) )
+		{
+			seekable = lseek( fd, 0, SEEK_CUR ) != (off_t)-1;
+		}
+		else if( S_ISFIFO( buf.st_mode ) || S_ISSOCK( buf.st_mode ) )
+		{
+			pushable = true;
+			std::map<int, read_pushback_t>::iterator iter = read_pushbacks.find( fd );
+			if( iter != read_pushbacks.end() )
+			{
+				if( iter->second.dev == buf.st_dev && iter->second.ino == buf.st_ino )
+					bytes.swap( iter->second.bytes );
+				read_pushbacks.erase( iter );
+			}
+		}
+	}
+
+	/**
+	   Gets the next byte. Returns false on end of file or error.
+	*/
+	bool next( char *b )
+	{
+		if( pos == bytes.size() )
+		{
+			char chunk[READ_CHUNK_SIZE];
+			int amt = read_blocked( fd, chunk, (seekable || pushable) ? sizeof chunk : 1 );
+			if( amt <= 0 )
+				return false;
+			bytes.assign( chunk, amt );
+			pos = 0;
+		}
+		*b = bytes.at( pos++ );
+		return true;
+	}
+
+	/**
+	   Hands back the bytes that were read but not used
+	*/
+	~read_buffer_t()
+	{
+		size_t unused = bytes.size() - pos;
+		if( unused == 0 )
+			return;
+
+		if( seekable )
+		{
+			lseek( fd, -(off_t)unused, SEEK_CUR );
+		}
+		else if( pushable )
+		{
+			read_pushback_t &pushback = read_pushbacks[fd];
+			pushback.dev = buf.st_dev;
+			pushback.ino = buf.st_ino;
+			pushback.bytes.assign( bytes, pos, unused );
+		}
+	}
+};
+
 /**
    The read builtin. Reads from stdin and stores the values in environment variables.
 */
@@ -2191,6 +2302,7 @@ static int builtin_read( parser_t &parser, wchar_t **argv )
 		int eof=0;
 		
 		wcstring sb;
+		read_buffer_t input( builtin_stdin );
 		
 		while( 1 )
 		{
@@ -2203,8 +2315,7 @@ static int builtin_read( parser_t &parser, wchar_t **argv )
 			while( !finished )
 			{
 				char b;
-				int read_res = read_blocked( builtin_stdin, &b, 1 );
-				if( read_res <= 0 )
+				if( ! input.next( &b ) )
 				{
 					eof=1;
 					break;
@@ -2294,7 +2405,10 @@ static int builtin_status( parser_t &parser, wchar_t **argv )
 		STACK_TRACE,
 		DONE,
 		CURRENT_FILENAME,
-		CURRENT_LINE_NUMBER
+		CURRENT_LINE_NUMBER,
+		JOB_TIMING,
+		MEMORY,
+		SYSCALLS
 	}
 	;
 
@@ -2357,6 +2471,18 @@ static int builtin_status( parser_t &parser, wchar_t **argv )
 				L"print-stack-trace", no_argument, 0, 't'
 			}
 			,
+			{
+				L"job-timing", no_argument, &mode, JOB_TIMING
+			}
+			,
+			{
+				L"memory", no_argument, &mode, MEMORY
+			}
+			,
+			{
+				L"syscalls", no_argument, &mode, SYSCALLS
+			}
+			,
 			{
 				0, 0, 0, 0
 			}
@@ -2499,6 +2625,55 @@ static int builtin_status( parser_t &parser, wchar_t **argv )
 				break;
 			}
 
+			case JOB_TIMING:
+			{
+				const wcstring_list_t &timing = proc_get_last_job_timing();
+				for( size_t i=0; i<timing.size(); i++ )
+				{
+					stdout_buffer.append( timing.at( i ) );
+					stdout_buffer.push_back( L'\n' );
+				}
+				break;
+			}
+
+			case MEMORY:
+			{
+				memory_usage_t usage;
+				history_t::memory_usage( usage );
+				complete_memory_usage( usage );
+				function_memory_usage( usage );
+				env_memory_usage( usage );
+				usage.push_back( memory_usage_t::value_type( L"intern'd strings", intern_memory_usage() ) );
+				usage.push_back( memory_usage_t::value_type( L"io buffers", io_buffer_memory_usage() ) );
+
+				size_t total = 0;
+				for( size_t i=0; i<usage.size(); i++ )
+				{
+					append_format( stdout_buffer, L"%12lu %ls\n", (unsigned long)usage.at( i ).second, usage.at( i ).first.c_str() );
+					total += usage.at( i ).second;
+				}
+				append_format( stdout_buffer, L"%12lu %ls\n", (unsigned long)total, _( L"total" ) );
+				break;
+			}
+
+			case SYSCALLS:
+			{
+				const syscall_counts_t total = syscall_counts();
+				syscall_counts_t last_command, at_prompt;
+				reader_get_syscall_counts( last_command, at_prompt );
+
+				append_format( stdout_buffer, L"%-8ls %12ls %12ls %12ls\n", L"", _( L"total" ), _( L"command" ), _( L"prompt" ) );
+				for( int i=0; i<SYSCALL_COUNTER_COUNT; i++ )
+				{
+					append_format( stdout_buffer, L"%-8ls %12lu %12lu %12lu\n",
+								   syscall_counter_name( i ),
+								   total.count[i],
+								   last_command.count[i],
+								   at_prompt.count[i] );
+				}
+				break;
+			}
+
 			case NORMAL:
 			{
 				if( is_login )
@@ -3144,6 +3319,290 @@ static int builtin_bg( parser_t &parser, wchar_t **argv )
 }
 
 
+/**
+   Parses the option of the for builtin, which is the number of laps
+   that may run at once. Returns the number of arguments after argv[0]
+   that the option takes, or -1 if it is invalid.
+*/
+static int builtin_for_parse_jobs( wchar_t **argv, int *jobs )
+{
+	const wchar_t *arg = argv[1];
+	const wchar_t *num = 0;
+	int taken = 1;
+
+	if( !arg || arg[0] != L'-' )
+		return 0;
+
+	if( wcscmp( arg, L"-j" ) == 0 || wcscmp( arg, L"--jobs" ) == 0 )
+	{
+		num = argv[2];
+		taken = 2;
+	}
+	else if( wcsncmp( arg, L"-j", 2 ) == 0 )
+	{
+		num = arg+2;
+	}
+	else if( wcsncmp( arg, L"--jobs=", 7 ) == 0 )
+	{
+		num = arg+7;
+	}
+	else
+	{
+		append_format( stderr_buffer,
+					   BUILTIN_ERR_UNKNOWN,
+					   argv[0],
+					   arg );
+		return -1;
+	}
+
+	if( !num )
+	{
+		append_format( stderr_buffer,
+					   BUILTIN_ERR_MISSING,
+					   argv[0] );
+		return -1;
+	}
+
+	wchar_t *end;
+	errno = 0;
+	long val = wcstol( num, &end, 10 );
+	if( errno || !*num || *end || val < 1 || val > INT_MAX )
+	{
+		append_format( stderr_buffer,
+					   BUILTIN_FOR_ERR_JOBS,
+					   argv[0],
+					   num );
+		return -1;
+	}
+
+	*jobs = (int)val;
+	return taken;
+}
+
+/**
+   A lap of a parallel for loop, which runs in a process of its own
+*/
+struct for_lap_t
+{
+	/** The process running the lap */
+	pid_t pid;
+
+	/** Whether the process has been reaped */
+	bool done;
+
+	/** The pipes that the stdout and stderr of the lap are read from, or -1 once they are closed */
+	int fd[2];
+
+	/** What has been read from these pipes */
+	std::string output[2];
+
+	/** The exit status of the lap */
+	int status;
+};
+
+/**
+   Runs the laps of the parallel for loop in the current block, at most
+   for_jobs at once, each in a forked copy of fish that continues with
+   the body of the loop. The output of the laps is appended to the
+   output of the builtin in the order of the values, and so is only
+   written once every lap has finished. The status is that of the first
+   lap that failed, or 0.
+
+   Returns true in the forked process, which is set up to run its lap
+   when the end builtin returns. Returns false once the laps are done.
+*/
+static bool builtin_for_run_laps( parser_t &parser )
+{
+	block_t *b = parser.current_block;
+	wcstring_list_t &for_vars = b->state2<wcstring_list_t>();
+	const wcstring_list_t values( for_vars.rbegin(), for_vars.rend() );
+	for_vars.clear();
+
+	std::vector<for_lap_t> laps( values.size() );
+	size_t started = 0, running = 0;
+	bool stop = false;
+
+	/*
+	  The laps are waited for here, so the SIGCHLD handler must not
+	  reap them first
+	*/
+	sigset_t chldset, oldset;
+	sigemptyset( &chldset );
+	sigaddset( &chldset, SIGCHLD );
+	sigprocmask( SIG_BLOCK, &chldset, &oldset );
+
+	while( running || ( !stop && started < laps.size() ) )
+	{
+		/*
+		  A cancelled loop, e.g. by ^C, doesn't start more laps
+		*/
+		stop = stop || b->outer->skip;
+
+		while( !stop && running < (size_t)b->for_jobs && started < laps.size() )
+		{
+			int out[2], err[2];
+			if( exec_pipe( out ) == -1 )
+			{
+				stop = true;
+				break;
+			}
+			if( exec_pipe( err ) == -1 )
+			{
+				exec_close( out[0] );
+				exec_close( out[1] );
+				stop = true;
+				break;
+			}
+
+			fflush( stdout );
+			pid_t pid = execute_fork( true );
+			if( pid == 0 )
+			{
+				/*
+				  This process carries on as a shell of its own
+				*/
+				setup_fork_guards();
+				
+				for( size_t i=0; i<started; i++ )
+				{
+					for( int k=0; k<2; k++ )
+					{
+						if( laps.at( i ).fd[k] != -1 )
+							exec_close( laps.at( i ).fd[k] );
+					}
+				}
+				exec_close( out[0] );
+				exec_close( err[0] );
+				dup2( out[1], 1 );
+				dup2( err[1], 2 );
+				exec_close( out[1] );
+				exec_close( err[1] );
+
+				proc_push_interactive( 0 );
+				sigprocmask( SIG_SETMASK, &oldset, 0 );
+
+				/*
+				  The lap reads the input of the loop, but its output
+				  goes to the pipes, not to where the output of the
+				  loop goes
+				*/
+				io_data_t *in = io_get( parser.block_io, 0 );
+				if( in )
+				{
+					in = new io_data_t( *in );
+					in->next = 0;
+				}
+				parser.block_io = in;
+
+				b->for_lap = true;
+				b->skip = 0;
+				b->loop_status = LOOP_NORMAL;
+				env_set( b->state1<wcstring>().c_str(), values.at( started ).c_str(), ENV_LOCAL );
+				parser.set_pos( b->tok_pos );
+				return true;
+			}
+
+			exec_close( out[1] );
+			exec_close( err[1] );
+
+			for_lap_t &lap = laps.at( started );
+			lap.pid = pid;
+			lap.done = false;
+			lap.fd[0] = out[0];
+			lap.fd[1] = err[0];
+			lap.status = 0;
+			started++;
+			running++;
+		}
+
+		if( !running )
+			break;
+
+		fd_set fds;
+		int max_fd = -1;
+		FD_ZERO( &fds );
+		for( size_t i=0; i<started; i++ )
+		{
+			for( int k=0; k<2; k++ )
+			{
+				int fd = laps.at( i ).fd[k];
+				if( fd != -1 )
+				{
+					FD_SET( fd, &fds );
+					max_fd = maxi( max_fd, fd );
+				}
+			}
+		}
+
+		if( max_fd != -1 && select( max_fd+1, &fds, 0, 0, 0 ) == -1 )
+		{
+			if( errno != EINTR )
+			{
+				wperror( L"select" );
+				FD_ZERO( &fds );
+			}
+			else
+			{
+				continue;
+			}
+		}
+
+		for( size_t i=0; i<started; i++ )
+		{
+			for_lap_t &lap = laps.at( i );
+			if( lap.done )
+				continue;
+
+			for( int k=0; k<2; k++ )
+			{
+				if( lap.fd[k] == -1 || !FD_ISSET( lap.fd[k], &fds ) )
+					continue;
+
+				char buff[4096];
+				ssize_t len = read( lap.fd[k], buff, sizeof buff );
+				if( len > 0 )
+				{
+					lap.output[k].append( buff, len );
+				}
+				else if( len == 0 || errno != EINTR )
+				{
+					exec_close( lap.fd[k] );
+					lap.fd[k] = -1;
+				}
+			}
+
+			/*
+			  Once a lap has closed its output it has exited, or
+			  is about to
+			*/
+			if( lap.fd[0] == -1 && lap.fd[1] == -1 )
+			{
+				int status;
+				while( waitpid( lap.pid, &status, 0 ) == -1 && errno == EINTR )
+				{
+				}
+				lap.status = WIFSIGNALED( status ) ? 128+WTERMSIG( status ) : WEXITSTATUS( status );
+				lap.done = true;
+				running--;
+			}
+		}
+	}
+
+	sigprocmask( SIG_SETMASK, &oldset, 0 );
+
+	int res = 0;
+	for( size_t i=0; i<started; i++ )
+	{
+		const for_lap_t &lap = laps.at( i );
+		stdout_buffer.append( str2wcstring( lap.output[0].data(), lap.output[0].size() ) );
+		stderr_buffer.append( str2wcstring( lap.output[1].data(), lap.output[1].size() ) );
+		if( !res )
+			res = lap.status;
+	}
+	proc_set_last_status( res );
+	return false;
+}
+
 /**
    Builtin for looping over a list
 */
@@ -3151,9 +3610,17 @@ static int builtin_for( parser_t &parser, wchar_t **argv )
 {
 	int argc = builtin_count_args( argv );
 	int res=STATUS_BUILTIN_ERROR;
+	int jobs = 0;
 
+	int taken = builtin_for_parse_jobs( argv, &jobs );
+	wchar_t **args = argv + maxi( taken, 0 );
+	argc -= maxi( taken, 0 );
 
-	if( argc < 3)
+	if( taken < 0 )
+	{
+		builtin_print_help( parser, argv[0], stderr_buffer );
+	}
+	else if( argc < 3)
 	{
 		append_format(stderr_buffer,
 				   BUILTIN_FOR_ERR_COUNT,
@@ -3161,15 +3628,15 @@ static int builtin_for( parser_t &parser, wchar_t **argv )
 				   argc );
 		builtin_print_help( parser, argv[0], stderr_buffer );
 	}
-	else if ( wcsvarname(argv[1]) )
+	else if ( wcsvarname(args[1]) )
 	{
 		append_format(stderr_buffer,
 				   BUILTIN_FOR_ERR_NAME,
 				   argv[0],
-				   argv[1] );
+				   args[1] );
 		builtin_print_help( parser, argv[0], stderr_buffer );
 	}
-	else if (wcscmp( argv[2], L"in") != 0 )
+	else if (wcscmp( args[2], L"in") != 0 )
 	{
 		append_format(stderr_buffer,
 				   BUILTIN_FOR_ERR_IN,
@@ -3191,20 +3658,27 @@ static int builtin_for( parser_t &parser, wchar_t **argv )
 		parser.push_block( FOR );
 
 		int i;
-        const wcstring for_variable = argv[1];
+        const wcstring for_variable = args[1];
 		parser.current_block->tok_pos = parser.get_pos();
         parser.current_block->state1<wcstring>() = for_variable;
+		parser.current_block->for_jobs = jobs;
 
         wcstring_list_t &for_vars = parser.current_block->state2<wcstring_list_t>();
 		for( i=argc-1; i>3; i-- )
-            for_vars.push_back(argv[i]);
+            for_vars.push_back(args[i]);
 
-		if( argc > 3 )
+		/*
+		  The laps of a parallel loop are all started by the end
+		  builtin, so the body is skipped until then
+		*/
+		if( argc > 3 && !jobs )
 		{
-			env_set( for_variable.c_str(), argv[3], ENV_LOCAL );
+			env_set( for_variable.c_str(), args[3], ENV_LOCAL );
 		}
 		else
 		{
+			if( argc > 3 )
+				for_vars.push_back(args[3]);
 			parser.current_block->skip=1;
 		}
 	}
@@ -3278,6 +3752,20 @@ static int builtin_end( parser_t &parser, wchar_t **argv )
 
 			case FOR:
 			{
+				/*
+				  A parallel loop gets here once to run all of its
+				  laps, and then once in the process of every lap,
+				  which exits when the block is popped.
+				*/
+				if( parser.current_block->for_jobs )
+				{
+					if( !parser.current_block->for_lap && builtin_for_run_laps( parser ) )
+					{
+						kill_block = 0;
+					}
+					break;
+				}
+
 				/*
 				  set loop variable to next element, and rewind to the beginning of the block.
 				*/
@@ -3310,17 +3798,15 @@ static int builtin_end( parser_t &parser, wchar_t **argv )
 				if( d )
 				{
 					/**
-					   Copy the text from the beginning of the function
-					   until the end command and use as the new definition
-					   for the specified function
+					   Use the text from the beginning of the function
+					   until the end command as the new definition for
+					   the specified function
 					*/
 
-					wchar_t *def = wcsndup( parser.get_buffer()+parser.current_block->tok_pos,
-											parser.get_job_pos()-parser.current_block->tok_pos );
-					d->definition = def;
+					d->definition = parser.get_buffer()+parser.current_block->tok_pos;
+					d->definition_length = parser.get_job_pos()-parser.current_block->tok_pos;
 		
-					function_add( *d, parser );	
-					free( def );
+					function_add( *d, parser );
 				}
 				else
 				{
@@ -3600,6 +4086,7 @@ static int builtin_history( parser_t &parser, wchar_t **argv )
     bool search_history = false; 
     bool delete_item = false;
     bool search_prefix = false;
+    bool search_fuzzy = false;
     bool save_history = false;
     bool clear_history = false;
 
@@ -3612,6 +4099,7 @@ static int builtin_history( parser_t &parser, wchar_t **argv )
             { L"delete", required_argument, 0, 'd' },
             { L"search", no_argument, 0, 's' },
             { L"contains", required_argument, 0, 'c' },
+            { L"fuzzy", required_argument, 0, 'f' },
             { L"save", no_argument, 0, 'v' },
             { L"clear", no_argument, 0, 'l' },
             { 0, 0, 0, 0 }
@@ -3622,7 +4110,7 @@ static int builtin_history( parser_t &parser, wchar_t **argv )
     woptind = 0;
     history_t *history = reader_get_history();
 
-    while((opt = wgetopt_long_only( argc, argv, L"pdscvl", long_options, &opt_index )) != -1)
+    while((opt = wgetopt_long_only( argc, argv, L"pdscfvl", long_options, &opt_index )) != -1)
     {
         switch(opt)
         {
@@ -3640,6 +4128,10 @@ static int builtin_history( parser_t &parser, wchar_t **argv )
            case 'c':
                 search_string = woptarg;
                 break;
+           case 'f':
+                search_fuzzy = true;
+                search_string = woptarg;
+                break;
            case 'v':
                 save_history = true;
                 break;
@@ -3671,11 +4163,17 @@ static int builtin_history( parser_t &parser, wchar_t **argv )
 
         if (search_string.empty())
         {
-            append_format(stderr_buffer, BUILTIN_ERR_COMBO2, argv[0], L"Use --search with either --contains or --prefix");
+            append_format(stderr_buffer, BUILTIN_ERR_COMBO2, argv[0], L"Use --search with either --contains, --prefix or --fuzzy");
             return res;
         }
 
-        history_search_t searcher = history_search_t(*history, search_string, search_prefix?HISTORY_SEARCH_TYPE_PREFIX:HISTORY_SEARCH_TYPE_CONTAINS);
+        enum history_search_type_t search_type = HISTORY_SEARCH_TYPE_CONTAINS;
+        if (search_prefix)
+            search_type = HISTORY_SEARCH_TYPE_PREFIX;
+        else if (search_fuzzy)
+            search_type = HISTORY_SEARCH_TYPE_FUZZY;
+
+        history_search_t searcher = history_search_t(*history, search_string, search_type);
         while (searcher.go_backwards())
         {
             stdout_buffer.append(searcher.current_string());
@@ -3711,6 +4209,230 @@ static int builtin_history( parser_t &parser, wchar_t **argv )
 }
 
 
+/**
+   The hash builtin, used for inspecting and resetting the cache of
+   command locations in $PATH.
+*/
+static int builtin_hash( parser_t &parser, wchar_t **argv )
+{
+	int argc = builtin_count_args( argv );
+	bool reset = false;
+
+	static const struct woption long_options[] =
+		{
+			{ L"reset", no_argument, 0, 'r' },
+			{ L"help", no_argument, 0, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+	woptind = 0;
+	while( 1 )
+	{
+		int opt_index = 0;
+		int opt = wgetopt_long( argc, argv, L"rh", long_options, &opt_index );
+		if( opt == -1 )
+			break;
+
+		switch( opt )
+		{
+			case 'r':
+				reset = true;
+				break;
+
+			case 'h':
+				builtin_print_help( parser, argv[0], stdout_buffer );
+				return STATUS_BUILTIN_OK;
+
+			case '?':
+				builtin_unknown_option( parser, argv[0], argv[woptind-1] );
+				return STATUS_BUILTIN_ERROR;
+		}
+	}
+
+	if( reset )
+	{
+		path_clear_command_cache();
+	}
+
+	/* Look up the named commands, which caches them */
+	int res = STATUS_BUILTIN_OK;
+	for( int i=woptind; i<argc; i++ )
+	{
+		wchar_t *path = path_get_path( argv[i] );
+		if( path )
+		{
+			free( path );
+		}
+		else
+		{
+			append_format( stderr_buffer, _( L"%ls: Command '%ls' not found\n" ), argv[0], argv[i] );
+			res = STATUS_BUILTIN_ERROR;
+		}
+	}
+
+	if( ! reset && woptind == argc )
+	{
+		std::vector<path_cached_command_t> commands;
+		path_get_cached_commands( commands );
+		for( size_t i=0; i < commands.size(); i++ )
+		{
+			const path_cached_command_t &command = commands.at(i);
+			append_format( stdout_buffer, L"%lu\t%ls\n", command.hits, command.path.c_str() );
+		}
+	}
+	return res;
+}
+
+/**
+   The profile builtin, used for starting and stopping the profiler at
+   runtime and for printing what it has recorded.
+*/
+static int builtin_profile( parser_t &parser, wchar_t **argv )
+{
+	int argc = builtin_count_args( argv );
+
+	enum
+	{
+		PROFILE_DEFAULT,
+		PROFILE_REPORT,
+		PROFILE_FOLDED,
+		PROFILE_RECENT,
+		PROFILE_TRACE,
+		PROFILE_NONE
+	}
+	;
+
+	int output = PROFILE_DEFAULT;
+	bool start = false, stop = false, reset = false, trace = false;
+
+	static const struct woption long_options[] =
+		{
+			{ L"start", no_argument, 0, 's' },
+			{ L"stop", no_argument, 0, 'S' },
+			{ L"reset", no_argument, 0, 'r' },
+			{ L"folded", no_argument, 0, 'f' },
+			{ L"recent", no_argument, 0, 'R' },
+			{ L"trace", no_argument, 0, 't' },
+			{ L"help", no_argument, 0, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+	woptind = 0;
+	while( 1 )
+	{
+		int opt_index = 0;
+		int opt = wgetopt_long( argc, argv, L"sSrfRth", long_options, &opt_index );
+		if( opt == -1 )
+			break;
+
+		switch( opt )
+		{
+			case 's':
+				start = true;
+				break;
+
+			case 'S':
+				stop = true;
+				break;
+
+			case 'r':
+				reset = true;
+				break;
+
+			case 'f':
+				output = PROFILE_FOLDED;
+				break;
+
+			case 'R':
+				output = PROFILE_RECENT;
+				break;
+
+			case 't':
+				trace = true;
+				break;
+
+			case 'h':
+				builtin_print_help( parser, argv[0], stdout_buffer );
+				return STATUS_BUILTIN_OK;
+
+			case '?':
+				builtin_unknown_option( parser, argv[0], argv[woptind-1] );
+				return STATUS_BUILTIN_ERROR;
+		}
+	}
+
+	if( woptind != argc )
+	{
+		append_format( stderr_buffer, BUILTIN_ERR_TOO_MANY_ARGUMENTS, argv[0] );
+		builtin_print_help( parser, argv[0], stderr_buffer );
+		return STATUS_BUILTIN_ERROR;
+	}
+
+	if( start && stop )
+	{
+		append_format( stderr_buffer, BUILTIN_ERR_COMBO2, argv[0], L"--start and --stop can not be used together" );
+		return STATUS_BUILTIN_ERROR;
+	}
+
+	if( trace )
+	{
+		if( output != PROFILE_DEFAULT )
+		{
+			append_format( stderr_buffer, BUILTIN_ERR_COMBO2, argv[0], L"--trace can not be used with --folded or --recent" );
+			return STATUS_BUILTIN_ERROR;
+		}
+
+		if( ! trace_is_supported() )
+		{
+			append_format( stderr_buffer, _( L"%ls: This fish was built without trace points\n" ), argv[0] );
+			return STATUS_BUILTIN_ERROR;
+		}
+
+		/* With --trace, the other switches control the trace points instead of the profiler */
+		if( ! ( start || stop || reset ) )
+		{
+			trace_write_json( stdout_buffer );
+		}
+		if( reset )
+			trace_reset();
+		if( start )
+			trace_set_enabled( true );
+		if( stop )
+			trace_set_enabled( false );
+
+		return STATUS_BUILTIN_OK;
+	}
+
+	/* The switches that control the profiler print nothing unless asked to */
+	if( output == PROFILE_DEFAULT )
+		output = ( start || stop || reset ) ? PROFILE_NONE : PROFILE_REPORT;
+
+	switch( output )
+	{
+		case PROFILE_REPORT:
+			profiler_write_report( stdout_buffer );
+			break;
+
+		case PROFILE_FOLDED:
+			profiler_write_folded( stdout_buffer );
+			break;
+
+		case PROFILE_RECENT:
+			profiler_write_recent( stdout_buffer );
+			break;
+	}
+
+	if( reset )
+		profiler_reset();
+	if( start )
+		profiler_set_enabled( true );
+	if( stop )
+		profiler_set_enabled( false );
+
+	return STATUS_BUILTIN_OK;
+}
+
+
 /*
   END OF BUILTIN COMMANDS
   Below are functions for handling the builtin commands.
@@ -3750,16 +4472,21 @@ static const builtin_data_t builtin_datas[]=
 	{ 		L"for",  &builtin_for, N_( L"Perform a set of commands multiple times" )   },
 	{ 		L"function",  &builtin_function, N_( L"Define a new function" )   },
 	{ 		L"functions",  &builtin_functions, N_( L"List or remove functions" )   },
+	{ 		L"hash",  &builtin_hash, N_( L"Show or reset the cache of command locations" )   },
 	{ 		L"history",  &builtin_history, N_( L"History of commands executed by user" )   },
  	{ 		L"if",  &builtin_generic, N_( L"Evaluate block if condition is true" )   },
 	{ 		L"jobs",  &builtin_jobs, N_( L"Print currently running jobs" )   },
+	{ 		L"math",  &builtin_math, N_( L"Perform mathematics calculations" )   },
 	{ 		L"not",  &builtin_generic, N_( L"Negate exit status of job" )  },
 	{ 		L"or",  &builtin_generic, N_( L"Execute command if previous command failed" )  },
+	{ 		L"profile",  &builtin_profile, N_( L"Measure how long commands and functions take" )  },
     { 		L"pwd",  &builtin_pwd, N_( L"Print the working directory" )  },
 	{ 		L"random",  &builtin_random, N_( L"Generate random number" )  },
 	{ 		L"read",  &builtin_read, N_( L"Read a line of input into variables" )   },
 	{ 		L"return",  &builtin_return, N_( L"Stop the currently evaluated function" )   },
+	{ 		L"seq",  &builtin_seq, N_( L"Print sequences of numbers" )   },
 	{ 		L"set",  &builtin_set, N_( L"Handle environment variables" )   },
+	{ 		L"set_color",  &builtin_set_color, N_( L"Set the terminal color" )   },
 	{ 		L"status",  &builtin_status, N_( L"Return status information about fish" )  },
 	{ 		L"switch",  &builtin_switch, N_( L"Conditionally execute a block of commands" )   },
     { 		L"test",  &builtin_test, N_( L"Test a condition" )   },
@@ -73,6 +73,11 @@ enum
 
 #define BUILTIN_FOR_ERR_NAME _( L"%ls: '%ls' is not a valid variable name\n" )
 
+/**
+   Error message for an invalid number of jobs of a parallel for loop
+*/
+#define BUILTIN_FOR_ERR_JOBS _( L"%ls: '%ls' is not a valid number of jobs\n" )
+
 /**
    Error message when too many arguments are supplied to a builtin
 */
@@ -167,6 +172,14 @@ wcstring builtin_get_desc( const wcstring &b );
 */
 const wchar_t *builtin_complete_get_temporary_buffer();
 
+/**
+   Computes the completions of the commandline cmd the way 'complete
+   -C' does, as if cmd was the contents of the commandline. Unlike the
+   completions that complete() returns, these are always the whole new
+   token, and not just what is to be appended to it.
+*/
+void builtin_complete_do_complete( const wcstring &cmd, std::vector<completion_t> &out );
+
 
 /**
    Run the __fish_print_help function to obtain the help information
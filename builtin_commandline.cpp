@@ -26,6 +26,7 @@ Functions used for implementing the commandline builtin.
 #include "tokenizer.h"
 #include "input_common.h"
 #include "input.h"
+#include "complete.h"
 
 #include "parse_util.h"
 
@@ -526,6 +527,15 @@ static int builtin_commandline( parser_t &parser, wchar_t **argv )
 		buffer_part = STRING_MODE;
 	}
 
+	/*
+	  Only the tokens before the one under the cursor are the same for
+	  all the completions that completion conditions are kept for
+	*/
+	if( !( tokenize && cut_at_cursor ) )
+	{
+		complete_condition_reads_token();
+	}
+
 	if( cursor_mode )
 	{
 		if( argc-woptind )
@@ -277,6 +277,30 @@ const wchar_t *builtin_complete_get_temporary_buffer()
 	return temporary_buffer;
 }
 
+void builtin_complete_do_complete( const wcstring &cmd, std::vector<completion_t> &out )
+{
+	const wchar_t *token;
+
+	parse_util_token_extent( cmd.c_str(), cmd.size(), &token, 0, 0, 0 );
+
+	const wchar_t *prev_temporary_buffer = temporary_buffer;
+	temporary_buffer = cmd.c_str();
+
+	complete_forget_conditions();
+	complete( cmd, out, COMPLETE_DEFAULT );
+
+	/* Completions that don't replace the token only hold what comes after it */
+	const wcstring prepend = token;
+	for( size_t i=0; i< out.size() ; i++ )
+	{
+		completion_t &next = out.at( i );
+		if( !( next.flags & COMPLETE_NO_CASE ) )
+			next.completion.insert( 0, prepend );
+	}
+
+	temporary_buffer = prev_temporary_buffer;
+}
+
 /**
    The complete builtin. Used for specifying programmable
    tab-completions. Calls the functions in complete.c for any heavy
@@ -294,7 +318,7 @@ static int builtin_complete( parser_t &parser, wchar_t **argv )
 	
 	wcstring short_opt;
 	wcstring_list_t gnu_opt, old_opt;
-	const wchar_t *comp=L"", *desc=L"", *condition=L"";
+	const wchar_t *comp=L"", *desc=L"", *condition=L"", *lazy=0;
 
     bool do_complete = false;
     wcstring do_complete_param;
@@ -373,6 +397,10 @@ static int builtin_complete( parser_t &parser, wchar_t **argv )
 					L"do-complete", optional_argument, 0, 'C'
 				}
 				,
+				{
+					L"lazy", required_argument, 0, 'L'
+				}
+				,
 				{
 					L"help", no_argument, 0, 'h'
 				}
@@ -387,7 +415,7 @@ static int builtin_complete( parser_t &parser, wchar_t **argv )
 		
 		int opt = wgetopt_long( argc,
 								argv, 
-								L"a:c:p:s:l:o:d:frxeuAn:C::h", 
+								L"a:c:p:s:l:o:d:frxeuAn:C::L:h", 
 								long_options, 
 								&opt_index );
 		if( opt == -1 )
@@ -477,7 +505,16 @@ static int builtin_complete( parser_t &parser, wchar_t **argv )
 				
 			case 'C':
                 do_complete = true;
-				do_complete_param = woptarg ? woptarg : reader_get_buffer();
+				{
+					/* Without a reader there is no buffer to complete */
+					const wchar_t *param = woptarg ? woptarg : reader_get_buffer();
+					if( param )
+						do_complete_param = param;
+				}
+				break;
+				
+			case 'L':
+				lazy = woptarg;
 				break;
 				
 			case 'h':
@@ -529,55 +566,53 @@ static int builtin_complete( parser_t &parser, wchar_t **argv )
 		}
 	}
 
+	if( !res && lazy && !remove )
+	{
+		if( !short_opt.empty() || !gnu_opt.empty() || !old_opt.empty() || wcslen( comp ) || wcslen( desc ) )
+		{
+			append_format(stderr_buffer,
+					   _( L"%ls: A lazy section can not have options, arguments or a description of its own\n" ),
+					   argv[0] );
+			res = true;
+		}
+		else if( parser.test( lazy, 0, 0, 0 ) )
+		{
+			append_format(stderr_buffer,
+					   L"%ls: Lazy section '%ls' contained a syntax error\n", 
+					   argv[0],
+					   lazy );
+			
+			parser.test( lazy, 0, &stderr_buffer, argv[0] );
+			
+			res = true;
+		}
+	}
+
 	if( !res )
 	{
 		if( do_complete )
 		{
-			const wchar_t *token;
-
-			parse_util_token_extent( do_complete_param.c_str(), do_complete_param.size(), &token, 0, 0, 0 );
-						
-			const wchar_t *prev_temporary_buffer = temporary_buffer;
-			temporary_buffer = do_complete_param.c_str();
-
 			if( recursion_level < 1 )
 			{
 				recursion_level++;
-                
-                std::vector<completion_t> comp;
-				complete( do_complete_param, comp, COMPLETE_DEFAULT );
-			
+				std::vector<completion_t> comp;
+				builtin_complete_do_complete( do_complete_param, comp );
+
 				for( size_t i=0; i< comp.size() ; i++ )
 				{
 					const completion_t &next =  comp.at( i );
 
-					const wchar_t *prepend;
-					
-					if( next.flags & COMPLETE_NO_CASE )
-					{
-						prepend = L"";
-					}
-					else
-					{
-						prepend = token;
-					}
-						
-
 					if( !(next.description).empty() )
 					{
-						append_format(stdout_buffer, L"%ls%ls\t%ls\n", prepend, next.completion.c_str(), next.description.c_str() );
+						append_format(stdout_buffer, L"%ls\t%ls\n", next.completion.c_str(), next.description.c_str() );
 					}
 					else
 					{
-						append_format(stdout_buffer, L"%ls%ls\n", prepend, next.completion.c_str() );
+						append_format(stdout_buffer, L"%ls\n", next.completion.c_str() );
 					}
 				}
-			
 				recursion_level--;
 			}
-		
-			temporary_buffer = prev_temporary_buffer;		
-		
 		}
 		else if( woptind != argc )
 		{
@@ -604,6 +639,17 @@ static int builtin_complete( parser_t &parser, wchar_t **argv )
 										 gnu_opt,
 										 old_opt );									 
 			}
+			else if( lazy )
+			{
+				for( size_t i=0; i<cmd.size(); i++ )
+				{
+					complete_add_lazy( cmd.at(i).c_str(), COMMAND, condition, lazy );
+				}
+				for( size_t i=0; i<path.size(); i++ )
+				{
+					complete_add_lazy( path.at(i).c_str(), PATH, condition, lazy );
+				}
+			}
 			else
 			{
 				builtin_complete_add( cmd, 
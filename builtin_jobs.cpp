@@ -41,30 +41,35 @@ enum
 
 #ifdef HAVE__PROC_SELF_STAT
 /**
-   Calculates the cpu usage (in percent) of the specified job.
+   Calculates the cpu usage (in percent) of the specified job since it
+   was last calculated, or since the job started. The processes are
+   only looked at here rather than after every command, so that having
+   lots of background jobs doesn't slow everything else down.
 */
 static int cpu_use( const job_t *j )
 {
 	double u=0;
 	process_t *p;
+	struct timeval t;
+	gettimeofday( &t, 0 );
 
 	for( p=j->first_process; p; p=p->next )
 	{
-		struct timeval t;
-		int jiffies;
-		gettimeofday( &t, 0 );
-		jiffies = proc_get_jiffies( p );
+		if( p->pid <= 0 )
+			continue;
+
+		unsigned long long cpu_time = proc_get_cpu_time( p );
 
 		double t1 = 1000000.0*p->last_time.tv_sec+p->last_time.tv_usec;
 		double t2 = 1000000.0*t.tv_sec+t.tv_usec;
 
-/*		fwprintf( stderr, L"t1 %f t2 %f p1 %d p2 %d\n",
-  t1, t2, jiffies, p->last_jiffies );
-*/
+		if( t2 > t1 && cpu_time >= p->last_cpu_time )
+			u += ((double)(cpu_time-p->last_cpu_time))/(t2-t1);
 
-		u += ((double)(jiffies-p->last_jiffies))/(t2-t1);
+		p->last_time = t;
+		p->last_cpu_time = cpu_time;
 	}
-	return u*1000000;
+	return u*100;
 }
 #endif
 
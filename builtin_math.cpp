@@ -0,0 +1,381 @@
+/** \file builtin_math.cpp Functions defining the math and seq builtins
+
+Functions used for implementing the math and seq builtins. Both only
+handle the common case of integer arithmetic themselves, which is what
+loop counters in scripts need, and hand everything else to the bc and
+seq commands, so that their output does not change.
+
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "builtin.h"
+#include "common.h"
+#include "exec.h"
+
+/**
+   Adds two numbers. Returns false on overflow.
+*/
+static bool math_add( long long a, long long b, long long *out )
+{
+	if( ( b > 0 && a > LLONG_MAX - b ) || ( b < 0 && a < LLONG_MIN - b ) )
+		return false;
+	*out = a + b;
+	return true;
+}
+
+/**
+   Multiplies two numbers. Returns false on overflow.
+*/
+static bool math_multiply( long long a, long long b, long long *out )
+{
+	if( a > 0 )
+	{
+		if( b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a )
+			return false;
+	}
+	else if( a < 0 )
+	{
+		if( b > 0 ? a < LLONG_MIN / b : b < LLONG_MAX / a )
+			return false;
+	}
+	*out = a * b;
+	return true;
+}
+
+/**
+   A parser for integer expressions in the syntax of bc. It fails on
+   anything it doesn't understand, like variables, fractions and
+   division by zero, as well as on overflow, since bc then has to do
+   the work.
+*/
+class math_parser_t
+{
+	const wchar_t *pos;
+
+	void skip_spaces()
+	{
+		while( *pos == L' ' || *pos == L'\t' )
+			pos++;
+	}
+
+	/** Parses a number or a parenthesized expression */
+	bool parse_primary( long long *out )
+	{
+		skip_spaces();
+		if( *pos == L'(' )
+		{
+			pos++;
+			if( ! parse_sum( out ) )
+				return false;
+			skip_spaces();
+			if( *pos != L')' )
+				return false;
+			pos++;
+			return true;
+		}
+
+		if( ! iswdigit( *pos ) )
+			return false;
+
+		long long res = 0;
+		while( iswdigit( *pos ) )
+		{
+			if( ! math_multiply( res, 10, &res ) || ! math_add( res, *pos - L'0', &res ) )
+				return false;
+			pos++;
+		}
+
+		/* Fractions are bc's business */
+		if( *pos == L'.' )
+			return false;
+		*out = res;
+		return true;
+	}
+
+	/** Parses a negation, which binds tighter than anything else in bc */
+	bool parse_unary( long long *out )
+	{
+		skip_spaces();
+		if( *pos == L'-' )
+		{
+			pos++;
+			return parse_unary( out ) && math_multiply( *out, -1, out );
+		}
+		return parse_primary( out );
+	}
+
+	/** Parses an exponentiation, which is right associative */
+	bool parse_power( long long *out )
+	{
+		long long base, exponent;
+		if( ! parse_unary( &base ) )
+			return false;
+
+		skip_spaces();
+		if( *pos != L'^' )
+		{
+			*out = base;
+			return true;
+		}
+		pos++;
+
+		/* Negative exponents give fractions */
+		if( ! parse_power( &exponent ) || exponent < 0 )
+			return false;
+
+		long long res = 1;
+		while( exponent > 0 )
+		{
+			if( exponent & 1 )
+			{
+				if( ! math_multiply( res, base, &res ) )
+					return false;
+			}
+			exponent >>= 1;
+			if( exponent > 0 && ! math_multiply( base, base, &base ) )
+				return false;
+		}
+		*out = res;
+		return true;
+	}
+
+	/** Parses a product, quotient or remainder */
+	bool parse_product( long long *out )
+	{
+		if( ! parse_power( out ) )
+			return false;
+
+		while( 1 )
+		{
+			skip_spaces();
+			wchar_t op = *pos;
+			if( op != L'*' && op != L'/' && op != L'%' )
+				return true;
+			pos++;
+
+			long long rhs;
+			if( ! parse_power( &rhs ) )
+				return false;
+
+			if( op == L'*' )
+			{
+				if( ! math_multiply( *out, rhs, out ) )
+					return false;
+			}
+			else
+			{
+				if( rhs == 0 || ( *out == LLONG_MIN && rhs == -1 ) )
+					return false;
+				*out = ( op == L'/' ) ? *out / rhs : *out % rhs;
+			}
+		}
+	}
+
+	/** Parses a sum or difference */
+	bool parse_sum( long long *out )
+	{
+		if( ! parse_product( out ) )
+			return false;
+
+		while( 1 )
+		{
+			skip_spaces();
+			wchar_t op = *pos;
+			if( op != L'+' && op != L'-' )
+				return true;
+			pos++;
+
+			long long rhs;
+			if( ! parse_product( &rhs ) )
+				return false;
+			if( op == L'-' && ! math_multiply( rhs, -1, &rhs ) )
+				return false;
+			if( ! math_add( *out, rhs, out ) )
+				return false;
+		}
+	}
+
+	public:
+
+	math_parser_t( const wchar_t *str ) : pos( str ) { }
+
+	/** Evaluates the whole expression. Returns false if it has to be left to bc. */
+	bool evaluate( long long *out )
+	{
+		/* These are increment and decrement operators in bc, not two signs */
+		if( wcsstr( pos, L"--" ) || wcsstr( pos, L"++" ) )
+			return false;
+		if( ! parse_sum( out ) )
+			return false;
+		skip_spaces();
+		return *pos == L'\0';
+	}
+};
+
+/**
+   Runs a command with the specified arguments, which are escaped so
+   that they reach it unchanged, and returns its output lines in lst.
+   Returns the exit status of the command.
+*/
+static int math_run_command( const wcstring &cmd, wchar_t **argv, const wcstring &suffix, wcstring_list_t &lst )
+{
+	wcstring str = cmd;
+	for( size_t i=0; argv[i]; i++ )
+	{
+		str.push_back( L' ' );
+		str.append( escape_string( argv[i], 1 ) );
+	}
+	str.append( suffix );
+
+	int status = exec_subshell( str, lst );
+	if( status == -1 )
+	{
+		lst.clear();
+		status = STATUS_BUILTIN_ERROR;
+	}
+	return status;
+}
+
+/**
+   The math builtin. Evaluates integer expressions itself and passes
+   anything else on to bc.
+*/
+static int builtin_math( parser_t &parser, wchar_t **argv )
+{
+	int argc = builtin_count_args( argv );
+	if( argc < 2 )
+		return 2;
+
+	const wchar_t *first = argv[1];
+	if( ! wcscmp( first, L"-h" ) || ! wcscmp( first, L"--h" ) || ! wcscmp( first, L"--he" ) || ! wcscmp( first, L"--hel" ) || ! wcscmp( first, L"--help" ) )
+	{
+		builtin_print_help( parser, argv[0], stdout_buffer );
+		return 0;
+	}
+
+	wcstring expression;
+	for( int i=1; i<argc; i++ )
+	{
+		if( i > 1 )
+			expression.push_back( L' ' );
+		expression.append( argv[i] );
+	}
+
+	long long res;
+	math_parser_t math_parser( expression.c_str() );
+	if( math_parser.evaluate( &res ) )
+	{
+		append_format( stdout_buffer, L"%lld\n", res );
+		return res == 0 ? 1 : 0;
+	}
+
+	/* Let bc do it, and print its output all on one line, like the math function used to */
+	wcstring_list_t lst;
+	math_run_command( L"echo", argv + 1, L" | bc", lst );
+
+	for( size_t i=0; i<lst.size(); i++ )
+	{
+		if( i > 0 )
+			stdout_buffer.push_back( L' ' );
+		stdout_buffer.append( lst.at( i ) );
+	}
+	stdout_buffer.push_back( L'\n' );
+	return ( lst.size() == 1 && lst.at( 0 ) == L"0" ) ? 1 : 0;
+}
+
+/**
+   Parses an integer argument to seq. Returns false if it is anything
+   else, which includes options.
+*/
+static bool seq_parse_integer( const wchar_t *str, long long *out )
+{
+	const wchar_t *pos = str;
+	if( *pos == L'-' || *pos == L'+' )
+		pos++;
+	if( ! iswdigit( *pos ) )
+		return false;
+	for( ; *pos; pos++ )
+	{
+		if( ! iswdigit( *pos ) )
+			return false;
+	}
+
+	wchar_t *end;
+	errno = 0;
+	long long res = wcstoll( str, &end, 10 );
+	if( errno || *end )
+		return false;
+
+	/* seq prints a negative zero as such */
+	if( res == 0 && *str == L'-' )
+		return false;
+	*out = res;
+	return true;
+}
+
+/**
+   The seq builtin. Prints sequences of integers itself and passes
+   anything else, like fractions and options, on to the seq command.
+*/
+static int builtin_seq( parser_t &parser, wchar_t **argv )
+{
+	int argc = builtin_count_args( argv );
+	long long from = 1, step = 1, to = 1;
+	bool ok = argc >= 2 && argc <= 4;
+
+	if( ok )
+	{
+		long long *nums[3];
+		switch( argc )
+		{
+			case 2:
+				nums[0] = &to;
+				break;
+			case 3:
+				nums[0] = &from;
+				nums[1] = &to;
+				break;
+			default:
+				nums[0] = &from;
+				nums[1] = &step;
+				nums[2] = &to;
+				break;
+		}
+		for( int i=1; ok && i<argc; i++ )
+		{
+			ok = seq_parse_integer( argv[i], nums[i-1] );
+		}
+	}
+
+	if( ! ok || step == 0 )
+	{
+		wcstring_list_t lst;
+		int status = math_run_command( L"command seq", argv + 1, L"", lst );
+		for( size_t i=0; i<lst.size(); i++ )
+		{
+			stdout_buffer.append( lst.at( i ) );
+			stdout_buffer.push_back( L'\n' );
+		}
+		return status;
+	}
+
+	for( long long i = from; step > 0 ? i <= to : i >= to; i += step )
+	{
+		append_format( stdout_buffer, L"%lld\n", i );
+
+		/* Stop if the next step would overflow */
+		if( step > 0 ? i > LLONG_MAX - step : i < LLONG_MIN - step )
+			break;
+	}
+	return STATUS_BUILTIN_OK;
+}
@@ -575,14 +575,13 @@ static int builtin_set( parser_t &parser, wchar_t **argv )
 			if( slice )
 			{
 				std::vector<long> indexes;
-				wcstring_list_t result;
-				size_t j;
+				wcstring_list_t unused;
+				size_t j, count = 0;
 				
-                env_var_t dest_str = env_get_string(dest);
-                if (! dest_str.missing())
-                    tokenize_variable_array( dest_str, result );
+				/* Only the size of the array is needed */
+				env_get_elements( dest, indexes, unused, &count );
 								
-				if( !parse_index( indexes, arg, dest, result.size() ) )
+				if( !parse_index( indexes, arg, dest, count ) )
 				{
 					builtin_print_help( parser, argv[0], stderr_buffer );
 					retcode = 1;
@@ -591,7 +590,7 @@ static int builtin_set( parser_t &parser, wchar_t **argv )
 				for( j=0; j < indexes.size() ; j++ )
 				{
 					long idx = indexes[j];
-					if( idx < 1 || (size_t)idx > result.size() )
+					if( idx < 1 || (size_t)idx > count )
 					{
 						retcode++;
 					}
@@ -0,0 +1,205 @@
+/** \file builtin_set_color.cpp
+	Functions for executing the set_color builtin.
+
+	The builtin does what the set_color command does, without starting
+	a process and setting up terminfo every time a prompt changes the
+	color. The escape sequences come from the tables in output.cpp,
+	which are computed once for every terminal.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "wutil.h"
+#include "builtin.h"
+#include "common.h"
+#include "env.h"
+#include "output.h"
+#include "color.h"
+#include "wgetopt.h"
+
+/**
+   The color names that set_color --print-colors prints
+*/
+static const wchar_t * const set_color_names[]=
+{
+	L"black",
+	L"red",
+	L"green",
+	L"brown",
+	L"yellow",
+	L"blue",
+	L"magenta",
+	L"purple",
+	L"cyan",
+	L"white",
+	L"normal"
+}
+	;
+
+/**
+   Returns whether colors that are not named should be taken from the
+   256 color palette. This is decided the way the set_color command
+   decides it, so that the output doesn't depend on which one is used.
+*/
+static bool set_color_supports_term256()
+{
+	const env_var_t fish_term256 = env_get_string( L"fish_term256" );
+	if( ! fish_term256.missing() )
+		return from_string<bool>( fish_term256 );
+
+	const env_var_t term = env_get_string( L"TERM" );
+	return ! term.missing() && term.find( L"256color" ) != wcstring::npos;
+}
+
+/**
+   The set_color builtin
+*/
+static int builtin_set_color( parser_t &parser, wchar_t **argv )
+{
+	int argc = builtin_count_args( argv );
+	const wchar_t *bgcolor = 0;
+	const wchar_t *fgcolor = 0;
+	bool bold = false;
+	bool underline = false;
+
+	woptind=0;
+
+	while( 1 )
+	{
+		static const struct woption
+			long_options[] =
+			{
+				{
+					L"background", required_argument, 0, 'b'
+				}
+				,
+				{
+					L"help", no_argument, 0, 'h'
+				}
+				,
+				{
+					L"bold", no_argument, 0, 'o'
+				}
+				,
+				{
+					L"underline", no_argument, 0, 'u'
+				}
+				,
+				{
+					L"version", no_argument, 0, 'v'
+				}
+				,
+				{
+					L"print-colors", no_argument, 0, 'c'
+				}
+				,
+				{
+					0, 0, 0, 0
+				}
+			}
+		;
+
+		int opt_index = 0;
+
+		int opt = wgetopt_long( argc,
+								argv,
+								L"b:hvocu",
+								long_options,
+								&opt_index );
+		if( opt == -1 )
+			break;
+
+		switch( opt )
+		{
+			case 0:
+				break;
+
+			case 'b':
+				bgcolor = woptarg;
+				break;
+
+			case 'h':
+				builtin_print_help( parser, argv[0], stdout_buffer );
+				return 0;
+
+			case 'o':
+				bold = true;
+				break;
+
+			case 'u':
+				underline = true;
+				break;
+
+			case 'v':
+				append_format( stderr_buffer, _( L"%ls, version %s\n" ), argv[0], PACKAGE_VERSION );
+				return 0;
+
+			case 'c':
+				for( size_t i=0; i<sizeof set_color_names / sizeof *set_color_names; i++ )
+				{
+					stdout_buffer.append( set_color_names[i] );
+					stdout_buffer.push_back( L'\n' );
+				}
+				return 0;
+
+			case '?':
+				builtin_unknown_option( parser, argv[0], argv[woptind-1] );
+				return 1;
+		}
+	}
+
+	switch( argc-woptind )
+	{
+		case 0:
+			break;
+
+		case 1:
+			fgcolor = argv[woptind];
+			break;
+
+		default:
+			append_format( stderr_buffer, BUILTIN_ERR_TOO_MANY_ARGUMENTS, argv[0] );
+			return 1;
+	}
+
+	if( !fgcolor && !bgcolor && !bold && !underline )
+	{
+		append_format( stderr_buffer, BUILTIN_ERR_MISSING, argv[0] );
+		builtin_print_help( parser, argv[0], stderr_buffer );
+		return 1;
+	}
+
+	const rgb_color_t fg = fgcolor ? rgb_color_t( fgcolor ) : rgb_color_t::none();
+	if( fgcolor && fg.is_none() )
+	{
+		append_format( stderr_buffer, _( L"%ls: Unknown color '%ls'\n" ), argv[0], fgcolor );
+		return 1;
+	}
+
+	const rgb_color_t bg = bgcolor ? rgb_color_t( bgcolor ) : rgb_color_t::none();
+	if( bgcolor && bg.is_none() )
+	{
+		append_format( stderr_buffer, _( L"%ls: Unknown color '%ls'\n" ), argv[0], bgcolor );
+		return 1;
+	}
+
+	/* Scripts that are not interactive haven't set up the terminal */
+	const env_var_t term = env_get_string( L"TERM" );
+	if( ! output_init_term( term.missing() ? 0 : term.c_str() ) )
+	{
+		append_format( stderr_buffer, _( L"%ls: Could not set up terminal\n" ), argv[0] );
+		return 1;
+	}
+
+	std::string seq;
+	output_append_color_sequence( seq, fg, bg, bold, underline, set_color_supports_term256() );
+	stdout_buffer.append( str2wcstring( seq ) );
+	return 0;
+}
@@ -10,6 +10,7 @@ Implemented from scratch (yes, really) by way of IEEE 1003.1 as reference.
 #include "builtin.h"
 #include "wutil.h"
 #include "proc.h"
+#include "lru.h"
 #include <sys/stat.h>
 #include <memory>
 
@@ -119,6 +120,9 @@ namespace test_expressions {
     };
     
     const token_info_t *token_for_string(const wcstring &str) {
+        /* Most arguments are operands, and all tokens start with one of these */
+        if (str.empty() || ! wcschr(L"!-=()", str.at(0)))
+            return &token_infos[0];
         for (size_t i=0; i < sizeof token_infos / sizeof *token_infos; i++) {
             if (str == token_infos[i].string) {
                 return &token_infos[i];
@@ -191,29 +195,29 @@ namespace test_expressions {
         
         virtual ~expression() { }
         
-        // evaluate returns true if the expression is true (i.e. BUILTIN_TEST_SUCCESS)
-        virtual bool evaluate(wcstring_list_t &errors) = 0;
+        // evaluate returns true if the expression is true (i.e. BUILTIN_TEST_SUCCESS). args are the arguments the expression was parsed from, or any arguments that parse the same way.
+        virtual bool evaluate(const wcstring_list_t &args, wcstring_list_t &errors) = 0;
     };
 
     typedef std::auto_ptr<expression> expr_ref_t;
 
-    /* Single argument like -n foo or "just a string" */
+    /* Single argument like -n foo or "just a string". Arguments are referred to by their index. */
     class unary_primary : public expression {
         public:
-        wcstring arg;
-        unary_primary(token_t tok, range_t where, const wcstring &what) : expression(tok, where), arg(what) { }
-        bool evaluate(wcstring_list_t &errors);
+        unsigned int arg;
+        unary_primary(token_t tok, range_t where, unsigned int what) : expression(tok, where), arg(what) { }
+        bool evaluate(const wcstring_list_t &args, wcstring_list_t &errors);
     };
 
     /* Two argument primary like foo != bar */
     class binary_primary : public expression {
         public:
-        wcstring arg_left;
-        wcstring arg_right;
+        unsigned int arg_left;
+        unsigned int arg_right;
         
-        binary_primary(token_t tok, range_t where, const wcstring &left, const wcstring &right) : expression(tok, where), arg_left(left), arg_right(right)
+        binary_primary(token_t tok, range_t where, unsigned int left, unsigned int right) : expression(tok, where), arg_left(left), arg_right(right)
         { }
-        bool evaluate(wcstring_list_t &errors);
+        bool evaluate(const wcstring_list_t &args, wcstring_list_t &errors);
     };
     
     /* Unary operator like bang */
@@ -221,7 +225,7 @@ namespace test_expressions {
         public:
         expr_ref_t subject;        
         unary_operator(token_t tok, range_t where, expr_ref_t &exp) : expression(tok, where), subject(exp) { }
-        bool evaluate(wcstring_list_t &errors);
+        bool evaluate(const wcstring_list_t &args, wcstring_list_t &errors);
     };
     
     /* Combining expression. Contains a list of AND or OR expressions. It takes more than two so that we don't have to worry about precedence in the parser. */
@@ -243,7 +247,7 @@ namespace test_expressions {
             }
         }
         
-        bool evaluate(wcstring_list_t &errors);
+        bool evaluate(const wcstring_list_t &args, wcstring_list_t &errors);
     };
     
     /* Parenthetical expression */
@@ -252,7 +256,7 @@ namespace test_expressions {
         expr_ref_t contents;
         parenthetical_expression(token_t tok, range_t where, expr_ref_t &expr) : expression(tok, where), contents(expr) { }
         
-        virtual bool evaluate(wcstring_list_t &errors);
+        virtual bool evaluate(const wcstring_list_t &args, wcstring_list_t &errors);
     };
     
     void test_parser::add_error(const wchar_t *fmt, ...) {
@@ -346,7 +350,7 @@ namespace test_expressions {
         if (! (info->flags & UNARY_PRIMARY))
             return NULL;
         
-        return new unary_primary(info->tok, range_t(start, start + 2), arg(start + 1));
+        return new unary_primary(info->tok, range_t(start, start + 2), start + 1);
     }
     
     expression *test_parser::parse_just_a_string(unsigned int start, unsigned int end) {
@@ -366,7 +370,7 @@ namespace test_expressions {
         }
         
         /* This is hackish; a nicer way to implement this would be with a "just a string" expression type */
-        return new unary_primary(test_string_n, range_t(start, start + 1), arg(start));
+        return new unary_primary(test_string_n, range_t(start, start + 1), start);
     }
     
 #if 0
@@ -401,7 +405,7 @@ namespace test_expressions {
             return error(L"Missing argument at index %u", arg_idx);
         }
         
-        return new unary_primary(info->tok, range_t(start, arg_idx + 1), arg(arg_idx));
+        return new unary_primary(info->tok, range_t(start, arg_idx + 1), arg_idx);
     }
 #endif
     
@@ -418,7 +422,7 @@ namespace test_expressions {
         if (! (info->flags & BINARY_PRIMARY))
             return NULL;
         
-        return new binary_primary(info->tok, range_t(start, start + 3), arg(start), arg(start + 2));
+        return new binary_primary(info->tok, range_t(start, start + 3), start, start + 2);
     }
     
     expression *test_parser::parse_parenthentical(unsigned int start, unsigned int end) {
@@ -506,19 +510,19 @@ namespace test_expressions {
         return result;
     }
     
-    bool unary_primary::evaluate(wcstring_list_t &errors) {
-        return unary_primary_evaluate(token, arg, errors);
+    bool unary_primary::evaluate(const wcstring_list_t &args, wcstring_list_t &errors) {
+        return unary_primary_evaluate(token, args.at(arg), errors);
     }
     
-    bool binary_primary::evaluate(wcstring_list_t &errors) {
-        return binary_primary_evaluate(token, arg_left, arg_right, errors);
+    bool binary_primary::evaluate(const wcstring_list_t &args, wcstring_list_t &errors) {
+        return binary_primary_evaluate(token, args.at(arg_left), args.at(arg_right), errors);
     }
     
-    bool unary_operator::evaluate(wcstring_list_t &errors) {
+    bool unary_operator::evaluate(const wcstring_list_t &args, wcstring_list_t &errors) {
         switch (token) {
             case test_bang:
                 assert(subject.get());
-                return ! subject->evaluate(errors);
+                return ! subject->evaluate(args, errors);
             default:
                 errors.push_back(format_string(L"Unknown token type in %s", __func__));
                 return false;
@@ -526,14 +530,14 @@ namespace test_expressions {
         }
     }
     
-    bool combining_expression::evaluate(wcstring_list_t &errors) {
+    bool combining_expression::evaluate(const wcstring_list_t &args, wcstring_list_t &errors) {
         switch (token) {
             case test_combine_and:
             case test_combine_or:
             {
                 /* One-element case */
                 if (subjects.size() == 1)
-                    return subjects.at(0)->evaluate(errors);
+                    return subjects.at(0)->evaluate(args, errors);
                 
                 /* Evaluate our lists, remembering that AND has higher precedence than OR. We can visualize this as a sequence of OR expressions of AND expressions. */
                 assert(combiners.size() + 1 == subjects.size());
@@ -551,7 +555,7 @@ namespace test_expressions {
                     bool and_result = true;
                     for (; idx < max; idx++) {
                         /* Evaluate it, short-circuiting */
-                        and_result = and_result && subjects.at(idx)->evaluate(errors);
+                        and_result = and_result && subjects.at(idx)->evaluate(args, errors);
                         
                         /* If the combiner at this index (which corresponding to how we combine with the next subject) is not AND, then exit the loop */
                         if (idx + 1 < max && combiners.at(idx) != test_combine_and) {
@@ -573,10 +577,36 @@ namespace test_expressions {
         }
     }
     
-    bool parenthetical_expression::evaluate(wcstring_list_t &errors) {
-        return contents->evaluate(errors);
+    bool parenthetical_expression::evaluate(const wcstring_list_t &args, wcstring_list_t &errors) {
+        return contents->evaluate(args, errors);
     }
 
+    /* Returns the token types of the arguments, one character each. The parser only looks at the types of the arguments and refers to them by index, so all arguments of the same shape parse into the same expression. */
+    static wcstring args_shape(const wcstring_list_t &args) {
+        wcstring shape;
+        shape.reserve(args.size());
+        for (size_t i=0; i < args.size(); i++) {
+            shape.push_back(wchar_t(L'A' + token_for_string(args.at(i))->tok));
+        }
+        return shape;
+    }
+
+    /* An expression, cached under the shape of the arguments it was parsed from */
+    class cached_expression_t : public lru_node_t {
+        public:
+        expression * const expr;
+        cached_expression_t(const wcstring &shape, expression *e) : lru_node_t(shape), expr(e) { }
+        ~cached_expression_t() { delete expr; }
+    };
+
+    /* The most recently used expressions. Scripts tend to use few shapes, like 'test $i -lt $max', over and over again, so this saves parsing them on every call. */
+    class expression_cache_t : public lru_cache_t<cached_expression_t> {
+        virtual void node_was_evicted(cached_expression_t *node) { delete node; }
+        public:
+        expression_cache_t() : lru_cache_t<cached_expression_t>(64) { }
+    };
+    static expression_cache_t s_expression_cache;
+
     /* IEEE 1003.1 says nothing about what it means for two strings to be "algebraically equal". For example, should we interpret 0x10 as 0, 10, or 16? Here we use only base 10 and use wcstoll, which allows for leading + and -, and leading whitespace. This matches bash. */
     static bool parse_number(const wcstring &arg, long long *out) {
         const wchar_t *str = arg.c_str();
@@ -715,9 +745,11 @@ int builtin_test( parser_t &parser, wchar_t **argv )
         // Per 1003.1, exit true if the arg is non-empty
         return args.at(0).empty() ? BUILTIN_TEST_FAIL : BUILTIN_TEST_SUCCESS;
     } else {
-        // Try parsing. If expr is not nil, we are responsible for deleting it.
+        // Try parsing, unless arguments of the same shape have been parsed before. The cache owns the expression.
+        const wcstring shape = args_shape(args);
+        cached_expression_t *cached = s_expression_cache.get_node(shape);
         wcstring err;
-        expression *expr = test_parser::parse_args(args, err);
+        expression *expr = cached ? cached->expr : test_parser::parse_args(args, err);
         if (! expr) {
 #if 0
             printf("Oops! test was given args:\n");
@@ -729,15 +761,17 @@ int builtin_test( parser_t &parser, wchar_t **argv )
             builtin_show_error(err);
             return BUILTIN_TEST_FAIL;
         } else {
+            if (! cached)
+                s_expression_cache.add_node(new cached_expression_t(shape, expr));
+            
             wcstring_list_t eval_errors;
-            bool result = expr->evaluate(eval_errors);
+            bool result = expr->evaluate(args, eval_errors);
             if (! eval_errors.empty()) {
                 printf("test returned eval errors:\n");
                 for (size_t i=0; i < eval_errors.size(); i++) {
                     printf("\t%ls\n", eval_errors.at(i).c_str());
                 }
             }
-            delete expr;
             return result ? BUILTIN_TEST_SUCCESS : BUILTIN_TEST_FAIL;
         }
     }
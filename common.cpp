@@ -90,6 +90,11 @@ static bool thread_assertions_configured_for_testing = false;
 
 wchar_t ellipsis_char;
 
+/**
+   Whether the character set of the current locale is UTF-8, which str2wcs and wcs2str convert without calling mbrtowc and wcrtomb for every character
+*/
+static bool utf8_locale = false;
+
 char *profile=0;
 
 const wchar_t *program_name;
@@ -197,9 +202,114 @@ static bool string_sort_predicate(const wcstring& d1, const wcstring& d2)
     return wcsfilecmp(d1.c_str(), d2.c_str()) < 0;
 }
 
+/**
+   One element of a string as wcsfilecmp sees it: a run of digits, compared by its value, or a character, compared ignoring case. The secondary value breaks ties between equal elements: the length of the digit run, or the character itself.
+*/
+struct filecmp_element_t
+{
+    long primary;
+    long secondary;
+    bool number;
+};
+
+typedef std::vector<filecmp_element_t> filecmp_key_t;
+
+/**
+   Splits str into the elements wcsfilecmp compares. Returns false if it contains a number too big for wcsfilecmp to compare by value without overflowing, in which case only wcsfilecmp itself gets the order right.
+*/
+static bool make_filecmp_key( const wcstring &str, filecmp_key_t &key )
+{
+    const wchar_t *cursor = str.c_str();
+    while (*cursor)
+    {
+        filecmp_element_t element;
+        if (iswdigit(*cursor))
+        {
+            wchar_t *end;
+            errno = 0;
+            element.primary = wcstol(cursor, &end, 10);
+            if (errno || element.primary > INT_MAX)
+                return false;
+            element.secondary = end - cursor;
+            element.number = true;
+            cursor = end;
+        }
+        else
+        {
+            element.primary = towlower(*cursor);
+            element.secondary = *cursor;
+            element.number = false;
+            cursor++;
+        }
+        key.push_back(element);
+    }
+    return true;
+}
+
+/**
+   Orders indexes of strings like wcsfilecmp orders the strings, using their keys. A primary difference decides, then the leftmost secondary difference, then the length.
+*/
+struct filecmp_key_less_t
+{
+    const std::vector<filecmp_key_t> &keys;
+    
+    filecmp_key_less_t(const std::vector<filecmp_key_t> &k) : keys(k)
+    {
+    }
+    
+    bool operator()(size_t a, size_t b) const
+    {
+        const filecmp_key_t &ka = keys[a], &kb = keys[b];
+        const size_t count = std::min(ka.size(), kb.size());
+        for (size_t i=0; i < count; i++)
+        {
+            const filecmp_element_t &ea = ka[i], &eb = kb[i];
+            long diff;
+            if (ea.number && eb.number)
+            {
+                diff = ea.primary - eb.primary;
+            }
+            else
+            {
+                /* A number is compared with a character by its first digit, and every digit compares the same way with a character that is not one */
+                diff = (ea.number ? L'0' : ea.primary) - (eb.number ? L'0' : eb.primary);
+            }
+            if (diff)
+                return diff < 0;
+        }
+        for (size_t i=0; i < count; i++)
+        {
+            long diff = ka[i].secondary - kb[i].secondary;
+            if (diff)
+                return diff < 0;
+        }
+        return ka.size() < kb.size();
+    }
+};
+
 void sort_strings( std::vector<wcstring> &strings)
 {
-    std::sort(strings.begin(), strings.end(), string_sort_predicate);
+    /* wcsfilecmp takes the string apart on every comparison, so take each string apart once and sort by that */
+    const size_t count = strings.size();
+    std::vector<filecmp_key_t> keys(count);
+    for (size_t i=0; i < count; i++)
+    {
+        if (! make_filecmp_key(strings[i], keys[i]))
+        {
+            std::sort(strings.begin(), strings.end(), string_sort_predicate);
+            return;
+        }
+    }
+    
+    std::vector<size_t> order(count);
+    for (size_t i=0; i < count; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), filecmp_key_less_t(keys));
+    
+    std::vector<wcstring> sorted(count);
+    for (size_t i=0; i < count; i++)
+        sorted[i].swap(strings[order[i]]);
+    strings.swap(sorted);
 }
 
 void sort_completions( std::vector<completion_t> &completions)
@@ -237,23 +347,95 @@ wcstring str2wcstring( const std::string &in )
     return result;
 }
 
-wchar_t *str2wcs_internal( const char *in, wchar_t *out )
+/**
+   Decodes the well formed UTF-8 sequence at in into out, and returns its length, or 0 if it is not a well formed sequence for a character outside the ranges fish encodes directly. Those are left to mbrtowc.
+*/
+static size_t utf8_decode_one( const unsigned char *in, wchar_t *out )
 {
-	size_t res=0;
-	int in_pos=0;
-	int out_pos = 0;
-	mbstate_t state;
+	const unsigned char c = in[0];
+	wchar_t result;
 	size_t len;
+	
+	if( c < 0xc2 )
+		return 0;
+	else if( c < 0xe0 )
+	{
+		result = c & 0x1f;
+		len = 2;
+	}
+	else if( c < 0xf0 )
+	{
+		result = c & 0x0f;
+		len = 3;
+	}
+	else if( c < 0xf5 )
+	{
+		result = c & 0x07;
+		len = 4;
+	}
+	else
+		return 0;
+	
+	/* The string is null terminated, and null is not a continuation byte, so this never reads past the end */
+	for( size_t i=1; i<len; i++ )
+	{
+		if( (in[i] & 0xc0) != 0x80 )
+			return 0;
+		result = (result << 6) | (in[i] & 0x3f);
+	}
+	
+	/* Reject overlong forms, surrogates and values past the end of unicode */
+	if( (len == 3 && result < 0x800) || (len == 4 && (result < 0x10000 || result > 0x10ffff)) || (result >= 0xd800 && result <= 0xdfff) )
+		return 0;
+	
+	if( ( ( result >= ENCODE_DIRECT_BASE) && ( result < ENCODE_DIRECT_BASE+256)) || ( result == INTERNAL_SEPARATOR ) )
+		return 0;
+	
+	/* wchar_t may be 16 bits wide */
+	if( (unsigned long)result > (unsigned long)WCHAR_MAX )
+		return 0;
+	
+	*out = result;
+	return len;
+}
 
-	CHECK( in, 0 );
-	CHECK( out, 0 );
-		
-	len = strlen(in);
+/**
+   Converts the first len bytes of in, or the bytes before the first
+   null if there is one, into out, and returns the number of wide
+   characters written. out is not null terminated.
+*/
+static size_t str2wcs_len( const char *in, size_t len, wchar_t *out )
+{
+	size_t res=0;
+	size_t in_pos=0;
+	size_t out_pos = 0;
+	mbstate_t state;
 
 	memset( &state, 0, sizeof(state) );
 
-	while( in[in_pos] )
+	while( in_pos < len && in[in_pos] )
 	{
+		if( utf8_locale )
+		{
+			/* Copy runs of ascii, and decode well formed sequences by hand */
+			const unsigned char c = in[in_pos];
+			if( c <= ASCII_MAX )
+			{
+				out[out_pos++] = c;
+				in_pos++;
+				continue;
+			}
+			
+			/* Sequences at the very end are left to mbrtowc, which knows where to stop */
+			size_t decoded = len - in_pos >= 4 ? utf8_decode_one( (const unsigned char *)&in[in_pos], &out[out_pos] ) : 0;
+			if( decoded )
+			{
+				in_pos += decoded;
+				out_pos++;
+				continue;
+			}
+		}
+		
 		res = mbrtowc( &out[out_pos], &in[in_pos], len-in_pos, &state );
 
 		if( ( ( out[out_pos] >= ENCODE_DIRECT_BASE) &&
@@ -281,7 +463,7 @@ wchar_t *str2wcs_internal( const char *in, wchar_t *out )
 				
 				case 0:
 				{
-					return out;
+					return out_pos;
 				}
 		
 				default:
@@ -294,9 +476,25 @@ wchar_t *str2wcs_internal( const char *in, wchar_t *out )
 		}
 		
 	}
-	out[out_pos] = 0;
 	
-	return out;	
+	return out_pos;
+}
+
+wchar_t *str2wcs_internal( const char *in, wchar_t *out )
+{
+	CHECK( in, 0 );
+	CHECK( out, 0 );
+	
+	out[str2wcs_len( in, strlen( in ), out )] = 0;
+	return out;
+}
+
+wcstring str2wcstring( const char *in, size_t len )
+{
+	wcstring result( len, L'\0' );
+	if( len )
+		result.resize( str2wcs_len( in, len, &result.at( 0 ) ) );
+	return result;
 }
 
 char *wcs2str( const wchar_t *in )
@@ -352,7 +550,12 @@ char *wcs2str_internal( const wchar_t *in, char *out )
 	
 	while( in[in_pos] )
 	{
-		if( in[in_pos] == INTERNAL_SEPARATOR )
+		const wchar_t c = in[in_pos];
+		if( utf8_locale && c <= ASCII_MAX )
+		{
+			out[out_pos++] = (char)c;
+		}
+		else if( in[in_pos] == INTERNAL_SEPARATOR )
 		{
 		}
 		else if( ( in[in_pos] >= ENCODE_DIRECT_BASE) &&
@@ -360,6 +563,24 @@ char *wcs2str_internal( const wchar_t *in, char *out )
 		{
 			out[out_pos++] = in[in_pos]- ENCODE_DIRECT_BASE;
 		}
+		else if( utf8_locale && c > ASCII_MAX && c < 0x800 )
+		{
+			out[out_pos++] = (char)(0xc0 | (c >> 6));
+			out[out_pos++] = (char)(0x80 | (c & 0x3f));
+		}
+		else if( utf8_locale && c >= 0x800 && c < 0x10000 && ! (c >= 0xd800 && c <= 0xdfff) )
+		{
+			out[out_pos++] = (char)(0xe0 | (c >> 12));
+			out[out_pos++] = (char)(0x80 | ((c >> 6) & 0x3f));
+			out[out_pos++] = (char)(0x80 | (c & 0x3f));
+		}
+		else if( utf8_locale && (unsigned long)c >= 0x10000 && (unsigned long)c <= 0x10ffff )
+		{
+			out[out_pos++] = (char)(0xf0 | (c >> 18));
+			out[out_pos++] = (char)(0x80 | ((c >> 12) & 0x3f));
+			out[out_pos++] = (char)(0x80 | ((c >> 6) & 0x3f));
+			out[out_pos++] = (char)(0x80 | (c & 0x3f));
+		}
 		else
 		{
 			res = wcrtomb( &out[out_pos], in[in_pos], &state );
@@ -502,6 +723,44 @@ int wcsvarchr( wchar_t chr )
 }
 
 
+/**
+   Widths of the characters of the basic multilingual plane, as returned by wcwidth, filled in as they are first asked for. Entries not yet known are WIDTH_UNKNOWN. Entries are single bytes each written with the same value, so threads racing to fill one in do no harm.
+*/
+#define WIDTH_UNKNOWN (-2)
+#define WIDTH_TABLE_SIZE 0x10000
+static signed char width_table[WIDTH_TABLE_SIZE];
+static bool width_table_valid = false;
+
+/**
+   Forgets the widths in the table, since they depend on the locale
+*/
+static void width_table_reset()
+{
+	memset( width_table, WIDTH_UNKNOWN, sizeof width_table );
+	width_table_valid = true;
+}
+
+int fish_wcwidth( wchar_t c )
+{
+	/* Printable ascii is one column wide in every locale */
+	if( c >= L' ' && c < 0x7f )
+		return 1;
+	
+	if( c < 0 || (unsigned long)c >= WIDTH_TABLE_SIZE )
+		return wcwidth( c );
+	
+	if( ! width_table_valid )
+		width_table_reset();
+	
+	int w = width_table[c];
+	if( w == WIDTH_UNKNOWN )
+	{
+		w = wcwidth( c );
+		width_table[c] = (signed char)(w < -1 ? -1 : w);
+	}
+	return w;
+}
+
 /** 
 	The glibc version of wcswidth seems to hang on some strings. fish uses this replacement.
 */
@@ -510,7 +769,7 @@ int my_wcswidth( const wchar_t *c )
 	int res=0;
 	while( *c )
 	{
-		int w = wcwidth( *c++ );
+		int w = fish_wcwidth( *c++ );
 		if( w < 0 )
 			w = 1;
 		if( w > 2 )
@@ -565,7 +824,9 @@ wcstring wsetlocale(int category, const wchar_t *locale)
 	  Use ellipsis if on known unicode system, otherwise use $
 	*/
 	char *ctype = setlocale( LC_CTYPE, NULL );
-	ellipsis_char = (strstr( ctype, ".UTF")||strstr( ctype, ".utf") )?L'\x2026':L'$';	
+	utf8_locale = (strstr( ctype, ".UTF")||strstr( ctype, ".utf") );
+	width_table_valid = false;
+	ellipsis_char = utf8_locale?L'\x2026':L'$';	
 		
 	if( !res )
 		return wcstring();
@@ -1688,6 +1949,129 @@ bool string_prefixes_string_case_insensitive(const wcstring &proposed_prefix, co
     return prefix_size <= value.size() && wcsncasecmp(proposed_prefix.c_str(), value.c_str(), prefix_size) == 0;
 }
 
+/**
+   Returns the character in lower case, the way fuzzy_matcher_t compares
+   characters. ASCII characters don't need a call to towlower.
+*/
+static inline wchar_t fuzzy_lower( wchar_t c )
+{
+	if( c < 128 )
+		return ( c >= L'A' && c <= L'Z' ) ? c - L'A' + L'a' : c;
+	return towlower( c );
+}
+
+fuzzy_matcher_t::fuzzy_matcher_t( const wcstring &s ) : search(s), search_lower(s), search_upper(s)
+{
+	for( size_t i=0; i<search_lower.size(); i++ )
+	{
+		search_lower[i] = fuzzy_lower( search_lower[i] );
+		search_upper[i] = towupper( search_lower[i] );
+	}
+}
+
+fuzzy_match_t fuzzy_matcher_t::match( const wchar_t *str, size_t len ) const
+{
+	fuzzy_match_t result = { FUZZY_MATCH_NONE, 0 };
+	const size_t search_len = search_lower.size();
+	if( search_len > len )
+		return result;
+
+	if( wmemcmp( str, search.c_str(), search_len ) == 0 )
+	{
+		result.type = FUZZY_MATCH_PREFIX;
+		return result;
+	}
+
+	/*
+	  Find the earliest end of a subsequence match. Every better kind of
+	  match is also a subsequence match, so strings failing this don't
+	  match at all.
+	*/
+	const wchar_t *cursor = str, * const str_end = str + len;
+	for( size_t matched=0; matched < search_len; matched++ )
+	{
+		/* Only characters outside ASCII need towlower to be compared */
+		const wchar_t lower = search_lower[matched], upper = search_upper[matched];
+		while( cursor < str_end && *cursor != lower && *cursor != upper &&
+			   ( *cursor < 128 || (wchar_t)towlower( *cursor ) != lower ) )
+		{
+			cursor++;
+		}
+		if( cursor == str_end )
+			return result;
+		cursor++;
+	}
+
+	result.type = FUZZY_MATCH_SUBSEQUENCE;
+	result.distance = ( cursor - str ) - search_len;
+
+	/*
+	  Look for the first occurence of the whole search string. It can't
+	  start before the distance of the subsequence match, since it would
+	  end before the earliest end.
+	*/
+	for( size_t start=result.distance; start + search_len <= len; start++ )
+	{
+		size_t i = 0;
+		while( i < search_len && fuzzy_lower( str[start+i] ) == search_lower[i] )
+			i++;
+		if( i == search_len )
+		{
+			result.type = start ? FUZZY_MATCH_SUBSTRING : FUZZY_MATCH_PREFIX_NO_CASE;
+			result.distance = start;
+			break;
+		}
+	}
+	return result;
+}
+
+/**
+   Returns the string in lower case, the way name_index_t sorts names
+*/
+static wcstring name_index_key( const wcstring &name )
+{
+	wcstring key = name;
+	for( size_t i=0; i<key.size(); i++ )
+	{
+		key[i] = fuzzy_lower( key[i] );
+	}
+	return key;
+}
+
+void name_index_t::insert( const wcstring &name )
+{
+	const wcstring key = name_index_key( name );
+	std::pair<map_t::iterator, map_t::iterator> range = names.equal_range( key );
+	for( map_t::iterator iter = range.first; iter != range.second; ++iter )
+	{
+		if( iter->second == name )
+			return;
+	}
+	names.insert( range.second, map_t::value_type( key, name ) );
+}
+
+void name_index_t::erase( const wcstring &name )
+{
+	std::pair<map_t::iterator, map_t::iterator> range = names.equal_range( name_index_key( name ) );
+	for( map_t::iterator iter = range.first; iter != range.second; ++iter )
+	{
+		if( iter->second == name )
+		{
+			names.erase( iter );
+			return;
+		}
+	}
+}
+
+void name_index_t::find_prefix( const wcstring &prefix, wcstring_list_t &out ) const
+{
+	const wcstring key = name_index_key( prefix );
+	for( map_t::const_iterator iter = names.lower_bound( key ); iter != names.end() && string_prefixes_string( key, iter->first ); ++iter )
+	{
+		out.push_back( iter->second );
+	}
+}
+
 bool string_suffixes_string(const wcstring &proposed_suffix, const wcstring &value) {
     size_t suffix_size = proposed_suffix.size();
     return suffix_size <= value.size() && value.compare(value.size() - suffix_size, suffix_size, proposed_suffix) == 0;
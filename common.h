@@ -15,6 +15,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <map>
 #include <pthread.h>
 #include <string.h>
 
@@ -28,6 +29,21 @@ class completion_t;
 typedef std::wstring wcstring;
 typedef std::vector<wcstring> wcstring_list_t;
 
+/**
+   A list of named byte counts, describing what memory is used for.
+   Printed by status --memory.
+*/
+typedef std::vector<std::pair<wcstring, size_t> > memory_usage_t;
+
+/**
+   Returns the approximate number of bytes allocated for the contents
+   of the specified string
+*/
+inline size_t memory_usage_of(const wcstring &str)
+{
+    return (str.capacity() + 1) * sizeof(wchar_t);
+}
+
 /**
    Maximum number of bytes used by a single utf-8 character
 */
@@ -225,6 +241,13 @@ wchar_t *str2wcs( const char *in );
 wcstring str2wcstring( const char *in );
 wcstring str2wcstring( const std::string &in );
 
+/**
+   Returns the wide character string equivalent of the first len
+   bytes of the specified multibyte character string, which need not
+   be null terminated. The conversion stops at a null byte.
+*/
+wcstring str2wcstring( const char *in, size_t len );
+
 /**
    Converts the narrow character string \c in into it's wide
    equivalent, stored in \c out. \c out must have enough space to fit
@@ -257,6 +280,107 @@ bool string_suffixes_string(const wchar_t *proposed_suffix, const wcstring &valu
 /** Test if a string prefixes another without regard to case. Returns true if a is a prefix of b */
 bool string_prefixes_string_case_insensitive(const wcstring &proposed_prefix, const wcstring &value);
 
+/**
+   How a string matched the search string of a fuzzy_matcher_t. Better
+   kinds of matches come first.
+*/
+enum fuzzy_match_type_t
+{
+	/** The string starts with the search string */
+	FUZZY_MATCH_PREFIX,
+
+	/** The string starts with the search string, ignoring case */
+	FUZZY_MATCH_PREFIX_NO_CASE,
+
+	/** The string contains the search string, ignoring case */
+	FUZZY_MATCH_SUBSTRING,
+
+	/** The characters of the search string appear in the string in the same order, ignoring case */
+	FUZZY_MATCH_SUBSEQUENCE,
+
+	/** The string doesn't match */
+	FUZZY_MATCH_NONE
+};
+
+/**
+   How well a string matched the search string of a fuzzy_matcher_t
+*/
+struct fuzzy_match_t
+{
+	/** The kind of match */
+	fuzzy_match_type_t type;
+
+	/**
+	   How far the match is from being a prefix match, 0 for prefix
+	   matches. For the other kinds, it is the number of characters
+	   before the end of the match that weren't matched.
+	*/
+	size_t distance;
+
+	/** Orders better matches first */
+	bool operator<( const fuzzy_match_t &rhs ) const
+	{
+		return type != rhs.type ? type < rhs.type : distance < rhs.distance;
+	}
+};
+
+/**
+   A search string prepared for being matched against many strings,
+   e.g. to let 'gco' find 'git-checkout'. Most strings that don't match
+   are rejected after one pass over their characters, without
+   allocating memory.
+*/
+class fuzzy_matcher_t
+{
+	/** The search string */
+	const wcstring search;
+
+	/** The search string in lower case */
+	wcstring search_lower;
+
+	/** The search string in upper case */
+	wcstring search_upper;
+
+public:
+	explicit fuzzy_matcher_t( const wcstring &search );
+
+	/** Match the search string against the specified string */
+	fuzzy_match_t match( const wcstring &str ) const
+	{
+		return match( str.c_str(), str.size() );
+	}
+
+	/** Match the search string against the first len characters of str */
+	fuzzy_match_t match( const wchar_t *str, size_t len ) const;
+};
+
+/**
+   A set of names, sorted without regard to case, so that the names
+   that start with a prefix, ignoring case, can be found without
+   looking at the others.
+*/
+class name_index_t
+{
+	/** The names, keyed by their lower case form */
+	typedef std::multimap<wcstring, wcstring> map_t;
+	map_t names;
+
+public:
+	/** Adds a name. Adding a name twice does nothing. */
+	void insert( const wcstring &name );
+
+	/** Removes a name */
+	void erase( const wcstring &name );
+
+	/** Appends the names that start with prefix, ignoring case, to out */
+	void find_prefix( const wcstring &prefix, wcstring_list_t &out ) const;
+
+	size_t size() const
+	{
+		return names.size();
+	}
+};
+
 /** Test if a list contains a string using a linear search. */
 bool list_contains_string(const wcstring_list_t &list, const wcstring &str);
 
@@ -344,7 +468,7 @@ inline wcstring to_string(const int &x) {
 }
 
 
-/* Helper class for managing a null-terminated array of null-terminated strings (of some char type) */
+/* Helper class for managing a null-terminated array of null-terminated strings (of some char type). The array and the strings share a single allocation, since one is made for every process fish launches. */
 template <typename CharType_t>
 class null_terminated_array_t {
     CharType_t **array;
@@ -367,14 +491,18 @@ class null_terminated_array_t {
         return count_not_null(array);
     }
 
+    /* Allocate room for count strings of length characters in total, not counting their terminators, in a single block with the array. The strings go after the array; this returns where the first one goes. */
+    CharType_t *allocate(size_t count, size_t length) {
+        const size_t array_size = (count + 1) * sizeof(CharType_t *);
+        char *block = new char[array_size + (length + count) * sizeof(CharType_t)];
+        this->array = reinterpret_cast<CharType_t **>(block);
+        this->array[count] = NULL;
+        return reinterpret_cast<CharType_t *>(block + array_size);
+    }
+
     void free(void) {
-        if (array != NULL) {
-            for (size_t i = 0; array[i] != NULL; i++) {
-                delete [] array[i];
-            }
-            delete [] array;
-            array = NULL;
-        }
+        delete [] reinterpret_cast<char *>(array);
+        array = NULL;
     }
         
     public:
@@ -399,15 +527,16 @@ class null_terminated_array_t {
         this->free();
 
         /* Allocate our null-terminated array of null-terminated strings */
-        size_t i, count = argv.size();
-        this->array = new CharType_t * [count + 1];
+        size_t i, count = argv.size(), length = 0;
+        for (i=0; i < count; i++)
+            length += argv.at(i).size();
+        CharType_t *pos = this->allocate(count, length);
         for (i=0; i < count; i++) {
             const string_t &str = argv.at(i);
-            this->array[i] = new CharType_t [1 + str.size()];
-            std::copy(str.begin(), str.end(), this->array[i]);
-            this->array[i][str.size()] = CharType_t(0);
+            this->array[i] = pos;
+            pos = std::copy(str.begin(), str.end(), pos);
+            *pos++ = CharType_t(0);
         }
-        this->array[count] = NULL;
     }
     
     void set(const CharType_t * const *new_array) {
@@ -419,15 +548,16 @@ class null_terminated_array_t {
         
         /* Copy the new one */
         if (new_array) {
-            size_t i, count = count_not_null(new_array);
-            this->array = new CharType_t * [count + 1];
+            size_t i, count = count_not_null(new_array), length = 0;
+            for (i=0; i < count; i++)
+                length += count_not_null(new_array[i]);
+            CharType_t *pos = this->allocate(count, length);
             for (i=0; i < count; i++) {
                 size_t len = count_not_null(new_array[i]);
-                this->array[i] = new CharType_t [1 + len];
-                std::copy(new_array[i], new_array[i] + len, this->array[i]);
-                this->array[i][len] = CharType_t(0);
+                this->array[i] = pos;
+                pos = std::copy(new_array[i], new_array[i] + len, pos);
+                *pos++ = CharType_t(0);
             }
-            this->array[count] = NULL;
         }
     }
     
@@ -483,6 +613,26 @@ public:
     ~scoped_lock();
 };
 
+/**
+   A generation token lets work done on a background thread notice that
+   its result is no longer wanted. The main thread increments a shared
+   counter whenever the inputs of the work change, and the token
+   remembers the value the counter had when the work was requested.
+*/
+class generation_token_t {
+    const volatile unsigned int *counter;
+    unsigned int generation;
+public:
+    /** Create a token that never goes stale */
+    generation_token_t() : counter(NULL), generation(0) {}
+    
+    /** Create a token for the current value of the specified counter */
+    explicit generation_token_t(const volatile unsigned int &c) : counter(&c), generation(c) {}
+    
+    /** Returns true if the counter has changed since the token was created */
+    bool is_stale() const { return counter != NULL && *counter != generation; }
+};
+
 class wcstokenizer {
     wchar_t *buffer, *str, *state;
     const wcstring sep;
@@ -548,6 +698,11 @@ const wchar_t *wcsfuncname( const wchar_t *str );
 int wcsvarchr( wchar_t chr );
 
 
+/**
+   Returns the width of the specified character, like wcwidth. Widths are looked up once per character and kept in a table, since wcwidth is called for every character on every redraw.
+*/
+int fish_wcwidth( wchar_t c );
+
 /**
    A wcswidth workalike. Fish uses this since the regular wcswidth seems flaky.
 */
@@ -22,6 +22,9 @@
 #include <wchar.h>
 #include <pthread.h>
 #include <algorithm>
+#include <functional>
+#include <tr1/memory>
+#include <tr1/unordered_map>
 
 #include "fallback.h"
 #include "util.h"
@@ -45,6 +48,8 @@
 #include "wutil.h"
 #include "path.h"
 #include "builtin_scripts.h"
+#include "iothread.h"
+#include "trace.h"
 
 /*
   Completion description strings, mostly for different types of files, such as sockets, block devices, etc.
@@ -156,18 +161,88 @@ typedef struct complete_entry_opt
 /* Last value used in the order field of completion_entry_t */
 static unsigned int kCompleteOrder = 0;
 
+/**
+   The options of a command completion, oldest first
+*/
+typedef std::vector<complete_entry_opt_t> option_list_t;
+
+/**
+   The options of a command completion, together with indexes of them
+   by short and long option. The indexes are rebuilt the first time the
+   options are used after they have changed, so that adding a thousand
+   options doesn't sort a thousand times. Once completing has a
+   reference to a set of options it must not change, so
+   completion_entry_t copies a shared set before changing it, and
+   indexes it before sharing it.
+*/
+struct option_set_t
+{
+	option_list_t options;
+
+	/** The indexes of the options with a long option, sorted by long option */
+	std::vector<size_t> long_index;
+
+	/** The indexes of the options with a long option, sorted by long option ignoring case */
+	std::vector<size_t> nocase_index;
+
+	/** The indexes of the options with a short option, sorted by short option and then by age */
+	std::vector<size_t> short_index;
+
+	/** The indexes of the options with neither, which complete arguments of the command */
+	std::vector<size_t> arg_index;
+
+	/** False if options have changed since the indexes were built */
+	bool indexed;
+
+	option_set_t() : indexed(true)
+	{
+	}
+
+	/** Recreates the indexes from scratch */
+	void rebuild_index();
+
+	/** Appends an option */
+	void add(const complete_entry_opt_t &opt);
+
+	/** Returns the first position in long_index whose option doesn't precede the specified long option */
+	std::vector<size_t>::const_iterator find_long(const wcstring &long_opt) const;
+
+	/** Returns the oldest option with the specified short option, or NULL */
+	const complete_entry_opt_t *find_short(wchar_t short_opt) const;
+
+	/** Appends the indexes of the options with the specified short option to out */
+	void short_matches(wchar_t short_opt, std::vector<size_t> &out) const;
+
+	/** Appends the indexes of the options with the specified long option to out */
+	void long_matches(const wcstring &long_opt, std::vector<size_t> &out) const;
+
+	/** Appends the indexes of the options whose long option starts with prefix, ignoring case, to out */
+	void long_prefix_matches_nocase(const wcstring &prefix, std::vector<size_t> &out) const;
+};
+typedef std::tr1::shared_ptr<const option_set_t> option_set_ref_t;
+
+/**
+   A section of completions for a command that is only added when it is
+   first needed, by evaluating a script
+*/
+struct lazy_section_t
+{
+	/** The condition under which the section is needed */
+	wcstring condition;
+	/** The script that adds the completions */
+	wcstring script;
+};
+
 /**
    Struct describing a command completion
 */
-typedef std::list<complete_entry_opt_t> option_list_t;
 class completion_entry_t
 {    
-public:
-	/** List of all options */
-	option_list_t options;
-    
-	/** String containing all short option characters */
-	wcstring short_opt_str;
+	/** All options, possibly shared with a completion in progress */
+	std::tr1::shared_ptr<option_set_t> options;
+
+	/** Returns the options, copied first if they are shared */
+	option_set_t &edit_options();
     
     public:
     
@@ -183,19 +258,17 @@ public:
     /** Order for when this completion was created. This aids in outputting completions sorted by time. */
     const unsigned int order;
     
-    /** Getters for option list. */
-    const option_list_t &get_options() const;
+    /** Sections that haven't been added yet */
+    std::vector<lazy_section_t> lazy_sections;
+    
+    /** Getter for the options, which indexes them if needed. The result stays the same when options are added or removed later. */
+    option_set_ref_t get_options() const;
     
     /** Adds or removes an option. */
     void add_option(const complete_entry_opt_t &opt);
     bool remove_option(wchar_t short_opt, const wchar_t *long_opt);
     
-    /** Getter for short_opt_str. */
-    wcstring &get_short_opt_str();    
-    const wcstring &get_short_opt_str() const;
-    
-    completion_entry_t(const wcstring &c, bool type, const wcstring &options, bool author) :
-        short_opt_str(options),
+    completion_entry_t(const wcstring &c, bool type, bool author) :
         cmd(c),
         cmd_is_path(type),
         authoritative(author),
@@ -204,10 +277,9 @@ public:
     }
 };
 
-/** Set of all completion entries */
-struct completion_entry_set_comparer {
-    /** Comparison for std::set */
-    bool operator()(completion_entry_t *p1, completion_entry_t *p2) const {
+/** The order in which the entries that apply to a command are used */
+struct completion_entry_less_t {
+    bool operator()(const completion_entry_t *p1, const completion_entry_t *p2) const {
         /* Paths always come last for no particular reason */
         if (p1->cmd_is_path != p2->cmd_is_path) {
             return p1->cmd_is_path < p2->cmd_is_path;
@@ -216,8 +288,19 @@ struct completion_entry_set_comparer {
         }
     }
 };
-typedef std::set<completion_entry_t *, completion_entry_set_comparer> completion_entry_set_t;
-static completion_entry_set_t completion_set;
+
+/** Completion entries by their command or path */
+typedef std::tr1::unordered_map<wcstring, completion_entry_t *> completion_entry_map_t;
+
+/**
+   The completion entries whose command or path has no wildcards, the
+   ones for commands first and the ones for paths second. These are
+   the vast majority, and are found with a single lookup.
+*/
+static completion_entry_map_t completion_entries[2];
+
+/** The completion entries whose command or path is a wildcard, which are matched against every command */
+static std::vector<completion_entry_t *> completion_patterns;
 
 // Comparison function to sort completions by their order field
 static bool compare_completions_by_order(const completion_entry_t *p1, const completion_entry_t *p2) {
@@ -231,24 +314,356 @@ static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t completion_entry_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
+/** Orders indexes of options by the long options of the options, optionally ignoring case */
+class long_opt_less_t
+{
+    const option_list_t &options;
+    const bool nocase;
+    
+    bool less(const wcstring &a, const wcstring &b) const
+    {
+        return nocase ? wcscasecmp(a.c_str(), b.c_str()) < 0 : a < b;
+    }
+    
+    public:
+    
+    long_opt_less_t(const option_list_t &o, bool n = false) : options(o), nocase(n)
+    {
+    }
+    
+    bool operator()(size_t a, size_t b) const
+    {
+        return less(options.at(a).long_opt, options.at(b).long_opt);
+    }
+    
+    bool operator()(size_t a, const wcstring &b) const
+    {
+        return less(options.at(a).long_opt, b);
+    }
+    
+    bool operator()(const wcstring &a, size_t b) const
+    {
+        return less(a, options.at(b).long_opt);
+    }
+};
+
+/** Orders indexes of options by the short options of the options */
+class short_opt_less_t
+{
+    const option_list_t &options;
+    
+    public:
+    
+    short_opt_less_t(const option_list_t &o) : options(o)
+    {
+    }
+    
+    bool operator()(size_t a, size_t b) const
+    {
+        return options.at(a).short_opt < options.at(b).short_opt;
+    }
+    
+    bool operator()(size_t a, wchar_t b) const
+    {
+        return options.at(a).short_opt < b;
+    }
+    
+    bool operator()(wchar_t a, size_t b) const
+    {
+        return a < options.at(b).short_opt;
+    }
+};
+
+void option_set_t::rebuild_index()
+{
+    long_index.clear();
+    short_index.clear();
+    arg_index.clear();
+    for (size_t i=0; i < options.size(); i++)
+    {
+        const complete_entry_opt_t &o = options.at(i);
+        if (! o.long_opt.empty())
+            long_index.push_back(i);
+        if (o.short_opt != L'\0')
+            short_index.push_back(i);
+        if (o.long_opt.empty() && o.short_opt == L'\0')
+            arg_index.push_back(i);
+    }
+    nocase_index = long_index;
+    std::stable_sort(long_index.begin(), long_index.end(), long_opt_less_t(options));
+    std::stable_sort(nocase_index.begin(), nocase_index.end(), long_opt_less_t(options, true));
+    std::stable_sort(short_index.begin(), short_index.end(), short_opt_less_t(options));
+    indexed = true;
+}
+
+void option_set_t::add(const complete_entry_opt_t &opt)
+{
+    options.push_back(opt);
+    indexed = false;
+}
+
+std::vector<size_t>::const_iterator option_set_t::find_long(const wcstring &long_opt) const
+{
+    assert(indexed);
+    return std::lower_bound(long_index.begin(), long_index.end(), long_opt, long_opt_less_t(options));
+}
+
+const complete_entry_opt_t *option_set_t::find_short(wchar_t short_opt) const
+{
+    assert(indexed);
+    std::vector<size_t>::const_iterator iter = std::lower_bound(short_index.begin(), short_index.end(), short_opt, short_opt_less_t(options));
+    if (iter == short_index.end() || options.at(*iter).short_opt != short_opt)
+        return NULL;
+    return &options.at(*iter);
+}
+
+void option_set_t::short_matches(wchar_t short_opt, std::vector<size_t> &out) const
+{
+    assert(indexed);
+    std::pair<std::vector<size_t>::const_iterator, std::vector<size_t>::const_iterator> range = std::equal_range(short_index.begin(), short_index.end(), short_opt, short_opt_less_t(options));
+    out.insert(out.end(), range.first, range.second);
+}
+
+void option_set_t::long_matches(const wcstring &long_opt, std::vector<size_t> &out) const
+{
+    for (std::vector<size_t>::const_iterator iter = find_long(long_opt); iter != long_index.end() && options.at(*iter).long_opt == long_opt; ++iter)
+    {
+        out.push_back(*iter);
+    }
+}
+
+void option_set_t::long_prefix_matches_nocase(const wcstring &prefix, std::vector<size_t> &out) const
+{
+    assert(indexed);
+    /* The long options that start with the prefix in any case are next to each other in the index */
+    std::vector<size_t>::const_iterator iter = std::lower_bound(nocase_index.begin(), nocase_index.end(), prefix, long_opt_less_t(options, true));
+    for (; iter != nocase_index.end(); ++iter)
+    {
+        if (wcsncasecmp(options.at(*iter).long_opt.c_str(), prefix.c_str(), prefix.size()) != 0)
+            break;
+        out.push_back(*iter);
+    }
+}
+
+/**
+   Sorts indexes of options newest first, the order options are tried
+   in, and removes duplicates
+*/
+static void sort_newest_first(std::vector<size_t> &matches)
+{
+    std::sort(matches.begin(), matches.end(), std::greater<size_t>());
+    matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+}
+
+/** The options of entries without any */
+static const option_set_ref_t kNoOptions(new option_set_t());
+
+option_set_t &completion_entry_t::edit_options() {
+    ASSERT_IS_LOCKED(completion_entry_lock);
+    if (! options)
+    {
+        options.reset(new option_set_t());
+    }
+    else if (! options.unique())
+    {
+        options.reset(new option_set_t(*options));
+    }
+    return *options;
+}
+
 void completion_entry_t::add_option(const complete_entry_opt_t &opt) {
     ASSERT_IS_LOCKED(completion_entry_lock);
-    options.push_front(opt);
+    edit_options().add(opt);
 }
 
-const option_list_t &completion_entry_t::get_options() const {
+option_set_ref_t completion_entry_t::get_options() const {
     ASSERT_IS_LOCKED(completion_entry_lock);
+    if (! options)
+        return kNoOptions;
+    
+    /* A set that isn't indexed hasn't been shared since it changed, so nothing else can be reading it */
+    if (! options->indexed)
+        options->rebuild_index();
     return options;
 }
 
-wcstring &completion_entry_t::get_short_opt_str() {
-    ASSERT_IS_LOCKED(completion_entry_lock);
-    return short_opt_str;
+/** Table of completion conditions and their test results */
+typedef std::map<wcstring, bool> condition_cache_t;
+
+/**
+   Results of conditions kept between completions, and the working
+   directory and command line before the token being completed that
+   they were tested with. Only used from the main thread.
+*/
+static condition_cache_t kept_conditions;
+static wcstring kept_conditions_pwd, kept_conditions_prefix;
+
+/** Whether the condition being tested has read more than the command line before the token being completed */
+static bool condition_read_token = false;
+
+void complete_forget_conditions()
+{
+    ASSERT_IS_MAIN_THREAD();
+    kept_conditions.clear();
+    kept_conditions_pwd.clear();
+    kept_conditions_prefix.clear();
 }
 
-const wcstring &completion_entry_t::get_short_opt_str() const {
-    ASSERT_IS_LOCKED(completion_entry_lock);
-    return short_opt_str;    
+void complete_condition_reads_token()
+{
+    condition_read_token = true;
+}
+
+/** A completion found by fuzzy matching, and how well it matched */
+struct fuzzy_completion_t
+{
+    completion_t completion;
+    fuzzy_match_t match;
+
+    fuzzy_completion_t(const completion_t &c, const fuzzy_match_t &m) : completion(c), match(m) { }
+};
+
+/** Orders fuzzy completions by how well they matched */
+struct fuzzy_completion_less_t
+{
+    bool operator()(const fuzzy_completion_t &a, const fuzzy_completion_t &b) const
+    {
+        return a.match < b.match;
+    }
+};
+
+/**
+   Files of the token being completed, expanded on a background thread
+   while the main thread finds the completions that need the parser.
+   Whoever needs the files first expands them itself if the background
+   thread hasn't started yet, and otherwise waits for it. It is shared
+   by the completer and the background thread, so that either can go
+   away first.
+*/
+class file_expansion_t
+{
+    /** The string to expand, and how */
+    const wcstring str;
+    const expand_flags_t flags;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    enum
+    {
+        EXPANSION_PENDING,
+        EXPANSION_RUNNING,
+        EXPANSION_DONE,
+        EXPANSION_TAKEN
+    } state;
+
+    /** The files found by the background thread */
+    std::vector<completion_t> results;
+
+    /* No copying */
+    file_expansion_t(const file_expansion_t &);
+    void operator=(const file_expansion_t &);
+
+    public:
+
+    file_expansion_t(const wcstring &s, expand_flags_t f) : str(s), flags(f), state(EXPANSION_PENDING)
+    {
+        VOMIT_ON_FAILURE(pthread_mutex_init(&lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&cond, NULL));
+    }
+
+    ~file_expansion_t()
+    {
+        VOMIT_ON_FAILURE(pthread_cond_destroy(&cond));
+        VOMIT_ON_FAILURE(pthread_mutex_destroy(&lock));
+    }
+
+    /** Expands the files, unless they have been taken or are no longer needed. Called on the background thread. */
+    void run()
+    {
+        {
+            scoped_lock locker(lock);
+            if (state != EXPANSION_PENDING)
+                return;
+            state = EXPANSION_RUNNING;
+        }
+
+        TRACE_SCOPE("file_expansion");
+        if (expand_string(str, results, flags) == EXPAND_ERROR)
+            debug( 3, L"Error while expanding string '%ls'", str.c_str() );
+
+        scoped_lock locker(lock);
+        state = EXPANSION_DONE;
+        VOMIT_ON_FAILURE(pthread_cond_broadcast(&cond));
+    }
+
+    /** Appends the files to out, expanding them here if the background thread hasn't started on them. May only be called once. */
+    void take(std::vector<completion_t> &out)
+    {
+        scoped_lock locker(lock);
+        assert(state != EXPANSION_TAKEN);
+        if (state == EXPANSION_PENDING)
+        {
+            state = EXPANSION_TAKEN;
+            locker.unlock();
+            if (expand_string(str, out, flags) == EXPAND_ERROR)
+                debug( 3, L"Error while expanding string '%ls'", str.c_str() );
+            return;
+        }
+
+        while (state == EXPANSION_RUNNING)
+            VOMIT_ON_FAILURE(pthread_cond_wait(&cond, &lock));
+        state = EXPANSION_TAKEN;
+        completions_append(out, results);
+        results.clear();
+    }
+
+    /** Whether these are the files of the string s, expanded with the flags f */
+    bool is_for(const wcstring &s, expand_flags_t f) const
+    {
+        return str == s && flags == f;
+    }
+
+    /** Tells the background thread the files are not needed, in case it hasn't started on them */
+    void cancel()
+    {
+        scoped_lock locker(lock);
+        if (state == EXPANSION_PENDING)
+            state = EXPANSION_TAKEN;
+    }
+};
+typedef std::tr1::shared_ptr<file_expansion_t> file_expansion_ref_t;
+
+/** Expands files on a background thread. The reference is dropped right away, rather than when the main thread gets around to the completion callback, so that unused files are freed soon. */
+static int expand_files_in_background(file_expansion_ref_t *expansion)
+{
+    (*expansion)->run();
+    delete expansion;
+    return 0;
+}
+
+static void expanded_files_in_background(file_expansion_ref_t *expansion, int result)
+{
+}
+
+/** The number of seconds for which files expanded by complete_prewarm are used */
+#define PREWARM_TIMEOUT 30
+
+/**
+   Files expanded by complete_prewarm for the next completion of the
+   same token, and the working directory and time they were expanded
+   with. Only used from the main thread.
+*/
+static file_expansion_ref_t prewarmed_files;
+static wcstring prewarmed_files_pwd;
+static double prewarmed_files_when = 0;
+
+void complete_forget_prewarmed()
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (prewarmed_files)
+        prewarmed_files->cancel();
+    prewarmed_files.reset();
 }
 
 /** Class representing an attempt to compute completions */
@@ -256,21 +671,99 @@ class completer_t {
     const complete_type_t type;
     const wcstring initial_cmd;
     std::vector<completion_t> completions;
+
+    /** Completions that only matched the token fuzzily. They are used if nothing else matches. */
+    std::vector<fuzzy_completion_t> fuzzy_completions;
     wcstring_list_t commands_to_load;
     
     /** Table of completions conditions that have already been tested and the corresponding test results */
-    typedef std::map<wcstring, bool> condition_cache_t;
     condition_cache_t condition_cache;
-    
+
+    /** Whether condition results may be kept for the next completion */
+    bool keep_conditions;
+
+    /** Called before running the parser. If it returns true, the rest of the work needing the main thread is skipped */
+    bool (*stop_func)(void);
+
+    /** Whether stop_func has returned true */
+    bool stopped;
+
+    /** Whether expanding files is left for complete_deferred, which may run on a background thread */
+    bool defer_files;
+
+    /** What expansion complete_param_expand or complete_cmd left for complete_deferred */
+    enum
+    {
+        DEFER_NONE,
+        DEFER_PARAM,
+        DEFER_COMMAND
+    } deferred;
+
+    /** The string to expand in complete_deferred */
+    wcstring deferred_str;
+
+    /** For DEFER_PARAM, whether to complete files. For DEFER_COMMAND, whether the found commands should be described. */
+    bool deferred_flag;
+
+    /** Completions found by complete_deferred. They are kept apart until complete_finish_deferred, so that the main thread can look at the others meanwhile */
+    std::vector<completion_t> deferred_completions;
+
+    /** The files of the token being expanded on a background thread since start_expanding_files, or NULL */
+    file_expansion_ref_t file_expansion;
+
+    /** Returns the part of the token that complete_param_expand expands, and the flags to expand it with */
+    const wchar_t *param_expand_str( const wcstring &str ) const;
+    expand_flags_t param_expand_flags( bool do_file ) const;
+
+    /** Expands the string for complete_param_expand, into the specified list */
+    void expand_param( const wcstring &str, bool do_file, std::vector<completion_t> &out );
+
+    /** Finds command files for complete_cmd, into the specified list. Returns whether they should be described. */
+    bool complete_cmd_files( const wcstring &str_cmd, std::vector<completion_t> &out );
+
     public:
     completer_t(const wcstring &c, complete_type_t t) :
         type(t),
-        initial_cmd(c)
+        initial_cmd(c),
+        keep_conditions(false),
+        stop_func(NULL),
+        stopped(false),
+        defer_files(false),
+        deferred(DEFER_NONE),
+        deferred_flag(false)
     {
     }
+
+    ~completer_t()
+    {
+        if (file_expansion)
+            file_expansion->cancel();
+    }
+
+    /** Leave expanding files for complete_deferred, and call stop before every use of the parser */
+    void set_defer_files(bool (*stop)(void)) {
+        defer_files = true;
+        stop_func = stop;
+    }
+
+    /** Whether the work needing the main thread should stop. Once it returns true, it keeps doing so. */
+    bool should_stop() {
+        if (! stopped && stop_func && stop_func())
+            stopped = true;
+        return stopped;
+    }
+
+    void complete_deferred();
+    void complete_finish_deferred();
     
     bool empty() const { return completions.empty(); }
     const std::vector<completion_t> &get_completions(void) { return completions; }
+
+    /** Replace the contents of the list with the completions found, without copying them */
+    void swap_completions(std::vector<completion_t> &lst) {
+        lst.clear();
+        lst.swap(completions);
+    }
     
     bool try_complete_variable( const wcstring &str );
     bool try_complete_user( const wcstring &str );
@@ -281,6 +774,16 @@ class completer_t {
                          bool use_switches);
                          
     void complete_param_expand(const wcstring &str, bool do_file);
+
+    void start_expanding_files(const wcstring &str);
+
+    /** Gives up the files being expanded on a background thread, without cancelling them */
+    file_expansion_ref_t release_file_expansion()
+    {
+        file_expansion_ref_t result;
+        result.swap(file_expansion);
+        return result;
+    }
     
     void debug_print_completions();
     
@@ -294,11 +797,22 @@ class completer_t {
                              const wcstring &desc,
                              complete_flags_t flags );
                        
-    void complete_cmd_desc( const wcstring &str );
+    void complete_cmd_desc( const wcstring &str, std::vector<completion_t> &comps );
                           
     bool complete_variable(const wcstring &str, int start_offset);
     
     bool condition_test( const wcstring &condition );
+
+    void use_kept_conditions( const wcstring &prefix );
+
+    void load_lazy_sections( const wcstring &cmd, const wcstring &path );
+
+    void use_fuzzy_completions();
+
+    /** Fuzzy matches are only wanted when the user asked for completions, not for autosuggestions */
+    std::vector<fuzzy_completion_t> *fuzzy_out() {
+        return type == COMPLETE_DEFAULT ? &fuzzy_completions : NULL;
+    }
     
     expand_flags_t expand_flags() const {
         /* Never do command substitution in autosuggestions */
@@ -346,11 +860,28 @@ void completion_allocate(std::vector<completion_t> &completions, const wcstring
     completions.push_back(completion_t(comp, desc, flags));
 }
 
+void completions_append(std::vector<completion_t> &to, std::vector<completion_t> &from)
+{
+    if (to.empty())
+    {
+        to.swap(from);
+        return;
+    }
+
+    for (size_t i=0; i < from.size(); i++)
+    {
+        to.push_back(completion_t(wcstring()));
+        to.back().swap(from.at(i));
+    }
+    from.clear();
+}
+
 /**
    Test if the specified script returns zero. The result is cached, so
    that if multiple completions use the same condition, it needs only
-   be evaluated once. condition_cache_clear must be called after a
-   completion run to make sure that there are no stale completions.
+   be evaluated once. If use_kept_conditions was called, results are
+   also kept for the next completions of the same command line, except
+   for conditions that read the token being completed.
 */
 bool completer_t::condition_test( const wcstring &condition )
 {    
@@ -370,29 +901,145 @@ bool completer_t::condition_test( const wcstring &condition )
     
     bool test_res;
     condition_cache_t::iterator cached_entry = condition_cache.find(condition);
-    if (cached_entry == condition_cache.end()) {
+    if (cached_entry != condition_cache.end()) {
+        /* Use the old value */
+        test_res = cached_entry->second;
+    } else if (keep_conditions && (cached_entry = kept_conditions.find(condition)) != kept_conditions.end()) {
+        /* Use the value from an earlier completion */
+        test_res = cached_entry->second;
+        condition_cache[condition] = test_res;
+    } else if (this->should_stop()) {
+        /* The completion is being abandoned, so don't spend time on it or remember the result */
+        test_res = false;
+    } else {
         /* Compute new value and reinsert it */
+        bool outer_read_token = condition_read_token;
+        condition_read_token = false;
         test_res = (0 == exec_subshell( condition));
         condition_cache[condition] = test_res;
-    } else {
-        /* Use the old value */
-        test_res = cached_entry->second;
+        if (keep_conditions && ! condition_read_token)
+            kept_conditions[condition] = test_res;
+        condition_read_token = condition_read_token || outer_read_token;
     }
     return test_res;
 }
 
+/**
+   If nothing matched the token, use the fuzzy matches of the best kind
+   that was found instead, best matches first. Substring matches are
+   better than subsequence matches, and for each kind, the fewer
+   characters were skipped, the better.
+*/
+void completer_t::use_fuzzy_completions()
+{
+    if( ! completions.empty() || fuzzy_completions.empty() )
+        return;
+
+    std::stable_sort( fuzzy_completions.begin(), fuzzy_completions.end(), fuzzy_completion_less_t() );
+    const fuzzy_match_type_t best = fuzzy_completions.front().match.type;
+    for( size_t i=0; i<fuzzy_completions.size() && fuzzy_completions.at( i ).match.type == best; i++ )
+    {
+        completions.push_back( fuzzy_completions.at( i ).completion );
+    }
+}
+
+/**
+   Lets condition_test use and keep results from earlier completions,
+   forgetting them first if they were tested with a different working
+   directory or command line before the token being completed.
+*/
+void completer_t::use_kept_conditions( const wcstring &prefix )
+{
+    ASSERT_IS_MAIN_THREAD();
+    const env_var_t pwd = env_get_string( L"PWD" );
+    if( prefix != kept_conditions_prefix || pwd != kept_conditions_pwd )
+    {
+        complete_forget_conditions();
+        kept_conditions_prefix = prefix;
+        kept_conditions_pwd = pwd;
+    }
+    keep_conditions = true;
+}
+
+
+/** Returns whether an entry for the specified command is matched as a wildcard */
+static bool complete_is_pattern( const wcstring &cmd )
+{
+    return wildcard_has( cmd.c_str(), 1 ) != 0;
+}
 
 /** Search for an exactly matching completion entry. Must be called while locked. */
 static completion_entry_t *complete_find_exact_entry( const wchar_t *cmd, const bool cmd_is_path )
 {
     ASSERT_IS_LOCKED(completion_lock);
-    completion_entry_t *result = NULL;
-    completion_entry_t tmp_entry(cmd, cmd_is_path, L"", false);
-    completion_entry_set_t::iterator iter = completion_set.find(&tmp_entry);
-    if (iter != completion_set.end()) {
-        result = *iter;
+    const wcstring key(cmd);
+    if (complete_is_pattern(key))
+    {
+        for (size_t i=0; i < completion_patterns.size(); i++)
+        {
+            completion_entry_t *e = completion_patterns.at(i);
+            if (e->cmd_is_path == cmd_is_path && e->cmd == key)
+                return e;
+        }
+        return NULL;
     }
-	return result;
+    
+    const completion_entry_map_t &map = completion_entries[cmd_is_path];
+    completion_entry_map_t::const_iterator iter = map.find(key);
+	return iter == map.end() ? NULL : iter->second;
+}
+
+/** Removes an entry from the entries, without deleting it. Must be called while locked. */
+static void complete_erase_entry( completion_entry_t *entry )
+{
+    ASSERT_IS_LOCKED(completion_lock);
+    if (complete_is_pattern(entry->cmd))
+    {
+        completion_patterns.erase(std::find(completion_patterns.begin(), completion_patterns.end(), entry));
+    }
+    else
+    {
+        completion_entries[entry->cmd_is_path].erase(entry->cmd);
+    }
+}
+
+/**
+   Appends the entries that apply to the command cmd, which was found
+   at path, to out. Must be called while locked.
+*/
+static void complete_find_entries( const wcstring &cmd, const wcstring &path, std::vector<completion_entry_t *> &out )
+{
+    ASSERT_IS_LOCKED(completion_lock);
+    const size_t start = out.size();
+    for (int cmd_is_path = 0; cmd_is_path < 2; cmd_is_path++)
+    {
+        const completion_entry_map_t &map = completion_entries[cmd_is_path];
+        completion_entry_map_t::const_iterator iter = map.find(cmd_is_path ? path : cmd);
+        if (iter != map.end())
+            out.push_back(iter->second);
+    }
+    
+    for (size_t i=0; i < completion_patterns.size(); i++)
+    {
+        completion_entry_t *e = completion_patterns.at(i);
+        if (wildcard_match(e->cmd_is_path ? path : cmd, e->cmd))
+            out.push_back(e);
+    }
+    
+    std::sort(out.begin() + start, out.end(), completion_entry_less_t());
+}
+
+/** Appends all entries to out, in no particular order. Must be called while locked. */
+static void complete_all_entries( std::vector<completion_entry_t *> &out )
+{
+    ASSERT_IS_LOCKED(completion_lock);
+    for (int cmd_is_path = 0; cmd_is_path < 2; cmd_is_path++)
+    {
+        const completion_entry_map_t &map = completion_entries[cmd_is_path];
+        for (completion_entry_map_t::const_iterator iter = map.begin(); iter != map.end(); ++iter)
+            out.push_back(iter->second);
+    }
+    out.insert(out.end(), completion_patterns.begin(), completion_patterns.end());
 }
 
 /** Locate the specified entry. Create it if it doesn't exist. Must be called while locked. */
@@ -405,8 +1052,11 @@ static completion_entry_t *complete_get_exact_entry( const wchar_t *cmd, bool cm
 
 	if( c == NULL )
 	{
-        c = new completion_entry_t(cmd, cmd_is_path, L"", true);
-        completion_set.insert(c);
+        c = new completion_entry_t(cmd, cmd_is_path, true);
+        if (complete_is_pattern(c->cmd))
+            completion_patterns.push_back(c);
+        else
+            completion_entries[cmd_is_path][c->cmd] = c;
 	}
 
 	return c;
@@ -448,17 +1098,6 @@ void complete_add( const wchar_t *cmd,
         
     /* Create our new option */
     complete_entry_opt_t opt;
-	if( short_opt != L'\0' )
-	{
-		int len = 1 + ((result_mode & NO_COMMON) != 0);
-        
-        c->get_short_opt_str().push_back(short_opt);
-		if( len == 2 )
-		{
-            c->get_short_opt_str().push_back(L':');
-		}
-	}
-	
 	opt.short_opt = short_opt;
 	opt.result_mode = result_mode;
 	opt.old_mode=old_mode;
@@ -472,9 +1111,29 @@ void complete_add( const wchar_t *cmd,
     c->add_option(opt);
 }
 
+void complete_add_lazy( const wchar_t *cmd,
+						bool cmd_is_path,
+						const wchar_t *condition,
+						const wchar_t *script )
+{
+	CHECK( cmd, );
+	CHECK( script, );
+    
+    scoped_lock lock(completion_lock);
+    scoped_lock lock2(completion_entry_lock);
+    
+	completion_entry_t *c = complete_get_exact_entry( cmd, cmd_is_path );
+    
+    lazy_section_t section;
+    if (condition) section.condition = condition;
+    section.script = script;
+    c->lazy_sections.push_back(section);
+}
+
 /**
    Remove all completion options in the specified entry that match the
-   specified short / long option strings. Returns true if it is now
+   specified short / long option strings. If neither is specified, the
+   lazy sections are removed too. Returns true if it is now
    empty and should be deleted, false if it's not empty. Must be called while locked.
 */
 bool completion_entry_t::remove_option( wchar_t short_opt, const wchar_t *long_opt )
@@ -483,36 +1142,25 @@ bool completion_entry_t::remove_option( wchar_t short_opt, const wchar_t *long_o
     ASSERT_IS_LOCKED(completion_entry_lock);
 	if(( short_opt == 0 ) && (long_opt == 0 ) )
 	{
-        this->options.clear();
+        this->options.reset();
+        this->lazy_sections.clear();
 	}
-	else
+	else if (this->options)
 	{
-        for (option_list_t::iterator iter = this->options.begin(); iter != this->options.end(); )
+        option_set_t &set = this->edit_options();
+        for (option_list_t::iterator iter = set.options.begin(); iter != set.options.end(); )
 		{
             complete_entry_opt_t &o = *iter;
-			if(short_opt==o.short_opt || long_opt == o.long_opt)
+			if(short_opt==o.short_opt || (long_opt && long_opt == o.long_opt))
 			{
 				/*			fwprintf( stderr,
 							L"remove option -%lc --%ls\n",
 							o->short_opt?o->short_opt:L' ',
 							o->long_opt );
 				*/
-				if( o.short_opt )
-				{
-                    wcstring &short_opt_str = this->get_short_opt_str();
-                    size_t idx = short_opt_str.find(o.short_opt);
-                    if (idx != wcstring::npos)
-                    {
-                        /* Consume all colons */
-                        size_t first_non_colon = idx + 1;
-                        while (first_non_colon < short_opt_str.size() && short_opt_str.at(first_non_colon) == L':')
-                            first_non_colon++;
-                        short_opt_str.erase(idx, first_non_colon - idx);
-                    }
-				}
                 
                 /* Destroy this option and go to the next one */
-				iter = this->options.erase(iter);
+				iter = set.options.erase(iter);
 			}
 			else
 			{
@@ -520,8 +1168,9 @@ bool completion_entry_t::remove_option( wchar_t short_opt, const wchar_t *long_o
 				++iter;
 			}
 		}
+        set.indexed = false;
 	}
-    return this->options.empty();
+    return this->get_options()->options.empty() && this->lazy_sections.empty();
 }
 
 
@@ -534,14 +1183,12 @@ void complete_remove( const wchar_t *cmd,
     scoped_lock lock(completion_lock);
     scoped_lock lock2(completion_entry_lock);
     
-    completion_entry_t tmp_entry(cmd, cmd_is_path, L"", false);
-    completion_entry_set_t::iterator iter = completion_set.find(&tmp_entry);
-    if (iter != completion_set.end()) {
-        completion_entry_t *entry = *iter;
+    completion_entry_t *entry = complete_find_exact_entry(cmd, cmd_is_path);
+    if (entry) {
         bool delete_it = entry->remove_option(short_opt, long_opt);
         if (delete_it) {
             /* Delete this entry */
-            completion_set.erase(iter);
+            complete_erase_entry(entry);
             delete entry;
         }
     }
@@ -653,66 +1300,63 @@ int complete_is_valid_option( const wchar_t *str,
 
 	scoped_lock lock(completion_lock);
     scoped_lock lock2(completion_entry_lock);
-    for (completion_entry_set_t::const_iterator iter = completion_set.begin(); iter != completion_set.end(); ++iter)
+    std::vector<completion_entry_t *> entries;
+    complete_find_entries( cmd, path, entries );
+    for (std::vector<completion_entry_t *>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
 	{
         const completion_entry_t *i = *iter;
-		const wcstring &match = i->cmd_is_path ? path : cmd;
 		const wchar_t *a;
-
-		if( !wildcard_match( match, i->cmd ) )
-		{
-			continue;
-		}
 		
 		found_match = 1;
 
-		if( !i->authoritative )
+		/* Options in sections that haven't been added yet are unknown */
+		if( !i->authoritative || !i->lazy_sections.empty() )
 		{
 			authoritative = 0;
 			break;
 		}
 
-        const option_list_t &options = i->get_options();
+        const option_set_ref_t set = i->get_options();
 		if( is_gnu_opt )
 		{
-            for (option_list_t::const_iterator iter = options.begin(); iter != options.end(); ++iter)
+            /* The long options that start with what has been typed are next to each other in the index */
+            const wcstring prefix(&opt[2], gnu_opt_len);
+            for (std::vector<size_t>::const_iterator iter = set->find_long(prefix); iter != set->long_index.end(); ++iter)
             {
-                const complete_entry_opt_t &o = *iter;
+                const complete_entry_opt_t &o = set->options.at(*iter);
+				if( ! string_prefixes_string(prefix, o.long_opt) )
+				{
+					break;
+				}
+				
 				if (o.old_mode )
 				{
 					continue;
 				}
 				
-				if (wcsncmp(&opt[2], o.long_opt.c_str(), gnu_opt_len) == 0)
+                gnu_match_set.insert(o.long_opt);
+				if( o.long_opt == prefix )
 				{
-                    gnu_match_set.insert(o.long_opt);
-					if( (wcsncmp( &opt[2],
-								  o.long_opt.c_str(),
-                                  o.long_opt.size())==0) )
-					{
-						is_gnu_exact=1;
-					}
+					is_gnu_exact=1;
 				}
 			}
 		}
 		else
 		{
 			/* Check for old style options */
-            for (option_list_t::const_iterator iter = options.begin(); iter != options.end(); ++iter)
+            const wcstring long_opt(&opt[1]);
+            for (std::vector<size_t>::const_iterator iter = set->find_long(long_opt); iter != set->long_index.end(); ++iter)
 			{
-                const complete_entry_opt_t &o = *iter;
+                const complete_entry_opt_t &o = set->options.at(*iter);
+				if( o.long_opt != long_opt )
+					break;
                 
-				if( !o.old_mode )
-					continue;
-
-
-				if( wcscmp( &opt[1], o.long_opt.c_str() )==0)
+				if( o.old_mode )
 				{
 					opt_found = 1;
 					is_old_opt = 1;
 					break;
 				}
-
 			}
 
 			if( is_old_opt )
@@ -721,12 +1365,11 @@ int complete_is_valid_option( const wchar_t *str,
 
 			for( a = &opt[1]; *a; a++ )
 			{
-
-                const wcstring &short_opt_str = i->get_short_opt_str();
-                size_t str_idx = short_opt_str.find(*a);                
-				if  (str_idx != wcstring::npos )
+                /* The oldest option with a short option decides whether it takes an argument */
+                const complete_entry_opt_t *o = set->find_short(*a);
+				if( o )
 				{
-					if (str_idx + 1 < short_opt_str.size() && short_opt_str.at(str_idx + 1) == L':' )
+					if( o->result_mode & NO_COMMON )
 					{
 						/*
 						  This is a short option with an embedded argument,
@@ -834,7 +1477,8 @@ static void complete_strings( std::vector<completion_t> &comp_out,
 							  const wchar_t *desc,
 							  wcstring (*desc_func)(const wcstring &),
 							  std::vector<completion_t> &possible_comp,
-							  complete_flags_t flags )
+							  complete_flags_t flags,
+							  std::vector<fuzzy_completion_t> *fuzzy_out = NULL )
 {
     wcstring tmp = wc_escaped;
     if (! expand_one(tmp, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_WILDCARDS))
@@ -853,14 +1497,115 @@ static void complete_strings( std::vector<completion_t> &comp_out,
 		}
 	}
 
+	/*
+	  Also find the strings that contain the characters of the token
+	  in order. A wildcard that didn't match means what it says, so they
+	  are not fuzzy matched.
+	*/
+	if( fuzzy_out && ! wildcard_has( wc, 1 ) )
+	{
+		const fuzzy_matcher_t matcher( wc );
+		std::vector<completion_t> found;
+		for( size_t i=0; i< possible_comp.size(); i++ )
+		{
+			const wcstring &next = possible_comp.at( i ).completion;
+			const fuzzy_match_t match = matcher.match( next.c_str(), std::min( next.find( PROG_COMPLETE_SEP ), next.size() ) );
+			if( match.type != FUZZY_MATCH_SUBSTRING && match.type != FUZZY_MATCH_SUBSEQUENCE )
+				continue;
+
+			/* Matching against the empty wildcard gives the whole string, with the same description as above */
+			found.clear();
+			wildcard_complete( next, L"", desc, desc_func, found, flags | COMPLETE_NO_CASE | COMPLETE_FUZZY );
+			for( size_t j=0; j<found.size(); j++ )
+			{
+				fuzzy_out->push_back( fuzzy_completion_t( found.at( j ), match ) );
+			}
+		}
+	}
+
 	free( (void *)wc );
 }
 
+/** Table of command names and their descriptions */
+typedef std::map<wcstring, wcstring> cmd_desc_map_t;
+
+/**
+   The descriptions found by __fish_describe_command, for every prefix
+   it was run with, and the value of PATH when they were found. Only
+   used from the main thread.
+*/
+static std::map<wcstring, cmd_desc_map_t> cmd_desc_cache;
+static wcstring cmd_desc_cache_path;
+
+/**
+   Returns the descriptions of the commands whose names start with the
+   specified prefix, or NULL if they can't be found. The descriptions
+   are remembered until PATH changes. Since __fish_describe_command
+   finds all commands starting with the prefix, the descriptions for a
+   prefix of it are used if they are known.
+*/
+static const cmd_desc_map_t *get_cmd_descs( const wcstring &prefix )
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    const env_var_t path = env_get_string( L"PATH" );
+    if( path != cmd_desc_cache_path )
+    {
+        cmd_desc_cache.clear();
+        cmd_desc_cache_path = path;
+    }
+
+    for( size_t len = prefix.size(); len >= 2; len-- )
+    {
+        std::map<wcstring, cmd_desc_map_t>::const_iterator iter = cmd_desc_cache.find( wcstring( prefix, 0, len ) );
+        if( iter != cmd_desc_cache.end() )
+            return &iter->second;
+    }
+
+    wcstring lookup_cmd(L"__fish_describe_command ");
+    lookup_cmd.append(escape_string(prefix, 1));
+
+	/*
+	  Locate a list of possible descriptions using a single call to
+	  apropos or a direct search if we know the location of the
+	  whatis database. This can take some time on slower systems
+	  with a large set of manuals, but it should be ok since apropos
+	  is only called once for every prefix.
+	*/
+    wcstring_list_t list;
+	if( exec_subshell( lookup_cmd, list ) == -1 )
+        return NULL;
+
+    cmd_desc_map_t &descs = cmd_desc_cache[prefix];
+    for( size_t i=0; i < list.size(); i++ )
+    {
+        const wcstring &elstr = list.at(i);
+
+        size_t tab_idx = elstr.find(L'\t');
+        if( tab_idx == wcstring::npos )
+            continue;
+
+        const wcstring key(elstr, 0, tab_idx);
+        wcstring val(elstr, tab_idx + 1);
+
+        /*
+          And once again I make sure the first character is uppercased
+          because I like it that way, and I get to decide these
+          things.
+        */
+        if (! val.empty())
+            val[0]=towupper(val[0]);
+
+        descs[key] = val;
+    }
+    return &descs;
+}
+
 /**
    If command to complete is short enough, substitute
    the description with the whatis information for the executable.
 */
-void completer_t::complete_cmd_desc( const wcstring &str )
+void completer_t::complete_cmd_desc( const wcstring &str, std::vector<completion_t> &comps )
 {
     ASSERT_IS_MAIN_THREAD();
     
@@ -893,9 +1638,9 @@ void completer_t::complete_cmd_desc( const wcstring &str )
 
 	skip = 1;
 	
-	for( size_t i=0; i< this->completions.size(); i++ )
+	for( size_t i=0; i< comps.size(); i++ )
 	{
-		const completion_t &c = this->completions.at ( i );
+		const completion_t &c = comps.at ( i );
 			
 		if( c.completion.empty() || (c.completion[c.completion.size()-1] != L'/' )) 
 		{
@@ -907,77 +1652,33 @@ void completer_t::complete_cmd_desc( const wcstring &str )
 	
 	if( skip )
 	{
-		return;
-	}
-	
-
-    wcstring lookup_cmd(L"__fish_describe_command ");
-    lookup_cmd.append(escape_string(cmd_start, 1));
-
-    std::map<wcstring, wcstring> lookup;
-
-	/*
-	  First locate a list of possible descriptions using a single
-	  call to apropos or a direct search if we know the location
-	  of the whatis database. This can take some time on slower
-	  systems with a large set of manuals, but it should be ok
-	  since apropos is only called once.
-	*/
-    wcstring_list_t list;
-	if( exec_subshell( lookup_cmd, list ) != -1 )
-	{
-	
-		/*
-		  Then discard anything that is not a possible completion and put
-		  the result into a hashtable with the completion as key and the
-		  description as value.
-
-		  Should be reasonably fast, since no memory allocations are needed.
-		*/
-		for( size_t i=0; i < list.size(); i++ )
-		{
-            const wcstring &elstr = list.at(i);
-            
-            const wcstring fullkey(elstr, wcslen(cmd_start));
-            
-            size_t tab_idx = fullkey.find(L'\t');
-			if( tab_idx == wcstring::npos )
-				continue;
-            
-            const wcstring key(fullkey, 0, tab_idx);
-            wcstring val(fullkey, tab_idx + 1);
-
-			/*
-			  And once again I make sure the first character is uppercased
-			  because I like it that way, and I get to decide these
-			  things.
-			*/
-            if (! val.empty())
-                val[0]=towupper(val[0]);
-		
-            lookup[key] = val;
-		}
-
-		/*
-		  Then do a lookup on every completion and if a match is found,
-		  change to the new description.
-
-		  This needs to do a reallocation for every description added, but
-		  there shouldn't be that many completions, so it should be ok.
-		*/
-		for( size_t i=0; i<this->completions.size(); i++ )
-		{
-            completion_t &completion = this->completions.at(i);
-            const wcstring &el = completion.completion;
-            if (el.empty())
-                continue;
-            
-            std::map<wcstring, wcstring>::iterator new_desc_iter = lookup.find(el);
-            if (new_desc_iter != lookup.end())
-                completion.description = new_desc_iter->second;
-		}
+		return;
 	}
 	
+
+    const cmd_desc_map_t *lookup = get_cmd_descs( cmd_start );
+    if( ! lookup )
+        return;
+
+	/*
+	  Do a lookup on every completion and if a match is found, change
+	  to the new description.
+	*/
+    const wcstring prefix = cmd_start;
+    wcstring name;
+	for( size_t i=0; i<comps.size(); i++ )
+	{
+        completion_t &completion = comps.at(i);
+        const wcstring &el = completion.completion;
+        if (el.empty())
+            continue;
+
+        name = prefix;
+        name.append(el);
+        cmd_desc_map_t::const_iterator new_desc_iter = lookup->find(name);
+        if (new_desc_iter != lookup->end())
+            completion.description = new_desc_iter->second;
+	}
 }
 
 /**
@@ -1003,87 +1704,117 @@ static wcstring complete_function_desc( const wcstring &fn )
 
    \param comp the list to add all completions to
 */
-void completer_t::complete_cmd( const wcstring &str_cmd, bool use_function, bool use_builtin, bool use_command)
+bool completer_t::complete_cmd_files( const wcstring &str_cmd, std::vector<completion_t> &out )
 {
-    /* Paranoia */
-    if (str_cmd.empty())
-        return;
-        
 	wchar_t *path_cpy;
 	wchar_t *nxt_path;
 	wchar_t *state;
-	std::vector<completion_t> possible_comp;
 
-
-    env_var_t cdpath = env_get_string(L"CDPATH");
-    if (cdpath.missing_or_empty())
-        cdpath = L".";
-    
-    const bool wants_description = (type == COMPLETE_DEFAULT);
-    
     if (str_cmd.find(L'/') != wcstring::npos || str_cmd.at(0) == L'~')
 	{
+		return expand_string(str_cmd, out, ACCEPT_INCOMPLETE | EXECUTABLES_ONLY | this->expand_flags() ) != EXPAND_ERROR;
+	}
+
+	const env_var_t path = env_get_string(L"PATH");
+	if( !path.missing() && expand_is_clean( str_cmd.c_str() ) )
+	{
+		/*
+		  There is nothing to expand, so look the name up in the
+		  index of $PATH instead of reading every directory
+		*/
+		std::vector<dir_file_t> files;
+		path_find_commands( str_cmd, path, files );
+		wildcard_complete_files( str_cmd, files, EXECUTABLES_ONLY | this->expand_flags(), out );
 
-		if( use_command )
+		/* Only look through all names in $PATH when no name started with the token */
+		if( out.empty() && this->fuzzy_out() )
 		{
-			
-			if( expand_string(str_cmd, this->completions, ACCEPT_INCOMPLETE | EXECUTABLES_ONLY | this->expand_flags() ) != EXPAND_ERROR )
+			std::vector<completion_t> found;
+			files.clear();
+			path_find_commands_fuzzy( str_cmd, path, files );
+			wildcard_complete_files( L"", files, EXECUTABLES_ONLY | this->expand_flags(), found );
+
+			const fuzzy_matcher_t matcher( str_cmd );
+			for( size_t i=0; i<found.size(); i++ )
 			{
-                if (wants_description) {
-                    this->complete_cmd_desc( str_cmd );
-                }
+				completion_t &c = found.at( i );
+				c.flags |= COMPLETE_NO_CASE | COMPLETE_FUZZY;
+				this->fuzzy_completions.push_back( fuzzy_completion_t( c, matcher.match( c.completion ) ) );
 			}
 		}
 	}
-	else
+	else if( !path.missing() )
 	{
-		if( use_command )
+	
+		path_cpy = wcsdup( path.c_str() );
+	
+		for( nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
+		     nxt_path != 0;
+		     nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
 		{
-			
-			const env_var_t path = env_get_string(L"PATH");
-			if( !path.missing() )
-			{
-			
-				path_cpy = wcsdup( path.c_str() );
-			
-				for( nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
-				     nxt_path != 0;
-				     nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
-				{
-                    wcstring base_path = nxt_path;
-                    if (base_path.empty())
-                        continue;
-                        
-                    /* Make sure the base path ends with a slash */
-                    if (base_path.at(base_path.size() - 1) != L'/')
-                        base_path.push_back(L'/');
+            wcstring base_path = nxt_path;
+            if (base_path.empty())
+                continue;
+                
+            /* Make sure the base path ends with a slash */
+            if (base_path.at(base_path.size() - 1) != L'/')
+                base_path.push_back(L'/');
 
-                    wcstring nxt_completion = base_path;
-                    nxt_completion.append(str_cmd);
+            wcstring nxt_completion = base_path;
+            nxt_completion.append(str_cmd);
 
-                    size_t prev_count =  this->completions.size();
-					if( expand_string( nxt_completion,
-									   this->completions,
-									   ACCEPT_INCOMPLETE | EXECUTABLES_ONLY | this->expand_flags()  ) != EXPAND_ERROR )
+            size_t prev_count =  out.size();
+			if( expand_string( nxt_completion,
+							   out,
+							   ACCEPT_INCOMPLETE | EXECUTABLES_ONLY | this->expand_flags()  ) != EXPAND_ERROR )
+			{
+                /* For all new completions, if COMPLETE_NO_CASE is set, then use only the last path component */
+				for( size_t i=prev_count; i< out.size(); i++ )
+				{
+					completion_t &c =  out.at( i );
+					if(c.flags & COMPLETE_NO_CASE )
 					{
-                        /* For all new completions, if COMPLETE_NO_CASE is set, then use only the last path component */
-						for( size_t i=prev_count; i< this->completions.size(); i++ )
-						{
-							completion_t &c =  this->completions.at( i );
-							if(c.flags & COMPLETE_NO_CASE )
-							{
-                                
-								c.completion.erase(0, base_path.size());
-							}
-						}
+                        
+						c.completion.erase(0, base_path.size());
 					}
 				}
-				free( path_cpy );
-				if (wants_description)
-                    this->complete_cmd_desc( str_cmd );
 			}
 		}
-		
+		free( path_cpy );
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+void completer_t::complete_cmd( const wcstring &str_cmd, bool use_function, bool use_builtin, bool use_command)
+{
+    /* Paranoia */
+    if (str_cmd.empty())
+        return;
+        
+	std::vector<completion_t> possible_comp;
+
+    const bool wants_description = (type == COMPLETE_DEFAULT);
+    
+	if( use_command )
+	{
+		if( this->defer_files )
+		{
+			this->deferred = DEFER_COMMAND;
+			this->deferred_str = str_cmd;
+			this->deferred_flag = wants_description;
+		}
+		else if( this->complete_cmd_files( str_cmd, this->completions ) && wants_description )
+		{
+			this->complete_cmd_desc( str_cmd, this->completions );
+		}
+	}
+
+	if (str_cmd.find(L'/') == wcstring::npos && str_cmd.at(0) != L'~')
+	{
 		/*
 		  These return the original strings - don't free them
 		*/
@@ -1096,7 +1827,7 @@ void completer_t::complete_cmd( const wcstring &str_cmd, bool use_function, bool
                 possible_comp.push_back(completion_t(names.at(i)));
             }
             
-			complete_strings( this->completions, str_cmd, 0, &complete_function_desc, possible_comp, 0 );
+			complete_strings( this->completions, str_cmd, 0, &complete_function_desc, possible_comp, 0, this->fuzzy_out() );
 		}
 
 		possible_comp.clear();
@@ -1104,7 +1835,7 @@ void completer_t::complete_cmd( const wcstring &str_cmd, bool use_function, bool
 		if( use_builtin )
 		{
 			builtin_get_names( possible_comp );
-			complete_strings( this->completions, str_cmd, 0, &builtin_get_desc, possible_comp, 0 );
+			complete_strings( this->completions, str_cmd, 0, &builtin_get_desc, possible_comp, 0, this->fuzzy_out() );
 		}
 
 	}
@@ -1131,6 +1862,9 @@ void completer_t::complete_from_args( const wcstring &str,
     
 	std::vector<completion_t> possible_comp;
 
+    if (this->should_stop())
+        return;
+
     bool is_autosuggest = (this->type == COMPLETE_AUTOSUGGEST);
     parser_t parser(is_autosuggest ? PARSER_TYPE_COMPLETIONS_ONLY : PARSER_TYPE_GENERAL, false);
 
@@ -1143,7 +1877,7 @@ void completer_t::complete_from_args( const wcstring &str,
     if (! is_autosuggest)
         proc_pop_interactive();
 	
-	complete_strings( this->completions, str, desc.c_str(), 0, possible_comp, flags );
+	complete_strings( this->completions, str, desc.c_str(), 0, possible_comp, flags, this->fuzzy_out() );
 }
 
 /**
@@ -1200,10 +1934,9 @@ static wchar_t *param_match2( const complete_entry_opt_t *e,
 /**
    Tests whether a short option is a viable completion
 */
-static int short_ok( const wcstring &arg_str, wchar_t nextopt, const wcstring &allopt_str )
+static int short_ok( const wcstring &arg_str, wchar_t nextopt, const option_set_t &set )
 {
     const wchar_t *arg = arg_str.c_str();
-    const wchar_t *allopt = allopt_str.c_str();
 	const wchar_t *ptr;
 
 	if( arg[0] != L'-')
@@ -1216,18 +1949,18 @@ static int short_ok( const wcstring &arg_str, wchar_t nextopt, const wcstring &a
 
 	for( ptr = arg+1; *ptr; ptr++ )
 	{
-		const wchar_t *tmp = wcschr( allopt, *ptr );
+		const complete_entry_opt_t *o = set.find_short( *ptr );
 		/* Unknown option */
-		if( tmp == 0 )
+		if( o == 0 )
 		{
 			/*fwprintf( stderr, L"Unknown option %lc", *ptr );*/
 
 			return 0;
 		}
 
-		if( *(tmp+1) == L':' )
+		/* An option that takes an argument can't be followed by another */
+		if( o->result_mode & NO_COMMON )
 		{
-/*			fwprintf( stderr, L"Woot %ls", allopt );*/
 			return 0;
 		}
 
@@ -1241,15 +1974,86 @@ void complete_load( const wcstring &name, bool reload )
 	completion_autoloader.load( name, reload );
 }
 
+/**
+   A lazy section waiting to be evaluated, and the entry it belongs to.
+   The entry is remembered by its command rather than by pointer, since
+   evaluating conditions may remove it.
+*/
+struct pending_lazy_section_t
+{
+    wcstring cmd;
+    bool cmd_is_path;
+    lazy_section_t section;
+};
+
+/**
+   Evaluate the lazy sections of the entries for the command cmd whose
+   conditions hold. Every section is evaluated once and then removed.
+   Sections added by the ones that are evaluated wait until the next
+   time.
+*/
+void completer_t::load_lazy_sections( const wcstring &cmd, const wcstring &path )
+{
+    ASSERT_IS_MAIN_THREAD();
+    
+    std::vector<pending_lazy_section_t> pending;
+    {
+        scoped_lock lock(completion_lock);
+        scoped_lock lock2(completion_entry_lock);
+        std::vector<completion_entry_t *> entries;
+        complete_find_entries(cmd, path, entries);
+        for (std::vector<completion_entry_t *>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
+        {
+            const completion_entry_t *i = *iter;
+            if (i->lazy_sections.empty())
+                continue;
+            
+            for (size_t j=0; j < i->lazy_sections.size(); j++)
+            {
+                pending.push_back(pending_lazy_section_t());
+                pending.back().cmd = i->cmd;
+                pending.back().cmd_is_path = i->cmd_is_path;
+                pending.back().section = i->lazy_sections.at(j);
+            }
+        }
+    }
+    
+    for (size_t j=0; j < pending.size(); j++)
+    {
+        const pending_lazy_section_t &next = pending.at(j);
+        if (! this->condition_test(next.section.condition))
+            continue;
+        
+        /* Remove the section before evaluating it, unless something else already has */
+        bool found = false;
+        {
+            scoped_lock lock(completion_lock);
+            scoped_lock lock2(completion_entry_lock);
+            completion_entry_t *entry = complete_find_exact_entry(next.cmd.c_str(), next.cmd_is_path);
+            for (size_t k=0; entry && k < entry->lazy_sections.size(); k++)
+            {
+                const lazy_section_t &section = entry->lazy_sections.at(k);
+                if (section.condition == next.section.condition && section.script == next.section.script)
+                {
+                    entry->lazy_sections.erase(entry->lazy_sections.begin() + k);
+                    found = true;
+                    break;
+                }
+            }
+        }
+        
+        if (found && exec_subshell(next.section.script) == -1)
+        {
+            /* Do nothing on failure */
+        }
+    }
+}
+
 /**
    Find completion for the argument str of command cmd_orig with
    previous option popt. Insert results into comp_out. Return 0 if file
    completion should be disabled, 1 otherwise.
 */
-struct local_options_t {
-    wcstring short_opt_str;
-    option_list_t options;
-};
 bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spopt, const wcstring &sstr, bool use_switches)
 {
 
@@ -1260,7 +2064,7 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
     wcstring cmd, path;
     parse_cmd_string(cmd_orig, path, cmd);
 
-    if (this->type == COMPLETE_DEFAULT)
+    if (this->type == COMPLETE_DEFAULT && ! this->should_stop())
     {
         complete_load( cmd, true );
     }
@@ -1273,33 +2077,37 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
         }
     }
     
+    /* Add the sections that are needed now. Evaluating their conditions needs the main thread. */
+    if (this->type == COMPLETE_DEFAULT)
+    {
+        this->load_lazy_sections( cmd, path );
+    }
+    
     /* Make a list of lists of all options that we care about */
-    std::vector<local_options_t> all_options;
+    std::vector<option_set_ref_t> all_options;
     {
         scoped_lock lock(completion_lock);
         scoped_lock lock2(completion_entry_lock);
-        for (completion_entry_set_t::const_iterator iter = completion_set.begin(); iter != completion_set.end(); ++iter)
+        std::vector<completion_entry_t *> entries;
+        complete_find_entries(cmd, path, entries);
+        for (std::vector<completion_entry_t *>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
         {
             const completion_entry_t *i = *iter;
-            const wcstring &match = i->cmd_is_path ? path : cmd;
-            if (! wildcard_match(match, i->cmd))
-            {
-                continue;
-            }
             
-            /* Copy all of their options into our list */
-            all_options.push_back(local_options_t());
-            all_options.back().short_opt_str = i->get_short_opt_str();
-            all_options.back().options = i->get_options(); //Oof, this is a lot of copying
+            /* Take a reference to their options, which stay the same even if the entry changes */
+            all_options.push_back(i->get_options());
         }
     }
     
     /* Now release the lock and test each option that we captured above.
        We have to do this outside the lock because callouts (like the condition) may add or remove completions.
        See https://github.com/ridiculousfish/fishfish/issues/2 */
-    for (std::vector<local_options_t>::const_iterator iter = all_options.begin(); iter != all_options.end(); iter++)
+    /* The indexes of the options that may match, which only the options that do are picked from */
+    std::vector<size_t> matches;
+    for (std::vector<option_set_ref_t>::const_iterator iter = all_options.begin(); iter != all_options.end(); iter++)
     {
-        const option_list_t &options = iter->options;
+        const option_set_t &set = **iter;
+        const option_list_t &options = set.options;
 		use_common=1;
 		if( use_switches )
 		{
@@ -1308,9 +2116,19 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
 			{
 				/* Check if we are entering a combined option and argument
 				   (like --color=auto or -I/usr/include) */
-                for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+                matches.clear();
+                if( str[1] != L'\0' )
+                    set.short_matches( str[1], matches );
+                if( str[1] == L'-' )
+                {
+                    for( const wchar_t *eq = wcschr( str+2, L'=' ); eq; eq = wcschr( eq+1, L'=' ) )
+                        set.long_matches( wcstring( str+2, eq ), matches );
+                }
+                sort_newest_first( matches );
+                
+                for (size_t k=0; k < matches.size(); k++)
 				{
-                	const complete_entry_opt_t *o = &*oiter;
+                	const complete_entry_opt_t *o = &options.at(matches.at(k));
 					wchar_t *arg;
 					if( (arg=param_match2( o, str ))!=0 && this->condition_test( o->condition ))
 					{
@@ -1330,9 +2148,13 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
 				  If we are using old style long options, check for them
 				  first
 				*/
-                for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+                matches.clear();
+                set.long_matches( popt+1, matches );
+                sort_newest_first( matches );
+                
+                for (size_t k=0; k < matches.size(); k++)
 				{
-                    const complete_entry_opt_t *o = &*oiter;
+                    const complete_entry_opt_t *o = &options.at(matches.at(k));
 					if( o->old_mode )
 					{
 						if( param_match_old( o, popt ) && this->condition_test( o->condition ))
@@ -1352,9 +2174,16 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
 				*/
 				if( !old_style_match )
 				{
-                    for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+                    matches.clear();
+                    if( popt[1] != L'\0' )
+                        set.short_matches( popt[1], matches );
+                    if( popt[1] == L'-' )
+                        set.long_matches( popt+2, matches );
+                    sort_newest_first( matches );
+                    
+                    for (size_t k=0; k < matches.size(); k++)
                     {
-                        const complete_entry_opt_t *o = &*oiter;
+                        const complete_entry_opt_t *o = &options.at(matches.at(k));
 						/*
 						  Gnu-style options with _optional_ arguments must
 						  be specified as a single token, so that it can
@@ -1377,10 +2206,23 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
 		
 		if( use_common )
 		{
+            /* Arguments, and the switches that what has been typed may be the start of */
+            matches.assign( set.arg_index.begin(), set.arg_index.end() );
+            if( str[0] == L'-' && use_switches )
+            {
+                if( str[1] != L'-' )
+                    matches.insert( matches.end(), set.short_index.begin(), set.short_index.end() );
+                
+                /* Old style long options follow a single dash and others two */
+                set.long_prefix_matches_nocase( str+1, matches );
+                if( str[1] == L'-' )
+                    set.long_prefix_matches_nocase( str+2, matches );
+            }
+            sort_newest_first( matches );
 
-            for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+            for (size_t k=0; k < matches.size(); k++)
             {
-                const complete_entry_opt_t *o = &*oiter;
+                const complete_entry_opt_t *o = &options.at(matches.at(k));
 				/*
 				  If this entry is for the base command,
 				  check if any of the arguments match
@@ -1402,7 +2244,7 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
 					  Check if the short style option matches
 					*/
 					if( o->short_opt != L'\0' &&
-						short_ok(str, o->short_opt, iter->short_opt_str))
+						short_ok(str, o->short_opt, set))
 					{
 						const wchar_t *desc = o->localized_desc();
 						wchar_t completion[2];
@@ -1486,6 +2328,18 @@ bool completer_t::complete_param( const wcstring &scmd_orig, const wcstring &spo
    Perform file completion on the specified string
 */
 void completer_t::complete_param_expand( const wcstring &sstr, bool do_file)
+{
+    if (this->defer_files)
+    {
+        this->deferred = DEFER_PARAM;
+        this->deferred_str = sstr;
+        this->deferred_flag = do_file;
+        return;
+    }
+    this->expand_param( sstr, do_file, this->completions );
+}
+
+const wchar_t *completer_t::param_expand_str( const wcstring &sstr ) const
 {
     const wchar_t * const str = sstr.c_str();
 	const wchar_t *comp_str;
@@ -1498,7 +2352,11 @@ void completer_t::complete_param_expand( const wcstring &sstr, bool do_file)
 	{
 		comp_str = str;
 	}
-    
+    return comp_str;
+}
+
+expand_flags_t completer_t::param_expand_flags( bool do_file ) const
+{
     expand_flags_t flags = EXPAND_SKIP_CMDSUBST | ACCEPT_INCOMPLETE;
     
     if (! do_file)
@@ -1506,15 +2364,102 @@ void completer_t::complete_param_expand( const wcstring &sstr, bool do_file)
         
     if (type == COMPLETE_AUTOSUGGEST)
         flags |= EXPAND_NO_DESCRIPTIONS;
-	
+    
+    return flags | this->expand_flags();
+}
+
+void completer_t::expand_param( const wcstring &sstr, bool do_file, std::vector<completion_t> &out )
+{
+    /* Use the files that have been expanded in the background if they are the ones wanted */
+    if (file_expansion)
+    {
+        file_expansion_ref_t expansion;
+        expansion.swap(file_expansion);
+        if (do_file)
+        {
+            expansion->take(out);
+            return;
+        }
+        expansion->cancel();
+    }
+    
+    const wchar_t * const comp_str = param_expand_str( sstr );
 	if( expand_string( comp_str,
-					   this->completions,
-					   flags | this->expand_flags() ) == EXPAND_ERROR )
+					   out,
+					   param_expand_flags( do_file ) ) == EXPAND_ERROR )
 	{
 		debug( 3, L"Error while expanding string '%ls'", comp_str );
 	}	
 }
 
+/**
+   Starts expanding the files of the token str on a background thread,
+   so that it runs alongside the completions that need the parser.
+   complete_param_expand uses them if it turns out that files are
+   wanted. Files expanded by complete_prewarm are used if they are
+   still fresh. Only the main thread may start background work.
+*/
+void completer_t::start_expanding_files( const wcstring &str )
+{
+    if (type != COMPLETE_DEFAULT || ! is_main_thread() || file_expansion)
+        return;
+    
+    const wcstring expand_str = param_expand_str( str );
+    const expand_flags_t flags = param_expand_flags( true );
+    if (prewarmed_files && prewarmed_files->is_for( expand_str, flags ) &&
+        timef() - prewarmed_files_when < PREWARM_TIMEOUT &&
+        env_get_string( L"PWD" ) == prewarmed_files_pwd)
+    {
+        file_expansion.swap(prewarmed_files);
+        return;
+    }
+    
+    file_expansion.reset(new file_expansion_t(expand_str, flags));
+    iothread_perform(expand_files_in_background, expanded_files_in_background, new file_expansion_ref_t(file_expansion), IOTHREAD_PRIORITY_INTERACTIVE);
+}
+
+/**
+   Does the expansion left by complete_param_expand or complete_cmd.
+   It only reads the filesystem and variables, so it may run on a
+   background thread, while the main thread looks at the other
+   completions.
+*/
+void completer_t::complete_deferred()
+{
+    switch (this->deferred)
+    {
+        case DEFER_PARAM:
+            this->expand_param( this->deferred_str, this->deferred_flag, this->deferred_completions );
+            break;
+
+        case DEFER_COMMAND:
+            if (! this->complete_cmd_files( this->deferred_str, this->deferred_completions ))
+                this->deferred_flag = false;
+            break;
+
+        case DEFER_NONE:
+            break;
+    }
+}
+
+/**
+   Describes the commands found by complete_deferred, and adds its
+   completions to the others, in the same order complete_cmd would.
+*/
+void completer_t::complete_finish_deferred()
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    if (this->deferred == DEFER_COMMAND)
+    {
+        if (this->deferred_flag)
+            this->complete_cmd_desc( this->deferred_str, this->deferred_completions );
+        this->deferred_completions.swap( this->completions );
+    }
+    completions_append( this->completions, this->deferred_completions );
+    this->deferred = DEFER_NONE;
+}
+
 void completer_t::debug_print_completions()
 {
     for (size_t i=0; i < completions.size(); i++) {
@@ -1533,7 +2478,7 @@ bool completer_t::complete_variable(const wcstring &str, int start_offset)
 	int res = 0;
     bool wants_description = (type != COMPLETE_AUTOSUGGEST);
     
-    const wcstring_list_t names = env_get_names(0);
+    const wcstring_list_t names = env_get_names_with_prefix(var);
 	for( size_t i=0; i<names.size(); i++ )
 	{
 		const wcstring & env_name = names.at(i);
@@ -1623,7 +2568,6 @@ bool completer_t::try_complete_user( const wcstring &str )
     const wchar_t *cmd = str.c_str();
 	const wchar_t *first_char=cmd;
 	int res=0;
-	double start_time = timef();
 	
 	if( *first_char ==L'~' && !wcschr(first_char, L'/'))
 	{
@@ -1631,61 +2575,48 @@ bool completer_t::try_complete_user( const wcstring &str )
 		const wchar_t *name_end = wcschr( user_name, L'~' );
 		if( name_end == 0 )
 		{
-			struct passwd *pw;
 			int name_len = wcslen( user_name );
+			wcstring_list_t names;
+			expand_user_names( user_name, names );
 			
-			setpwent();
-			
-			while((pw=getpwent()) != 0)
+			for( size_t i=0; i < names.size(); i++ )
 			{
-				double current_time = timef();
-				wchar_t *pw_name;
-
-				if( current_time - start_time > 0.2 ) 
+				const wchar_t *pw_name = names.at(i).c_str();
+				if( wcsncmp( user_name, pw_name, name_len )==0 )
 				{
-					return 1;
+                    wcstring desc = format_string(COMPLETE_USER_DESC, pw_name);						
+					completion_allocate( this->completions, 
+										 &pw_name[name_len],
+										 desc,
+										 COMPLETE_NO_SPACE );
+					
+					res=1;
 				}
-			
-				pw_name = str2wcs( pw->pw_name );
-
-				if( pw_name )
+				else if( wcsncasecmp( user_name, pw_name, name_len )==0 )
 				{
-					if( wcsncmp( user_name, pw_name, name_len )==0 )
-					{
-                        wcstring desc = format_string(COMPLETE_USER_DESC, pw_name);						
-						completion_allocate( this->completions, 
-											 &pw_name[name_len],
-											 desc,
-											 COMPLETE_NO_SPACE );
+					wcstring name = format_string(L"~%ls", pw_name);
+                    wcstring desc = format_string(COMPLETE_USER_DESC, pw_name);
 						
-						res=1;
-					}
-					else if( wcsncasecmp( user_name, pw_name, name_len )==0 )
-					{
-						wcstring name = format_string(L"~%ls", pw_name);
-                        wcstring desc = format_string(COMPLETE_USER_DESC, pw_name);
-							
-						completion_allocate( this->completions, 
-											 name,
-											 desc,
-											 COMPLETE_NO_CASE | COMPLETE_DONT_ESCAPE | COMPLETE_NO_SPACE );
-						res=1;							
-					}
-					free( pw_name );
+					completion_allocate( this->completions, 
+										 name,
+										 desc,
+										 COMPLETE_NO_CASE | COMPLETE_DONT_ESCAPE | COMPLETE_NO_SPACE );
+					res=1;							
 				}
 			}
-			endpwent();
 		}
 	}
 
 	return res;
 }
 
-void complete( const wcstring &cmd, std::vector<completion_t> &comps, complete_type_t type, wcstring_list_t *commands_to_load )
+/**
+   Finds the completions of the command line cmd, using the specified
+   completer. This does all the work of complete(), except for
+   looking for fuzzy matches and returning the completions.
+*/
+static void complete_with_completer( completer_t &completer, const wcstring &cmd, complete_type_t type )
 {
-    /* Make our completer */
-    completer_t completer(cmd, type);
-    
 	const wchar_t *tok_begin, *tok_end, *cmdsubst_begin, *cmdsubst_end, *prev_begin, *prev_end;
 	wcstring buff;
 	tokenizer tok;
@@ -1726,13 +2657,17 @@ void complete( const wcstring &cmd, std::vector<completion_t> &comps, complete_t
 	if( !done )
 	{
 		pos = cursor_pos-(cmdsubst_begin-cmd_cstr);
-		
+
+		if( type == COMPLETE_DEFAULT )
+			completer.use_kept_conditions( wcstring( cmd_cstr, tok_begin-cmd_cstr ) );
+
 		buff = wcstring( cmdsubst_begin, cmdsubst_end-cmdsubst_begin );
 
 		int had_cmd=0;
 		int end_loop=0;
 
-		tok_init( &tok, buff.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS );
+		std::tr1::shared_ptr<const tok_cache_t> tokens = parse_util_get_tokens( buff.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS );
+		tok_init_cached( &tok, buff.c_str(), tokens.get(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS );
 
 		while( tok_has_next( &tok) && !end_loop )
 		{
@@ -1894,6 +2829,9 @@ void complete( const wcstring &cmd, std::vector<completion_t> &comps, complete_t
                     unescape_string( prev_token_unescape, 0 ) &&
                     unescape_string( current_token_unescape, UNESCAPE_INCOMPLETE))
 				{
+					/* Files are usually wanted, and don't need the parser, so start on them right away */
+					completer.start_expanding_files( current_token );
+					
 					do_file = completer.complete_param( current_command_unescape, 
                                                           prev_token_unescape, 
                                                           current_token_unescape, 
@@ -1917,11 +2855,90 @@ void complete( const wcstring &cmd, std::vector<completion_t> &comps, complete_t
 	
 	free( (void *)current_token );
 	free( (void *)prev_token );
+}
 
-	comps = completer.get_completions();
+void complete( const wcstring &cmd, std::vector<completion_t> &comps, complete_type_t type, wcstring_list_t *commands_to_load )
+{
+    TRACE_SCOPE( "complete" );
+
+    /* Make our completer */
+    completer_t completer(cmd, type);
+    
+    complete_with_completer( completer, cmd, type );
+
+	completer.use_fuzzy_completions();
+	completer.swap_completions(comps);
     completer.get_commands_to_load(commands_to_load);
 }
 
+completer_t *complete_begin( const wcstring &cmd, bool (*stop)(void) )
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    completer_t *completer = new completer_t(cmd, COMPLETE_DEFAULT);
+    completer->set_defer_files( stop );
+    complete_with_completer( *completer, cmd, COMPLETE_DEFAULT );
+
+    if (completer->should_stop())
+    {
+        delete completer;
+        return NULL;
+    }
+    return completer;
+}
+
+/** Stops a prewarming completion before it uses the parser */
+static bool complete_stop_prewarming()
+{
+    return true;
+}
+
+void complete_prewarm( const wcstring &cmd )
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    /* Going through the completer finds the token and whether files would be expanded the same way pressing tab does, and uses the prewarmed files if they are already the right ones */
+    const file_expansion_ref_t old = prewarmed_files;
+    completer_t completer(cmd, COMPLETE_DEFAULT);
+    completer.set_defer_files( &complete_stop_prewarming );
+    complete_with_completer( completer, cmd, COMPLETE_DEFAULT );
+
+    prewarmed_files = completer.release_file_expansion();
+    if (prewarmed_files != old)
+    {
+        if (old)
+            old->cancel();
+        prewarmed_files_pwd = env_get_string( L"PWD" );
+        prewarmed_files_when = timef();
+    }
+}
+
+void complete_background( completer_t *completer )
+{
+    completer->complete_deferred();
+}
+
+const std::vector<completion_t> &complete_get_partial( completer_t *completer )
+{
+    ASSERT_IS_MAIN_THREAD();
+    return completer->get_completions();
+}
+
+void complete_finish( completer_t *completer, std::vector<completion_t> &comps )
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    completer->complete_finish_deferred();
+    completer->use_fuzzy_completions();
+    completer->swap_completions( comps );
+    delete completer;
+}
+
+void complete_discard( completer_t *completer )
+{
+    delete completer;
+}
+
 
 
 /**
@@ -1940,20 +2957,57 @@ static void append_switch( wcstring &out,
 	append_format( out, L" --%ls %ls", opt.c_str(), esc.c_str() );
 }
 
+void complete_memory_usage( memory_usage_t &usage )
+{
+    size_t entries = 0;
+    {
+        scoped_lock locker(completion_lock);
+        scoped_lock locker2(completion_entry_lock);
+        std::vector<completion_entry_t *> all_entries;
+        complete_all_entries(all_entries);
+        for (std::vector<completion_entry_t *>::const_iterator iter = all_entries.begin(); iter != all_entries.end(); ++iter)
+        {
+            const completion_entry_t *e = *iter;
+            /* The entry and its node in the table */
+            entries += sizeof *e + 4 * sizeof(void *) + memory_usage_of(e->cmd);
+            
+            const option_set_ref_t set = e->get_options();
+            if (set != kNoOptions)
+                entries += sizeof *set;
+            entries += set->options.capacity() * sizeof(complete_entry_opt_t);
+            entries += (set->long_index.capacity() + set->nocase_index.capacity() + set->short_index.capacity() + set->arg_index.capacity()) * sizeof(size_t);
+            for (option_list_t::const_iterator oiter = set->options.begin(); oiter != set->options.end(); ++oiter)
+            {
+                entries += memory_usage_of(oiter->long_opt) + memory_usage_of(oiter->comp) + memory_usage_of(oiter->desc) + memory_usage_of(oiter->condition);
+            }
+            
+            entries += e->lazy_sections.capacity() * sizeof(lazy_section_t);
+            for (std::vector<lazy_section_t>::const_iterator liter = e->lazy_sections.begin(); liter != e->lazy_sections.end(); ++liter)
+            {
+                entries += memory_usage_of(liter->condition) + memory_usage_of(liter->script);
+            }
+        }
+    }
+    usage.push_back(memory_usage_t::value_type(L"completions", entries));
+    usage.push_back(memory_usage_t::value_type(L"completion autoload records", completion_autoloader.memory_usage()));
+}
+
 void complete_print( wcstring &out )
 {
     scoped_lock locker(completion_lock);
     scoped_lock locker2(completion_entry_lock);
     
     // Get a list of all completions in a vector, then sort it by order
-    std::vector<const completion_entry_t *> all_completions(completion_set.begin(), completion_set.end());
+    std::vector<completion_entry_t *> all_completions;
+    complete_all_entries(all_completions);
     sort(all_completions.begin(), all_completions.end(), compare_completions_by_order);
     
-    for (std::vector<const completion_entry_t *>::const_iterator iter = all_completions.begin(); iter != all_completions.end(); ++iter)
+    for (std::vector<completion_entry_t *>::const_iterator iter = all_completions.begin(); iter != all_completions.end(); ++iter)
     {
         const completion_entry_t *e = *iter;
-        const option_list_t options = e->get_options();
-        for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+        const option_set_ref_t set = e->get_options();
+        const option_list_t &options = set->options;
+        for (option_list_t::const_reverse_iterator oiter = options.rbegin(); oiter != options.rend(); ++oiter)
         {
             const complete_entry_opt_t *o = &*oiter;
 			const wchar_t *modestr[] =
@@ -2000,5 +3054,21 @@ void complete_print( wcstring &out )
 
 			out.append( L"\n" );
 		}
+        
+        for (size_t i=0; i < e->lazy_sections.size(); i++)
+        {
+            const lazy_section_t &section = e->lazy_sections.at(i);
+            out.append( L"complete" );
+			append_switch( out,
+						   e->cmd_is_path ? L"path" : L"command",
+						   e->cmd );
+			append_switch( out,
+						   L"condition",
+						   section.condition );
+			append_switch( out,
+						   L"lazy",
+						   section.script );
+			out.append( L"\n" );
+        }
 	}
 }
@@ -14,6 +14,8 @@
 
 
 #include <wchar.h>
+#include <vector>
+#include <algorithm>
 
 #include "util.h"
 #include "common.h"
@@ -99,7 +101,15 @@ enum {
     /**
        This completion should be inserted as-is, without escaping.
     */
-    COMPLETE_DONT_ESCAPE = 1 << 4
+    COMPLETE_DONT_ESCAPE = 1 << 4,
+
+    /**
+       This completion was found by fuzzy matching, because nothing
+       matched the token better. It is always set together with
+       COMPLETE_NO_CASE, but the completion need not start with the
+       current token.
+    */
+    COMPLETE_FUZZY = 1 << 5
 };
 typedef int complete_flags_t;
 
@@ -145,11 +155,30 @@ public:
         }
     }
 
+	/** Swap the contents of two completions. This doesn't copy the strings. */
+	void swap(completion_t &rhs)
+	{
+		completion.swap(rhs.completion);
+		description.swap(rhs.description);
+		std::swap(flags, rhs.flags);
+	}
+
 	bool operator < (const completion_t& rhs) const { return this->completion < rhs.completion; }
 	bool operator == (const completion_t& rhs) const { return this->completion == rhs.completion; }
 	bool operator != (const completion_t& rhs) const { return ! (*this == rhs); }
 };
 
+/**
+   Lets std::sort and other algorithms swap completions without copying their strings
+*/
+namespace std
+{
+	template<> inline void swap(completion_t &a, completion_t &b)
+	{
+		a.swap(b);
+	}
+}
+
 enum complete_type_t {
     COMPLETE_DEFAULT,
     COMPLETE_AUTOSUGGEST
@@ -207,6 +236,24 @@ void complete_add( const wchar_t *cmd,
 		   const wchar_t *comp,
 		   const wchar_t *desc,
 		   int flags ); 
+/**
+  Add a lazily evaluated section of completions for a command. The
+  first time the command is completed while the condition holds, the
+  script is evaluated, and is expected to add the completions of the
+  section using the complete builtin. After that the section is
+  forgotten. Until then, the command is not treated as authoritative,
+  since it may have options that are not known yet.
+
+  \param cmd Command to complete.
+  \param cmd_is_path Whether cmd is the path of the program rather than its name
+  \param condition A command to be run to check if the section is needed. If \c condition is empty, it is needed the first time the command is completed.
+  \param script The script that adds the completions
+*/
+void complete_add_lazy( const wchar_t *cmd,
+			bool cmd_is_path,
+			const wchar_t *condition,
+			const wchar_t *script );
+
 /**
   Sets whether the completion list for this command is complete. If
   true, any options not matching one of the provided options will be
@@ -226,6 +273,84 @@ void complete_remove( const wchar_t *cmd,
 /** Find all completions of the command cmd, insert them into out. If to_load is not NULL, append all commands that we would autoload, but did not (presumably because this is not the main thread) */
 void complete( const wcstring &cmd, std::vector<completion_t> &comp, complete_type_t type, wcstring_list_t *to_load = NULL );
 
+/**
+   The state of a completion that is computed in parts, so that
+   reading directories doesn't block the main thread.
+*/
+class completer_t;
+
+/**
+   Starts completing the command line cmd like complete() with
+   COMPLETE_DEFAULT does. This runs everything that needs the
+   parser, like testing conditions and evaluating argument lists, and
+   leaves expanding files for complete_background. Must be called on
+   the main thread.
+
+   \param cmd the command line to complete
+   \param stop called before every use of the parser. If it returns true, the completion is abandoned.
+   \return the completer to pass to complete_background and then complete_finish or complete_discard, or NULL if the completion was abandoned
+*/
+completer_t *complete_begin( const wcstring &cmd, bool (*stop)(void) );
+
+/**
+   Expands the files for a completer returned by complete_begin. This
+   may be called on a background thread, and may block on slow
+   filesystems.
+*/
+void complete_background( completer_t *completer );
+
+/**
+   Returns the completions that complete_begin found. They may be
+   looked at on the main thread while complete_background runs.
+*/
+const std::vector<completion_t> &complete_get_partial( completer_t *completer );
+
+/**
+   Describes the commands found by complete_background, puts all
+   completions into comp, and frees the completer. Must be called on
+   the main thread, after complete_background has returned.
+*/
+void complete_finish( completer_t *completer, std::vector<completion_t> &comp );
+
+/**
+   Frees a completer without looking at its completions. If
+   complete_background was called, it must have returned.
+*/
+void complete_discard( completer_t *completer );
+
+/**
+   Starts expanding the files that completing the command line cmd
+   would look for on a background thread, so that they are ready when
+   the next completion of the same token needs them. Nothing that needs
+   the parser is done. The files are used for as long as the working
+   directory stays the same, but at most for half a minute. Must be
+   called on the main thread.
+*/
+void complete_prewarm( const wcstring &cmd );
+
+/**
+   Forgets the files expanded by complete_prewarm. Running a command
+   may change them, so this is called before running one.
+*/
+void complete_forget_prewarmed();
+
+/**
+   Forgets the results of completion conditions. The results are kept
+   from one completion to the next for as long as the working directory
+   and the tokens before the token being completed stay the same, and
+   running a command may change what the conditions test, so this is
+   called before running one.
+*/
+void complete_forget_conditions();
+
+/**
+   Tells the completion code that the condition being tested read the
+   token under the cursor, the cursor position or the command line
+   after it, so that its result is only used for the current completion.
+   Called by the commandline builtin.
+*/
+void complete_condition_reads_token();
+
 /**
    Print a list of all current completions into the string. 
 
@@ -233,6 +358,12 @@ void complete( const wcstring &cmd, std::vector<completion_t> &comp, complete_ty
 */
 void complete_print( wcstring &out );
 
+/**
+   Append the memory used by completion definitions, and by the
+   records of autoloaded completion files, to usage
+*/
+void complete_memory_usage( memory_usage_t &usage );
+
 /**
    Tests if the specified option is defined for the specified command
 */
@@ -272,5 +403,14 @@ void complete_load( const wcstring &cmd, bool reload );
 */
 void completion_allocate(std::vector<completion_t> &completions, const wcstring &comp, const wcstring &desc, int flags);
 
+/**
+   Move all completions from one list to the end of another. The moved
+   completions are swapped rather than copied, and \c from is left empty.
+
+   \param to The list to append to
+   \param from The list to take the completions from
+*/
+void completions_append(std::vector<completion_t> &to, std::vector<completion_t> &from);
+
 
 #endif
@@ -0,0 +1,289 @@
+/** \file complete_server.cpp
+	The completion server that <tt>fish --complete-server</tt> runs.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <vector>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "wutil.h"
+#include "complete_server.h"
+#include "complete.h"
+#include "builtin.h"
+#include "highlight.h"
+#include "env.h"
+#include "proc.h"
+#include "iothread.h"
+
+/**
+   The prefix of the color variables, which answers to highlight requests leave out
+*/
+#define COLOR_VAR_PREFIX L"fish_color_"
+
+/**
+   Appends str to out with newlines, tabs and backslashes escaped
+*/
+static void append_escaped( wcstring &out, const wcstring &str )
+{
+	for( size_t i=0; i<str.size(); i++ )
+	{
+		switch( str.at( i ) )
+		{
+			case L'\n':
+				out.append( L"\\n" );
+				break;
+
+			case L'\t':
+				out.append( L"\\t" );
+				break;
+
+			case L'\\':
+				out.append( L"\\\\" );
+				break;
+
+			default:
+				out.push_back( str.at( i ) );
+				break;
+		}
+	}
+}
+
+/**
+   Undoes append_escaped. Other backslash sequences are kept as they are.
+*/
+static wcstring unescape_argument( const wcstring &str )
+{
+	wcstring result;
+	result.reserve( str.size() );
+	for( size_t i=0; i<str.size(); i++ )
+	{
+		wchar_t c = str.at( i );
+		if( c == L'\\' && i+1 < str.size() )
+		{
+			switch( str.at( i+1 ) )
+			{
+				case L'n':
+					result.push_back( L'\n' );
+					i++;
+					continue;
+
+				case L't':
+					result.push_back( L'\t' );
+					i++;
+					continue;
+
+				case L'\\':
+					result.push_back( L'\\' );
+					i++;
+					continue;
+			}
+		}
+		result.push_back( c );
+	}
+	return result;
+}
+
+/**
+   Appends the name that highlight answers use for the HIGHLIGHT_* value color
+*/
+static void append_color_name( wcstring &out, int color )
+{
+	const wcstring var = highlight_get_color_var( color );
+	const size_t prefix_len = wcslen( COLOR_VAR_PREFIX );
+	out.append( var, prefix_len, wcstring::npos );
+
+	if( color >= 0 && ( color & HIGHLIGHT_VALID_PATH ) && var != highlight_get_color_var( HIGHLIGHT_VALID_PATH ) )
+	{
+		out.push_back( L',' );
+		out.append( highlight_get_color_var( HIGHLIGHT_VALID_PATH ) + prefix_len );
+	}
+}
+
+/**
+   A commandline being highlighted by a worker thread, since
+   highlight_shell may block on the file system
+*/
+struct server_highlight_t
+{
+	wcstring cmd;
+	std::vector<int> colors;
+	env_vars vars;
+
+	server_highlight_t( const wcstring &c ) : cmd( c ), colors( c.size(), 0 ), vars( env_vars::highlighting_keys )
+	{
+	}
+};
+
+static int threaded_server_highlight( server_highlight_t *ctx )
+{
+	highlight_shell( ctx->cmd, ctx->colors, ctx->cmd.size(), NULL, ctx->vars );
+	return 0;
+}
+
+static void server_highlight_done( server_highlight_t *ctx, int result )
+{
+}
+
+static void handle_complete( const wcstring &cmd, wcstring &reply )
+{
+	std::vector<completion_t> comp;
+	builtin_complete_do_complete( cmd, comp );
+
+	for( size_t i=0; i<comp.size(); i++ )
+	{
+		const completion_t &next = comp.at( i );
+		append_escaped( reply, next.completion );
+		if( ! next.description.empty() )
+		{
+			reply.push_back( L'\t' );
+			append_escaped( reply, next.description );
+		}
+		reply.push_back( L'\n' );
+	}
+}
+
+static void handle_highlight( const wcstring &cmd, wcstring &reply )
+{
+	server_highlight_t ctx( cmd );
+	iothread_perform( threaded_server_highlight, server_highlight_done, &ctx, IOTHREAD_PRIORITY_INTERACTIVE );
+	iothread_drain_all();
+
+	size_t start = 0;
+	while( start < ctx.colors.size() )
+	{
+		size_t end = start + 1;
+		while( end < ctx.colors.size() && ctx.colors.at( end ) == ctx.colors.at( start ) )
+			end++;
+
+		append_format( reply, L"%lu %lu ", (unsigned long)start, (unsigned long)( end - start ) );
+		append_color_name( reply, ctx.colors.at( start ) );
+		reply.push_back( L'\n' );
+		start = end;
+	}
+}
+
+static void handle_cd( const wcstring &dir, wcstring &reply )
+{
+	if( dir.empty() || wchdir( dir ) != 0 )
+	{
+		reply.append( L"error " );
+		append_escaped( reply, format_string( _( L"Could not change directory to '%ls'" ), dir.c_str() ) );
+		reply.push_back( L'\n' );
+	}
+	else if( ! env_set_pwd() )
+	{
+		reply.append( L"error " );
+		append_escaped( reply, _( L"Could not set PWD variable" ) );
+		reply.push_back( L'\n' );
+	}
+}
+
+bool complete_server_handle_request( const wcstring &request, wcstring &reply )
+{
+	const size_t space = request.find( L' ' );
+	const wcstring keyword = request.substr( 0, space );
+	const wcstring arg = space == wcstring::npos ? L"" : unescape_argument( request.substr( space+1 ) );
+
+	if( keyword == L"quit" )
+		return false;
+
+	if( keyword == L"complete" )
+	{
+		handle_complete( arg, reply );
+	}
+	else if( keyword == L"highlight" )
+	{
+		handle_highlight( arg, reply );
+	}
+	else if( keyword == L"cd" )
+	{
+		handle_cd( arg, reply );
+	}
+	else
+	{
+		reply.append( L"error " );
+		append_escaped( reply, format_string( _( L"Unknown request '%ls'" ), keyword.c_str() ) );
+		reply.push_back( L'\n' );
+	}
+
+	reply.push_back( L'\n' );
+
+	/* Reap the background jobs that completions may have started */
+	job_reap( false );
+	return true;
+}
+
+/**
+   Answers a request, returning false if the server should exit
+*/
+static bool serve_line( const std::string &line, int out )
+{
+	wcstring reply;
+	const bool keep_going = complete_server_handle_request( str2wcstring( line ), reply );
+	const std::string narrow = wcs2string( reply );
+	if( write_loop( out, narrow.data(), narrow.size() ) != (ssize_t)narrow.size() )
+		return false;
+	return keep_going;
+}
+
+int complete_server_run( int in_fd, int out_fd )
+{
+	/*
+	  Keep the requests and answers on our own descriptors, and give
+	  the commands that completions run /dev/null instead
+	*/
+	const int in = dup( in_fd );
+	const int out = dup( out_fd );
+	if( in == -1 || out == -1 )
+	{
+		wperror( L"dup" );
+		return 1;
+	}
+	set_cloexec( in );
+	set_cloexec( out );
+
+	const int null_fd = open( "/dev/null", O_RDWR );
+	if( null_fd != -1 )
+	{
+		dup2( null_fd, in_fd );
+		dup2( null_fd, out_fd );
+		if( null_fd != in_fd && null_fd != out_fd )
+			close( null_fd );
+	}
+
+	std::string pending;
+	char buff[4096];
+	while( 1 )
+	{
+		size_t newline;
+		while( ( newline = pending.find( '\n' ) ) != std::string::npos )
+		{
+			const std::string line( pending, 0, newline );
+			pending.erase( 0, newline+1 );
+			if( ! serve_line( line, out ) )
+				return 0;
+		}
+
+		const ssize_t count = read( in, buff, sizeof buff );
+		if( count == -1 && errno == EINTR )
+			continue;
+		if( count <= 0 )
+			break;
+		pending.append( buff, count );
+	}
+
+	if( ! pending.empty() )
+		serve_line( pending, out );
+	return 0;
+}
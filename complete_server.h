@@ -0,0 +1,57 @@
+/** \file complete_server.h
+
+	The completion server. Editors and other tools that want the
+	completions or the highlighting of a commandline can start <tt>fish
+	--complete-server</tt> once and send it any number of requests,
+	instead of starting a new fish for every <tt>complete -C</tt>, which
+	loads the init files and the completions of the command again every
+	time. The server keeps the completions, functions and caches that
+	it has loaded between requests.
+
+	Requests are read from stdin and answered on stdout, one request
+	per line. A request is a keyword, optionally followed by a space and
+	an argument. In arguments and answers, a newline is written as \\n,
+	a tab as \\t and a backslash as \\\\. Every answer consists of zero
+	or more lines, followed by an empty line. The requests are:
+
+	- <tt>complete CMDLINE</tt> answers with one line per completion of
+	CMDLINE, as if it was the contents of the commandline with the
+	cursor at its end. Each line is the new token, followed by a tab and
+	the description if the completion has one, like <tt>complete
+	-C</tt> prints them.
+
+	- <tt>highlight CMDLINE</tt> answers with one line per run of
+	characters of CMDLINE with the same color, holding the index of the
+	first character, the number of characters and the name of the color
+	variable without the fish_color_ prefix, like <tt>0 4 command</tt>.
+	Runs that are valid paths have ,valid_path appended to the name.
+
+	- <tt>cd DIRECTORY</tt> changes the working directory that later
+	requests complete and highlight files in, and answers with nothing.
+
+	- <tt>quit</tt> makes the server exit, like the end of stdin does.
+
+	Requests that fail are answered with a single line starting with
+	<tt>error </tt>. Commands that completions run get /dev/null as their
+	stdin and stdout, so that they can't read requests or write answers.
+*/
+
+#ifndef FISH_COMPLETE_SERVER_H
+#define FISH_COMPLETE_SERVER_H
+
+#include "common.h"
+
+/**
+   Answers the request on a line, without its newline, by appending
+   the answer, including its final empty line, to reply. Returns false
+   if the request asks the server to exit.
+*/
+bool complete_server_handle_request( const wcstring &request, wcstring &reply );
+
+/**
+   Answers requests read from in_fd on out_fd until in_fd ends or a
+   quit request is read. Returns the exit status fish should have.
+*/
+int complete_server_run( int in_fd, int out_fd );
+
+#endif
@@ -0,0 +1,149 @@
+/** \file dir_cache.cpp
+
+	A cache of directory listings.
+
+	Listings are keyed by the device and inode of the directory, so
+	that different ways of spelling the same path share a listing. A
+	listing is used as long as the change time of the directory is the
+	same as when it was read. Since change times are only precise to
+	the second, a listing is only trusted if the directory last changed
+	before the second it was read in; otherwise a change made in that
+	same second could go unnoticed.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "wutil.h"
+#include "lru.h"
+#include "dir_cache.h"
+
+/**
+   The maximum number of directories to cache listings for
+*/
+#define DIR_CACHE_SIZE 64
+
+/**
+   The number of seconds after which a listing is read again even if
+   the directory seems unchanged. This protects against file systems
+   that don't keep change times up to date.
+*/
+#define DIR_CACHE_MAX_AGE 10
+
+/**
+   A cached directory listing
+*/
+struct dir_cache_node_t : public lru_node_t
+{
+	dir_cache_node_t(const wcstring &key) : lru_node_t(key), change_time(0), read_time(0) { }
+
+	/** The change time of the directory when it was read */
+	time_t change_time;
+
+	/** When the directory was read */
+	time_t read_time;
+
+	/** The listing */
+	dir_listing_ref_t listing;
+};
+
+class dir_cache_t : public lru_cache_t<dir_cache_node_t>
+{
+	protected:
+
+	/* Override to delete evicted nodes */
+	virtual void node_was_evicted(dir_cache_node_t *node)
+	{
+		delete node;
+	}
+
+	public:
+	dir_cache_t() : lru_cache_t<dir_cache_node_t>(DIR_CACHE_SIZE) { }
+};
+
+/** Lock protecting the cache */
+static pthread_mutex_t s_dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static dir_cache_t s_dir_cache;
+
+/**
+   Read the entries of a directory. Returns false if it can't be opened.
+*/
+static bool dir_cache_read(const wcstring &path, dir_listing_t &listing)
+{
+	DIR *dir = wopendir(path);
+	if (! dir)
+		return false;
+
+	dir_entry_t entry;
+	while (wreaddir_typed(dir, entry.name, &entry.is_dir))
+	{
+		listing.push_back(entry);
+	}
+	closedir(dir);
+	return true;
+}
+
+bool dir_cache_get_listing(const wcstring &path, dir_listing_ref_t *out_listing)
+{
+	assert(out_listing != NULL);
+	const wcstring dir_path = path.empty() ? L"." : path;
+
+	time_t now = time(NULL);
+	struct stat buf;
+	if (wstat(dir_path, &buf) || ! S_ISDIR(buf.st_mode))
+		return false;
+
+	const wcstring key = format_string(L"%llu:%llu", (unsigned long long)buf.st_dev, (unsigned long long)buf.st_ino);
+
+	{
+		scoped_lock lock(s_dir_cache_lock);
+		dir_cache_node_t *node = s_dir_cache.get_node(key);
+		if (node &&
+			node->change_time == buf.st_ctime &&
+			node->change_time < node->read_time &&
+			now - node->read_time <= DIR_CACHE_MAX_AGE)
+		{
+			*out_listing = node->listing;
+			return true;
+		}
+	}
+
+	/* Read the directory without holding the lock, since it may be slow */
+	dir_listing_t *listing = new dir_listing_t();
+	if (! dir_cache_read(dir_path, *listing))
+	{
+		delete listing;
+		return false;
+	}
+	out_listing->reset(listing);
+
+	scoped_lock lock(s_dir_cache_lock);
+	dir_cache_node_t *node = s_dir_cache.get_node(key);
+	if (! node)
+	{
+		node = new dir_cache_node_t(key);
+		s_dir_cache.add_node(node);
+	}
+	node->change_time = buf.st_ctime;
+	node->read_time = now;
+	node->listing = *out_listing;
+	return true;
+}
+
+void dir_cache_clear()
+{
+	scoped_lock lock(s_dir_cache_lock);
+	s_dir_cache.evict_all_nodes();
+}
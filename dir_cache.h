@@ -0,0 +1,58 @@
+/** \file dir_cache.h
+
+	A cache of directory listings, shared by globbing, completion and
+	highlighting, which tend to read the same directories over and
+	over again while the user types.
+*/
+
+#ifndef FISH_DIR_CACHE_H
+#define FISH_DIR_CACHE_H
+
+#include <vector>
+#include <tr1/memory>
+#include "common.h"
+
+/**
+   An entry in a directory listing
+*/
+struct dir_entry_t
+{
+	/** The name of the entry */
+	wcstring name;
+
+	/** Whether the entry is a directory, as reported by wreaddir_typed: 1 for directories, 0 for other files and -1 if unknown */
+	int is_dir;
+};
+
+/**
+   An entry in the listing of a particular directory
+*/
+struct dir_file_t
+{
+	/** The directory, ending with a slash */
+	wcstring dir;
+
+	/** The entry */
+	dir_entry_t entry;
+};
+
+typedef std::vector<dir_entry_t> dir_listing_t;
+typedef std::tr1::shared_ptr<const dir_listing_t> dir_listing_ref_t;
+
+/**
+   Get the entries of the specified directory, in the order readdir
+   returns them. A cached listing is used if the directory has not been
+   modified since it was read. This may be called from any thread.
+
+   \param path The directory. An empty path means the working directory.
+   \param out_listing The listing is returned here
+   \return false if the directory could not be read
+*/
+bool dir_cache_get_listing(const wcstring &path, dir_listing_ref_t *out_listing);
+
+/**
+   Forget all cached listings
+*/
+void dir_cache_clear();
+
+#endif
@@ -18,6 +18,7 @@
 #include <set>
 #include <map>
 #include <algorithm>
+#include <tr1/unordered_map>
 
 #if HAVE_NCURSES_H
 #include <ncurses.h>
@@ -57,6 +58,7 @@
 #include "input.h"
 #include "event.h"
 #include "path.h"
+#include "profiler.h"
 
 #include "complete.h"
 
@@ -84,15 +86,46 @@ extern char **__environ;
    should be exported. Obviously, it needs to be allocated large
    enough to fit the value string.
 */
+/**
+   Store the offsets in val of the ends of its array elements, i.e. of
+   the separators and of the end of the string, in ends
+*/
+static void find_element_ends( const wcstring &val, std::vector<size_t> &ends )
+{
+	for( size_t pos = val.find( ARRAY_SEP ); pos != wcstring::npos; pos = val.find( ARRAY_SEP, pos + 1 ) )
+		ends.push_back( pos );
+	ends.push_back( val.size() );
+}
+
 struct var_entry_t
 {
 	bool exportv; /**< Whether the variable should be exported */
 	wcstring val; /**< The value of the variable */
+	/**
+	   The offsets in val of the ends of the array elements, i.e. of
+	   the separators and of the end of the string, so elements can
+	   be indexed without splitting val. Built by element_ends() when
+	   first needed, and cleared when val changes.
+	*/
+	mutable std::vector<size_t> ends;
 
 	var_entry_t() : exportv(false) { } 
+
+	void set_val( const wcstring &v )
+	{
+		val = v;
+		ends.clear();
+	}
+
+	const std::vector<size_t> &element_ends() const
+	{
+		if( ends.empty() )
+			find_element_ends( val, ends );
+		return ends;
+	}
 };
 
-typedef std::map<wcstring, var_entry_t*> var_table_t;
+typedef std::tr1::unordered_map<wcstring, var_entry_t*> var_table_t;
 
 bool g_log_forks = false;
 
@@ -134,6 +167,39 @@ class variable_entry_t {
 
 static pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+   The result of looking up a variable in the visible scopes: the node
+   holding it and its entry, or NULLs if no scope holds it.
+*/
+struct var_lookup_t
+{
+	env_node_t *node;
+	var_entry_t *entry;
+};
+
+/**
+   Cache of variable lookups, so that repeated lookups of a variable
+   don't have to search every scope. Cleared whenever a variable is
+   created or removed, or a scope is pushed or popped. Protected by
+   env_lock.
+*/
+typedef std::tr1::unordered_map<wcstring, var_lookup_t> var_lookup_cache_t;
+static var_lookup_cache_t var_lookup_cache;
+
+/**
+   Incremented whenever a variable may have changed, so that snapshots
+   in env_vars can tell whether they are still current. Only used on
+   the main thread.
+*/
+static unsigned int env_generation = 0;
+
+static void invalidate_var_lookup_cache()
+{
+	env_generation++;
+	scoped_lock lock(env_lock);
+	var_lookup_cache.clear();
+}
+
 /**
    Top node on the function stack
 */
@@ -144,6 +210,12 @@ static env_node_t *top=0;
 */
 static env_node_t *global_env = 0;
 
+/**
+   The names of the global variables, for finding the ones that start
+   with a prefix without looking at all of them. Protected by env_lock.
+*/
+static name_index_t global_names;
+
 
 /**
    Table for global variables
@@ -183,6 +255,23 @@ static null_terminated_array_t<char> export_array;
 */
 static bool has_changed = true;
 
+/**
+   An exported variable as last put in export_array: its value, and
+   the narrow key=value string made from it.
+*/
+struct export_entry_t
+{
+	wcstring val;
+	std::string narrow;
+};
+
+/**
+   The exported variables, by name, as last put in export_array. Used
+   to avoid narrowing every variable again when the exports change,
+   and to tell whether a universal variable change affects them.
+*/
+static std::map<wcstring, export_entry_t> export_cache;
+
 /**
    This string is used to store the value of dynamically
    generated variables, such as history.
@@ -337,6 +426,7 @@ static void handle_locale()
 
 /** React to modifying hte given variable */
 static void react_to_variable_change(const wcstring &key) {
+    env_generation++;
     if(var_is_locale(key)){
         handle_locale();
     } else if (key == L"fish_term256") {
@@ -375,7 +465,11 @@ static void universal_callback( int type,
 	
 	if( str )
 	{
-		has_changed=true;
+		/* Only exported variables matter for the export array */
+		if( type == SET_EXPORT || (name && export_cache.find(name) != export_cache.end()) )
+		{
+			has_changed=true;
+		}
 		
         event_t ev = event_t::variable_event(name);
         ev.arguments.reset(new wcstring_list_t());
@@ -629,9 +723,37 @@ void env_init()
 	wchar_t * fishd_dir = fishd_dir_wstr.missing()?NULL:const_cast<wchar_t*>(fishd_dir_wstr.c_str());
 	wchar_t * user_dir = user_dir_wstr.missing()?NULL:const_cast<wchar_t*>(user_dir_wstr.c_str());
 
-	env_universal_init(fishd_dir , user_dir , 
-						&start_fishd,
-						&universal_callback );
+	/*
+	  A non-interactive shell is likely to be done before it changes any
+	  universal variable, so if fishd isn't running, it reads them from
+	  the save file instead of waiting for fishd to start
+	*/
+	std::string save_file;
+	wcstring config_dir;
+	if( !is_interactive_session && path_get_config( config_dir ) )
+	{
+		save_file = env_universal_save_filename( wcs2string( config_dir ) );
+	}
+
+	/*
+	  Interactive sessions want to know about changes to the variables
+	  that react_to_variable_change looks at while waiting for input
+	*/
+	if( is_interactive_session )
+	{
+		env_universal_subscribe( L"fish_color_*" );
+		env_universal_subscribe( L"fish_term256" );
+		env_universal_subscribe( L"LANG" );
+		env_universal_subscribe( L"LC_*" );
+	}
+
+	{
+		startup_trace_scope_t trace( "fishd_connect" );
+		env_universal_init(fishd_dir , user_dir , 
+							&start_fishd,
+							&universal_callback,
+							save_file.empty() ? 0 : save_file.c_str() );
+	}
 
 	/*
 	  Set up SHLVL variable
@@ -681,19 +803,31 @@ void env_destroy()
 	}
 
 	delete top;
+	invalidate_var_lookup_cache();
 }
 
 /**
-   Search all visible scopes in order for the specified key. Return
-   the first scope in which it was found.
+   Search all visible scopes in order for the specified key, using
+   var_lookup_cache. Must be called with env_lock held.
 */
-static env_node_t *env_get_node( const wcstring &key )
+static var_lookup_t env_lookup( const wcstring &key )
 {
+	ASSERT_IS_LOCKED(env_lock);
+	var_lookup_cache_t::const_iterator cached = var_lookup_cache.find( key );
+	if( cached != var_lookup_cache.end() )
+	{
+		return cached->second;
+	}
+
+	var_lookup_t result = { NULL, NULL };
 	env_node_t *env = top;
 	while( env != NULL )
 	{
-		if ( env->env.find( key ) != env->env.end() )
+		var_table_t::const_iterator iter = env->env.find( key );
+		if ( iter != env->env.end() )
 		{ 
+			result.node = env;
+			result.entry = iter->second;
 			break;
 		}
 
@@ -706,7 +840,18 @@ static env_node_t *env_get_node( const wcstring &key )
 			env = env->next;
 		}
 	}
-	return env;
+	var_lookup_cache.insert( std::make_pair( key, result ) );
+	return result;
+}
+
+/**
+   Search all visible scopes in order for the specified key. Return
+   the first scope in which it was found.
+*/
+static env_node_t *env_get_node( const wcstring &key )
+{
+	scoped_lock lock(env_lock);
+	return env_lookup( key ).node;
 }
 
 int env_set(const wcstring &key, const wchar_t *val, int var_mode)
@@ -796,11 +941,6 @@ int env_set(const wcstring &key, const wchar_t *val, int var_mode)
 			var_table_t::iterator result = node->env.find(key);
             assert(result != node->env.end());
             e  = result->second;
-                        
-			if( e->exportv )
-			{
-				has_changed_new = true;
-			}
 		}
         
 		if( (var_mode & ENV_LOCAL) || 
@@ -873,16 +1013,24 @@ int env_set(const wcstring &key, const wchar_t *val, int var_mode)
 				node->env.erase(result);
 		    }
             
+			/* Shadowing or replacing an exported variable in another scope changes the exports */
+			if( e && e != old_entry && e->exportv )
+			{
+				has_changed_new = true;
+			}
+
 			var_entry_t *entry = NULL;
 			if( old_entry )
             {
 			    entry = old_entry;
 				
-			    if( (var_mode & ENV_EXPORT) || entry->exportv )
+			    /* The exports only change if the variable is or was exported, and its value or export status changes */
+			    const bool exportv = !!(var_mode & ENV_EXPORT);
+			    if( entry->exportv != exportv || (exportv && entry->val != val) )
                 {
-                    entry->exportv = !!(var_mode & ENV_EXPORT);
                     has_changed_new = true;		
                 }
+			    entry->exportv = exportv;
             }	
 			else
             {
@@ -900,9 +1048,18 @@ int env_set(const wcstring &key, const wchar_t *val, int var_mode)
 				
             }
             
-			entry->val = val;
+			entry->set_val( val );
 			
 			node->env.insert(std::pair<wcstring, var_entry_t*>(key, entry));
+			if( ! old_entry )
+			{
+				invalidate_var_lookup_cache();
+				if( node == global_env )
+				{
+					scoped_lock lock(env_lock);
+					global_names.insert( key );
+				}
+			}
             
 			if( entry->exportv )
             {
@@ -914,7 +1071,7 @@ int env_set(const wcstring &key, const wchar_t *val, int var_mode)
         
     }
     
-    if( !is_universal )
+    if( !is_universal && event_is_variable_observed( key ) )
     {
         event_t ev = event_t::variable_event(key);		
         ev.arguments.reset(new wcstring_list_t);
@@ -961,6 +1118,12 @@ static int try_remove( env_node_t *n,
         
 		n->env.erase(result);
 		delete v;
+		invalidate_var_lookup_cache();
+		if( n == global_env )
+		{
+			scoped_lock lock(env_lock);
+			global_names.erase( key );
+		}
 		return 1;
 	}
 
@@ -1003,15 +1166,18 @@ int env_remove( const wcstring &key, int var_mode )
 		
 		if( try_remove( first_node, key.c_str(), var_mode ) )
 		{		
-			event_t ev = event_t::variable_event(key);
-            ev.arguments.reset(new wcstring_list_t);
-            ev.arguments->push_back(L"VARIABLE");
-            ev.arguments->push_back(L"ERASE");
-            ev.arguments->push_back(key);
-			
-			event_fire( &ev );	
-			
-			ev.arguments.reset(NULL);
+			if( event_is_variable_observed( key ) )
+			{
+				event_t ev = event_t::variable_event(key);
+				ev.arguments.reset(new wcstring_list_t);
+				ev.arguments->push_back(L"VARIABLE");
+				ev.arguments->push_back(L"ERASE");
+				ev.arguments->push_back(key);
+				
+				event_fire( &ev );	
+				
+				ev.arguments.reset(NULL);
+			}
 			erased = 1;
 		}
 	}
@@ -1039,6 +1205,18 @@ const wchar_t *env_var_t::c_str(void) const {
     return wcstring::c_str();
 }
 
+/**
+   Returns the history shown as the $history variable
+*/
+static history_t *env_get_history()
+{
+    history_t *history = reader_get_history();
+    if (! history) {
+        history = &history_t::history_with_name(L"fish");
+    }
+    return history;
+}
+
 env_var_t env_get_string( const wcstring &key )
 {    
     /* Big hack...we only allow getting the history on the main thread. Note that history_t may ask for an environment variable, so don't take the lock here (we don't need it) */
@@ -1047,10 +1225,7 @@ env_var_t env_get_string( const wcstring &key )
 	{
         env_var_t result;
         
-        history_t *history = reader_get_history();
-        if (! history) {
-            history = &history_t::history_with_name(L"fish");
-        }
+        history_t *history = env_get_history();
         if (history)
             history->get_string_representation(result, ARRAY_SEP_STR);                
 		return result;
@@ -1077,36 +1252,16 @@ env_var_t env_get_string( const wcstring &key )
             /* Lock around a local region */
             scoped_lock lock(env_lock);
             
-            var_entry_t *res = NULL;
-            env_node_t *env = top;
-            wcstring result;
-            
-            while( env != NULL )
+            const var_entry_t *res = env_lookup(key).entry;
+            if( res != NULL )
             {
-                var_table_t::iterator result =  env->env.find(key);
-                if ( result != env->env.end() ) 
-                    res = result->second; 
-                
-                
-                if( res != NULL )
-                {
-                    if( res->val == ENV_NULL ) 
-                    {
-                        return env_var_t::missing_var();
-                    }
-                    else
-                    {
-                        return res->val;			
-                    }
-                }
-                
-                if( env->new_scope )
+                if( res->val == ENV_NULL ) 
                 {
-                    env = global_env;
+                    return env_var_t::missing_var();
                 }
                 else
                 {
-                    env = env->next;
+                    return res->val;			
                 }
             }
         }
@@ -1132,6 +1287,78 @@ env_var_t env_get_string( const wcstring &key )
     }
 }
 
+/**
+   Append the elements of the array val at the specified indexes to
+   out, like env_get_elements. ends are the ends of its elements, as
+   found by find_element_ends.
+*/
+static void env_pick_elements( const wcstring &val, const std::vector<size_t> &ends, const std::vector<long> &indexes, wcstring_list_t &out )
+{
+	for( size_t i=0; i < indexes.size(); i++ )
+	{
+		long idx = indexes.at(i);
+		if( idx < 0 )
+			idx = (long)ends.size() + idx + 1;
+		if( idx < 1 || (size_t)idx > ends.size() )
+			break;
+
+		size_t start = ( idx > 1 ) ? ends.at( idx - 2 ) + 1 : 0;
+		out.push_back( val.substr( start, ends.at( idx - 1 ) - start ) );
+	}
+}
+
+bool env_get_elements( const wcstring &key, const std::vector<long> &indexes, wcstring_list_t &out, size_t *out_count )
+{
+	/* Decode only the requested history items, not the whole history. This has the same main thread restriction as env_get_string. An empty history falls through, and reads as a single empty element like before. */
+	history_t *history = ( key == L"history" && is_main_thread() ) ? env_get_history() : NULL;
+	size_t count = history ? history->size() : 0;
+	if( count > 0 )
+	{
+		for( size_t i=0; i < indexes.size(); i++ )
+		{
+			long idx = indexes.at(i);
+			if( idx < 0 )
+				idx = (long)count + idx + 1;
+			if( idx < 1 || (size_t)idx > count )
+				break;
+			out.push_back( history->item_at_index( idx ).str() );
+		}
+		if( out_count )
+			*out_count = count;
+		return true;
+	}
+
+	if( ! is_electric( key ) )
+	{
+		scoped_lock lock(env_lock);
+		
+		const var_entry_t *res = env_lookup(key).entry;
+		if( res != NULL )
+		{
+			if( res->val == ENV_NULL )
+				return false;
+
+			const std::vector<size_t> &ends = res->element_ends();
+			env_pick_elements( res->val, ends, indexes, out );
+			if( out_count )
+				*out_count = ends.size();
+			return true;
+		}
+	}
+
+	/* Electric and universal variables aren't kept in entries, so split their value */
+	const env_var_t val = env_get_string( key );
+	if( val.missing() )
+		return false;
+
+	std::vector<size_t> ends;
+	find_element_ends( val, ends );
+	env_pick_elements( val, ends, indexes, out );
+	if( out_count )
+		*out_count = ends.size();
+	return true;
+}
+
 int env_exist( const wchar_t *key, int mode )
 {
 	var_entry_t *res;
@@ -1233,6 +1460,7 @@ void env_push( int new_scope )
 		has_changed |= local_scope_exports(top);
 	}
 	top = node;	
+	invalidate_var_lookup_cache();
 
 }
 
@@ -1275,6 +1503,7 @@ void env_pop()
 		}
 
 		delete killme;
+		invalidate_var_lookup_cache();
 
 		if( locale_changed )
 			handle_locale();
@@ -1308,6 +1537,11 @@ static void add_key_to_string_set(const var_table_t &envs, std::set<wcstring> &s
 	}
 }
 
+bool env_var_is_user_settable( const wcstring &key )
+{
+	return ! is_read_only( key ) && ! is_electric( key );
+}
+
 wcstring_list_t env_get_names( int flags )
 {
     scoped_lock lock(env_lock);
@@ -1376,6 +1610,43 @@ wcstring_list_t env_get_names( int flags )
     return result;
 }
 
+wcstring_list_t env_get_names_with_prefix( const wcstring &prefix )
+{
+    scoped_lock lock(env_lock);
+    
+    wcstring_list_t matches;
+	for( env_node_t *n=top; n && n != global_env; n = n->next )
+	{
+		for( var_table_t::const_iterator iter = n->env.begin(); iter != n->env.end(); ++iter )
+		{
+			if( string_prefixes_string_case_insensitive( prefix, iter->first ) )
+				matches.push_back( iter->first );
+		}
+		if( n->new_scope )
+			break;
+	}
+	
+	global_names.find_prefix( prefix, matches );
+	for( std::set<wcstring>::const_iterator iter = env_electric.begin(); iter != env_electric.end(); ++iter )
+	{
+		if( string_prefixes_string_case_insensitive( prefix, *iter ) )
+			matches.push_back( *iter );
+	}
+	const wchar_t * const size_names[] = { L"COLUMNS", L"LINES" };
+	for( size_t i=0; i<2; i++ )
+	{
+		if( string_prefixes_string_case_insensitive( prefix, size_names[i] ) )
+			matches.push_back( size_names[i] );
+	}
+	
+	env_universal_get_names_with_prefix( prefix, matches );
+	
+	/* The same name may be in several scopes */
+	std::sort( matches.begin(), matches.end() );
+	matches.erase( std::unique( matches.begin(), matches.end() ), matches.end() );
+	return matches;
+}
+
 /**
 	Get list of all exported variables
 */
@@ -1402,33 +1673,37 @@ static void get_exported( const env_node_t *n, std::map<wcstring, wcstring> &h )
 	}
 }
 
+/**
+   Make the narrow key=value strings for the given variables, reusing
+   the strings in export_cache for variables whose values are
+   unchanged, and replace export_cache with the result.
+*/
 static void export_func(const std::map<wcstring, wcstring> &envs, std::vector<std::string> &out)
 {
+	std::map<wcstring, export_entry_t> new_cache;
 	std::map<wcstring, wcstring>::const_iterator iter;
 	for (iter = envs.begin(); iter != envs.end(); ++iter)
 	{
-		char* ks = wcs2str(iter->first.c_str());
-		char* vs = wcs2str(iter->second.c_str()); 
-		char *pos = vs;
-		while( *pos )
+		export_entry_t &entry = new_cache[iter->first];
+		std::map<wcstring, export_entry_t>::iterator cached = export_cache.find(iter->first);
+		if( cached != export_cache.end() && cached->second.val == iter->second )
 		{
-			if( *pos == ARRAY_SEP )
-				*pos = ':';			
-			pos++;
+			entry.narrow.swap(cached->second.narrow);
 		}
-        
-        /* Put a string on the vector */
-        out.push_back(std::string());
-        std::string &str = out.back();
-        
-        /* Append our environment variable data to it */
-        str.append(ks);
-        str.append("=");
-        str.append(vs);
-
-		free(ks);
-		free(vs);
+		else
+		{
+			std::string vs = wcs2string(iter->second);
+			std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
+			
+			/* Put our environment variable data in the string */
+			entry.narrow = wcs2string(iter->first);
+			entry.narrow.append("=");
+			entry.narrow.append(vs);
+		}
+		entry.val = iter->second;
+		out.push_back(entry.narrow);
 	}
+	export_cache.swap(new_cache);
 }
 
 static void update_export_array_if_necessary(bool recalc) {
@@ -1478,6 +1753,31 @@ char **env_export_arr( int recalc )
     return export_array.get();
 }
 
+void env_memory_usage( memory_usage_t &usage )
+{
+	size_t vars = 0, exports = 0;
+	
+	for( env_node_t *n = top; n != NULL; n = n->next )
+	{
+		vars += sizeof *n + n->env.bucket_count() * sizeof(void *);
+		for( var_table_t::const_iterator iter = n->env.begin(); iter != n->env.end(); ++iter )
+		{
+			const var_entry_t *entry = iter->second;
+			/* The node in the table, and the entry */
+			vars += sizeof *iter + sizeof(void *) + memory_usage_of( iter->first );
+			vars += sizeof *entry + memory_usage_of( entry->val ) + entry->ends.capacity() * sizeof(size_t);
+		}
+	}
+	
+	for( std::map<wcstring, export_entry_t>::const_iterator iter = export_cache.begin(); iter != export_cache.end(); ++iter )
+	{
+		exports += sizeof *iter + 4 * sizeof(void *) + memory_usage_of( iter->first ) + memory_usage_of( iter->second.val ) + iter->second.narrow.capacity() + 1;
+	}
+	
+	usage.push_back( memory_usage_t::value_type( L"variables", vars ) );
+	usage.push_back( memory_usage_t::value_type( L"exported variables", exports ) );
+}
+
 void env_export_arr(bool recalc, null_terminated_array_t<char> &output)
 {
     ASSERT_IS_MAIN_THREAD();
@@ -1485,23 +1785,39 @@ void env_export_arr(bool recalc, null_terminated_array_t<char> &output)
     output = export_array;
 }
 
+/**
+   The last snapshot made by env_vars, and what it was made from
+*/
+static const wchar_t * const *last_snapshot_keys = NULL;
+static unsigned int last_snapshot_generation = 0;
+static std::tr1::shared_ptr<const env_vars::var_map_t> last_snapshot;
+
 env_vars::env_vars(const wchar_t * const *keys)
 {
     ASSERT_IS_MAIN_THREAD();
-    for (size_t i=0; keys[i]; i++) {
-        const env_var_t val = env_get_string(keys[i]);
-        if (!val.missing()) {
-            vars[keys[i]] = val;
+    if (keys != last_snapshot_keys || env_generation != last_snapshot_generation || ! last_snapshot) {
+        var_map_t *snapshot = new var_map_t;
+        for (size_t i=0; keys[i]; i++) {
+            const env_var_t val = env_get_string(keys[i]);
+            if (!val.missing()) {
+                (*snapshot)[keys[i]] = val;
+            }
         }
+        last_snapshot.reset(snapshot);
+        last_snapshot_keys = keys;
+        last_snapshot_generation = env_generation;
     }
+    vars = last_snapshot;
 }
 
 env_vars::env_vars() { }
 
 const wchar_t *env_vars::get(const wchar_t *key) const
 {
-    std::map<wcstring, wcstring>::const_iterator iter = vars.find(key);
-    return (iter == vars.end() ? NULL : iter->second.c_str());
+    if (! vars)
+        return NULL;
+    var_map_t::const_iterator iter = vars->find(key);
+    return (iter == vars->end() ? NULL : iter->second.c_str());
 }
 
 const wchar_t * const env_vars::highlighting_keys[] = {L"PATH", L"CDPATH", L"HIGHLIGHT_DELAY", L"fish_function_path", NULL};
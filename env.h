@@ -7,6 +7,7 @@
 
 #include <wchar.h>
 #include <map>
+#include <tr1/memory>
 
 #include "util.h"
 #include "common.h"
@@ -126,6 +127,18 @@ public:
  */
 env_var_t env_get_string( const wcstring &key );
 
+/**
+   Gets elements of the array variable with the specified name without
+   splitting all of it, which makes indexing large arrays cheap.
+
+   \param key the name of the variable
+   \param indexes the indexes of the elements to get. The first element has index 1, and negative indexes count from the end of the array. Elements are appended to out up to the first index that is out of bounds.
+   \param out the list to append the elements to
+   \param out_count if not null, set to the number of elements in the array
+   \return false if the variable does not exist
+*/
+bool env_get_elements( const wcstring &key, const std::vector<long> &indexes, wcstring_list_t &out, size_t *out_count );
+
 /**
    Returns 1 if the specified key exists. This can't be reliably done
    using env_get, since env_get returns null for 0-element arrays
@@ -164,14 +177,42 @@ void env_export_arr(bool recalc, null_terminated_array_t<char> &result);
 */
 wcstring_list_t env_get_names( int flags );
 
+/**
+   Returns the sorted names of all visible variables that start with
+   the specified prefix, ignoring case. Unlike env_get_names, this
+   doesn't look at every global and universal variable.
+*/
+wcstring_list_t env_get_names_with_prefix( const wcstring &prefix );
+
+/**
+  Returns whether the user may set the variable, i.e. whether it is
+  neither read only nor calculated on the fly, like status
+*/
+bool env_var_is_user_settable( const wcstring &key );
+
 /**
    Update the PWD variable
    directory
 */
 int env_set_pwd();
 
+/**
+   Append the memory used by variables in all scopes, and by the cached
+   exported variables, to usage
+*/
+void env_memory_usage( memory_usage_t &usage );
+
+/**
+   An immutable snapshot of some variables, for use on background
+   threads. Copies share the same values. Snapshots of the same keys
+   share the values too, until one of the variables changes.
+*/
 class env_vars {
-    std::map<wcstring, wcstring> vars;
+public:
+    typedef std::map<wcstring, wcstring> var_map_t;
+
+private:
+    std::tr1::shared_ptr<const var_map_t> vars;
 
 public:
     env_vars(const wchar_t * const * keys);
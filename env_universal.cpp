@@ -12,6 +12,8 @@
 #include <pwd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #if HAVE_NCURSES_H
 #include <ncurses.h>
@@ -30,6 +32,7 @@
 #endif
 
 #include <signal.h>
+#include <set>
 
 #include "fallback.h"
 #include "util.h"
@@ -68,6 +71,48 @@ static void (*external_callback)( int type, const wchar_t *name, const wchar_t *
 */
 static int barrier_reply = 0;
 
+/**
+   The generation file of fishd mapped into memory, or 0 if there is none
+*/
+static const universal_generation_t *generation_map = 0;
+
+/**
+   Set while the universal variables are the ones read from the save
+   file of fishd, because fishd wasn't running
+*/
+static bool offline = false;
+
+/**
+   The generation of fishd when no fishd was found to be running
+*/
+static uint32_t offline_generation = 0;
+
+/**
+   The save file of fishd, while offline is set
+*/
+static char *save_file_name = 0;
+
+/**
+   The save file as it was when the variables were read from it
+*/
+static struct stat save_file_stat;
+
+/**
+   Whether synced_generation is valid
+*/
+static bool has_synced_generation = false;
+
+/**
+   The generation of fishd when the last completed barrier was started
+*/
+static uint32_t synced_generation = 0;
+
+/**
+   The variables that changes should be sent for right away. Changes
+   to the others are picked up by the next barrier.
+*/
+static std::set<wcstring> subscriptions;
+
 void env_universal_barrier();
 
 static int is_dead()
@@ -77,28 +122,19 @@ static int is_dead()
 
 
 /**
-   Get a socket for reading from the server
+   Constructs the filename of a file that belongs to the fishd of this
+   user from the specified prefix. The result is malloc'd.
 */
-static int get_socket( int fork_ok )
+static char *get_fishd_filename( const char *prefix )
 {
-	int s, len;
-	struct sockaddr_un local;
-	
 	char *name;
 	wchar_t *wdir;
 	wchar_t *wuname;	
 	char *dir =0, *uname=0;
 
-	get_socket_count++;
 	wdir = path;
 	wuname = user;
 	
-	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) 
-	{
-		wperror(L"socket");
-		return -1;
-	}
-	
 	if( wdir )
 		dir = wcs2str(wdir );
 	else
@@ -115,16 +151,74 @@ static int get_socket( int fork_ok )
 	
 	name = (char *)malloc( strlen(dir) +
 				   strlen(uname) + 
-				   strlen(SOCK_FILENAME) + 
+				   strlen(prefix) + 
 				   2 );
 	
 	strcpy( name, dir );
 	strcat( name, "/" );
-	strcat( name, SOCK_FILENAME );
+	strcat( name, prefix );
 	strcat( name, uname );
 	
 	free( dir );
 	free( uname );
+	return name;
+}
+
+/**
+   Map the generation file of fishd into memory, if there is one that
+   only this user can write to. It is mapped again for every new
+   connection, since a new fishd may have replaced the file.
+*/
+static void map_generation()
+{
+	if( generation_map )
+	{
+		munmap( (void *)generation_map, sizeof( universal_generation_t ) );
+		generation_map = 0;
+	}
+	has_synced_generation = false;
+
+	char *name = get_fishd_filename( GENERATION_FILENAME );
+	int fd = open( name, O_RDONLY | O_NOFOLLOW );
+	free( name );
+	if( fd == -1 )
+		return;
+
+	struct stat buf;
+	if( fstat( fd, &buf ) == 0 &&
+		buf.st_uid == getuid() &&
+		! (buf.st_mode & 022) &&
+		S_ISREG( buf.st_mode ) &&
+		buf.st_size >= (off_t)sizeof( universal_generation_t ) )
+	{
+		void *map = mmap( 0, sizeof( universal_generation_t ), PROT_READ, MAP_SHARED, fd, 0 );
+		if( map != MAP_FAILED )
+			generation_map = (const universal_generation_t *)map;
+	}
+	close( fd );
+}
+
+/**
+   Get a socket for reading from the server. If fishd isn't running, it
+   is started if fork_ok is set, and the failure is reported unless
+   quiet is set.
+*/
+static int get_socket( int fork_ok, int quiet )
+{
+	int s, len;
+	struct sockaddr_un local;
+	
+	char *name;
+
+	get_socket_count++;
+	
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) 
+	{
+		wperror(L"socket");
+		return -1;
+	}
+	
+	name = get_fishd_filename( SOCK_FILENAME );
 	
 	debug( 3, L"Connect to socket %s at fd %2", name, s );
 	
@@ -142,9 +236,12 @@ static int get_socket( int fork_ok )
 			
 			start_fishd();
 									
-			return get_socket( 0 );
+			return get_socket( 0, quiet );
 		}
 		
+		if( quiet )
+			return -1;
+		
 		debug( 1, L"Could not connect to universal variable server, already tried manual restart (or no command supplied). You will not be able to share variable values between fish sessions. Is fish properly installed?" );
 		return -1;
 	}
@@ -159,6 +256,8 @@ static int get_socket( int fork_ok )
 
 	debug( 3, L"Connected to fd %d", s );
 	
+	map_generation();
+	
 	return s;
 }
 
@@ -178,6 +277,33 @@ static void callback( int type, const wchar_t *name, const wchar_t *val )
 	}	
 }
 
+/**
+   Queue a subscribe message for the specified variable, or for no
+   variable at all if name is null
+*/
+static void queue_subscribe( const wchar_t *name )
+{
+	message_t *msg = create_message( SUBSCRIBE, name, 0 );
+	if( !msg )
+		return;
+	msg->count=1;
+	env_universal_server.unsent->push_back(msg);
+}
+
+/**
+   Tell a new fishd connection which variables to send changes for
+   right away. This must be queued before the first barrier, which
+   sends it.
+*/
+static void send_subscriptions()
+{
+	queue_subscribe( 0 );
+	for( std::set<wcstring>::const_iterator iter = subscriptions.begin(); iter != subscriptions.end(); ++iter )
+	{
+		queue_subscribe( iter->c_str() );
+	}
+}
+
 /**
    Make sure the connection is healthy. If not, close it, and try to
    establish a new connection.
@@ -237,11 +363,62 @@ static void reconnect()
 	
 	init = 0;
 	env_universal_server.buffer_consumed = env_universal_server.buffer_used = 0;
-	env_universal_server.fd = get_socket(1);
+	env_universal_server.fd = get_socket(1, 0);
 	init = 1;
 	if( env_universal_server.fd >= 0 )
 	{
 		env_universal_remove_all();
+		send_subscriptions();
+		env_universal_barrier();
+	}
+}
+
+/**
+   Read the universal variables from the save file of fishd. Returns
+   false if it can't be read.
+*/
+static bool read_save_file( const char *name )
+{
+	int fd = open( name, O_RDONLY );
+	if( fd == -1 )
+		return false;
+	
+	set_cloexec( fd );
+	if( fstat( fd, &save_file_stat ) )
+		memset( &save_file_stat, 0, sizeof( save_file_stat ) );
+	
+	connection_t c;
+	connection_init( &c, fd );
+	read_message( &c );
+	connection_destroy( &c );
+	return true;
+}
+
+/**
+   Stop using the variables from the save file, and connect to fishd
+   instead. fishd is started if fork_ok is set; otherwise nothing
+   changes if it isn't running.
+*/
+static void go_online( int fork_ok )
+{
+	debug( 3, L"Connect to fishd instead of using its save file" );
+	
+	/* Starting fishd runs a command, which must not end up here again */
+	init = 0;
+	int fd = get_socket( fork_ok, !fork_ok );
+	init = 1;
+	
+	if( fd == -1 && !fork_ok )
+		return;
+	
+	offline = false;
+	free( save_file_name );
+	save_file_name = 0;
+	env_universal_server.fd = fd;
+	if( env_universal_server.fd >= 0 )
+	{
+		env_universal_remove_all();
+		send_subscriptions();
 		env_universal_barrier();
 	}
 }
@@ -250,21 +427,40 @@ static void reconnect()
 void env_universal_init( wchar_t * p, 
 						 wchar_t *u, 
 						 void (*sf)(),
-						 void (*cb)( int type, const wchar_t *name, const wchar_t *val ))
+						 void (*cb)( int type, const wchar_t *name, const wchar_t *val ),
+						 const char *save_file )
 {
-	path=p;
-	user=u;
+	/* The strings belong to the caller, and they are needed for every reconnect */
+	path = p ? wcsdup( p ) : 0;
+	user = u ? wcsdup( u ) : 0;
 	start_fishd=sf;	
 	external_callback = cb;
 
 	connection_init( &env_universal_server, -1 );
 	
-	env_universal_server.fd = get_socket(1);
+	env_universal_server.fd = get_socket( !save_file, save_file != 0 );
 	env_universal_common_init( &callback );
+
+	if( env_universal_server.fd == -1 && save_file )
+	{
+		if( read_save_file( save_file ) )
+		{
+			debug( 3, L"fishd is not running, using its save file" );
+			offline = true;
+			save_file_name = strdup( save_file );
+			map_generation();
+			offline_generation = generation_map ? generation_map->generation : 0;
+			init = 1;
+			return;
+		}
+		env_universal_server.fd = get_socket( 1, 0 );
+	}
+
 	env_universal_read_all();	
 	init = 1;	
 	if( env_universal_server.fd >= 0 )
 	{
+		send_subscriptions();
 		env_universal_barrier();
 	}
 }
@@ -287,6 +483,13 @@ void env_universal_destroy()
 	env_universal_server.fd =-1;
 	env_universal_common_destroy();
 	init = 0;
+
+	free( path );
+	free( user );
+	path = user = 0;
+	free( save_file_name );
+	save_file_name = 0;
+	offline = false;
 }
 
 
@@ -295,7 +498,7 @@ void env_universal_destroy()
 */
 int env_universal_read_all()
 {
-	if( !init)
+	if( !init || offline )
 		return 0;
 
 	if( env_universal_server.fd == -1 )
@@ -340,17 +543,70 @@ void env_universal_barrier()
 	message_t *msg;
 	fd_set fds;
 
-	if( !init || is_dead() )
+	if( !init )
 		return;
 
+	/*
+	  Without a connection the variables from the save file are up to
+	  date, unless a fishd has started since they were read. Its
+	  generation file tells.
+	*/
+	if( offline )
+	{
+		if( !generation_map )
+			map_generation();
+		if( generation_map && generation_map->generation != offline_generation )
+		{
+			offline_generation = generation_map->generation;
+			go_online( 0 );
+			if( !offline )
+				return;
+		}
+
+		/* A fishd that has come and gone may have saved changes */
+		struct stat buf;
+		if( stat( save_file_name, &buf ) == 0 &&
+			( buf.st_dev != save_file_stat.st_dev ||
+			  buf.st_ino != save_file_stat.st_ino ||
+			  buf.st_size != save_file_stat.st_size ||
+			  buf.st_mtime != save_file_stat.st_mtime ) )
+		{
+			debug( 3, L"Read the save file of fishd again" );
+			env_universal_remove_all();
+			read_save_file( save_file_name );
+		}
+		return;
+	}
+
+	if( is_dead() )
+		return;
+
+	/*
+	  If nothing has changed since the last barrier, and we have nothing
+	  to send, there is no need to ask fishd
+	*/
+	uint32_t generation = 0;
+	const bool has_generation = generation_map && generation_map->magic == UNIVERSAL_GENERATION_MAGIC;
+	if( has_generation )
+	{
+		generation = generation_map->generation;
+		if( has_synced_generation &&
+			generation == synced_generation &&
+			env_universal_server.unsent->empty() )
+		{
+			return;
+		}
+	}
+
 	barrier_reply = 0;
+	syscall_count( SYSCALL_FISHD );
 
 	/*
 	  Create barrier request
 	*/
 	msg= create_message( BARRIER, 0, 0);
 	msg->count=1;
-    env_universal_server.unsent->push(msg);
+    env_universal_server.unsent->push_back(msg);
 
 	/*
 	  Wait until barrier request has been sent
@@ -394,9 +650,28 @@ void env_universal_barrier()
 		env_universal_read_all();
 	}
 	debug( 3, L"End barrier" );
+
+	if( has_generation )
+	{
+		synced_generation = generation;
+		has_synced_generation = true;
+	}
 }
 
 
+void env_universal_subscribe( const wcstring &name )
+{
+	if( !subscriptions.insert( name ).second )
+		return;
+
+	/* Connections made later send all subscriptions when they are made */
+	if( init && !offline && !is_dead() )
+	{
+		queue_subscribe( name.c_str() );
+		try_send_all( &env_universal_server );
+	}
+}
+
 void env_universal_set( const wcstring &name, const wcstring &value, int exportv )
 {
 	message_t *msg;
@@ -406,6 +681,10 @@ void env_universal_set( const wcstring &name, const wcstring &value, int exportv
 
 	debug( 3, L"env_universal_set( \"%ls\", \"%ls\" )", name.c_str(), value.c_str() );
 
+	/* Only fishd can tell the other sessions about the change */
+	if( offline )
+		go_online( 1 );
+
 	if( is_dead() )
 	{
 		env_universal_common_set( name.c_str(), value.c_str(), exportv );
@@ -423,7 +702,7 @@ void env_universal_set( const wcstring &name, const wcstring &value, int exportv
 		}
 		
 		msg->count=1;
-        env_universal_server.unsent->push(msg);
+        env_universal_server.unsent->push_back(msg);
 		env_universal_barrier();
 	}
 }
@@ -438,6 +717,9 @@ int env_universal_remove( const wchar_t *name )
 		
 	CHECK( name, 1 );
 
+	if( offline )
+		go_online( 1 );
+
 	res = !env_universal_common_get( name );
 	debug( 3,
 		   L"env_universal_remove( \"%ls\" )",
@@ -451,13 +733,21 @@ int env_universal_remove( const wchar_t *name )
 	{
 		msg= create_message( ERASE, name, 0);
 		msg->count=1;
-        env_universal_server.unsent->push(msg);
+        env_universal_server.unsent->push_back(msg);
 		env_universal_barrier();
 	}
 	
 	return res;
 }
 
+void env_universal_get_names_with_prefix( const wcstring &prefix, wcstring_list_t &lst )
+{
+	if( !init )
+		return;
+
+	env_universal_common_get_names_with_prefix( prefix, lst );
+}
+
 void env_universal_get_names2( wcstring_list_t &lst,
                               int show_exported,
                               int show_unexported )
@@ -16,11 +16,17 @@ extern connection_t env_universal_server;
 
 /**
    Initialize the envuni library
+
+   \param save_file If this is not null and fishd isn't running, the
+   variables are read from this save file of fishd, and fishd is only
+   started once a variable is changed. Otherwise fishd is started right
+   away.
 */
 void env_universal_init( wchar_t * p, 
                         wchar_t *u, 
                         void (*sf)(),
-                        void (*cb)( int type, const wchar_t *name, const wchar_t *val ));
+                        void (*cb)( int type, const wchar_t *name, const wchar_t *val ),
+                        const char *save_file );
 /**
   Free memory used by envuni
 */
@@ -64,6 +70,21 @@ void env_universal_get_names2( wcstring_list_t &list,
 							  int show_exported,
 							  int show_unexported );
 
+/**
+   Ask fishd to send changes to the specified universal variable right
+   away, so that the change wakes up this fish. A name that ends with
+   '*' subscribes to all variables whose names start with the rest of
+   it. Changes to the variables that are not subscribed to are only
+   picked up by the next barrier.
+*/
+void env_universal_subscribe( const wcstring &name );
+
+/**
+   Add the names of the universal variables that start with the
+   specified prefix, ignoring case, to the specified list
+*/
+void env_universal_get_names_with_prefix( const wcstring &prefix, wcstring_list_t &list );
+
 /**
    Synchronize with fishd
 */
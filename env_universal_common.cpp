@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <pwd.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -29,6 +30,7 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <map>
+#include <vector>
 
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
@@ -67,24 +69,14 @@
 #define BARRIER_REPLY_MBS "BARRIER_REPLY"
 
 /**
-   Error message
-*/
-#define PARSE_ERR L"Unable to parse universal variable message: '%ls'"
-
-/**
-   ERROR string for internal buffered reader
-*/
-#define ENV_UNIVERSAL_ERROR 0x100
-
-/**
-   EAGAIN string for internal buffered reader
+   Non-wide version of the subscribe command
 */
-#define ENV_UNIVERSAL_AGAIN 0x101
+#define SUBSCRIBE_MBS "SUBSCRIBE"
 
 /**
-   EOF string for internal buffered reader
+   Error message
 */
-#define ENV_UNIVERSAL_EOF   0x102
+#define PARSE_ERR L"Unable to parse universal variable message: '%ls'"
 
 /**
    A variable entry. Stores the value of a variable and whether it
@@ -100,14 +92,34 @@ typedef struct var_uni_entry
 var_uni_entry_t;
 
 
+/**
+   A change that a message made, whose callback is made once all the
+   messages that were read along with it have been applied
+*/
+struct pending_callback_t
+{
+	int type;
+	wcstring key;
+	wcstring val;
+};
+
+typedef std::vector<pending_callback_t> pending_callback_list_t;
+
 static void parse_message( wchar_t *msg,
-			   connection_t *src );
+			   connection_t *src,
+			   pending_callback_list_t &pending );
 
 /**
    The table of all universal variables
 */
 std::map<wcstring, var_uni_entry_t*> env_universal_var;
 
+/**
+   The names of all universal variables, for finding the ones that
+   start with a prefix, ignoring case
+*/
+static name_index_t env_universal_names;
+
 /**
    Callback function, should be called on all events
 */
@@ -167,13 +179,48 @@ static const char *iconv_wide_names_2[]=
   }
   ;
 
+/**
+   Conversion descriptors kept by utf2wcs and wcs2utf
+*/
+static iconv_t utf2wcs_cd = (iconv_t) -1;
+static iconv_t wcs2utf_cd = (iconv_t) -1;
+
+/**
+   Get a conversion descriptor from the first available character set
+   of from_name to the first available one of to_name. The descriptor is
+   opened once and kept in the specified cache, since opening one for
+   every message was a large part of the cost of receiving all variables
+   when connecting.
+*/
+static iconv_t get_iconv( const char **to_name, const char **from_name, iconv_t *cache )
+{
+	int i, j;
+
+	if( *cache != (iconv_t) -1 )
+	{
+		/* Reset the conversion state left by the previous string */
+		iconv( *cache, 0, 0, 0, 0 );
+		return *cache;
+	}
+
+	for( i=0; to_name[i]; i++ )
+	{
+		for( j=0; from_name[j]; j++ )
+		{
+			*cache = iconv_open( to_name[i], from_name[j] );
+			if( *cache != (iconv_t) -1 )
+				return *cache;
+		}
+	}
+	return (iconv_t) -1;
+}
+
 /**
    Convert utf-8 string to wide string
  */
 static wchar_t *utf2wcs( const char *in )
 {
 	iconv_t cd=(iconv_t) -1;
-	int i,j;
 
 	wchar_t *out;
 
@@ -217,22 +264,23 @@ static wchar_t *utf2wcs( const char *in )
 
 	if( !out )
 		return 0;
-	
-	for( i=0; to_name[i]; i++ )
-	{
-		for( j=0; from_name[j]; j++ )
-		{
-			cd = iconv_open ( to_name[i], from_name[j] );
 
-			if( cd != (iconv_t) -1)
-			{
-				goto start_conversion;
-				
-			}
-		}
+	/*
+	  Messages escape everything outside of ascii, so they hardly ever
+	  need iconv
+	*/
+	size_t i;
+	for( i=0; i<in_len && !( in[i] & 0x80 ); i++ )
+	{
+		out[i] = (unsigned char)in[i];
 	}
-
-  start_conversion:
+	if( i == in_len )
+	{
+		out[i] = L'\0';
+		return out;
+	}
+	
+	cd = get_iconv( to_name, from_name, &utf2wcs_cd );
 
 	if (cd == (iconv_t) -1)
 	{
@@ -251,6 +299,7 @@ static wchar_t *utf2wcs( const char *in )
 	if (nconv == (size_t) -1)
 	{
 		debug( 0, L"Error while converting from utf string" );
+		free( out );
 		return 0;
 	}
 	     
@@ -274,9 +323,6 @@ static wchar_t *utf2wcs( const char *in )
 	}
 	
 	
-	if (iconv_close (cd) != 0)
-		wperror (L"iconv_close");
-	
 	return out;	
 }
 
@@ -286,7 +332,6 @@ static wchar_t *utf2wcs( const char *in )
 static char *wcs2utf( const wchar_t *in )
 {
 	iconv_t cd=(iconv_t) -1;
-	int i,j;
 	
 	char *char_in = (char *)in;
 	char *out;
@@ -329,21 +374,7 @@ static char *wcs2utf( const wchar_t *in )
 	if( !out )
 		return 0;
 	
-	for( i=0; to_name[i]; i++ )
-	{
-		for( j=0; from_name[j]; j++ )
-		{
-			cd = iconv_open ( to_name[i], from_name[j] );
-			
-			if( cd != (iconv_t) -1)
-			{
-				goto start_conversion;
-				
-			}
-		}
-	}
-
-  start_conversion:
+	cd = get_iconv( to_name, from_name, &wcs2utf_cd );
 
 	if (cd == (iconv_t) -1)
 	{
@@ -364,14 +395,12 @@ static char *wcs2utf( const wchar_t *in )
 	{
 		debug( 0, L"%d %d", in_len, out_len );
 		debug( 0, L"Error while converting from to string" );
+		free( out );
 		return 0;
 	}
 	     
 	*nout = '\0';
 	
-	if (iconv_close (cd) != 0)
-		wperror (L"iconv_close");
-	
 	return out;	
 }
 
@@ -395,72 +424,48 @@ void env_universal_common_destroy()
 }
 
 /**
-   Read one byte of date form the specified connection
- */
-static int read_byte( connection_t *src )
+   Convert and parse a single message, which must not contain the
+   terminating newline
+*/
+static void handle_line( const char *line, connection_t *src, pending_callback_list_t &pending )
 {
-
-	if( src->buffer_consumed >= src->buffer_used )
+	wchar_t *msg = utf2wcs( line );
+	
+	if( msg )
 	{
-
-		int res;
-
-		res = read( src->fd, src->buffer, ENV_UNIVERSAL_BUFFER_SIZE );
-		
-//		debug(4, L"Read chunk '%.*s'", res, src->buffer );
-		
-		if( res < 0 )
-		{
-
-			if( errno == EAGAIN ||
-				errno == EINTR )
-			{
-				return ENV_UNIVERSAL_AGAIN;
-			}
-		
-			return ENV_UNIVERSAL_ERROR;
-
-		}
-		
-		if( res == 0 )
-		{
-			return ENV_UNIVERSAL_EOF;
-		}
-		
-		src->buffer_consumed = 0;
-		src->buffer_used = res;
+		parse_message( msg, src, pending );
+	}
+	else
+	{
+		debug( 0, _(L"Could not convert message '%s' to wide character string"), line );
 	}
 	
-	return src->buffer[src->buffer_consumed++];
-
+	free( msg );
 }
 
-
 void read_message( connection_t *src )
 {
+	pending_callback_list_t pending;
+	
 	while( 1 )
 	{
-		
-		int ib = read_byte( src );
-		char b;
-		
-		switch( ib )
+		if( src->buffer_consumed >= src->buffer_used )
 		{
-			case ENV_UNIVERSAL_AGAIN:
-			{
-				return;
-			}
-
-			case ENV_UNIVERSAL_ERROR:
+			int res = read( src->fd, src->buffer, ENV_UNIVERSAL_BUFFER_SIZE );
+			
+			if( res < 0 )
 			{
-				debug( 2, L"Read error on fd %d, set killme flag", src->fd );
-				if( debug_level > 2 )
-					wperror( L"read" );
-				src->killme = 1;
-				return;
+				if( errno != EAGAIN && errno != EINTR )
+				{
+					debug( 2, L"Read error on fd %d, set killme flag", src->fd );
+					if( debug_level > 2 )
+						wperror( L"read" );
+					src->killme = 1;
+				}
+				break;
 			}
-
-			case ENV_UNIVERSAL_EOF:
+			
+			if( res == 0 )
 			{
 				src->killme = 1;
 				debug( 3, L"Fd %d has reached eof, set killme flag", src->fd );
@@ -472,43 +477,58 @@ void read_message( connection_t *src )
 						   L"Universal variable connection closed while reading command. Partial command recieved: '%s'", 
 						   &src->input.at(0));
 				}
-				return;
+				break;
 			}
+			
+			src->buffer_consumed = 0;
+			src->buffer_used = res;
 		}
 		
-		b = (char)ib;
+		/*
+		  Messages that are entirely in the buffer are parsed where
+		  they are. Only a message that is split between reads is
+		  copied into the input string.
+		*/
+		char *start = src->buffer + src->buffer_consumed;
+		char *end = src->buffer + src->buffer_used;
+		char *nl = (char *)memchr( start, '\n', end-start );
 		
-		if( b == '\n' )
+		if( !nl )
 		{
-			wchar_t *msg;
-			
-			b = 0;
-            src->input.push_back(b);
-			
-			msg = utf2wcs( &src->input.at(0) );
-			
-			/*
-			  Before calling parse_message, we must empty reset
-			  everything, since the callback function could
-			  potentially call read_message.
-			*/
-			src->input.clear();
-			
-			if( msg )
-			{
-				parse_message( msg, src );	
-			}
-			else
-			{
-				debug( 0, _(L"Could not convert message '%s' to wide character string"), &src->input.at(0) );
-			}
-			
-			free( msg );
-			
+			src->input.insert( src->input.end(), start, end );
+			src->buffer_consumed = src->buffer_used;
+			continue;
+		}
+		
+		*nl = 0;
+		src->buffer_consumed = nl+1 - src->buffer;
+		
+		if( src->input.empty() )
+		{
+			handle_line( start, src, pending );
 		}
 		else
 		{
-            src->input.push_back(b);
+			src->input.insert( src->input.end(), start, nl+1 );
+			handle_line( &src->input.at(0), src, pending );
+			src->input.clear();
+		}
+	}
+	
+	/*
+	  The callbacks are only made once everything that was read has
+	  been applied, so that a client that just connected sees the
+	  whole set of variables when the first change event fires. A
+	  callback could potentially call read_message, which is fine, since
+	  nothing of this call is left in the connection.
+	*/
+	if( callback )
+	{
+		for( size_t i=0; i<pending.size(); i++ )
+		{
+			const pending_callback_t &c = pending.at( i );
+			const bool is_set = c.type == SET || c.type == SET_EXPORT;
+			callback( c.type, c.type == BARRIER_REPLY ? 0 : c.key.c_str(), is_set ? c.val.c_str() : 0 );
 		}
 	}
 }
@@ -523,6 +543,7 @@ void env_universal_common_remove( const wcstring &name )
 	{
 		var_uni_entry_t* v = result->second;		
 		env_universal_var.erase(result);
+		env_universal_names.erase( name );
 		delete v;
 	}
 }
@@ -542,20 +563,33 @@ static int match( const wchar_t *msg, const wchar_t *cmd )
 	return 1;
 }
 
-void env_universal_common_set( const wchar_t *key, const wchar_t *val, int exportv )
+/**
+   Set the value of a universal variable, without calling the callback
+*/
+static void universal_set( const wcstring &key, const wchar_t *val, int exportv )
 {
+	std::map<wcstring, var_uni_entry_t*>::iterator result = env_universal_var.find(key);
 	var_uni_entry_t *entry;
+	if( result != env_universal_var.end() )
+	{
+		entry = result->second;
+	}
+	else
+	{
+		entry = new var_uni_entry_t;
+		env_universal_var.insert( std::pair<wcstring, var_uni_entry_t*>(key, entry));			
+		env_universal_names.insert( key );
+	}
+	entry->exportv=exportv;
+	entry->val = val;
+}
 
+void env_universal_common_set( const wchar_t *key, const wchar_t *val, int exportv )
+{
 	CHECK( key, );
 	CHECK( val, );
 	
-	entry = new var_uni_entry_t;
-
-	entry->exportv=exportv;
-	entry->val = val;
-	env_universal_common_remove( key );
-	
-	env_universal_var.insert( std::pair<wcstring, var_uni_entry_t*>(key, entry));			
+	universal_set( key, val, exportv );
 	if( callback )
 	{
 		callback( exportv?SET_EXPORT:SET, key, val );
@@ -567,7 +601,8 @@ void env_universal_common_set( const wchar_t *key, const wchar_t *val, int expor
    Parse message msg
 */
 static void parse_message( wchar_t *msg, 
-						   connection_t *src )
+						   connection_t *src,
+						   pending_callback_list_t &pending )
 {
 //	debug( 3, L"parse_message( %ls );", msg );
 	
@@ -586,20 +621,21 @@ static void parse_message( wchar_t *msg,
 		tmp = wcschr( name, L':' );
 		if( tmp )
 		{
-			wchar_t *key;
-			wchar_t *val;
-			
-			key = (wchar_t *)malloc( sizeof( wchar_t)*(tmp-name+1));
-			memcpy( key, name, sizeof( wchar_t)*(tmp-name));
-			key[tmp-name]=0;
-			
-			val = tmp+1;
-			val = unescape( val, 0 );
-			
-			env_universal_common_set( key, val, exportv );
-			
-			free( val );
-			free( key );
+			wchar_t *val = unescape( tmp+1, 0 );
+			if( val )
+			{
+				pending.push_back( pending_callback_t() );
+				pending_callback_t &c = pending.back();
+				c.type = exportv?SET_EXPORT:SET;
+				c.key.assign( name, tmp-name );
+				c.val = val;
+				universal_set( c.key, val, exportv );
+				free( val );
+			}
+			else
+			{
+				debug( 1, PARSE_ERR, msg );
+			}
 		}
 		else
 		{
@@ -627,24 +663,33 @@ static void parse_message( wchar_t *msg,
 
 		env_universal_common_remove( name );
 		
-		if( callback )
-		{
-			callback( ERASE, name, 0 );
-		}
+		pending.push_back( pending_callback_t() );
+		pending.back().type = ERASE;
+		pending.back().key = name;
 	}
 	else if( match( msg, BARRIER_STR) )
 	{
 		message_t *msg = create_message( BARRIER_REPLY, 0, 0 );
 		msg->count = 1;
-        src->unsent->push(msg);
+        src->unsent->push_back(msg);
+		src->wakeup = 1;
 		try_send_all( src );
 	}
+	else if( match( msg, SUBSCRIBE_STR ) )
+	{
+		wchar_t *name = msg+wcslen(SUBSCRIBE_STR);
+		while( wcschr( L"\t ", *name ) )
+			name++;
+		
+		if( !src->subscriptions )
+			src->subscriptions = new wcstring_list_t;
+		if( *name )
+			src->subscriptions->push_back( name );
+	}
 	else if( match( msg, BARRIER_REPLY_STR ) )
 	{
-		if( callback )
-		{
-			callback( BARRIER_REPLY, 0, 0 );
-		}
+		pending.push_back( pending_callback_t() );
+		pending.back().type = BARRIER_REPLY;
 	}
 	else
 	{
@@ -653,52 +698,17 @@ static void parse_message( wchar_t *msg,
 }
 
 /**
-   Attempt to send the specified message to the specified file descriptor
-
-   \return 1 on sucess, 0 if the message could not be sent without blocking and -1 on error
+   Release a message that has been written to one of the connections it
+   was queued for
 */
-static int try_send( message_t *msg,
-					 int fd )
+static void message_sent( message_t *msg )
 {
-
-	debug( 3,
-		   L"before write of %d chars to fd %d", strlen(msg->body), fd );	
-
-	int res = write( fd, msg->body, strlen(msg->body) );
-
-	if( res != -1 )
-	{
-		debug( 4, L"Wrote message '%s'", msg->body );
-	}
-	else
-	{
-		debug( 4, L"Failed to write message '%s'", msg->body );
-	}
-	
-	if( res == -1 )
-	{
-		switch( errno )
-		{
-			case EAGAIN:
-				return 0;
-				
-			default:
-				debug( 2,
-					   L"Error while sending universal variable message to fd %d. Closing connection",
-					   fd );
-				if( debug_level > 2 )
-					wperror( L"write" );
-				
-				return -1;
-		}		
-	}
 	msg->count--;
 	
 	if( !msg->count )
 	{
 		free( msg );
 	}
-	return 1;
 }
 
 void try_send_all( connection_t *c )
@@ -708,20 +718,62 @@ void try_send_all( connection_t *c )
 		   c->fd );*/
 	while( !c->unsent->empty() )
 	{
-		switch( try_send( c->unsent->front(), c->fd ) )
+		/*
+		  Write as many of the queued messages as possible at once,
+		  since there can be hundreds of them when a client connects
+		*/
+		struct iovec iov[ENV_UNIVERSAL_WRITE_BATCH];
+		size_t count = c->unsent->size();
+		if( count > ENV_UNIVERSAL_WRITE_BATCH )
+			count = ENV_UNIVERSAL_WRITE_BATCH;
+		
+		for( size_t i=0; i<count; i++ )
 		{
-			case 1:
-				c->unsent->pop();
-				break;
-				
-			case 0:
+			message_t *msg = c->unsent->at( i );
+			size_t offset = i ? 0 : c->sent_offset;
+			iov[i].iov_base = msg->body + offset;
+			iov[i].iov_len = strlen( msg->body ) - offset;
+		}
+		
+		ssize_t res = writev( c->fd, iov, count );
+		if( res == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			
+			if( errno == EAGAIN )
+			{
 				debug( 4,
 					   L"Socket full, send rest later" );	
 				return;
-								
-			case -1:
-				c->killme = 1;
-				return;
+			}
+			
+			debug( 2,
+				   L"Error while sending universal variable message to fd %d. Closing connection",
+				   c->fd );
+			if( debug_level > 2 )
+				wperror( L"writev" );
+			c->killme = 1;
+			return;
+		}
+		
+		/*
+		  Drop the messages that were written completely, and remember
+		  how much of the first remaining one was
+		*/
+		size_t written = res;
+		for( size_t i=0; i<count; i++ )
+		{
+			if( written < iov[i].iov_len )
+			{
+				c->sent_offset += written;
+				break;
+			}
+			
+			written -= iov[i].iov_len;
+			message_sent( c->unsent->front() );
+			c->unsent->pop_front();
+			c->sent_offset = 0;
 		}
 	}
 }
@@ -768,7 +820,10 @@ message_t *create_message( int type,
 	
 	if( key_in )
 	{
-		if( wcsvarname( key_in ) )
+		/* Subscriptions may end with a wildcard */
+		const wcstring name = key_in;
+		const bool is_pattern = type == SUBSCRIBE && string_suffixes_string( L"*", name );
+		if( wcsvarname( is_pattern ? name.substr( 0, name.size()-1 ).c_str() : key_in ) )
 		{
 			debug( 0, L"Illegal variable name: '%ls'", key_in );
 			return 0;
@@ -850,6 +905,22 @@ message_t *create_message( int type,
 			break;
 		}
 		
+		case SUBSCRIBE:
+		{
+			sz = strlen(SUBSCRIBE_MBS) + (key ? strlen(key) : 0) + 3;
+			msg = (message_t *)malloc( sizeof( message_t ) + sz );
+			if( !msg )
+				DIE_MEM();
+			strcpy( msg->body, SUBSCRIBE_MBS );
+			if( key )
+			{
+				strcat( msg->body, " " );
+				strcat( msg->body, key );
+			}
+			strcat( msg->body, "\n" );
+			break;
+		}
+		
 		default:
 		{
 			debug( 0, L"create_message: Unknown message type" );
@@ -888,6 +959,10 @@ void env_universal_common_get_names( wcstring_list_t &lst,
 
 }
 
+void env_universal_common_get_names_with_prefix( const wcstring &prefix, wcstring_list_t &lst )
+{
+	env_universal_names.find_prefix( prefix, lst );
+}
 
 wchar_t *env_universal_common_get( const wcstring &name )
 {
@@ -926,24 +1001,42 @@ void enqueue_all( connection_t *c )
 	
 		message_t *msg = create_message( val->exportv?SET_EXPORT:SET, key.c_str(), val->val.c_str() );
 		msg->count=1;
-		c->unsent->push(msg);
+		c->unsent->push_back(msg);
 	}
 
 	try_send_all( c );
 }
 
 
+bool connection_is_subscribed( const connection_t *c, const wcstring &key )
+{
+	if( !c->subscriptions )
+		return true;
+	
+	for( size_t i=0; i<c->subscriptions->size(); i++ )
+	{
+		const wcstring &name = c->subscriptions->at( i );
+		if( name == key )
+			return true;
+		if( string_suffixes_string( L"*", name ) && key.compare( 0, name.size()-1, name, 0, name.size()-1 ) == 0 )
+			return true;
+	}
+	return false;
+}
+
 void connection_init( connection_t *c, int fd )
 {
 	memset (c, 0, sizeof (connection_t));
 	c->fd = fd;
-    c->unsent = new std::queue<message_t *>;
+    c->unsent = new message_queue_t;
 	c->buffer_consumed = c->buffer_used = 0;	
 }
 
 void connection_destroy( connection_t *c)
 {
     if (c->unsent) delete c->unsent;
+    delete c->subscriptions;
+    c->subscriptions = 0;
 
 	/*
 	  A connection need not always be open - we only try to close it
@@ -957,3 +1050,18 @@ void connection_destroy( connection_t *c)
 		}
 	}
 }
+
+std::string env_universal_save_filename( const std::string &dir )
+{
+	char hostname[SAVE_HOSTNAME_LEN+1];
+	
+	gethostname( hostname, SAVE_HOSTNAME_LEN );
+	hostname[SAVE_HOSTNAME_LEN] = 0;
+	
+    std::string name;
+    name.append(dir);
+    name.append("/");
+    name.append(SAVE_FILENAME);
+    name.append(hostname);
+	return name;
+}
@@ -2,7 +2,8 @@
 #define FISH_ENV_UNIVERSAL_COMMON_H
 
 #include <wchar.h>
-#include <queue>
+#include <stdint.h>
+#include <deque>
 #include "util.h"
 
 /**
@@ -30,12 +31,60 @@
 */
 #define BARRIER_REPLY_STR L"BARRIER_REPLY"
 
+/**
+   The subscribe command. A client that sends it is only sent the
+   changes to variables it subscribed to right away, and gets the rest
+   along with the reply to its next barrier. It is followed by a
+   variable name to subscribe to, or by nothing to start with no
+   subscriptions. A name that ends with '*' subscribes to all variables
+   whose names start with the rest of it.
+*/
+#define SUBSCRIBE_STR L"SUBSCRIBE"
+
 
 /**
    The filename to use for univeral variables. The username is appended
 */
 #define SOCK_FILENAME "fishd.socket."
 
+/**
+   The filename of the file in which fishd counts changes to universal
+   variables. The username is appended
+*/
+#define GENERATION_FILENAME "fishd.generation."
+
+/**
+   The name of the save file of fishd in the configuration directory.
+   The hostname is appended to this.
+*/
+#define SAVE_FILENAME "fishd."
+
+/**
+   Maximum length of hostname in the name of the save file. Longer
+   hostnames are truncated
+*/
+#define SAVE_HOSTNAME_LEN 32
+
+/**
+   Magic number at the start of the generation file
+*/
+#define UNIVERSAL_GENERATION_MAGIC 0x66697368
+
+/**
+   The contents of the generation file, which fishd and its clients map
+   into memory. fishd increments the generation after every change to a
+   universal variable, once the change has been queued for all clients.
+   A client that has nothing to send and sees the same generation as
+   when it started its last barrier therefore knows that a new barrier
+   would not bring any news, and can skip the round trip to fishd.
+*/
+typedef struct
+{
+	uint32_t magic;
+	volatile uint32_t generation;
+}
+	universal_generation_t;
+
 /**
    The different types of commands that can be sent between client/server
 */
@@ -46,13 +95,21 @@ enum
 	ERASE,
 	BARRIER,
 	BARRIER_REPLY,
+	SUBSCRIBE,
 }
 	;
 
 /**
-   The size of the buffer used for reading from the socket
+   The size of the buffer used for reading from the socket. It is large
+   enough for the few hundred variables a client usually gets when it
+   connects to take only a few reads.
 */
-#define ENV_UNIVERSAL_BUFFER_SIZE 1024
+#define ENV_UNIVERSAL_BUFFER_SIZE 16384
+
+/**
+   The largest number of messages that are written to a socket at once
+*/
+#define ENV_UNIVERSAL_WRITE_BATCH 64
 
 /**
    A struct representing a message to be sent between client and server
@@ -70,7 +127,7 @@ typedef struct
 }
 	message_t;
 
-typedef std::queue<message_t *> message_queue_t;
+typedef std::deque<message_t *> message_queue_t;
 
 /**
    This struct represents a connection between a universal variable server/client
@@ -85,13 +142,27 @@ typedef struct connection
 	   Queue of onsent messages
 	*/
     message_queue_t *unsent;
+	/**
+	   Number of bytes of the first unsent message that have already been sent
+	*/
+	size_t sent_offset;
 	/**
 	   Set to one when this connection should be killed
 	*/
 	int killme;
 	/**
-	   The input string. Input from the socket goes here. When a
-	   newline is encountered, the buffer is parsed and cleared.
+	   The variables the other end subscribed to, or 0 if it wants
+	   every change sent right away
+	*/
+	wcstring_list_t *subscriptions;
+	/**
+	   Set to one when a queued message is for a subscribed variable,
+	   so the queue should be sent right away
+	*/
+	int wakeup;
+	/**
+	   The start of a message that was split between two reads. Messages
+	   that are read in one piece are parsed in the read buffer.
 	*/
 	std::vector<char> input;
 	
@@ -119,12 +190,15 @@ typedef struct connection
 	connection_t;
 
 /**
-   Read all available messages on this connection
+   Read all available messages on this connection, and apply them. The
+   callback is called for the changes once all of them are applied.
 */
 void read_message( connection_t * );
 
 /**
-   Send as many messages as possible without blocking to the connection
+   Send as many messages as possible without blocking to the connection.
+   Queued messages are written together, so that updates that are queued
+   at the same time go out in a single write.
 */
 void try_send_all( connection_t *c );
 
@@ -153,6 +227,15 @@ void env_universal_common_get_names( wcstring_list_t &lst,
 									 int show_exported,
 									 int show_unexported );
 
+/**
+   Add the names of the universal variables that start with the
+   specified prefix, ignoring case, to the specified list
+
+   This function operate agains the local copy of all universal
+   variables, it does not communicate with any other process.
+*/
+void env_universal_common_get_names_with_prefix( const wcstring &prefix, wcstring_list_t &lst );
+
 /**
    Perform the specified variable assignment.
 
@@ -197,6 +280,12 @@ int env_universal_common_get_export( const wcstring &name );
 */
 void enqueue_all( connection_t *c );
 
+/**
+   Returns whether the other end of the connection wants changes to the
+   specified variable sent right away
+*/
+bool connection_is_subscribed( const connection_t *c, const wcstring &key );
+
 /**
    Fill in the specified connection_t struct. Use the specified file
    descriptor for communication.
@@ -210,4 +299,10 @@ void connection_init( connection_t *c, int fd );
 */
 void connection_destroy( connection_t *c);
 
+/**
+   Returns the name of the save file of fishd in the specified
+   configuration directory
+*/
+std::string env_universal_save_filename( const std::string &dir );
+
 #endif
@@ -13,6 +13,7 @@
 #include <signal.h>
 #include <string.h>
 #include <algorithm>
+#include <tr1/unordered_map>
 
 #include "fallback.h"
 #include "util.h"
@@ -24,6 +25,8 @@
 #include "common.h"
 #include "event.h"
 #include "signal.h"
+#include "exec.h"
+#include "env_universal.h"
 
 /**
    Number of signals that can be queued before an overflow occurs
@@ -80,6 +83,49 @@ static event_list_t killme;
 */
 static event_list_t blocked;
 
+/**
+   Indices in the events list of some event handlers, in order
+*/
+typedef std::vector<size_t> event_index_list_t;
+
+/**
+   The event handlers indexed by what they are triggered by, so that
+   firing an event does not have to look at handlers for other
+   events. Handlers for any signal or any process are indexed under
+   EVENT_ANY_SIGNAL and EVENT_ANY_PID. Only contains lists that are
+   not empty.
+*/
+struct event_index_t
+{
+	/** Handlers of the type EVENT_ANY */
+	event_index_list_t any;
+	/** Handlers of the type EVENT_SIGNAL by signal number */
+	std::tr1::unordered_map<int, event_index_list_t> signals;
+	/** Handlers of the type EVENT_EXIT by process id */
+	std::tr1::unordered_map<pid_t, event_index_list_t> pids;
+	/** Handlers of the type EVENT_JOB_ID by job id */
+	std::tr1::unordered_map<int, event_index_list_t> job_ids;
+	/** Handlers of the type EVENT_VARIABLE by variable name */
+	std::tr1::unordered_map<wcstring, event_index_list_t> variables;
+	/** Handlers of the type EVENT_GENERIC by event name */
+	std::tr1::unordered_map<wcstring, event_index_list_t> generics;
+	
+	void clear()
+	{
+		any.clear();
+		signals.clear();
+		pids.clear();
+		job_ids.clear();
+		variables.clear();
+		generics.clear();
+	}
+};
+
+/**
+   The index of the events list
+*/
+static event_index_t event_index;
+
 /**
    Tests if one event instance matches the definition of a event
    class. If both the class and the instance name a function,
@@ -135,6 +181,126 @@ static int event_match( const event_t *classv, const event_t *instance )
 }
 
 
+/**
+   Find the list in a map of the index that has the handlers for the specified key. 
+
+   \param create whether to create the list if there is none
+   \return the list, or null if there is none
+*/
+template<typename T>
+static event_index_list_t *event_index_find( std::tr1::unordered_map<T, event_index_list_t> &map, const T &key, bool create )
+{
+	if( create )
+		return &map[key];
+
+	typename std::tr1::unordered_map<T, event_index_list_t>::iterator iter = map.find( key );
+	return iter == map.end() ? 0 : &iter->second;
+}
+
+/**
+   Find the list of the index that has the handlers of the same type
+   and parameter as the specified event.
+
+   \param create whether to create the list if there is none
+   \return the list, or null if there is none
+*/
+static event_index_list_t *event_index_list( const event_t *e, bool create )
+{
+	switch( e->type )
+	{
+		case EVENT_ANY:
+			return &event_index.any;
+			
+		case EVENT_SIGNAL:
+			return event_index_find( event_index.signals, e->param1.signal, create );
+			
+		case EVENT_EXIT:
+			return event_index_find( event_index.pids, e->param1.pid, create );
+
+		case EVENT_JOB_ID:
+			return event_index_find( event_index.job_ids, e->param1.job_id, create );
+
+		case EVENT_VARIABLE:
+			return event_index_find( event_index.variables, e->str_param1, create );
+
+		case EVENT_GENERIC:
+			return event_index_find( event_index.generics, e->str_param1, create );
+	}
+	return 0;
+}
+
+/**
+   Rebuild the index from the events list
+*/
+static void event_index_rebuild()
+{
+	event_index.clear();
+	for( size_t i=0; i<events.size(); i++ )
+	{
+		event_index_list_t *lst = event_index_list( events.at(i), true );
+		if( lst )
+			lst->push_back( i );
+	}
+}
+
+/**
+   Add the indices of the handlers in the list of the index for the
+   specified event to the specified vector.
+
+   \return whether any were added
+*/
+static bool event_index_get( const event_t *e, event_index_list_t &out )
+{
+	const event_index_list_t *lst = event_index_list( e, false );
+	if( ! lst || lst->empty() )
+		return false;
+	out.insert( out.end(), lst->begin(), lst->end() );
+	return true;
+}
+
+/**
+   Find all event handlers that match the specified event instance,
+   in the order they were added
+*/
+static void event_get_matching( const event_t *instance, event_list_t &out )
+{
+	event_index_list_t candidates;
+	int sources = 0;
+
+	sources += event_index_get( instance, candidates );
+	if( ! event_index.any.empty() )
+	{
+		candidates.insert( candidates.end(), event_index.any.begin(), event_index.any.end() );
+		sources++;
+	}
+	
+	/*
+	  Handlers for any signal or process are indexed under the value
+	  that matches any
+	*/
+	event_t any( instance->type );
+	if( instance->type == EVENT_SIGNAL && instance->param1.signal != EVENT_ANY_SIGNAL )
+	{
+		any.param1.signal = EVENT_ANY_SIGNAL;
+		sources += event_index_get( &any, candidates );
+	}
+	else if( instance->type == EVENT_EXIT && instance->param1.pid != EVENT_ANY_PID )
+	{
+		any.param1.pid = EVENT_ANY_PID;
+		sources += event_index_get( &any, candidates );
+	}
+
+	if( sources > 1 )
+		std::sort( candidates.begin(), candidates.end() );
+
+	for( size_t i=0; i<candidates.size(); i++ )
+	{
+		event_t *criterion = events.at( candidates.at(i) );
+		if( event_match( criterion, instance ) )
+			out.push_back( criterion );
+	}
+}
+
 /**
    Create an identical copy of an event. Use deep copying, i.e. make
    duplicates of any strings used as well.
@@ -247,11 +413,21 @@ void event_add_handler( const event_t *event )
 	{
 		signal_handle( e->param1.signal, 1 );
 	}
+	
+	/* A change to the variable in another session should run the handler right away */
+	if( e->type == EVENT_VARIABLE && !wcsvarname( e->str_param1.c_str() ) )
+	{
+		env_universal_subscribe( e->str_param1 );
+	}
     
     // Block around updating the events vector
     signal_block();
     events.push_back(e);
     signal_unblock();
+
+	event_index_list_t *lst = event_index_list( e, true );
+	if( lst )
+		lst->push_back( events.size()-1 );
 }
 
 void event_remove( event_t *criterion )
@@ -303,6 +479,8 @@ void event_remove( event_t *criterion )
     signal_block();
 	events.swap(new_list);
     signal_unblock();
+
+	event_index_rebuild();
 }
 
 int event_get( event_t *criterion, std::vector<event_t *> *out )
@@ -350,6 +528,11 @@ bool event_is_signal_observed(int sig)
     return false;
 }
 
+bool event_is_variable_observed( const wcstring &name )
+{
+	return ! event_index.any.empty() || event_index.variables.find( name ) != event_index.variables.end();
+}
+
 /**
    Free all events in the kill list
 */
@@ -388,24 +571,13 @@ static void event_fire_internal( const event_t *event )
 		return;
 
 	/*
-	  Then we iterate over all events, adding events that should be
-	  fired to a second list. We need to do this in a separate step
-	  since an event handler might call event_remove or
+	  Then we look up the events that should be fired in the index,
+	  adding them to a second list. We need to do this in a separate
+	  step since an event handler might call event_remove or
 	  event_add_handler, which will change the contents of the \c
 	  events list.
 	*/
-	for( i=0; i<events.size(); i++ )
-	{
-		event_t *criterion = events.at(i);
-		
-		/*
-		  Check if this event is a match
-		*/
-		if(event_match( criterion, event ) )
-		{
-            fire.push_back(criterion);
-		}
-	}
+	event_get_matching( event, fire );
 	
 	/*
 	  No matches. Time to return.
@@ -431,20 +603,14 @@ static void event_fire_internal( const event_t *event )
 		/*
 		  Fire event
 		*/
-		wcstring buffer = criterion->function_name;
-		
+		wcstring_list_t argv;
+		argv.reserve( 1 + (event->arguments.get() ? event->arguments->size() : 0) );
+		argv.push_back( criterion->function_name );
         if (event->arguments.get())
         {
-            for( j=0; j< event->arguments->size(); j++ )
-            {
-                wcstring arg_esc = escape_string( event->arguments->at(j), 1 );		
-                buffer += L" ";
-                buffer += arg_esc;
-            }
+			argv.insert( argv.end(), event->arguments->begin(), event->arguments->end() );
         }
 
-//		debug( 1, L"Event handler fires command '%ls'", (wchar_t *)b->buff );
-		
 		/*
 		  Event handlers are not part of the main flow of code, so
 		  they are marked as non-interactive
@@ -454,7 +620,22 @@ static void event_fire_internal( const event_t *event )
         parser_t &parser = parser_t::principal_parser();
 		parser.push_block( EVENT );
 		parser.current_block->state1<const event_t *>() = event;
-		parser.eval( buffer.c_str(), 0, TOP );
+		
+		/*
+		  The handler is called directly with the arguments. Only if
+		  that can't be done is the call evaluated as a command, so
+		  that the parser reports the problem.
+		*/
+		if( ! exec_function( parser, argv ) )
+		{
+			wcstring buffer = criterion->function_name;
+			for( j=1; j<argv.size(); j++ )
+			{
+				buffer += L" ";
+				buffer += escape_string( argv.at(j), 1 );
+			}
+			parser.eval( buffer.c_str(), 0, TOP );
+		}
 		parser.pop_block();
 		proc_pop_interactive();					
 		proc_set_last_status( prev_status );
@@ -603,6 +784,7 @@ void event_destroy()
 
     for_each(events.begin(), events.end(), event_free);
     events.clear();
+	event_index.clear();
     
     for_each(killme.begin(), killme.end(), event_free);
     killme.clear();
@@ -128,6 +128,13 @@ int event_get( event_t *criterion, std::vector<event_t *> *out );
 */
 bool event_is_signal_observed(int signal);
 
+/**
+   Returns whether an event handler is registered for changes to the
+   variable with the specified name. If not, there is no need to fire
+   an event when it changes.
+*/
+bool event_is_variable_observed( const wcstring &name );
+
 /**
    Fire the specified event. The function_name field of the event must
    be set to 0. If the event is of type EVENT_SIGNAL, no the event is
@@ -51,6 +51,9 @@
 #include "signal.h"
 
 #include "parse_util.h"
+#include "reader.h"
+#include "profiler.h"
+#include "trace.h"
 
 /**
    file descriptor redirection error message
@@ -123,6 +126,7 @@ int exec_pipe( int fd[2])
 {
 	int res;
 	
+	syscall_count( SYSCALL_PIPE );
 	while( ( res=pipe( fd ) ) )
 	{
 		if( errno != EINTR )
@@ -192,34 +196,52 @@ void close_unused_internal_pipes( io_data_t *io )
     }
 }
 
+void get_unused_internal_pipes( std::vector<int> &fds, io_data_t *io )
+{
+    for (size_t i=0; i < open_fds.size(); i++) {
+        if (open_fds[i]) {
+            int fd = (int)i;
+            if( !use_fd_in_pipe( fd, io) )
+                fds.push_back(fd);
+        }
+    }
+}
+
 /**
-   Returns the interpreter for the specified script. Returns NULL if file
-   is not a script with a shebang.
- */
-static char *get_interpreter( const char *command, char *interpreter, size_t buff_size )
+   Reads the first line of the specified file into buff, with a single
+   read of at most buff_size - 1 bytes, and null terminates it. buff is
+   left empty if the file can't be read.
+*/
+static void read_first_line( const char *command, char *buff, size_t buff_size )
 {
+    size_t len = 0;
+    
     // OK to not use CLO_EXEC here because this is only called after fork
 	int fd = open( command, O_RDONLY );
 	if( fd >= 0 )
 	{
-        size_t idx = 0;
-		while( idx + 1 < buff_size )
-		{
-            char ch;
-            ssize_t amt = read(fd, &ch, sizeof ch);
-			if( amt <= 0 )
-				break;
-			if( ch == '\n' )
-				break;
-            interpreter[idx++] = ch;
-		}
-        interpreter[idx++] = '\0';
+        ssize_t amt = read(fd, buff, buff_size - 1);
         close(fd);
+        
+        if( amt > 0 )
+        {
+            const char *newline = (const char *)memchr(buff, '\n', amt);
+            len = newline ? newline - buff : amt;
+        }
 	}
-	if (strncmp(interpreter, "#! /", 4) == 0) {
-        return interpreter + 3;
-    } else if (strncmp(interpreter, "#!/", 3) == 0) {
-        return interpreter + 2;
+    buff[len] = '\0';
+}
+
+/**
+   Returns the interpreter named in the first line of a script, as read
+   by read_first_line. Returns NULL if the line is not a shebang.
+ */
+static char *get_interpreter( char *first_line )
+{
+	if (strncmp(first_line, "#! /", 4) == 0) {
+        return first_line + 3;
+    } else if (strncmp(first_line, "#!/", 3) == 0) {
+        return first_line + 2;
     } else {
         return NULL;
     }
@@ -238,7 +260,7 @@ static void safe_launch_process( process_t *p, const char *actual_cmd, char **ar
 	
 //	debug( 1, L"exec '%ls'", p->argv[0] );
 
-	execve ( wcs2str(p->actual_cmd), 
+	execve ( actual_cmd, 
 		 argv,
 		 envv );
 	
@@ -248,29 +270,24 @@ static void safe_launch_process( process_t *p, const char *actual_cmd, char **ar
 	   Something went wrong with execve, check for a ":", and run
 	   /bin/sh if encountered. This is a weird predecessor to the shebang
 	   that is still sometimes used since it is supported on Windows.
+	   The first line is read once, since it is also needed to explain
+	   a missing interpreter below.
 	*/
-    /* OK to not use CLO_EXEC here because this is called after fork and the file is immediately closed */
-	int fd = open(actual_cmd, O_RDONLY);
-	if (fd >= 0)
+	char first_line[128];
+	read_first_line( actual_cmd, first_line, sizeof first_line );
+	if( first_line[0] == ':' )
 	{
-		char begin[1] = {0};
-		ssize_t amt_read = read(fd, begin, 1);
-		close(fd);
-		
-		if( (amt_read==1) && (begin[0] == ':') )
-		{
-            // Relaunch it with /bin/sh. Don't allocate memory, so if you have more args than this, update your silly script! Maybe this should be changed to be based on ARG_MAX somehow.
-            char sh_command[] = "/bin/sh";
-            char *argv2[128];
-            argv2[0] = sh_command;
-            for (size_t i=1; i < sizeof argv2 / sizeof *argv2; i++) {
-                argv2[i] = argv[i-1];
-                if (argv2[i] == NULL)
-                    break;
-            }
-            
-			execve(sh_command, argv2, envv);
-		}
+        // Relaunch it with /bin/sh. Don't allocate memory, so if you have more args than this, update your silly script! Maybe this should be changed to be based on ARG_MAX somehow.
+        char sh_command[] = "/bin/sh";
+        char *argv2[128];
+        argv2[0] = sh_command;
+        for (size_t i=1; i < sizeof argv2 / sizeof *argv2; i++) {
+            argv2[i] = argv[i-1];
+            if (argv2[i] == NULL)
+                break;
+        }
+        
+		execve(sh_command, argv2, envv);
 	}
 	
 	errno = err;
@@ -327,8 +344,7 @@ static void safe_launch_process( process_t *p, const char *actual_cmd, char **ar
 
 		case ENOENT:
 		{
-            char interpreter_buff[128] = {}, *interpreter;
-            interpreter = get_interpreter(actual_cmd, interpreter_buff, sizeof interpreter_buff);
+            char *interpreter = get_interpreter(first_line);
 			if( interpreter && 0 != access( interpreter, X_OK ) )
 			{
 				debug_safe(0, "The file '%s' specified the interpreter '%s', which is not an executable command.", actual_cmd, interpreter );
@@ -484,12 +500,14 @@ static io_data_t *io_transmogrify( io_data_t * in )
    \param def the code to evaluate
    \param block_type the type of block to push on evaluation
    \param io the io redirections to be performed on this block
+   \param def_tokens if non-null, the pre-tokenized form of def
 */
 
 static void internal_exec_helper( parser_t &parser,
                                   const wchar_t *def, 
 								  enum block_type_t block_type,
-								  io_data_t *io )
+								  io_data_t *io,
+								  const tok_cache_t *def_tokens = NULL )
 {
 	io_data_t *io_internal = io_transmogrify( io );
 	int is_block_old=is_block;
@@ -506,7 +524,7 @@ static void internal_exec_helper( parser_t &parser,
 	
 	signal_unblock();
 	
-	parser.eval( def, io_internal, block_type );		
+	parser.eval( def, io_internal, block_type, def_tokens );		
 	
 	signal_block();
 	
@@ -543,8 +561,204 @@ static void do_builtin_io( const char *out, const char *err )
 }
 
 
+/**
+   Writes as much of the buffer to the file descriptor as it takes
+   without blocking, and returns how much that was.
+*/
+static size_t write_nonblocking( int fd, const char *buff, size_t count )
+{
+	int flags = fcntl( fd, F_GETFL );
+	if( flags == -1 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) == -1 )
+		return 0;
+
+	size_t written = 0;
+	while( written < count )
+	{
+		ssize_t res = write( fd, buff + written, count - written );
+		if( res < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			break;
+		}
+		written += res;
+	}
+
+	fcntl( fd, F_SETFL, flags );
+	return written;
+}
+
+/**
+   Call the function named by argv[0] of the specified process
+
+   \param j the job of the process, or null if it is not run as part of a job
+   \param io_buffer set to the buffer that the output is written to if the process has a successor in a pipeline
+*/
+static void exec_function_call( parser_t &parser, job_t *j, process_t *p, io_data_t *&io_buffer )
+{
+	wchar_t * def=0;
+	int shadows;
+	
+	/*
+	  Calls to function_get_definition might need to
+	  source a file as a part of autoloading, hence there
+	  must be no blocks.
+	*/
+
+	signal_unblock();
+	wcstring orig_def;
+	function_get_definition( p->argv0(), &orig_def );
+	std::tr1::shared_ptr<const tok_cache_t> def_tokens = function_get_definition_tokens( p->argv0() );
+	
+	// function_get_named_arguments may trigger autoload, which deallocates the orig_def.
+	// We should make function_get_definition return a wcstring (but how to handle NULL...)
+	if (! orig_def.empty())
+		def = wcsdup(orig_def.c_str());
+	
+	wcstring_list_t named_arguments = function_get_named_arguments( p->argv0() );
+	shadows = function_get_shadows( p->argv0() );
+
+	signal_block();
+	
+	if( def == NULL )
+	{
+		debug( 0, _( L"Unknown function '%ls'" ), p->argv0() );
+		return;
+	}
+	parser.push_block( shadows?FUNCTION_CALL:FUNCTION_CALL_NO_SHADOW );
+	
+	parser.current_block->state2<process_t *>() = p;
+	parser.current_block->state1<wcstring>() = p->argv0();
+			
+
+	/*
+	  set_argv might trigger an event
+	  handler, hence we need to unblock
+	  signals.
+	*/
+	signal_unblock();
+	parse_util_set_argv( p->get_argv()+1, named_arguments );
+	signal_block();
+					
+	parser.forbid_function( p->argv0() );
+
+	if( p->next )
+	{
+		io_buffer = io_buffer_create( 0 );					
+		j->io = io_add( j->io, io_buffer );
+	}
+	
+	{
+		profile_function_scope_t profile_function( p->argv0() );
+		internal_exec_helper( parser, def, TOP, j ? j->io : 0, def_tokens.get() );
+	}
+	
+	parser.allow_function();
+	parser.pop_block();
+	free(def);
+}
+
+bool exec_function( parser_t &parser, const wcstring_list_t &argv )
+{
+	if( argv.empty() || ! function_exists( argv.at(0) ) || parser.function_recursion_too_deep() )
+		return false;
+	
+	process_t p;
+	p.type = INTERNAL_FUNCTION;
+	p.set_argv( argv );
+	io_data_t *io_buffer = 0;
+	
+	signal_block();
+	exec_function_call( parser, 0, &p, io_buffer );
+	signal_unblock();
+	return true;
+}
+
+/**
+   Whether the job is a single builtin or function in the foreground,
+   without any redirections. Nothing needs to be forked to run such a
+   job, so exec_direct can run it without setting up pipes and
+   blocking signals.
+*/
+static bool exec_is_direct( const parser_t &parser, const job_t *j )
+{
+	const process_t *p = j->first_process;
+	return ( p->type == INTERNAL_BUILTIN || p->type == INTERNAL_FUNCTION ) &&
+		! p->next &&
+		! j->io &&
+		! parser.block_io &&
+		job_get_flag( j, JOB_FOREGROUND );
+}
+
+/**
+   Run a job for which exec_is_direct is true. This does what exec
+   would do for the job, minus everything it does for pipelines and
+   child processes.
+*/
+static void exec_direct( parser_t &parser, job_t *j )
+{
+	process_t *p = j->first_process;
+	int status;
+
+	if( p->type == INTERNAL_BUILTIN )
+	{
+		int old_out = builtin_out_redirect;
+		int old_err = builtin_err_redirect;
+
+		builtin_push_io( parser, 0 );
+		builtin_out_redirect = builtin_err_redirect = 0;
+
+		/* See the comment on running builtins in exec */
+		job_set_flag( j, JOB_FOREGROUND, 0 );
+		p->status = builtin_run( parser, p->get_argv(), 0 );
+		job_set_flag( j, JOB_FOREGROUND, 1 );
+
+		builtin_out_redirect = old_out;
+		builtin_err_redirect = old_err;
+
+		const wcstring &out = get_stdout_buffer(), &err = get_stderr_buffer();
+		if( ! out.empty() || ! err.empty() )
+		{
+			char *outbuff = wcs2str( out.c_str() ), *errbuff = wcs2str( err.c_str() );
+			do_builtin_io( outbuff, errbuff );
+			free( outbuff );
+			free( errbuff );
+		}
+		builtin_pop_io( parser );
+		status = p->status;
+	}
+	else
+	{
+		io_data_t *io_buffer = 0;
+
+		signal_block();
+		exec_function_call( parser, j, p, io_buffer );
+		signal_unblock();
+		status = proc_get_last_status();
+	}
+
+	p->completed = 1;
+	proc_set_last_status( job_get_flag( j, JOB_NEGATE )?(!status):status );
+	job_set_flag( j, JOB_CONSTRUCTED, 1 );
+}
+
+/**
+   Returns whether the specified job starts a program of its own,
+   rather than only running builtins, functions and blocks
+*/
+static bool job_may_start_program( const job_t *j )
+{
+	for( const process_t *p = j->first_process; p; p = p->next )
+	{
+		if( p->type == EXTERNAL || p->type == INTERNAL_EXEC )
+			return true;
+	}
+	return false;
+}
+
 void exec( parser_t &parser, job_t *j )
 {
+	TRACE_SCOPE( "exec" );
 	process_t *p;
 	pid_t pid;
 	int mypipe[2];
@@ -576,6 +790,27 @@ void exec( parser_t &parser, job_t *j )
 	
 	debug( 4, L"Exec job '%ls' with id %d", j->command_wcstr(), j->job_id );	
 	
+	/* Command substitutions and event handlers, which include the prompt, are not timed, see proc_record_job_timing */
+	if( ! is_subshell && ! is_event )
+		gettimeofday( &j->start_time, 0 );
+	
+	if( exec_is_direct( parser, j ) )
+	{
+		exec_direct( parser, j );
+		job_continue( j, 0 );
+		return;
+	}
+
+	/*
+	  A job that may start a program gets the terminal in the modes of
+	  the user, which it also has to remember for when it is stopped
+	*/
+	if( job_may_start_program( j ) && reader_donate_terminal() && get_is_interactive() )
+	{
+		if( tcgetattr( 0, &j->tmodes ) )
+			wperror( L"tcgetattr" );
+	}
+
 	if( parser.block_io )
 	{
 		if( j->io )
@@ -752,6 +987,13 @@ void exec( parser_t &parser, job_t *j )
 		{
 //			debug( 1, L"%ls|%ls" , p->argv[0], p->next->argv[0]);
 			
+			/*
+			  Every pipeline gets new pipes, even in loops. A pipe
+			  can't be reused once its reader has seen end of
+			  file, since that takes closing all of its write
+			  ends, and there may be unread data left in it if
+			  the reader stopped early.
+			*/
 			if( exec_pipe( mypipe ) == -1 )
 			{
 				debug( 1, PIPE_ERROR );
@@ -776,64 +1018,7 @@ void exec( parser_t &parser, job_t *j )
 		{
 			case INTERNAL_FUNCTION:
 			{
-				wchar_t * def=0;
-				int shadows;
-				
-
-				/*
-				  Calls to function_get_definition might need to
-				  source a file as a part of autoloading, hence there
-				  must be no blocks.
-				*/
-
-				signal_unblock();
-                wcstring orig_def;
-                function_get_definition( p->argv0(), &orig_def );
-                
-                // function_get_named_arguments may trigger autoload, which deallocates the orig_def.
-                // We should make function_get_definition return a wcstring (but how to handle NULL...)
-                if (! orig_def.empty())
-                    def = wcsdup(orig_def.c_str());
-                
-				wcstring_list_t named_arguments = function_get_named_arguments( p->argv0() );
-				shadows = function_get_shadows( p->argv0() );
-
-				signal_block();
-				
-				if( def == NULL )
-				{
-					debug( 0, _( L"Unknown function '%ls'" ), p->argv0() );
-					break;
-				}
-				parser.push_block( shadows?FUNCTION_CALL:FUNCTION_CALL_NO_SHADOW );
-				
-				parser.current_block->state2<process_t *>() = p;
-				parser.current_block->state1<wcstring>() = p->argv0();
-						
-
-				/*
-				  set_argv might trigger an event
-				  handler, hence we need to unblock
-				  signals.
-				*/
-				signal_unblock();
-				parse_util_set_argv( p->get_argv()+1, named_arguments );
-				signal_block();
-								
-				parser.forbid_function( p->argv0() );
-
-				if( p->next )
-				{
-					io_buffer = io_buffer_create( 0 );					
-					j->io = io_add( j->io, io_buffer );
-				}
-				
-				internal_exec_helper( parser, def, TOP, j->io );
-				
-				parser.allow_function();
-				parser.pop_block();
-                free(def);
-				
+				exec_function_call( parser, j, p, io_buffer );
 				break;				
 			}
 			
@@ -1171,16 +1356,17 @@ void exec( parser_t &parser, job_t *j )
 					skip_fork = 1;
 				}
                 
+                /* Get the strings we'll write before we fork (since they call malloc) */
+                const wcstring &out = get_stdout_buffer(), &err = get_stderr_buffer();
+                char *outbuff = wcs2str(out.c_str()), *errbuff = wcs2str(err.c_str());
+                const char *outbuff_remaining = outbuff;
+                
                 if (! skip_fork && ! j->io) {
                     /* PCA for some reason, fish forks a lot, even for basic builtins like echo just to write out their buffers. I'm certain a lot of this is unnecessary, but I am not sure exactly when. If j->io is NULL, then it means there's no pipes or anything, so we can certainly just write out our data. Beyond that, we may be able to do the same if io_get returns 0 for STDOUT_FILENO and STDERR_FILENO. */
                     if (g_log_forks) {
                         printf("fork #-: Skipping fork for internal builtin for '%ls' (io is %p, job_io is %p)\n", p->argv0(), io, j->io);
                     }
-                    const wcstring &out = get_stdout_buffer(), &err = get_stderr_buffer();
-                    char *outbuff = wcs2str(out.c_str()), *errbuff = wcs2str(err.c_str());
                     do_builtin_io(outbuff, errbuff);
-                    free(outbuff);
-                    free(errbuff);
                     skip_fork = 1;
                 }
 
@@ -1192,10 +1378,31 @@ void exec( parser_t &parser, job_t *j )
                         break;
 					}
 				}
-                
+
+				/*
+				  If the builtin's output only goes to the next process
+				  in the pipeline, write what the pipe can take right
+				  away. The next process hasn't been started yet, so
+				  this must not block. We only need to fork to write
+				  whatever doesn't fit.
+				*/
+				if( ! skip_fork && p_wants_pipe && io_get( j->io, 1 ) == &pipe_write && io_get( j->io, 2 ) == NULL )
+				{
+					outbuff_remaining += write_nonblocking( pipe_write.param1.pipe_fd[1], outbuff, strlen( outbuff ) );
+					if( *outbuff_remaining == 0 )
+					{
+						if (g_log_forks) {
+							printf("fork #-: Skipping fork for internal builtin writing to a pipe for '%ls'\n", p->argv0());
+						}
+						do_builtin_io( NULL, errbuff );
+						skip_fork = 1;
+					}
+				}
 				
 				if( skip_fork )
 				{
+                    free(outbuff);
+                    free(errbuff);
 					p->completed=1;
 					if( p->next == 0 )
 					{
@@ -1210,10 +1417,6 @@ void exec( parser_t &parser, job_t *j )
 
 				/* Ok, unfortunatly, we have to do a real fork. Bummer. We work hard to make sure we don't have to wait for all our threads to exit, by arranging things so that we don't have to allocate memory or do anything except system calls in the child. */
                 
-                /* Get the strings we'll write before we fork (since they call malloc) */
-                const wcstring &out = get_stdout_buffer(), &err = get_stderr_buffer();
-                char *outbuff = wcs2str(out.c_str()), *errbuff = wcs2str(err.c_str());
-                
                 fflush(stdout);
                 fflush(stderr);
                 if (g_log_forks) {
@@ -1230,7 +1433,7 @@ void exec( parser_t &parser, job_t *j )
 					*/
 					p->pid = getpid();
 					setup_child_process( j, p );
-					do_builtin_io(outbuff, errbuff);
+					do_builtin_io(outbuff_remaining, errbuff);
 					exit_without_destructors( p->status );
 						
 				}
@@ -1256,6 +1459,8 @@ void exec( parser_t &parser, job_t *j )
 			
 			case EXTERNAL:
 			{
+                gettimeofday( &p->launch_time, 0 );
+                
                 /* Get argv and envv before we fork */
                 null_terminated_array_t<char> argv_array = convert_wide_array_to_narrow(p->get_argv_array());
                 
@@ -1269,6 +1474,51 @@ void exec( parser_t &parser, job_t *j )
                 const char *actual_cmd = actual_cmd_str.c_str();
                 
                 const wchar_t *reader_current_filename();
+                
+#if FISH_USE_POSIX_SPAWN
+                /* Launch the process without forking if we can, which avoids copying our page tables. If the spawn fails, fall back to fork, and let the child report the error. */
+                posix_spawnattr_t attr;
+                posix_spawn_file_actions_t actions;
+                if (fork_actions_make_spawn_properties(&attr, &actions, j, p)) {
+                    int spawn_ret = posix_spawn(&pid, actual_cmd, &actions, &attr, argv, envv);
+                    posix_spawnattr_destroy(&attr);
+                    posix_spawn_file_actions_destroy(&actions);
+                    
+                    if (spawn_ret == 0) {
+                        if (g_log_forks) {
+                            printf("spawn: spawned '%s'\n", actual_cmd);
+                        }
+                        p->pid = pid;
+                        set_child_group( j, p, 0 );
+                        break;
+                    }
+                }
+#endif
+                
+#if FISH_USE_VFORK
+                /* If we can't spawn the process, for instance because it has to take over the terminal, vfork it instead if the child can be set up without touching our memory. That still avoids copying our page tables. If vfork fails, fall back to fork. */
+                if (vfork_can_setup_child(j)) {
+                    std::vector<int> unused_fds;
+                    get_unused_internal_pipes(unused_fds, j->io);
+                    
+                    pid = vfork();
+                    if (pid == 0) {
+                        /* This is the child process, which shares our memory until safe_launch_process execs */
+                        setup_vforked_child_process(j, p, unused_fds);
+                        safe_launch_process(p, actual_cmd, argv, envv);
+                    }
+                    else if (pid > 0) {
+                        syscall_count(SYSCALL_FORK);
+                        if (g_log_forks) {
+                            printf("vfork: launched '%s'\n", actual_cmd);
+                        }
+                        p->pid = pid;
+                        set_child_group( j, p, 0 );
+                        break;
+                    }
+                }
+#endif
+                
                 if (g_log_forks) {
                     const wchar_t *file = reader_current_filename();
                     const wchar_t *func = parser_t::principal_parser().is_function();
@@ -1305,6 +1555,18 @@ void exec( parser_t &parser, job_t *j )
 			
 		}
 
+		if( p->type == EXTERNAL )
+		{
+			syscall_count( SYSCALL_EXEC );
+
+			struct timeval launched;
+			gettimeofday( &launched, 0 );
+			p->launch_usec = (launched.tv_sec - p->launch_time.tv_sec) * 1000000L + (launched.tv_usec - p->launch_time.tv_usec);
+#ifdef HAVE__PROC_SELF_STAT
+			p->last_time = launched;
+#endif
+		}
+
 		if( p->type == INTERNAL_BUILTIN )
 			builtin_pop_io(parser);
 				
@@ -1343,6 +1605,7 @@ void exec( parser_t &parser, job_t *j )
 		kill( keepalive.pid, SIGKILL );
 	}
 	
+	proc_index_job( j );
 	signal_unblock();	
 
 	debug( 3, L"Job is constructed" );
@@ -1367,10 +1630,50 @@ void exec( parser_t &parser, job_t *j )
 }
 
 
+/**
+   Splits the null terminated output of a command substitution at the
+   separator and appends the lines to lst. Each line is decoded straight
+   into its place in the list, and the list is grown once up front, so
+   that large outputs aren't copied around more than necessary. The
+   output is modified in the process.
+*/
+static void exec_split_subshell_output( char *output, char sep, wcstring_list_t *lst )
+{
+	size_t line_count = 0;
+	for( const char *pos = output; *pos; pos++ )
+	{
+		if( *pos == sep )
+			line_count++;
+	}
+	lst->reserve( lst->size() + line_count + 1 );
+
+	char *begin = output;
+	char *end = output;
+	while( 1 )
+	{
+		bool last = ( *end == 0 );
+		if( last || *end == sep )
+		{
+			if( begin != end || ! last )
+			{
+				*end = 0;
+				lst->push_back( wcstring() );
+				wcstring &el = lst->back();
+				el.resize( end - begin + 1 );
+				str2wcs_internal( begin, &el[0] );
+				el.resize( wcslen( el.c_str() ) );
+			}
+			if( last )
+				break;
+			begin = end+1;
+		}
+		end++;
+	}
+}
+
 static int exec_subshell_internal( const wcstring &cmd, wcstring_list_t *lst )
 {
     ASSERT_IS_MAIN_THREAD();
-	char *begin, *end;
 	char z=0;
 	int prev_subshell = is_subshell;
 	int status, prev_status;
@@ -1416,51 +1719,9 @@ static int exec_subshell_internal( const wcstring &cmd, wcstring_list_t *lst )
 	
 	io_buffer->out_buffer_append( &z, 1 );
 	
-	begin=end=io_buffer->out_buffer_ptr();	
-
 	if( lst )
 	{
-		while( 1 )
-		{
-			if( *end == 0 )
-			{
-				if( begin != end )
-				{
-					wchar_t *el = str2wcs( begin );
-					if( el )
-					{
-						lst->push_back(el);
-
-						free(el);
-					}
-					else
-					{
-						debug( 2, L"Got null string on line %d of file %s", __LINE__, __FILE__ );
-					}
-				}				
-				io_buffer_destroy( io_buffer );
-				
-				return status;
-			}
-			else if( *end == sep )
-			{
-				wchar_t *el;
-				*end=0;
-				el = str2wcs( begin );
-				if( el )
-				{
-                    lst->push_back(el);
-
-					free(el);
-				}
-				else
-				{
-					debug( 2, L"Got null string on line %d of file %s", __LINE__, __FILE__ );
-				}
-				begin = end+1;
-			}
-			end++;
-		}
+		exec_split_subshell_output( io_buffer->out_buffer_ptr(), sep, lst );
 	}
 	
 	io_buffer_destroy( io_buffer );
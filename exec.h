@@ -44,6 +44,15 @@
 class parser_t;
 void exec( parser_t &parser, job_t *j );
 
+/**
+   Call the function named by the first element of argv with the rest
+   of argv as its arguments, the way a command line calling it would,
+   but without building, parsing and expanding such a command line.
+
+   \return false if there is no such function or calling it would recurse too deep, in which case nothing is done
+*/
+bool exec_function( parser_t &parser, const wcstring_list_t &argv );
+
 /**
   Evaluate the expression cmd in a subshell, add the outputs into the
   list l. On return, the status flag as returned bu \c
@@ -73,4 +82,7 @@ int exec_pipe( int fd[2]);
 /* Close all fds in open_fds. This is called from postfork.cpp */
 void close_unused_internal_pipes( io_data_t *io );
 
+/* Get all fds in open_fds that close_unused_internal_pipes would close. This is called from postfork.cpp */
+void get_unused_internal_pipes( std::vector<int> &fds, io_data_t *io );
+
 #endif
@@ -21,9 +21,11 @@ parameter expansion.
 #include <sys/stat.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include <assert.h>
 #include <vector>
+#include <map>
 
 #ifdef SunOS
 #include <procfs.h>
@@ -45,6 +47,7 @@ parameter expansion.
 #include "complete.h"
 
 #include "parse_util.h"
+#include "iothread.h"
 
 /**
    Error issued on invalid variable name
@@ -116,6 +119,21 @@ parameter expansion.
 */
 #define UNCLEAN L"$*?\\\"'({})"
 
+/**
+   Number of seconds for which looked up users are trusted before they are looked up again
+*/
+#define USER_TABLE_TTL 300
+
+/**
+   Number of seconds that enumerating the user database may take when nothing has been cached yet and the caller is waiting
+*/
+#define USER_ENUMERATION_BUDGET 0.2
+
+/**
+   Number of seconds for which a snapshot of the process table is reused when completing process names
+*/
+#define PROCESS_SNAPSHOT_TTL 2
+
 int expand_is_clean( const wchar_t *in )
 {
 
@@ -309,6 +327,117 @@ static int match_pid( const wchar_t *cmd,
 
 }
 
+/**
+   A process of the current user, as found in the process table
+*/
+struct process_snapshot_entry_t
+{
+    wcstring pid;
+    wcstring cmd;
+};
+
+typedef std::vector<process_snapshot_entry_t> process_snapshot_t;
+
+/** The last process snapshot and when it was taken, and the lock protecting them */
+static process_snapshot_t s_process_snapshot;
+static double s_process_snapshot_when = 0;
+static pthread_mutex_t s_process_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   Reads the command of the process whose /proc directory is pdir_name into cmd. Returns false if there is no way to know it.
+*/
+static bool read_process_command( const std::string &pdir_name, wcstring &cmd )
+{
+	/* The 'cmdline' file contains the arguments separated by null bytes. Only the first one, the command, is needed. */
+	const std::string cmdline_name = pdir_name + "/cmdline";
+	int fd = open( cmdline_name.c_str(), O_RDONLY );
+	if( fd >= 0 )
+	{
+		char buff[1024];
+		ssize_t amt = read( fd, buff, sizeof buff - 1 );
+		close( fd );
+		if( amt < 0 )
+			return false;
+		buff[amt] = '\0';
+		cmd = str2wcstring( buff );
+		return true;
+	}
+	
+#ifdef SunOS
+	const std::string psinfo_name = pdir_name + "/psinfo";
+	FILE *psfile = fopen( psinfo_name.c_str(), "r" );
+	if( psfile )
+	{
+		psinfo_t info;
+		bool result = false;
+		if( fread( &info, sizeof(info), 1, psfile ) )
+		{
+			cmd = str2wcstring( info.pr_fname );
+			result = true;
+		}
+		fclose( psfile );
+		return result;
+	}
+#endif
+	return false;
+}
+
+/**
+   Reads the processes of the current user from /proc in one pass. Leaves the snapshot empty if the system has no /proc filesystem.
+*/
+static void take_process_snapshot( process_snapshot_t &snapshot )
+{
+	DIR *dir = opendir( "/proc" );
+	if( dir == NULL )
+		return;
+	
+	const uid_t uid = getuid();
+	std::string pdir_name;
+	struct dirent *next;
+	while( (next = readdir( dir )) != NULL )
+	{
+		const char *name = next->d_name;
+		if( ! isdigit( (unsigned char)name[0] ) || strspn( name, "0123456789" ) != strlen( name ) )
+			continue;
+		
+		pdir_name = "/proc/";
+		pdir_name.append( name );
+		struct stat buf;
+		if( stat( pdir_name.c_str(), &buf ) || buf.st_uid != uid )
+			continue;
+		
+		process_snapshot_entry_t entry;
+		if( read_process_command( pdir_name, entry.cmd ) && ! entry.cmd.empty() )
+		{
+			entry.pid = str2wcstring( name );
+			snapshot.push_back( entry );
+		}
+	}
+	closedir( dir );
+}
+
+/**
+   Gets the processes of the current user. A snapshot taken less than PROCESS_SNAPSHOT_TTL seconds ago is reused if allow_reuse is set, which is fine for completions; expansion wants the processes that exist now.
+*/
+static void get_process_snapshot( process_snapshot_t &snapshot, bool allow_reuse )
+{
+	{
+		scoped_lock locker( s_process_snapshot_lock );
+		if( allow_reuse && s_process_snapshot_when > 0 && timef() - s_process_snapshot_when < PROCESS_SNAPSHOT_TTL )
+		{
+			snapshot = s_process_snapshot;
+			return;
+		}
+	}
+	
+	const double when = timef();
+	take_process_snapshot( snapshot );
+	
+	scoped_lock locker( s_process_snapshot_lock );
+	s_process_snapshot = snapshot;
+	s_process_snapshot_when = when;
+}
+
 /**
    Searches for a job with the specified job id, or a job or process
    which has the string \c proc as a prefix of its commandline.
@@ -327,11 +456,6 @@ static int find_process( const wchar_t *proc,
 						 int flags,
 						 std::vector<completion_t> &out )
 {
-	DIR *dir;
-	wchar_t *pdir_name;
-	wchar_t *pfile_name;
-	wchar_t *cmd=0;
-	int sz=0;
 	int found = 0;
 
 	const job_t *j;
@@ -458,123 +582,29 @@ static int find_process( const wchar_t *proc,
 		return 1;
 	}
 
-	if( !(dir = opendir( "/proc" )))
-	{
-		/*
-		  This system does not have a /proc filesystem.
-		*/
-		return 1;
-	}
-
-	pdir_name = (wchar_t *)malloc( sizeof(wchar_t)*256 );
-	pfile_name = (wchar_t *)malloc( sizeof(wchar_t)*64 );
-	wcscpy( pdir_name, L"/proc/" );
-	
-    wcstring nameStr;
-    while (wreaddir(dir, nameStr))
+	process_snapshot_t snapshot;
+	get_process_snapshot( snapshot, (flags & ACCEPT_INCOMPLETE) != 0 );
+	for( size_t i=0; i < snapshot.size(); i++ )
 	{
-		const wchar_t *name = nameStr.c_str();
-		struct stat buf;
-
-		if( !iswnumeric( name ) )
-			continue;
-
-		wcscpy( pdir_name + 6, name );
-		if( wstat( pdir_name, &buf ) )
-		{
-			continue;
-		}
-		if( buf.st_uid != getuid() )
-		{
-			continue;
-		}
-		wcscpy( pfile_name, pdir_name );
-		wcscat( pfile_name, L"/cmdline" );
-
-		if( !wstat( pfile_name, &buf ) )
-		{
-			/*
-			  the 'cmdline' file exists, it should contain the commandline
-			*/
-			FILE *cmdfile;
-
-			if((cmdfile=wfopen( pfile_name, "r" ))==0)
-			{
-				wperror( L"fopen" );
-				continue;
-			}
-
-			signal_block();
-			fgetws2( &cmd, &sz, cmdfile );
-			signal_unblock();
-			
-			fclose( cmdfile );
-		}
-		else
+		const process_snapshot_entry_t &entry = snapshot.at(i);
+		int offset;
+		
+		if( match_pid( entry.cmd.c_str(), proc, flags, &offset ) )
 		{
-#ifdef SunOS
-			wcscpy( pfile_name, pdir_name );
-			wcscat( pfile_name, L"/psinfo" );
-			if( !wstat( pfile_name, &buf ) )
+			if( flags & ACCEPT_INCOMPLETE )
 			{
-				psinfo_t info;
-
-				FILE *psfile;
-
-				if((psfile=wfopen( pfile_name, "r" ))==0)
-				{
-					wperror( L"fopen" );
-					continue;
-				}
-
-				if( fread( &info, sizeof(info), 1, psfile ) )
-				{
-					if( cmd != 0 )
-						free( cmd );
-					cmd = str2wcs( info.pr_fname );
-				}
-				fclose( psfile );
+				completion_allocate( out, 
+									 entry.cmd.c_str() + offset + wcslen(proc),
+									 COMPLETE_PROCESS_DESC,
+									 0 );
 			}
 			else
-#endif
 			{
-				if( cmd != 0 )
-				{
-					*cmd = 0;
-				}
-			}
-		}
-
-		if( cmd != 0 )
-		{
-			int offset;
-			
-			if( match_pid( cmd, proc, flags, &offset ) )
-			{
-				if( flags & ACCEPT_INCOMPLETE )
-				{
-					completion_allocate( out, 
-										 cmd + offset + wcslen(proc),
-										 COMPLETE_PROCESS_DESC,
-										 0 );
-				}
-				else
-				{
-                    if (name)
-                        out.push_back(completion_t(name));
-				}
+				out.push_back(completion_t(entry.pid));
 			}
 		}
 	}
 
-	if( cmd != 0 )
-		free( cmd );
-
-	free( pdir_name );
-	free( pfile_name );
-
-	closedir( dir );
-
 	return 1;
 }
 
@@ -790,17 +820,21 @@ static int parse_slice( const wchar_t *in, wchar_t **end_ptr, std::vector<long>
    happens, don't edit it unless you know exactly what you are doing,
    and do proper testing afterwards.
 */
-static int expand_variables_internal( parser_t &parser, wchar_t * const in, std::vector<completion_t> &out, int last_idx );
-
-static int expand_variables2( parser_t &parser, const wcstring &instr, std::vector<completion_t> &out, int last_idx ) {
-    wchar_t *in = wcsdup(instr.c_str());
-    int result = expand_variables_internal(parser, in, out, last_idx);
-    free(in);
-    return result;
+/**
+   Appends a completion for str to out, taking the contents of str instead of copying them
+*/
+static void append_completion_taking( std::vector<completion_t> &out, wcstring &str )
+{
+    out.push_back(completion_t(wcstring()));
+    out.back().completion.swap(str);
 }
 
-static int expand_variables_internal( parser_t &parser, wchar_t * const in, std::vector<completion_t> &out, int last_idx )
+/**
+   Expands the variables in instr at or before last_idx. Variables are expanded from right to left, and each expansion only looks at the string before the variable, so expanding an alternative only builds the string once, and nothing after the variable is scanned again.
+*/
+static int expand_variables2( parser_t &parser, const wcstring &instr, std::vector<completion_t> &out, int last_idx )
 {
+    const wchar_t * const in = instr.c_str();
 	int is_ok= 1;
 	int empty=0;
 	
@@ -845,68 +879,54 @@ static int expand_variables_internal( parser_t &parser, wchar_t * const in, std:
 			}
             
             var_tmp.append(in + start_pos, var_len);
-			env_var_t var_val = expand_var(var_tmp.c_str() );
+
+			int all_vars=1;
+			bool var_exists;
+			wcstring_list_t var_item_list;
+			wchar_t *slice_end = NULL;
+			int slice_error = 0;
+
+			if( in[stop_pos] == L'[' )
+			{
+				/*
+				  Only get the elements that are asked for, so that
+				  indexing a large array doesn't split all of it
+				*/
+				all_vars=0;
+				slice_error = parse_slice( in + stop_pos, &slice_end, var_idx_list );
+				var_exists = env_get_elements( var_tmp, var_idx_list, var_item_list, NULL );
+			}
+			else
+			{
+				env_var_t var_val = expand_var(var_tmp.c_str() );
+				var_exists = ! var_val.missing();
+				if( var_exists )
+					tokenize_variable_array( var_val, var_item_list );
+			}
             
-			if( ! var_val.missing() )
+			if( var_exists )
 			{
-				int all_vars=1;
-                wcstring_list_t var_item_list;
-                
-				if( in[stop_pos] == L'[' )
+				if( slice_error )
 				{
-					wchar_t *slice_end;
-					all_vars=0;
-					
-					if( parse_slice( in + stop_pos, &slice_end, var_idx_list ) )
+					parser.error( SYNTAX_ERROR,
+                                 -1,
+                                 L"Invalid index value" );						
+					is_ok = 0;
+				}
+				else if( !all_vars )
+				{
+					stop_pos = (slice_end-in);
+
+					/*
+					  Check that we are within array bounds. If not,
+					  truncate the list to exit.
+					*/
+					if( var_item_list.size() < var_idx_list.size() )
 					{
 						parser.error( SYNTAX_ERROR,
                                      -1,
-                                     L"Invalid index value" );						
-						is_ok = 0;
-					}					
-					stop_pos = (slice_end-in);
-				}				
-                
-				if( is_ok )
-				{
-					tokenize_variable_array( var_val.c_str(), var_item_list );                    
-                    
-					if( !all_vars )
-					{
-                        wcstring_list_t string_values(var_idx_list.size());
-                        
-						for( size_t j=0; j<var_idx_list.size(); j++)
-						{
-							long tmp = var_idx_list.at(j);
-							if( tmp < 0 )
-							{
-								tmp = ((long)var_item_list.size())+tmp+1;
-							}
-                            
-							/*
-                             Check that we are within array
-                             bounds. If not, truncate the list to
-                             exit.
-                             */
-							if( tmp < 1 || (size_t)tmp > var_item_list.size() )
-							{
-								parser.error( SYNTAX_ERROR,
-                                             -1,
-                                             ARRAY_BOUNDS_ERR );
-								is_ok=0;
-								var_idx_list.resize(j);
-								break;
-							}
-							else
-							{
-								/* Replace each index in var_idx_list inplace with the string value at the specified index */
-								//al_set( var_idx_list, j, wcsdup((const wchar_t *)al_get( &var_item_list, tmp-1 ) ) );
-                                string_values.at(j) = var_item_list.at(tmp-1);
-							}
-						}
-                        
-                        // string_values is the new var_item_list
-                        var_item_list.swap(string_values);
+                                     ARRAY_BOUNDS_ERR );
+						is_ok=0;
 					}
 				}
                 
@@ -915,8 +935,7 @@ static int expand_variables_internal( parser_t &parser, wchar_t * const in, std:
 					
 					if( is_single )
 					{
-                        in[i]=0;
-                        wcstring res = in;
+                        wcstring res(in, i);
                         res.push_back(INTERNAL_SEPARATOR);
                         
 						for( size_t j=0; j<var_item_list.size(); j++ )
@@ -947,6 +966,7 @@ static int expand_variables_internal( parser_t &parser, wchar_t * const in, std:
 								if( is_ok )
 								{
                                     wcstring new_in;
+                                    new_in.reserve(start_pos + next.size() + instr.size() - stop_pos);
                                     
                                     if (start_pos > 0)
                                         new_in.append(in, start_pos - 1);
@@ -985,9 +1005,7 @@ static int expand_variables_internal( parser_t &parser, wchar_t * const in, std:
 					/*
                      Expansion to single argument.
                      */
-					wcstring res;
-                    in[i] = 0;
-                    res.append(in);
+					wcstring res(in, i);
                     res.append(in + stop_pos);
                     
 					is_ok &= expand_variables2( parser, res, out, i );
@@ -1001,7 +1019,7 @@ static int expand_variables_internal( parser_t &parser, wchar_t * const in, std:
     
 	if( !empty )
 	{
-		out.push_back(completion_t(in));
+		out.push_back(completion_t(instr));
 	}
     
 	return is_ok;
@@ -1104,21 +1122,22 @@ static int expand_brackets(parser_t &parser, const wchar_t *in, int flags, std::
 	len2 = wcslen(bracket_end)-1;
 	tot_len = len1+len2;
 	item_begin = bracket_begin+1;
+	wcstring whole_item;
+	whole_item.reserve( tot_len + (bracket_end-bracket_begin) );
 	for( pos=(bracket_begin+1); 1; pos++ )
 	{
 		if( bracket_count == 0 )
 		{
 			if( (*pos == BRACKET_SEP) || (pos==bracket_end) )
 			{
-				wchar_t *whole_item;
 				int item_len = pos-item_begin;
 
-				whole_item = (wchar_t *)malloc( sizeof(wchar_t)*(tot_len + item_len + 1) );
-				wcslcpy( whole_item, in, len1+1 );
-				wcslcpy( whole_item+len1, item_begin, item_len+1 );
-				wcscpy( whole_item+len1+item_len, bracket_end+1 );
+				/* The buffer is reused for every alternative, since the prefix and suffix are the same for all of them */
+				whole_item.assign( in, len1 );
+				whole_item.append( item_begin, item_len );
+				whole_item.append( bracket_end+1 );
 
-				expand_brackets( parser, whole_item, flags, out );
+				expand_brackets( parser, whole_item.c_str(), flags, out );
 
 				item_begin = pos+1;
 				if( pos == bracket_end )
@@ -1216,7 +1235,7 @@ static int expand_cmdsubst( parser_t &parser, const wcstring &input, std::vector
                 //				debug( 0, L"Pushing item '%ls' with index %d onto sliced result", al_get( sub_res, idx ), idx );
 				//sub_res[idx] = 0; // ??
 			}
-			sub_res = sub_res2;			
+			sub_res.swap(sub_res2);
 		}
 	}
     
@@ -1235,7 +1254,7 @@ static int expand_cmdsubst( parser_t &parser, const wcstring &input, std::vector
      */
     for( i=0; i<sub_res.size(); i++ )
     {
-        wcstring sub_item = sub_res.at(i);
+        const wcstring &sub_item = sub_res.at(i);
         wcstring sub_item2 = escape_string(sub_item, 1);
         
         for( j=0; j < tail_expand.size(); j++ )
@@ -1288,6 +1307,211 @@ static wcstring expand_unescape_string( const wcstring &in, int escape_special )
 	return tmp;
 }
 
+/**
+   A user known to the user database
+*/
+struct user_entry_t
+{
+    wcstring name;
+    wcstring home;
+    double when;
+};
+
+/**
+   Users keyed by their lowercased name, so that the users whose names start with a prefix, ignoring case, are a range of the map.
+*/
+typedef std::multimap<wcstring, user_entry_t> user_map_t;
+
+/**
+   A cached copy of the user database. Enumerating it, or even looking up one user, may go over the network, for example with LDAP, so ~user expansion and completion use the cache, and the enumeration is refreshed on a background thread.
+*/
+struct user_table_t
+{
+    /** Users, from the enumeration or from looking them up by name */
+    user_map_t users;
+    
+    /** Names that looking up found no user for, and when */
+    std::map<wcstring, double> missing;
+    
+    /** When the user database was last enumerated, or 0 if never */
+    double enumerated_when;
+    
+    /** Whether that enumeration got through the whole database */
+    bool enumeration_complete;
+    
+    /** Whether an enumeration is running on a background thread */
+    bool refreshing;
+};
+
+static user_table_t s_user_table;
+
+/** Lock protecting s_user_table */
+static pthread_mutex_t s_user_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Lock serializing uses of getpwent, whose position is shared by the whole process */
+static pthread_mutex_t s_user_enumeration_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static wcstring user_table_key( const wcstring &name )
+{
+    wcstring key = name;
+    for (size_t i=0; i < key.size(); i++)
+        key.at(i) = towlower(key.at(i));
+    return key;
+}
+
+/** Adds a user to the map, replacing any earlier entry with the same name */
+static void user_table_add( user_map_t &users, const wcstring &name, const wcstring &home, double when )
+{
+    const wcstring key = user_table_key(name);
+    std::pair<user_map_t::iterator, user_map_t::iterator> range = users.equal_range(key);
+    for (user_map_t::iterator iter = range.first; iter != range.second; ++iter)
+    {
+        if (iter->second.name == name)
+        {
+            iter->second.home = home;
+            iter->second.when = when;
+            return;
+        }
+    }
+    user_entry_t entry;
+    entry.name = name;
+    entry.home = home;
+    entry.when = when;
+    users.insert(range.second, user_map_t::value_type(key, entry));
+}
+
+/**
+   Reads the user database into users. If budget is positive, gives up after that many seconds. Returns whether every user was read.
+*/
+static bool enumerate_users( user_map_t &users, double budget )
+{
+    scoped_lock locker(s_user_enumeration_lock);
+    const double start = timef();
+    bool complete = true;
+    struct passwd *pw;
+    setpwent();
+    while ((pw = getpwent()) != NULL)
+    {
+        const double now = timef();
+        if (budget > 0 && now - start > budget)
+        {
+            complete = false;
+            break;
+        }
+        user_table_add(users, str2wcstring(pw->pw_name), str2wcstring(pw->pw_dir), now);
+    }
+    endpwent();
+    return complete;
+}
+
+/** Replaces the cached users with the ones read by an enumeration */
+static void user_table_install( user_map_t &users, bool complete, double when )
+{
+    scoped_lock locker(s_user_table_lock);
+    s_user_table.users.swap(users);
+    s_user_table.missing.clear();
+    s_user_table.enumerated_when = when;
+    s_user_table.enumeration_complete = complete;
+}
+
+struct user_table_refresh_t
+{
+    user_map_t users;
+    bool complete;
+};
+
+static int threaded_refresh_user_table( user_table_refresh_t *refresh )
+{
+    refresh->complete = enumerate_users(refresh->users, 0);
+    return 0;
+}
+
+static void user_table_refreshed( user_table_refresh_t *refresh, int result )
+{
+    user_table_install(refresh->users, refresh->complete, timef());
+    scoped_lock locker(s_user_table_lock);
+    s_user_table.refreshing = false;
+    delete refresh;
+}
+
+void expand_user_names( const wcstring &prefix, wcstring_list_t &out_names )
+{
+    bool enumerated, stale, start_refresh = false;
+    {
+        scoped_lock locker(s_user_table_lock);
+        enumerated = (s_user_table.enumerated_when > 0);
+    }
+    
+    /* Nothing is cached the first time, so read what we can while the user waits */
+    if (! enumerated)
+    {
+        user_map_t users;
+        bool complete = enumerate_users(users, USER_ENUMERATION_BUDGET);
+        user_table_install(users, complete, timef());
+    }
+    
+    scoped_lock locker(s_user_table_lock);
+    user_table_t &table = s_user_table;
+    stale = ! table.enumeration_complete || timef() - table.enumerated_when > USER_TABLE_TTL;
+    if (stale && ! table.refreshing && is_main_thread())
+    {
+        table.refreshing = true;
+        start_refresh = true;
+    }
+    
+    const wcstring key = user_table_key(prefix);
+    for (user_map_t::const_iterator iter = table.users.lower_bound(key); iter != table.users.end() && string_prefixes_string(key, iter->first); ++iter)
+    {
+        out_names.push_back(iter->second.name);
+    }
+    
+    if (start_refresh)
+        iothread_perform(threaded_refresh_user_table, user_table_refreshed, new user_table_refresh_t(), IOTHREAD_PRIORITY_BACKGROUND);
+}
+
+/**
+   Looks up the home directory of the user with the given name, using the cache when it is fresh enough. Returns false if there is no such user.
+*/
+static bool user_home_directory( const wcstring &name, wcstring *out_home )
+{
+    const double now = timef();
+    {
+        scoped_lock locker(s_user_table_lock);
+        const wcstring key = user_table_key(name);
+        std::pair<user_map_t::const_iterator, user_map_t::const_iterator> range = s_user_table.users.equal_range(key);
+        for (user_map_t::const_iterator iter = range.first; iter != range.second; ++iter)
+        {
+            if (iter->second.name == name && now - iter->second.when <= USER_TABLE_TTL)
+            {
+                out_home->assign(iter->second.home);
+                return true;
+            }
+        }
+        
+        std::map<wcstring, double>::const_iterator missing = s_user_table.missing.find(name);
+        if (missing != s_user_table.missing.end() && now - missing->second <= USER_TABLE_TTL)
+            return false;
+    }
+    
+    /* getpwnam's result lives in a buffer shared by the whole process, and this may be called from background threads, so use getpwnam_r */
+    const std::string narrow_name = wcs2string(name);
+    std::vector<char> buff(1024);
+    struct passwd pwd, *userinfo = NULL;
+    int err;
+    while ((err = getpwnam_r(narrow_name.c_str(), &pwd, &buff.at(0), buff.size(), &userinfo)) == ERANGE)
+        buff.resize(buff.size() * 2);
+    
+    scoped_lock locker(s_user_table_lock);
+    if (err != 0 || userinfo == NULL)
+    {
+        s_user_table.missing[name] = now;
+        return false;
+    }
+    out_home->assign(str2wcstring(userinfo->pw_dir));
+    user_table_add(s_user_table.users, name, *out_home, now);
+    return true;
+}
+
 /**
    Attempts tilde expansion of the string specified, modifying it in place.
 */
@@ -1320,18 +1544,11 @@ static void expand_tilde_internal( wcstring &input )
                 tail_idx = wcslen( in );
             }
             wcstring name_str = input.substr(1, tail_idx - 1);
-            std::string name_cstr = wcs2string(name_str);
-			struct passwd *userinfo = getpwnam( name_cstr.c_str() );
-
-			if( userinfo == NULL )
+			if( ! user_home_directory( name_str, &home ) )
 			{
 				tilde_error = 1;
                 input[0] = L'~';
 			}
-			else
-			{
-				home = str2wcstring(userinfo->pw_dir);
-			}
 		}
 
         if (! tilde_error)
@@ -1449,6 +1666,9 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
         int unescape_flags = UNESCAPE_SPECIAL | UNESCAPE_INCOMPLETE;            
         wcstring next = expand_unescape_string( in->at(i).completion, unescape_flags );
         
+        /* Each stage frees the strings of the previous one as it goes, so that large expansions aren't held twice */
+        wcstring().swap( in->at(i).completion );
+        
         if( EXPAND_SKIP_VARIABLES & flags )
         {
             for (size_t i=0; i < next.size(); i++) {
@@ -1474,7 +1694,8 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
     
     for( i=0; i < in->size(); i++ )
     {
-        wcstring next = in->at(i).completion;
+        wcstring next;
+        next.swap( in->at(i).completion );
         
         if( !expand_brackets( parser, next.c_str(), flags, *out ))
         {
@@ -1488,7 +1709,8 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
     
     for( i=0; i < in->size(); i++ )
     {
-        wcstring next = in->at(i).completion;
+        wcstring next;
+        next.swap( in->at(i).completion );
         
         expand_tilde_internal(next);
         
@@ -1507,7 +1729,7 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
             }
             else
             {
-                out->push_back(completion_t(next));
+                append_completion_taking( *out, next );
             }
         }
         else
@@ -1526,7 +1748,8 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
     
     for( i=0; i < in->size(); i++ )
     {
-        wcstring next_str = in->at(i).completion;
+        wcstring next_str;
+        next_str.swap( in->at(i).completion );
         int wc_res;
         
         remove_internal_separator2( next_str, EXPAND_SKIP_WILDCARDS & flags );			
@@ -1573,15 +1796,9 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
                         
                     case 1:
                     {
-                        size_t j;
                         res = EXPAND_WILDCARD_MATCH;
                         sort_completions( *out );
-                        
-                        for( j=0; j< out->size(); j++ )
-                        {
-                            output.push_back( out->at(j) );
-                        }
-                        out->clear();
+                        completions_append( output, *out );
                         break;
                     }
                         
@@ -1601,7 +1818,7 @@ int expand_string( const wcstring &input, std::vector<completion_t> &output, exp
             }
             else
             {
-                output.push_back(completion_t(next));
+                append_completion_taking( output, next_str );
             }
         }
         
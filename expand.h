@@ -163,6 +163,14 @@ wcstring expand_escape_variable( const wcstring &in );
 */
 void expand_tilde(wcstring &input);
 
+/**
+   Finds the users whose names start with the specified prefix, ignoring case, from a cached copy of the user database. The cache is refreshed on a background thread when it is old.
+
+   \param prefix the start of the user names
+   \param out_names the list to which the names are appended, in order
+*/
+void expand_user_names( const wcstring &prefix, wcstring_list_t &out_names );
+
 
 /**
    Test if the specified argument is clean, i.e. it does not contain
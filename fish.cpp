@@ -60,21 +60,35 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "output.h"
 #include "history.h"
 #include "path.h"
+#include "profiler.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "complete_server.h"
 
 /**
    The string describing the single-character options accepted by the main fish binary
 */
-#define GETOPT_STRING "+hilnvc:p:d:"
+#define GETOPT_STRING "+hilnvCc:p:d:"
+
+/**
+   The value that getopt_long returns for --complete-server, which has no short form
+*/
+#define COMPLETE_SERVER_OPT 256
+
+/**
+   Whether fish answers completion requests instead of reading commands
+*/
+static bool complete_server = false;
 
 /**
    Parse init files
 */
 static int read_init()
 {
-    parser_t &parser = parser_t::principal_parser();
-
-	parser.eval( L"builtin . " DATADIR "/fish/config.fish 2>/dev/null", 0, TOP );
-	parser.eval( L"builtin . " SYSCONFDIR L"/fish/config.fish 2>/dev/null", 0, TOP );
+	startup_trace_scope_t trace( "config" );
+	wcstring_list_t files;
+	files.push_back( DATADIR L"/fish/config.fish" );
+	files.push_back( SYSCONFDIR L"/fish/config.fish" );
 	
 	/*
 	  We need to get the configuration directory before we can source the user configuration file
@@ -87,10 +101,10 @@ static int read_init()
 	*/
     if (path_get_config(config_dir))
 	{
-		wcstring config_dir_escaped = escape_string( config_dir, 1 );
-        wcstring eval_buff = format_string(L"builtin . %ls/config.fish 2>/dev/null", config_dir_escaped.c_str());
-		parser.eval( eval_buff, 0, TOP );
+		files.push_back( config_dir + L"/config.fish" );
 	}
+
+	snapshot_eval_init_files( files );
 	
 	return 1;
 }
@@ -134,6 +148,14 @@ static int fish_parse_opt( int argc, char **argv, const char **cmd_ptr )
 					"profile", required_argument, 0, 'p' 
 				}
 				,
+				{
+					"check-first", no_argument, 0, 'C' 
+				}
+				,
+				{
+					"complete-server", no_argument, 0, COMPLETE_SERVER_OPT
+				}
+				,
 				{
 					"help", no_argument, 0, 'h' 
 				}
@@ -173,6 +195,19 @@ static int fish_parse_opt( int argc, char **argv, const char **cmd_ptr )
 				break;
 			}
 			
+			case 'C':
+			{
+				reader_set_check_first( true );
+				break;
+			}
+			
+			case COMPLETE_SERVER_OPT:
+			{
+				complete_server = true;
+				is_interactive_session = 0;
+				break;
+			}
+			
 			case 'd':		
 			{
 				char *end;
@@ -220,6 +255,7 @@ static int fish_parse_opt( int argc, char **argv, const char **cmd_ptr )
 			case 'p':
 			{
 				profile = optarg;
+				profiler_set_enabled( true );
 				break;				
 			}
 			
@@ -274,6 +310,9 @@ int main( int argc, char **argv )
 	int my_optind=0;
 
 	set_main_thread();
+	startup_trace_init();
+	exit_stats_init();
+	trace_init();
     setup_fork_guards();
     
 	wsetlocale( LC_ALL, L"" );
@@ -299,7 +338,10 @@ int main( int argc, char **argv )
 	//parser_init();
 	builtin_init();
 	function_init();
-	env_init();
+	{
+		startup_trace_scope_t trace( "env_init" );
+		env_init();
+	}
 	reader_init();
 	history_init();
 
@@ -310,7 +352,11 @@ int main( int argc, char **argv )
 
 	if( read_init() )
 	{
-		if( cmd != 0 )
+		if( complete_server )
+		{
+			res = complete_server_run( STDIN_FILENO, STDOUT_FILENO );
+		}
+		else if( cmd != 0 )
 		{
 			wchar_t *cmd_wcs = str2wcs( cmd );
 			res = parser.eval( cmd_wcs, 0, TOP );
@@ -379,6 +425,7 @@ int main( int argc, char **argv )
 		}
 	}
 	
+	startup_trace_finish( "exit" );
 	proc_fire_event( L"PROCESS_EXIT", EVENT_EXIT, getpid(), res );
 	
 	history_destroy();
@@ -393,6 +440,9 @@ int main( int argc, char **argv )
 	
     if (g_log_forks)
         printf("%d: g_fork_count: %d\n", __LINE__, g_fork_count);
-    
+
+	trace_finish();
+	exit_stats_finish();
+	
 	return res?STATUS_UNKNOWN_COMMAND:proc_get_last_status();	
 }
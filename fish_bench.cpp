@@ -0,0 +1,698 @@
+/** \file fish_bench.cpp
+	Micro-benchmarks for the hot paths of fish. Compiled by make
+	fish_bench. Run without arguments to run all benchmarks, or with
+	arguments to only run the benchmarks whose name contains one of
+	them.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <new>
+#include <vector>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#if HAVE_NCURSES_H
+#include <ncurses.h>
+#else
+#include <curses.h>
+#endif
+
+#if HAVE_TERM_H
+#include <term.h>
+#elif HAVE_NCURSES_TERM_H
+#include <ncurses/term.h>
+#endif
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "proc.h"
+#include "reader.h"
+#include "builtin.h"
+#include "function.h"
+#include "wutil.h"
+#include "env.h"
+#include "env_universal_common.h"
+#include "expand.h"
+#include "tokenizer.h"
+#include "output.h"
+#include "event.h"
+#include "path.h"
+#include "history.h"
+#include "highlight.h"
+#include "wildcard.h"
+#include "screen.h"
+
+/**
+   The number of times each benchmark is run. The fastest run is reported.
+*/
+#define BENCH_RUNS 5
+
+/**
+   The minimum duration of each run, in microseconds. The number of
+   calls per run is doubled until a run takes at least this long.
+*/
+#define BENCH_RUN_TIME 50000
+
+/**
+   The number of files in the directory used for glob benchmarks
+*/
+#define BENCH_GLOB_FILES 1000
+
+/**
+   Number of allocations made with operator new since the program started
+*/
+static size_t s_allocations = 0;
+
+void *operator new( size_t size )
+{
+	s_allocations++;
+	void *result = malloc( size ? size : 1 );
+	if( ! result )
+		throw std::bad_alloc();
+	return result;
+}
+
+void *operator new[]( size_t size )
+{
+	s_allocations++;
+	void *result = malloc( size ? size : 1 );
+	if( ! result )
+		throw std::bad_alloc();
+	return result;
+}
+
+void operator delete( void *ptr )
+{
+	free( ptr );
+}
+
+void operator delete[]( void *ptr )
+{
+	free( ptr );
+}
+
+/**
+   Where the results are printed. This is a copy of standard output,
+   so that the output of the code being measured can be discarded.
+*/
+static FILE *s_results = 0;
+
+/**
+   The benchmark names given on the commandline
+*/
+static wcstring_list_t s_filters;
+
+/**
+   Returns whether the benchmark with the specified name should be run
+*/
+static bool bench_selected( const wcstring &name )
+{
+	if( s_filters.empty() )
+		return true;
+	for( size_t i=0; i<s_filters.size(); i++ )
+	{
+		if( name.find( s_filters.at( i ) ) != wcstring::npos )
+			return true;
+	}
+	return false;
+}
+
+/**
+   Call \c op \c iterations times and return the elapsed time in microseconds
+*/
+template<typename T>
+static long long bench_run( T &op, size_t iterations )
+{
+	long long start = get_time();
+	for( size_t i=0; i<iterations; i++ )
+	{
+		op();
+	}
+	return get_time() - start;
+}
+
+/**
+   Run a benchmark, and print the time and the number of allocations
+   per call of \c op. After finding out how many calls of \c op take
+   BENCH_RUN_TIME, that many calls are timed BENCH_RUNS times and the
+   fastest run is reported.
+*/
+template<typename T>
+static void bench( const wchar_t *name, T &op )
+{
+	if( ! bench_selected( name ) )
+		return;
+
+	size_t iterations = 1;
+	while( bench_run( op, iterations ) < BENCH_RUN_TIME )
+	{
+		iterations *= 2;
+	}
+
+	long long best = LLONG_MAX;
+	size_t allocations = 0;
+	for( int run=0; run<BENCH_RUNS; run++ )
+	{
+		size_t allocations_before = s_allocations;
+		long long elapsed = bench_run( op, iterations );
+		if( elapsed < best )
+		{
+			best = elapsed;
+			allocations = s_allocations - allocations_before;
+		}
+	}
+
+	fwprintf( s_results, L"%-40ls %14.1f ns/op %12.1f allocs/op\n",
+			 name,
+			 1000.0 * best / iterations,
+			 (double)allocations / iterations );
+	fflush( s_results );
+}
+
+/**
+   Tokenize a string
+*/
+struct tokenize_op_t
+{
+	wcstring src;
+	size_t tokens;
+
+	void operator()()
+	{
+		tokenizer tok;
+		tokens = 0;
+		for( tok_init( &tok, src.c_str(), TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS ); tok_has_next( &tok ); tok_next( &tok ) )
+		{
+			tokens++;
+		}
+		tok_destroy( &tok );
+	}
+};
+
+static void bench_tokenizer()
+{
+	tokenize_op_t op;
+	for( int i=0; i<100; i++ )
+	{
+		append_format( op.src, L"if test -f $file%d; and grep -q 'foo bar' \"$file%d\" ^/dev/null | sort >out%d.txt # check %d\n", i, i, i, i );
+		op.src.append( L"\tset -l x (math $x + 1) {a,b,c}*.c\nend\n" );
+	}
+	bench( L"tokenizer/script", op );
+}
+
+/**
+   Expand a string
+*/
+struct expand_op_t
+{
+	wcstring input;
+	expand_flags_t flags;
+	std::vector<completion_t> out;
+
+	void operator()()
+	{
+		out.clear();
+		if( expand_string( input, out, flags ) == EXPAND_ERROR )
+		{
+			fwprintf( stderr, L"Error: could not expand '%ls'\n", input.c_str() );
+		}
+	}
+};
+
+static void bench_expand( const wcstring &glob_dir )
+{
+	expand_op_t op;
+	op.flags = EXPAND_SKIP_CMDSUBST;
+
+	op.input = L"{alpha,beta,gamma}{1,2,3}{x,y}";
+	bench( L"expand/brace", op );
+
+	op.input = L"$HOME/$USER/$PATH";
+	bench( L"expand/variable", op );
+
+	op.input = L"foo\\ bar'baz'\"qux\"";
+	bench( L"expand/plain", op );
+
+	op.input = glob_dir + L"/*.txt";
+	bench( L"expand/glob", op );
+
+	op.input = glob_dir + L"/file_5";
+	op.flags = EXPAND_SKIP_CMDSUBST | ACCEPT_INCOMPLETE;
+	bench( L"expand/glob_complete", op );
+}
+
+/**
+   Match a string against a wildcard
+*/
+struct wildcard_match_op_t
+{
+	wcstring str, wc;
+	bool result;
+
+	void operator()()
+	{
+		result = wildcard_match( str, wc );
+	}
+};
+
+static void bench_wildcard_match()
+{
+	wildcard_match_op_t op;
+	op.str = L"some_rather_long_file_name_with_several_parts.tar.gz";
+
+	op.wc = L"*part*.tar.?z";
+	bench( L"wildcard_match/hit", op );
+
+	op.wc = L"*part*.zip";
+	bench( L"wildcard_match/miss", op );
+}
+
+/**
+   Write a history file with the specified number of synthetic items
+   for the history with the specified name
+*/
+static void write_history_file( const wcstring &name, size_t count )
+{
+	wcstring path;
+	if( ! path_get_config( path ) )
+		return;
+	path.append( L"/" );
+	path.append( name );
+	path.append( L"_history" );
+
+	FILE *f = wfopen( path, "w" );
+	if( ! f )
+	{
+		wperror( L"fopen" );
+		return;
+	}
+	for( size_t i=0; i<count; i++ )
+	{
+		fprintf( f, "- cmd: git commit -m 'change number %lu' file%lu.c\n   when: %lu\n", (unsigned long)i, (unsigned long)(i % 997), (unsigned long)(1300000000 + i) );
+	}
+	fclose( f );
+}
+
+/**
+   Search the history for the first \c limit matches of a term, like
+   pressing the up arrow \c limit times
+*/
+struct history_search_op_t
+{
+	history_t *history;
+	wcstring term;
+	history_search_type_t type;
+	size_t limit;
+	size_t found;
+
+	void operator()()
+	{
+		history_search_t search( *history, term, type );
+		found = 0;
+		while( found < limit && search.go_backwards() )
+		{
+			found++;
+		}
+	}
+};
+
+static void bench_history( const wchar_t *name, const wcstring &bench_name, size_t count )
+{
+	if( ! bench_selected( bench_name ) )
+		return;
+
+	write_history_file( name, count );
+
+	history_search_op_t op;
+	op.history = &history_t::history_with_name( name );
+	op.limit = 50;
+
+	op.term = L"this is not in the history";
+	op.type = HISTORY_SEARCH_TYPE_CONTAINS;
+	bench( ( bench_name + L"/miss" ).c_str(), op );
+
+	op.term = L"file1.c";
+	bench( ( bench_name + L"/contains" ).c_str(), op );
+
+	op.term = L"git commit -m 'change number 1";
+	op.type = HISTORY_SEARCH_TYPE_PREFIX;
+	bench( ( bench_name + L"/prefix" ).c_str(), op );
+}
+
+/**
+   Highlight a commandline
+*/
+struct highlight_op_t
+{
+	wcstring line;
+	std::vector<int> colors;
+	env_vars vars;
+
+	highlight_op_t() : vars( env_vars::highlighting_keys )
+	{
+	}
+
+	void operator()()
+	{
+		colors.assign( line.size(), 0 );
+		highlight_shell( line, colors, line.size(), NULL, vars );
+	}
+};
+
+static void bench_highlight( const wcstring &glob_dir )
+{
+	highlight_op_t op;
+	op.line = L"for i in (seq 10); echo \"value $i\" | sed -e 's/a/b/g' >> " + glob_dir + L"/out; end; ls";
+	for( int i=0; i<50; i++ )
+	{
+		append_format( op.line, L" %ls/file_%d.txt --opt%d", glob_dir.c_str(), i, i );
+	}
+	bench( L"highlight/long_line", op );
+}
+
+/**
+   Look up an environment variable
+*/
+struct env_get_op_t
+{
+	wcstring key;
+	bool missing;
+
+	void operator()()
+	{
+		missing = env_get_string( key ).missing();
+	}
+};
+
+/**
+   Find the variables that complete $fish_bench_var_1
+*/
+struct env_prefix_op_t
+{
+	size_t count;
+
+	void operator()()
+	{
+		count = env_get_names_with_prefix( L"fish_bench_var_1" ).size();
+	}
+};
+
+static void bench_env()
+{
+	env_get_op_t op;
+
+	op.key = L"PATH";
+	bench( L"env_get_string/exported", op );
+
+	op.key = L"fish_bench_not_a_variable";
+	bench( L"env_get_string/missing", op );
+
+	for( int i=0; i<5000; i++ )
+	{
+		env_set( format_string( L"fish_bench_var_%d", i ), L"1", ENV_GLOBAL );
+	}
+	env_prefix_op_t prefix_op;
+	bench( L"env_get_names_with_prefix/5k", prefix_op );
+	for( int i=0; i<5000; i++ )
+	{
+		env_remove( format_string( L"fish_bench_var_%d", i ), ENV_GLOBAL );
+	}
+}
+
+/**
+   Read the messages that a client gets from fishd when it connects
+*/
+struct universal_read_op_t
+{
+	std::string file;
+
+	void operator()()
+	{
+		connection_t c;
+		connection_init( &c, open( file.c_str(), O_RDONLY ) );
+		read_message( &c );
+		connection_destroy( &c );
+	}
+};
+
+static void bench_universal( const std::string &base )
+{
+	universal_read_op_t op;
+	op.file = base + "/universal_messages";
+
+	std::string messages;
+	for( int i=0; i<1000; i++ )
+	{
+		char line[128];
+		snprintf( line, sizeof line, "SET fish_bench_universal_%d:value\\x20number\\x20%d\n", i, i );
+		messages.append( line );
+	}
+
+	FILE *f = fopen( op.file.c_str(), "w" );
+	if( ! f || fwrite( messages.data(), 1, messages.size(), f ) != messages.size() )
+	{
+		fwprintf( stderr, L"Error: could not write '%s'\n", op.file.c_str() );
+		if( f )
+			fclose( f );
+		return;
+	}
+	fclose( f );
+
+	bench( L"universal/read_1k", op );
+	unlink( op.file.c_str() );
+}
+
+/**
+   Convert a string to a wide string and back
+*/
+struct convert_op_t
+{
+	std::string narrow;
+	wcstring wide;
+
+	void operator()()
+	{
+		wide = str2wcstring( narrow );
+		narrow = wcs2string( wide );
+	}
+};
+
+static void bench_convert()
+{
+	convert_op_t op;
+	for( int i=0; i<40; i++ )
+		op.narrow.append( "plain ascii text " );
+	bench( L"convert/ascii", op );
+
+	op.narrow.clear();
+	for( int i=0; i<40; i++ )
+		op.narrow.append( "r\xc3\xa4ksm\xc3\xb6rg\xc3\xa5s \xe2\x82\xac " );
+	bench( L"convert/utf8", op );
+}
+
+/**
+   Render a commandline, alternating between two versions of it so
+   that every call has something to redraw
+*/
+struct screen_op_t
+{
+	screen_t *screen;
+	wcstring commandlines[2];
+	std::vector<int> colors, indents;
+	size_t count;
+
+	void operator()()
+	{
+		const wcstring &line = commandlines[count++ % 2];
+		s_write( screen, L"bench> ", line.c_str(), &colors.at( 0 ), &indents.at( 0 ), line.size() );
+	}
+};
+
+/**
+   Make the terminal code think it is writing to an 80 column xterm,
+   so that the screen benchmark does not depend on where it runs.
+   Returns false if that is not possible.
+*/
+static bool setup_bench_terminal()
+{
+	int err;
+	if( setupterm( const_cast<char *>( "xterm" ), STDOUT_FILENO, &err ) == ERR )
+		return false;
+
+	/* The terminal size is read from standard output, so point it at a pty of the right size for a moment */
+	int master = posix_openpt( O_RDWR | O_NOCTTY );
+	if( master < 0 )
+		return false;
+	bool result = false;
+	int slave = -1;
+	if( ! grantpt( master ) && ! unlockpt( master ) && ( slave = open( ptsname( master ), O_RDWR | O_NOCTTY ) ) >= 0 )
+	{
+		struct winsize size;
+		memset( &size, 0, sizeof size );
+		size.ws_row = 24;
+		size.ws_col = 80;
+		int saved_stdout = dup( STDOUT_FILENO );
+		if( saved_stdout >= 0 && ! ioctl( slave, TIOCSWINSZ, &size ) )
+		{
+			fflush( stdout );
+			dup2( slave, STDOUT_FILENO );
+			common_handle_winch( 0 );
+			dup2( saved_stdout, STDOUT_FILENO );
+			result = ( common_get_width() == 80 );
+		}
+		if( saved_stdout >= 0 )
+			close( saved_stdout );
+		close( slave );
+	}
+	close( master );
+	return result;
+}
+
+static void bench_screen()
+{
+	if( ! bench_selected( L"s_update/commandline" ) )
+		return;
+
+	if( ! setup_bench_terminal() )
+	{
+		fwprintf( s_results, L"%-40ls skipped, could not set up a terminal\n", L"s_update/commandline" );
+		return;
+	}
+
+	screen_op_t op;
+	op.screen = new screen_t();
+	op.count = 0;
+	s_reset( op.screen, true );
+	for( int i=0; i<6; i++ )
+	{
+		append_format( op.commandlines[0], L"echo line %d with some arguments | grep something\n", i );
+		append_format( op.commandlines[1], L"echo line %d with other arguments | grep something\n", i );
+	}
+	op.colors.assign( op.commandlines[0].size() + 1, HIGHLIGHT_PARAM );
+	op.indents.assign( op.commandlines[0].size() + 1, 0 );
+
+	/* The screen code writes straight to standard output */
+	int null_fd = open( "/dev/null", O_WRONLY );
+	int saved_stdout = dup( STDOUT_FILENO );
+	if( null_fd >= 0 && saved_stdout >= 0 )
+	{
+		dup2( null_fd, STDOUT_FILENO );
+		bench( L"s_update/commandline", op );
+		dup2( saved_stdout, STDOUT_FILENO );
+	}
+	if( null_fd >= 0 )
+		close( null_fd );
+	if( saved_stdout >= 0 )
+		close( saved_stdout );
+	delete op.screen;
+}
+
+/**
+   Make a directory with files for the glob benchmarks. Returns the empty string on failure.
+*/
+static wcstring make_glob_dir( const std::string &base )
+{
+	const std::string dir = base + "/glob";
+	if( mkdir( dir.c_str(), 0700 ) )
+		return wcstring();
+
+	for( int i=0; i<BENCH_GLOB_FILES; i++ )
+	{
+		char name[64];
+		snprintf( name, sizeof name, "/file_%d.%s", i, i % 2 ? "txt" : "c" );
+		int fd = open( ( dir + name ).c_str(), O_WRONLY | O_CREAT, 0600 );
+		if( fd >= 0 )
+			close( fd );
+	}
+	return str2wcstring( dir );
+}
+
+/**
+   Remove the files the benchmarks made
+*/
+static void remove_bench_dir( const std::string &base )
+{
+	const std::string command = "rm -rf '" + base + "'";
+	if( system( command.c_str() ) )
+		fwprintf( stderr, L"Error: could not remove %s\n", base.c_str() );
+}
+
+/**
+   Run the benchmarks
+*/
+int main( int argc, char **argv )
+{
+	setlocale( LC_ALL, "" );
+	configure_thread_assertions_for_testing();
+
+	program_name=L"fish_bench";
+
+	s_results = fdopen( dup( STDOUT_FILENO ), "w" );
+	if( ! s_results )
+	{
+		perror( "fdopen" );
+		return 1;
+	}
+
+	for( int i=1; i<argc; i++ )
+		s_filters.push_back( str2wcstring( argv[i] ) );
+
+	/* Keep the history files and anything else fish writes out of the real configuration directory */
+	char base_template[] = "/tmp/fish_bench.XXXXXX";
+	const char *base_dir = mkdtemp( base_template );
+	if( ! base_dir )
+	{
+		perror( "mkdtemp" );
+		return 1;
+	}
+	const std::string base = base_dir;
+	setenv( "XDG_CONFIG_HOME", base.c_str(), 1 );
+
+	set_main_thread();
+	setup_fork_guards();
+	proc_init();
+	event_init();
+	function_init();
+	builtin_init();
+	reader_init();
+	env_init();
+
+	const wcstring glob_dir = make_glob_dir( base );
+
+	bench_tokenizer();
+	bench_expand( glob_dir );
+	bench_wildcard_match();
+	bench_history( L"bench_100k", L"history_search/100k", 100000 );
+	bench_history( L"bench_1m", L"history_search/1m", 1000000 );
+	bench_highlight( glob_dir );
+	bench_env();
+	bench_universal( base );
+	bench_convert();
+	bench_screen();
+
+	env_destroy();
+	reader_destroy();
+	builtin_destroy();
+	wutil_destroy();
+	event_destroy();
+	proc_destroy();
+
+	remove_bench_dir( base );
+
+	fclose( s_results );
+	return 0;
+}
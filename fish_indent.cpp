@@ -32,6 +32,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <getopt.h>
 #endif
 #include <locale.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
 
 #include "fallback.h"
 #include "util.h"
@@ -44,7 +47,15 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 /**
    The string describing the single-character options accepted by the main fish binary
 */
-#define GETOPT_STRING "hvi"
+#define GETOPT_STRING "hviw"
+
+/**
+   The number of lines of input after which the streaming indenter
+   first checks whether the pending input ends with a complete job.
+   The interval doubles while the job is incomplete, so that a long
+   job is not tokenized again for every line of it.
+*/
+#define STREAM_FIRST_ATTEMPT 1
 
 /**
    Read the entire contents of a file into the specified string
@@ -69,6 +80,53 @@ static void read_file( FILE *f, wcstring &b )
 	}
 }
 
+/**
+   Read one line, including the trailing newline, from the specified
+   file and append it to the specified string. Returns false if the
+   end of the file was reached before anything could be read.
+ */
+static bool read_line( FILE *f, wcstring &b )
+{
+	bool got_any = false;
+	while( 1 )
+	{
+		errno=0;
+		wint_t c = fgetwc( f );
+		if( c == WEOF )
+		{
+			if( errno )
+			{
+				wperror(L"fgetwc");
+				exit(1);
+			}
+			
+			break;
+		}
+		got_any = true;
+		b.push_back((wchar_t)c);
+		if( c == L'\n' )
+			break;
+	}
+	return got_any;
+}
+
+/**
+   The state of the indenter between two jobs. Keeping it out of
+   indent() lets the input be indented a few jobs at a time.
+ */
+struct indent_state_t
+{
+	int is_command;
+	int indent;
+	int do_indent;
+	int prev_type;
+	int prev_prev_type;
+
+	indent_state_t() : is_command(1), indent(0), do_indent(1), prev_type(0), prev_prev_type(0)
+	{
+	}
+};
+
 /**
    Insert the specified number of tabs into the output buffer
  */
@@ -79,25 +137,46 @@ static void insert_tabs( wcstring &out, int indent )
 }
 
 /**
-   Indent the specified input
+   Indent the specified input, continuing from the specified state.
+
+   If \c incomplete is not null, the input may end in the middle of a
+   job. In that case \c incomplete is set to true and the output and
+   state are not usable; the caller should try again with more input.
  */
-static int indent( wcstring &out, const wcstring &in, int flags )
+static int indent( wcstring &out, const wcstring &in, int flags, indent_state_t &state, bool *incomplete )
 {
 	tokenizer tok;
 	int res=0;
-	int is_command = 1;
-	int indent = 0;
-	int do_indent = 1;
-	int prev_type = 0;
-	int prev_prev_type = 0;
+	int &is_command = state.is_command;
+	int &indent = state.indent;
+	int &do_indent = state.do_indent;
+	int &prev_type = state.prev_type;
+	int &prev_prev_type = state.prev_prev_type;
+	int last_end_pos = -1;
 
-	tok_init( &tok, in.c_str(), TOK_SHOW_COMMENTS );
+	/* Error messages can only be generated on the main thread */
+	tok_init( &tok, in.c_str(), TOK_SHOW_COMMENTS | ( is_main_thread() ? 0 : TOK_SQUASH_ERRORS ) );
 	
 	for( ; tok_has_next( &tok ); tok_next( &tok ) )
 	{
 		int type = tok_last_type( &tok );
 		wchar_t *last = tok_last( &tok );
 		
+		if( incomplete && type == TOK_ERROR )
+		{
+			switch( tok_get_error( &tok ) )
+			{
+				case TOK_UNTERMINATED_QUOTE:
+				case TOK_UNTERMINATED_SUBSHELL:
+				case TOK_UNTERMINATED_ESCAPE:
+				{
+					*incomplete = true;
+					tok_destroy( &tok );
+					return res;
+				}
+			}
+		}
+		
 		switch( type )
 		{
 			case TOK_STRING:
@@ -152,6 +231,7 @@ static int indent( wcstring &out, const wcstring &in, int flags )
 			
 			case TOK_END:
 			{
+				last_end_pos = tok_get_pos( &tok );
 				if( prev_type != TOK_END || prev_prev_type != TOK_END ) 
 					out.append( L"\n" );
 				do_indent = 1;
@@ -251,6 +331,10 @@ static int indent( wcstring &out, const wcstring &in, int flags )
 	
 	tok_destroy( &tok );
 
+	/* The input is only complete if it ends with the end of a job, and not with e.g. an escaped newline */
+	if( incomplete )
+		*incomplete = ( prev_type != TOK_END || last_end_pos + 1 != (int)in.size() );
+
 	return res;
 }
 
@@ -273,12 +357,236 @@ static void trim( wcstring &str )
 }
 
 
+/**
+   Writes indented output as it is produced, leaving out the leading
+   and trailing whitespace that trim() would remove from the whole
+   output.
+ */
+class trimmed_writer_t
+{
+	FILE *f;
+	bool started;
+	wcstring held;
+
+public:
+	trimmed_writer_t( FILE *file ) : f(file), started(false)
+	{
+	}
+
+	void write( const wcstring &str )
+	{
+		size_t end = str.find_last_not_of(L" \n");
+		if( end == wcstring::npos )
+		{
+			/* Only whitespace, which is written if anything else follows it */
+			if( started )
+				held.append( str );
+			return;
+		}
+
+		size_t start = 0;
+		if( ! started )
+		{
+			start = str.find_first_not_of(L" \n");
+			started = true;
+		}
+
+		held.append( str, start, end + 1 - start );
+		fputws( held.c_str(), f );
+		held.assign( str, end + 1, wcstring::npos );
+	}
+};
+
+/**
+   Indent standard input to standard output a few jobs at a time,
+   so that only the job being indented has to be kept in memory.
+ */
+static void indent_stream( FILE *in, FILE *out, int flags )
+{
+	trimmed_writer_t writer( out );
+	indent_state_t state;
+	wcstring pending, chunk;
+	size_t pending_lines = 0, next_attempt = STREAM_FIRST_ATTEMPT;
+	
+	while( read_line( in, pending ) )
+	{
+		if( pending.at( pending.size() - 1 ) != L'\n' )
+			break;
+		
+		if( ++pending_lines < next_attempt )
+			continue;
+		
+		indent_state_t next_state = state;
+		bool incomplete = false;
+		chunk.clear();
+		indent( chunk, pending, flags, next_state, &incomplete );
+		if( incomplete )
+		{
+			next_attempt = 2 * pending_lines;
+			continue;
+		}
+		
+		writer.write( chunk );
+		state = next_state;
+		pending.clear();
+		pending_lines = 0;
+		next_attempt = STREAM_FIRST_ATTEMPT;
+	}
+	
+	if( ! pending.empty() )
+	{
+		chunk.clear();
+		indent( chunk, pending, flags, state, NULL );
+		writer.write( chunk );
+	}
+}
+
+/**
+   A file given on the commandline, and the result of indenting it
+ */
+struct indent_file_t
+{
+	/** The name of the file */
+	std::string name;
+	/** The indented contents, if the file could be read */
+	wcstring output;
+	/** The errno value if the file could not be opened, or zero */
+	int err;
+};
+
+/**
+   The files being indented in parallel. Worker threads take the next
+   unclaimed file until all files are claimed.
+ */
+struct indent_batch_t
+{
+	std::vector<indent_file_t> files;
+	int flags;
+	bool write_back;
+	size_t next_file;
+	pthread_mutex_t lock;
+};
+
+/**
+   Writes the output for a file back to it. Returns zero on success, or an errno value.
+ */
+static int write_file( const indent_file_t &file )
+{
+	FILE *f = fopen( file.name.c_str(), "w" );
+	if( ! f )
+		return errno;
+
+	fputws( file.output.c_str(), f );
+	if( ! file.output.empty() )
+		fputwc( L'\n', f );
+
+	int err = ferror( f ) ? errno : 0;
+	if( fclose( f ) && ! err )
+		err = errno;
+	return err;
+}
+
+/**
+   Thread function that indents files from the batch until there are none left
+ */
+static void *indent_files_thread( void *arg )
+{
+	indent_batch_t *batch = (indent_batch_t *)arg;
+	while( 1 )
+	{
+		VOMIT_ON_FAILURE( pthread_mutex_lock( &batch->lock ) );
+		size_t idx = batch->next_file++;
+		VOMIT_ON_FAILURE( pthread_mutex_unlock( &batch->lock ) );
+		if( idx >= batch->files.size() )
+			break;
+
+		indent_file_t &file = batch->files.at( idx );
+		FILE *f = fopen( file.name.c_str(), "r" );
+		if( ! f )
+		{
+			file.err = errno;
+			continue;
+		}
+
+		wcstring in;
+		read_file( f, in );
+		fclose( f );
+
+		indent_state_t state;
+		indent( file.output, in, batch->flags, state, NULL );
+		trim( file.output );
+
+		/* Leave files that are already indented alone */
+		if( batch->write_back && file.output + L"\n" != in )
+			file.err = write_file( file );
+	}
+	return NULL;
+}
+
+/**
+   Indent the specified files, on as many threads as there are
+   processors. Each file is written back if \c write_back is set, and
+   printed otherwise. Returns the exit status.
+ */
+static int indent_files( char **names, int count, int flags, bool write_back )
+{
+	indent_batch_t batch;
+	batch.files.resize( count );
+	for( int i=0; i<count; i++ )
+	{
+		batch.files.at( i ).name = names[i];
+		batch.files.at( i ).err = 0;
+	}
+	batch.flags = flags;
+	batch.write_back = write_back;
+	batch.next_file = 0;
+	VOMIT_ON_FAILURE( pthread_mutex_init( &batch.lock, NULL ) );
+
+	long thread_count = sysconf( _SC_NPROCESSORS_ONLN );
+	if( thread_count > count )
+		thread_count = count;
+	if( thread_count < 1 )
+		thread_count = 1;
+
+	std::vector<pthread_t> threads;
+	for( long i=1; i<thread_count; i++ )
+	{
+		pthread_t thread;
+		if( pthread_create( &thread, NULL, indent_files_thread, &batch ) )
+			break;
+		threads.push_back( thread );
+	}
+	indent_files_thread( &batch );
+	for( size_t i=0; i<threads.size(); i++ )
+	{
+		VOMIT_ON_FAILURE( pthread_join( threads.at( i ), NULL ) );
+	}
+	pthread_mutex_destroy( &batch.lock );
+
+	int res = 0;
+	for( size_t i=0; i<batch.files.size(); i++ )
+	{
+		const indent_file_t &file = batch.files.at( i );
+		if( file.err )
+		{
+			fwprintf( stderr, L"%ls: %s: %s\n", program_name, file.name.c_str(), strerror( file.err ) );
+			res = 1;
+		}
+		else if( ! write_back )
+		{
+			fwprintf( stdout, L"%ls\n", file.output.c_str() );
+		}
+	}
+	return res;
+}
+
 /**
    The main mathod. Run the program.
  */
 int main( int argc, char **argv )
 {	
 	int do_indent=1;
+	bool write_back = false;
 	set_main_thread();
     setup_fork_guards();
     
@@ -302,6 +610,10 @@ int main( int argc, char **argv )
 					"version", no_argument, 0, 'v' 
 				}
 				,
+				{
+					"write", no_argument, 0, 'w' 
+				}
+				,
 				{ 
 					0, 0, 0, 0 
 				}
@@ -348,6 +660,12 @@ int main( int argc, char **argv )
 				break;
 			}
 			
+			case 'w':
+			{
+				write_back = true;
+				break;
+			}
+			
 			
 			case '?':
 			{
@@ -357,26 +675,24 @@ int main( int argc, char **argv )
 		}		
 	}
 
-    wcstring sb_in, sb_out;
-	read_file( stdin, sb_in );
-	
 	wutil_init();
 
-	if( !indent( sb_out, sb_in, do_indent ) )
+	int res = 0;
+	if( optind < argc )
 	{
-        trim(sb_out);
-		fwprintf( stdout, L"%ls", sb_out.c_str() );
+		res = indent_files( argv + optind, argc - optind, do_indent, write_back );
+	}
+	else if( write_back )
+	{
+		fwprintf( stderr, _(L"%ls: --write needs files to indent\n"), program_name );
+		res = 1;
 	}
 	else
 	{
-		/*
-		  Indenting failed - print original input
-		*/
-		fwprintf( stdout, L"%ls", sb_in.c_str() );
+		indent_stream( stdin, stdout, do_indent );
 	}
-	
 
 	wutil_destroy();
 
-	return 0;
+	return res;
 }
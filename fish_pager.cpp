@@ -61,52 +61,7 @@
 #include "input_common.h"
 #include "env_universal.h"
 #include "print_help.h"
-
-enum 
-{
-	LINE_UP = R_NULL+1,
-	LINE_DOWN,
-	PAGE_UP,
-	PAGE_DOWN
-}
-	;
-
-
-enum
-{
-	HIGHLIGHT_PAGER_PREFIX,
-	HIGHLIGHT_PAGER_COMPLETION,
-	HIGHLIGHT_PAGER_DESCRIPTION,
-	HIGHLIGHT_PAGER_PROGRESS
-}
-	;
-
-enum
-{
-	/*
-	  Returnd by the pager if no more displaying is needed
-	*/
-	PAGER_DONE,
-	/*
-	  Returned by the pager if the completions would not fit in the specified number of columns
-	*/
-	PAGER_RETRY,
-	/*
-	  Returned by the pager if the terminal changes size
-	*/
-	PAGER_RESIZE
-}
-	;
-
-/**
-   The minimum width (in characters) the terminal may have for fish_pager to not refuse showing the completions
-*/
-#define PAGER_MIN_WIDTH 16
-
-/**
-   The maximum number of columns of completion to attempt to fit onto the screen
-*/
-#define PAGER_MAX_COLS 6
+#include "pager.h"
 
 /**
    The string describing the single-character options accepted by fish_pager
@@ -118,84 +73,17 @@ enum
 */
 #define ERR_NOT_FD _( L"%ls: Argument '%s' is not a valid file descriptor\n" )
 
-/**
-   This struct should be continually updated by signals as the term
-   resizes, and as such always contain the correct current size.
-*/
-static struct winsize termsize;
-
 /**
    The termios modes the terminal had when the program started. These
    should be restored on exit
 */
 static struct termios saved_modes;
 
-/**
-   This flag is set to 1 of we have sent the enter_ca_mode terminfo
-   sequence to save the previous terminal contents.
-*/
-static int is_ca_mode = 0;
-
-/**
-   This buffer is used to buffer the output of the pager to improve
-   screen redraw performance bu cutting down the number of write()
-   calls to only one.
-*/
-static std::vector<char> pager_buffer;
-
-/**
-   The environment variables used to specify the color of different
-   tokens.
-*/
-static const wchar_t *hightlight_var[] = 
-{
-	L"fish_pager_color_prefix",
-	L"fish_pager_color_completion",
-	L"fish_pager_color_description",
-	L"fish_pager_color_progress"
-}
-	;
-
-/**
-   This string contains the text that should be sent back to the calling program
-*/
-static wcstring out_buff;
 /**
    This is the file to which the output text should be sent. It is really a pipe.
 */
 static FILE *out_file;
 
-/**
-   Data structure describing one or a group of related completions
-*/
-struct comp_t
-{
-	/**
-	   The list of all completin strings this entry applies to
-	*/
-	wcstring_list_t comp;
-	/**
-	   The description
-	*/
-	wcstring desc;
-	/**
-	   On-screen width of the completion string
-	*/
-	int comp_width;	
-	/**
-	   On-screen width of the description information
-	*/
-	int desc_width;	
-	/**
-	   Preffered total width
-	*/
-	int pref_width;
-	/**
-	   Minimum acceptable width
-	*/
-	int min_width;
-};
-
 /**
    This function translates from a highlight code to a specific color
    by check invironement variables
@@ -204,16 +92,11 @@ static rgb_color_t get_color( int highlight )
 {
 	const wchar_t *val;
 
-	if( highlight < 0 )
-		return rgb_color_t::normal();
-	if( highlight >= (4) )
-		return rgb_color_t::normal();
-	
-	val = wgetenv( hightlight_var[highlight]);
+	val = wgetenv( pager_color_var[highlight]);
 
 	if( !val )
 	{
-		val = env_universal_get( hightlight_var[highlight]);
+		val = env_universal_get( pager_color_var[highlight]);
 	}
 	
 	if( !val )
@@ -225,754 +108,33 @@ static rgb_color_t get_color( int highlight )
 }
 
 /**
-   This function calculates the minimum width for each completion
-   entry in the specified array_list. This width depends on the
-   terminal size, so this function should be called when the terminal
-   changes size.
+   Turn the lines read from the caller, each holding a completion,
+   optionally followed by COMPLETE_SEP and a description, into
+   completions
 */
-static void recalc_width( std::vector<comp_t *> &lst, const wchar_t *prefix )
+static void split_completions( const wcstring_list_t &lst, std::vector<completion_t> &comps )
 {
 	for( size_t i=0; i<lst.size(); i++ )
 	{
-		comp_t *c = lst.at(i);
-		
-		c->min_width = mini( c->desc_width, maxi(0,termsize.ws_col/3 - 2)) +
-			mini( c->desc_width, maxi(0,termsize.ws_col/5 - 4)) +4;
-	}
-	
-}
-
-/**
-   Test if the specified character sequence has been entered on the
-   keyboard
-*/
-static int try_sequence( const char *seq )
-{
-	int j, k;
-	wint_t c=0;
-	
-	for( j=0; 
-	     seq[j] != '\0' && seq[j] == (c=input_common_readch( j>0 )); 
-	     j++ )
-		;
-
-	if( seq[j] == '\0' )
-	{		
-		return 1;
-	}
-	else
-	{
-		input_common_unreadch(c);
-		for(k=j-1; k>=0; k--)
-			input_common_unreadch(seq[k]);
-	}
-	return 0;
-}
-
-/**
-   Read a character from keyboard
-*/
-static wint_t readch()
-{
-	struct mapping
-	{
-		const char *seq;
-		wint_t bnd;
-	}
-	;
-	
-	struct mapping m[]=
-		{
-			{				
-				"\x1b[A", LINE_UP
-			}
-			,
-			{
-				key_up, LINE_UP
-			}
-			,
-			{				
-				"\x1b[B", LINE_DOWN
-			}
-			,
-			{
-				key_down, LINE_DOWN
-			}
-			,
-			{
-				key_ppage, PAGE_UP
-			}
-			,
-			{
-				key_npage, PAGE_DOWN
-			}
-			,
-			{
-				" ", PAGE_DOWN
-			}
-			,
-			{
-				"\t", PAGE_DOWN
-			}
-			,
-			{
-				0, 0
-			}
-			
-		}
-	;
-	int i;
-	
-	for( i=0; m[i].bnd; i++ )
-	{
-		if( !m[i].seq )
+		const wcstring &next = lst.at(i);
+		size_t sep = next.find( COMPLETE_SEP );
+		if( sep == wcstring::npos )
 		{
-			continue;
+			comps.push_back( completion_t( next ) );
 		}
-		
-		if( try_sequence(m[i].seq ) )
-			return m[i].bnd;
-	}
-	return input_common_readch(0);
-}
-
-/**
-   Write specified character to the output buffer \c pager_buffer
-*/
-static int pager_buffered_writer( char c)
-{
-	pager_buffer.push_back(c);
-	return 0;
-}
-
-/**
-   Flush \c pager_buffer to stdout
-*/
-static void pager_flush()
-{
-    if (! pager_buffer.empty()) {
-        write_loop( 1, & pager_buffer.at(0), pager_buffer.size() * sizeof(char) );
-        pager_buffer.clear();
-    }
-}
-
-/**
-   Print the specified string, but use at most the specified amount of
-   space. If the whole string can't be fitted, ellipsize it.
-
-   \param str the string to print
-   \param max the maximum space that may be used for printing
-   \param has_more if this flag is true, this is not the entire string, and the string should be ellisiszed even if the string fits but takes up the whole space.
-*/
-static int print_max( const wchar_t *str, int max, int has_more )
-{
-	int i;
-	int written = 0;
-	for( i=0; str[i]; i++ )
-	{
-		
-		if( written + wcwidth(str[i]) > max )
-			break;
-		if( ( written + wcwidth(str[i]) == max) && (has_more || str[i+1]) )
-		{
-			writech( ellipsis_char );
-			written += wcwidth(ellipsis_char );
-			break;
-		}
-			
-		writech( str[i] );
-		written+= wcwidth( str[i] );
-	}
-	return written;
-}
-
-/**
-   Print the specified item using at the specified amount of space
-*/
-static void completion_print_item( const wchar_t *prefix, comp_t *c, int width )
-{
-	int comp_width=0, desc_width=0;
-	int written=0;
-	
-	if( c->pref_width <= width )
-	{
-		/*
-		  The entry fits, we give it as much space as it wants
-		*/
-		comp_width = c->comp_width;
-		desc_width = c->desc_width;
-	}
-	else
-	{
-		/*
-		  The completion and description won't fit on the
-		  allocated space. Give a maximum of 2/3 of the
-		  space to the completion, and whatever is left to
-		  the description.
-		*/
-		int desc_all = c->desc_width?c->desc_width+4:0;
-		
-		comp_width = maxi( mini( c->comp_width,
-					 2*(width-4)/3 ),
-				   width - desc_all );
-		if( c->desc_width )
-			desc_width = width-comp_width-4;
 		else
-			c->desc_width=0;
-		
-	}
-	
-	for( size_t i=0; i<c->comp.size(); i++ )
-	{
-        const wcstring &comp = c->comp.at(i);
-		if( i != 0 )
-			written += print_max( L"  ", comp_width - written, 2 );
-		set_color( get_color(HIGHLIGHT_PAGER_PREFIX),rgb_color_t::normal() );
-		written += print_max( prefix, comp_width - written, comp.empty()?0:1 );
-		set_color( get_color(HIGHLIGHT_PAGER_COMPLETION),rgb_color_t::ignore() );
-		written += print_max( comp.c_str(), comp_width - written, i!=(c->comp.size()-1) );
-	}
-
-
-	if( desc_width )
-	{
-		while( written < (width-desc_width-2))
 		{
-			written++;
-			writech( L' ');
+			comps.push_back( completion_t( wcstring( next, 0, sep ), wcstring( next, sep+1 ) ) );
 		}
-		written += print_max( L"(", 1, 0 );
-		set_color( get_color( HIGHLIGHT_PAGER_DESCRIPTION ), rgb_color_t::ignore() );
-		written += print_max( c->desc.c_str(), desc_width, 0 );
-		written += print_max( L")", 1, 0 );
 	}
-	else
-	{
-		while( written < width )
-		{
-			written++;
-			writech( L' ');
-		}
-	}
-	
 }
 
-/**
-   Print the specified part of the completion list, using the
-   specified column offsets and quoting style.
-
-   \param l The list of completions to print
-   \param cols number of columns to print in
-   \param width An array specifying the width of each column
-   \param row_start The first row to print
-   \param row_stop the row after the last row to print
-   \param prefix The string to print before each completion
-   \param is_quoted Whether to print the completions are in a quoted environment
-*/
-
-static void completion_print( int cols,
-			      int *width,
-			      int row_start,
-			      int row_stop,
-			      wchar_t *prefix,
-			      int is_quoted,
-			      std::vector<comp_t *> &lst )
-{
-
-	int rows = (lst.size()-1)/cols+1;
-	int i, j;
-
-	for( i = row_start; i<row_stop; i++ )
-	{
-		for( j = 0; j < cols; j++ )
-		{
-			comp_t *el;
-
-			int is_last = (j==(cols-1));
-			
-			if( (int)lst.size() <= j*rows + i )
-				continue;
-
-			el = lst.at(j*rows + i );
-			
-			completion_print_item( prefix, el, width[j] - (is_last?0:2) );
-			
-			if( !is_last)
-				writestr( L"  " );
-		}
-		writech( L'\n' );
-	}
-}
-
-
-/**
-   Try to print the list of completions l with the prefix prefix using
-   cols as the number of columns. Return 1 if the completion list was
-   printed, 0 if the terminal is to narrow for the specified number of
-   columns. Always succeeds if cols is 1.
-
-   If all the elements do not fit on the screen at once, make the list
-   scrollable using the up, down and space keys to move. The list will
-   exit when any other key is pressed.
-
-   \param cols the number of columns to try to fit onto the screen
-   \param prefix the character string to prefix each completion with
-   \param is_quoted whether the completions should be quoted
-   \param l the list of completions
-
-   \return one of PAGER_RETRY, PAGER_DONE and PAGER_RESIZE
-*/
-
-static int completion_try_print( int cols,
-				 wchar_t *prefix,
-				 int is_quoted,
-				 std::vector<comp_t *> &lst )
-{
-	/*
-	  The calculated preferred width of each column
-	*/
-	int pref_width[PAGER_MAX_COLS];
-	/*
-	  The calculated minimum width of each column
-	*/
-	int min_width[PAGER_MAX_COLS];
-	/*
-	  If the list can be printed with this width, width will contain the width of each column
-	*/
-	int *width=pref_width;
-	/*
-	  Set to one if the list should be printed at this width
-	*/
-	int print=0;
-	
-	int i, j;
-	
-	int rows = (lst.size()-1)/cols+1;
-	
-	int pref_tot_width=0;
-	int min_tot_width = 0;
-	int res=PAGER_RETRY;
-	/*
-	  Skip completions on tiny terminals
-	*/
-	
-	if( termsize.ws_col < PAGER_MIN_WIDTH )
-		return PAGER_DONE;
-	
-	memset( pref_width, 0, sizeof(pref_width) );
-	memset( min_width, 0, sizeof(min_width) );
-	
-	/* Calculate how wide the list would be */
-	for( j = 0; j < cols; j++ )
-	{
-		for( i = 0; i<rows; i++ )
-		{
-			int pref,min;
-			comp_t *c;
-			if( (int)lst.size() <= j*rows + i )
-				continue;
-
-			c = lst.at(j*rows + i );
-			pref = c->pref_width;
-			min = c->min_width;
-			
-			if( j != cols-1 )
-			{
-				pref += 2;
-				min += 2;
-			}
-			min_width[j] = maxi( min_width[j],
-					     min );
-			pref_width[j] = maxi( pref_width[j],
-					      pref );
-		}
-		min_tot_width += min_width[j];
-		pref_tot_width += pref_width[j];
-	}
-	/*
-	  Force fit if one column
-	*/
-	if( cols == 1)
-	{
-		if( pref_tot_width > termsize.ws_col )
-		{
-			pref_width[0] = termsize.ws_col;
-		}
-		width = pref_width;
-		print=1;
-	}
-	else if( pref_tot_width <= termsize.ws_col )
-	{
-		/* Terminal is wide enough. Print the list! */
-		width = pref_width;
-		print=1;
-	}
-	else
-	{
-		int next_rows = (lst.size()-1)/(cols-1)+1;
-/*		fwprintf( stderr,
-  L"cols %d, min_tot %d, term %d, rows=%d, nextrows %d, termrows %d, diff %d\n",
-  cols,
-  min_tot_width, termsize.ws_col,
-  rows, next_rows, termsize.ws_row,
-  pref_tot_width-termsize.ws_col );
-*/
-		if( min_tot_width < termsize.ws_col &&
-		    ( ( (rows < termsize.ws_row) && (next_rows >= termsize.ws_row ) ) ||
-		      ( pref_tot_width-termsize.ws_col< 4 && cols < 3 ) ) )
-		{
-			/*
-			  Terminal almost wide enough, or squeezing makes the
-			  whole list fit on-screen.
-
-			  This part of the code is really important. People hate
-			  having to scroll through the completion list. In cases
-			  where there are a huge number of completions, it can't
-			  be helped, but it is not uncommon for the completions to
-			  _almost_ fit on one screen. In those cases, it is almost
-			  always desirable to 'squeeze' the completions into a
-			  single page. 
-
-			  If we are using N columns and can get everything to
-			  fit using squeezing, but everything would also fit
-			  using N-1 columns, don't try.
-			*/
-
-			int tot_width = min_tot_width;
-			width = min_width;
-
-			while( tot_width < termsize.ws_col )
-			{
-				for( i=0; (i<cols) && ( tot_width < termsize.ws_col ); i++ )
-				{
-					if( width[i] < pref_width[i] )
-					{
-						width[i]++;
-						tot_width++;
-					}
-				}
-			}
-			print=1;
-		}
-	}
-
-	if( print )
-	{
-		res=PAGER_DONE;
-		if( rows < termsize.ws_row )
-		{
-			/* List fits on screen. Print it and leave */
-			if( is_ca_mode )
-			{
-				is_ca_mode = 0;
-				writembs(exit_ca_mode);
-			}
-			
-			completion_print( cols, width, 0, rows, prefix, is_quoted, lst);
-			pager_flush();
-		}
-		else
-		{
-			int npos, pos = 0;
-			int do_loop = 1;
-
-			/*
-			  Enter ca_mode, which means that the terminal
-			  content will be restored to the current
-			  state on exit.
-			*/
-			if( enter_ca_mode && exit_ca_mode )
-			{
-				is_ca_mode=1;
-				writembs(enter_ca_mode);
-			}
-			
-
-			completion_print( cols,
-					  width,
-					  0,
-					  termsize.ws_row-1,
-					  prefix,
-					  is_quoted,
-					  lst);
-			/*
-			  List does not fit on screen. Print one screenfull and
-			  leave a scrollable interface
-			*/
-			while(do_loop)
-			{
-				set_color( rgb_color_t::black(), get_color(HIGHLIGHT_PAGER_PROGRESS) );
-                wcstring msg = format_string(_(L" %d to %d of %d"), pos, pos+termsize.ws_row-1, rows );
-				msg.append(L"   \r" );
-								
-				writestr(msg.c_str());
-				set_color( rgb_color_t::normal(), rgb_color_t::normal() );
-				pager_flush();
-				int c = readch();
-
-				switch( c )
-				{
-					case LINE_UP:
-					{
-						if( pos > 0 )
-						{
-							pos--;
-							writembs(tparm( cursor_address, 0, 0));
-							writembs(scroll_reverse);
-							completion_print( cols,
-									  width,
-									  pos,
-									  pos+1,
-									  prefix,
-									  is_quoted,
-									  lst );
-							writembs( tparm( cursor_address,
-									 termsize.ws_row-1, 0) );
-							writembs(clr_eol );
-
-						}
-
-						break;
-					}
-
-					case LINE_DOWN:
-					{
-						if( pos <= (rows - termsize.ws_row ) )
-						{
-							pos++;
-							completion_print( cols,
-									  width,
-									  pos+termsize.ws_row-2,
-									  pos+termsize.ws_row-1,
-									  prefix,
-									  is_quoted,
-									  lst );
-						}
-						break;
-					}
-
-					case PAGE_DOWN:
-					{
-
-						npos = mini( rows - termsize.ws_row+1,
-							     pos + termsize.ws_row-1 );
-						if( npos != pos )
-						{
-							pos = npos;
-							completion_print( cols,
-									  width,
-									  pos,
-									  pos+termsize.ws_row-1,
-									  prefix,
-									  is_quoted,
-									  lst );
-						}
-						else
-						{
-							if( flash_screen )
-								writembs( flash_screen );
-						}
-
-						break;
-					}
-
-					case PAGE_UP:
-					{
-						npos = maxi( 0,
-							     pos - termsize.ws_row+1 );
-
-						if( npos != pos )
-						{
-							pos = npos;
-							completion_print( cols,
-									  width,
-									  pos,
-									  pos+termsize.ws_row-1,
-									  prefix,
-									  is_quoted,
-									  lst );
-						}
-						else
-						{
-							if( flash_screen )
-								writembs( flash_screen );
-						}
-						break;
-					}
-
-					case R_NULL:
-					{
-						do_loop=0;
-						res=PAGER_RESIZE;
-						break;
-						
-					}
-					
-					default:
-					{
-						out_buff.push_back( c );
-						do_loop = 0;
-						break;
-					}					
-				}
-			}
-			writembs(clr_eol);
-		}
-	}
-	return res;
-}
-
-/**
-   Substitute any series of whitespace with a single space character
-   inside completion descriptions. Remove all whitespace from
-   beginning/end of completion descriptions.
-*/
-static void mangle_descriptions( wcstring_list_t &lst )
-{
-	int skip;
-	for( size_t i=0; i<lst.size(); i++ )
-	{
-        wcstring &next = lst.at(i);
-		size_t in, out;
-		skip=1;
-		
-        size_t next_idx = 0;
-		while( next_idx < next.size() && next[next_idx] != COMPLETE_SEP )
-			next_idx++;
-		
-		if( next_idx == next.size() )
-			continue;
-		
-		in=out=next_idx + 1;
-		
-		while( in < next.size() )
-		{
-			if( next[in] == L' ' || next[in]==L'\t' || next[in]<32 )
-			{
-				if( !skip )
-					next[out++]=L' ';
-				skip=1;					
-			}
-			else
-			{
-				next[out++] = next[in];					
-				skip=0;
-			}
-			in++;
-		}
-        next.resize(out);
-	}
-}
-
-/**
-   Merge multiple completions with the same description to the same line
-*/
-static void join_completions( wcstring_list_t lst )
-{
-	long i;
-    
-    std::map<wcstring, long> desc_table;
-
-	for( i=0; i<(long)lst.size(); i++ )
-	{
-		const wchar_t *item = lst.at(i).c_str();
-		const wchar_t *desc = wcschr( item, COMPLETE_SEP );
-		long prev_idx;
-		
-		if( !desc )
-			continue;
-		desc++;
-        prev_idx = desc_table[desc] - 1;
-		if( prev_idx == -1 )
-		{
-            desc_table[desc] = i+1;
-		}
-		else
-		{
-			const wchar_t *old = lst.at(i).c_str();
-			const wchar_t *old_end = wcschr( old, COMPLETE_SEP );
-			
-			if( old_end )
-			{
-				
-                wcstring foo;
-                foo.append(old, old_end - old);
-                foo.push_back(COMPLETE_ITEM_SEP);
-                foo.append(item);
-                
-                lst.at(prev_idx) = foo;
-                lst.at(i).clear();
-			}
-			
-		}
-		
-	}	
-
-    /* Remove empty strings */
-    lst.erase(remove(lst.begin(), lst.end(), wcstring()), lst.end());
-}
-
-/**
-   Replace completion strings with a comp_t structure
-*/
-static std::vector<comp_t *> mangle_completions( wcstring_list_t &lst, const wchar_t *prefix )
-{
-    std::vector<comp_t *> result;
-	for( size_t i=0; i<lst.size(); i++ )
-	{
-        wcstring &next = lst.at(i);
-		size_t start, end;
-        
-        comp_t zerod = {};
-		comp_t *comp = new comp_t(zerod);
-		
-		for( start=end=0; 1; end++ )
-		{
-			wchar_t c = next.c_str()[end];
-			
-			if( (c == COMPLETE_ITEM_SEP) || (c==COMPLETE_SEP) || !c)
-			{
-                wcstring start2 = wcstring(next, start, end - start);
-                wcstring str = escape_string(start2, ESCAPE_ALL | ESCAPE_NO_QUOTED);
-				comp->comp_width += my_wcswidth( str.c_str() );
-				comp->comp.push_back(str);
-				start = end+1;
-			}
-
-			if( c == COMPLETE_SEP )
-			{
-				comp->desc = next.c_str() + start;
-				break;
-			}	
-			
-			if( !c )
-				break;
-			
-		}
-
-		comp->comp_width  += my_wcswidth(prefix)*comp->comp.size() + 2*(comp->comp.size()-1);
-		comp->desc_width = comp->desc.empty()?0:my_wcswidth( comp->desc.c_str() );
-		
-		comp->pref_width = comp->comp_width + comp->desc_width + (comp->desc_width?4:0);
-		
-        result.push_back(comp);
-	}
-	
-	recalc_width( result, prefix );
-    return result;
-}
-
-
-
 /**
    Respond to a winch signal by checking the terminal size
 */
 static void handle_winch( int sig )
 {
-	if (ioctl(1,TIOCGWINSZ,&termsize)!=0)
-	{
-		return;
-	}
+	common_handle_winch( sig );
 }
 
 /**
@@ -1038,9 +200,8 @@ static void init( int mangle_descriptors, int out )
 	}
 	
 
-	env_universal_init( 0, 0, 0, 0);
+	env_universal_init( 0, 0, 0, 0, 0 );
 	input_common_init( &interrupt_handler );
-	output_set_writer( &pager_buffered_writer );
 
 	sigemptyset( & act.sa_mask );
 	act.sa_flags=0;
@@ -1118,51 +279,50 @@ static void destroy()
 
 /**
    Read lines of input from the specified file, unescape them and
-   insert them into the specified list.
+   insert them into the specified list. The file is read in large
+   blocks, and the lines are found and converted in place. Lines
+   without quotes or backslashes are already unescaped.
 */
 static void read_array( FILE* file, wcstring_list_t &comp )
 {
-	std::vector<char> buffer;
-	int c;
-	wchar_t *wcs;
+	const int fd = fileno( file );
+	std::string buffer;
+	char block[8192];
 
-	while( !feof( file ) )
+	while( 1 )
 	{
-		buffer.clear();
-
-		while( 1 )
+		ssize_t len = read( fd, block, sizeof block );
+		if( len == 0 )
+			break;
+		if( len < 0 )
 		{
-			c = getc( file );
-			if( c == EOF ) 
-			{
-				break;
-			}
-
-			if( c == '\n' )
-			{
-				break;
-			}
-
-            buffer.push_back(static_cast<char>(c));
+			if( errno == EINTR )
+				continue;
+			wperror( L"read" );
+			break;
 		}
+		buffer.append( block, len );
+	}
 
-		if( ! buffer.empty() )
+	const char *pos = buffer.data();
+	const char *end = pos + buffer.size();
+	while( pos < end )
+	{
+		const char *eol = static_cast<const char *>( memchr( pos, '\n', end - pos ) );
+		if( !eol )
+			eol = end;
+
+		if( eol > pos )
 		{
-            buffer.push_back(0);
-			
-			wcs = str2wcs( &buffer.at(0) );
-			if( wcs ) 
+			wcstring tmp = str2wcstring( pos, eol - pos );
+			if( tmp.find_first_of( L"\\'\"" ) == wcstring::npos || unescape_string( tmp, 0 ) )
 			{
-                wcstring tmp = wcs;
-                if (unescape_string(tmp, 0))
-                {
-                    comp.push_back(tmp);
-				}				
-				free( wcs );
+				comp.push_back( wcstring() );
+				comp.back().swap( tmp );
 			}
 		}
+		pos = eol + 1;
 	}
-
 }
 
 static int get_fd( const char *str )
@@ -1388,52 +548,20 @@ int main( int argc, char **argv )
 		
 	init( mangle_descriptors, result_fd );
 
-	mangle_descriptions( comp );
-
-	if( wcscmp( prefix, L"-" ) == 0 )
-		join_completions( comp );
-
-	std::vector<comp_t *> completions = mangle_completions( comp, prefix );
-
-	/**
-	   Try to print the completions. Start by trying to print the
-	   list in PAGER_MAX_COLS columns, if the completions won't
-	   fit, reduce the number of columns by one. Printing a single
-	   column never fails.
-	*/
-	for( i = PAGER_MAX_COLS; i>0; i-- )
+	rgb_color_t colors[PAGER_COLOR_COUNT];
+	for( i=0; i<PAGER_COLOR_COUNT; i++ )
 	{
-		switch( completion_try_print( i, prefix, is_quoted, completions ) )
-		{
-
-			case PAGER_RETRY:
-				break;
+		colors[i] = get_color( i );
+	}
 
-			case PAGER_DONE:
-				i=0;
-				break;
+	std::vector<completion_t> completions;
+	split_completions( comp, completions );
 
-			case PAGER_RESIZE:
-				/*
-				  This means we got a resize event, so we start
-				  over from the beginning. Since it the screen got
-				  bigger, we might be able to fit all completions
-				  on-screen.
-				*/
-				i=PAGER_MAX_COLS+1;
-				break;
-
-		}		
-	}
+	wcstring out_buff = pager_show( completions, prefix, colors );
 	
 	free(prefix );
 
 	fwprintf( out_file, L"%ls", out_buff.c_str() );
-	if( is_ca_mode )
-	{
-		writembs(exit_ca_mode);
-		pager_flush();
-	}
 	destroy();
 
 }
@@ -50,15 +50,23 @@
 #include "expand.h"
 #include "parser.h"
 #include "tokenizer.h"
+#include "parse_util.h"
 #include "output.h"
 #include "exec.h"
 #include "event.h"
 #include "path.h"
 #include "history.h"
+#include "input.h"
 #include "highlight.h"
 #include "iothread.h"
+#include "wildcard.h"
+#include "dir_cache.h"
 #include "postfork.h"
 #include "signal.h"
+#include "intern.h"
+#include "kill.h"
+#include "trace.h"
+#include "complete_server.h"
 /**
    The number of tests to run
  */
@@ -269,9 +277,188 @@ static void test_convert()
 		}
 		free( w );
 		free( (void *)n );
+
+	}
+
+	/* UTF-8 locales are converted without mbrtowc, so check they agree on valid and invalid sequences */
+	const wcstring saved_locale = wsetlocale( LC_CTYPE, NULL );
+	if( ! wsetlocale( LC_CTYPE, L"C.UTF-8" ).empty() )
+	{
+		const char *narrow = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x90\x9f\xff\xc0\xaf\xed\xa0\x80\xef\x84\x80";
+		const wchar_t expected[] = { L'a', 0xe9, 0x20ac, 0x1f41f, ENCODE_DIRECT_BASE + 0xff, ENCODE_DIRECT_BASE + 0xc0, ENCODE_DIRECT_BASE + 0xaf, ENCODE_DIRECT_BASE + 0xed, ENCODE_DIRECT_BASE + 0xa0, ENCODE_DIRECT_BASE + 0x80, ENCODE_DIRECT_BASE + 0xef, ENCODE_DIRECT_BASE + 0x84, ENCODE_DIRECT_BASE + 0x80, 0 };
+		if( sizeof(wchar_t) == 4 && str2wcstring( narrow ) != wcstring( expected ) )
+		{
+			err( L"Line %d - UTF-8 string decoded incorrectly", __LINE__ );
+		}
+		if( wcs2string( str2wcstring( narrow ) ) != narrow )
+		{
+			err( L"Line %d - UTF-8 conversion cycle produced a different string", __LINE__ );
+		}
+		/* Every prefix converts like a copy of it that is null terminated, without reading past its end */
+		for( size_t len = 0; len <= strlen( narrow ); len++ )
+		{
+			if( str2wcstring( narrow, len ) != str2wcstring( std::string( narrow, len ) ) )
+			{
+				err( L"Line %d - UTF-8 prefix of length %lu decoded incorrectly", __LINE__, (unsigned long)len );
+			}
+		}
+		for( i=0; i<ESCAPE_TEST_COUNT; i++ )
+		{
+			std::string o;
+			while( rand() % ESCAPE_TEST_LENGTH )
+			{
+				char c = rand();
+				if( c )
+					o.push_back( c );
+			}
+			if( wcs2string( str2wcstring( o ) ) != o )
+			{
+				err( L"Line %d - %d: UTF-8 conversion cycle of string %s produced a different string", __LINE__, i, o.c_str() );
+			}
+		}
+		wsetlocale( LC_CTYPE, saved_locale.c_str() );
+	}
+
+}
+
+/**
+   Test that fish_wcwidth, which remembers widths, agrees with wcwidth
+*/
+static void test_wcwidth()
+{
+	say( L"Testing character widths" );
+	
+	const wchar_t chars[] = { L'a', L' ', L'~', L'\t', L'\x1b', 0x7f, 0xe9, 0x300, 0x4e00, 0xff21, 0x2026 };
+	for( size_t i=0; i < sizeof chars / sizeof *chars; i++ )
+	{
+		/* Ask twice, so the second answer comes from the table */
+		for( int pass=0; pass < 2; pass++ )
+		{
+			if( fish_wcwidth( chars[i] ) != wcwidth( chars[i] ) )
+			{
+				err( L"Line %d - Width of character %d is %d, expected %d", __LINE__, (int)chars[i], fish_wcwidth( chars[i] ), wcwidth( chars[i] ) );
+			}
+		}
+	}
+	
+	if( my_wcswidth( L"abc\x1b" ) != 4 )
+	{
+		err( L"Line %d - my_wcswidth counts nonprintable characters as one column", __LINE__ );
+	}
+}
+
+static bool filecmp_less( const wcstring &a, const wcstring &b )
+{
+	return wcsfilecmp( a.c_str(), b.c_str() ) < 0;
+}
+
+/**
+   Test that sort_strings, which sorts by precomputed keys, agrees with
+   sorting by wcsfilecmp
+*/
+static void test_sort_strings()
+{
+	say( L"Testing natural string sorting" );
+	
+	const wchar_t alphabet[] = L"aAbB0123456789 ._-";
+	for( int lap=0; lap < 100; lap++ )
+	{
+		wcstring_list_t strings;
+		for( int i=0; i < 50; i++ )
+		{
+			wcstring str;
+			while( rand() % 8 )
+				str.push_back( alphabet[ rand() % (sizeof alphabet / sizeof *alphabet - 1) ] );
+			strings.push_back( str );
+		}
 		
+		wcstring_list_t expected = strings;
+		std::sort( expected.begin(), expected.end(), filecmp_less );
+		sort_strings( strings );
+		
+		/* Strings that compare equal may come out in either order, so check that each string is where one equal to it is expected */
+		for( size_t i=0; i < strings.size(); i++ )
+		{
+			if( wcsfilecmp( strings.at(i).c_str(), expected.at(i).c_str() ) != 0 )
+			{
+				err( L"Line %d - sort_strings put '%ls' where '%ls' belongs", __LINE__, strings.at(i).c_str(), expected.at(i).c_str() );
+				break;
+			}
+		}
 	}
+}
+
+/**
+   Test null_terminated_array_t, which keeps its strings in the same
+   block as the array
+*/
+static void test_null_terminated_array()
+{
+	say( L"Testing null terminated arrays" );
+
+	wcstring_list_t list;
+	list.push_back( L"echo" );
+	list.push_back( L"" );
+	list.push_back( L"some longer argument" );
+
+	null_terminated_array_t<wchar_t> arr( list );
+	null_terminated_array_t<wchar_t> copy( arr );
+	if( arr.to_list() != list || copy.to_list() != list || copy.get() == arr.get() )
+		err( L"Null terminated array does not match the list it was made from" );
+
+	null_terminated_array_t<char> narrow = convert_wide_array_to_narrow( arr );
+	if( strcmp( narrow.get()[2], "some longer argument" ) || narrow.get()[3] != NULL )
+		err( L"Null terminated array is not converted to narrow strings" );
 
+	copy.set( wcstring_list_t() );
+	if( !copy.get() || copy.get()[0] != NULL )
+		err( L"Empty null terminated array is not terminated" );
+}
+
+/**
+   Test the pool of intern'd strings
+*/
+static void test_intern()
+{
+	say( L"Testing intern'd strings" );
+
+	const wcstring long_str( 5000, L'x' );
+	const wchar_t *first = intern( L"/usr/share/fish/completions/ls.fish" );
+	const wchar_t *longer = intern( long_str.c_str() );
+	for( int i=0; i<2000; i++ )
+		intern( format_string( L"interned %d", i ).c_str() );
+
+	if( intern( wcstring( L"/usr/share/fish/completions/ls.fish" ).c_str() ) != first
+	    || wcscmp( first, L"/usr/share/fish/completions/ls.fish" ) )
+		err( L"Intern'd string is not reused" );
+	if( intern( long_str.c_str() ) != longer || long_str != longer )
+		err( L"Long intern'd string is not reused" );
+	if( wcscmp( intern( L"interned 1999" ), L"interned 1999" ) || intern( L"" )[0] != L'\0' )
+		err( L"Intern'd string has the wrong contents" );
+
+	static const wchar_t stat[] = L"a static string";
+	if( intern_static( stat ) != stat || intern( L"a static string" ) != stat )
+		err( L"Static intern'd string is copied" );
+}
+
+/**
+   Test that the kill ring keeps each string once
+*/
+static void test_kill()
+{
+	say( L"Testing the kill ring" );
+
+	kill_add( L"first kill" );
+	kill_add( L"second kill" );
+	kill_add( L"first kill" );
+	if( wcscmp( kill_yank(), L"first kill" ) )
+		err( L"Kill ring does not yank the last kill" );
+	if( wcscmp( kill_yank_rotate(), L"second kill" ) || wcscmp( kill_yank_rotate(), L"first kill" ) )
+		err( L"Kill ring keeps a duplicate of a string" );
+
+	kill_replace( L"first kill", L"first kill, longer" );
+	if( wcscmp( kill_yank(), L"first kill, longer" ) || wcscmp( kill_yank_rotate(), L"second kill" ) || wcscmp( kill_yank_rotate(), L"first kill, longer" ) )
+		err( L"Kill ring does not replace a string" );
 }
 
 /**
@@ -335,6 +522,111 @@ static void test_tok()
 						 tok_get_desc(tok_last_type( &t )) );
 			}
 		}
+		tok_destroy( &t );
+	}
+
+	{
+		const wchar_t *str = L"for i in a b (echo c)\n\techo $i >out ^&1 | cat &\nend # comment\necho 'unterminated";
+		tokenizer cached;
+		tok_cache_t cache;
+		bool jumped = false;
+
+		say( L"Test cached tokenization" );
+
+		tok_cache_build( &cache, str, 0 );
+		tok_init( &t, str, 0 );
+		tok_init_cached( &cached, str, &cache, 0 );
+		for( ;; )
+		{
+			if( tok_last_type( &cached ) == TOK_STRING &&
+				( tok_last_view( &cached ) != str + tok_get_pos( &cached ) ||
+				  ! tok_last_equals( &cached, tok_last( &t ) ) ||
+				  tok_last_length( &cached ) != wcslen( tok_last( &t ) ) ) )
+			{
+				err( L"Token at offset %d is not viewed in place", tok_get_pos( &cached ) );
+			}
+			if( tok_last_type( &t ) != tok_last_type( &cached ) ||
+				tok_get_pos( &t ) != tok_get_pos( &cached ) ||
+				tok_has_next( &t ) != tok_has_next( &cached ) ||
+				( tok_last_type( &t ) == TOK_STRING && wcscmp( tok_last( &t ), tok_last( &cached ) ) ) )
+			{
+				err( L"Cached tokenization of '%ls' differs at offset %d", str, tok_get_pos( &t ) );
+				break;
+			}
+			if( !tok_has_next( &t ) )
+				break;
+
+			/* Jump back once, like a loop block does */
+			if( !jumped && tok_get_pos( &t ) == 28 )
+			{
+				jumped = true;
+				tok_set_pos( &t, 23 );
+				tok_set_pos( &cached, 23 );
+			}
+			else
+			{
+				tok_next( &t );
+				tok_next( &cached );
+			}
+		}
+		tok_destroy( &t );
+		tok_destroy( &cached );
+	}
+
+	{
+		const wchar_t *str = L"for i in a b\n\techo $i\nend";
+
+		say( L"Test caching tokens while tokenizing" );
+
+		tok_init( &t, str, 0 );
+		tok_next( &t );
+		tok_cache_all( &t );
+		tok_set_pos( &t, 13 );
+		if( !t.cache || tok_last_type( &t ) != TOK_STRING || !tok_last_equals( &t, L"echo" ) )
+			err( L"Tokens of '%ls' are not replayed after caching them", str );
+		tok_next( &t );
+		if( t.cache_idx != 8 || !tok_last_equals( &t, L"$i" ) )
+			err( L"Tokens of '%ls' are not replayed after caching them", str );
+		tok_destroy( &t );
+	}
+
+	{
+		const int flags = TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS;
+		const wcstring str = L"echo a; ls -l # comment";
+
+		say( L"Test shared tokens" );
+
+		std::tr1::shared_ptr<const tok_cache_t> tokens = parse_util_get_tokens( str.c_str(), flags );
+		if( parse_util_get_tokens( wcstring( str ).c_str(), flags ) != tokens )
+			err( L"Tokens of '%ls' are not shared", str.c_str() );
+		if( parse_util_get_tokens( str.c_str(), TOK_SQUASH_ERRORS ) == tokens )
+			err( L"Tokens of '%ls' are shared between different flags", str.c_str() );
+		if( !tokens || tokens->tokens.size() != 7 )
+			err( L"Shared tokens of '%ls' are wrong", str.c_str() );
+	}
+
+	{
+		const wchar_t *str = L"echo a\n\nls\n";
+		const int positions[] = { 0, 6, 7, 8, 10, 11, 100 };
+		const int lines[] = { 1, 1, 2, 3, 3, 4, 4 };
+		const int starts[] = { 0, 0, 7, 8, 8, 11, 11 };
+
+		say( L"Test line numbers" );
+
+		tok_cache_t cache;
+		tok_cache_build( &cache, str, 0 );
+		tokenizer cached;
+		tok_init( &t, str, 0 );
+		tok_init_cached( &cached, str, &cache, 0 );
+		for( size_t i=0; i < sizeof positions / sizeof *positions; i++ )
+		{
+			int start = -1, cached_start = -1;
+			if( tok_get_lineno( &t, positions[i], &start ) != lines[i] || start != starts[i] ||
+				tok_get_lineno( &cached, positions[i], &cached_start ) != lines[i] || cached_start != starts[i] )
+				err( L"Offset %d of '%ls' is not on line %d", positions[i], str, lines[i] );
+		}
+		tok_destroy( &t );
+		tok_destroy( &cached );
 	}
 }
 
@@ -390,6 +682,72 @@ static void test_fork(void) {
 #undef FORK_COUNT
 }
 
+static int test_iothread_slow_handler(int *value) {
+    usleep(1000);
+    return *value;
+}
+
+static void test_iothread_completion(int *value, int result) {
+    /* Record which requests ran, and which were cancelled */
+    *value = (result == IOTHREAD_CANCELLED) ? -1 : result + 1000;
+}
+
+static void test_iothread_parallel_handler(void *context, size_t idx) {
+    static_cast<int *>(context)[idx] += 1;
+}
+
+static void test_iothread(void) {
+    say(L"Testing iothreads");
+    const int count = 32;
+    int values[count];
+    
+    /* Use a single thread so that requests pile up in the queue */
+    iothread_set_max_threads(1);
+    for (int i=0; i < count; i++) {
+        values[i] = i;
+        iothread_perform(test_iothread_slow_handler, test_iothread_completion, &values[i], IOTHREAD_PRIORITY_NORMAL, true);
+    }
+    iothread_drain_all();
+    
+    int cancelled = 0;
+    for (int i=0; i < count; i++) {
+        if (values[i] == -1) {
+            cancelled++;
+        } else if (values[i] != i + 1000) {
+            err(L"iothread request %d was not completed", i);
+        }
+    }
+    if (values[count - 1] != count - 1 + 1000) {
+        err(L"The latest iothread request was cancelled");
+    }
+    if (cancelled == 0) {
+        err(L"No superseded iothread requests were cancelled");
+    }
+    
+    /* Requests that don't supersede are never cancelled */
+    for (int i=0; i < count; i++) {
+        values[i] = i;
+        iothread_perform(test_iothread_slow_handler, test_iothread_completion, &values[i], (i % 2) ? IOTHREAD_PRIORITY_BACKGROUND : IOTHREAD_PRIORITY_INTERACTIVE);
+    }
+    iothread_drain_all();
+    for (int i=0; i < count; i++) {
+        if (values[i] != i + 1000) {
+            err(L"iothread request %d was not completed", i);
+        }
+    }
+    iothread_set_max_threads(8);
+    
+    /* Every index of a parallel batch is run exactly once, even when most of them run on other threads */
+    const size_t batch_count = 1000;
+    std::vector<int> batch_values(batch_count, 0);
+    iothread_perform_parallel(test_iothread_parallel_handler, &batch_values[0], batch_count, 10);
+    for (size_t i=0; i < batch_count; i++) {
+        if (batch_values[i] != 1) {
+            err(L"Parallel iothread index %lu was run %d times", (unsigned long)i, batch_values[i]);
+        }
+    }
+}
+
 /**
    Test the parser
 */
@@ -487,6 +845,16 @@ static void test_lru(void) {
         assert(! cache.add_node(node));
     }
     assert(cache.evicted_nodes == expected_evicted);
+    assert(cache.evictions() == 4);
+    
+    /* Looking up a node makes it the most recently used one, so it is evicted last */
+    assert(cache.get_node(L"4") != NULL);
+    assert(cache.get_node(L"0") == NULL);
+    assert(cache.hits() == 1 && cache.misses() == 1);
+    cache.add_node(new lru_node_test_t(to_string(total_nodes)));
+    assert(cache.evicted_nodes.back()->key == L"5");
+    total_nodes++;
+    
     cache.evict_all_nodes();
     assert(cache.evicted_nodes.size() == total_nodes);
     while (! cache.evicted_nodes.empty()) {
@@ -565,6 +933,159 @@ static void test_expand()
 	
 }
 
+/** Converts '*' and '?' in a string to wildcard characters */
+static wcstring make_wildcard(const wchar_t *str)
+{
+    wcstring result = str;
+    for (size_t i=0; i < result.size(); i++) {
+        if (result.at(i) == L'*')
+            result.at(i) = ANY_STRING;
+        else if (result.at(i) == L'?')
+            result.at(i) = ANY_CHAR;
+    }
+    return result;
+}
+
+/** Test wildcard matching */
+static void test_wildcard_match()
+{
+	say( L"Testing wildcard matching" );
+    
+    const struct {
+        const wchar_t *wc;
+        const wchar_t *str;
+        bool matches;
+    } tests[] = {
+        {L"", L"", true},
+        {L"", L"a", false},
+        {L"*", L"", true},
+        {L"*", L"foo", true},
+        {L"*", L".foo", false},
+        {L"?", L".", false},
+        {L".*", L".foo", true},
+        {L"foo", L"foo", true},
+        {L"foo", L"fo", false},
+        {L"f?o", L"foo", true},
+        {L"f?o", L"fooo", false},
+        {L"*.txt", L"a.txt", true},
+        {L"*.txt", L".txt", false},
+        {L"*.txt", L"a.txt.gz", false},
+        {L"a*b*c", L"abc", true},
+        {L"a*b*c", L"aXbYbZc", true},
+        {L"a*b*c", L"acb", false},
+        {L"a*?", L"a", false},
+        {L"a*?", L"ab", true},
+        {L"*a*", L"bab", true},
+        {L"ab*ab", L"ab", false},
+        {L"ab*ab", L"abab", true},
+        {L"**", L"x", true}
+    };
+    
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++) {
+        const wcstring wc = make_wildcard(tests[i].wc);
+        if (!! wildcard_match(tests[i].str, wc) != tests[i].matches) {
+            err(L"wildcard_match('%ls', '%ls') should have returned %d", tests[i].str, tests[i].wc, (int)tests[i].matches);
+        }
+        if (wildcard_matcher_t(wc).matches(tests[i].str) != tests[i].matches) {
+            err(L"wildcard_matcher_t('%ls').matches('%ls') should have returned %d", tests[i].wc, tests[i].str, (int)tests[i].matches);
+        }
+    }
+    
+    /* This took exponential time with a backtracking matcher */
+    const wcstring pathological = make_wildcard(L"*a*a*a*a*a*a*a*a*a*a*b");
+    const wcstring str(200, L'a');
+    if (wildcard_match(str, pathological) || wildcard_matcher_t(pathological).matches(str)) {
+        err(L"Pathological wildcard matched");
+    }
+}
+
+/** Test fuzzy matching */
+static void test_fuzzy_match()
+{
+	say( L"Testing fuzzy matching" );
+    
+    const struct {
+        const wchar_t *search;
+        const wchar_t *str;
+        fuzzy_match_type_t type;
+        size_t distance;
+    } tests[] = {
+        {L"", L"", FUZZY_MATCH_PREFIX, 0},
+        {L"", L"foo", FUZZY_MATCH_PREFIX, 0},
+        {L"foo", L"foobar", FUZZY_MATCH_PREFIX, 0},
+        {L"foo", L"fo", FUZZY_MATCH_NONE, 0},
+        {L"FOO", L"foobar", FUZZY_MATCH_PREFIX_NO_CASE, 0},
+        {L"bar", L"fooBAR", FUZZY_MATCH_SUBSTRING, 3},
+        {L"oba", L"foofobar", FUZZY_MATCH_SUBSTRING, 4},
+        {L"gco", L"git-checkout", FUZZY_MATCH_SUBSEQUENCE, 7},
+        {L"gco", L"gcc-objc", FUZZY_MATCH_SUBSEQUENCE, 2},
+        {L"gco", L"ogc", FUZZY_MATCH_NONE, 0}
+    };
+    
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++) {
+        const fuzzy_match_t match = fuzzy_matcher_t(tests[i].search).match(tests[i].str);
+        if (match.type != tests[i].type || (match.type != FUZZY_MATCH_NONE && match.distance != tests[i].distance)) {
+            err(L"Matching '%ls' against '%ls' gave type %d and distance %lu", tests[i].search, tests[i].str, (int)match.type, (unsigned long)match.distance);
+        }
+    }
+    
+    fuzzy_match_t better = {FUZZY_MATCH_SUBSTRING, 5}, worse = {FUZZY_MATCH_SUBSEQUENCE, 0};
+    if (! (better < worse) || worse < better) {
+        err(L"Fuzzy matches are ordered wrong");
+    }
+}
+
+/** Test that snapshots of variables are shared until a variable changes */
+static void test_env_vars()
+{
+    say( L"Testing variable snapshots" );
+    
+    env_set(L"CDPATH", L"/snapshot/one", ENV_GLOBAL);
+    const env_vars first(env_vars::highlighting_keys), second(env_vars::highlighting_keys);
+    if (first.get(L"CDPATH") != second.get(L"CDPATH") || wcscmp(first.get(L"CDPATH"), L"/snapshot/one")) {
+        err(L"Snapshots of unchanged variables are not shared");
+    }
+    
+    env_set(L"CDPATH", L"/snapshot/two", ENV_GLOBAL);
+    const env_vars third(env_vars::highlighting_keys);
+    if (wcscmp(first.get(L"CDPATH"), L"/snapshot/one") || wcscmp(third.get(L"CDPATH"), L"/snapshot/two")) {
+        err(L"Snapshot does not keep its values after a variable changes");
+    }
+    
+    env_remove(L"CDPATH", ENV_GLOBAL);
+    if (env_vars(env_vars::highlighting_keys).get(L"CDPATH") != NULL || env_vars().get(L"PATH") != NULL) {
+        err(L"Snapshot has a variable that does not exist");
+    }
+}
+
+/** Test that variable names are found by prefix, ignoring case */
+static void test_env_names_with_prefix()
+{
+    say( L"Testing variable names by prefix" );
+    
+    env_set(L"fish_test_prefix_a", L"1", ENV_GLOBAL);
+    env_set(L"FISH_TEST_PREFIX_B", L"1", ENV_GLOBAL);
+    env_set(L"fish_test_prefiy", L"1", ENV_GLOBAL);
+    env_push(true);
+    env_set(L"fish_test_prefix_c", L"1", ENV_LOCAL);
+    env_set(L"fish_test_prefix_a", L"2", ENV_LOCAL);
+    
+    wcstring_list_t names = env_get_names_with_prefix(L"Fish_Test_Prefix");
+    if (names.size() != 3 || names.at(0) != L"FISH_TEST_PREFIX_B" || names.at(1) != L"fish_test_prefix_a" || names.at(2) != L"fish_test_prefix_c") {
+        err(L"Wrong variable names for a prefix");
+    }
+    
+    env_pop();
+    env_remove(L"FISH_TEST_PREFIX_B", ENV_GLOBAL);
+    names = env_get_names_with_prefix(L"fish_test_prefix");
+    if (names.size() != 1 || names.at(0) != L"fish_test_prefix_a") {
+        err(L"Removed or popped variables are found by prefix");
+    }
+    
+    env_remove(L"fish_test_prefix_a", ENV_GLOBAL);
+    env_remove(L"fish_test_prefiy", ENV_GLOBAL);
+}
+
 /** Test path functions */
 static void test_path()
 {
@@ -584,6 +1105,148 @@ static void test_path()
     {
 		err( L"Bug in canonical PATH code" );
     }
+
+    if (system("rm -Rf /tmp/fish_command_index_test/")) err(L"rm failed");
+    if (system("mkdir -p /tmp/fish_command_index_test/one/ /tmp/fish_command_index_test/two/")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_command_index_test/one/Alpha /tmp/fish_command_index_test/one/beta /tmp/fish_command_index_test/two/alpine")) err(L"touch failed");
+
+    const wcstring path_var = L"/tmp/fish_command_index_test/one" ARRAY_SEP_STR L"/tmp/fish_command_index_test/two/";
+    std::vector<dir_file_t> files;
+    path_find_commands(L"al", path_var, files);
+    if (files.size() != 2 ||
+        files.at(0).dir != L"/tmp/fish_command_index_test/one/" || files.at(0).entry.name != L"Alpha" ||
+        files.at(1).dir != L"/tmp/fish_command_index_test/two/" || files.at(1).entry.name != L"alpine")
+    {
+        err(L"Command index returned the wrong files");
+    }
+
+    if (system("touch /tmp/fish_command_index_test/two/alto")) err(L"touch failed");
+    files.clear();
+    path_find_commands(L"al", path_var, files);
+    if (files.size() != 3 || files.at(2).entry.name != L"alto")
+    {
+        err(L"Command index was not updated when a directory changed");
+    }
+    if (system("rm -Rf /tmp/fish_command_index_test/")) err(L"rm failed");
+
+    /* Lookups in CDPATH find directories created and removed since the last lookup, and follow changes of CDPATH */
+    if (system("mkdir -p /tmp/fish_cdpath_test/one/proj /tmp/fish_cdpath_test/two/")) err(L"mkdir failed");
+    /* Directories modified a moment ago are not cached, so pretend these are old */
+    if (system("touch -t 200001010000 /tmp/fish_cdpath_test/one /tmp/fish_cdpath_test/two")) err(L"touch failed");
+    env_set(L"CDPATH", L"/tmp/fish_cdpath_test/one" ARRAY_SEP_STR L"/tmp/fish_cdpath_test/two", ENV_GLOBAL);
+    const wchar_t * const wd = L"/tmp/fish_cdpath_test/";
+    for (int i=0; i < 2; i++)
+    {
+        wchar_t *found = path_allocate_cdpath(L"proj/", wd);
+        if (! found || wcscmp(found, L"/tmp/fish_cdpath_test/one/proj/"))
+            err(L"CDPATH lookup found '%ls' instead of the directory", found ? found : L"nothing");
+        free(found);
+        if (path_can_get_cdpath(L"other", wd) || errno != ENOENT)
+            err(L"CDPATH lookup found a directory that does not exist");
+    }
+
+    if (system("mkdir /tmp/fish_cdpath_test/two/other && rmdir /tmp/fish_cdpath_test/one/proj")) err(L"mkdir failed");
+    /* Modification times are checked once a second */
+    const time_t changed = time(NULL);
+    while (time(NULL) == changed)
+        usleep(10000);
+    if (! path_can_get_cdpath(L"other", wd) || path_can_get_cdpath(L"proj/", wd))
+        err(L"CDPATH lookup was not updated when a directory changed");
+
+    env_set(L"CDPATH", L"/tmp/fish_cdpath_test/one", ENV_GLOBAL);
+    if (path_can_get_cdpath(L"other", wd))
+        err(L"CDPATH lookup was not updated when CDPATH changed");
+    env_remove(L"CDPATH", ENV_GLOBAL);
+    if (system("rm -Rf /tmp/fish_cdpath_test/")) err(L"rm failed");
+}
+
+/** Test that listing the files that can be autoloaded follows changes to the directories */
+static void test_autoload_names()
+{
+	say( L"Testing autoload listings" );
+
+    if (system("rm -Rf /tmp/fish_autoload_test/")) err(L"rm failed");
+    if (system("mkdir -p /tmp/fish_autoload_test/one /tmp/fish_autoload_test/two")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_autoload_test/one/foo.fish /tmp/fish_autoload_test/one/_hidden.fish /tmp/fish_autoload_test/two/bar.fish /tmp/fish_autoload_test/two/README")) err(L"touch failed");
+    env_set(L"fish_test_autoload_path", L"/tmp/fish_autoload_test/one" ARRAY_SEP_STR L"/tmp/fish_autoload_test/two" ARRAY_SEP_STR L"/tmp/fish_autoload_test/missing", ENV_GLOBAL);
+
+    autoload_t loader(L"fish_test_autoload_path", NULL, 0);
+    std::set<wcstring> names;
+    loader.get_names(names, false);
+    if (names.size() != 2 || ! names.count(L"foo") || ! names.count(L"bar"))
+        err(L"Autoload listing found %lu names instead of foo and bar", names.size());
+
+    names.clear();
+    loader.get_names(names, true);
+    if (names.size() != 3 || ! names.count(L"_hidden"))
+        err(L"Autoload listing did not find the hidden name");
+
+    if (system("touch /tmp/fish_autoload_test/two/baz.fish && rm /tmp/fish_autoload_test/one/foo.fish")) err(L"touch failed");
+    names.clear();
+    loader.get_names(names, false);
+    if (names.size() != 2 || ! names.count(L"bar") || ! names.count(L"baz"))
+        err(L"Autoload listing was not updated when a directory changed");
+
+    env_remove(L"fish_test_autoload_path", ENV_GLOBAL);
+    if (system("rm -Rf /tmp/fish_autoload_test/")) err(L"rm failed");
+}
+
+/** Test the counters of system calls */
+static void test_syscall_counts()
+{
+	say( L"Testing system call counters" );
+
+	const syscall_counts_t before = syscall_counts();
+	struct stat buf;
+	wstat( L"/", &buf );
+	lwstat( L"/", &buf );
+	waccess( L"/", F_OK );
+	DIR *dir = wopendir( L"/" );
+	if( dir )
+		closedir( dir );
+	int fds[2];
+	if( exec_pipe( fds ) == 0 )
+	{
+		close( fds[0] );
+		close( fds[1] );
+	}
+	const syscall_counts_t counts = syscall_counts() - before;
+
+	if( counts.count[SYSCALL_STAT] != 2 || counts.count[SYSCALL_ACCESS] != 1 ||
+		counts.count[SYSCALL_OPENDIR] != 1 || counts.count[SYSCALL_PIPE] != 1 ||
+		counts.count[SYSCALL_FORK] != 0 || counts.count[SYSCALL_EXEC] != 0 )
+	{
+		err( L"System calls were counted wrong: %lu stat, %lu access, %lu opendir, %lu pipe",
+			 counts.count[SYSCALL_STAT], counts.count[SYSCALL_ACCESS],
+			 counts.count[SYSCALL_OPENDIR], counts.count[SYSCALL_PIPE] );
+	}
+}
+
+/**
+   Test the ring buffers of the trace points
+*/
+static void test_trace()
+{
+	say( L"Testing trace points" );
+
+	trace_reset();
+	for( int i=0; i<TRACE_BUFFER_SIZE + 10; i++ )
+	{
+		trace_add( i < 10 ? "test_trace_old" : "test_trace_new", i, 1 );
+	}
+
+	wcstring json;
+	trace_write_json( json );
+	if( json.find( L"test_trace_old" ) != wcstring::npos )
+		err( L"Overwritten trace events were written" );
+	if( json.find( L"\"ts\":10," ) == wcstring::npos || json.find( L"\"ts\":9," ) != wcstring::npos )
+		err( L"The oldest trace event that was kept is missing" );
+
+	trace_reset();
+	json.clear();
+	trace_write_json( json );
+	if( json.find( L"test_trace_new" ) != wcstring::npos )
+		err( L"Trace events were written after a reset" );
 }
 
 /** Test is_potential_path */
@@ -624,6 +1287,24 @@ static void test_is_potential_path()
     assert(! is_potential_path(L"/tmp/is_potential_path_test/ar", wds, false, &tmp));
     
     assert(is_potential_path(L"/usr", wds, true, &tmp) && tmp == L"/usr/");
+    
+    /* Once the token goes stale, we give up */
+    volatile unsigned int generation = 0;
+    const generation_token_t token(generation);
+    assert(is_potential_path(L"al", wds, true, &tmp, token));
+    generation++;
+    assert(token.is_stale());
+    assert(! is_potential_path(L"al", wds, true, &tmp, token));
+    
+    /* Directory listings are cached, but files that are added later must still be found. The listing includes . and .. */
+    assert(! is_potential_path(L"de", wds, false, &tmp));
+    if (system("touch /tmp/is_potential_path_test/delta")) err(L"touch failed");
+    assert(is_potential_path(L"de", wds, false, &tmp) && tmp == L"delta");
+    
+    dir_listing_ref_t listing;
+    if (! dir_cache_get_listing(wd, &listing) || listing->size() != 7) {
+        err(L"Wrong directory listing for %ls", wd.c_str());
+    }
 
 }
 
@@ -708,6 +1389,14 @@ static void test_test() {
     /* We didn't properly handle multiple "just strings" either */
     assert(run_test_test(0, L"foo"));
     assert(run_test_test(0, L"foo -a bar"));
+    
+    /* Expressions are reused for arguments of the same shape, which must not reuse their values */
+    assert(run_test_test(0, L"3 -lt 4"));
+    assert(run_test_test(1, L"4 -lt 3"));
+    assert(run_test_test(0, L"-n 5 -a 3 -lt 4"));
+    assert(run_test_test(1, L"-n 5 -a 4 -lt 3"));
+    assert(run_test_test(0, L"-lt = -lt"));
+    assert(run_test_test(1, L"= = -lt"));
 }
 
 /** Testing colors */
@@ -733,6 +1422,240 @@ static void test_autosuggest() {
 }
 
 
+/** Returns how often the condition of test_complete_conditions has been tested */
+static size_t condition_test_count()
+{
+    wcstring_list_t runs;
+    env_var_t val = env_get_string( L"cond_test_runs" );
+    if( ! val.missing() )
+        tokenize_variable_array( val, runs );
+    return runs.size();
+}
+
+/**
+   Test that completion conditions are kept between completions of the
+   same command line, and only then
+*/
+static void test_complete_conditions()
+{
+    say( L"Testing completion conditions" );
+
+    parser_t &parser = parser_t::principal_parser();
+    std::vector<completion_t> comps;
+
+    complete_forget_conditions();
+    parser.eval( L"set -e cond_test_runs", 0, TOP );
+    complete_add( L"cond_test_cmd", false, 0, L"cond-test", 0, 0, L"set -g cond_test_runs $cond_test_runs x", 0, 0, 0 );
+
+    complete( L"cond_test_cmd --cond", comps, COMPLETE_DEFAULT );
+    complete( L"cond_test_cmd --cond-", comps, COMPLETE_DEFAULT );
+    if( condition_test_count() != 1 )
+        err( L"Condition was tested %lu times for the same command line", condition_test_count() );
+
+    complete( L"cond_test_cmd foo --cond", comps, COMPLETE_DEFAULT );
+    if( condition_test_count() != 2 )
+        err( L"Condition was not tested again for a different command line" );
+
+    complete_forget_conditions();
+    complete( L"cond_test_cmd foo --cond", comps, COMPLETE_DEFAULT );
+    if( condition_test_count() != 3 )
+        err( L"Condition was not tested again after forgetting conditions" );
+
+    complete_remove( L"cond_test_cmd", false, 0, 0 );
+    parser.eval( L"set -e cond_test_runs", 0, TOP );
+}
+
+/** Returns whether comps contains the completion str */
+static bool has_completion( const std::vector<completion_t> &comps, const wcstring &str )
+{
+    for (size_t i=0; i < comps.size(); i++)
+    {
+        if( comps.at(i).completion == str )
+            return true;
+    }
+    return false;
+}
+
+/**
+   Test that options are found by their short and long options, and no
+   longer after they are removed
+*/
+static void test_complete_options()
+{
+    say( L"Testing completion options" );
+
+    std::vector<completion_t> comps;
+    wcstring_list_t errors;
+
+    complete_add( L"opt_test_cmd", false, L'a', L"alpha", 0, 0, 0, 0, 0, 0 );
+    complete_add( L"opt_test_cmd", false, L'b', L"Alpha-two", 0, NO_COMMON, 0, L"x y", 0, 0 );
+    complete_add( L"opt_test_cmd", false, 0, L"old", 1, 0, 0, 0, 0, 0 );
+    complete_add( L"opt_test_cmd", false, 0, 0, 0, NO_FILES, 0, L"arg", 0, 0 );
+
+    complete( L"opt_test_cmd --al", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"pha" ) || ! has_completion( comps, L"--Alpha-two" ) || comps.size() != 2 )
+        err( L"Long options were not completed by prefix, ignoring case" );
+
+    comps.clear();
+    complete( L"opt_test_cmd -a", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"b" ) || has_completion( comps, L"a" ) )
+        err( L"Short options were not completed after another one" );
+
+    comps.clear();
+    complete( L"opt_test_cmd -b ", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"x" ) || ! has_completion( comps, L"y" ) || has_completion( comps, L"arg" ) )
+        err( L"The arguments of a short option were not completed" );
+
+    comps.clear();
+    complete( L"opt_test_cmd --Alpha-two=", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"x" ) )
+        err( L"The arguments of a long option were not completed" );
+
+    if( ! complete_is_valid_option( L"opt_test_cmd", L"-a", &errors, false ) ||
+        ! complete_is_valid_option( L"opt_test_cmd", L"--alpha", &errors, false ) ||
+        ! complete_is_valid_option( L"opt_test_cmd", L"-old", &errors, false ) ||
+        complete_is_valid_option( L"opt_test_cmd", L"-z", &errors, false ) )
+        err( L"Options were not validated by their short and long options" );
+
+    complete_remove( L"opt_test_cmd", false, L'a', 0 );
+    if( complete_is_valid_option( L"opt_test_cmd", L"-a", &errors, false ) )
+        err( L"A removed short option is still valid" );
+
+    complete_remove( L"opt_test_cmd", false, 0, 0 );
+
+    /* Entries for a wildcard apply to every command it matches, together with the entry of the command */
+    const wcstring pattern = wcstring(L"opt_test_") + (wchar_t)ANY_STRING;
+    complete_add( pattern.c_str(), false, 0, L"pattern", 0, 0, 0, 0, 0, 0 );
+    complete_add( L"opt_test_cmd", false, 0, L"exact", 0, 0, 0, 0, 0, 0 );
+    comps.clear();
+    complete( L"opt_test_cmd --", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"pattern" ) || ! has_completion( comps, L"exact" ) )
+        err( L"Entries for a wildcard and the command were not both used" );
+
+    complete_remove( pattern.c_str(), false, 0, 0 );
+    comps.clear();
+    complete( L"opt_test_cmd --", comps, COMPLETE_DEFAULT );
+    if( has_completion( comps, L"pattern" ) )
+        err( L"A removed entry for a wildcard was still used" );
+    complete_remove( L"opt_test_cmd", false, 0, 0 );
+}
+
+static bool complete_stop_always()
+{
+    return true;
+}
+
+/**
+   Test that completing in parts, as the reader does to expand files on
+   a background thread, finds the same completions as complete()
+*/
+static void test_complete_background()
+{
+    say( L"Testing completion in the background" );
+
+    if (system("rm -Rf /tmp/fish_bg_complete_test/")) err(L"rm failed");
+    if (system("mkdir -p /tmp/fish_bg_complete_test/")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_bg_complete_test/abc /tmp/fish_bg_complete_test/abd /tmp/fish_bg_complete_test/xyz")) err(L"touch failed");
+    if (system("chmod +x /tmp/fish_bg_complete_test/abc")) err(L"chmod failed");
+
+    const wchar_t * const lines[] =
+    {
+        L"ls /tmp/fish_bg_complete_test/a",
+        L"/tmp/fish_bg_complete_test/a",
+        L"echo",
+        L"set -"
+    };
+
+    for (size_t i=0; i < sizeof lines / sizeof *lines; i++)
+    {
+        std::vector<completion_t> expected, found;
+        complete( lines[i], expected, COMPLETE_DEFAULT );
+
+        completer_t *completer = complete_begin( lines[i], NULL );
+        if( ! completer )
+        {
+            err( L"Completing '%ls' in the background was abandoned", lines[i] );
+            continue;
+        }
+        complete_background( completer );
+        complete_finish( completer, found );
+
+        if( expected.empty() || found != expected )
+            err( L"Completing '%ls' in the background found %lu completions instead of %lu", lines[i], (unsigned long)found.size(), (unsigned long)expected.size() );
+    }
+
+    /* Stopping abandons the completion before testing conditions */
+    parser_t &parser = parser_t::principal_parser();
+    complete_forget_conditions();
+    parser.eval( L"set -e cond_test_runs", 0, TOP );
+    complete_add( L"cond_test_cmd", false, 0, L"cond-test", 0, 0, L"set -g cond_test_runs $cond_test_runs x", 0, 0, 0 );
+    if( complete_begin( L"cond_test_cmd --cond", &complete_stop_always ) )
+        err( L"Stopped completion was not abandoned" );
+    if( condition_test_count() != 0 )
+        err( L"Stopped completion tested a condition" );
+    complete_remove( L"cond_test_cmd", false, 0, 0 );
+
+    /* Prewarmed files are used once, and not after they are forgotten */
+    std::vector<completion_t> comps;
+    complete_prewarm( L"ls /tmp/fish_bg_complete_test/a" );
+    iothread_drain_all();
+    if (system("touch /tmp/fish_bg_complete_test/abe")) err(L"touch failed");
+    complete( L"ls /tmp/fish_bg_complete_test/a", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"bc" ) || has_completion( comps, L"be" ) )
+        err( L"Prewarmed files were not used" );
+
+    comps.clear();
+    complete( L"ls /tmp/fish_bg_complete_test/a", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"be" ) )
+        err( L"Prewarmed files were used twice" );
+
+    complete_prewarm( L"ls /tmp/fish_bg_complete_test/x" );
+    iothread_drain_all();
+    complete_forget_prewarmed();
+    if (system("touch /tmp/fish_bg_complete_test/xyw")) err(L"touch failed");
+    comps.clear();
+    complete( L"ls /tmp/fish_bg_complete_test/x", comps, COMPLETE_DEFAULT );
+    if( ! has_completion( comps, L"yw" ) )
+        err( L"Forgotten prewarmed files were used" );
+
+    if (system("rm -Rf /tmp/fish_bg_complete_test/")) err(L"rm failed");
+}
+
+/**
+   Test the requests that fish --complete-server answers
+*/
+static void test_complete_server()
+{
+    say( L"Testing the completion server" );
+
+    wcstring reply;
+    complete_add( L"server_test_cmd", false, 0, L"alpha", 0, 0, 0, 0, L"first\\letter", 0 );
+    if( ! complete_server_handle_request( L"complete server_test_cmd --al", reply ) || reply != L"--alpha\tfirst\\\\letter\n\n" )
+        err( L"Wrong answer to a complete request: '%ls'", reply.c_str() );
+    complete_remove( L"server_test_cmd", false, 0, 0 );
+
+    reply.clear();
+    complete_server_handle_request( L"highlight echo hi\\nls", reply );
+    if( reply.find( L"0 4 command\n" ) != 0 || reply.find( L"\n8 2 command\n" ) == wcstring::npos || reply.find( L"\n\n" ) != reply.size() - 2 )
+        err( L"Wrong answer to a highlight request: '%ls'", reply.c_str() );
+
+    const env_var_t old_pwd = env_get_string( L"PWD" );
+    reply.clear();
+    complete_server_handle_request( L"cd /", reply );
+    if( reply != L"\n" || env_get_string( L"PWD" ) != L"/" )
+        err( L"Wrong answer to a cd request: '%ls'", reply.c_str() );
+    if( ! old_pwd.missing() && ( wchdir( old_pwd ) || ! env_set_pwd() ) )
+        err( L"Could not change back to '%ls'", old_pwd.c_str() );
+
+    reply.clear();
+    complete_server_handle_request( L"frobnicate", reply );
+    if( reply.find( L"error " ) != 0 )
+        err( L"Unknown requests were not answered with an error" );
+
+    if( complete_server_handle_request( L"quit", reply ) )
+        err( L"The quit request did not stop the server" );
+}
+
 /**
    Test speed of completion calculations
 */
@@ -799,6 +1722,59 @@ void perf_complete()
 	
 }
 
+/**
+   Push the specified string as input, followed by a character that no
+   mapping uses, so that reading never has to wait for more
+*/
+static void test_input_push( const wchar_t *str )
+{
+    input_unreadch( L'#' );
+    for( size_t i=wcslen( str ); i>0; i-- )
+        input_unreadch( str[i-1] );
+}
+
+static void test_input()
+{
+    say( L"Testing key bindings" );
+
+    input_mapping_add( L"", L"self-insert" );
+    input_mapping_add( L"qwe", L"down-line" );
+    input_mapping_add( L"qw", L"up-line" );
+    input_mapping_add( L"asd", L"repaint" );
+
+    test_input_push( L"qwe" );
+    if( input_readch() != R_DOWN_LINE )
+        err( L"Longer binding added first was not used" );
+    if( input_readch() != L'#' )
+        err( L"Input after a binding was lost" );
+
+    test_input_push( L"qwx" );
+    if( input_readch() != R_UP_LINE || input_readch() != L'x' )
+        err( L"Binding that is a prefix of another one was not used" );
+    input_readch();
+
+    test_input_push( L"asx" );
+    if( input_readch() != L'a' || input_readch() != L's' || input_readch() != L'x' )
+        err( L"Partly matching input was not returned unchanged" );
+    input_readch();
+
+    input_mapping_erase( L"qwe" );
+    test_input_push( L"qwe" );
+    if( input_readch() != R_UP_LINE || input_readch() != L'e' )
+        err( L"Erased binding was still used" );
+    input_readch();
+
+    input_mapping_add( L"qw", L"repaint" );
+    test_input_push( L"qw" );
+    if( input_readch() != R_REPAINT )
+        err( L"Changed binding was not used" );
+    input_readch();
+
+    input_mapping_erase( L"" );
+    input_mapping_erase( L"qw" );
+    input_mapping_erase( L"asd" );
+}
+
 static void test_history_matches(history_search_t &search, size_t matches) {
     size_t i;
     for (i=0; i < matches; i++) {
@@ -833,6 +1809,7 @@ class history_tests_t {
 public:
     static void test_history(void);
     static void test_history_merge(void);
+    static void test_history_formats(void);
 };
 
 static wcstring random_string(void) {
@@ -864,6 +1841,19 @@ void history_tests_t::test_history(void) {
     test_history_matches(search2, 1);
     assert(search2.current_string() == L"Beta");
 
+    /* Skipping the newest item leaves two matches, starting with the second item */
+    history_search_t search_resumed(history, L"a");
+    search_resumed.skip_items_through(1);
+    assert(search_resumed.go_backwards());
+    assert(search_resumed.current_string() == L"Beta" && search_resumed.current_index() == 2);
+    search_resumed.go_to_end();
+    test_history_matches(search_resumed, 2);
+
+    /* Only one item has an "m" followed by an "a" */
+    history_search_t search_fuzzy(history, L"MA", HISTORY_SEARCH_TYPE_FUZZY);
+    test_history_matches(search_fuzzy, 1);
+    assert(search_fuzzy.current_string() == L"Gamma");
+
     /* Test item removal */
     history.remove(L"Alpha");
     history_search_t search3(history, L"Alpha");
@@ -886,7 +1876,7 @@ void history_tests_t::test_history(void) {
         path_list_t paths;        
         size_t count = rand() % 6;
         while (count--) {
-            paths.push_front(random_string());
+            paths.push_back(random_string());
         }
         
         /* Record this item */
@@ -896,6 +1886,10 @@ void history_tests_t::test_history(void) {
     }
     history.save();
     
+    /* The size counts the saved items, and is the last valid index */
+    assert(history.size() == 100);
+    assert(history.item_at_index(101).empty());
+    
     /* Read items back in reverse order and ensure they're the same */
     for (i=100; i >= 1; i--) {
         history_item_t item = history.item_at_index(i);
@@ -966,6 +1960,15 @@ void history_tests_t::test_history_merge(void) {
     for (size_t i=0; i < count; i++) {
         assert(history_contains(everything, texts[i]));
     }
+    
+    /* Its items are all old, so searches go through the trigram index */
+    history_search_t search1(*everything, L"History");
+    test_history_matches(search1, count);
+    history_search_t search2(*everything, L"story 2");
+    test_history_matches(search2, 1);
+    assert(search2.current_string() == texts[1]);
+    history_search_t search3(*everything, L"History 4");
+    test_history_matches(search3, 0);
 
     /* Clean up */
     for (size_t i=0; i < 3; i++) {
@@ -975,6 +1978,58 @@ void history_tests_t::test_history_merge(void) {
     delete everything; //not as scary as it looks
 }
 
+void history_tests_t::test_history_formats(void) {
+    say( L"Testing history formats");
+    const wcstring name = L"format_test";
+    history_t *hist = new history_t(name);
+    hist->clear();
+    delete hist;
+    
+    /* Write a history file in the old YAML format */
+    wcstring path;
+    if (! path_get_config(path)) {
+        err( L"No config directory for the history file" );
+        return;
+    }
+    path.append(L"/format_test_history");
+    FILE *f = wfopen(path, "w");
+    fputs("- cmd: echo yaml\\\\\n   when: 1000\n   paths:\n    - /tmp\n", f);
+    fclose(f);
+    
+    /* It can be read, and is converted to the binary format when saving */
+    time_barrier();
+    hist = new history_t(name);
+    history_item_t item = hist->item_at_index(1);
+    assert(item.str() == L"echo yaml\\");
+    assert(item.timestamp() == 1000);
+    assert(item.get_required_paths() == path_list_t(1, L"/tmp"));
+    hist->add(L"echo binary");
+    hist->save();
+    delete hist;
+    
+    /* Saving again appends to the binary file */
+    time_barrier();
+    hist = new history_t(name);
+    assert(history_contains(hist, L"echo yaml\\"));
+    assert(history_contains(hist, L"echo binary"));
+    if (hist->mmap_type != history_type_binary)
+        err( L"History was not converted to the binary format" );
+    hist->add(L"echo appended 1");
+    hist->save();
+    hist->add(L"echo appended 2");
+    hist->save();
+    delete hist;
+    
+    time_barrier();
+    hist = new history_t(name);
+    assert(history_contains(hist, L"echo binary"));
+    assert(history_contains(hist, L"echo appended 1"));
+    assert(history_contains(hist, L"echo appended 2"));
+    assert(hist->item_at_index(1).str() == L"echo appended 2");
+    hist->clear();
+    delete hist;
+}
+
 
 /**
    Main test 
@@ -1001,18 +2056,37 @@ int main( int argc, char **argv )
     test_format();
 	test_escape();
 	test_convert();
+	test_wcwidth();
+	test_sort_strings();
+	test_null_terminated_array();
+	test_intern();
+	test_kill();
 	test_tok();
     test_fork();
+    test_iothread();
 	test_parser();
 	test_lru();
 	test_expand();
+	test_wildcard_match();
+	test_fuzzy_match();
     test_test();
+	test_env_vars();
+	test_env_names_with_prefix();
 	test_path();
+	test_autoload_names();
+	test_syscall_counts();
+	test_trace();
     test_is_potential_path();
     test_colors();
     test_autosuggest();
+    test_complete_conditions();
+    test_complete_options();
+    test_complete_background();
+    test_complete_server();
+    test_input();
     history_tests_t::test_history();
     history_tests_t::test_history_merge();
+    history_tests_t::test_history_formats();
 	
 	say( L"Encountered %d errors in low-level tests", err_count );
 
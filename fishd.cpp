@@ -39,6 +39,21 @@ used to synchronize clients, since once the reply for a barrier
 message returns, the sender can know that any updates available at the
 time the original barrier request was sent have been received.
 
+\section fishd-generation Generation file
+
+fishd also keeps a counter of changes in the file fishd.generation.USER
+next to its socket, which clients map into memory. A client that has
+nothing to send and sees the same count as when it started its last
+barrier knows that no variables have changed since then, and skips the
+barrier.
+
+\section fishd-save Save file
+
+The save file ~/.config/fish/fishd.HOSTNAME holds the commands that
+recreate all variables. Changes are appended to it as \c set and \c
+erase commands, and once enough of them have piled up, or when fishd
+exits, the file is rewritten from scratch.
+
 */
 
 #include "config.h"
@@ -55,6 +70,25 @@ time the original barrier request was sent have been received.
 #include <sys/un.h>
 #include <pwd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <tr1/unordered_map>
+#include <vector>
+
+#if defined( HAVE_SYS_EPOLL_H ) && defined( HAVE_EPOLL_CREATE )
+#define FISHD_USE_EPOLL 1
+#include <sys/epoll.h>
+#elif defined( HAVE_SYS_EVENT_H ) && defined( HAVE_KQUEUE )
+#define FISHD_USE_KQUEUE 1
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#include <sys/time.h>
+#include <set>
+#endif
 
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
@@ -108,16 +142,6 @@ time the original barrier request was sent have been received.
 */
 #define SAVE_MSG "# This file is automatically generated by the fishd universal variable daemon.\n# Do NOT edit it directly, your changes will be overwritten.\n"
 
-/**
-   The name of the save file. The hostname is appended to this.
-*/
-#define FILE "fishd."
-
-/**
-   Maximum length of hostname. Longer hostnames are truncated
-*/
-#define HOSTNAME_LEN 32
-
 /**
    The string to append to the socket name to name the lockfile
 */
@@ -149,9 +173,298 @@ static int sock;
 static int quit=0;
 
 /**
-   Constructs the fish socket filename
+   The maximum number of readiness events handled per round of the main loop
 */
-static char *get_socket_filename()
+#define POLL_EVENT_MAX 64
+
+/**
+   A file descriptor that the main loop watches
+*/
+struct watched_fd_t
+{
+	/** The connection on the file descriptor, or 0 for the listening socket */
+	connection_t *c;
+
+	/** Whether the file descriptor is watched for writing as well as reading */
+	bool want_write;
+};
+
+typedef std::tr1::unordered_map<int, watched_fd_t> watched_fd_map_t;
+
+/**
+   The file descriptors that the main loop watches
+*/
+static watched_fd_map_t watched_fds;
+
+/**
+   A file descriptor that is ready
+*/
+struct ready_fd_t
+{
+	int fd;
+	bool readable;
+	bool writable;
+};
+
+/**
+   Set when a change has been queued for every client, so that the
+   main loop flushes all of them rather than only the ones it heard
+   from
+*/
+static bool broadcast_pending = false;
+
+/*
+  The readiness backend. The main loop only hears about the file
+  descriptors that are ready, so that a round costs the same however
+  many clients are connected. epoll and kqueue are used where they
+  exist, with select as the fallback. All of them are level
+  triggered, and a connection is only watched for writing while it
+  has messages that could not be sent right away.
+*/
+
+#if defined( FISHD_USE_EPOLL )
+
+static int poll_fd = -1;
+
+static void poller_init()
+{
+	poll_fd = epoll_create( POLL_EVENT_MAX );
+	if( poll_fd == -1 )
+	{
+		wperror( L"epoll_create" );
+		exit(1);
+	}
+	fcntl( poll_fd, F_SETFD, FD_CLOEXEC );
+}
+
+static bool poller_update( int fd, int op, bool want_write )
+{
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN | ( want_write ? EPOLLOUT : 0 );
+	event.data.fd = fd;
+	if( epoll_ctl( poll_fd, op, fd, &event ) )
+	{
+		wperror( L"epoll_ctl" );
+		return false;
+	}
+	return true;
+}
+
+static bool poller_add( int fd )
+{
+	return poller_update( fd, EPOLL_CTL_ADD, false );
+}
+
+static void poller_set_write( int fd, bool want_write )
+{
+	poller_update( fd, EPOLL_CTL_MOD, want_write );
+}
+
+static void poller_remove( int fd, bool want_write )
+{
+	struct epoll_event event;
+	memset( &event, 0, sizeof( event ) );
+	epoll_ctl( poll_fd, EPOLL_CTL_DEL, fd, &event );
+}
+
+static int poller_wait( std::vector<ready_fd_t> &ready )
+{
+	struct epoll_event events[POLL_EVENT_MAX];
+	int res = epoll_wait( poll_fd, events, POLL_EVENT_MAX, -1 );
+	for( int i=0; i<res; i++ )
+	{
+		ready_fd_t r;
+		r.fd = events[i].data.fd;
+		/* Errors and hangups are noticed by reading */
+		r.readable = ( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) != 0;
+		r.writable = ( events[i].events & EPOLLOUT ) != 0;
+		ready.push_back( r );
+	}
+	return res;
+}
+
+#elif defined( FISHD_USE_KQUEUE )
+
+static int poll_fd = -1;
+
+static void poller_init()
+{
+	poll_fd = kqueue();
+	if( poll_fd == -1 )
+	{
+		wperror( L"kqueue" );
+		exit(1);
+	}
+	fcntl( poll_fd, F_SETFD, FD_CLOEXEC );
+}
+
+static bool poller_change( int fd, int filter, int flags )
+{
+	struct kevent change;
+	EV_SET( &change, fd, filter, flags, 0, 0, 0 );
+	if( kevent( poll_fd, &change, 1, 0, 0, 0 ) == -1 )
+	{
+		wperror( L"kevent" );
+		return false;
+	}
+	return true;
+}
+
+static bool poller_add( int fd )
+{
+	return poller_change( fd, EVFILT_READ, EV_ADD );
+}
+
+static void poller_set_write( int fd, bool want_write )
+{
+	poller_change( fd, EVFILT_WRITE, want_write ? EV_ADD : EV_DELETE );
+}
+
+static void poller_remove( int fd, bool want_write )
+{
+	poller_change( fd, EVFILT_READ, EV_DELETE );
+	if( want_write )
+		poller_change( fd, EVFILT_WRITE, EV_DELETE );
+}
+
+static int poller_wait( std::vector<ready_fd_t> &ready )
+{
+	struct kevent events[POLL_EVENT_MAX];
+	int res = kevent( poll_fd, 0, 0, events, POLL_EVENT_MAX, 0 );
+	for( int i=0; i<res; i++ )
+	{
+		ready_fd_t r;
+		r.fd = (int)events[i].ident;
+		r.readable = events[i].filter == EVFILT_READ;
+		r.writable = events[i].filter == EVFILT_WRITE;
+		ready.push_back( r );
+	}
+	return res;
+}
+
+#else
+
+/** The file descriptors watched for reading */
+static std::set<int> poll_read_fds;
+
+/** The file descriptors watched for writing */
+static std::set<int> poll_write_fds;
+
+static void poller_init()
+{
+}
+
+static bool poller_add( int fd )
+{
+	if( fd >= FD_SETSIZE )
+	{
+		debug( 1, L"Too many clients, refusing connection on fd %d", fd );
+		return false;
+	}
+	poll_read_fds.insert( fd );
+	return true;
+}
+
+static void poller_set_write( int fd, bool want_write )
+{
+	if( want_write )
+		poll_write_fds.insert( fd );
+	else
+		poll_write_fds.erase( fd );
+}
+
+static void poller_remove( int fd, bool want_write )
+{
+	poll_read_fds.erase( fd );
+	poll_write_fds.erase( fd );
+}
+
+static int poller_wait( std::vector<ready_fd_t> &ready )
+{
+	fd_set read_fd, write_fd;
+	int max_fd = 0;
+	std::set<int>::const_iterator iter;
+
+	FD_ZERO( &read_fd );
+	FD_ZERO( &write_fd );
+	for( iter = poll_read_fds.begin(); iter != poll_read_fds.end(); ++iter )
+	{
+		FD_SET( *iter, &read_fd );
+		max_fd = maxi( max_fd, *iter+1 );
+	}
+	for( iter = poll_write_fds.begin(); iter != poll_write_fds.end(); ++iter )
+	{
+		FD_SET( *iter, &write_fd );
+	}
+
+	int res = select( max_fd, &read_fd, &write_fd, 0, 0 );
+	if( res <= 0 )
+		return res;
+
+	for( iter = poll_read_fds.begin(); iter != poll_read_fds.end(); ++iter )
+	{
+		ready_fd_t r;
+		r.fd = *iter;
+		r.readable = FD_ISSET( *iter, &read_fd );
+		r.writable = FD_ISSET( *iter, &write_fd );
+		if( r.readable || r.writable )
+			ready.push_back( r );
+	}
+	return ready.size();
+}
+
+#endif
+
+/**
+   Start watching a file descriptor for reading. Returns false if it
+   can't be watched.
+*/
+static bool watch_fd( int fd, connection_t *c )
+{
+	if( ! poller_add( fd ) )
+		return false;
+	watched_fd_t &w = watched_fds[fd];
+	w.c = c;
+	w.want_write = false;
+	return true;
+}
+
+/**
+   Send what can be sent to a client right away, and watch it for
+   writing only if something is left. A client that subscribed to
+   variables isn't woken for changes to others, which stay queued until
+   it asks for a barrier.
+*/
+static void flush_connection( connection_t *c )
+{
+	const bool send_now = ! c->subscriptions || c->wakeup;
+	if( ! c->killme && ! c->unsent->empty() && send_now )
+		try_send_all( c );
+
+	if( c->killme )
+		return;
+
+	if( c->unsent->empty() )
+		c->wakeup = 0;
+
+	watched_fd_map_t::iterator iter = watched_fds.find( c->fd );
+	if( iter == watched_fds.end() )
+		return;
+
+	bool want_write = ! c->unsent->empty() && send_now;
+	if( iter->second.want_write != want_write )
+	{
+		poller_set_write( c->fd, want_write );
+		iter->second.want_write = want_write;
+	}
+}
+
+/**
+   Constructs the filename of a file that belongs to the fishd of this
+   user from the specified prefix
+*/
+static char *get_fishd_filename( const char *prefix )
 {
 	char *name;
 	const char *dir = getenv( "FISHD_SOCKET_DIR" );
@@ -169,16 +482,25 @@ static char *get_socket_filename()
 		uname = strdup( pw->pw_name );
 	}
 
-	name = (char *)malloc( strlen(dir)+ strlen(uname)+ strlen(SOCK_FILENAME) + 2 );
+	name = (char *)malloc( strlen(dir)+ strlen(uname)+ strlen(prefix) + 2 );
 	if( name == NULL )
 	{
-		wperror( L"get_socket_filename" );
+		wperror( L"get_fishd_filename" );
 		exit( EXIT_FAILURE );
 	}
 	strcpy( name, dir );
 	strcat( name, "/" );
-	strcat( name, SOCK_FILENAME );
+	strcat( name, prefix );
 	strcat( name, uname );
+	return name;
+}
+
+/**
+   Constructs the fish socket filename
+*/
+static char *get_socket_filename()
+{
+	char *name = get_fishd_filename( SOCK_FILENAME );
 
 	if( strlen( name ) >= UNIX_PATH_MAX )
 	{
@@ -188,6 +510,71 @@ static char *get_socket_filename()
 	return name;
 }
 
+/**
+   The generation file mapped into memory, or 0 if it could not be opened
+*/
+static universal_generation_t *generation_map = 0;
+
+/**
+   Open the generation file and map it into memory. The generation
+   continues from the value already in the file, if there is one, and is
+   incremented right away, so that clients never mistake the state of a
+   new fishd for that of an old one.
+*/
+static void init_generation()
+{
+	char *name = get_fishd_filename( GENERATION_FILENAME );
+	int fd = open( name, O_RDWR | O_CREAT | O_NOFOLLOW, 0600 );
+	free( name );
+	if( fd == -1 )
+	{
+		wperror( L"open" );
+		return;
+	}
+
+	/* Clients trust the file to tell them when to skip a barrier, so it must not be writable by anyone else */
+	struct stat buf;
+	if( fstat( fd, &buf ) || buf.st_uid != getuid() || (buf.st_mode & 022) || ! S_ISREG( buf.st_mode ) )
+	{
+		debug( 1, L"Ignoring generation file that is not private to this user" );
+		close( fd );
+		return;
+	}
+
+	if( buf.st_size < (off_t)sizeof( universal_generation_t ) && ftruncate( fd, sizeof( universal_generation_t ) ) )
+	{
+		wperror( L"ftruncate" );
+		close( fd );
+		return;
+	}
+
+	void *map = mmap( 0, sizeof( universal_generation_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( map == MAP_FAILED )
+	{
+		wperror( L"mmap" );
+		return;
+	}
+
+	generation_map = (universal_generation_t *)map;
+	generation_map->generation++;
+	generation_map->magic = UNIVERSAL_GENERATION_MAGIC;
+}
+
+/**
+   Remove the generation file when fishd exits, so that clients of a
+   later fishd that doesn't maintain it don't trust a stale generation
+*/
+static void remove_generation()
+{
+	if( !generation_map )
+		return;
+
+	char *name = get_fishd_filename( GENERATION_FILENAME );
+	unlink( name );
+	free( name );
+}
+
 /**
    Signal handler for the term signal. 
 */
@@ -443,14 +830,76 @@ done:
 	return ret;
 }
 
+/**
+ Called when waiting for a lock takes too long. It does nothing, it
+ only interrupts the wait.
+ */
+static void handle_lock_timeout( int signal )
+{
+}
+
+/**
+ Acquire a lock on the lockfile with fcntl, blocking until it is free
+ or until timeout seconds have passed. The kernel releases the lock
+ when the process holding it dies, so a stale lock never has to be
+ broken, and nobody polls for it. The lockfile is left in place, since
+ removing it would let two processes lock different files of the same
+ name. Returns the file descriptor that holds the lock, which is
+ released by closing it, -1 if the lock could not be acquired, or -2
+ if the lockfile doesn't support fcntl locks.
+ */
+static int acquire_lock_fd( const char *lockfile, const int timeout )
+{
+	struct flock lock;
+	struct sigaction act, old_act;
+	int res, err;
+
+    /* OK to not use CLO_EXEC here because fishd is single threaded */
+	int fd = open( lockfile, O_CREAT | O_RDWR | O_NOFOLLOW, 0600 );
+	if( fd == -1 )
+	{
+		debug( 1, L"acquire_lock_fd: open: %s", strerror( errno ) );
+		return -2;
+	}
+
+	memset( &lock, 0, sizeof( lock ) );
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+
+	memset( &act, 0, sizeof( act ) );
+	act.sa_handler = &handle_lock_timeout;
+	sigemptyset( &act.sa_mask );
+	sigaction( SIGALRM, &act, &old_act );
+	alarm( timeout );
+
+	res = fcntl( fd, F_SETLKW, &lock );
+	err = errno;
+
+	alarm( 0 );
+	sigaction( SIGALRM, &old_act, 0 );
+
+	if( res == 0 )
+		return fd;
+
+	close( fd );
+	if( err == EINTR )
+	{
+		debug( 1, L"acquire_lock_fd: timed out trying to lock %s", lockfile );
+		return -1;
+	}
+	debug( 2, L"acquire_lock_fd: fcntl: %s", strerror( err ) );
+	return -2;
+}
+
 /**
    Acquire the lock for the socket
    Returns the name of the lock file if successful or 
    NULL if unable to obtain lock.
-   The returned string must be free()d after unlink()ing the file to release 
-   the lock
+   If lock_fd is set to a file descriptor, the lock is released by
+   closing it, otherwise by unlink()ing the file.
+   The returned string must be free()d after releasing the lock
 */
-static char *acquire_socket_lock( const char *sock_name )
+static char *acquire_socket_lock( const char *sock_name, int *lock_fd )
 {
 	int len = strlen( sock_name );
 	char *lockfile = (char *)malloc( len + strlen( LOCKPOSTFIX ) + 1 );
@@ -462,7 +911,16 @@ static char *acquire_socket_lock( const char *sock_name )
 	}
 	strcpy( lockfile, sock_name );
 	strcpy( lockfile + len, LOCKPOSTFIX );
-	if ( !acquire_lock_file( lockfile, LOCKTIMEOUT, 1 ) )
+
+	*lock_fd = acquire_lock_fd( lockfile, LOCKTIMEOUT );
+	if( *lock_fd == -1 )
+	{
+		free( lockfile );
+		return NULL;
+	}
+
+	/* Fall back to a link based lock where fcntl locks don't work */
+	if( *lock_fd == -2 && !acquire_lock_file( lockfile, LOCKTIMEOUT, 1 ) )
 	{
 		free( lockfile );
 		lockfile = NULL;
@@ -483,7 +941,8 @@ static int get_socket()
 	/*
 	   Start critical section protected by lock
 	*/
-	char *lockfile = acquire_socket_lock( sock_name );
+	int lock_fd;
+	char *lockfile = acquire_socket_lock( sock_name, &lock_fd );
 	if( lockfile == NULL )
 	{
 		debug( 0, L"Unable to obtain lock on socket, exiting" );
@@ -536,7 +995,10 @@ static int get_socket()
 	}
 
 unlock:
-	(void)unlink( lockfile );
+	if( lock_fd >= 0 )
+		close( lock_fd );
+	else
+		(void)unlink( lockfile );
 	debug( 4, L"Released lockfile: %s", lockfile );
 	/*
 	   End critical section protected by lock
@@ -554,6 +1016,23 @@ unlock:
 	return s;
 }
 
+/**
+   The changes that have not been saved yet
+*/
+static message_queue_t journal;
+
+/**
+   The number of changes that have been appended to the save file since
+   it was last rewritten
+*/
+static int journal_count = 0;
+
+/**
+   Set while the save file is read, so that what it contains isn't
+   mistaken for changes
+*/
+static bool loading = false;
+
 /**
    Event handler. Broadcasts updates to all clients.
 */
@@ -562,26 +1041,35 @@ static void broadcast( int type, const wchar_t *key, const wchar_t *val )
 	connection_t *c;
 	message_t *msg;
 
-	if( !conn )
-		return;
-	
-	msg = create_message( type, key, val );
-	
 	/*
-	  Don't merge these loops, or try_send_all can free the message
-	  prematurely
+	  The message is only queued here. The main loop sends it on its next
+	  round, together with every other update that came in on this one,
+	  so that a burst of changes reaches each client in a single write.
 	*/
-	
-	for( c = conn; c; c=c->next )
+	if( loading )
 	{
-		msg->count++;
-        c->unsent->push(msg);
-	}	
+		journal_count++;
+		return;
+	}
+
+	msg = create_message( type, key, val );
+
+	/* The change is saved along with the others on the next save */
+	msg->count++;
+	journal.push_back( msg );
 	
 	for( c = conn; c; c=c->next )
 	{
-		try_send_all( c );
+		msg->count++;
+		c->unsent->push_back(msg);
+		if( connection_is_subscribed( c, key ) )
+			c->wakeup = 1;
 	}	
+	broadcast_pending = conn != 0;
+
+	/* Only now that the change is queued for every client may they see the new generation */
+	if( generation_map )
+		generation_map->generation++;
 }
 
 /**
@@ -712,34 +1200,62 @@ static wcstring fishd_get_config()
 }
 
 /**
-   Load or save all variables
+   The maximum number of changes that are appended to the save file
+   before it is rewritten from scratch
+*/
+#define SAVE_JOURNAL_MAX 256
+
+/**
+   The suffix of the temporary file that the save file is rewritten into
 */
-static void load_or_save( int save)
+#define SAVE_NEW_POSTFIX ".new"
+
+/**
+   Returns the name of the save file, or an empty string if there is no
+   configuration directory
+*/
+static std::string get_save_filename()
 {
 	const wcstring wdir = fishd_get_config();
-	char hostname[HOSTNAME_LEN];
-	connection_t c;
-	int fd;
 	
 	if (wdir.empty())
-		return;
-	
-	std::string dir = wcs2string( wdir );
+		return std::string();
 	
-	gethostname( hostname, HOSTNAME_LEN );
+	return env_universal_save_filename( wcs2string( wdir ) );
+}
+
+/**
+   Forget the changes that have not been saved
+*/
+static void clear_journal()
+{
+	while( ! journal.empty() )
+	{
+		message_t *msg = journal.front();
+		journal.pop_front();
+		msg->count--;
+		if( !msg->count )
+			free( msg );
+	}
+}
+
+/**
+   Load variables from disk. The save file is a list of all variables,
+   followed by the changes that were appended to it later.
+*/
+static void load()
+{
+	connection_t c;
+	int fd;
+	std::string name = get_save_filename();
 	
-    std::string name;
-    name.append(dir);
-    name.append("/");
-    name.append(FILE);
-    name.append(hostname);
+	if( name.empty() )
+		return;
 	
-	debug( 4, L"Open file for %s: '%s'", 
-		   save?"saving":"loading", 
-		   name.c_str() );
+	debug( 4, L"Open file for loading: '%s'", name.c_str() );
 	
     /* OK to not use CLO_EXEC here because fishd is single threaded */
-	fd = open(name.c_str(), save?(O_CREAT | O_TRUNC | O_WRONLY):O_RDONLY, 0600);
+	fd = open(name.c_str(), O_RDONLY);
 	
 	if( fd == -1 )
 	{
@@ -747,36 +1263,113 @@ static void load_or_save( int save)
 		wperror( L"open" );
 		return;		
 	}
-	debug( 4, L"File open on fd %d", c.fd );
+	debug( 4, L"File open on fd %d", fd );
 
 	connection_init( &c, fd );
 
-	if( save )
-	{
-		
-		write_loop( c.fd, SAVE_MSG, strlen(SAVE_MSG) );
-		enqueue_all( &c );
-	}
-	else
-		read_message( &c );
+	loading = true;
+	journal_count = 0;
+	read_message( &c );
+	loading = false;
 
 	connection_destroy( &c );	
+
+	/* Whatever is in the file on top of one entry per variable was appended */
+	wcstring_list_t names;
+	env_universal_common_get_names( names, 1, 1 );
+	journal_count = maxi( 0, journal_count - (int)names.size() );
 }
 
 /**
-   Load variables from disk
+   Append the changes that have not been saved to the save file.
+   Returns false if they could not be appended.
 */
-static void load()
+static bool append_journal( const std::string &name )
 {
-	load_or_save(0);
+	std::string buff;
+	for( size_t i=0; i<journal.size(); i++ )
+	{
+		buff.append( journal.at( i )->body );
+	}
+	
+	int fd = open( name.c_str(), O_WRONLY | O_APPEND );
+	if( fd == -1 )
+		return false;
+	
+	bool ok = write_loop( fd, buff.data(), buff.size() ) == (ssize_t)buff.size();
+	if( close( fd ) )
+		ok = false;
+	
+	if( ok )
+	{
+		journal_count += journal.size();
+		clear_journal();
+	}
+	return ok;
 }
 
 /**
-   Save variables to disk
+   Write all variables to a new save file, and put it in place of the
+   old one, so that a crash while saving leaves the old one intact
 */
-static void save()
+static void rewrite_save_file( const std::string &name )
 {
-	load_or_save(1);
+	connection_t c;
+	std::string new_name = name + SAVE_NEW_POSTFIX;
+	
+	debug( 4, L"Open file for saving: '%s'", new_name.c_str() );
+	
+	int fd = open( new_name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600 );
+	if( fd == -1 )
+	{
+		debug( 1, L"Could not open load/save file. No previous saves?" );
+		wperror( L"open" );
+		return;
+	}
+
+	connection_init( &c, fd );
+	write_loop( c.fd, SAVE_MSG, strlen(SAVE_MSG) );
+	enqueue_all( &c );
+	bool ok = !c.killme;
+	connection_destroy( &c );
+
+	if( !ok || rename( new_name.c_str(), name.c_str() ) )
+	{
+		debug( 1, L"Could not save universal variables to '%s'", name.c_str() );
+		unlink( new_name.c_str() );
+		return;
+	}
+
+	journal_count = 0;
+	clear_journal();
+}
+
+/**
+   Save variables to disk. Normally the changes since the last save are
+   appended to the save file, which is only rewritten once too many
+   changes have piled up in it. If compact is true, the file is
+   rewritten if it contains any changes at all.
+*/
+static void save( bool compact )
+{
+	std::string name = get_save_filename();
+	
+	if( name.empty() )
+	{
+		clear_journal();
+		return;
+	}
+
+	if( compact ? journal_count == 0 && journal.empty() : journal.empty() )
+		return;
+
+	if( !compact && journal_count + journal.size() <= SAVE_JOURNAL_MAX )
+	{
+		if( append_journal( name ) )
+			return;
+	}
+
+	rewrite_save_file( name );
 }
 
 /**
@@ -785,6 +1378,7 @@ static void save()
 static void init()
 {
 
+	init_generation();
 	sock = get_socket();
 	daemonize();	
 	env_universal_common_init( &broadcast );
@@ -800,10 +1394,7 @@ int main( int argc, char ** argv )
 	int child_socket;
 	struct sockaddr_un remote;
 	socklen_t t;
-	int max_fd;
 	int update_count=0;
-	
-	fd_set read_fd, write_fd;
 
 	set_main_thread();
     setup_fork_guards();
@@ -864,6 +1455,13 @@ int main( int argc, char ** argv )
 	}
 	
 	init();
+	poller_init();
+	if( ! watch_fd( sock, 0 ) )
+		exit(1);
+
+	std::vector<ready_fd_t> ready;
+	std::vector<connection_t *> touched;
+
 	while(1) 
 	{
 		connection_t *c;
@@ -871,28 +1469,15 @@ int main( int argc, char ** argv )
 
 		t = sizeof( remote );		
 		
-		FD_ZERO( &read_fd );
-		FD_ZERO( &write_fd );
-		FD_SET( sock, &read_fd );
-		max_fd = sock+1;
-		for( c=conn; c; c=c->next )
-		{
-			FD_SET( c->fd, &read_fd );
-			max_fd = maxi( max_fd, c->fd+1);
-			
-			if( ! c->unsent->empty() )
-			{
-				FD_SET( c->fd, &write_fd );
-			}
-		}
-
 		while( 1 )
 		{
-			res=select( max_fd, &read_fd, &write_fd, 0, 0 );
+			ready.clear();
+			res=poller_wait( ready );
 
 			if( quit )
 			{
-				save();
+				save( true );
+				remove_generation();
 				exit(0);
 			}
 			
@@ -901,52 +1486,75 @@ int main( int argc, char ** argv )
 			
 			if( errno != EINTR )
 			{
-				wperror( L"select" );
+				wperror( L"poll" );
 				exit(1);
 			}
 		}
-				
-		if( FD_ISSET( sock, &read_fd ) )
+
+		/*
+		  Only the connections that were ready, and the ones that were
+		  accepted, need to be looked at after the events are handled,
+		  unless a change was queued for every client
+		*/
+		touched.clear();
+		broadcast_pending = false;
+		
+		for( size_t i=0; i<ready.size(); i++ )
 		{
-			if( (child_socket = 
-				 accept( sock, 
-						 (struct sockaddr *)&remote, 
-						 &t) ) == -1) {
-				wperror( L"accept" );
-				exit(1);
-			}
-			else
-			{
-				debug( 4, L"Connected with new child on fd %d", child_socket );
+			const ready_fd_t &r = ready.at( i );
+			watched_fd_map_t::iterator iter = watched_fds.find( r.fd );
+			if( iter == watched_fds.end() )
+				continue;
 
-				if( fcntl( child_socket, F_SETFL, O_NONBLOCK ) != 0 )
-				{
-					wperror( L"fcntl" );
-					close( child_socket );		
+			c = iter->second.c;
+			if( !c )
+			{
+				if( (child_socket = 
+					 accept( sock, 
+							 (struct sockaddr *)&remote, 
+							 &t) ) == -1) {
+					wperror( L"accept" );
+					exit(1);
 				}
 				else
 				{
-					connection_t *newc = (connection_t *)malloc( sizeof(connection_t));
-					connection_init( newc, child_socket );					
-					newc->next = conn;
-					send( newc->fd, GREETING, strlen(GREETING), MSG_DONTWAIT );
-					enqueue_all( newc );				
-					conn=newc;
+					debug( 4, L"Connected with new child on fd %d", child_socket );
+
+					if( fcntl( child_socket, F_SETFL, O_NONBLOCK ) != 0 )
+					{
+						wperror( L"fcntl" );
+						close( child_socket );		
+					}
+					else if( ! watch_fd( child_socket, 0 ) )
+					{
+						close( child_socket );
+					}
+					else
+					{
+						connection_t *newc = (connection_t *)malloc( sizeof(connection_t));
+						connection_init( newc, child_socket );					
+						watched_fds[child_socket].c = newc;
+						newc->next = conn;
+						send( newc->fd, GREETING, strlen(GREETING), MSG_DONTWAIT );
+						enqueue_all( newc );				
+						conn=newc;
+						touched.push_back( newc );
+					}
 				}
+				continue;
 			}
-		}
-		
-		for( c=conn; c; c=c->next )
-		{
-			if( FD_ISSET( c->fd, &write_fd ) )
+
+			if( c->killme )
+				continue;
+
+			touched.push_back( c );
+			
+			if( r.writable )
 			{
 				try_send_all( c );
 			}
-		}
-		
-		for( c=conn; c; c=c->next )
-		{
-			if( FD_ISSET( c->fd, &read_fd ) )
+			
+			if( r.readable && !c->killme )
 			{
 				read_message( c );
 
@@ -957,11 +1565,37 @@ int main( int argc, char ** argv )
 				update_count++;
 				if( update_count >= 64 )
 				{
-					save();
+					save( false );
 					update_count = 0;
 				}
 			}
 		}
+
+		/*
+		  Send the updates that were queued during this round, and find
+		  out whether any connection has to be closed
+		*/
+		bool any_killed = false;
+		if( broadcast_pending )
+		{
+			for( c=conn; c; c=c->next )
+			{
+				flush_connection( c );
+				any_killed |= c->killme;
+			}
+		}
+		else
+		{
+			for( size_t i=0; i<touched.size(); i++ )
+			{
+				c = touched.at( i );
+				flush_connection( c );
+				any_killed |= c->killme;
+			}
+		}
+
+		if( !any_killed )
+			continue;
 		
 		connection_t *prev=0;
 		c=conn;
@@ -975,11 +1609,18 @@ int main( int argc, char ** argv )
 				while( ! c->unsent->empty() )
 				{
 					message_t *msg = c->unsent->front();
-                    c->unsent->pop();
+                    c->unsent->pop_front();
 					msg->count--;
 					if( !msg->count )
 						free( msg );
 				}
+
+				watched_fd_map_t::iterator iter = watched_fds.find( c->fd );
+				if( iter != watched_fds.end() )
+				{
+					poller_remove( c->fd, iter->second.want_write );
+					watched_fds.erase( iter );
+				}
 				
 				connection_destroy( c );
 				if( prev )
@@ -1006,7 +1647,8 @@ int main( int argc, char ** argv )
 		if( !conn )
 		{
 			debug( 0, L"No more clients. Quitting" );
-			save();			
+			save( true );			
+			remove_generation();
 			env_universal_common_destroy();
 			break;
 		}		
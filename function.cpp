@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <map>
 #include <set>
+#include <vector>
 
 #include "wutil.h"
 #include "fallback.h"
@@ -34,6 +35,7 @@
 #include "reader.h"
 #include "parse_util.h"
 #include "parser_keywords.h"
+#include "tokenizer.h"
 #include "env.h"
 #include "expand.h"
 #include "builtin_scripts.h"
@@ -44,6 +46,9 @@
 typedef std::map<wcstring, function_info_t> function_map_t;
 static function_map_t loaded_functions;
 
+/** The scripts shared by function_push_source, innermost last. Only used on the main thread. */
+static std::vector<function_source_t> shared_sources;
+
 /* Lock for functions */
 static pthread_mutex_t functions_lock;
 
@@ -103,49 +108,6 @@ static int load( const wcstring &name )
 	return res;
 }
 
-/**
-   Insert a list of all dynamically loaded functions into the
-   specified list.
-*/
-static void autoload_names( std::set<wcstring> &names, int get_hidden )
-{
-	size_t i;
-	
-	const env_var_t path_var_wstr =  env_get_string( L"fish_function_path" );
-    if (path_var_wstr.missing())
-        return;
-	const wchar_t *path_var = path_var_wstr.c_str(); 
-	
-    wcstring_list_t path_list;
-
-	tokenize_variable_array( path_var, path_list );
-	for( i=0; i<path_list.size(); i++ )
-	{
-        const wcstring &ndir_str = path_list.at(i);
-		const wchar_t *ndir = (wchar_t *)ndir_str.c_str();
-		DIR *dir = wopendir( ndir );
-		if( !dir )
-			continue;
-		
-		wcstring name;
-		while (wreaddir(dir, name))
-		{
-			const wchar_t *fn = name.c_str();
-			const wchar_t *suffix;
-			if( !get_hidden && fn[0] == L'_' )
-				continue;
-			
-            suffix = wcsrchr( fn, L'.' );
-			if( suffix && (wcscmp( suffix, L".fish" ) == 0 ) )
-			{
-                wcstring name(fn, suffix - fn);
-                names.insert(name);
-			}
-		}				
-		closedir(dir);
-	}
-}
-
 void function_init()
 {
     /* PCA: This recursive lock was introduced early in my work. I would like to make this a non-recursive lock but I haven't fully investigated all the call paths (for autoloading functions, etc.) */
@@ -156,8 +118,10 @@ void function_init()
     VOMIT_ON_FAILURE(pthread_mutexattr_destroy(&a));
 }
 
-function_info_t::function_info_t(const function_data_t &data, const wchar_t *filename, int def_offset, bool autoload) :
-    definition(data.definition),
+function_info_t::function_info_t(const function_data_t &data, const function_source_t &source, const wchar_t *filename, int def_offset, bool autoload) :
+    definition_source(source ? source : function_source_t(new wcstring(data.definition, data.definition_length))),
+    definition_start(source ? data.definition - source->c_str() : 0),
+    definition_length(data.definition_length),
     description(data.description),
     definition_file(intern(filename)),
     definition_offset(def_offset),
@@ -168,16 +132,52 @@ function_info_t::function_info_t(const function_data_t &data, const wchar_t *fil
 }
 
 function_info_t::function_info_t(const function_info_t &data, const wchar_t *filename, int def_offset, bool autoload) :
-    definition(data.definition),
+    definition_source(data.definition_source),
+    definition_start(data.definition_start),
+    definition_length(data.definition_length),
     description(data.description),
     definition_file(intern(filename)),
     definition_offset(def_offset),
     named_arguments(data.named_arguments),
     is_autoload(autoload),
-    shadows(data.shadows)
+    shadows(data.shadows),
+    definition_tokens(data.definition_tokens)
 {
 }
 
+wcstring function_info_t::definition() const
+{
+    return definition_source->substr(definition_start, definition_length);
+}
+
+void function_push_source( const function_source_t &source )
+{
+    ASSERT_IS_MAIN_THREAD();
+    shared_sources.push_back(source);
+}
+
+void function_pop_source()
+{
+    ASSERT_IS_MAIN_THREAD();
+    shared_sources.pop_back();
+}
+
+/**
+   Returns the shared script that the specified definition is a part
+   of, if it is nearly all of it. Keeping the rest of the script alive
+   would cost more than a copy of the definition otherwise.
+*/
+static function_source_t function_shared_source( const wchar_t *def, size_t len )
+{
+    for (size_t i = shared_sources.size(); i--; ) {
+        const function_source_t &source = shared_sources.at(i);
+        const wchar_t *begin = source->c_str();
+        if (def >= begin && def + len <= begin + source->size())
+            return 16 * len >= 15 * source->size() ? source : function_source_t();
+    }
+    return function_source_t();
+}
+
 void function_add( const function_data_t &data, const parser_t &parser )
 {
     ASSERT_IS_MAIN_THREAD();
@@ -192,8 +192,9 @@ void function_add( const function_data_t &data, const parser_t &parser )
     
     /* Create and store a new function */
     const wchar_t *filename = reader_current_filename();
-    int def_offset = parse_util_lineno( parser.get_buffer(), parser.current_block->tok_pos )-1;
-    const function_map_t::value_type new_pair(data.name, function_info_t(data, filename, def_offset, is_autoload));
+    int def_offset = parser.get_buffer_lineno( parser.current_block->tok_pos )-1;
+    const function_source_t source = function_shared_source(data.definition, data.definition_length);
+    const function_map_t::value_type new_pair(data.name, function_info_t(data, source, filename, def_offset, is_autoload));
     loaded_functions.insert(new_pair);
 	
     /* Add event handlers */
@@ -240,6 +241,33 @@ void function_remove( const wcstring &name )
         function_autoloader.unload( name );
 }
 
+void function_memory_usage( memory_usage_t &usage )
+{
+    size_t definitions = 0, tokens = 0;
+    {
+        /* A script shared by several functions is counted once */
+        std::set<const wcstring *> sources;
+        scoped_lock lock(functions_lock);
+        for (function_map_t::const_iterator iter = loaded_functions.begin(); iter != loaded_functions.end(); ++iter)
+        {
+            const function_info_t &info = iter->second;
+            /* The node in the map */
+            definitions += sizeof *iter + 4 * sizeof(void *) + memory_usage_of(iter->first);
+            if (sources.insert(info.definition_source.get()).second)
+                definitions += memory_usage_of(*info.definition_source);
+            definitions += memory_usage_of(info.description);
+            definitions += info.named_arguments.capacity() * sizeof(wcstring);
+            for (size_t i=0; i < info.named_arguments.size(); i++)
+                definitions += memory_usage_of(info.named_arguments.at(i));
+            if (info.definition_tokens)
+                tokens += sizeof(tok_cache_t) + info.definition_tokens->tokens.capacity() * sizeof(tok_cache_entry_t) + info.definition_tokens->line_starts.capacity() * sizeof(int);
+        }
+    }
+    usage.push_back(memory_usage_t::value_type(L"functions", definitions));
+    usage.push_back(memory_usage_t::value_type(L"function tokens", tokens));
+    usage.push_back(memory_usage_t::value_type(L"function autoload records", function_autoloader.memory_usage()));
+}
+
 static const function_info_t *function_get(const wcstring &name)
 {
     // The caller must lock the functions_lock before calling this; however our mutex is currently recursive, so trylock will never fail
@@ -258,11 +286,29 @@ bool function_get_definition(const wcstring &name, wcstring *out_definition)
     scoped_lock lock(functions_lock);
     const function_info_t *func = function_get(name);
     if (func && out_definition) {
-        out_definition->assign(func->definition);
+        out_definition->assign(*func->definition_source, func->definition_start, func->definition_length);
     }
     return func != NULL;
 }
 
+std::tr1::shared_ptr<const tok_cache_t> function_get_definition_tokens(const wcstring &name)
+{
+    ASSERT_IS_MAIN_THREAD();
+    scoped_lock lock(functions_lock);
+    function_map_t::iterator iter = loaded_functions.find(name);
+    if (iter == loaded_functions.end())
+        return std::tr1::shared_ptr<const tok_cache_t>();
+    
+    function_info_t &func = iter->second;
+    if (! func.definition_tokens) {
+        /* Tokenize with the same flags parser_t::eval uses */
+        tok_cache_t *tokens = new tok_cache_t();
+        tok_cache_build(tokens, func.definition().c_str(), 0);
+        func.definition_tokens.reset(tokens);
+    }
+    return func.definition_tokens;
+}
+
 wcstring_list_t function_get_named_arguments(const wcstring &name)
 {
     scoped_lock lock(functions_lock);
@@ -277,6 +323,13 @@ int function_get_shadows(const wcstring &name)
     return func ? func->shadows : false;
 }
 
+bool function_is_autoloaded(const wcstring &name)
+{
+    scoped_lock lock(functions_lock);
+    const function_info_t *func = function_get(name);
+    return func ? func->is_autoload : false;
+}
+
 	
 bool function_get_desc(const wcstring &name, wcstring *out_desc)
 {
@@ -319,7 +372,7 @@ wcstring_list_t function_get_names(int get_hidden)
 {
     std::set<wcstring> names;
     scoped_lock lock(functions_lock);
-	autoload_names(names, get_hidden);
+	function_autoloader.get_names(names, get_hidden);
 	
     function_map_t::const_iterator iter;
     for (iter = loaded_functions.begin(); iter != loaded_functions.end(); ++iter) {
@@ -11,6 +11,7 @@
 #define FISH_FUNCTION_H
 
 #include <wchar.h>
+#include <tr1/memory>
 
 #include "util.h"
 #include "common.h"
@@ -18,6 +19,7 @@
 
 class parser_t;
 class env_vars;
+struct tok_cache_t;
 
 /**
    Structure describing a function. This is used by the parser to
@@ -37,9 +39,13 @@ struct function_data_t
 	 */
 	wcstring description;
 	/**
-	   Function definition
+	   Function definition, which is not null terminated
 	 */
-	wchar_t *definition;
+	const wchar_t *definition;
+	/**
+	   The length of the definition
+	 */
+	size_t definition_length;
 	/**
 	   List of all event handlers for this function
 	 */
@@ -55,16 +61,31 @@ struct function_data_t
 	int shadows;
 };
 
+/**
+   A script that functions are defined in, shared by the functions
+   that refer to their definitions in it
+*/
+typedef std::tr1::shared_ptr<const wcstring> function_source_t;
+
 class function_info_t {
 public:
-    /** Constructs relevant information from the function_data */
-    function_info_t(const function_data_t &data, const wchar_t *filename, int def_offset, bool autoload);
+    /** Constructs relevant information from the function_data. If source is set, the definition is a part of it. */
+    function_info_t(const function_data_t &data, const function_source_t &source, const wchar_t *filename, int def_offset, bool autoload);
     
     /** Used by function_copy */
     function_info_t(const function_info_t &data, const wchar_t *filename, int def_offset, bool autoload);
 
-    /** Function definition */
-    const wcstring definition;
+    /** The string that the definition is a part of, either a shared script or a copy of its own */
+    const function_source_t definition_source;
+    
+    /** Where the definition starts in definition_source */
+    const size_t definition_start;
+    
+    /** The length of the definition */
+    const size_t definition_length;
+    
+    /** Returns the function definition */
+    wcstring definition() const;
     
     /** Function description. Only the description may be changed after the function is created. */
     wcstring description;
@@ -83,6 +104,9 @@ public:
     
 	/** Set to true if invoking this function shadows the variables of the underlying function. */
 	const bool shadows;
+
+	/** Tokenized definition, built on first invocation. Since the definition never changes, neither does this once built. */
+	std::tr1::shared_ptr<const tok_cache_t> definition_tokens;
 };
 
 
@@ -94,6 +118,21 @@ void function_init();
 /** Add a function. */
 void function_add( const function_data_t &data, const parser_t &parser );
 
+/**
+   Shares the specified script, which is about to be evaluated, with
+   the functions defined in it, so that function_add refers to their
+   definitions in it instead of copying them. Functions that are not
+   nearly all of it are still copied, so that they don't keep the rest
+   of it alive. Must be matched by function_pop_source once it has been
+   evaluated.
+*/
+void function_push_source( const function_source_t &source );
+
+/**
+   Stops sharing the script shared by the last call to function_push_source
+*/
+void function_pop_source();
+
 /**
    Remove the function with the specified name.
 */
@@ -105,6 +144,15 @@ void function_remove( const wcstring &name );
 */
 bool function_get_definition( const wcstring &name, wcstring *out_definition );
 
+/**
+   Returns the tokenized definition of the function with the name \c name,
+   for use with tok_init_cached, building it if necessary. Returns an
+   empty pointer if no function with the given name exists.
+
+   This function does not autoload functions. It must be called from the main thread.
+*/
+std::tr1::shared_ptr<const tok_cache_t> function_get_definition_tokens( const wcstring &name );
+
 /**
    Returns by reference the description of the function with the name \c name.
    Returns true if the function exists and has a nonempty description, false if it does not.
@@ -170,4 +218,15 @@ bool function_copy( const wcstring &name, const wcstring &new_name );
 */
 int function_get_shadows( const wcstring &name );
 
+/**
+   Returns whether this function was loaded from the function path
+*/
+bool function_is_autoloaded( const wcstring &name );
+
+/**
+   Append the memory used by function definitions, and by the records
+   of autoloaded function files, to usage
+*/
+void function_memory_usage( memory_usage_t &usage );
+
 #endif
@@ -12,6 +12,9 @@
 #include <wctype.h>
 #include <termios.h>
 #include <signal.h>
+#include <pthread.h>
+#include <map>
+#include <tr1/memory>
 
 #include "fallback.h"
 #include "util.h"
@@ -33,6 +36,8 @@
 #include "output.h"
 #include "wildcard.h"
 #include "path.h"
+#include "dir_cache.h"
+#include "trace.h"
 
 /**
    Number of elements in the highlight_var array
@@ -105,7 +110,7 @@ static wcstring apply_working_directory(const wcstring &path, const wcstring &wo
 
 /* Tests whether the specified string cpath is the prefix of anything we could cd to. directories is a list of possible parent directories (typically either the working directory, or the cdpath). This does I/O!
 */
-bool is_potential_path(const wcstring &const_path, const wcstring_list_t &directories, bool require_dir, wcstring *out_path)
+bool is_potential_path(const wcstring &const_path, const wcstring_list_t &directories, bool require_dir, wcstring *out_path, const generation_token_t &token)
 {
     ASSERT_IS_BACKGROUND_THREAD();
     
@@ -162,6 +167,10 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
         std::set<wcstring> checked_paths;
         
         for (size_t wd_idx = 0; wd_idx < directories.size() && ! result; wd_idx++) {
+            /* Each directory may be on a slow filesystem, so stop if nobody cares about the answer any more */
+            if (token.is_stale())
+                break;
+            
             const wcstring &wd = directories.at(wd_idx);
             
             const wcstring abs_path = apply_working_directory(clean_path, wd);
@@ -185,7 +194,7 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
             }
             else
             {
-                DIR *dir = NULL;
+                dir_listing_ref_t listing;
                 
                 /* We do not end with a slash; it does not have to be a directory */
                 const wcstring dir_name = wdirname(abs_path);
@@ -196,16 +205,28 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
                     if (out_path)
                         *out_path = clean_path;
                 }
-                else if ((dir = wopendir(dir_name))) {
-                    // We opened the dir_name; look for a string where the base name prefixes it
-                    wcstring ent;
-                    
-                    // Don't ask for the is_dir value unless we care, because it can cause extra filesystem acces */
-                    bool is_dir = false;
-                    while (wreaddir_resolving(dir, dir_name, ent, require_dir ? &is_dir : NULL))
+                else if (dir_cache_get_listing(dir_name, &listing)) {
+                    // We read the dir_name; look for a string where the base name prefixes it
+                    for (size_t i=0; i < listing->size() && ! token.is_stale(); i++)
                     {
+                        const wcstring &ent = listing->at(i).name;
+                        
                         // TODO: support doing the right thing on case-insensitive filesystems like HFS+
-                        if (string_prefixes_string(base_name, ent) && (! require_dir || is_dir))
+                        if (! string_prefixes_string(base_name, ent))
+                            continue;
+                        
+                        // Don't ask for the is_dir value unless we care, because it can cause extra filesystem access
+                        bool is_dir = false;
+                        if (require_dir) {
+                            is_dir = listing->at(i).is_dir == 1;
+                            if (listing->at(i).is_dir == -1) {
+                                /* We want to treat symlinks to directories as directories. Use stat to resolve it. */
+                                struct stat buf;
+                                is_dir = (0 == wstat(dir_name + L'/' + ent, &buf) && S_ISDIR(buf.st_mode));
+                            }
+                        }
+                        
+                        if (! require_dir || is_dir)
                         {
                             result = true;
                             if (out_path) {
@@ -226,7 +247,6 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
                             break;
                         }
                     }
-                    closedir(dir);
                 }
             }
         }
@@ -236,7 +256,13 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
 
 
 /* Given a string, return whether it prefixes a path that we could cd into. Return that path in out_path */
-static bool is_potential_cd_path(const wcstring &path, const wcstring &working_directory, wcstring *out_path) {
+static bool is_potential_cd_path(const wcstring &path, const wcstring &working_directory, wcstring *out_path, const generation_token_t &token = generation_token_t()) {
+    /* A directory that cd can change to is a potential cd path. Single names are looked up through the cache of $CDPATH lookups, which is cheaper than reading the directories of $CDPATH. */
+    const size_t name_end = path.find_last_not_of(L'/');
+    if (! out_path && name_end != wcstring::npos && path.rfind(L'/', name_end) == wcstring::npos &&
+        path_can_get_cdpath(path, working_directory.c_str()))
+        return true;
+    
     wcstring_list_t directories;
     
     if (string_prefixes_string(L"./", path)) {
@@ -259,7 +285,7 @@ static bool is_potential_cd_path(const wcstring &path, const wcstring &working_d
     }
     
     /* Call is_potential_path with all of these directories */
-    bool result = is_potential_path(path, directories, true /* require_dir */, out_path);
+    bool result = is_potential_path(path, directories, true /* require_dir */, out_path, token);
 #if 0
     if (out_path) {
         printf("%ls -> %ls\n", path.c_str(), out_path->c_str());
@@ -268,26 +294,28 @@ static bool is_potential_cd_path(const wcstring &path, const wcstring &working_d
     return result;
 }
 
+const wchar_t *highlight_get_color_var( int highlight )
+{
+	if( highlight < 0 || highlight > (1<<VAR_COUNT) )
+		return highlight_var[0];
+	for( size_t i=0; i<VAR_COUNT; i++ )
+	{
+		if( highlight & (1<<i ))
+			return highlight_var[i];
+	}
+	return highlight_var[0];
+}
+
 rgb_color_t highlight_get_color( int highlight, bool is_background )
 {
-	size_t i;
-	int idx=0;
 	rgb_color_t result;
 
 	if( highlight < 0 )
 		return rgb_color_t::normal();
 	if( highlight > (1<<VAR_COUNT) )
 		return rgb_color_t::normal();
-	for( i=0; i<VAR_COUNT; i++ )
-	{
-		if( highlight & (1<<i ))
-		{
-			idx = i;
-			break;
-		}
-	}
-    
-	env_var_t val_wstr = env_get_string( highlight_var[idx]); 
+
+	env_var_t val_wstr = env_get_string( highlight_get_color_var( highlight ) ); 
 
 //	debug( 1, L"%d -> %d -> %ls", highlight, idx, val );	
 	
@@ -631,8 +659,10 @@ static bool autosuggest_parse_command(const wcstring &str, wcstring *out_command
     int arg_pos = -1;
     
     bool had_cmd = false;
+    /* Comments are skipped below, but tokenizing with them gives the same tokens highlighting uses */
+    std::tr1::shared_ptr<const tok_cache_t> tokens = parse_util_get_tokens( str.c_str(), TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS );
     tokenizer tok;
-    for (tok_init( &tok, str.c_str(), TOK_SQUASH_ERRORS); tok_has_next(&tok); tok_next(&tok))
+    for (tok_init_cached( &tok, str.c_str(), tokens.get(), TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS); tok_has_next(&tok); tok_next(&tok))
     {
         int last_type = tok_last_type(&tok);
         
@@ -643,13 +673,13 @@ static bool autosuggest_parse_command(const wcstring &str, wcstring *out_command
                 if( had_cmd )
                 {
                     /* Parameter to the command */
-                    args.push_back(tok_last(&tok));
+                    args.push_back(tok_last_string(&tok));
                     arg_pos = tok_get_pos(&tok);
                 }
                 else
                 { 	
                     /* Command. First check that the command actually exists. */
-                    wcstring local_cmd = tok_last( &tok );
+                    wcstring local_cmd = tok_last_string( &tok );
                     bool expanded = expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES);
                     if (! expanded || has_expand_reserved(cmd.c_str()))
                     {
@@ -665,7 +695,7 @@ static bool autosuggest_parse_command(const wcstring &str, wcstring *out_command
                             int sw;
                             tok_next( &tok );
                             
-                            sw = parser_keywords_is_switch( tok_last( &tok ) );
+                            sw = parser_keywords_is_switch( tok_last_string( &tok ) );
                             if( !parser_keywords_is_block( cmd ) &&
                                sw == ARG_SWITCH )
                             {
@@ -815,7 +845,7 @@ bool autosuggest_special_validate_from_history(const wcstring &str, const wcstri
 }
 
 // This function does I/O
-static void tokenize( const wchar_t * const buff, std::vector<int> &color, const int pos, wcstring_list_t *error, const wcstring &working_directory, const env_vars &vars) {
+static void tokenize( const wchar_t * const buff, std::vector<int> &color, const int pos, wcstring_list_t *error, const wcstring &working_directory, const env_vars &vars, const generation_token_t &token) {
     ASSERT_IS_BACKGROUND_THREAD();
     
 	wcstring cmd;    
@@ -838,9 +868,10 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 
     std::fill(color.begin(), color.end(), -1); 
 
+    std::tr1::shared_ptr<const tok_cache_t> tokens = parse_util_get_tokens( buff, TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS );
     tokenizer tok;
-	for( tok_init( &tok, buff, TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS );
-		tok_has_next( &tok );
+	for( tok_init_cached( &tok, buff, tokens.get(), TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS );
+		tok_has_next( &tok ) && ! token.is_stale();
 		tok_next( &tok ) )
 	{	
 		int last_type = tok_last_type( &tok );
@@ -853,10 +884,11 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 				{
 					
 					/*Parameter */
-					wchar_t *param = tok_last( &tok );
+					const wcstring param_str = tok_last_string( &tok );
+					const wchar_t *param = param_str.c_str();
 					if( param[0] == L'-' )
 					{
-						if (wcscmp( param, L"--" ) == 0 )
+						if (param_str == L"--" )
 						{
 							accept_switches = 0;
 							color.at(tok_get_pos( &tok )) = HIGHLIGHT_PARAM;
@@ -880,11 +912,11 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 
 					if( cmd == L"cd" )
 					{
-                        wcstring dir = tok_last( &tok );
+                        wcstring dir = param_str;
                         if (expand_one(dir, EXPAND_SKIP_CMDSUBST))
 						{
 							int is_help = string_prefixes_string(dir, L"--help") || string_prefixes_string(dir, L"-h");
-							if( !is_help && ! is_potential_cd_path(dir, working_directory, NULL))
+							if( !is_help && ! is_potential_cd_path(dir, working_directory, NULL, token))
 							{
                                 color.at(tok_get_pos( &tok )) = HIGHLIGHT_ERROR;							
 							}
@@ -892,7 +924,6 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 					}
 					
                     /* Highlight the parameter. highlight_param wants to write one more color than we have characters (hysterical raisins) so allocate one more in the vector. But don't copy it back. */
-                    const wcstring param_str = param;
                     int tok_pos = tok_get_pos(&tok);
                     
                     std::vector<int>::const_iterator where = color.begin() + tok_pos;
@@ -908,7 +939,7 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 					/*
 					 Command. First check that the command actually exists.
 					 */
-                    cmd = tok_last( &tok );
+                    cmd = tok_last_string( &tok );
                     bool expanded = expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES);
 					if (! expanded || has_expand_reserved(cmd.c_str()))
 					{
@@ -941,7 +972,7 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 							
 							tok_next( &tok );
 							
-							sw = parser_keywords_is_switch( tok_last( &tok ) );
+							sw = parser_keywords_is_switch( tok_last_string( &tok ) );
 							
 							if( !parser_keywords_is_block( cmd ) &&
 							   sw == ARG_SWITCH )
@@ -1026,7 +1057,7 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 						
 						if( had_cmd )
 						{
-							last_cmd = tok_last( &tok );
+							last_cmd = tok_last_string( &tok );
 						}
 					}
 					
@@ -1062,7 +1093,7 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 				{
 					case TOK_STRING:
 					{
-                        target_str = tok_last( &tok );
+                        target_str = tok_last_string( &tok );
                         if (expand_one(target_str, EXPAND_SKIP_CMDSUBST)) {
                             target = target_str.c_str();
                         }
@@ -1188,11 +1219,110 @@ static void tokenize( const wchar_t * const buff, std::vector<int> &color, const
 }
 
 
-// PCA This function does I/O, (calls is_potential_path, path_get_path, maybe others) and so ought to only run on a background thread
-void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars )
+/**
+   Colors computed by the last call to highlight_shell, so that the next
+   call only needs to highlight the jobs that were edited in between.
+   Highlighting depends on the working directory and a few variables, so
+   the cache is only used if these are unchanged.
+*/
+struct highlight_cache_t
+{
+    /** Working directory the cache was computed in */
+    wcstring working_directory;
+
+    /** Values of env_vars::highlighting_keys the cache was computed with */
+    wcstring_list_t var_values;
+
+    /** Colors of each job, as returned by tokenize(), keyed by the text of the job */
+    std::map<wcstring, std::vector<int> > job_colors;
+
+    /** The last token checked with is_potential_path, and the result */
+    bool has_potential_path;
+    wcstring potential_path_token;
+    bool potential_path_result;
+
+    highlight_cache_t() : has_potential_path(false), potential_path_result(false)
+    {
+    }
+};
+
+typedef std::tr1::shared_ptr<const highlight_cache_t> highlight_cache_ref_t;
+
+/** The cache of the last completed highlight_shell call, protected by s_highlight_cache_lock */
+static highlight_cache_ref_t s_highlight_cache;
+static pthread_mutex_t s_highlight_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void get_highlighting_var_values(const env_vars &vars, wcstring_list_t &values)
+{
+    for (size_t i=0; env_vars::highlighting_keys[i]; i++)
+    {
+        const wchar_t *val = vars.get(env_vars::highlighting_keys[i]);
+        values.push_back(val ? val : L"");
+    }
+}
+
+/**
+   Locate the start of every job in buff. tokenize() resets all of its
+   state at the end of a job, so each job can be highlighted on its own
+   with the same result. Escaped newlines are not job boundaries.
+*/
+static void locate_jobs(const wcstring &buff, std::vector<size_t> &job_starts)
+{
+    std::tr1::shared_ptr<const tok_cache_t> tokens = parse_util_get_tokens( buff.c_str(), TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS );
+    tokenizer tok;
+    job_starts.push_back(0);
+    for( tok_init_cached( &tok, buff.c_str(), tokens.get(), TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS ); tok_has_next( &tok ); tok_next( &tok ) )
+    {
+        if( tok_last_type( &tok ) != TOK_END )
+            continue;
+
+        size_t end_pos = tok_get_pos( &tok );
+        if( end_pos + 1 < buff.size() && wcschr( L";\n\r", buff.at(end_pos) ) )
+            job_starts.push_back(end_pos + 1);
+    }
+    tok_destroy( &tok );
+}
+
+/**
+   Like tokenize(), but reuse the colors of every job that is unchanged
+   since the previous call, so only edited jobs are highlighted again.
+   The colors of all jobs are stored in next.
+*/
+static void tokenize_incremental( const wcstring &buff, std::vector<int> &color, const int pos, const wcstring &working_directory, const env_vars &vars, const generation_token_t &token, const highlight_cache_t *previous, highlight_cache_t *next )
+{
+    std::vector<size_t> job_starts;
+    locate_jobs(buff, job_starts);
+
+    for( size_t i=0; i < job_starts.size() && ! token.is_stale(); i++ )
+    {
+        const size_t start = job_starts.at(i);
+        const size_t end = (i + 1 < job_starts.size()) ? job_starts.at(i + 1) : buff.size();
+        const wcstring job(buff, start, end - start);
+
+        std::map<wcstring, std::vector<int> >::const_iterator cached = next->job_colors.find(job);
+        if( cached == next->job_colors.end() )
+        {
+            if( previous && (cached = previous->job_colors.find(job)) != previous->job_colors.end() )
+            {
+                cached = next->job_colors.insert(*cached).first;
+            }
+            else
+            {
+                std::vector<int> job_colors(job.size(), -1);
+                tokenize(job.c_str(), job_colors, pos - (int)start, NULL, working_directory, vars, token);
+                cached = next->job_colors.insert(std::make_pair(job, job_colors)).first;
+            }
+        }
+        std::copy(cached->second.begin(), cached->second.end(), color.begin() + start);
+    }
+}
+
+/**
+   Highlight buff. If next is not NULL, colors are reused from previous
+   where possible, and stored in next for the next call.
+*/
+static void highlight_shell_internal( const wcstring &buff, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars, const generation_token_t &token, const wcstring &working_directory, const highlight_cache_t *previous, highlight_cache_t *next )
 {
-    ASSERT_IS_BACKGROUND_THREAD();
-    
     const size_t length = buff.size();
     assert(buff.size() == color.size());
 
@@ -1202,11 +1332,11 @@ void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wc
 	
     std::fill(color.begin(), color.end(), -1);
 
-    /* Do something sucky and get the current working directory on this background thread. This should really be passed in. Note that we also need this as a vector (of one directory). */
-    const wcstring working_directory = get_working_directory();
-
     /* Tokenize the string */
-    tokenize(buff.c_str(), color, pos, error, working_directory, vars);
+    if( next )
+        tokenize_incremental(buff, color, pos, working_directory, vars, token, previous, next);
+    else
+        tokenize(buff.c_str(), color, pos, error, working_directory, vars, token);
 
 	/*
 	  Locate and syntax highlight cmdsubsts recursively
@@ -1216,7 +1346,7 @@ void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wc
     wchar_t * subpos = subbuff;
 	int done=0;
 	
-	while( 1 )
+	while( ! token.is_stale() )
 	{
 		wchar_t *begin, *end;
     
@@ -1234,7 +1364,7 @@ void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wc
         size_t start = begin - subbuff + 1, len = wcslen(begin + 1);
         std::vector<int> subcolors(len, -1);
         
-		highlight_shell( begin+1, subcolors, -1, error, vars );
+		highlight_shell_internal( begin+1, subcolors, -1, error, vars, token, working_directory, previous, next );
         
         // insert subcolors
         std::copy(subcolors.begin(), subcolors.end(), color.begin() + start);
@@ -1270,7 +1400,7 @@ void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wc
 	  are the current token.
       For reasons that I don't yet understand, it's required that pos be allowed to be length (e.g. when backspacing).
 	*/
-	if( pos >= 0 && (size_t)pos <= length )
+	if( pos >= 0 && (size_t)pos <= length && ! token.is_stale() )
 	{
 		
         const wchar_t *cbuff = buff.c_str();
@@ -1278,9 +1408,24 @@ void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wc
 		parse_util_token_extent( cbuff, pos, &tok_begin, &tok_end, 0, 0 );
 		if( tok_begin && tok_end )
 		{
-			const wcstring token(tok_begin, tok_end-tok_begin);
-			const wcstring_list_t working_directory_list(1, working_directory);
-			if (is_potential_path(token, working_directory_list))
+			const wcstring path_token(tok_begin, tok_end-tok_begin);
+			bool is_path;
+			if( previous && previous->has_potential_path && previous->potential_path_token == path_token )
+			{
+				is_path = previous->potential_path_result;
+			}
+			else
+			{
+				const wcstring_list_t working_directory_list(1, working_directory);
+				is_path = is_potential_path(path_token, working_directory_list, false, NULL, token);
+			}
+			if( next )
+			{
+				next->has_potential_path = true;
+				next->potential_path_token = path_token;
+				next->potential_path_result = is_path;
+			}
+			if (is_path)
 			{
 				for( ptrdiff_t i=tok_begin-cbuff; i < (tok_end-cbuff); i++ )
 				{
@@ -1310,6 +1455,48 @@ void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wc
 
 
 
+// PCA This function does I/O, (calls is_potential_path, path_get_path, maybe others) and so ought to only run on a background thread
+void highlight_shell( const wcstring &buff, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars, const generation_token_t &token )
+{
+    ASSERT_IS_BACKGROUND_THREAD();
+    TRACE_SCOPE( "highlight_shell" );
+
+    /* Do something sucky and get the current working directory on this background thread. This should really be passed in. */
+    const wcstring working_directory = get_working_directory();
+
+    /* Error messages are only generated when actually tokenizing, so don't use the cache if the caller wants them */
+    if( error )
+    {
+        highlight_shell_internal(buff, color, pos, error, vars, token, working_directory, NULL, NULL);
+        return;
+    }
+
+    highlight_cache_ref_t previous;
+    {
+        scoped_lock lock(s_highlight_cache_lock);
+        previous = s_highlight_cache;
+    }
+
+    highlight_cache_t *next = new highlight_cache_t();
+    next->working_directory = working_directory;
+    get_highlighting_var_values(vars, next->var_values);
+    if( previous && (previous->working_directory != next->working_directory || previous->var_values != next->var_values) )
+        previous.reset();
+
+    highlight_shell_internal(buff, color, pos, NULL, vars, token, working_directory, previous.get(), next);
+
+    /* A stale call may have given up half way, so don't let it replace the cache */
+    if( token.is_stale() )
+    {
+        delete next;
+    }
+    else
+    {
+        scoped_lock lock(s_highlight_cache_lock);
+        s_highlight_cache.reset(next);
+    }
+}
+
 /**
    Perform quote and parenthesis highlighting on the specified string.
 */
@@ -1422,7 +1609,7 @@ static void highlight_universal_internal( const wcstring &buffstr,
 	}
 }
 
-void highlight_universal( const wcstring &buff, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars )
+void highlight_universal( const wcstring &buff, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars, const generation_token_t &token )
 {
     assert(buff.size() == color.size());
     std::fill(color.begin(), color.end(), 0);	
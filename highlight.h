@@ -79,8 +79,9 @@
    \param color The array in wchich to store the color codes. The first 8 bits are used for fg color, the next 8 bits for bg color. 
    \param pos the cursor position. Used for quote matching, etc.
    \param error a list in which a description of each error will be inserted. May be 0, in whcich case no error descriptions will be generated.
+   \param token Highlighting stops early, leaving the colors incomplete, once this token goes stale.
 */
-void highlight_shell( const wcstring &buffstr, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars );
+void highlight_shell( const wcstring &buffstr, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars, const generation_token_t &token = generation_token_t() );
 
 /**
    Perform syntax highlighting for the text in buff. Matching quotes and paranthesis are highlighted. The result is
@@ -92,7 +93,7 @@ void highlight_shell( const wcstring &buffstr, std::vector<int> &color, int pos,
    \param pos the cursor position. Used for quote matching, etc.
    \param error a list in which a description of each error will be inserted. May be 0, in whcich case no error descriptions will be generated.
 */
-void highlight_universal( const wcstring &buffstr, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars );
+void highlight_universal( const wcstring &buffstr, std::vector<int> &color, int pos, wcstring_list_t *error, const env_vars &vars, const generation_token_t &token = generation_token_t() );
 
 /**
    Translate from HIGHLIGHT_* to FISH_COLOR_* according to environment
@@ -106,6 +107,14 @@ void highlight_universal( const wcstring &buffstr, std::vector<int> &color, int
 */
 rgb_color_t highlight_get_color( int highlight, bool is_background );
 
+/**
+   Returns the name of the variable that the color of the HIGHLIGHT_*
+   value highlight is read from, like fish_color_command. When
+   highlight combines several values, this is the variable of the
+   lowest one, which is also the one highlight_get_color starts from.
+*/
+const wchar_t *highlight_get_color_var( int highlight );
+
 /** Given a command 'str' from the history, try to determine whether we ought to suggest it by specially recognizing the command.
     Returns true if we validated the command. If so, returns by reference whether the suggestion is valid or not.
 */
@@ -115,11 +124,11 @@ bool autosuggest_special_validate_from_history(const wcstring &str, const wcstri
 */
 bool autosuggest_suggest_special(const wcstring &str, const wcstring &working_directory, wcstring &outString);
 
-/* Tests whether the specified string cpath is the prefix of anything we could cd to. directories is a list of possible parent directories (typically either the working directory, or the cdpath). This does I/O!
+/* Tests whether the specified string cpath is the prefix of anything we could cd to. directories is a list of possible parent directories (typically either the working directory, or the cdpath). This does I/O! The test gives up and returns false once token goes stale.
 
     This is used only internally to this file, and is exposed only for testing.
 */
-bool is_potential_path(const wcstring &const_path, const wcstring_list_t &directories, bool require_dir = false, wcstring *out_path = NULL);
+bool is_potential_path(const wcstring &const_path, const wcstring_list_t &directories, bool require_dir = false, wcstring *out_path = NULL, const generation_token_t &token = generation_token_t());
 
 #endif
 
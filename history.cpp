@@ -35,7 +35,20 @@
 
 /*
 
-Our history format is intended to be valid YAML. Here it is:
+Our history is written in a binary format. The file starts with the line
+HISTORY_BINARY_MAGIC, followed by one record per item. All integers are
+little endian, and strings are UTF-8 without a terminator:
+
+  uint32   length of the rest of the record
+  uint64   timestamp
+  uint32   length of the command, followed by the command
+  uint32   number of paths, followed by each path as a uint32 length and the path
+
+Records can be located by hopping over their lengths and decoded without
+any unescaping, and new items are saved by appending records to the file.
+
+We still read the older format, which is intended to be valid YAML.
+Here it is:
 
   - cmd: ssh blah blah blah
     when: 2348237
@@ -44,8 +57,14 @@ Our history format is intended to be valid YAML. Here it is:
       - /path/to/something_else
     
   Newlines are replaced by \n. Backslashes are replaced by \\.
+  A history file in that format is rewritten in the binary format the
+  first time it is saved.
 */
 
+/** The first line of a history file in the binary format */
+static const char HISTORY_BINARY_MAGIC[] = "# fish history, binary version 1\n";
+#define HISTORY_BINARY_MAGIC_LEN (sizeof HISTORY_BINARY_MAGIC - 1)
+
 
 
 /** When we rewrite the history, the number of items we keep */
@@ -54,9 +73,18 @@ Our history format is intended to be valid YAML. Here it is:
 /** Interval in seconds between automatic history save */
 #define SAVE_INTERVAL (5*60)
 
+/** When saving by appending, the number of items in the file at which we rewrite it instead, dropping duplicates and the oldest items */
+#define HISTORY_APPEND_MAX (HISTORY_SAVE_MAX + HISTORY_SAVE_MAX / 4)
+
 /** Number of new history entries to add before automatic history save */
 #define SAVE_COUNT 5
 
+/** Number of seconds after which a file detection batch that hasn't finished is assumed to be stuck, for example on a hung network mount. Commands are then added without waiting for it. */
+#define FILE_DETECTION_TIMEOUT 5
+
+/** Length of the substrings indexed to speed up searches. Searches for shorter terms scan every item. */
+#define HISTORY_INDEX_GRAM_LENGTH 3
+
 /** Whether we print timing information */
 #define LOG_TIMES 0
 
@@ -93,6 +121,7 @@ class history_lru_node_t : public lru_node_t {
     
     bool write_to_file(FILE *f) const;
     bool write_yaml_to_file(FILE *f) const;
+    bool write_binary_to_file(FILE *f) const;
 };
 
 class history_lru_cache_t : public lru_cache_t<history_lru_node_t> {
@@ -169,6 +198,10 @@ bool history_item_t::matches_search(const wcstring &term, enum history_search_ty
             /* We consider equal strings to match a prefix search, so that autosuggest will allow suggesting what you've typed */
             return string_prefixes_string(term, contents);
             
+        case HISTORY_SEARCH_TYPE_FUZZY:
+            /* Like a contains search, equal strings don't match */
+            return contents != term && fuzzy_matcher_t(term).match(contents).type != FUZZY_MATCH_NONE;
+            
         default:
             sanity_lose();
             return false;
@@ -200,6 +233,76 @@ bool history_lru_node_t::write_yaml_to_file(FILE *f) const {
     return true;
 }
 
+static void append_uint32(std::string &out, uint32_t val) {
+    for (size_t i=0; i < 4; i++)
+        out.push_back((char)((val >> (8 * i)) & 0xFF));
+}
+
+static void append_uint64(std::string &out, uint64_t val) {
+    for (size_t i=0; i < 8; i++)
+        out.push_back((char)((val >> (8 * i)) & 0xFF));
+}
+
+static void append_binary_string(std::string &out, const wcstring &str) {
+    const std::string narrow = wcs2string(str);
+    append_uint32(out, (uint32_t)narrow.size());
+    out.append(narrow);
+}
+
+/* Appends the binary record for an item to out */
+static void append_binary_record(std::string &out, const wcstring &cmd, time_t when, const path_list_t &paths) {
+    std::string record;
+    append_uint64(record, (uint64_t)(int64_t)when);
+    append_binary_string(record, cmd);
+    append_uint32(record, (uint32_t)paths.size());
+    for (path_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
+        append_binary_string(record, *iter);
+    }
+    append_uint32(out, (uint32_t)record.size());
+    out.append(record);
+}
+
+/* Output our binary record to a file */
+bool history_lru_node_t::write_binary_to_file(FILE *f) const {
+    std::string record;
+    append_binary_record(record, key, timestamp, required_paths);
+    return fwrite(record.data(), 1, record.size(), f) == record.size();
+}
+
+/* Reads a uint32 at *inout_cursor, which must not pass end, and advances the cursor. Returns false if there's not enough data. */
+static bool read_uint32(const char **inout_cursor, const char *end, uint32_t *out_val) {
+    const unsigned char *cursor = (const unsigned char *)*inout_cursor;
+    if (end - *inout_cursor < 4)
+        return false;
+    *out_val = (uint32_t)cursor[0] | ((uint32_t)cursor[1] << 8) | ((uint32_t)cursor[2] << 16) | ((uint32_t)cursor[3] << 24);
+    *inout_cursor += 4;
+    return true;
+}
+
+static bool read_uint64(const char **inout_cursor, const char *end, uint64_t *out_val) {
+    uint32_t low, high;
+    if (end - *inout_cursor < 8 || ! read_uint32(inout_cursor, end, &low) || ! read_uint32(inout_cursor, end, &high))
+        return false;
+    *out_val = ((uint64_t)high << 32) | low;
+    return true;
+}
+
+static bool read_binary_string(const char **inout_cursor, const char *end, wcstring *out_str) {
+    uint32_t len;
+    if (! read_uint32(inout_cursor, end, &len) || (size_t)(end - *inout_cursor) < len)
+        return false;
+    if (out_str)
+        *out_str = str2wcstring(std::string(*inout_cursor, len));
+    *inout_cursor += len;
+    return true;
+}
+
+/* Returns the type of a history file with the given contents */
+static history_file_type_t infer_file_type(const char *data, size_t len) {
+    if (len >= HISTORY_BINARY_MAGIC_LEN && ! memcmp(data, HISTORY_BINARY_MAGIC, HISTORY_BINARY_MAGIC_LEN))
+        return history_type_binary;
+    return history_type_yaml;
+}
 
 // Parse a timestamp line that looks like this: spaces, "when:", spaces, timestamp, newline
 // The string is NOT null terminated; however we do know it contains a newline, so stop when we reach it
@@ -259,12 +362,8 @@ static const char *next_line(const char *start, size_t length) {
     return nextline;
 }
 
-// Support for iteratively locating the offsets of history items
-// Pass the address and length of a mapped region.
-// Pass a pointer to a cursor size_t, initially 0
-// If custoff_timestamp is nonzero, skip items created at or after that timestamp
-// Returns (size_t)(-1) when done
-static size_t offset_of_next_item(const char *begin, size_t mmap_length, size_t *inout_cursor, time_t cutoff_timestamp)
+// Locate the next item in a mapped YAML history file. See offset_of_next_item.
+static size_t offset_of_next_item_yaml(const char *begin, size_t mmap_length, size_t *inout_cursor, time_t cutoff_timestamp)
 {
     size_t cursor = *inout_cursor;
     size_t result = (size_t)(-1);
@@ -333,6 +432,49 @@ static size_t offset_of_next_item(const char *begin, size_t mmap_length, size_t
     return result;
 }
 
+// Locate the next record in a mapped binary history file. See offset_of_next_item. A truncated record at the end is ignored.
+static size_t offset_of_next_item_binary(const char *begin, size_t mmap_length, size_t *inout_cursor, time_t cutoff_timestamp)
+{
+    size_t cursor = std::max(*inout_cursor, HISTORY_BINARY_MAGIC_LEN);
+    size_t result = (size_t)(-1);
+    const char * const end = begin + mmap_length;
+    while (cursor < mmap_length) {
+        const char *record = begin + cursor;
+        uint32_t record_len;
+        uint64_t timestamp;
+        if (! read_uint32(&record, end, &record_len) || (size_t)(end - record) < record_len) {
+            break;
+        }
+        size_t offset = cursor;
+        cursor = (record - begin) + record_len;
+        
+        /* Skip this item if the timestamp is at or after our cutoff */
+        if (cutoff_timestamp != 0 && read_uint64(&record, record + record_len, &timestamp) && (time_t)(int64_t)timestamp >= cutoff_timestamp)
+            continue;
+        
+        result = offset;
+        break;
+    }
+    *inout_cursor = cursor;
+    return result;
+}
+
+// Support for iteratively locating the offsets of history items
+// Pass the address and length of a mapped region, and the type of the file.
+// Pass a pointer to a cursor size_t, initially 0
+// If custoff_timestamp is nonzero, skip items created at or after that timestamp
+// Returns (size_t)(-1) when done
+static size_t offset_of_next_item(const char *begin, size_t mmap_length, history_file_type_t type, size_t *inout_cursor, time_t cutoff_timestamp)
+{
+    switch (type) {
+        case history_type_yaml: return offset_of_next_item_yaml(begin, mmap_length, inout_cursor, cutoff_timestamp);
+        case history_type_binary: return offset_of_next_item_binary(begin, mmap_length, inout_cursor, cutoff_timestamp);
+        default:
+            sanity_lose();
+            return (size_t)(-1);
+    }
+}
+
 
 history_t & history_t::history_with_name(const wcstring &name) {
     /* Note that histories are currently never deleted, so we can return a reference to them without using something like shared_ptr */
@@ -346,11 +488,15 @@ history_t & history_t::history_with_name(const wcstring &name) {
 history_t::history_t(const wcstring &pname) :
     name(pname),
     unsaved_item_count(0),
+    first_unwritten_new_item(0),
     mmap_start(NULL),
     mmap_length(0),
+    mmap_type(history_type_yaml),
     birth_timestamp(time(NULL)),
     save_timestamp(0),
-    loaded_old(false)
+    loaded_old(false),
+    built_old_item_index(false),
+    compaction_in_progress(false)
 {
     pthread_mutex_init(&lock, NULL);
 }
@@ -426,9 +572,9 @@ void history_t::get_string_representation(wcstring &result, const wcstring &sepa
     
     /* Append old items */
     load_old_if_needed();
-    for (std::deque<size_t>::const_reverse_iterator iter = old_item_offsets.rbegin(); iter != old_item_offsets.rend(); ++iter) {        
+    for (std::vector<uint32_t>::const_reverse_iterator iter = old_item_offsets.rbegin(); iter != old_item_offsets.rend(); ++iter) {        
         size_t offset = *iter;
-        const history_item_t item = history_t::decode_item(mmap_start + offset, mmap_length - offset);
+        const history_item_t item = history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
         if (! first)
             result.append(separator);
         result.append(item.str());
@@ -456,13 +602,197 @@ history_item_t history_t::item_at_index(size_t idx) {
     if (idx < old_item_count) {
         /* idx=0 corresponds to last item in old_item_offsets */
         size_t offset = old_item_offsets.at(old_item_count - idx - 1);
-        return history_t::decode_item(mmap_start + offset, mmap_length - offset);
+        return history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
     }
     
     /* Index past the valid range, so return an empty history item */
     return history_item_t(wcstring(), 0);
 }
 
+/** Returns the approximate number of bytes used by the specified items */
+static size_t items_memory_usage(const std::vector<history_item_t> &items) {
+    size_t result = items.capacity() * sizeof(history_item_t);
+    for (std::vector<history_item_t>::const_iterator iter = items.begin(); iter != items.end(); ++iter) {
+        result += memory_usage_of(iter->str());
+        const path_list_t &paths = iter->get_required_paths();
+        result += paths.capacity() * sizeof(wcstring);
+        for (path_list_t::const_iterator path = paths.begin(); path != paths.end(); ++path) {
+            result += memory_usage_of(*path);
+        }
+    }
+    return result;
+}
+
+void history_t::memory_usage(memory_usage_t &usage) {
+    size_t items = 0, mapped = 0, offsets = 0, index = 0;
+    scoped_lock locker(hist_lock);
+    for (std::map<wcstring, history_t *>::const_iterator iter = histories.begin(); iter != histories.end(); ++iter) {
+        history_t *history = iter->second;
+        scoped_lock history_locker(history->lock);
+        items += items_memory_usage(history->new_items) + items_memory_usage(history->deleted_items);
+        mapped += history->mmap_length;
+        offsets += history->old_item_offsets.capacity() * sizeof(uint32_t);
+        for (trigram_index_t::const_iterator trigram = history->old_item_index.begin(); trigram != history->old_item_index.end(); ++trigram) {
+            index += sizeof *trigram + 4 * sizeof(void *) + trigram->second.capacity() * sizeof(uint32_t);
+        }
+    }
+    usage.push_back(memory_usage_t::value_type(L"history new items", items));
+    usage.push_back(memory_usage_t::value_type(L"history file mapping", mapped));
+    usage.push_back(memory_usage_t::value_type(L"history old item offsets", offsets));
+    usage.push_back(memory_usage_t::value_type(L"history search index", index));
+}
+
+size_t history_t::size() {
+    scoped_lock locker(lock);
+    load_old_if_needed();
+    return new_items.size() + old_item_offsets.size();
+}
+
+/* A view of the command of an item in a mapped binary history file. It can be matched against a search term, converted with wcs2string, without decoding the item. */
+class history_item_view_t {
+    const char *cmd;
+    size_t cmd_len;
+    
+    public:
+    history_item_view_t() : cmd(NULL), cmd_len(0)
+    {
+    }
+    
+    /* Points the view at the record at base. Returns false if the record is malformed. */
+    bool init(const char *base, size_t len) {
+        const char *cursor = base, *end = base + len;
+        uint32_t record_len, str_len;
+        uint64_t when;
+        if (! read_uint32(&cursor, end, &record_len) || (size_t)(end - cursor) < record_len)
+            return false;
+        end = cursor + record_len;
+        if (! read_uint64(&cursor, end, &when) || ! read_uint32(&cursor, end, &str_len) || (size_t)(end - cursor) < str_len)
+            return false;
+        cmd = cursor;
+        cmd_len = str_len;
+        return true;
+    }
+    
+    const char *data() const { return cmd; }
+    size_t size() const { return cmd_len; }
+    
+    /* Same as history_item_t::matches_search, on the narrow strings. Fuzzy searches are not done on them. */
+    bool matches_search(const std::string &narrow_term, enum history_search_type_t type) const {
+        switch (type) {
+            case HISTORY_SEARCH_TYPE_CONTAINS:
+                return cmd_len > narrow_term.size() && std::search(cmd, cmd + cmd_len, narrow_term.begin(), narrow_term.end()) != cmd + cmd_len;
+                
+            case HISTORY_SEARCH_TYPE_PREFIX:
+                return cmd_len >= narrow_term.size() && ! memcmp(cmd, narrow_term.data(), narrow_term.size());
+                
+            default:
+                sanity_lose();
+                return false;
+        }
+    }
+};
+
+bool history_t::item_at_index_matches_search(size_t idx, const wcstring &term, const std::string &narrow_term, enum history_search_type_t type, bool *out_past_end) {
+    scoped_lock locker(lock);
+    *out_past_end = false;
+    
+    /* 0 is considered an invalid index */
+    assert(idx > 0);
+    idx--;
+    
+    size_t new_item_count = new_items.size();
+    if (idx < new_item_count) {
+        return new_items.at(new_item_count - idx - 1).matches_search(term, type);
+    }
+    
+    idx -= new_item_count;
+    load_old_if_needed();
+    size_t old_item_count = old_item_offsets.size();
+    if (idx >= old_item_count) {
+        *out_past_end = true;
+        return false;
+    }
+    
+    size_t offset = old_item_offsets.at(old_item_count - idx - 1);
+    /* Fuzzy matching folds case, which needs the wide characters */
+    if (mmap_type == history_type_binary && type != HISTORY_SEARCH_TYPE_FUZZY) {
+        history_item_view_t view;
+        return view.init(mmap_start + offset, mmap_length - offset) && view.matches_search(narrow_term, type);
+    }
+    return history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type).matches_search(term, type);
+}
+
+/* Returns the index key for the trigram starting at str */
+static uint32_t trigram_key(const char *str) {
+    const unsigned char *ustr = (const unsigned char *)str;
+    return ((uint32_t)ustr[0] << 16) | ((uint32_t)ustr[1] << 8) | ustr[2];
+}
+
+/* Adds the trigrams of a narrow string to the index, for the item at the given position */
+static void index_trigrams(std::map<uint32_t, std::vector<uint32_t> > &index, const char *str, size_t len, uint32_t pos) {
+    for (size_t j=0; j + HISTORY_INDEX_GRAM_LENGTH <= len; j++) {
+        std::vector<uint32_t> &positions = index[trigram_key(str + j)];
+        if (positions.empty() || positions.back() != pos)
+            positions.push_back(pos);
+    }
+}
+
+void history_t::build_old_item_index(void) {
+    ASSERT_IS_LOCKED(lock);
+    time_profiler_t profiler("build_old_item_index");
+    old_item_index.clear();
+    for (size_t i=0; i < old_item_offsets.size(); i++) {
+        size_t offset = old_item_offsets.at(i);
+        if (mmap_type == history_type_binary) {
+            /* Index the command directly from the file */
+            history_item_view_t view;
+            if (view.init(mmap_start + offset, mmap_length - offset))
+                index_trigrams(old_item_index, view.data(), view.size(), (uint32_t)i);
+        } else {
+            const std::string narrow = wcs2string(history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type).str());
+            index_trigrams(old_item_index, narrow.data(), narrow.size(), (uint32_t)i);
+        }
+    }
+    built_old_item_index = true;
+}
+
+size_t history_t::next_possible_match(size_t idx, const std::string &narrow_term) {
+    scoped_lock locker(lock);
+    
+    /* New items are not indexed, and short terms have no trigrams */
+    size_t next = idx + 1;
+    size_t new_item_count = new_items.size();
+    if (next <= new_item_count || narrow_term.size() < HISTORY_INDEX_GRAM_LENGTH)
+        return next;
+    
+    load_old_if_needed();
+    if (! built_old_item_index)
+        build_old_item_index();
+    
+    size_t old_item_count = old_item_offsets.size();
+    size_t past_end = new_item_count + old_item_count + 1;
+    if (next >= past_end)
+        return next;
+    
+    /* Every item containing term contains all of its trigrams, so use the trigram that appears in the fewest items */
+    const std::vector<uint32_t> *candidates = NULL;
+    for (size_t i=0; i + HISTORY_INDEX_GRAM_LENGTH <= narrow_term.size(); i++) {
+        trigram_index_t::const_iterator iter = old_item_index.find(trigram_key(narrow_term.data() + i));
+        if (iter == old_item_index.end())
+            return past_end;
+        if (candidates == NULL || iter->second.size() < candidates->size())
+            candidates = &iter->second;
+    }
+    
+    /* The index of the item at position pos in old_item_offsets is new_item_count + old_item_count - pos. Find the last candidate at or before the position of next. */
+    uint32_t max_pos = (uint32_t)(new_item_count + old_item_count - next);
+    std::vector<uint32_t>::const_iterator where = std::upper_bound(candidates->begin(), candidates->end(), max_pos);
+    if (where == candidates->begin())
+        return past_end;
+    --where;
+    return new_item_count + old_item_count - *where;
+}
+
 /* Read one line, stripping off any newline, and updating cursor. Note that our input string is NOT null terminated; it's just a memory mapped file. */
 static size_t read_line(const char *base, size_t cursor, size_t len, std::string &result) {
     /* Locate the newline */
@@ -508,7 +838,36 @@ static bool extract_prefix(std::string &key, std::string &value, const std::stri
     return where != std::string::npos;
 }
 
-history_item_t history_t::decode_item(const char *base, size_t len) {
+history_item_t history_t::decode_item(const char *base, size_t len, history_file_type_t type) {
+    switch (type) {
+        case history_type_yaml: return decode_item_yaml(base, len);
+        case history_type_binary: return decode_item_binary(base, len);
+        default:
+            sanity_lose();
+            return history_item_t(wcstring(), 0);
+    }
+}
+
+history_item_t history_t::decode_item_binary(const char *base, size_t len) {
+    const char *cursor = base, *end = base + len;
+    uint32_t record_len, path_count;
+    uint64_t when = 0;
+    wcstring cmd;
+    path_list_t paths;
+    
+    if (read_uint32(&cursor, end, &record_len) && (size_t)(end - cursor) >= record_len) {
+        end = cursor + record_len;
+        if (read_uint64(&cursor, end, &when) && read_binary_string(&cursor, end, &cmd) && read_uint32(&cursor, end, &path_count)) {
+            wcstring path;
+            while (path_count-- && read_binary_string(&cursor, end, &path)) {
+                paths.push_back(path);
+            }
+        }
+    }
+    return history_item_t(cmd, (time_t)(int64_t)when, paths);
+}
+
+history_item_t history_t::decode_item_yaml(const char *base, size_t len) {
     wcstring cmd;
     time_t when = 0;
     path_list_t paths;
@@ -568,13 +927,11 @@ history_item_t history_t::decode_item(const char *base, size_t len) {
                 /* Skip the leading dash-space and then store this path it */
                 line.erase(0, 2);
                 unescape_yaml(line);
-                paths.push_front(str2wcstring(line));
+                paths.push_back(str2wcstring(line));
             }
         }
     }
-    /* Reverse the paths, since we pushed them to the front each time */
 done:
-    paths.reverse();
     return history_item_t(cmd, when, paths);
     
 }
@@ -583,14 +940,17 @@ void history_t::populate_from_mmap(void)
 {
     size_t cursor = 0;
     for (;;) {
-        size_t offset = offset_of_next_item(mmap_start, mmap_length, &cursor, birth_timestamp);
-        // If we get back -1, we're done
-        if (offset == (size_t)(-1))
+        size_t offset = offset_of_next_item(mmap_start, mmap_length, mmap_type, &cursor, birth_timestamp);
+        // If we get back -1, we're done. Items beyond what a 32 bit offset can reach are dropped.
+        if (offset == (size_t)(-1) || offset > UINT32_MAX)
             break;
 
         // Remember this item
-        old_item_offsets.push_back(offset);        
+        old_item_offsets.push_back((uint32_t)offset);
     }
+    
+    // Release the slack left by growing the vector
+    std::vector<uint32_t>(old_item_offsets).swap(old_item_offsets);
 }
 
 // Do a private, read-only map of the entirety of a history file with the given name. Returns true if successful. Returns the mapped memory region by reference.
@@ -637,6 +997,7 @@ bool history_t::load_old_if_needed(void)
     if (map_file(name, &mmap_start, &mmap_length)) {
         // Here we've mapped the file
         ok = true;
+        mmap_type = infer_file_type(mmap_start, mmap_length);
         time_profiler_t profiler("populate_from_mmap");
         this->populate_from_mmap();
     } 
@@ -667,23 +1028,31 @@ bool history_search_t::go_backwards() {
     /* Backwards means increasing our index */
     const size_t max_idx = (size_t)(-1);
 
-    size_t idx = 0;
+    size_t idx = start_index;
     if (! prev_matches.empty())
         idx = prev_matches.back().first;
     
     if (idx == max_idx)
         return false;
         
-    while (++idx < max_idx) {
-        const history_item_t item = history->item_at_index(idx);
-        /* We're done if it's empty */
-        if (item.empty()) {
-            return false;
+    /* Skip items that the history's index says can't match, and only decode items that do match */
+    const std::string narrow_term = wcs2string(term);
+    bool past_end = false;
+    
+    /* The trigrams of the term need not appear in fuzzy matches, so don't let the index skip anything then */
+    const std::string index_term = (search_type == HISTORY_SEARCH_TYPE_FUZZY ? std::string() : narrow_term);
+    while ((idx = history->next_possible_match(idx, index_term)) < max_idx) {
+        if (! history->item_at_index_matches_search(idx, term, narrow_term, search_type, &past_end)) {
+            /* We're done if we ran out of items */
+            if (past_end)
+                return false;
+            continue;
         }
 
-        /* Look for a term that matches and that we haven't seen before */
+        /* Look for a term that we haven't seen before */
+        const history_item_t item = history->item_at_index(idx);
         const wcstring &str = item.str();
-        if (item.matches_search(term, search_type) && ! match_already_made(str) && ! should_skip_match(str)) {
+        if (! match_already_made(str) && ! should_skip_match(str)) {
             prev_matches.push_back(prev_match_t(idx, item));
             return true;
         }
@@ -720,6 +1089,11 @@ wcstring history_search_t::current_string() const {
     return item.str();
 }
 
+size_t history_search_t::current_index() const {
+    assert(! prev_matches.empty());
+    return prev_matches.back().first;
+}
+
 bool history_search_t::match_already_made(const wcstring &match) const {
     for (std::deque<prev_match_t>::const_iterator iter = prev_matches.begin(); iter != prev_matches.end(); ++iter) {
         if (iter->second.str() == match)
@@ -789,60 +1163,117 @@ void history_t::clear_file_state()
     mmap_length = 0;
     loaded_old = false;
     old_item_offsets.clear();
+    old_item_index.clear();
+    built_old_item_index = false;
     save_timestamp=time(0);
 }
 
 void history_t::compact_new_items() {
-    /* Keep only the most recent items with the given contents. This algorithm could be made more efficient, but likely would consume more memory too. */
-    std::set<wcstring> seen;
+    /* Keep only the most recent items with the given contents. Walk from the most recent item, keeping the items whose contents we haven't seen yet, and then put the survivors back in order. */
+    wcstring_hash_set_t seen;
+    std::vector<history_item_t> compacted;
+    compacted.reserve(new_items.size());
     size_t idx = new_items.size();
     while (idx--) {
         const history_item_t &item = new_items[idx];
-        if (! seen.insert(item.contents).second) {
-            // This item was not inserted because it was already in the set, so delete the item at this index
-            new_items.erase(new_items.begin() + idx);
-        }
+        if (seen.insert(item.contents).second)
+            compacted.push_back(item);
     }
+    std::reverse(compacted.begin(), compacted.end());
+    new_items.swap(compacted);
 }
 
-/** Save the specified mode to file */
-void history_t::save_internal()
+bool history_t::save_internal_via_appending(bool *out_needs_compaction)
 {
-    /* This must be called while locked */
     ASSERT_IS_LOCKED(lock);
     
-    /* Nothing to do if there's no new items */
-    if (new_items.empty() && deleted_items.empty())
-        return;
-        
-    /* Compact our new items so we don't have duplicates */
-    this->compact_new_items();
+    const wcstring filename = history_filename(name, L"");
+    if (filename.empty())
+        return false;
     
-	bool ok = true;
+    /* Check that the file is in the binary format and ends with a complete record, and whether it has grown big enough to compact */
+    const char *local_mmap_start = NULL;
+    size_t local_mmap_size = 0;
+    if (! map_file(name, &local_mmap_start, &local_mmap_size))
+        return false;
+    
+    bool appendable = (infer_file_type(local_mmap_start, local_mmap_size) == history_type_binary);
+    size_t cursor = 0, item_count = 0;
+    while (appendable && offset_of_next_item_binary(local_mmap_start, local_mmap_size, &cursor, 0) != (size_t)(-1)) {
+        item_count++;
+    }
+    *out_needs_compaction = (item_count >= HISTORY_APPEND_MAX);
+    if (cursor != local_mmap_size)
+        appendable = false;
+    munmap((void *)local_mmap_start, local_mmap_size);
+    if (! appendable)
+        return false;
+    
+    /* Write all the records at once, so that concurrent appends from other sessions don't interleave with ours */
+    std::string records;
+    for (size_t i = first_unwritten_new_item; i < new_items.size(); i++) {
+        const history_item_t &item = new_items.at(i);
+        append_binary_record(records, item.str(), item.timestamp(), item.get_required_paths());
+    }
+    
+    int fd = wopen_cloexec(filename, O_WRONLY | O_APPEND);
+    if (fd < 0)
+        return false;
     
-    wcstring tmp_name = history_filename(name, L".tmp");    
+    signal_block();
+    bool ok = (write_loop(fd, records.data(), records.size()) >= 0);
+    signal_unblock();
+    
+    if (close(fd) != 0)
+        ok = false;
+    if (! ok)
+        debug( 2, L"Error when appending to history file" );
+    return ok;
+}
+
+bool history_t::rewrite_file(const wcstring &name, const std::vector<history_item_t> &new_items, const std::vector<history_item_t> &deleted_items)
+{
+	bool ok = false;
+    
+    /* Use a temporary file of our own, since other sessions may be rewriting the file at the same time */
+    wcstring tmp_name = history_filename(name, format_string(L".tmp.%d", (int)getpid()));
 	if( ! tmp_name.empty() )
 	{        
         /* Make an LRU cache to save only the last N elements */
         history_lru_cache_t lru(HISTORY_SAVE_MAX);
         
+        /* Hash the deleted items, so every old item can be checked quickly */
+        wcstring_hash_set_t deleted;
+        for (std::vector<history_item_t>::const_iterator iter = deleted_items.begin(); iter != deleted_items.end(); ++iter) {
+            deleted.insert(iter->str());
+        }
+        
         /* Insert old items in, from old to new. Merge them with our new items, inserting items with earlier timestamps first. */
         std::vector<history_item_t>::const_iterator new_item_iter = new_items.begin();
         
+        /* Note which file we read, and how much of it, so we can pick up items that other sessions append while we work */
+        const wcstring filename = history_filename(name, L"");
+        struct stat read_stat = {};
+        bool read_binary = false;
+        size_t read_length = 0;
+        
         /* Map in existing items (which may have changed out from underneath us, so don't trust our old mmap'd data) */
         const char *local_mmap_start = NULL;
         size_t local_mmap_size = 0;
-        if (map_file(name, &local_mmap_start, &local_mmap_size)) {
+        if (wstat(filename, &read_stat) == 0 && map_file(name, &local_mmap_start, &local_mmap_size)) {
+            const history_file_type_t local_mmap_type = infer_file_type(local_mmap_start, local_mmap_size);
+            read_binary = (local_mmap_type == history_type_binary);
+            read_length = local_mmap_size;
             size_t cursor = 0;
             for (;;) {
-                size_t offset = offset_of_next_item(local_mmap_start, local_mmap_size, &cursor, 0);
+                size_t offset = offset_of_next_item(local_mmap_start, local_mmap_size, local_mmap_type, &cursor, 0);
                 /* If we get back -1, we're done */
                 if (offset == (size_t)(-1))
                     break;
 
                 /* Try decoding an old item */
-                const history_item_t old_item = history_t::decode_item(local_mmap_start + offset, local_mmap_size - offset);
-                if (old_item.empty() || is_deleted(old_item))
+                const history_item_t old_item = history_t::decode_item(local_mmap_start + offset, local_mmap_size - offset, local_mmap_type);
+                if (old_item.empty() || deleted.count(old_item.str()))
                 {
 //                    debug(0, L"Item is deleted : %s\n", old_item.str().c_str());
                     continue;
@@ -869,21 +1300,30 @@ void history_t::save_internal()
         {
             lru.add_item(*new_item_iter);
         }
-                
-        signal_block();
     
         FILE *out;
 		if( (out=wfopen( tmp_name, "w" ) ) )
 		{
             /* Write them out */
-            for (history_lru_cache_t::iterator iter = lru.begin(); iter != lru.end(); ++iter) {
+            ok = (fputs(HISTORY_BINARY_MAGIC, out) >= 0);
+            for (history_lru_cache_t::iterator iter = lru.begin(); ok && iter != lru.end(); ++iter) {
                 const history_lru_node_t *node = *iter;
-                if (! node->write_yaml_to_file(out)) {
+                if (! node->write_binary_to_file(out)) {
                     ok = false;
                     break;
                 }
             }
             
+            /* Carry over the records that were appended to the same file since we read it */
+            struct stat tail_stat = {};
+            if (ok && read_binary && wstat(filename, &tail_stat) == 0 && tail_stat.st_dev == read_stat.st_dev && tail_stat.st_ino == read_stat.st_ino && map_file(name, &local_mmap_start, &local_mmap_size)) {
+                if (local_mmap_size > read_length) {
+                    size_t tail_length = local_mmap_size - read_length;
+                    ok = (fwrite(local_mmap_start + read_length, 1, tail_length, out) == tail_length);
+                }
+                munmap((void *)local_mmap_start, local_mmap_size);
+            }
+            
 			if( fclose( out ) || !ok )
 			{
 				/*
@@ -891,26 +1331,94 @@ void history_t::save_internal()
 				  be shown by default.
 				*/
 				debug( 2, L"Error when writing history file" );
+                ok = false;
+                wunlink(tmp_name);
 			}
 			else
 			{
-                wcstring new_name = history_filename(name, wcstring());
-				wrename(tmp_name, new_name);
+				wrename(tmp_name, filename);
 			}
 		}
         
-        signal_unblock();
-        
         /* Make sure we clear all nodes, since this doesn't happen automatically */
         lru.evict_all_nodes();
-        
-        /* We've saved everything, so we have no more unsaved items */
+	}
+    return ok;
+}
+
+/* Context for compacting a history file on a background thread */
+struct history_compaction_context_t {
+    history_t *history;
+    wcstring name;
+};
+
+int history_t::threaded_compact(history_compaction_context_t *ctx)
+{
+    /* Everything we've saved is already in the file, so there's nothing to merge in */
+    return history_t::rewrite_file(ctx->name, std::vector<history_item_t>(), std::vector<history_item_t>());
+}
+
+void history_t::compaction_completed(history_compaction_context_t *ctx, int result)
+{
+    ctx->history->compaction_in_progress = false;
+    delete ctx;
+}
+
+/** Whether we're saving history for the last time. We don't start compacting then, since we'd never wait for it. */
+static bool s_saving_at_exit = false;
+
+void history_t::compact_in_background()
+{
+    ASSERT_IS_LOCKED(lock);
+    if (compaction_in_progress || s_saving_at_exit || ! is_main_thread())
+        return;
+    
+    compaction_in_progress = true;
+    history_compaction_context_t *ctx = new history_compaction_context_t();
+    ctx->history = this;
+    ctx->name = name;
+    iothread_perform(threaded_compact, compaction_completed, ctx, IOTHREAD_PRIORITY_BACKGROUND);
+}
+
+/** Save the specified mode to file */
+void history_t::save_internal()
+{
+    /* This must be called while locked */
+    ASSERT_IS_LOCKED(lock);
+    
+    /* Nothing to do if there's no new items */
+    if (first_unwritten_new_item >= new_items.size() && deleted_items.empty())
+        return;
+    
+    /* Usually we just append our new items. Deleted items can only be removed by rewriting the file. */
+    bool needs_compaction = false;
+    if (deleted_items.empty() && this->save_internal_via_appending(&needs_compaction))
+    {
+        first_unwritten_new_item = new_items.size();
         unsaved_item_count = 0;
-	}	
+        this->clear_file_state();
+        
+        /* If the file has grown too much, rewrite it without blocking the user */
+        if (needs_compaction)
+            this->compact_in_background();
+        return;
+    }
+    
+    /* Compact our new items so we don't have duplicates. This invalidates first_unwritten_new_item, so if the rewrite fails, append them all next time. */
+    this->compact_new_items();
+    first_unwritten_new_item = 0;
+    
+    signal_block();
+    bool ok = history_t::rewrite_file(name, new_items, deleted_items);
+    signal_unblock();
+    
+    /* Don't retry on every new item if we failed */
+    unsaved_item_count = 0;
 
 	if( ok )
 	{
 		/* Our history has been written to the file, so clear our state so we can re-reference the file. */
+        first_unwritten_new_item = new_items.size();
 		this->clear_file_state();
 	}
 }
@@ -925,6 +1433,7 @@ void history_t::clear(void) {
     new_items.clear();
     deleted_items.clear();
     unsaved_item_count = 0;
+    first_unwritten_new_item = 0;
     old_item_offsets.clear();
     wcstring filename = history_filename(name, L"");
     if (! filename.empty())
@@ -941,6 +1450,7 @@ void history_init()
 void history_destroy()
 {
     /* Save all histories */
+    s_saving_at_exit = true;
     for (std::map<wcstring, history_t *>::iterator iter = histories.begin(); iter != histories.end(); ++iter) {
         iter->second->save();
     }
@@ -961,7 +1471,7 @@ int file_detection_context_t::perform_file_detection(bool test_all) {
     for (path_list_t::const_iterator iter = potential_paths.begin(); iter != potential_paths.end(); ++iter) {    
         if (path_is_valid(*iter, working_directory)) {
             /* Push the original (possibly relative) path */
-            valid_paths.push_front(*iter);
+            valid_paths.push_back(*iter);
         } else {
             /* Not a valid path */
             result = 0;
@@ -969,7 +1479,6 @@ int file_detection_context_t::perform_file_detection(bool test_all) {
                 break;
         }
     }
-    valid_paths.reverse();
     return result;
 }
 
@@ -986,18 +1495,98 @@ file_detection_context_t::file_detection_context_t(history_t *hist, const wcstri
 {
 }
 
-static int threaded_perform_file_detection(file_detection_context_t *ctx) {
+/* File detection runs as one batch at a time. Commands wait in the queue while a batch runs, and the next batch takes all of them, so a slow or hung file system ties up at most one thread. */
+typedef std::vector<file_detection_context_t *> file_detection_batch_t;
+
+/* Contexts waiting for the next batch. Only accessed on the main thread. */
+static file_detection_batch_t s_file_detection_queue;
+
+/* Whether a batch is running, and when it started. Only accessed on the main thread. */
+static bool s_file_detection_running = false;
+static time_t s_file_detection_start = 0;
+
+/* Results shared by the paths tested in one batch: whether each absolute path exists, and whether each directory exists. A batch is short lived, so the results don't go stale. */
+struct file_detection_cache_t {
+    std::map<wcstring, bool> paths;
+    std::map<wcstring, bool> directories;
+};
+
+/* Like path_is_valid, but looks in the cache first. A path in a directory that doesn't exist is invalid without testing it. */
+static bool path_is_valid_cached(const wcstring &path, const wcstring &working_directory, file_detection_cache_t &cache) {
+    if (path.empty() || path == L"." || path == L"./" || path == L".." || path == L"../")
+        return path_is_valid(path, working_directory);
+    
+    const wcstring absolute = (path.at(0) == L'/') ? path : working_directory + path;
+    std::map<wcstring, bool>::const_iterator known = cache.paths.find(absolute);
+    if (known != cache.paths.end())
+        return known->second;
+    
+    const size_t slash = absolute.find_last_of(L'/');
+    const wcstring directory = (slash == wcstring::npos || slash == 0) ? wcstring() : absolute.substr(0, slash);
+    std::map<wcstring, bool>::const_iterator dir = cache.directories.find(directory);
+    bool valid = false;
+    if (dir == cache.directories.end() || dir->second) {
+        valid = (0 == waccess(absolute.c_str(), F_OK));
+        if (! valid && errno == ENOENT && ! directory.empty() && dir == cache.directories.end())
+            cache.directories[directory] = (0 == waccess(directory.c_str(), F_OK));
+    }
+    cache.paths[absolute] = valid;
+    return valid;
+}
+
+static int threaded_perform_file_detection(file_detection_batch_t *batch) {
     ASSERT_IS_BACKGROUND_THREAD();
-    assert(ctx != NULL);
-    return ctx->perform_file_detection(true /* test all */);
+    file_detection_cache_t cache;
+    for (file_detection_batch_t::iterator iter = batch->begin(); iter != batch->end(); ++iter) {
+        file_detection_context_t *ctx = *iter;
+        ctx->valid_paths.clear();
+        for (path_list_t::const_iterator path = ctx->potential_paths.begin(); path != ctx->potential_paths.end(); ++path) {
+            if (path_is_valid_cached(*path, ctx->working_directory, cache))
+                ctx->valid_paths.push_back(*path);
+        }
+    }
+    return 1;
+}
+
+/* Adds the commands of the contexts to their histories and deletes the contexts */
+static void add_detected_items(file_detection_batch_t &batch) {
+    for (file_detection_batch_t::iterator iter = batch.begin(); iter != batch.end(); ++iter) {
+        file_detection_context_t *ctx = *iter;
+        ctx->history->add(ctx->command, ctx->valid_paths);
+        delete ctx;
+    }
+    batch.clear();
 }
 
-static void perform_file_detection_done(file_detection_context_t *ctx, int success) {
-    /* Now that file detection is done, create the history item */
-    ctx->history->add(ctx->command, ctx->valid_paths);
+static void perform_file_detection_done(file_detection_batch_t *batch, int success);
+
+/* Starts a batch with the waiting contexts, unless one is running. If the running batch looks stuck, the waiting commands are added without their paths instead. */
+static void start_file_detection(void) {
+    ASSERT_IS_MAIN_THREAD();
+    if (s_file_detection_queue.empty())
+        return;
     
-    /* Done with the context. */
-    delete ctx;
+    if (s_file_detection_running) {
+        if (time(NULL) - s_file_detection_start >= FILE_DETECTION_TIMEOUT)
+            add_detected_items(s_file_detection_queue);
+        return;
+    }
+    
+    file_detection_batch_t *batch = new file_detection_batch_t;
+    batch->swap(s_file_detection_queue);
+    s_file_detection_running = true;
+    s_file_detection_start = time(NULL);
+    iothread_perform(threaded_perform_file_detection, perform_file_detection_done, batch, IOTHREAD_PRIORITY_BACKGROUND);
+}
+
+static void perform_file_detection_done(file_detection_batch_t *batch, int success) {
+    /* Now that file detection is done, create the history items */
+    add_detected_items(*batch);
+    delete batch;
+    
+    /* Run the commands that arrived in the meantime */
+    s_file_detection_running = false;
+    start_file_detection();
 }
 
 static bool string_could_be_path(const wcstring &potential_path) {
@@ -1023,7 +1612,7 @@ void history_t::add_with_file_detection(const wcstring &str)
             if (token_cstr) {
                 wcstring potential_path = token_cstr;
                 if (unescape_string(potential_path, false) && string_could_be_path(potential_path)) {
-                    potential_paths.push_front(potential_path);
+                    potential_paths.push_back(potential_path);
                 }
             }
         }
@@ -1034,10 +1623,10 @@ void history_t::add_with_file_detection(const wcstring &str)
         /* We have some paths. Make a context. */
         file_detection_context_t *context = new file_detection_context_t(this, str);
                         
-        /* Store the potential paths. Reverse them to put them in the same order as in the command. */
-        potential_paths.reverse();
+        /* Store the potential paths, in the same order as in the command */
         context->potential_paths.swap(potential_paths);
-        iothread_perform(threaded_perform_file_detection, perform_file_detection_done, context);
+        s_file_detection_queue.push_back(context);
+        start_file_detection();
     }
 }
 
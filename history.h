@@ -6,23 +6,38 @@
 #define FISH_HISTORY_H
 
 #include <wchar.h>
+#include <stdint.h>
 #include "common.h"
 #include "pthread.h"
 #include <vector>
 #include <deque>
 #include <utility>
-#include <list>
 #include <tr1/memory>
 #include <set>
+#include <map>
+#include <tr1/unordered_set>
 
-typedef std::list<wcstring> path_list_t;
+typedef std::vector<wcstring> path_list_t;
+
+typedef std::tr1::unordered_set<wcstring> wcstring_hash_set_t;
+
+struct history_compaction_context_t;
+
+/** The formats a history file may be in */
+enum history_file_type_t {
+    history_type_yaml,
+    history_type_binary
+};
 
 enum history_search_type_t {
     /** The history searches for strings containing the given string */
     HISTORY_SEARCH_TYPE_CONTAINS,
     
     /** The history searches for strings starting with the given string */
-    HISTORY_SEARCH_TYPE_PREFIX
+    HISTORY_SEARCH_TYPE_PREFIX,
+    
+    /** The history searches for strings containing the characters of the given string in the same order, ignoring case, as fuzzy_matcher_t matches them */
+    HISTORY_SEARCH_TYPE_FUZZY
 };
 
 class history_item_t {
@@ -107,11 +122,17 @@ private:
 	/** How many items we've added without saving */
 	size_t unsaved_item_count;
     
+    /** Index in new_items of the first item that hasn't been written to the file */
+    size_t first_unwritten_new_item;
+    
 	/** The mmaped region for the history file */
 	const char *mmap_start;
 
 	/** The size of the mmaped region */
 	size_t mmap_length;
+    
+    /** The format of the mmaped file */
+    history_file_type_t mmap_type;
 
     /** Timestamp of when this history was created */
     const time_t birth_timestamp;
@@ -119,22 +140,48 @@ private:
 	/** Timestamp of last save */
 	time_t save_timestamp;
     
-    static history_item_t decode_item(const char *ptr, size_t len);
+    static history_item_t decode_item(const char *ptr, size_t len, history_file_type_t type);
+    static history_item_t decode_item_yaml(const char *ptr, size_t len);
+    static history_item_t decode_item_binary(const char *ptr, size_t len);
     
     void populate_from_mmap(void);
     
-    /** List of old items, as offsets into out mmap data */
-    std::deque<size_t> old_item_offsets;
+    /** List of old items, as offsets into out mmap data. Offsets take 32 bits, since there are many of them and history files stay far smaller than 4GB. */
+    std::vector<uint32_t> old_item_offsets;
     
     /** Whether we've loaded old items */
     bool loaded_old;
     
+    /** Index from each trigram of the narrow (wcs2string) contents to the positions in old_item_offsets of the old items containing it, in increasing order. Built lazily by searches. */
+    typedef std::map<uint32_t, std::vector<uint32_t> > trigram_index_t;
+    trigram_index_t old_item_index;
+    
+    /** Whether old_item_index has been built */
+    bool built_old_item_index;
+    
+    /** Builds old_item_index from the old items */
+    void build_old_item_index(void);
+    
     /** Loads old if necessary */
     bool load_old_if_needed(void);
     
     /** Deletes duplicates in new_items. */
     void compact_new_items();
     
+    /** Saves history by appending the unwritten new items to the file. Returns false if the file has to be rewritten instead. Sets *out_needs_compaction if the file has grown enough that it should be rewritten soon. */
+    bool save_internal_via_appending(bool *out_needs_compaction);
+    
+    /** Rewrites the named history file, merging in new_items and dropping deleted_items, duplicates, and the oldest items beyond HISTORY_SAVE_MAX. Does not touch any history_t, so this can run on a background thread. Returns true on success. */
+    static bool rewrite_file(const wcstring &name, const std::vector<history_item_t> &new_items, const std::vector<history_item_t> &deleted_items);
+    
+    /** Whether a background compaction of our file is running */
+    bool compaction_in_progress;
+    
+    /** Starts rewriting our file on a background thread, unless that's already happening */
+    void compact_in_background();
+    static int threaded_compact(history_compaction_context_t *ctx);
+    static void compaction_completed(history_compaction_context_t *ctx, int result);
+    
     /** Saves history */
     void save_internal();
         
@@ -163,7 +210,19 @@ public:
     /** Return the specified history at the specified index. 0 is the index of the current commandline. (So the most recent item is at index 1.) */
     history_item_t item_at_index(size_t idx);
 
+    /** Returns the number of items, which is the largest valid index for item_at_index. Old items are counted without being decoded. */
+    size_t size();
+
+    /** Appends the memory used by all histories to usage */
+    static void memory_usage(memory_usage_t &usage);
+
     bool is_deleted(const history_item_t &item) const;
+    
+    /** Returns the smallest index greater than idx whose item may contain narrow_term (a search term converted with wcs2string), skipping old items that the trigram index rules out. The result may be past the last item. */
+    size_t next_possible_match(size_t idx, const std::string &narrow_term);
+    
+    /** Returns whether the item at the specified index matches a search for term. narrow_term is term converted with wcs2string. Old items in the binary format are matched against the mapped file, without decoding them. Sets *out_past_end if there is no item at the index. */
+    bool item_at_index_matches_search(size_t idx, const wcstring &term, const std::string &narrow_term, enum history_search_type_t type, bool *out_past_end);
 };
 
 class history_search_t {
@@ -187,6 +246,9 @@ class history_search_t {
     /** Additional strings to skip (sorted) */
     wcstring_list_t external_skips;
     
+    /** Index of the item that searching backwards from the end starts after */
+    size_t start_index;
+    
     bool should_skip_match(const wcstring &str) const;
     
     public:
@@ -196,6 +258,9 @@ class history_search_t {
 
     /** Sets additional string matches to skip */
     void skip_matches(const wcstring_list_t &skips);
+    
+    /** Makes searching backwards from the end skip the items up to and including the item at the given index */
+    void skip_items_through(size_t idx) { start_index = idx; }
 
     /** Finds the next search term (forwards in time). Returns true if one was found. */
     bool go_forwards(void);
@@ -217,20 +282,25 @@ class history_search_t {
     
     /** Returns the current search result item contents. asserts if there is no current item. */
     wcstring current_string(void) const;
+    
+    /** Returns the index of the current search result item. asserts if there is no current item. */
+    size_t current_index(void) const;
 
 
     /** Constructor */
     history_search_t(history_t &hist, const wcstring &str, enum history_search_type_t type = HISTORY_SEARCH_TYPE_CONTAINS) :
         history(&hist),
         search_type(type),
-        term(str)
+        term(str),
+        start_index(0)
     {}
     
     /* Default constructor */
     history_search_t() :
         history(),
         search_type(HISTORY_SEARCH_TYPE_CONTAINS),
-        term()
+        term(),
+        start_index(0)
     {}
     
 };
@@ -68,6 +68,7 @@
 #include "output.h"
 #include "intern.h"
 #include <vector>
+#include <map>
 
 /**
    Struct representing a keybinding. Returned by input_get_mappings.
@@ -217,6 +218,45 @@ static const wchar_t code_arr[] =
 /** Mappings for the current input mode */
 static std::vector<input_mapping_t> mapping_list;
 
+/**
+   Value of mapping indices that refer to no mapping
+*/
+#define NO_MAPPING ((size_t)-1)
+
+/**
+   A node in the trie that the sequences of mapping_list are compiled
+   into. The root node is the empty sequence.
+ */
+struct input_trie_node_t
+{
+	/** Index in mapping_list of the mapping whose sequence ends here, or NO_MAPPING */
+	size_t mapping; 
+	/** Lowest index in mapping_list of the mappings whose sequences continue past this node, or NO_MAPPING */
+	size_t first_below;
+	/** Index in mapping_trie of the child node for every character that can follow */
+	std::map<wchar_t, size_t> children;
+	
+	input_trie_node_t() : mapping(NO_MAPPING), first_below(NO_MAPPING) {}
+};
+
+/**
+   The trie of all mapping sequences, or empty if mapping_list has
+   changed since it was built
+*/
+static std::vector<input_trie_node_t> mapping_trie;
+
+/**
+   Index in mapping_list of the first mapping of every input function
+   code, which is run when the code itself is pushed as input
+*/
+static std::map<wchar_t, size_t> mapping_codes;
+
+/**
+   Index in mapping_list of the mapping with the empty sequence, used
+   for input that matches no other mapping, or NO_MAPPING
+*/
+static size_t generic_mapping = NO_MAPPING;
+
 /* Terminfo map list */
 static std::vector<terminfo_mapping_t> terminfo_mappings;
 
@@ -268,10 +308,12 @@ void input_mapping_add( const wchar_t *sequence,
 		if(  m.seq == sequence )
 		{
 			m.command = command;
+			mapping_trie.clear();
 			return;
 		}
 	}
     mapping_list.push_back(input_mapping_t(sequence, command));	
+	mapping_trie.clear();
 }
 
 /**
@@ -339,6 +381,7 @@ int input_init()
 	is_init = 1;
 
 	input_common_init( &interrupt_handler );
+	input_common_set_signal_port( signal_port() );
 
 	if( setupterm( 0, STDOUT_FILENO, 0) == ERR )
 	{
@@ -437,51 +480,56 @@ static wint_t input_exec_binding( const input_mapping_t &m, const wcstring &seq
 
 
 /**
-   Try reading the specified function mapping
+   Build mapping_trie, mapping_codes and generic_mapping from mapping_list
 */
-static wint_t input_try_mapping( const input_mapping_t &m)
+static void input_mapping_compile()
 {
-	wint_t c=0;
-	int j;
-
-	/*
-	  Check if the actual function code of this mapping is on the stack
-	 */
-	c = input_common_readch( 0 );
-	if( c == input_function_get_code( m.command ) )
+	mapping_trie.clear();
+	mapping_codes.clear();
+	generic_mapping = NO_MAPPING;
+	mapping_trie.push_back( input_trie_node_t() );
+	
+	for( size_t i=0; i<mapping_list.size(); i++ )
 	{
-		return input_exec_binding( m, m.seq );
-	}
-	input_unreadch( c );
-
-    const wchar_t *str = m.seq.c_str();
-    for (j=0; str[j] != L'\0'; j++)
-    {
-        bool timed = (j > 0);
-        c = input_common_readch(timed);
-        if (str[j] != c)
-            break;
-    }
-    
-    if( str[j] == L'\0' )
-    {
-        /* We matched the entire sequence */
-        return input_exec_binding( m, m.seq );
-    }
-    else
-    {
-        int k;
-        /*
-          Return the read characters
-        */
-        input_unreadch(c);
-        for( k=j-1; k>=0; k-- )
-        {
-            input_unreadch( m.seq[k] );
-        }
-    }
-	return 0;
+		const input_mapping_t &m = mapping_list.at(i);
+		
+		wchar_t code = input_function_get_code( m.command );
+		if( code != -1 && mapping_codes.find( code ) == mapping_codes.end() )
+		{
+			mapping_codes[code] = i;
+		}
 		
+		if( m.seq.empty() )
+		{
+			generic_mapping = i;
+			continue;
+		}
+		
+		size_t node = 0;
+		for( size_t j=0; j<m.seq.size(); j++ )
+		{
+			/*
+			  Mappings are added in order, so the first one to pass
+			  a node has the lowest index
+			*/
+			if( mapping_trie.at( node ).first_below == NO_MAPPING )
+				mapping_trie.at( node ).first_below = i;
+			
+			std::map<wchar_t, size_t>::const_iterator iter = mapping_trie.at( node ).children.find( m.seq.at(j) );
+			if( iter == mapping_trie.at( node ).children.end() )
+			{
+				size_t child = mapping_trie.size();
+				mapping_trie.at( node ).children[m.seq.at(j)] = child;
+				mapping_trie.push_back( input_trie_node_t() );
+				node = child;
+			}
+			else
+			{
+				node = iter->second;
+			}
+		}
+		mapping_trie.at( node ).mapping = i;
+	}
 }
 
 void input_unreadch( wint_t ch )
@@ -491,9 +539,6 @@ void input_unreadch( wint_t ch )
 
 wint_t input_readch()
 {
-	
-	size_t i;
-
 	CHECK_BLOCK( R_NULL );
 	
 	/*
@@ -501,32 +546,72 @@ wint_t input_readch()
 	*/
 	reader_interrupted();
 	
-	/*
-	  Search for sequence in mapping tables
-	*/
-
 	while( 1 )
 	{
-		const input_mapping_t *generic = 0;
-		for( i=0; i<mapping_list.size(); i++ )
+		if( mapping_trie.empty() )
+			input_mapping_compile();
+		
+		/*
+		  Find the first mapping in mapping_list whose function code
+		  is on the stack or whose sequence matches the input. The
+		  trie is followed only as long as a mapping before the best
+		  match so far could still match, so that we never wait for
+		  the rest of a sequence that could not be used.
+		*/
+		std::vector<wint_t> read;
+		size_t best = NO_MAPPING, best_len = 0;
+		
+		wint_t c = input_common_readch( 0 );
+		std::map<wchar_t, size_t>::const_iterator code = mapping_codes.find( c );
+		if( code != mapping_codes.end() )
 		{
-			const input_mapping_t &m = mapping_list.at(i);
-			wint_t res = input_try_mapping( m );		
-			if( res )
-				return res;
+			best = code->second;
+			best_len = 1;
+		}
+		
+		size_t node = 0;
+		while( 1 )
+		{
+			read.push_back( c );
+			
+			const input_trie_node_t &parent = mapping_trie.at( node );
+			std::map<wchar_t, size_t>::const_iterator iter = parent.children.find( c );
+			if( iter == parent.children.end() )
+				break;
 			
-			if( m.seq.length() == 0 )
+			node = iter->second;
+			const input_trie_node_t &current = mapping_trie.at( node );
+			if( current.mapping < best )
 			{
-				generic = &m;
+				best = current.mapping;
+				best_len = read.size();
 			}
+			if( current.first_below >= best )
+				break;
 			
+			c = input_common_readch( 1 );
+		}
+		
+		/*
+		  Return the characters that were read past the match
+		*/
+		for( size_t k=read.size(); k>best_len; k-- )
+		{
+			input_unreadch( read.at( k-1 ) );
+		}
+		
+		if( best != NO_MAPPING )
+		{
+			/* Copied, since a bound command may change the bindings */
+			const input_mapping_t m = mapping_list.at( best );
+			return input_exec_binding( m, m.seq );
 		}
 		
 		/*
 		  No matching exact mapping, try to find generic mapping.
 		*/
 
-		if( generic )
+		if( generic_mapping != NO_MAPPING )
 		{	
 			wchar_t arr[2]=
 				{
@@ -536,14 +621,16 @@ wint_t input_readch()
 			;
 			arr[0] = input_common_readch(0);
 			
-			return input_exec_binding( *generic, arr );				
+			const input_mapping_t generic = mapping_list.at( generic_mapping );
+			return input_exec_binding( generic, arr );				
 		}
 				
 		/*
 		  No action to take on specified character, ignore it
 		  and move to next one.
 		*/
-		input_common_readch( 0 );	}	
+		input_common_readch( 0 );
+	}	
 }
 
 void input_mapping_get_names( wcstring_list_t &lst )
@@ -575,6 +662,7 @@ bool input_mapping_erase( const wchar_t *sequence )
                 mapping_list[i] = mapping_list[sz-1];
 			}
             mapping_list.pop_back();
+			mapping_trie.clear();
 			result = true;
 			break;
 			
@@ -47,9 +47,12 @@ static int lookahead_count = 0;
 /** Callback function for handling interrupts on reading */
 static int (*interrupt_handler)();
 
-/** Callback function to be invoked before reading each byte */
+/** Callback function to be invoked before waiting for input */
 static void (*poll_handler)();
 
+/** File descriptor that becomes readable when a signal has been handled, or -1 */
+static int signal_port = -1;
+
 
 void input_common_init( int (*ih)() )
 {
@@ -61,11 +64,80 @@ void input_common_set_poll_callback(void (*handler)(void))
     poll_handler = handler;
 }
 
+void input_common_set_signal_port( int fd )
+{
+	signal_port = fd;
+}
+
 void input_common_destroy()
 {
 	
 }
 
+/**
+   Returns whether bytes can be read from stdin without blocking
+*/
+static bool stdin_has_input()
+{
+	struct timeval timeout = { 0, 0 };
+	fd_set fds;
+
+	FD_ZERO( &fds );
+	FD_SET( 0, &fds );
+	return select( 1, &fds, 0, 0, &timeout ) == 1;
+}
+
+/**
+   Read everything from the signal port
+
+   \return whether there was anything to read, i.e. a signal has been handled since the last call
+*/
+static bool drain_signal_port()
+{
+	bool result = false;
+	char buff[64];
+	
+	if( signal_port < 0 )
+		return false;
+	
+	while( 1 )
+	{
+		ssize_t count = read( signal_port, buff, sizeof buff );
+		if( count > 0 )
+		{
+			result = true;
+			continue;
+		}
+		if( count < 0 && errno == EINTR )
+			continue;
+		break;
+	}
+	return result;
+}
+
+/**
+   Run the interrupt handler, since a signal has been handled while
+   waiting for input.
+
+   \return the character readb should return, or 0 if it should keep waiting
+*/
+static wint_t readb_interrupted()
+{
+	if( interrupt_handler )
+	{
+		int res = interrupt_handler();
+		if( res )
+		{
+			return res;
+		}
+		if( lookahead_count )
+		{
+			return lookahead_arr[--lookahead_count];
+		}
+	}
+	return 0;
+}
+
 /**
    Internal function used by input_common_readch to read one byte from fd 1. This function should only be called by
    input_common_readch().
@@ -78,8 +150,8 @@ static wint_t readb()
 	
 	do
 	{
-        /* Invoke any poll handler */
-        if (poll_handler)
+        /* Invoke any poll handler, unless more input is already waiting. Then it is invoked once that has been handled, so that e.g. a pasted command only causes one repaint. */
+        if (poll_handler && ! stdin_has_input())
             poll_handler();
     
 		fd_set fdset;	
@@ -89,6 +161,11 @@ static wint_t readb()
 		
 		FD_ZERO( &fdset );
 		FD_SET( 0, &fdset );
+		if( signal_port > 0 )
+		{
+			FD_SET( signal_port, &fdset );
+			if (fd_max < signal_port) fd_max = signal_port;
+		}
 		if( env_universal_server.fd > 0 )
 		{
 			FD_SET( env_universal_server.fd, &fdset );
@@ -107,21 +184,16 @@ static wint_t readb()
 				case EINTR:
 				case EAGAIN:
 				{
-					if( interrupt_handler )
+					/*
+					  The signal has been handled now, don't wake up
+					  for it again
+					*/
+					drain_signal_port();
+					wint_t c = readb_interrupted();
+					if( c )
 					{
-						int res = interrupt_handler();
-						if( res )
-						{
-							return res;
-						}
-						if( lookahead_count )
-						{
-							return lookahead_arr[--lookahead_count];
-						}
-						
+						return c;
 					}
-					
-					
 					do_loop = true;
 					break;
 				}
@@ -139,6 +211,16 @@ static wint_t readb()
             /* Assume we loop unless we see a character in stdin */
             do_loop = true;
             
+            if( signal_port > 0 && FD_ISSET( signal_port, &fdset ) && drain_signal_port() )
+            {
+                /* A signal was handled before select was called */
+                wint_t c = readb_interrupted();
+                if( c )
+                {
+                    return c;
+                }
+            }
+            
             if( env_universal_server.fd > 0 && FD_ISSET( env_universal_server.fd, &fdset ) )
             {
                 debug( 3, L"Wake up on universal variable event" );					
@@ -30,9 +30,17 @@ enum
 */
 void input_common_init( int (*ih)() );
 
-/* Sets a callback to be invoked every time a byte is read */
+/* Sets a callback to be invoked before waiting for the next byte, when no input is pending */
 void input_common_set_poll_callback(void (*handler)(void));
 
+/**
+   Set a nonblocking file descriptor that becomes readable whenever a
+   signal has been handled. It is waited for along with input, so that
+   the interrupt handler runs even when the signal arrives just before
+   waiting starts. Use -1 for none.
+*/
+void input_common_set_signal_port( int fd );
+
 /**
    Free memory used by the library
 */
@@ -10,9 +10,8 @@
 #include <stdio.h>
 #include <wchar.h>
 #include <unistd.h>
-#include <set>
-#include <deque>
-#include <algorithm>
+#include <string.h>
+#include <tr1/unordered_set>
 
 #include "fallback.h"
 #include "util.h"
@@ -21,29 +20,64 @@
 #include "common.h"
 #include "intern.h"
 
+/** Hash function for intern'd strings */
+struct string_table_hash_t {
+    size_t operator()(const wchar_t *str) const {
+        size_t result = 2166136261u;
+        for (; *str; str++)
+            result = (result ^ (size_t)*str) * 16777619u;
+        return result;
+    }
+};
+
 /** Comparison function for intern'd strings */
-class string_table_compare_t {
-    public:
+struct string_table_equal_t {
     bool operator()(const wchar_t *a, const wchar_t *b) const {
-        return wcscmp(a, b) < 0;
+        return wcscmp(a, b) == 0;
     }
 };
 
-/* A sorted deque ends up being a little more memory efficient than a std::set for the intern'd string table */
-#define USE_SET 0
-#if USE_SET
 /** The table of intern'd strings */
-typedef std::set<const wchar_t *, string_table_compare_t> string_table_t;
-#else
-/** The table of intern'd strings */
-typedef std::deque<const wchar_t *> string_table_t;
-#endif
+typedef std::tr1::unordered_set<const wchar_t *, string_table_hash_t, string_table_equal_t> string_table_t;
 
 static string_table_t string_table;
 
+/** The number of characters in each block of copied strings */
+#define STRING_BLOCK_LENGTH 4096
+
+/** The block that copies of intern'd strings are cut from. Intern'd strings are never free'd, so a block is just filled from the start, and then left alone. */
+static wchar_t *string_block = NULL;
+
+/** The number of characters used in string_block */
+static size_t string_block_used = STRING_BLOCK_LENGTH;
+
+/** The number of bytes allocated for copies of intern'd strings */
+static size_t string_bytes = 0;
+
 /** The lock to provide thread safety for intern'd strings */
 static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/** Returns a copy of the specified string, cut from string_block. Strings too long to share a block get an allocation of their own. */
+static const wchar_t *copy_string( const wchar_t *in )
+{
+    size_t length = wcslen(in) + 1;
+    wchar_t *result;
+    if (length > STRING_BLOCK_LENGTH / 4) {
+        result = new wchar_t[length];
+        string_bytes += length * sizeof *result;
+    } else {
+        if (string_block_used + length > STRING_BLOCK_LENGTH) {
+            string_block = new wchar_t[STRING_BLOCK_LENGTH];
+            string_bytes += sizeof(wchar_t[STRING_BLOCK_LENGTH]);
+            string_block_used = 0;
+        }
+        result = string_block + string_block_used;
+        string_block_used += length;
+    }
+    memcpy(result, in, length * sizeof *in);
+    return result;
+}
+
 static const wchar_t *intern_with_dup( const wchar_t *in, bool dup )
 {
 	if( !in )
@@ -53,23 +87,13 @@ static const wchar_t *intern_with_dup( const wchar_t *in, bool dup )
     scoped_lock lock(intern_lock);
     const wchar_t *result;
     
-#if USE_SET
     string_table_t::const_iterator iter = string_table.find(in);
     if (iter != string_table.end()) {
         result = *iter; 
     } else {
-        result = dup ? wcsdup(in) : in;
+        result = dup ? copy_string(in) : in;
         string_table.insert(result);
     }
-#else
-    string_table_t::iterator iter = std::lower_bound(string_table.begin(), string_table.end(), in, string_table_compare_t());
-    if (iter != string_table.end() && wcscmp(*iter, in) == 0) {
-        result = *iter;
-    } else {
-        result = dup ? wcsdup(in) : in;
-        string_table.insert(iter, result);
-    }
-#endif
     return result;
 }
 
@@ -83,3 +107,10 @@ const wchar_t *intern_static( const wchar_t *in )
 {
 	return intern_with_dup(in, false);
 }
+
+size_t intern_memory_usage()
+{
+    scoped_lock lock(intern_lock);
+    /* Each string has a node in the table */
+    return string_bytes + string_table.size() * 2 * sizeof(void *) + string_table.bucket_count() * sizeof(void *);
+}
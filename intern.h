@@ -25,4 +25,10 @@ const wchar_t *intern( const wchar_t *in );
 */
 const wchar_t *intern_static( const wchar_t *in );
 
+/**
+   Returns the approximate number of bytes used by the pool of intern'd
+   strings, including the copies made by intern
+*/
+size_t intern_memory_usage();
+
 #endif
@@ -1,7 +1,7 @@
 #!/usr/bin/env python
 
 
-import string, sys, os.path
+import string, sys, os.path, io
 
 escapes = {}
 escapes['\a'] = r'\a'
@@ -26,14 +26,16 @@ def escape(c):
 	else:
 		return (c, False)
 
+# Scripts are stored as wide strings, so that fish can run them without
+# converting them first. Hexadecimal escapes in them are code points.
 def stringize(line):
-	newline = '"'
+	newline = 'L"'
 	was_escape = False
 	for c in line:
 		# Avoid an issue where characters after a hexadecimal escape are treated as part of that escape
-		# by adding two quotes
+		# by starting a new string
 		if was_escape and c in string.hexdigits:
-			newline += '""'
+			newline += '" L"'
 		chars, was_escape = escape(c)
 		newline += chars
 	newline += '"'
@@ -47,7 +49,7 @@ class cfunc:
 		
 	def cdef(self):
 		result = ""
-		result += "static const char * const {0} = \n\t".format(self.cfunc_name())
+		result += "static const wchar_t * const {0} = \n\t".format(self.cfunc_name())
 		result += '\n\t'.join(self.lines)
 		result += ';\n'
 		return result
@@ -65,7 +67,7 @@ class cfunc:
 TYPES = ['function', 'completion']
 type_to_funcs = dict((t, []) for t in TYPES)
 for file in sys.argv[1:]:
-	fd = open(file, 'r')
+	fd = io.open(file, 'r', encoding='utf-8')
 	newlines = []
 	for line in fd:
 		newlines.append(stringize(line))
@@ -84,16 +86,17 @@ for file in sys.argv[1:]:
 	newfunc = cfunc(type, name, newlines)
 	type_to_funcs[type].append(newfunc)
 
-# Sort our functions by name
+# Sort our functions by name, in the order of wcscmp, since autoload
+# finds them with a binary search
 for funcs in type_to_funcs.values():
-	funcs.sort(key=cfunc.cfunc_name)
+	funcs.sort(key=lambda func: func.name)
 
 # Output our header
 fd = open('builtin_scripts.h', 'w')
 fd.write('/* This file is generated by internalize_scripts.py */\n\n')
 fd.write("""struct builtin_script_t {
 	const wchar_t *name;
-	const char *def;
+	const wchar_t *def;
 };""")
 
 fd.write('\n')
@@ -117,7 +120,7 @@ for type in TYPES:
 # Output the refs
 for type in TYPES:
 	funcs = type_to_funcs[type]
-	func_refs = ["{0}L{1}, {2}{3}".format("{", stringize(func.name), func.cfunc_name(), "}") for func in funcs]
+	func_refs = ["{0}{1}, {2}{3}".format("{", stringize(func.name), func.cfunc_name(), "}") for func in funcs]
 	fd.write('const struct builtin_script_t internal_{0}_scripts[{1}] =\n'.format(type, len(funcs)))
 	fd.write('{\n\t')
 	fd.write(',\n\t'.join(func_refs))
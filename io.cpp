@@ -23,6 +23,7 @@ Utilities for io redirection.
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <set>
 
 #if HAVE_NCURSES_H
 #include <ncurses.h>
@@ -98,6 +99,11 @@ void io_buffer_read( io_data_t *d )
 }
 
 
+/**
+   The buffers made by io_buffer_create that have not been destroyed
+*/
+static std::set<const io_data_t *> live_buffers;
+
 io_data_t *io_buffer_create( int is_input )
 {
 	std::auto_ptr<io_data_t> buffer_redirect(new io_data_t);
@@ -121,6 +127,7 @@ io_data_t *io_buffer_create( int is_input )
 		wperror( L"fcntl" );
 		return NULL;
 	}
+	live_buffers.insert( buffer_redirect.get() );
 	return buffer_redirect.release();
 }
 
@@ -142,9 +149,21 @@ void io_buffer_destroy( io_data_t *io_buffer )
 	  Dont free fd for writing. This should already be free'd before
 	  calling exec_read_io_buffer on the buffer
 	*/
+	live_buffers.erase( io_buffer );
 	delete io_buffer;
 }
 
+size_t io_buffer_memory_usage()
+{
+	ASSERT_IS_MAIN_THREAD();
+	size_t result = 0;
+	for( std::set<const io_data_t *>::const_iterator iter = live_buffers.begin(); iter != live_buffers.end(); ++iter )
+	{
+		result += sizeof **iter + (*iter)->out_buffer_capacity();
+	}
+	return result;
+}
+
 
 
 io_data_t *io_add( io_data_t *list, io_data_t *element )
@@ -81,6 +81,12 @@ public:
         assert(out_buffer.get() != NULL);
         return out_buffer->size();
     }
+    
+    /** Function to get the number of bytes allocated for the buffer */
+    size_t out_buffer_capacity(void) const {
+        assert(out_buffer.get() != NULL);
+        return out_buffer->capacity();
+    }
 
 	/** Set to true if this is an input io redirection */
 	int is_input;
@@ -149,6 +155,12 @@ void io_buffer_destroy( io_data_t *io_buffer );
 */
 io_data_t *io_buffer_create( int is_input );
 
+/**
+   Returns the number of bytes used by the IO_BUFFER redirections that
+   currently exist, including the output they have buffered
+*/
+size_t io_buffer_memory_usage();
+
 /**
    Close output pipe, and read from input pipe until eof.
 */
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "iothread.h"
 #include "common.h"
+#include "trace.h"
 #include <pthread.h>
 #include <assert.h>
 #include <errno.h>
@@ -11,6 +12,9 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <queue>
+#include <deque>
+#include <map>
+#include <algorithm>
 
 #ifdef _POSIX_THREAD_THREADS_MAX
   #if _POSIX_THREAD_THREADS_MAX < 64
@@ -22,33 +26,51 @@
   #define IO_MAX_THREADS 64
 #endif
 
-static int s_active_thread_count;
-
-typedef unsigned char ThreadIndex_t;
-
-static struct WorkerThread_t {
-	ThreadIndex_t idx;
-	pthread_t thread;
-} threads[IO_MAX_THREADS];
+/* The default number of worker threads. Most requests are short, so a handful of threads is plenty. */
+#ifndef IO_DEFAULT_THREADS
+  #define IO_DEFAULT_THREADS 8
+#endif
 
 struct ThreadedRequest_t {
 	int sequenceNumber;
-	
+
 	int (*handler)(void *);
 	void (*completionCallback)(void *, int);
 	void *context;
 	int handlerResult;
-};
 
-static struct WorkerThread_t *next_vacant_thread_slot(void) {
-	for (ThreadIndex_t i=0; i < IO_MAX_THREADS; i++) {
-		if (! threads[i].thread) return &threads[i];
-	}
-	return NULL;
-}
+	/* Whether this request supersedes earlier requests with the same handler */
+	bool supersede;
 
+	/* Whether this request has no completion callback. Detached requests are deleted by the worker that runs them, instead of being handed back to the main thread. */
+	bool detached;
+};
+
+/* Lock protecting all of the below */
 static pthread_mutex_t s_request_queue_lock;
-static std::queue<ThreadedRequest_t *> s_request_queue;
+
+/* Signalled when a request is added to the queue */
+static pthread_cond_t s_request_queue_cond;
+
+/* Requests that have not yet been picked up by a worker, one queue per priority */
+static std::deque<ThreadedRequest_t *> s_request_queue[IOTHREAD_PRIORITY_COUNT];
+
+/* Requests whose handler has run, waiting for the main thread to invoke their completion callback */
+static std::queue<ThreadedRequest_t *> s_result_queue;
+
+/* For each handler, the sequence number of the latest superseding request. Queued superseding requests with a lower sequence number are cancelled. */
+typedef std::map<int (*)(void *), int> generation_map_t;
+static generation_map_t s_latest_generation;
+
+/* Number of worker threads started, and number of those waiting for work */
+static int s_thread_count, s_idle_thread_count;
+
+/* Maximum number of worker threads */
+static int s_max_threads = IO_DEFAULT_THREADS;
+
+/* Number of requests whose completion callback has not yet been invoked. Only accessed on the main thread. */
+static int s_outstanding_request_count;
+
 static int s_last_sequence_number;
 static int s_read_pipe, s_write_pipe;
 
@@ -56,112 +78,246 @@ static void iothread_init(void) {
 	static bool inited = false;
 	if (! inited) {
 		inited = true;
-		
+
 		/* Initialize the queue lock */
 		VOMIT_ON_FAILURE(pthread_mutex_init(&s_request_queue_lock, NULL));
-		
+		VOMIT_ON_FAILURE(pthread_cond_init(&s_request_queue_cond, NULL));
+
 		/* Initialize the completion pipes */
 		int pipes[2] = {0, 0};
 		VOMIT_ON_FAILURE(pipe(pipes));
 		s_read_pipe = pipes[0];
 		s_write_pipe = pipes[1];
-        
+
         // 0 means success to VOMIT_ON_FAILURE. Arrange to pass 0 if fcntl returns anything other than -1.
         VOMIT_ON_FAILURE(-1 == fcntl(s_read_pipe, F_SETFD, FD_CLOEXEC));
         VOMIT_ON_FAILURE(-1 == fcntl(s_write_pipe, F_SETFD, FD_CLOEXEC));
-		
-		/* Tell each thread its index */
-		for (ThreadIndex_t i=0; i < IO_MAX_THREADS; i++) {
-			threads[i].idx = i;
-		}
 	}
 }
 
-static void add_to_queue(struct ThreadedRequest_t *req) {
+static void add_to_queue(struct ThreadedRequest_t *req, enum iothread_priority_t priority) {
 	ASSERT_IS_LOCKED(s_request_queue_lock);
-    s_request_queue.push(req);
+    s_request_queue[priority].push_back(req);
+    if (req->supersede) {
+        s_latest_generation[req->handler] = req->sequenceNumber;
+    }
 }
 
+/* Returns the highest priority request, or NULL if there are none. */
 static ThreadedRequest_t *dequeue_request(void) {
-    ThreadedRequest_t *result = NULL;
-    scoped_lock lock(s_request_queue_lock);
-    if (! s_request_queue.empty()) {
-        result = s_request_queue.front();
-        s_request_queue.pop();
+    ASSERT_IS_LOCKED(s_request_queue_lock);
+    for (int priority = 0; priority < IOTHREAD_PRIORITY_COUNT; priority++) {
+        std::deque<ThreadedRequest_t *> &queue = s_request_queue[priority];
+        if (! queue.empty()) {
+            ThreadedRequest_t *result = queue.front();
+            queue.pop_front();
+            return result;
+        }
     }
-    return result;
+    return NULL;
 }
 
-/* The function that does thread work. */
-static void *iothread_worker(void *threadPtr) {
-	assert(threadPtr != NULL);
-	struct WorkerThread_t *thread = (struct WorkerThread_t *)threadPtr;
-	
+/* Returns whether the request has been superseded by a later request */
+static bool request_is_superseded(const ThreadedRequest_t *req) {
+    ASSERT_IS_LOCKED(s_request_queue_lock);
+    if (! req->supersede)
+        return false;
+    generation_map_t::const_iterator iter = s_latest_generation.find(req->handler);
+    return iter != s_latest_generation.end() && iter->second != req->sequenceNumber;
+}
+
+/* The function that does thread work. Worker threads live forever, waiting for requests. */
+static void *iothread_worker(void *unused) {
     // We don't want to receive signals on this thread
     sigset_t set;
     sigfillset(&set);
     VOMIT_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &set, NULL));
-    
-	/* Grab a request off of the queue */
-	struct ThreadedRequest_t *req = dequeue_request();
 
-	/* Run the handler and store the result */
-	if (req) {
-		req->handlerResult = req->handler(req->context);
-	}
-	
-	/* Write our index to wake up the main thread */
-	VOMIT_ON_FAILURE(! write_loop(s_write_pipe, (const char *)&thread->idx, sizeof thread->idx));
-	
-	/* We're done */
-	return req;
+    VOMIT_ON_FAILURE(pthread_mutex_lock(&s_request_queue_lock));
+    for (;;) {
+        /* Grab a request off of the queue, waiting if there is none */
+        struct ThreadedRequest_t *req;
+        while ((req = dequeue_request()) == NULL) {
+            s_idle_thread_count += 1;
+            VOMIT_ON_FAILURE(pthread_cond_wait(&s_request_queue_cond, &s_request_queue_lock));
+            s_idle_thread_count -= 1;
+        }
+
+        bool cancelled = request_is_superseded(req);
+        VOMIT_ON_FAILURE(pthread_mutex_unlock(&s_request_queue_lock));
+
+        /* Run the handler and store the result */
+        {
+            TRACE_SCOPE("iothread_handler");
+            req->handlerResult = cancelled ? IOTHREAD_CANCELLED : req->handler(req->context);
+        }
+
+        if (req->detached) {
+            delete req;
+            VOMIT_ON_FAILURE(pthread_mutex_lock(&s_request_queue_lock));
+            continue;
+        }
+
+        /* Hand the request back and write a byte to wake up the main thread */
+        VOMIT_ON_FAILURE(pthread_mutex_lock(&s_request_queue_lock));
+        s_result_queue.push(req);
+        VOMIT_ON_FAILURE(pthread_mutex_unlock(&s_request_queue_lock));
+
+        const char wakeup_byte = 0;
+        VOMIT_ON_FAILURE(! write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte));
+
+        VOMIT_ON_FAILURE(pthread_mutex_lock(&s_request_queue_lock));
+    }
+    return NULL;
 }
 
-/* Spawn another thread if there's work to be done. */
+/* Wake up an idle thread, or spawn another thread if there's work to be done and no thread to do it. */
 static void iothread_spawn_if_needed(void) {
     ASSERT_IS_LOCKED(s_request_queue_lock);
-	if (! s_request_queue.empty() && s_active_thread_count < IO_MAX_THREADS) {
-		struct WorkerThread_t *thread = next_vacant_thread_slot();
-		assert(thread != NULL);
-		
+    if (s_idle_thread_count > 0) {
+        VOMIT_ON_FAILURE(pthread_cond_signal(&s_request_queue_cond));
+    } else if (s_thread_count < s_max_threads) {
 		/* Spawn a thread */
+		pthread_t thread;
 		int err;
 		do {
 			err = 0;
-			if (pthread_create(&thread->thread, NULL, iothread_worker, thread)) {
+			if (pthread_create(&thread, NULL, iothread_worker, NULL)) {
 				err = errno;
 			}
 		} while (err == EAGAIN);
 		assert(err == 0);
-		
+		VOMIT_ON_FAILURE(pthread_detach(thread));
+
 		/* Note that we are spawned another thread */
-		s_active_thread_count += 1;		
+		s_thread_count += 1;
 	}
 }
 
-int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context) {
+int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context, enum iothread_priority_t priority, bool supersede) {
     ASSERT_IS_MAIN_THREAD();
     ASSERT_IS_NOT_FORKED_CHILD();
+    TRACE_SCOPE("iothread_perform");
 	iothread_init();
-	
+	assert(priority >= 0 && priority < IOTHREAD_PRIORITY_COUNT);
+
 	/* Create and initialize a request. */
 	struct ThreadedRequest_t *req = new ThreadedRequest_t();
 	req->handler = handler;
 	req->completionCallback = completionCallback;
 	req->context = context;
 	req->sequenceNumber = ++s_last_sequence_number;
+	req->supersede = supersede;
+	req->detached = false;
+	s_outstanding_request_count += 1;
 
     /* Take our lock */
     scoped_lock lock(s_request_queue_lock);
-    
+
     /* Add to the queue */
-    add_to_queue(req);
-    
-    /* Spawn a thread if necessary */
+    add_to_queue(req, priority);
+
+    /* Get a thread to do the work */
     iothread_spawn_if_needed();
+    return req->sequenceNumber;
+}
+
+/* The state shared by the threads working on a parallel batch */
+struct parallel_batch_t {
+    void (*handler)(void *, size_t);
+    void *context;
+    size_t count;
+
+    /* Lock protecting the fields below */
+    pthread_mutex_t lock;
+
+    /* Signalled when the last item is done */
+    pthread_cond_t cond;
+
+    /* The next item to hand out, and the number of items that are done */
+    size_t next, done;
+
+    /* The number of threads referencing the batch. The last one to let go deletes it. */
+    int refs;
+};
+
+/* Drops a reference to the batch, whose lock must be held, and deletes it if it was the last one */
+static void release_batch(parallel_batch_t *batch) {
+    ASSERT_IS_LOCKED(batch->lock);
+    bool last = (--batch->refs == 0);
+    VOMIT_ON_FAILURE(pthread_mutex_unlock(&batch->lock));
+    if (last) {
+        VOMIT_ON_FAILURE(pthread_cond_destroy(&batch->cond));
+        VOMIT_ON_FAILURE(pthread_mutex_destroy(&batch->lock));
+        delete batch;
+    }
+}
+
+/* Runs items of the batch until there are none left, then releases the batch */
+static int iothread_parallel_worker(void *context) {
+    parallel_batch_t *batch = static_cast<parallel_batch_t *>(context);
+    VOMIT_ON_FAILURE(pthread_mutex_lock(&batch->lock));
+    while (batch->next < batch->count) {
+        size_t idx = batch->next++;
+        VOMIT_ON_FAILURE(pthread_mutex_unlock(&batch->lock));
+        batch->handler(batch->context, idx);
+        VOMIT_ON_FAILURE(pthread_mutex_lock(&batch->lock));
+        if (++batch->done == batch->count)
+            VOMIT_ON_FAILURE(pthread_cond_broadcast(&batch->cond));
+    }
+    release_batch(batch);
     return 0;
 }
 
+void iothread_perform_parallel(void (*handler)(void *, size_t), void *context, size_t count, size_t min_per_thread, enum iothread_priority_t priority) {
+    ASSERT_IS_NOT_FORKED_CHILD();
+    assert(priority >= 0 && priority < IOTHREAD_PRIORITY_COUNT);
+    if (count == 0)
+        return;
+
+    /* Decide how many helpers to ask for; the calling thread does its share too */
+    size_t helpers = count / std::max(min_per_thread, (size_t)1);
+    if (helpers > 0)
+        helpers -= 1;
+    if (is_main_thread())
+        iothread_init();
+
+    parallel_batch_t *batch = new parallel_batch_t();
+    batch->handler = handler;
+    batch->context = context;
+    batch->count = count;
+    batch->next = 0;
+    batch->done = 0;
+    VOMIT_ON_FAILURE(pthread_mutex_init(&batch->lock, NULL));
+    VOMIT_ON_FAILURE(pthread_cond_init(&batch->cond, NULL));
+
+    {
+        scoped_lock lock(s_request_queue_lock);
+        helpers = std::min(helpers, (size_t)s_max_threads);
+        /* One reference for each helper, one for the work done by the calling thread, and one for waiting */
+        batch->refs = 2 + (int)helpers;
+        for (size_t i=0; i < helpers; i++) {
+            struct ThreadedRequest_t *req = new ThreadedRequest_t();
+            req->handler = iothread_parallel_worker;
+            req->completionCallback = NULL;
+            req->context = batch;
+            req->sequenceNumber = 0;
+            req->supersede = false;
+            req->detached = true;
+            add_to_queue(req, priority);
+            iothread_spawn_if_needed();
+        }
+    }
+
+    iothread_parallel_worker(batch);
+
+    /* Wait for the items that helpers are still running. Helpers that have not started yet will find nothing to do. */
+    VOMIT_ON_FAILURE(pthread_mutex_lock(&batch->lock));
+    while (batch->done < batch->count)
+        VOMIT_ON_FAILURE(pthread_cond_wait(&batch->cond, &batch->lock));
+    release_batch(batch);
+}
+
 int iothread_port(void) {
 	iothread_init();
 	return s_read_pipe;
@@ -169,49 +325,56 @@ int iothread_port(void) {
 
 void iothread_service_completion(void) {
     ASSERT_IS_MAIN_THREAD();
-	ThreadIndex_t threadIdx = (ThreadIndex_t)-1;
-	VOMIT_ON_FAILURE(1 != read_loop(iothread_port(), &threadIdx, sizeof threadIdx));
-	assert(threadIdx < IO_MAX_THREADS);
-	
-	struct WorkerThread_t *thread = &threads[threadIdx];
-	assert(thread->thread != 0);
-	
+	char wakeup_byte = 0;
+	VOMIT_ON_FAILURE(1 != read_loop(iothread_port(), &wakeup_byte, sizeof wakeup_byte));
+
 	struct ThreadedRequest_t *req = NULL;
-	VOMIT_ON_FAILURE(pthread_join(thread->thread, (void **)&req));
-	
-	/* Free up this thread */
-	thread->thread = 0;
-	assert(s_active_thread_count > 0);
-	s_active_thread_count -= 1;
-	
-	/* Handle the request */
-    if (req) {
-        if (req->completionCallback) 
-            req->completionCallback(req->context, req->handlerResult);
-        delete req;
-    }
-    
-	/* Maybe spawn another thread, if there's more work to be done. */
 	VOMIT_ON_FAILURE(pthread_mutex_lock(&s_request_queue_lock));
-	iothread_spawn_if_needed();
+	assert(! s_result_queue.empty());
+	req = s_result_queue.front();
+	s_result_queue.pop();
+
+	/* Forget the generation of a finished request so the map doesn't grow */
+	if (req->supersede) {
+	    generation_map_t::iterator iter = s_latest_generation.find(req->handler);
+	    if (iter != s_latest_generation.end() && iter->second == req->sequenceNumber)
+	        s_latest_generation.erase(iter);
+	}
 	VOMIT_ON_FAILURE(pthread_mutex_unlock(&s_request_queue_lock));
+
+	assert(s_outstanding_request_count > 0);
+	s_outstanding_request_count -= 1;
+
+	/* Handle the request */
+    if (req->completionCallback) {
+        TRACE_SCOPE("iothread_completion");
+        req->completionCallback(req->context, req->handlerResult);
+    }
+    delete req;
 }
 
 void iothread_drain_all(void) {
     ASSERT_IS_MAIN_THREAD();
-    ASSERT_IS_NOT_FORKED_CHILD(); 
-    if (s_active_thread_count == 0)
+    ASSERT_IS_NOT_FORKED_CHILD();
+    if (s_outstanding_request_count == 0)
         return;
 #define TIME_DRAIN 0
 #if TIME_DRAIN
-    int thread_count = s_active_thread_count;
+    int request_count = s_outstanding_request_count;
     double now = timef();
 #endif
-    while (s_active_thread_count > 0) {
+    while (s_outstanding_request_count > 0) {
         iothread_service_completion();
     }
 #if TIME_DRAIN
     double after = timef();
-    printf("(Waited %.02f msec for %d thread(s) to drain)\n", 1000 * (after - now), thread_count);
+    printf("(Waited %.02f msec for %d request(s) to drain)\n", 1000 * (after - now), request_count);
 #endif
 }
+
+void iothread_set_max_threads(int count) {
+    ASSERT_IS_MAIN_THREAD();
+    iothread_init();
+    scoped_lock lock(s_request_queue_lock);
+    s_max_threads = std::max(1, std::min(count, IO_MAX_THREADS));
+}
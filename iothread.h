@@ -5,19 +5,40 @@
 #ifndef FISH_IOTHREAD_H
 #define FISH_IOTHREAD_H
 
+#include <limits.h>
+#include <stddef.h>
+
+/**
+   Request priorities. Queued requests are run in priority order, and in the order they were made within each priority.
+*/
+enum iothread_priority_t
+{
+    IOTHREAD_PRIORITY_INTERACTIVE, /**< Work the user is waiting on, like highlighting and autosuggestions */
+    IOTHREAD_PRIORITY_NORMAL, /**< The default priority */
+    IOTHREAD_PRIORITY_BACKGROUND, /**< Work nobody is waiting on, like history file detection */
+    IOTHREAD_PRIORITY_COUNT
+};
+
+/**
+   The result passed to the completion callback of a request that was superseded before its handler could run. The handler is not run in that case.
+*/
+#define IOTHREAD_CANCELLED INT_MIN
+
 /**
  Runs a command on a thread.
- 
+
  \param handler The function to execute on a background thread. Accepts an arbitrary context pointer, and returns an int, which is passed to the completionCallback.
  \param completionCallback The function to execute on the main thread once the background thread is complete. Accepts an int (the return value of handler) and the context.
  \param context A arbitary context pointer to pass to the handler and completion callback.
+ \param priority The priority of the request
+ \param supersede If true, the request supersedes all earlier superseding requests with the same handler that have not yet started running. Those are cancelled: their completion callback is invoked with IOTHREAD_CANCELLED instead of running the handler.
  \return A sequence number, currently not very useful.
 */
-int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context);
+int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context, enum iothread_priority_t priority = IOTHREAD_PRIORITY_NORMAL, bool supersede = false);
 
-/** 
+/**
   Gets the fd on which to listen for completion callbacks.
- 
+
   \return A file descriptor on which to listen for completion callbacks.
 */
 int iothread_port(void);
@@ -25,13 +46,27 @@ int iothread_port(void);
 /** Services one iothread competion callback. */
 void iothread_service_completion(void);
 
-/** Waits for all iothreads to terminate. */
+/** Waits for all outstanding requests to complete, and services their completion callbacks. */
 void iothread_drain_all(void);
 
+/** Sets the maximum number of worker threads. Threads are started on demand up to this limit, and then kept around to serve later requests. Lowering the limit does not stop threads that are already running. */
+void iothread_set_max_threads(int count);
+
+/**
+ Runs handler(context, i) for every i from 0 to count - 1, spread over the calling thread and worker threads, and returns once all of them have run. Unlike iothread_perform, this may be called from any thread, including a worker thread. The handler must be thread safe.
+
+ \param handler The function to execute for each index
+ \param context A arbitary context pointer to pass to the handler
+ \param count The number of indexes
+ \param min_per_thread The smallest number of indexes worth handing to another thread. If count is smaller than twice this, everything runs on the calling thread.
+ \param priority The priority of the requests for worker threads
+*/
+void iothread_perform_parallel(void (*handler)(void *, size_t), void *context, size_t count, size_t min_per_thread, enum iothread_priority_t priority = IOTHREAD_PRIORITY_INTERACTIVE);
+
 /** Helper template */
 template<typename T>
-int iothread_perform(int (*handler)(T *), void (*completionCallback)(T *, int), T *context) {
-    return iothread_perform_base((int (*)(void *))handler, (void (*)(void *, int))completionCallback, static_cast<void *>(context));
+int iothread_perform(int (*handler)(T *), void (*completionCallback)(T *, int), T *context, enum iothread_priority_t priority = IOTHREAD_PRIORITY_NORMAL, bool supersede = false) {
+    return iothread_perform_base((int (*)(void *))handler, (void (*)(void *, int))completionCallback, static_cast<void *>(context), priority, supersede);
 }
 
 #endif
@@ -0,0 +1,512 @@
+/*
+	A small utility to measure how long fish takes to update the screen
+	after a key is pressed. It runs fish on a pseudo-terminal, writes
+	the same bytes a terminal would send for typing, Tab completion,
+	history search and pasting, and measures the time from writing the
+	key until fish stops writing to the terminal.
+
+	Usage: key_latency [-n RUNS] [-t MS] FISH [SCENARIO...]
+
+	The percentiles of each scenario are printed in milliseconds. If -t
+	is given, the exit status is 1 if the 90th percentile of any
+	scenario is more than MS milliseconds, so that it can be used to
+	catch regressions.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/**
+   How long fish may write nothing before the screen is considered
+   settled, in microseconds. Highlighting and autosuggestions are
+   computed in the background and painted a little after the key, so
+   this must be longer than the time they take.
+*/
+#define SETTLE_TIME 50000
+
+/**
+   How long to wait for fish to respond to a key at all, in microseconds
+*/
+#define KEY_TIMEOUT 5000000
+
+/**
+   How long to wait for the first prompt, in microseconds
+*/
+#define STARTUP_TIMEOUT 20000000
+
+/**
+   The number of items in the history used by the history scenario
+*/
+#define HISTORY_ITEMS 10000
+
+/**
+   The bytes sent for the keys used by the scenarios
+*/
+#define KEY_UP "\x1b[A"
+#define KEY_TAB "\t"
+#define KEY_CLEAR "\x03"
+
+/**
+   The latencies of each scenario, in microseconds
+*/
+struct scenario_result_t
+{
+	const char *name;
+	std::vector<long long> latencies;
+	int timeouts;
+};
+
+/**
+   A fish running on a pseudo-terminal
+*/
+struct session_t
+{
+	int master;
+	pid_t pid;
+	std::string dir;
+};
+
+static long long get_time()
+{
+	struct timeval time_struct;
+	gettimeofday( &time_struct, 0 );
+	return 1000000ll*time_struct.tv_sec+time_struct.tv_usec;
+}
+
+static void write_all( int fd, const char *buff, size_t len )
+{
+	while( len > 0 )
+	{
+		ssize_t res = write( fd, buff, len );
+		if( res < 0 )
+		{
+			if( errno == EINTR || errno == EAGAIN )
+				continue;
+			perror( "write" );
+			return;
+		}
+		buff += res;
+		len -= res;
+	}
+}
+
+/**
+   Read everything fish writes until it has been quiet for
+   SETTLE_TIME, or until \c timeout microseconds have passed without
+   any output. Returns the time the last byte was read, or 0 if
+   nothing was read.
+*/
+static long long wait_settle( session_t &s, long long timeout )
+{
+	long long last = 0;
+	long long deadline = get_time() + timeout;
+	while( 1 )
+	{
+		long long now = get_time();
+		long long wait_until = last ? last + SETTLE_TIME : deadline;
+		if( now >= wait_until )
+			break;
+
+		struct pollfd pfd;
+		pfd.fd = s.master;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int res = poll( &pfd, 1, (int)( ( wait_until - now + 999 ) / 1000 ) );
+		if( res < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			perror( "poll" );
+			break;
+		}
+		if( res == 0 )
+			continue;
+
+		char buff[4096];
+		ssize_t len = read( s.master, buff, sizeof buff );
+		if( len <= 0 )
+		{
+			/* fish exited */
+			break;
+		}
+		last = get_time();
+	}
+	return last;
+}
+
+/**
+   Send a key to fish and add the time until the screen settled to \c result
+*/
+static void measure( session_t &s, scenario_result_t &result, const char *key )
+{
+	long long start = get_time();
+	write_all( s.master, key, strlen( key ) );
+	long long end = wait_settle( s, KEY_TIMEOUT );
+	if( end )
+	{
+		result.latencies.push_back( end - start );
+	}
+	else
+	{
+		result.timeouts++;
+	}
+}
+
+/**
+   Send keys to fish without measuring anything
+*/
+static void send( session_t &s, const char *keys )
+{
+	write_all( s.master, keys, strlen( keys ) );
+	wait_settle( s, KEY_TIMEOUT );
+}
+
+static void scenario_typing( session_t &s, scenario_result_t &result )
+{
+	const char *text = "echo the quick brown fox jumps over the lazy dog";
+	for( const char *c = text; *c; c++ )
+	{
+		char key[2] = { *c, 0 };
+		measure( s, result, key );
+	}
+	send( s, KEY_CLEAR );
+}
+
+static void scenario_complete( session_t &s, scenario_result_t &result )
+{
+	std::string line = "ls " + s.dir + "/files/uni";
+	send( s, line.c_str() );
+	measure( s, result, KEY_TAB );
+	send( s, KEY_CLEAR );
+}
+
+static void scenario_complete_list( session_t &s, scenario_result_t &result )
+{
+	std::string line = "ls " + s.dir + "/files/file_";
+	send( s, line.c_str() );
+	measure( s, result, KEY_TAB );
+	send( s, KEY_CLEAR );
+}
+
+static void scenario_history( session_t &s, scenario_result_t &result )
+{
+	send( s, "git" );
+	for( int i=0; i<10; i++ )
+	{
+		measure( s, result, KEY_UP );
+	}
+	send( s, KEY_CLEAR );
+}
+
+static void scenario_paste( session_t &s, scenario_result_t &result )
+{
+	std::string text = "echo";
+	while( text.size() < 400 )
+	{
+		text.append( " pasted" );
+	}
+	measure( s, result, text.c_str() );
+	send( s, KEY_CLEAR );
+}
+
+/**
+   The scenarios, in the order they are run
+*/
+static const struct
+{
+	const char *name;
+	void (*run)( session_t &s, scenario_result_t &result );
+}
+scenarios[] =
+{
+	{ "typing", &scenario_typing },
+	{ "complete", &scenario_complete },
+	{ "complete-list", &scenario_complete_list },
+	{ "history", &scenario_history },
+	{ "paste", &scenario_paste }
+};
+
+#define SCENARIO_COUNT (sizeof scenarios / sizeof *scenarios)
+
+static bool write_file( const std::string &path, const std::string &contents )
+{
+	FILE *f = fopen( path.c_str(), "w" );
+	if( ! f )
+	{
+		perror( path.c_str() );
+		return false;
+	}
+	fwrite( contents.data(), 1, contents.size(), f );
+	return fclose( f ) == 0;
+}
+
+/**
+   Make the home and configuration directories the fish under test
+   uses, so that the measurements don't depend on the configuration of
+   the user running them
+*/
+static bool setup_dir( const std::string &dir )
+{
+	const char *dirs[] =
+	{
+		"/home", "/config", "/config/fish", "/files"
+	};
+	for( size_t i=0; i<sizeof dirs / sizeof *dirs; i++ )
+	{
+		if( mkdir( ( dir + dirs[i] ).c_str(), 0700 ) )
+		{
+			perror( "mkdir" );
+			return false;
+		}
+	}
+
+	std::string history;
+	char buff[128];
+	for( int i=0; i<HISTORY_ITEMS; i++ )
+	{
+		snprintf( buff, sizeof buff, "- cmd: %s %d\n   when: %d\n", i % 2 ? "git commit -m change" : "make test", i, 1300000000 + i );
+		history.append( buff );
+	}
+
+	for( int i=0; i<10; i++ )
+	{
+		snprintf( buff, sizeof buff, "/files/file_%d", i );
+		if( ! write_file( dir + buff, "" ) )
+			return false;
+	}
+
+	return write_file( dir + "/config/fish/config.fish", "set fish_greeting\n" ) &&
+		write_file( dir + "/config/fish/fish_history", history ) &&
+		write_file( dir + "/files/unique_name.txt", "" );
+}
+
+/**
+   Start fish on a new 80x24 pseudo-terminal and wait for the first prompt
+*/
+static bool start_fish( session_t &s, const char *fish )
+{
+	s.master = posix_openpt( O_RDWR | O_NOCTTY );
+	if( s.master < 0 || grantpt( s.master ) || unlockpt( s.master ) )
+	{
+		perror( "posix_openpt" );
+		return false;
+	}
+	const char *slave_name = ptsname( s.master );
+
+	s.pid = fork();
+	if( s.pid < 0 )
+	{
+		perror( "fork" );
+		return false;
+	}
+
+	if( s.pid == 0 )
+	{
+		setsid();
+		int slave = open( slave_name, O_RDWR );
+		if( slave < 0 )
+			_exit( 1 );
+#ifdef TIOCSCTTY
+		ioctl( slave, TIOCSCTTY, 0 );
+#endif
+		struct winsize size;
+		memset( &size, 0, sizeof size );
+		size.ws_row = 24;
+		size.ws_col = 80;
+		ioctl( slave, TIOCSWINSZ, &size );
+
+		dup2( slave, 0 );
+		dup2( slave, 1 );
+		dup2( slave, 2 );
+		if( slave > 2 )
+			close( slave );
+		close( s.master );
+
+		setenv( "TERM", "xterm", 1 );
+		setenv( "HOME", ( s.dir + "/home" ).c_str(), 1 );
+		setenv( "XDG_CONFIG_HOME", ( s.dir + "/config" ).c_str(), 1 );
+		setenv( "FISHD_SOCKET_DIR", s.dir.c_str(), 1 );
+		execl( fish, fish, "-i", (char *)0 );
+		_exit( 127 );
+	}
+
+	if( ! wait_settle( s, STARTUP_TIMEOUT ) )
+	{
+		fprintf( stderr, "key_latency: %s did not show a prompt\n", fish );
+		return false;
+	}
+	return true;
+}
+
+static void stop_fish( session_t &s )
+{
+	send( s, "exit\n" );
+	kill( s.pid, SIGHUP );
+	waitpid( s.pid, 0, 0 );
+	close( s.master );
+}
+
+/**
+   Returns the latency below which \c p percent of the measurements lie
+*/
+static long long percentile( const std::vector<long long> &sorted, int p )
+{
+	size_t idx = ( sorted.size() * p + 99 ) / 100;
+	if( idx < 1 )
+		idx = 1;
+	return sorted.at( idx - 1 );
+}
+
+static void usage()
+{
+	fprintf( stderr, "Usage: key_latency [-n RUNS] [-t MS] FISH [SCENARIO...]\n" );
+	fprintf( stderr, "Scenarios:" );
+	for( size_t i=0; i<SCENARIO_COUNT; i++ )
+		fprintf( stderr, " %s", scenarios[i].name );
+	fprintf( stderr, "\n" );
+}
+
+int main( int argc, char **argv )
+{
+	int runs = 5;
+	double threshold = 0;
+
+	int opt;
+	while( ( opt = getopt( argc, argv, "n:t:h" ) ) != -1 )
+	{
+		switch( opt )
+		{
+			case 'n':
+			{
+				runs = atoi( optarg );
+				break;
+			}
+
+			case 't':
+			{
+				threshold = atof( optarg );
+				break;
+			}
+
+			default:
+			{
+				usage();
+				return opt == 'h' ? 0 : 2;
+			}
+		}
+	}
+
+	if( optind >= argc || runs < 1 )
+	{
+		usage();
+		return 2;
+	}
+	const char *fish = argv[optind++];
+
+	std::vector<scenario_result_t> results;
+	for( size_t i=0; i<SCENARIO_COUNT; i++ )
+	{
+		bool selected = ( optind >= argc );
+		for( int j=optind; j<argc; j++ )
+		{
+			if( ! strcmp( argv[j], scenarios[i].name ) )
+				selected = true;
+		}
+		if( selected )
+		{
+			scenario_result_t result;
+			result.name = scenarios[i].name;
+			result.timeouts = 0;
+			results.push_back( result );
+		}
+	}
+	if( results.empty() )
+	{
+		usage();
+		return 2;
+	}
+
+	char dir_template[] = "/tmp/key_latency.XXXXXX";
+	if( ! mkdtemp( dir_template ) )
+	{
+		perror( "mkdtemp" );
+		return 2;
+	}
+
+	session_t s;
+	s.dir = dir_template;
+	signal( SIGPIPE, SIG_IGN );
+
+	int status = 0;
+	if( ! setup_dir( s.dir ) || ! start_fish( s, fish ) )
+	{
+		status = 2;
+	}
+	else
+	{
+		for( int run=0; run<runs; run++ )
+		{
+			for( size_t i=0; i<results.size(); i++ )
+			{
+				for( size_t j=0; j<SCENARIO_COUNT; j++ )
+				{
+					if( results[i].name == scenarios[j].name )
+						scenarios[j].run( s, results[i] );
+				}
+			}
+		}
+		stop_fish( s );
+
+		printf( "%-16s %6s %8s %8s %8s %8s %8s\n", "scenario", "keys", "p50", "p90", "p99", "max", "timeouts" );
+		for( size_t i=0; i<results.size(); i++ )
+		{
+			scenario_result_t &result = results[i];
+			std::vector<long long> &sorted = result.latencies;
+			std::sort( sorted.begin(), sorted.end() );
+			printf( "%-16s %6d", result.name, (int)sorted.size() );
+			if( sorted.empty() )
+			{
+				printf( " %8s %8s %8s %8s", "-", "-", "-", "-" );
+			}
+			else
+			{
+				int ps[] = { 50, 90, 99, 100 };
+				for( size_t j=0; j<4; j++ )
+					printf( " %8.1f", percentile( sorted, ps[j] ) / 1000.0 );
+			}
+			printf( " %8d\n", result.timeouts );
+
+			if( result.timeouts )
+			{
+				fprintf( stderr, "key_latency: %s: fish did not respond to %d keys\n", result.name, result.timeouts );
+				status = 1;
+			}
+			else if( threshold > 0 && percentile( sorted, 90 ) > threshold * 1000 )
+			{
+				fprintf( stderr, "key_latency: %s: p90 of %.1f ms is over the threshold of %.1f ms\n", result.name, percentile( sorted, 90 ) / 1000.0, threshold );
+				status = 1;
+			}
+		}
+	}
+
+	std::string command = "rm -rf '" + s.dir + "'";
+	if( system( command.c_str() ) )
+		fprintf( stderr, "key_latency: could not remove %s\n", s.dir.c_str() );
+
+	return status;
+}
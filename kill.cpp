@@ -17,7 +17,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
-#include <algorithm>
+#include <list>
+#include <tr1/unordered_map>
 
 #include "fallback.h"
 #include "util.h"
@@ -42,10 +43,60 @@
 /** Current kill string */
 //static ll_node_t *kill_current=0;
 
-/** Kill ring */
+/** Kill ring, most recent kill first */
 typedef std::list<wcstring> kill_list_t;
 static kill_list_t kill_list;
 
+/**
+   Index from the hash of each string in the kill ring to its
+   position. A string is in the ring at most once. List iterators
+   stay valid when the ring is rotated, so this only changes when
+   strings are added or removed.
+*/
+typedef std::tr1::unordered_multimap<size_t, kill_list_t::iterator> kill_index_t;
+static kill_index_t kill_index;
+
+/**
+   Returns the position in kill_index of the specified string, or
+   kill_index.end() if it is not in the ring
+*/
+static kill_index_t::iterator kill_find( const wcstring &str, size_t hash )
+{
+	std::pair<kill_index_t::iterator, kill_index_t::iterator> range = kill_index.equal_range( hash );
+	for( kill_index_t::iterator iter = range.first; iter != range.second; ++iter )
+	{
+		if( *iter->second == str )
+			return iter;
+	}
+	return kill_index.end();
+}
+
+/**
+   Put the specified string at the front of the kill ring. A copy
+   already in the ring is moved rather than duplicated. If the ring
+   is full, the oldest string is dropped.
+*/
+static void kill_push( const wcstring &str )
+{
+	const size_t hash = std::tr1::hash<wcstring>()( str );
+	kill_index_t::iterator iter = kill_find( str, hash );
+	if( iter != kill_index.end() )
+	{
+		kill_list.splice( kill_list.begin(), kill_list, iter->second );
+		return;
+	}
+
+	kill_list.push_front( str );
+	kill_index.insert( kill_index_t::value_type( hash, kill_list.begin() ) );
+
+	if( kill_index.size() > KILL_MAX )
+	{
+		const wcstring &oldest = kill_list.back();
+		kill_index.erase( kill_find( oldest, std::tr1::hash<wcstring>()( oldest ) ) );
+		kill_list.pop_back();
+	}
+}
+
 /**
    Contents of the X clipboard, at last time we checked it
 */
@@ -78,7 +129,7 @@ void kill_add( const wcstring &str )
         
 	wcstring cmd;
     wchar_t *escaped_str = NULL;
-	kill_list.push_front(str);
+	kill_push(str);
 
 	/*
 	   Check to see if user has set the FISH_CLIPBOARD_CMD variable,
@@ -129,14 +180,16 @@ void kill_add( const wcstring &str )
 }
 
 /**
-   Remove first match for specified string from circular list
+   Remove the specified string from the kill ring
 */
 static void kill_remove( const wcstring &s )
 {
     ASSERT_IS_MAIN_THREAD();
-    kill_list_t::iterator iter = std::find(kill_list.begin(), kill_list.end(), s);
-    if (iter != kill_list.end())
-        kill_list.erase(iter);
+    kill_index_t::iterator iter = kill_find(s, std::tr1::hash<wcstring>()(s));
+    if (iter != kill_index.end()) {
+        kill_list.erase(iter->second);
+        kill_index.erase(iter);
+    }
 }
 		
 		
@@ -197,7 +250,7 @@ static void kill_check_x_buffer()
                 {
                     free(cut_buffer);
                     cut_buffer = wcsdup(new_cut_buffer.c_str());
-                    kill_list.push_front( new_cut_buffer );
+                    kill_push( new_cut_buffer );
                 }
 			}
 		}
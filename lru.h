@@ -1,6 +1,8 @@
 /** \file lru.h
 
-    Least-recently-used cache implementation
+    Least-recently-used cache implementation. Nodes are kept in a
+    circular linked list in order of use, and found through a hash
+    table, so lookups, additions and evictions take constant time.
 */
 
 #ifndef FISH_LRU_H
@@ -10,12 +12,19 @@
 #include <map>
 #include <set>
 #include <list>
+#include <tr1/unordered_set>
 #include "common.h"
 
-/** A predicate to compare dereferenced pointers */
-struct dereference_less_t {
+/** A predicate to compare the keys of dereferenced nodes for equality */
+struct dereference_key_equal_t {
     template <typename ptr_t>
-    bool operator()(ptr_t p1, ptr_t p2) const { return *p1 < *p2; }
+    bool operator()(ptr_t p1, ptr_t p2) const { return p1->key == p2->key; }
+};
+
+/** A hash function on the keys of dereferenced nodes */
+struct dereference_key_hash_t {
+    template <typename ptr_t>
+    size_t operator()(ptr_t p) const { return std::tr1::hash<wcstring>()(p->key); }
 };
 
 class lru_node_t {
@@ -30,9 +39,6 @@ public:
     
     /** Constructor */
     lru_node_t(const wcstring &pkey) : prev(NULL), next(NULL), key(pkey) { }
-    
-    /** operator< for std::set */
-    bool operator<(const lru_node_t &other) const { return key < other.key; }
 };
 
 template<class node_type_t>
@@ -45,8 +51,11 @@ class lru_cache_t {
     /** Count of nodes */
     size_t node_count;
     
-    /** The set of nodes */
-    typedef std::set<lru_node_t *, dereference_less_t> node_set_t;
+    /** Number of lookups that found a node, that found none, and number of evicted nodes */
+    unsigned long hit_count, miss_count, eviction_count;
+    
+    /** The set of nodes, hashed by key */
+    typedef std::tr1::unordered_set<lru_node_t *, dereference_key_hash_t, dereference_key_equal_t> node_set_t;
     node_set_t node_set;
         
     void promote_node(node_type_t *node) {
@@ -75,6 +84,7 @@ class lru_cache_t {
         /* Remove us from the set */
         node_set.erase(condemned_node);
         node_count--;
+        eviction_count++;
 
         /* Tell ourselves */
         this->node_was_evicted(condemned_node);
@@ -96,7 +106,7 @@ class lru_cache_t {
     public:
     
     /** Constructor */
-    lru_cache_t(size_t max_size = 1024 ) : max_node_count(max_size), node_count(0), mouth(wcstring()) {
+    lru_cache_t(size_t max_size = 1024 ) : max_node_count(max_size), node_count(0), hit_count(0), miss_count(0), eviction_count(0), mouth(wcstring()) {
         /* Hook up the mouth to itself: a one node circularly linked list! */
         mouth.prev = mouth.next = &mouth;
     }
@@ -119,6 +129,9 @@ class lru_cache_t {
         if (iter != node_set.end()) {
             result = static_cast<node_type_t*>(*iter);
             promote_node(result);
+            hit_count++;
+        } else {
+            miss_count++;
         }
         return result;
     }
@@ -182,6 +195,21 @@ class lru_cache_t {
         return node_count;
     }
     
+    /** Returns the number of calls to get_node that found a node */
+    unsigned long hits(void) const {
+        return hit_count;
+    }
+    
+    /** Returns the number of calls to get_node that found no node */
+    unsigned long misses(void) const {
+        return miss_count;
+    }
+    
+    /** Returns the number of nodes that have been evicted */
+    unsigned long evictions(void) const {
+        return eviction_count;
+    }
+    
     /** Evicts all nodes */
     void evict_all_nodes(void) {
         while (node_count > 0) {
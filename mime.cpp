@@ -0,0 +1,495 @@
+/** \file mime.cpp
+
+	Looks up descriptions of file types in the XDG mime database.
+
+	The lookup of a description works the same way as in mimedb: the
+	mimetype is found using the xdgmime library, and the description is
+	found using a simple string search in the xml file for that
+	mimetype. Descriptions are cached in memory and in a file in the
+	fish configuration directory. The cache file consists of a header
+	line identifying the locale and the state of the mime database the
+	descriptions were taken from, followed by one line per suffix of the
+	form 'suffix<TAB>description'. Sessions append the suffixes they
+	look up, and a file with an unexpected header is started over.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <locale.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "wutil.h"
+#include "path.h"
+#include "mime.h"
+#include "xdgmime.h"
+
+/**
+   Location of the mime xml database, relative to a base data directory
+*/
+#define MIME_DIR "mime/"
+
+/**
+   Filename suffix for xml files
+*/
+#define MIME_SUFFIX ".xml"
+
+/**
+   Start tag for language-specific comment
+*/
+#define START_TAG "<comment( +xml:lang *= *(\"%s\"|'%s'))? *>"
+
+/**
+   End tag for comment
+*/
+#define STOP_TAG "</comment *>"
+
+/**
+   Name of the cache file, relative to the fish configuration directory
+*/
+#define MIME_CACHE_NAME L"/fish_mime_cache"
+
+/**
+   First part of the header line of the cache file. The version number must be changed if the format changes.
+*/
+#define MIME_CACHE_HEADER "# fish mime cache, version 1"
+
+/**
+   Lock protecting the xdgmime library, which is not thread safe, and all of the state below
+*/
+static pthread_mutex_t s_mime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   The description cache
+*/
+struct mime_cache_t
+{
+	/** Whether the cache file has been read */
+	bool loaded;
+
+	/** Whether the cache file on disk has the expected header, so new entries can be appended to it */
+	bool file_is_current;
+
+	/** The header the cache file is expected to have */
+	std::string header;
+
+	/** Map from suffix to description. Unknown suffixes map to the empty string. */
+	std::map<wcstring, wcstring> descriptions;
+
+	/** Regular expressions used to find the description in an xml file, or NULL if they have not been compiled */
+	regex_t *start_re, *stop_re;
+
+	mime_cache_t() : loaded(false), file_is_current(false), start_re(NULL), stop_re(NULL)
+	{
+	}
+};
+
+static mime_cache_t s_mime_cache;
+
+/**
+   Returns the XDG data directories, in order of decreasing importance
+*/
+static std::vector<std::string> mime_data_dirs()
+{
+	std::vector<std::string> result;
+
+	const char *xdg_data_home = getenv("XDG_DATA_HOME");
+	if (xdg_data_home)
+	{
+		result.push_back(xdg_data_home);
+	}
+	else
+	{
+		const char *home = getenv("HOME");
+		if (home)
+			result.push_back(std::string(home) + "/.local/share");
+	}
+
+	const char *xdg_data_dirs = getenv("XDG_DATA_DIRS");
+	if (! xdg_data_dirs)
+		xdg_data_dirs = "/usr/local/share:/usr/share";
+
+	const char *ptr = xdg_data_dirs;
+	while (*ptr)
+	{
+		const char *end = strchr(ptr, ':');
+		if (! end)
+			end = ptr + strlen(ptr);
+		if (end > ptr)
+			result.push_back(std::string(ptr, end));
+		ptr = *end ? end + 1 : end;
+	}
+
+	for (size_t i=0; i < result.size(); i++)
+	{
+		std::string &dir = result.at(i);
+		if (dir.at(dir.size() - 1) != '/')
+			dir.push_back('/');
+	}
+	return result;
+}
+
+/**
+   Returns a string identifying the current locale and the state of the mime database, used as the header of the cache file
+*/
+static std::string mime_cache_header(const std::vector<std::string> &data_dirs)
+{
+	/* Use the newest glob file as the state of the database, update-mime-database regenerates them along with the xml files */
+	long long newest = 0;
+	const char * const globs[] = {"globs", "globs2"};
+	for (size_t i=0; i < data_dirs.size(); i++)
+	{
+		for (size_t j=0; j < sizeof globs / sizeof *globs; j++)
+		{
+			std::string path = data_dirs.at(i) + MIME_DIR + globs[j];
+			struct stat buf;
+			if (! stat(path.c_str(), &buf))
+				newest = std::max(newest, (long long)buf.st_mtime);
+		}
+	}
+
+	const char *lang = setlocale(LC_MESSAGES, NULL);
+	char buff[128];
+	snprintf(buff, sizeof buff, ", database %lld, locale ", newest);
+	return std::string(MIME_CACHE_HEADER) + buff + (lang ? lang : "C");
+}
+
+/**
+   Returns the name of the cache file, or the empty string if there is no configuration directory
+*/
+static wcstring mime_cache_filename()
+{
+	wcstring path;
+	if (! path_get_config(path))
+		return L"";
+	return path + MIME_CACHE_NAME;
+}
+
+/**
+   Reads the cache file into the cache, if it has the expected header
+*/
+static void mime_cache_load(mime_cache_t &cache)
+{
+	ASSERT_IS_LOCKED(s_mime_lock);
+	cache.loaded = true;
+	cache.header = mime_cache_header(mime_data_dirs());
+
+	const wcstring filename = mime_cache_filename();
+	if (filename.empty())
+		return;
+
+	int fd = wopen_cloexec(filename, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	std::string contents;
+	char buff[4096];
+	ssize_t amt;
+	while ((amt = read_loop(fd, buff, sizeof buff)) > 0)
+		contents.append(buff, amt);
+	close(fd);
+
+	size_t line_start = 0;
+	bool first_line = true;
+	while (line_start < contents.size())
+	{
+		size_t line_end = contents.find('\n', line_start);
+		if (line_end == std::string::npos)
+		{
+			/* An incomplete line, probably being written by another session right now */
+			break;
+		}
+		const std::string line(contents, line_start, line_end - line_start);
+		line_start = line_end + 1;
+
+		if (first_line)
+		{
+			first_line = false;
+			if (line != cache.header)
+				return;
+			cache.file_is_current = true;
+			continue;
+		}
+
+		size_t tab = line.find('\t');
+		if (tab == std::string::npos || tab == 0)
+			continue;
+		cache.descriptions[str2wcstring(line.substr(0, tab))] = str2wcstring(line.substr(tab + 1));
+	}
+}
+
+/**
+   Appends new entries to the cache file, starting the file over if it is out of date. The entries are the suffixes in the specified list, with their descriptions taken from the cache.
+*/
+static void mime_cache_append(mime_cache_t &cache, const wcstring_list_t &suffixes)
+{
+	ASSERT_IS_LOCKED(s_mime_lock);
+
+	std::string entries;
+	for (size_t i=0; i < suffixes.size(); i++)
+	{
+		const wcstring &suffix = suffixes.at(i);
+		const wcstring &desc = cache.descriptions[suffix];
+
+		/* Suffixes with tabs or newlines can't be represented in the file */
+		if (suffix.find_first_of(L"\t\n") != wcstring::npos || desc.find(L'\n') != wcstring::npos)
+			continue;
+
+		entries.append(wcs2string(suffix));
+		entries.push_back('\t');
+		entries.append(wcs2string(desc));
+		entries.push_back('\n');
+	}
+	if (entries.empty())
+		return;
+
+	const wcstring filename = mime_cache_filename();
+	if (filename.empty())
+		return;
+
+	std::string data;
+	int flags = O_WRONLY | O_CREAT | O_APPEND;
+	if (! cache.file_is_current)
+	{
+		flags |= O_TRUNC;
+		data = cache.header;
+		data.push_back('\n');
+	}
+	data.append(entries);
+
+	int fd = wopen_cloexec(filename, flags, 0644);
+	if (fd < 0)
+		return;
+
+	/* Write all entries at once, so that entries appended by concurrent sessions don't get interleaved */
+	if (write_loop(fd, data.data(), data.size()) >= 0)
+		cache.file_is_current = true;
+	close(fd);
+}
+
+/**
+   Return a regular expression that matches all strings specifying the current locale
+*/
+static std::string mime_lang_re()
+{
+	const char *lang = setlocale(LC_MESSAGES, NULL);
+	std::string result;
+	bool close = false;
+	for (; lang && *lang; lang++)
+	{
+		switch (*lang)
+		{
+			case '@':
+			case '.':
+			case '_':
+				if (close)
+					result.append(")?");
+				close = true;
+				result.push_back('(');
+				result.push_back(*lang);
+				break;
+
+			default:
+				result.push_back(*lang);
+				break;
+		}
+	}
+	if (close)
+		result.append(")?");
+	return result;
+}
+
+/**
+   Compile the regular expressions used to find descriptions. Returns false on failure.
+*/
+static bool mime_compile_regexes(mime_cache_t &cache)
+{
+	if (cache.start_re)
+		return true;
+
+	const std::string lang = mime_lang_re();
+	std::vector<char> buff(strlen(START_TAG) + 2 * lang.size() + 1);
+	snprintf(&buff[0], buff.size(), START_TAG, lang.c_str(), lang.c_str());
+	const std::string start_tag(&buff[0]);
+
+	regex_t *start_re = new regex_t, *stop_re = new regex_t;
+	if (regcomp(start_re, start_tag.c_str(), REG_EXTENDED))
+	{
+		delete start_re;
+		delete stop_re;
+		return false;
+	}
+	if (regcomp(stop_re, STOP_TAG, REG_EXTENDED))
+	{
+		regfree(start_re);
+		delete start_re;
+		delete stop_re;
+		return false;
+	}
+	cache.start_re = start_re;
+	cache.stop_re = stop_re;
+	return true;
+}
+
+/**
+   Remove excessive whitespace from string. Replaces arbitrary sequence
+   of whitespace with a single space. Also removes any leading and
+   trailing whitespace
+*/
+static std::string mime_munge(const char *in)
+{
+	std::string result;
+	bool had_whitespace = false;
+	for (; *in; in++)
+	{
+		switch (*in)
+		{
+			case ' ':
+			case '\n':
+			case '\t':
+			case '\r':
+				had_whitespace = true;
+				break;
+
+			default:
+				if (had_whitespace && ! result.empty())
+					result.push_back(' ');
+				had_whitespace = false;
+				result.push_back(*in);
+				break;
+		}
+	}
+	return result;
+}
+
+/**
+   Get the description of the specified mimetype from its xml file, or the empty string if there is none
+*/
+static std::string mime_get_description(mime_cache_t &cache, const char *mimetype)
+{
+	ASSERT_IS_LOCKED(s_mime_lock);
+	if (! mime_compile_regexes(cache))
+		return "";
+
+	const std::vector<std::string> data_dirs = mime_data_dirs();
+	std::string contents;
+	bool found = false;
+	for (size_t i=0; i < data_dirs.size() && ! found; i++)
+	{
+		const std::string path = data_dirs.at(i) + MIME_DIR + mimetype + MIME_SUFFIX;
+		int fd = wopen_cloexec(str2wcstring(path), O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		char buff[4096];
+		ssize_t amt;
+		while ((amt = read_loop(fd, buff, sizeof buff)) > 0)
+			contents.append(buff, amt);
+		close(fd);
+		found = true;
+	}
+	if (! found)
+		return "";
+
+	/*
+	  On multiple matches, use the longest match, should be a pretty
+	  good heuristic for best match...
+	*/
+	const char *start = contents.c_str(), *best_start = NULL;
+	regmatch_t match[1];
+	regoff_t w = -1;
+	while (! regexec(cache.start_re, start, 1, match, 0))
+	{
+		regoff_t new_w = match[0].rm_eo - match[0].rm_so;
+		start += match[0].rm_eo;
+		if (new_w > w)
+		{
+			w = new_w;
+			best_start = start;
+		}
+	}
+
+	if (best_start && ! regexec(cache.stop_re, best_start, 1, match, 0))
+	{
+		const std::string desc(best_start, match[0].rm_so);
+		return mime_munge(desc.c_str());
+	}
+	return "";
+}
+
+/**
+   Look up the description of a suffix in the mime database
+*/
+static wcstring mime_describe_suffix_uncached(mime_cache_t &cache, const wcstring &suffix)
+{
+	ASSERT_IS_LOCKED(s_mime_lock);
+	const std::string narrow = wcs2string(suffix);
+	const char *mimetype = xdg_mime_get_mime_type_from_file_name(narrow.c_str());
+	if (mimetype)
+		mimetype = xdg_mime_unalias_mime_type(mimetype);
+	if (! mimetype || ! strcmp(mimetype, XDG_MIME_TYPE_UNKNOWN))
+		return L"";
+
+	wcstring desc = str2wcstring(mime_get_description(cache, mimetype));
+	if (desc == L"unknown")
+		desc.clear();
+
+	/*
+	  I have decided I prefer to have the description
+	  begin in uppercase and the whole universe will just
+	  have to accept it. Hah!
+	*/
+	if (! desc.empty())
+		desc[0] = towupper(desc[0]);
+	return desc;
+}
+
+void mime_describe_suffixes(const wcstring_list_t &suffixes, wcstring_list_t &out_descs)
+{
+	scoped_lock lock(s_mime_lock);
+	mime_cache_t &cache = s_mime_cache;
+	if (! cache.loaded)
+		mime_cache_load(cache);
+
+	wcstring_list_t added;
+	out_descs.reserve(out_descs.size() + suffixes.size());
+	for (size_t i=0; i < suffixes.size(); i++)
+	{
+		const wcstring &suffix = suffixes.at(i);
+		std::map<wcstring, wcstring>::const_iterator iter = cache.descriptions.find(suffix);
+		if (iter == cache.descriptions.end())
+		{
+			const wcstring desc = mime_describe_suffix_uncached(cache, suffix);
+			iter = cache.descriptions.insert(std::make_pair(suffix, desc)).first;
+			added.push_back(suffix);
+		}
+		out_descs.push_back(iter->second);
+	}
+
+	mime_cache_append(cache, added);
+}
+
+wcstring mime_describe_suffix(const wcstring &suffix)
+{
+	wcstring_list_t descs;
+	mime_describe_suffixes(wcstring_list_t(1, suffix), descs);
+	return descs.at(0);
+}
@@ -0,0 +1,40 @@
+/** \file mime.h
+
+	Looks up descriptions of file types in the XDG mime database. This
+	is the same lookup that the mimedb command does, but done in-process
+	and backed by a cache file that is shared between fish sessions.
+*/
+
+#ifndef FISH_MIME_H
+#define FISH_MIME_H
+
+#include "common.h"
+
+/**
+   Returns the description of files with the specified suffix, like
+   ".txt", in the current locale. The first letter of the description
+   is capitalized. Returns the empty string if the mime database knows
+   no description for the suffix.
+
+   Results are remembered for the lifetime of the process and stored
+   in a cache file in the fish configuration directory, so that later
+   sessions do not need to consult the mime database for the same
+   suffix again. The cache file is discarded when the locale or the
+   mime database changes.
+
+   This function may be called from any thread.
+*/
+wcstring mime_describe_suffix(const wcstring &suffix);
+
+/**
+   Looks up the descriptions of all the specified suffixes, and
+   appends them to \c out_descs in the same order. This works like
+   calling mime_describe_suffix for each suffix, but the suffixes that
+   are not cached yet are looked up together and written to the cache
+   file in one go.
+
+   This function may be called from any thread.
+*/
+void mime_describe_suffixes(const wcstring_list_t &suffixes, wcstring_list_t &out_descs);
+
+#endif
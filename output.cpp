@@ -63,6 +63,8 @@
 #define COLORS (sizeof(col)/sizeof(wchar_t *))
 
 static int writeb_internal( char c );
+static void write_bytes_internal( const char *buff, size_t len );
+static void forget_color_sequences();
 
 /**
  Names of different colors. 
@@ -110,6 +112,11 @@ static const int col_idx[]=
 
 static int (*out)(char c) = &writeb_internal;
 
+/**
+ The function used for writing many bytes at once, or NULL if they are written one at a time using out
+ */
+static void (*out_bytes)(const char *buff, size_t len) = &write_bytes_internal;
+
 /**
  Name of terminal
  */
@@ -119,10 +126,11 @@ static wcstring current_term;
 static bool support_term256 = false;
 
 
-void output_set_writer( int (*writer)(char) )
+void output_set_writer( int (*writer)(char), void (*bytes_writer)(const char *, size_t) )
 {
 	CHECK( writer, );
 	out = writer;
+	out_bytes = bytes_writer;
 }
 
 int (*output_get_writer())(char)
@@ -130,6 +138,11 @@ int (*output_get_writer())(char)
 	return out;
 }
 
+void (*output_get_bytes_writer())(const char *, size_t)
+{
+	return out_bytes;
+}
+
 static bool term256_support_is_native(void) {
     /* Return YES if we think the term256 support is "native" as opposed to forced. */
     return max_colors == 256;
@@ -140,6 +153,8 @@ bool output_get_supports_term256() {
 }
 
 void output_set_supports_term256(bool val) {
+    if (val != support_term256)
+        forget_color_sequences();
     support_term256 = val;
 }
 
@@ -152,33 +167,111 @@ static unsigned char index_for_color(rgb_color_t c) {
 }
 
 
-static bool write_color(char *todo, unsigned char idx, bool is_fg) {
-    bool result = false;
-    if (idx < 16 || term256_support_is_native()) {
-        /* Use tparm */
-        writembs( tparm( todo, idx ) );
-        result = true;
-    } else {
-        /* We are attempting to bypass the term here. Generate the ANSI escape sequence ourself. */
-        char stridx[128];
-        format_long_safe(stridx, (long)idx);
-        char buff[128] = "\x1b[";
-        strcat(buff, is_fg ? "38;5;" : "48;5;");
-        strcat(buff, stridx);
-        strcat(buff, "m");
-        
-        int (*writer)(char) = output_get_writer();
-        if (writer) {
-            for (size_t i=0; buff[i]; i++) {
-                writer(buff[i]);
+/**
+ Collects the output of tputs for color_sequence
+ */
+static std::string *s_sequence_buffer = NULL;
+
+static int sequence_writer( tputs_arg_t c )
+{
+    s_sequence_buffer->push_back((char)c);
+    return 0;
+}
+
+/**
+ The escape sequences for setting the foreground and background colors, indexed by color. They are computed by color_sequence.
+ */
+static std::string s_color_sequences[2][256];
+
+/**
+ Whether the entries of s_color_sequences have been computed
+ */
+static bool s_color_sequence_known[2][256];
+
+/**
+ The terminfo strings that s_color_sequences were computed from
+ */
+static const char *s_color_sequence_todo[2];
+
+static void forget_color_sequences()
+{
+    memset(s_color_sequence_known, 0, sizeof s_color_sequence_known);
+    s_color_sequence_todo[0] = s_color_sequence_todo[1] = NULL;
+}
+
+/**
+ Returns the bytes that set the color idx, using the terminfo string todo. Running tparm and tputs every time the color changes is slow, so the result is remembered until the terminfo string changes.
+ */
+static const std::string &color_sequence(char *todo, unsigned char idx, bool is_fg) {
+    const int which = is_fg ? 0 : 1;
+    if (s_color_sequence_todo[which] != todo) {
+        memset(s_color_sequence_known[which], 0, sizeof s_color_sequence_known[which]);
+        s_color_sequence_todo[which] = todo;
+    }
+    
+    std::string &result = s_color_sequences[which][idx];
+    if (! s_color_sequence_known[which][idx]) {
+        result.clear();
+        if (idx < 16 || term256_support_is_native()) {
+            /* Use tparm */
+            char *str = tparm( todo, idx );
+            if (str) {
+                std::string *old_buffer = s_sequence_buffer;
+                s_sequence_buffer = &result;
+                tputs(str, 1, &sequence_writer);
+                s_sequence_buffer = old_buffer;
             }
+        } else {
+            /* We are attempting to bypass the term here. Generate the ANSI escape sequence ourself. */
+            char stridx[128];
+            format_long_safe(stridx, (long)idx);
+            result = "\x1b[";
+            result.append(is_fg ? "38;5;" : "48;5;");
+            result.append(stridx);
+            result.append("m");
         }
-        
-        result = true;
+        s_color_sequence_known[which][idx] = true;
     }
     return result;
 }
 
+/**
+ Returns the terminfo string for setting the foreground or background color, or NULL if the terminal can't set it
+ */
+static char *color_todo(bool is_fg) {
+    char *set_a = is_fg ? set_a_foreground : set_a_background;
+    char *set = is_fg ? set_foreground : set_background;
+    if (set_a && set_a[0]) {
+        return set_a;
+    } else if (set && set[0]) {
+        return set;
+    } else {
+        return NULL;
+    }
+}
+
+/**
+ Appends to out the bytes that the terminfo string str without parameters comes to
+ */
+static void append_mode_sequence(std::string &out, const char *str) {
+    if (! str) {
+        return;
+    } else if (! strstr(str, "$<")) {
+        out.append(str);
+    } else {
+        std::string *old_buffer = s_sequence_buffer;
+        s_sequence_buffer = &out;
+        tputs(str, 1, &sequence_writer);
+        s_sequence_buffer = old_buffer;
+    }
+}
+
+static bool write_color(char *todo, unsigned char idx, bool is_fg) {
+    const std::string &seq = color_sequence(todo, idx, is_fg);
+    write_bytes(seq.data(), seq.size());
+    return true;
+}
+
 static bool write_foreground_color(unsigned char idx) {
     if (set_a_foreground && set_a_foreground[0]) {
         return write_color(set_a_foreground, idx, true);
@@ -394,6 +487,29 @@ static int writeb_internal( char c )
 	return 0;
 }
 
+/**
+ Default method for writing many bytes, writes them to stdout with a single write()
+ */
+static void write_bytes_internal( const char *buff, size_t len )
+{
+	write_loop( 1, buff, len );
+}
+
+void write_bytes( const char *buff, size_t len )
+{
+	if( out_bytes )
+	{
+		out_bytes( buff, len );
+	}
+	else
+	{
+		for( size_t i=0; i<len; i++ )
+		{
+			out( buff[i] );
+		}
+	}
+}
+
 int writeb( tputs_arg_t b )
 {
 	out( b );
@@ -404,13 +520,18 @@ int writembs_internal( char *str )
 {
 	CHECK( str, 1 );
     
+	/* tputs only does something besides writing the string when it asks for padding */
+	if( ! strstr( str, "$<" ) )
+	{
+		write_bytes( str, strlen( str ) );
+		return 0;
+	}
 	return tputs(str,1,&writeb)==ERR?1:0;
 }
 
 int writech( wint_t ch )
 {
 	mbstate_t state;
-	size_t i;
 	char buff[MB_LEN_MAX+1];
 	size_t bytes;
     
@@ -434,17 +555,12 @@ int writech( wint_t ch )
 		}
 	}
 	
-	for( i=0; i<bytes; i++ )
-	{
-		out( buff[i] );
-	}
+	write_bytes( buff, bytes );
 	return 0;
 }
 
 void writestr( const wchar_t *str )
 {
-	char *pos;
-    
 	CHECK( str, );
 	
     //	while( *str )
@@ -472,17 +588,14 @@ void writestr( const wchar_t *str )
     else
         buffer = new char[len];
     
-	wcstombs( buffer, 
-             str,
-             len );
+	size_t written = wcstombs( buffer, 
+                              str,
+                              len );
     
 	/*
      Write
      */
-	for( pos = buffer; *pos; pos++ )
-	{
-		out( *pos );
-	}
+	write_bytes( buffer, written );
     
     if (buffer != static_buffer)
         delete[] buffer;
@@ -679,9 +792,57 @@ rgb_color_t parse_color( const wcstring &val, bool is_background ) {
     return result;
 }
 
+bool output_init_term( const wchar_t *term )
+{
+    if (cur_term) {
+        return true;
+    }
+    
+    const std::string narrow = term ? wcs2string(term) : std::string();
+    int err;
+    if (setupterm(term ? const_cast<char *>(narrow.c_str()) : NULL, STDOUT_FILENO, &err) == ERR) {
+        return false;
+    }
+    output_set_term(term ? term : L"");
+    return true;
+}
+
+void output_append_color_sequence(std::string &out, rgb_color_t fg, rgb_color_t bg, bool bold, bool underline, bool term256) {
+    char *fg_todo = color_todo(true), *bg_todo = color_todo(false);
+    
+    if (bold) {
+        append_mode_sequence(out, enter_bold_mode);
+    }
+    
+    if (underline) {
+        append_mode_sequence(out, enter_underline_mode);
+    }
+    
+    if (bg.is_normal()) {
+        if (bg_todo)
+            out.append(color_sequence(bg_todo, 0, false));
+        append_mode_sequence(out, exit_attribute_mode);
+    }
+    
+    if (fg.is_normal()) {
+        if (fg_todo)
+            out.append(color_sequence(fg_todo, 0, true));
+        append_mode_sequence(out, exit_attribute_mode);
+    } else if (! fg.is_none() && fg_todo) {
+        const unsigned char idx = fg.is_named() || ! term256 ? fg.to_name_index() : fg.to_term256_index();
+        out.append(color_sequence(fg_todo, idx, true));
+    }
+    
+    if (! bg.is_none() && ! bg.is_normal() && bg_todo) {
+        const unsigned char idx = bg.is_named() || ! term256 ? bg.to_name_index() : bg.to_term256_index();
+        out.append(color_sequence(bg_todo, idx, false));
+    }
+}
+
 void output_set_term( const wchar_t *term )
 {
 	current_term = term;
+	forget_color_sequences();
 }
 
 const wchar_t *output_get_term()
@@ -106,6 +106,13 @@ void set_color(rgb_color_t c, rgb_color_t c2);
 */
 int writembs_internal( char *str );
 
+/**
+   Write the specified bytes using the output method specified using
+   output_set_writer(). This is much faster than writing them one at a
+   time.
+*/
+void write_bytes( const char *buff, size_t len );
+
 /**
    Write a wide character using the output method specified using output_set_writer().
 */
@@ -145,17 +152,40 @@ int writeb( tputs_arg_t b );
    set_color and all other output functions in this library. By
    default, the write call is used to give completely unbuffered
    output to stdout.
+
+   \param writer the function that writes a single byte
+   \param bytes_writer the function that writes many bytes at once. If it is NULL, writer is called for every byte.
 */
-void output_set_writer( int (*writer)(char) );
+void output_set_writer( int (*writer)(char), void (*bytes_writer)(const char *, size_t) = NULL );
 
 /**
    Return the current output writer
  */
 int (*output_get_writer())(char) ;
 
+/**
+   Return the current writer for many bytes, which may be NULL
+ */
+void (*output_get_bytes_writer())(const char *, size_t);
+
 /** Set the terminal name */
 void output_set_term( const wchar_t *term );
 
+/**
+   Sets up terminfo for the specified terminal, or for the one named by
+   the TERM environment variable if term is null, unless terminfo has
+   been set up already. Returns false if the terminal is unknown.
+*/
+bool output_init_term( const wchar_t *term );
+
+/**
+   Appends to out the bytes that the set_color command writes to set
+   the specified modes, foreground and background colors. A color that
+   is none is left unchanged. If term256 is false, colors that are not
+   named are set to the closest named color.
+*/
+void output_append_color_sequence( std::string &out, rgb_color_t fg, rgb_color_t bg, bool bold, bool underline, bool term256 );
+
 /** Return the terminal name */
 const wchar_t *output_get_term();
 
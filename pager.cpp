@@ -0,0 +1,904 @@
+/** \file pager.cpp
+
+	The completion pager, see pager.h.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <unistd.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#if HAVE_NCURSES_H
+#include <ncurses.h>
+#else
+#include <curses.h>
+#endif
+
+#if HAVE_TERM_H
+#include <term.h>
+#elif HAVE_NCURSES_TERM_H
+#include <ncurses/term.h>
+#endif
+
+#include "fallback.h"
+#include "util.h"
+
+#include "wutil.h"
+#include "common.h"
+#include "complete.h"
+#include "output.h"
+#include "input_common.h"
+#include "pager.h"
+
+enum
+{
+	LINE_UP = R_NULL+1,
+	LINE_DOWN,
+	PAGE_UP,
+	PAGE_DOWN
+}
+	;
+
+enum
+{
+	/*
+	  Returnd by the pager if no more displaying is needed
+	*/
+	PAGER_DONE,
+	/*
+	  Returned by the pager if the completions would not fit in the specified number of columns
+	*/
+	PAGER_RETRY,
+	/*
+	  Returned by the pager if the terminal changes size
+	*/
+	PAGER_RESIZE
+}
+	;
+
+/**
+   The minimum width (in characters) the terminal may have for the pager to not refuse showing the completions
+*/
+#define PAGER_MIN_WIDTH 16
+
+/**
+   The maximum number of columns of completion to attempt to fit onto the screen
+*/
+#define PAGER_MAX_COLS 6
+
+const wchar_t * const pager_color_var[PAGER_COLOR_COUNT] =
+{
+	L"fish_pager_color_prefix",
+	L"fish_pager_color_completion",
+	L"fish_pager_color_description",
+	L"fish_pager_color_progress"
+}
+	;
+
+/**
+   This flag is set to 1 of we have sent the enter_ca_mode terminfo
+   sequence to save the previous terminal contents.
+*/
+static int is_ca_mode = 0;
+
+/**
+   This buffer is used to buffer the output of the pager to improve
+   screen redraw performance bu cutting down the number of write()
+   calls to only one.
+*/
+static std::vector<char> pager_buffer;
+
+/**
+   The colors of the pager
+*/
+static const rgb_color_t *pager_colors;
+
+/**
+   The completions being shown
+*/
+static const std::vector<completion_t> *pager_comps;
+
+/**
+   The keys that the user left the pager with
+*/
+static wcstring out_buff;
+
+/**
+   Data structure describing one or a group of related completions.
+   Only the widths are stored, the text to print is found when the
+   entry is actually printed, so that a long list costs little more to
+   show than the part of it that is on the screen.
+*/
+struct comp_t
+{
+	/**
+	   The completion this entry applies to, as an index into \c pager_comps
+	*/
+	size_t idx;
+	/**
+	   The other completions with the same description
+	*/
+	std::vector<size_t> joined;
+	/**
+	   On-screen width of the completion string
+	*/
+	int comp_width;
+	/**
+	   On-screen width of the description information
+	*/
+	int desc_width;
+	/**
+	   Preffered total width
+	*/
+	int pref_width;
+	/**
+	   Minimum acceptable width
+	*/
+	int min_width;
+
+	comp_t( size_t i ) : idx(i), comp_width(0), desc_width(0), pref_width(0), min_width(0)
+	{
+	}
+
+	/**
+	   Returns the number of completions this entry applies to
+	*/
+	size_t count() const
+	{
+		return 1 + joined.size();
+	}
+
+	/**
+	   Returns the index in \c pager_comps of the specified completion of this entry
+	*/
+	size_t at( size_t i ) const
+	{
+		return i == 0 ? idx : joined.at( i-1 );
+	}
+};
+
+/**
+   This function calculates the minimum width for each completion
+   entry in the specified array_list. This width depends on the
+   terminal size, so this function should be called when the terminal
+   changes size.
+*/
+static void recalc_width( std::vector<comp_t> &lst )
+{
+	int term_width = common_get_width();
+	for( size_t i=0; i<lst.size(); i++ )
+	{
+		comp_t &c = lst.at(i);
+
+		c.min_width = mini( c.desc_width, maxi(0,term_width/3 - 2)) +
+			mini( c.desc_width, maxi(0,term_width/5 - 4)) +4;
+	}
+
+}
+
+/**
+   Test if the specified character sequence has been entered on the
+   keyboard
+*/
+static int try_sequence( const char *seq )
+{
+	int j, k;
+	wint_t c=0;
+
+	for( j=0;
+	     seq[j] != '\0' && seq[j] == (c=input_common_readch( j>0 ));
+	     j++ )
+		;
+
+	if( seq[j] == '\0' )
+	{
+		return 1;
+	}
+	else
+	{
+		input_common_unreadch(c);
+		for(k=j-1; k>=0; k--)
+			input_common_unreadch(seq[k]);
+	}
+	return 0;
+}
+
+/**
+   Read a character from keyboard
+*/
+static wint_t readch()
+{
+	struct mapping
+	{
+		const char *seq;
+		wint_t bnd;
+	}
+	;
+
+	struct mapping m[]=
+		{
+			{
+				"\x1b[A", LINE_UP
+			}
+			,
+			{
+				key_up, LINE_UP
+			}
+			,
+			{
+				"\x1b[B", LINE_DOWN
+			}
+			,
+			{
+				key_down, LINE_DOWN
+			}
+			,
+			{
+				key_ppage, PAGE_UP
+			}
+			,
+			{
+				key_npage, PAGE_DOWN
+			}
+			,
+			{
+				" ", PAGE_DOWN
+			}
+			,
+			{
+				"\t", PAGE_DOWN
+			}
+			,
+			{
+				0, 0
+			}
+
+		}
+	;
+	int i;
+
+	for( i=0; m[i].bnd; i++ )
+	{
+		if( !m[i].seq )
+		{
+			continue;
+		}
+
+		if( try_sequence(m[i].seq ) )
+			return m[i].bnd;
+	}
+	return input_common_readch(0);
+}
+
+/**
+   Write specified character to the output buffer \c pager_buffer
+*/
+static int pager_buffered_writer( char c)
+{
+	pager_buffer.push_back(c);
+	return 0;
+}
+
+/**
+   Write the specified bytes to the output buffer \c pager_buffer
+*/
+static void pager_buffered_bytes_writer( const char *buff, size_t len )
+{
+	pager_buffer.insert( pager_buffer.end(), buff, buff + len );
+}
+
+/**
+   Flush \c pager_buffer to stdout
+*/
+static void pager_flush()
+{
+    if (! pager_buffer.empty()) {
+        write_loop( 1, & pager_buffer.at(0), pager_buffer.size() * sizeof(char) );
+        pager_buffer.clear();
+    }
+}
+
+/**
+   Print the specified string, but use at most the specified amount of
+   space. If the whole string can't be fitted, ellipsize it.
+
+   \param str the string to print
+   \param max the maximum space that may be used for printing
+   \param has_more if this flag is true, this is not the entire string, and the string should be ellisiszed even if the string fits but takes up the whole space.
+*/
+static int print_max( const wchar_t *str, int max, int has_more )
+{
+	int i;
+	int written = 0;
+	for( i=0; str[i]; i++ )
+	{
+
+		if( written + fish_wcwidth(str[i]) > max )
+			break;
+		if( ( written + fish_wcwidth(str[i]) == max) && (has_more || str[i+1]) )
+		{
+			writech( ellipsis_char );
+			written += fish_wcwidth(ellipsis_char );
+			break;
+		}
+
+		writech( str[i] );
+		written+= fish_wcwidth( str[i] );
+	}
+	return written;
+}
+
+/**
+   Substitute any series of whitespace with a single space character
+   inside a completion description. Remove all whitespace from its
+   beginning.
+*/
+static wcstring mangle_description( const wcstring &desc )
+{
+	wcstring out;
+	int skip=1;
+	for( size_t in=0; in < desc.size(); in++ )
+	{
+		if( desc[in] == L' ' || desc[in]==L'\t' || desc[in]<32 )
+		{
+			if( !skip )
+				out.push_back( L' ' );
+			skip=1;
+		}
+		else
+		{
+			out.push_back( desc[in] );
+			skip=0;
+		}
+	}
+	return out;
+}
+
+/**
+   Returns the on-screen width the specified description has after
+   mangle_description, without making the mangled string
+*/
+static int mangled_description_width( const wcstring &desc )
+{
+	int width=0;
+	int skip=1;
+	for( size_t in=0; in < desc.size(); in++ )
+	{
+		if( desc[in] == L' ' || desc[in]==L'\t' || desc[in]<32 )
+		{
+			if( !skip )
+				width++;
+			skip=1;
+		}
+		else
+		{
+			/* Same as my_wcswidth */
+			int w = fish_wcwidth( desc[in] );
+			width += ( w < 0 || w > 2 ) ? 1 : w;
+			skip=0;
+		}
+	}
+	return width;
+}
+
+/**
+   Print the specified item using at the specified amount of space
+*/
+static void completion_print_item( const wchar_t *prefix, const comp_t &c, int width )
+{
+	int comp_width=0, desc_width=0;
+	int written=0;
+
+	if( c.pref_width <= width )
+	{
+		/*
+		  The entry fits, we give it as much space as it wants
+		*/
+		comp_width = c.comp_width;
+		desc_width = c.desc_width;
+	}
+	else
+	{
+		/*
+		  The completion and description won't fit on the
+		  allocated space. Give a maximum of 2/3 of the
+		  space to the completion, and whatever is left to
+		  the description.
+		*/
+		int desc_all = c.desc_width?c.desc_width+4:0;
+
+		comp_width = maxi( mini( c.comp_width,
+					 2*(width-4)/3 ),
+				   width - desc_all );
+		if( c.desc_width )
+			desc_width = width-comp_width-4;
+
+	}
+
+	for( size_t i=0; i<c.count(); i++ )
+	{
+        const wcstring comp = escape_string( pager_comps->at( c.at(i) ).completion, ESCAPE_ALL | ESCAPE_NO_QUOTED );
+		if( i != 0 )
+			written += print_max( L"  ", comp_width - written, 2 );
+		set_color( pager_colors[PAGER_COLOR_PREFIX], rgb_color_t::normal() );
+		written += print_max( prefix, comp_width - written, comp.empty()?0:1 );
+		set_color( pager_colors[PAGER_COLOR_COMPLETION], rgb_color_t::ignore() );
+		written += print_max( comp.c_str(), comp_width - written, i!=(c.count()-1) );
+	}
+
+
+	if( desc_width )
+	{
+		while( written < (width-desc_width-2))
+		{
+			written++;
+			writech( L' ');
+		}
+		written += print_max( L"(", 1, 0 );
+		set_color( pager_colors[PAGER_COLOR_DESCRIPTION], rgb_color_t::ignore() );
+		written += print_max( mangle_description( pager_comps->at( c.idx ).description ).c_str(), desc_width, 0 );
+		written += print_max( L")", 1, 0 );
+	}
+	else
+	{
+		while( written < width )
+		{
+			written++;
+			writech( L' ');
+		}
+	}
+
+}
+
+/**
+   Print the specified part of the completion list, using the
+   specified column offsets.
+
+   \param cols number of columns to print in
+   \param width An array specifying the width of each column
+   \param row_start The first row to print
+   \param row_stop the row after the last row to print
+   \param prefix The string to print before each completion
+   \param lst The list of completions to print
+*/
+static void completion_print( int cols,
+			      int *width,
+			      int row_start,
+			      int row_stop,
+			      const wchar_t *prefix,
+			      const std::vector<comp_t> &lst )
+{
+
+	int rows = (lst.size()-1)/cols+1;
+	int i, j;
+
+	for( i = row_start; i<row_stop; i++ )
+	{
+		for( j = 0; j < cols; j++ )
+		{
+			int is_last = (j==(cols-1));
+
+			if( (int)lst.size() <= j*rows + i )
+				continue;
+
+			completion_print_item( prefix, lst.at(j*rows + i ), width[j] - (is_last?0:2) );
+
+			if( !is_last)
+				writestr( L"  " );
+		}
+		writech( L'\n' );
+	}
+}
+
+
+/**
+   Try to print the list of completions with the specified prefix
+   using cols as the number of columns. Return 1 if the completion
+   list was printed, 0 if the terminal is to narrow for the specified
+   number of columns. Always succeeds if cols is 1.
+
+   If all the elements do not fit on the screen at once, make the list
+   scrollable using the up, down and space keys to move. The list will
+   exit when any other key is pressed.
+
+   \param cols the number of columns to try to fit onto the screen
+   \param prefix the character string to prefix each completion with
+   \param lst the list of completions
+
+   \return one of PAGER_RETRY, PAGER_DONE and PAGER_RESIZE
+*/
+static int completion_try_print( int cols,
+				 const wchar_t *prefix,
+				 const std::vector<comp_t> &lst )
+{
+	/*
+	  The calculated preferred width of each column
+	*/
+	int pref_width[PAGER_MAX_COLS];
+	/*
+	  The calculated minimum width of each column
+	*/
+	int min_width[PAGER_MAX_COLS];
+	/*
+	  If the list can be printed with this width, width will contain the width of each column
+	*/
+	int *width=pref_width;
+	/*
+	  Set to one if the list should be printed at this width
+	*/
+	int print=0;
+
+	int i, j;
+
+	int rows = (lst.size()-1)/cols+1;
+
+	int pref_tot_width=0;
+	int min_tot_width = 0;
+	int res=PAGER_RETRY;
+
+	int term_width = common_get_width();
+	int term_height = common_get_height();
+
+	/*
+	  Skip completions on tiny terminals
+	*/
+
+	if( term_width < PAGER_MIN_WIDTH )
+		return PAGER_DONE;
+
+	memset( pref_width, 0, sizeof(pref_width) );
+	memset( min_width, 0, sizeof(min_width) );
+
+	/* Calculate how wide the list would be */
+	for( j = 0; j < cols; j++ )
+	{
+		for( i = 0; i<rows; i++ )
+		{
+			int pref,min;
+			if( (int)lst.size() <= j*rows + i )
+				continue;
+
+			const comp_t &c = lst.at(j*rows + i );
+			pref = c.pref_width;
+			min = c.min_width;
+
+			if( j != cols-1 )
+			{
+				pref += 2;
+				min += 2;
+			}
+			min_width[j] = maxi( min_width[j],
+					     min );
+			pref_width[j] = maxi( pref_width[j],
+					      pref );
+		}
+		min_tot_width += min_width[j];
+		pref_tot_width += pref_width[j];
+	}
+	/*
+	  Force fit if one column
+	*/
+	if( cols == 1)
+	{
+		if( pref_tot_width > term_width )
+		{
+			pref_width[0] = term_width;
+		}
+		width = pref_width;
+		print=1;
+	}
+	else if( pref_tot_width <= term_width )
+	{
+		/* Terminal is wide enough. Print the list! */
+		width = pref_width;
+		print=1;
+	}
+	else
+	{
+		int next_rows = (lst.size()-1)/(cols-1)+1;
+
+		if( min_tot_width < term_width &&
+		    ( ( (rows < term_height) && (next_rows >= term_height ) ) ||
+		      ( pref_tot_width-term_width< 4 && cols < 3 ) ) )
+		{
+			/*
+			  Terminal almost wide enough, or squeezing makes the
+			  whole list fit on-screen.
+
+			  This part of the code is really important. People hate
+			  having to scroll through the completion list. In cases
+			  where there are a huge number of completions, it can't
+			  be helped, but it is not uncommon for the completions to
+			  _almost_ fit on one screen. In those cases, it is almost
+			  always desirable to 'squeeze' the completions into a
+			  single page.
+
+			  If we are using N columns and can get everything to
+			  fit using squeezing, but everything would also fit
+			  using N-1 columns, don't try.
+			*/
+
+			int tot_width = min_tot_width;
+			width = min_width;
+
+			while( tot_width < term_width )
+			{
+				for( i=0; (i<cols) && ( tot_width < term_width ); i++ )
+				{
+					if( width[i] < pref_width[i] )
+					{
+						width[i]++;
+						tot_width++;
+					}
+				}
+			}
+			print=1;
+		}
+	}
+
+	if( print )
+	{
+		res=PAGER_DONE;
+		if( rows < term_height )
+		{
+			/* List fits on screen. Print it and leave */
+			if( is_ca_mode )
+			{
+				is_ca_mode = 0;
+				writembs(exit_ca_mode);
+			}
+
+			completion_print( cols, width, 0, rows, prefix, lst);
+			pager_flush();
+		}
+		else
+		{
+			int npos, pos = 0;
+			int do_loop = 1;
+
+			/*
+			  Enter ca_mode, which means that the terminal
+			  content will be restored to the current
+			  state on exit.
+			*/
+			if( enter_ca_mode && exit_ca_mode )
+			{
+				is_ca_mode=1;
+				writembs(enter_ca_mode);
+			}
+
+
+			completion_print( cols,
+					  width,
+					  0,
+					  term_height-1,
+					  prefix,
+					  lst);
+			/*
+			  List does not fit on screen. Print one screenfull and
+			  leave a scrollable interface
+			*/
+			while(do_loop)
+			{
+				set_color( rgb_color_t::black(), pager_colors[PAGER_COLOR_PROGRESS] );
+                wcstring msg = format_string(_(L" %d to %d of %d"), pos, pos+term_height-1, rows );
+				msg.append(L"   \r" );
+
+				writestr(msg.c_str());
+				set_color( rgb_color_t::normal(), rgb_color_t::normal() );
+				pager_flush();
+				int c = readch();
+
+				switch( c )
+				{
+					case LINE_UP:
+					{
+						if( pos > 0 )
+						{
+							pos--;
+							writembs(tparm( cursor_address, 0, 0));
+							writembs(scroll_reverse);
+							completion_print( cols,
+									  width,
+									  pos,
+									  pos+1,
+									  prefix,
+									  lst );
+							writembs( tparm( cursor_address,
+									 term_height-1, 0) );
+							writembs(clr_eol );
+
+						}
+
+						break;
+					}
+
+					case LINE_DOWN:
+					{
+						if( pos <= (rows - term_height ) )
+						{
+							pos++;
+							completion_print( cols,
+									  width,
+									  pos+term_height-2,
+									  pos+term_height-1,
+									  prefix,
+									  lst );
+						}
+						break;
+					}
+
+					case PAGE_DOWN:
+					{
+
+						npos = mini( rows - term_height+1,
+							     pos + term_height-1 );
+						if( npos != pos )
+						{
+							pos = npos;
+							completion_print( cols,
+									  width,
+									  pos,
+									  pos+term_height-1,
+									  prefix,
+									  lst );
+						}
+						else
+						{
+							if( flash_screen )
+								writembs( flash_screen );
+						}
+
+						break;
+					}
+
+					case PAGE_UP:
+					{
+						npos = maxi( 0,
+							     pos - term_height+1 );
+
+						if( npos != pos )
+						{
+							pos = npos;
+							completion_print( cols,
+									  width,
+									  pos,
+									  pos+term_height-1,
+									  prefix,
+									  lst );
+						}
+						else
+						{
+							if( flash_screen )
+								writembs( flash_screen );
+						}
+						break;
+					}
+
+					case R_NULL:
+					{
+						do_loop=0;
+						res=PAGER_RESIZE;
+						break;
+
+					}
+
+					default:
+					{
+						out_buff.push_back( c );
+						do_loop = 0;
+						break;
+					}
+				}
+			}
+			writembs(clr_eol);
+		}
+	}
+	return res;
+}
+
+/**
+   Turn completions into comp_t structures, putting completions with
+   the same description into the same one if join is set, and measure
+   them.
+*/
+static void mangle_completions( const std::vector<completion_t> &comps, const wchar_t *prefix, bool join, std::vector<comp_t> &lst )
+{
+    std::map<wcstring, size_t> desc_table;
+	int prefix_width = my_wcswidth( prefix );
+
+	lst.reserve( comps.size() );
+	for( size_t i=0; i<comps.size(); i++ )
+	{
+		const completion_t &el = comps.at(i);
+		const wcstring str = escape_string( el.completion, ESCAPE_ALL | ESCAPE_NO_QUOTED );
+		const int str_width = my_wcswidth( str.c_str() );
+
+		if( join && !el.description.empty() )
+		{
+			const wcstring desc = mangle_description( el.description );
+			std::map<wcstring, size_t>::const_iterator prev = desc_table.find( desc );
+			if( prev != desc_table.end() )
+			{
+				comp_t &comp = lst.at( prev->second );
+				comp.joined.push_back( i );
+				comp.comp_width += str_width + prefix_width + 2;
+				comp.pref_width += str_width + prefix_width + 2;
+				continue;
+			}
+			desc_table[desc] = lst.size();
+		}
+
+		lst.push_back( comp_t( i ) );
+		comp_t &comp = lst.back();
+		comp.comp_width = str_width + prefix_width;
+		comp.desc_width = mangled_description_width( el.description );
+		comp.pref_width = comp.comp_width + comp.desc_width + (comp.desc_width?4:0);
+	}
+}
+
+wcstring pager_show( const std::vector<completion_t> &comps, const wcstring &prefix, const rgb_color_t *colors )
+{
+	std::vector<comp_t> lst;
+	mangle_completions( comps, prefix.c_str(), prefix == L"-", lst );
+
+	out_buff.clear();
+	if( lst.empty() )
+		return out_buff;
+
+	int (*old_writer)(char) = output_get_writer();
+	void (*old_bytes_writer)(const char *, size_t) = output_get_bytes_writer();
+	output_set_writer( &pager_buffered_writer, &pager_buffered_bytes_writer );
+	pager_colors = colors;
+	pager_comps = &comps;
+
+	/**
+	   Try to print the completions. Start by trying to print the
+	   list in PAGER_MAX_COLS columns, if the completions won't
+	   fit, reduce the number of columns by one. Printing a single
+	   column never fails.
+	*/
+	recalc_width( lst );
+	for( int i = PAGER_MAX_COLS; i>0; i-- )
+	{
+		switch( completion_try_print( i, prefix.c_str(), lst ) )
+		{
+
+			case PAGER_RETRY:
+				break;
+
+			case PAGER_DONE:
+				i=0;
+				break;
+
+			case PAGER_RESIZE:
+				/*
+				  This means we got a resize event, so we start
+				  over from the beginning. Since it the screen got
+				  bigger, we might be able to fit all completions
+				  on-screen.
+				*/
+				recalc_width( lst );
+				i=PAGER_MAX_COLS+1;
+				break;
+
+		}
+	}
+
+	if( is_ca_mode )
+	{
+		is_ca_mode = 0;
+		writembs(exit_ca_mode);
+	}
+	pager_flush();
+
+	output_set_writer( old_writer, old_bytes_writer );
+	pager_colors = 0;
+	pager_comps = 0;
+	return out_buff;
+}
@@ -0,0 +1,51 @@
+/** \file pager.h
+
+	The completion pager. It lays the completions out in as many
+	columns as fit on the terminal and prints them below the command
+	line. If they don't fit on the screen, the user can scroll through
+	them until pressing a key the pager doesn't use.
+
+	The pager is used by the reader, and by the fish_pager program.
+*/
+
+#ifndef FISH_PAGER_H
+#define FISH_PAGER_H
+
+#include <vector>
+
+#include "common.h"
+#include "complete.h"
+#include "color.h"
+
+/**
+   The parts of the pager that can be colored
+*/
+enum
+{
+	PAGER_COLOR_PREFIX,
+	PAGER_COLOR_COMPLETION,
+	PAGER_COLOR_DESCRIPTION,
+	PAGER_COLOR_PROGRESS,
+	PAGER_COLOR_COUNT
+}
+	;
+
+/**
+   The names of the variables holding the color of each part of the
+   pager, indexed by the PAGER_COLOR_ values
+*/
+extern const wchar_t * const pager_color_var[PAGER_COLOR_COUNT];
+
+/**
+   Shows the specified completions on the terminal. The terminal must
+   already be set up for reading single keys, and terminfo for
+   writing. Output goes directly to stdout.
+
+   \param comps the completions to show. Only the completion strings, which are printed escaped, and the descriptions are used.
+   \param prefix the string to print before every completion. If it is "-", completions with the same description are shown together.
+   \param colors the color of every part of the pager, indexed by the PAGER_COLOR_ values
+   \return the key that made the user leave the scrollable list, or an empty string if there was none. It should be handled as input.
+*/
+wcstring pager_show( const std::vector<completion_t> &comps, const wcstring &prefix, const rgb_color_t *colors );
+
+#endif
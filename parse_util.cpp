@@ -20,6 +20,7 @@
 #include <wchar.h>
 #include <map>
 #include <set>
+#include <list>
 #include <algorithm>
 
 #include <time.h>
@@ -51,6 +52,28 @@
 */
 #define AUTOLOAD_MIN_AGE 60
 
+/**
+   Maximum number of strings whose tokens are kept by
+   parse_util_get_tokens
+*/
+#define SHARED_TOKENS_MAX 4
+
+/**
+   A string and its tokens, as kept by parse_util_get_tokens
+*/
+struct shared_tokens_t
+{
+	wcstring str;
+	std::tr1::shared_ptr<const tok_cache_t> tokens;
+};
+
+/**
+   The strings most recently tokenized by parse_util_get_tokens, most
+   recent first. Protected by s_shared_tokens_lock.
+*/
+static std::list<shared_tokens_t> s_shared_tokens;
+static pthread_mutex_t s_shared_tokens_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 int parse_util_lineno( const wchar_t *str, int len )
 {
@@ -475,6 +498,36 @@ void parse_util_job_extent( const wchar_t *buff,
 	job_or_process_extent( buff,pos,a, b, 0 );	
 }
 
+std::tr1::shared_ptr<const tok_cache_t> parse_util_get_tokens( const wchar_t *str, int flags )
+{
+	CHECK( str, std::tr1::shared_ptr<const tok_cache_t>() );
+	assert( flags & TOK_SQUASH_ERRORS );
+
+	scoped_lock lock( s_shared_tokens_lock );
+	for( std::list<shared_tokens_t>::iterator iter = s_shared_tokens.begin(); iter != s_shared_tokens.end(); ++iter )
+	{
+		if( iter->tokens->flags == flags && iter->str == str )
+		{
+			s_shared_tokens.splice( s_shared_tokens.begin(), s_shared_tokens, iter );
+			return iter->tokens;
+		}
+	}
+
+	/*
+	  Tokenize while holding the lock, so that a thread asking for the
+	  same string in the meantime waits for these tokens instead of
+	  making its own
+	*/
+	tok_cache_t *tokens = new tok_cache_t();
+	tok_cache_build( tokens, str, flags );
+
+	s_shared_tokens.push_front( shared_tokens_t() );
+	s_shared_tokens.front().str = str;
+	s_shared_tokens.front().tokens.reset( tokens );
+	if( s_shared_tokens.size() > SHARED_TOKENS_MAX )
+		s_shared_tokens.pop_back();
+	return s_shared_tokens.front().tokens;
+}
 
 void parse_util_token_extent( const wchar_t *buff,
 							  int cursor_pos,
@@ -521,7 +574,8 @@ void parse_util_token_extent( const wchar_t *buff,
 		DIE_MEM();
 	}
 
-	for( tok_init( &tok, buffcpy, TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS );
+	std::tr1::shared_ptr<const tok_cache_t> tokens = parse_util_get_tokens( buffcpy, TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS );
+	for( tok_init_cached( &tok, buffcpy, tokens.get(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS );
 		 tok_has_next( &tok );
 		 tok_next( &tok ) )
 	{
@@ -533,7 +587,7 @@ void parse_util_token_extent( const wchar_t *buff,
 		*/
 		if( tok_last_type( &tok ) == TOK_STRING )
 		{
-			tok_end +=wcslen(tok_last(&tok));
+			tok_end +=tok_last_length(&tok);
 		}
 		
 		/*
@@ -554,7 +608,7 @@ void parse_util_token_extent( const wchar_t *buff,
 		if( (tok_last_type( &tok ) == TOK_STRING) && (tok_end >= pos ) )
 		{			
 			a = begin + tok_get_pos( &tok );
-			b = a + wcslen(tok_last(&tok));
+			b = a + tok_last_length(&tok);
 			break;
 		}
 		
@@ -564,7 +618,7 @@ void parse_util_token_extent( const wchar_t *buff,
 		if( tok_last_type( &tok ) == TOK_STRING )
 		{
 			pa = begin + tok_get_pos( &tok );
-			pb = pa + wcslen(tok_last(&tok));
+			pb = pa + tok_last_length(&tok);
 		}
 	}
 
@@ -11,6 +11,9 @@
 #include <wchar.h>
 #include <map>
 #include <set>
+#include <tr1/memory>
+
+struct tok_cache_t;
 
 /**
    Find the beginning and end of the first subshell in the specified string.
@@ -90,6 +93,19 @@ void parse_util_token_extent( const wchar_t *buff,
 							  const wchar_t **prev_begin, 
 							  const wchar_t **prev_end );
 
+/**
+   Return the tokens of the specified string, for use with
+   tok_init_cached. The tokens of the last few strings are kept, so
+   that highlighting, autosuggestions and completion of the same
+   command line, which all run after each edit, only tokenize it once
+   per set of flags. This may be called from any thread, and the
+   flags must therefore include TOK_SQUASH_ERRORS.
+
+   \param str the string to tokenize
+   \param flags the tokenizer flags
+*/
+std::tr1::shared_ptr<const tok_cache_t> parse_util_get_tokens( const wchar_t *str, int flags );
+
 
 /**
    Get the linenumber at the specified character offset
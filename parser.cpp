@@ -44,6 +44,7 @@ The fish parser. Contains functions for parsing and evaluating code.
 #include "path.h"
 #include "signal.h"
 #include "complete.h"
+#include "profiler.h"
 
 /**
    Maximum number of block levels in code. This is not the same as
@@ -374,6 +375,15 @@ parser_t::parser_t(enum parser_type_t type, bool errors) :
 /* A pointer to the principal parser (which is a static local) */
 static parser_t *s_principal_parser = NULL;
 
+/* The number of calls to parser_t::eval, which only happen on the main thread */
+static unsigned long s_eval_count = 0;
+
+unsigned long parser_t::eval_count()
+{
+    ASSERT_IS_MAIN_THREAD();
+    return s_eval_count;
+}
+
 parser_t &parser_t::principal_parser(void)
 {
     ASSERT_IS_NOT_FORKED_CHILD();
@@ -476,6 +486,16 @@ void parser_t::pop_block()
 	}
 	
 	current_block = current_block->outer;
+
+	if( old->for_lap )
+	{
+		/*
+		  However the lap ended, this process has no business running
+		  what comes after the loop
+		*/
+		fflush( stdout );
+		exit_without_destructors( proc_get_last_status() );
+	}
     
     if (old->wants_pop_env)
         env_pop();
@@ -534,11 +554,11 @@ static const wchar_t *parser_find_end( const wchar_t * buff )
 			{
 				if( !had_cmd )
 				{
-					if( wcscmp(tok_last(&tok), L"end")==0)
+					if( tok_last_equals( &tok, L"end" ) )
 					{
 						count--;
 					}
-					else if( parser_keywords_is_block( tok_last(&tok) ) )
+					else if( parser_keywords_is_block( tok_last_string( &tok ) ) )
 					{
 						count++;
 					}
@@ -614,6 +634,11 @@ void parser_t::allow_function()
     forbidden_function.pop_back();
 }
 
+bool parser_t::function_recursion_too_deep() const
+{
+	return forbidden_function.size() > MAX_RECURSION_DEPTH;
+}
+
 void parser_t::error( int ec, int p, const wchar_t *str, ... )
 {
 	va_list va;
@@ -629,77 +654,6 @@ void parser_t::error( int ec, int p, const wchar_t *str, ... )
 
 }
 
-/**
-   Print profiling information to the specified stream
-*/
-static void print_profile( const std::vector<profile_item_t> &items,
-						   size_t pos,
-						   FILE *out )
-{
-	const profile_item_t *me, *prev;
-	size_t i;
-	int my_time;
-
-	if( pos >= items.size() )
-	{
-		return;
-	}
-	
-	me= &items.at(pos);
-	if( !me->skipped )
-	{
-		my_time=me->parse+me->exec;
-
-		for( i=pos+1; i<items.size(); i++ )
-		{
-			prev = &items.at(i);
-			if( prev->skipped )
-			{
-				continue;
-			}
-			
-			if( prev->level <= me->level )
-			{
-				break;
-			}
-
-			if( prev->level > me->level+1 )
-			{
-				continue;
-			}
-
-			my_time -= prev->parse;
-			my_time -= prev->exec;
-		}
-
-		if( me->cmd.size() > 0 )
-		{
-			if( fwprintf( out, L"%d\t%d\t", my_time, me->parse+me->exec ) < 0 )
-			{
-				wperror( L"fwprintf" );
-				return;
-			}
-			
-			for( i=0; i<me->level; i++ )
-			{
-				if( fwprintf( out, L"-" ) < 0 )
-				{
-					wperror( L"fwprintf" );
-					return;
-				}
-
-			}
-			if( fwprintf( out, L"> %ls\n", me->cmd.c_str() ) < 0 )
-			{
-				wperror( L"fwprintf" );
-				return;
-			}
-
-		}
-	}
-	print_profile( items, pos+1, out );
-}
-
 void parser_t::destroy()
 {
 	if( profile )
@@ -714,16 +668,12 @@ void parser_t::destroy()
 		}
 		else
 		{
-			if( fwprintf( f,
-						  _(L"Time\tSum\tCommand\n"),
-						  profile_items.size() ) < 0 )
+			wcstring report;
+			profiler_write_report( report );
+			if( fwprintf( f, L"%ls", report.c_str() ) < 0 )
 			{
 				wperror( L"fwprintf" );
 			}
-			else
-			{
-				print_profile( profile_items, 0, f );
-			}
 			
 			if( fclose( f ) )
 			{
@@ -981,9 +931,7 @@ void parser_t::stack_trace( block_t *b, wcstring &buff)
 */
 const wchar_t *parser_t::is_function() const
 {
-    // PCA: Have to make this a string somehow
     ASSERT_IS_MAIN_THREAD();
-    wcstring result;
     
 	block_t *b = current_block;
 	while( 1 )
@@ -994,14 +942,21 @@ const wchar_t *parser_t::is_function() const
 		}
 		if( b->type == FUNCTION_CALL )
 		{
-            result = b->state1<wcstring>();
-			return result.c_str();
+            /* The name is kept by the block, which outlives the caller's use of it */
+            return b->state1<wcstring>().c_str();
 		}
 		b=b->outer;
 	}
 }
 
 
+int parser_t::get_buffer_lineno( int pos ) const
+{
+	if( !current_tokenizer || !tok_string( current_tokenizer ) )
+		return 0;
+	return tok_get_lineno( current_tokenizer, pos );
+}
+
 int parser_t::get_lineno() const
 {
 	const wchar_t *whole_str;
@@ -1021,7 +976,7 @@ int parser_t::get_lineno() const
 	if( !whole_str )
 		return -1;
 	
-	lineno = parse_util_lineno( whole_str, current_tokenizer_pos );
+	lineno = tok_get_lineno( current_tokenizer, current_tokenizer_pos );
 
 	if( (function_name = is_function()) )
 	{
@@ -1090,7 +1045,6 @@ const wchar_t *parser_t::current_line()
 	const wchar_t *whole_str;
 	const wchar_t *line;
 	const wchar_t *line_end;
-	int i;
 	int offset;
 	int current_line_width;
 	const wchar_t *function_name=0;
@@ -1114,15 +1068,8 @@ const wchar_t *parser_t::current_line()
 	/*
 	  Calculate line number, line offset, etc.
 	*/
-	for( i=0; i<current_tokenizer_pos && whole_str[i]; i++ )
-	{
-		if( whole_str[i] == L'\n' )
-		{
-			lineno++;
-			current_line_start=i+1;
-			line = &whole_str[i+1];
-		}
-	}
+	lineno = tok_get_lineno( current_tokenizer, current_tokenizer_pos, &current_line_start );
+	line = whole_str + current_line_start;
 
 //	lineno = current_tokenizer_pos;
 	
@@ -1210,6 +1157,7 @@ int parser_t::get_job_pos() const
 
 void parser_t::set_pos( int p)
 {
+	tok_cache_all( current_tokenizer );
 	tok_set_pos( current_tokenizer, p );
 }
 
@@ -1418,7 +1366,7 @@ void parser_t::parse_job_argument_list( process_t *p,
 						p->count_help_magic = 1;
 					}
 
-					switch( expand_string( tok_last( tok ), args, 0 ) )
+					switch( expand_string( tok_last_string( tok ), args, 0 ) )
 					{
 						case EXPAND_ERROR:
 						{
@@ -1518,7 +1466,7 @@ void parser_t::parse_job_argument_list( process_t *p,
 					{
 						case TOK_STRING:
 						{
-                            target = tok_last( tok );
+                            target = tok_last_string( tok );
                             has_target = expand_one(target, no_exec ? EXPAND_SKIP_VARIABLES : 0);
 
 							if( ! has_target && error_code == 0 )
@@ -1713,7 +1661,7 @@ int parser_t::parse_job( process_t *p,
 		{
 			case TOK_STRING:
 			{
-                nxt = tok_last( tok );
+                nxt = tok_last_string( tok );
                 has_nxt = expand_one(nxt, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES);
 				
 				if( ! has_nxt)
@@ -1797,7 +1745,7 @@ int parser_t::parse_job( process_t *p,
 			}
 
 			tok_next( tok );
-			sw = parser_keywords_is_switch( tok_last( tok ) );
+			sw = parser_keywords_is_switch( tok_last_string( tok ) );
 			
 			if( sw == ARG_SWITCH )
 			{
@@ -1936,7 +1884,7 @@ int parser_t::parse_job( process_t *p,
 				/*
 				  Check if we have reached the maximum recursion depth
 				*/
-				if( forbidden_function.size() > MAX_RECURSION_DEPTH )
+				if( function_recursion_too_deep() )
 				{
 					error( SYNTAX_ERROR,
 						   tok_get_pos( tok ),
@@ -2290,22 +2238,10 @@ void parser_t::eval_job( tokenizer *tok )
 	job_t *j;
 
 	int start_pos = job_start_pos = tok_get_pos( tok );
-	long long t1=0, t2=0, t3=0;
-    
     
-    profile_item_t *profile_item = NULL;
 	bool skip = false;
 	int job_begin_pos, prev_tokenizer_pos;
-	const bool do_profile = profile;
-    
-	if( do_profile )
-	{
-        profile_items.resize(profile_items.size() + 1);
-        profile_item = &profile_items.back();
-        profile_item->cmd = L"";
-        profile_item->skipped = 1;        
-		t1 = get_time();
-	}
+	profile_job_scope_t profile_job;
 
 	switch( tok_last_type( tok ) )
 	{
@@ -2352,13 +2288,6 @@ void parser_t::eval_job( tokenizer *tok )
 				else
 					j->set_command(L"");
 
-				if( do_profile )
-				{
-					t2 = get_time();
-					profile_item->cmd = wcsdup( j->command_wcstr() );
-					profile_item->skipped=current_block->skip;
-				}
-				
 				skip = skip || current_block->skip;
 				skip = skip || job_get_flag( j, JOB_WILDCARD_ERROR );
 				skip = skip || job_get_flag( j, JOB_SKIP );
@@ -2370,6 +2299,8 @@ void parser_t::eval_job( tokenizer *tok )
 						was_builtin = 1;
 					prev_tokenizer_pos = current_tokenizer_pos;
 					current_tokenizer_pos = job_begin_pos;		
+					if( profiler_is_enabled() && this == &principal_parser() )
+						profile_job.set_job( j->command_wcstr(), j->first_process->argv0(), current_filename(), get_lineno() );
 					exec( *this, j );
 					current_tokenizer_pos = prev_tokenizer_pos;
 					
@@ -2382,14 +2313,6 @@ void parser_t::eval_job( tokenizer *tok )
 					this->skipped_exec( j );
 				}
 
-				if( do_profile )
-				{
-					t3 = get_time();
-					profile_item->level=eval_level;
-					profile_item->parse = t2-t1;
-					profile_item->exec=t3-t2;
-				}
-
 				if( current_block->type == WHILE )
 				{
 
@@ -2486,7 +2409,7 @@ void parser_t::eval_job( tokenizer *tok )
 
 }
 
-int parser_t::eval( const wcstring &cmdStr, io_data_t *io, enum block_type_t block_type )
+int parser_t::eval( const wcstring &cmdStr, io_data_t *io, enum block_type_t block_type, const tok_cache_t *tokens )
 {
     const wchar_t * const cmd = cmdStr.c_str();
 	size_t forbid_count;
@@ -2496,6 +2419,8 @@ int parser_t::eval( const wcstring &cmdStr, io_data_t *io, enum block_type_t blo
 	io_data_t *prev_io = block_io;
     std::vector<wcstring> prev_forbidden = forbidden_function;
 
+	s_eval_count++;
+
 	if( block_type == SUBST )
 	{
 		forbidden_function.clear();
@@ -2534,7 +2459,7 @@ int parser_t::eval( const wcstring &cmdStr, io_data_t *io, enum block_type_t blo
 	this->push_block( block_type );
 
 	current_tokenizer = (tokenizer *)malloc( sizeof(tokenizer));
-	tok_init( current_tokenizer, cmd, 0 );
+	tok_init_cached( current_tokenizer, cmd, tokens, 0 );
 
 	error_code = 0;
 
@@ -2880,6 +2805,12 @@ int parser_t::test( const  wchar_t * buff,
 	  expand to more/less arguemtns then 1.
 	*/
 	int arg_count=0;
+
+	/*
+	  The number of arguments to the 'for' builtin that are taken by
+	  its options
+	*/
+	int for_options=0;
 	
 	/*
 	  The currently validated command.
@@ -2921,8 +2852,9 @@ int parser_t::test( const  wchar_t * buff,
 					int mark = tok_get_pos( &tok );
 					had_cmd = 1;
 					arg_count=0;
+					for_options=0;
 					
-                    command = tok_last(&tok);
+                    command = tok_last_string( &tok );
                     has_command = expand_one(command, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES);
 					if( !has_command )
 					{
@@ -3267,7 +3199,18 @@ int parser_t::test( const  wchar_t * buff,
 						*/
 						if( command == L"for"  )
 						{
-							if( arg_count == 1 )
+							const wchar_t *arg = tok_last( &tok );
+							
+							if( arg_count == 1 && arg[0] == L'-' )
+							{
+								/*
+								  The only option is the number of jobs,
+								  which ends up in the same or the next
+								  argument
+								*/
+								for_options = ( wcscmp( arg, L"-j" ) == 0 || wcscmp( arg, L"--jobs" ) == 0 ) ? 2 : 1;
+							}
+							else if( arg_count - for_options == 1 )
 							{
 								
 								if( wcsvarname( tok_last( &tok )) )
@@ -3288,7 +3231,7 @@ int parser_t::test( const  wchar_t * buff,
 								}
 															
 							}
-							else if( arg_count == 2 )
+							else if( arg_count > for_options && arg_count - for_options == 2 )
 							{
 								if( wcscmp( tok_last( &tok ), L"in" ) != 0 )
 								{
@@ -3466,7 +3409,7 @@ int parser_t::test( const  wchar_t * buff,
 		{
 			if( has_command && command == L"for" )
 			{
-				if( arg_count >= 0 && arg_count < 2 )
+				if( arg_count >= 0 && arg_count - for_options < 2 )
 				{
 					/*
 					  Not enough arguments to the for builtin
@@ -3479,7 +3422,7 @@ int parser_t::test( const  wchar_t * buff,
 							   tok_get_pos( &tok ),
 							   BUILTIN_FOR_ERR_COUNT,
 							   L"for",
-							   arg_count );
+							   maxi( arg_count - for_options, 0 ) );
 						
 						print_errors( *out, prefix );
 					}
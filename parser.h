@@ -73,6 +73,19 @@ typedef struct block
 	*/
 	int loop_status;
 
+	/**
+	   The number of laps of a for loop that may run at once in their
+	   own processes, or 0 if the laps run one after another
+	*/
+	int for_jobs;
+
+	/**
+	   Whether this is a for loop block in a process that has been
+	   forked to run a single lap. The process exits when the block is
+	   popped.
+	*/
+	bool for_lap;
+
 	/**
 	   The job that is currently evaluated in the specified block.
 	*/
@@ -239,30 +252,8 @@ enum parser_type_t {
 	PARSER_TYPE_ERRORS_ONLY
 };
 
-struct profile_item_t {
-	/**
-	   Time spent executing the specified command, including parse time for nested blocks.
-	*/
-	int exec;
-	/**
-	   Time spent parsing the specified command, including execution time for command substitutions.
-	*/
-	int parse;
-	/**
-	   The block level of the specified command. nested blocks and command substitutions both increase the block level.
-	*/
-	size_t level;
-	/**
-	   If the execution of this command was skipped.
-	*/
-	int skipped;
-	/**
-	   The command string.
-	*/
-	wcstring cmd;    
-};
-
 struct tokenizer;
+struct tok_cache_t;
 
 class parser_t {
     private:
@@ -319,7 +310,6 @@ class parser_t {
     void print_errors_stderr();
     
     public:
-    std::vector<profile_item_t> profile_items;
     
     /**
        Returns the name of the currently evaluated function if we are
@@ -332,6 +322,9 @@ class parser_t {
     /** Get the "principal" parser, whatever that is */
     static parser_t &principal_parser();
     
+    /** Returns the number of calls to eval by any parser so far. Must be called from the main thread. */
+    static unsigned long eval_count();
+    
     /** Indicates that execution of all blocks in the principal parser should stop.
         This is called from signal handlers!
     */
@@ -355,10 +348,11 @@ class parser_t {
       \param cmd the string to evaluate
       \param io io redirections to perform on all started jobs
       \param block_type The type of block to push on the block stack
+      \param tokens If non-null, a pre-tokenized representation of cmd to evaluate instead of tokenizing cmd again, as built by tok_cache_build
 
       \return 0 on success, 1 otherwise
     */
-    int eval( const wcstring &cmd, io_data_t *io, enum block_type_t block_type );
+    int eval( const wcstring &cmd, io_data_t *io, enum block_type_t block_type, const tok_cache_t *tokens = NULL );
     
     /**
       Evaluate line as a list of parameters, i.e. tokenize it and perform parameter expansion and cmdsubst execution on the tokens.
@@ -393,13 +387,16 @@ class parser_t {
     /** Returns the current line number */
     int get_lineno() const;
 
+    /** Returns the line number of the specified position in the latest string of the tokenizer, counting from the start of that string, or 0 if there is no string */
+    int get_buffer_lineno( int pos ) const;
+
     /** Returns the current position in the latest string of the tokenizer. */
     int get_pos() const;
 
     /** Returns the position where the current job started in the latest string of the tokenizer. */
     int get_job_pos() const;
 
-    /** Set the current position in the latest string of the tokenizer. */
+    /** Set the current position in the latest string of the tokenizer. This is how loops rewind to the start of their body, so the string is tokenized once on the first call and its tokens are replayed from then on. */
     void set_pos( int p);
 
     /** Get the string currently parsed */
@@ -465,6 +462,12 @@ class parser_t {
     */
     void allow_function();
 
+    /**
+       Returns whether so many functions are being called that calling
+       another one is considered an infinite recursion.
+    */
+    bool function_recursion_too_deep() const;
+
     /**
        Initialize static parser data
     */
@@ -3,11 +3,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <wchar.h>
+#include <wctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <algorithm>
 
 #include "fallback.h"
 #include "util.h"
@@ -17,237 +23,410 @@
 #include "wutil.h"
 #include "path.h"
 #include "expand.h"
+#include "dir_cache.h"
 
 /**
    Unexpected error in path_get_path()
 */
 #define MISSING_COMMAND_ERR_MSG _( L"Error while searching for command '%ls'" )
 
-bool path_get_path_string(const wcstring &cmd_str, wcstring &output, const env_vars &vars)
+/**
+   Number of seconds for which we trust the cached modification times
+   of the directories in $PATH before checking them again
+*/
+#define COMMAND_CACHE_VALIDATE_INTERVAL 1
+
+/**
+   A remembered command lookup
+*/
+struct command_cache_entry_t
 {
-    const wchar_t * const cmd = cmd_str.c_str();
-    int err = ENOENT;
-    debug( 3, L"path_get_path_string( '%ls' )", cmd );
-    
-	if(wcschr( cmd, L'/' ) != 0 )
+	/** Where the command was found, or empty if it was not found */
+	wcstring path;
+
+	/** The errno of a failed lookup */
+	int err;
+
+	/** How many times the entry was used */
+	unsigned long hits;
+};
+
+/**
+   A cache of where commands were found in $PATH, so that looking up a
+   command doesn't search every directory again. It is only valid for
+   the value of $PATH it was built for, and is cleared when the
+   modification time of any directory in $PATH changes.
+*/
+struct command_cache_t
+{
+	/** The value of $PATH the cache was built for */
+	wcstring path_var;
+
+	/** Modification times of the directories in path_var, or -1 for directories that could not be stat'd */
+	std::vector<time_t> dir_mtimes;
+
+	/** When dir_mtimes was last checked */
+	time_t validated;
+
+	/** Whether entries may be added. False while any directory was modified so recently that a further change might not alter its modification time. */
+	bool usable;
+
+	/** The cached lookups by command name */
+	std::map<wcstring, command_cache_entry_t> commands;
+
+	command_cache_t() : validated(0), usable(false) { }
+};
+
+static command_cache_t s_command_cache;
+static pthread_mutex_t s_command_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   A file in one of the directories of $PATH
+*/
+struct command_index_entry_t
+{
+	/** The name of the file in lower case, which the index is sorted by */
+	wcstring key;
+
+	/** The position of the directory of the file in command_index_t::dirs */
+	size_t dir;
+
+	/** The listing entry of the file */
+	dir_entry_t entry;
+};
+
+/**
+   Orders command index entries by key, and then by directory
+*/
+struct command_index_less_t
+{
+	bool operator()( const command_index_entry_t &a, const command_index_entry_t &b ) const
 	{
-		if( waccess( cmd, X_OK )==0 )
+		if( a.key != b.key )
+			return a.key < b.key;
+		return a.dir < b.dir;
+	}
+};
+
+/**
+   An index of the names of all files in the directories of $PATH, used
+   for completing command names. It is built from the listings of the
+   directory cache, and is valid for as long as the cache returns the
+   same listings.
+*/
+struct command_index_t
+{
+	/** The directories, each ending with a slash */
+	wcstring_list_t dirs;
+
+	/** The listings the index was built from, one for each directory */
+	std::vector<dir_listing_ref_t> listings;
+
+	/** All files, sorted by command_index_less_t */
+	std::vector<command_index_entry_t> entries;
+};
+
+static command_index_t s_command_index;
+static pthread_mutex_t s_command_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   Number of seconds for which we trust the cached modification times
+   of the directories in $CDPATH before checking them again
+*/
+#define CDPATH_CACHE_VALIDATE_INTERVAL 1
+
+/**
+   A remembered lookup of a directory in $CDPATH
+*/
+struct cdpath_cache_entry_t
+{
+	/** The directory that was found, or empty if none was */
+	wcstring path;
+
+	/** The errno of a failed lookup */
+	int err;
+};
+
+/**
+   A cache of where directories were found in $CDPATH, so that
+   highlighting and autosuggesting the arguments of cd doesn't stat a
+   directory for every entry of $CDPATH on every key press. It is only
+   valid for the value of $CDPATH and the working directory it was
+   built for, and is cleared when the modification time of any
+   directory in $CDPATH changes. Only names without slashes are cached,
+   since those are the ones whose creation or removal changes the
+   modification time of a directory in $CDPATH.
+*/
+struct cdpath_cache_t
+{
+	/** The value of $CDPATH, and the working directory, the cache was built for */
+	wcstring cdpath_var;
+	wcstring working_directory;
+
+	/** Modification times of the directories of cdpath_var, or -1 for directories that could not be stat'd */
+	std::vector<time_t> dir_mtimes;
+
+	/** When dir_mtimes was last checked */
+	time_t validated;
+
+	/** Whether entries may be added, like command_cache_t::usable */
+	bool usable;
+
+	/** The cached lookups by name */
+	std::map<wcstring, cdpath_cache_entry_t> lookups;
+
+	cdpath_cache_t() : validated(0), usable(false) { }
+};
+
+static cdpath_cache_t s_cdpath_cache;
+static pthread_mutex_t s_cdpath_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   Get the modification times of the specified directories, or -1 for
+   the ones that can't be stat'd. Returns false if any of them was
+   modified so recently that a further change might not alter its
+   modification time.
+*/
+static bool get_dir_mtimes( const wcstring_list_t &dirs, time_t now, std::vector<time_t> &mtimes )
+{
+	bool usable = true;
+	for( size_t i=0; i<dirs.size(); i++ )
+	{
+		struct stat buff;
+		if( dirs.at(i).empty() || wstat( dirs.at(i), &buff ) )
 		{
-			struct stat buff;
-			if(wstat( cmd, &buff ))
-			{
-				return false;
-			}
-			
-			if (S_ISREG(buff.st_mode))
-            {
-                output = cmd_str;
-                return true;
-            }
-            else
-			{
-				errno = EACCES;
-				return false;
-			}
+			mtimes.push_back(-1);
 		}
 		else
 		{
-			//struct stat buff;
-			//wstat( cmd, &buff );
-			return false;
+			mtimes.push_back(buff.st_mtime);
+			if( buff.st_mtime >= now - 1 )
+				usable = false;
 		}
-		
+	}
+	return usable;
+}
+
+/**
+   Make sure s_command_cache matches path_var and the current state of
+   its directories, clearing it otherwise. Must be called with
+   s_command_cache_lock held.
+*/
+static void validate_command_cache( const wcstring &path_var )
+{
+	ASSERT_IS_LOCKED(s_command_cache_lock);
+	command_cache_t &cache = s_command_cache;
+	const time_t now = time(NULL);
+	if( cache.path_var == path_var && cache.usable && now - cache.validated < COMMAND_CACHE_VALIDATE_INTERVAL )
+		return;
+
+	wcstring_list_t dirs;
+	wcstokenizer tokenizer(path_var, ARRAY_SEP_STR);
+	wcstring dir;
+	while (tokenizer.next(dir))
+	{
+		dirs.push_back(dir);
+	}
+
+	std::vector<time_t> mtimes;
+	const bool usable = get_dir_mtimes( dirs, now, mtimes );
+
+	if( cache.path_var != path_var || cache.dir_mtimes != mtimes || ! usable )
+	{
+		cache.commands.clear();
+	}
+	cache.path_var = path_var;
+	cache.dir_mtimes.swap(mtimes);
+	cache.validated = now;
+	cache.usable = usable;
+}
+
+/**
+   Returns the value of $PATH to use if it is not set
+*/
+static const wchar_t *path_default_path()
+{
+	if( contains( PREFIX L"/bin", L"/bin", L"/usr/bin" ) )
+	{
+		return L"/bin" ARRAY_SEP_STR L"/usr/bin";
 	}
 	else
 	{
-		const wchar_t *path = vars.get(L"PATH");
-		if( path == 0 )
+		return L"/bin" ARRAY_SEP_STR L"/usr/bin" ARRAY_SEP_STR PREFIX L"/bin";
+	}
+}
+
+/**
+   Check whether cmd, which contains a slash, is an executable regular
+   file. Sets errno on failure.
+*/
+static bool path_check_command( const wcstring &cmd, wcstring &output )
+{
+	if( waccess( cmd, X_OK )==0 )
+	{
+		struct stat buff;
+		if(wstat( cmd, &buff ))
 		{
-			if( contains( PREFIX L"/bin", L"/bin", L"/usr/bin" ) )
-			{
-				path = L"/bin" ARRAY_SEP_STR L"/usr/bin";
-			}
-			else
-			{
-				path = L"/bin" ARRAY_SEP_STR L"/usr/bin" ARRAY_SEP_STR PREFIX L"/bin";
-			}
+			return false;
 		}
 		
-        wcstokenizer tokenizer(path, ARRAY_SEP_STR);
-        wcstring new_cmd;
-        while (tokenizer.next(new_cmd))
-        {
-            size_t path_len = new_cmd.size();
-            if (path_len == 0) continue;
-            
-            append_path_component(new_cmd, cmd_str);
-			if( waccess( new_cmd, X_OK )==0 )
-			{
-				struct stat buff;
-				if( wstat( new_cmd, &buff )==-1 )
-				{
-					if( errno != EACCES )
-					{
-						wperror( L"stat" );
-					}
-					continue;
-				}
-				if( S_ISREG(buff.st_mode) )
-				{
-					output = new_cmd;
-                    return true;
-				}
-				err = EACCES;
-				
-			}
-			else
-			{
-				switch( errno )
-				{
-					case ENOENT:
-					case ENAMETOOLONG:
-					case EACCES:
-					case ENOTDIR:
-						break;
-					default:
-					{
-						debug( 1,
-                              MISSING_COMMAND_ERR_MSG,
-                              new_cmd.c_str() );
-						wperror( L"access" );
-					}
-				}
-			}
+		if (S_ISREG(buff.st_mode))
+		{
+			output = cmd;
+			return true;
+		}
+		else
+		{
+			errno = EACCES;
+			return false;
 		}
 	}
-    
-	errno = err;
 	return false;
-
 }
 
-wchar_t *path_get_path( const wchar_t *cmd )
+/**
+   Search the directories in path_var for an executable regular file
+   named cmd. Sets errno on failure.
+*/
+static bool path_search( const wcstring &cmd, const wcstring &path_var, wcstring &output )
 {
 	int err = ENOENT;
-	
-	CHECK( cmd, 0 );
-
-	debug( 3, L"path_get_path( '%ls' )", cmd );
-
-	if(wcschr( cmd, L'/' ) != 0 )
+	wcstokenizer tokenizer(path_var, ARRAY_SEP_STR);
+	wcstring new_cmd;
+	while (tokenizer.next(new_cmd))
 	{
-		if( waccess( cmd, X_OK )==0 )
+		size_t path_len = new_cmd.size();
+		if (path_len == 0) continue;
+		
+		append_path_component(new_cmd, cmd);
+		if( waccess( new_cmd, X_OK )==0 )
 		{
 			struct stat buff;
-			if(wstat( cmd, &buff ))
+			if( wstat( new_cmd, &buff )==-1 )
 			{
-				return 0;
+				if( errno != EACCES )
+				{
+					wperror( L"stat" );
+				}
+				continue;
 			}
-			
 			if( S_ISREG(buff.st_mode) )
-				return wcsdup( cmd );
-			else
 			{
-				errno = EACCES;
-				return 0;
+				output = new_cmd;
+				return true;
 			}
+			err = EACCES;
+			
 		}
 		else
 		{
-			struct stat buff;
-			wstat( cmd, &buff );
-			return 0;
-		}
-		
-	}
-	else
-	{
-		env_var_t path = env_get_string(L"PATH");
-		if( path.missing() )
-		{
-			if( contains( PREFIX L"/bin", L"/bin", L"/usr/bin" ) )
+			switch( errno )
 			{
-				path = L"/bin" ARRAY_SEP_STR L"/usr/bin";
-			}
-			else
-			{
-				path = L"/bin" ARRAY_SEP_STR L"/usr/bin" ARRAY_SEP_STR PREFIX L"/bin";
+				case ENOENT:
+				case ENAMETOOLONG:
+				case EACCES:
+				case ENOTDIR:
+					break;
+				default:
+				{
+					debug( 1,
+						   MISSING_COMMAND_ERR_MSG,
+						   new_cmd.c_str() );
+					wperror( L"access" );
+				}
 			}
 		}
-		
-		/*
-		  Allocate string long enough to hold the whole command
-		*/
-		wchar_t *new_cmd = (wchar_t *)calloc(wcslen(cmd)+path.size()+2, sizeof(wchar_t) );
-		
-		/*
-		  We tokenize a copy of the path, since strtok modifies
-		  its arguments
-		*/
-		wchar_t *path_cpy = wcsdup( path.c_str() );
-		wchar_t *state;
-			
-		if( (new_cmd==0) || (path_cpy==0) )
-		{
-			DIE_MEM();
-		}
+	}
+	errno = err;
+	return false;
+}
 
-		for( const wchar_t *nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
-			 nxt_path != 0;
-			 nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
+/**
+   Look up cmd in path_var through the command cache. If
+   for_execution is set, commands remembered as missing are searched
+   for again, and found commands are checked to still be executable,
+   so that the cache never stops a command from running.
+*/
+static bool path_search_cached( const wcstring &cmd, const wcstring &path_var, bool for_execution, wcstring &output )
+{
+	{
+		scoped_lock lock(s_command_cache_lock);
+		validate_command_cache( path_var );
+		std::map<wcstring, command_cache_entry_t>::iterator iter = s_command_cache.commands.find( cmd );
+		if( iter != s_command_cache.commands.end() )
 		{
-			int path_len = wcslen( nxt_path );
-			wcscpy( new_cmd, nxt_path );
-			if( new_cmd[path_len-1] != L'/' )
+			command_cache_entry_t &entry = iter->second;
+			if( entry.path.empty() )
 			{
-				new_cmd[path_len++]=L'/';
-			}
-			wcscpy( &new_cmd[path_len], cmd );
-			if( waccess( new_cmd, X_OK )==0 )
-			{
-				struct stat buff;
-				if( wstat( new_cmd, &buff )==-1 )
-				{
-					if( errno != EACCES )
-					{
-						wperror( L"stat" );
-					}
-					continue;
-				}
-				if( S_ISREG(buff.st_mode) )
+				if( ! for_execution )
 				{
-					free( path_cpy );
-					return new_cmd;
+					entry.hits++;
+					errno = entry.err;
+					return false;
 				}
-				err = EACCES;
-				
 			}
-			else
+			else if( ! for_execution || waccess( entry.path, X_OK ) == 0 )
 			{
-				switch( errno )
-				{
-					case ENOENT:
-					case ENAMETOOLONG:
-					case EACCES:
-					case ENOTDIR:
-						break;
-					default:
-					{
-						debug( 1,
-							   MISSING_COMMAND_ERR_MSG,
-							   new_cmd );
-						wperror( L"access" );
-					}
-				}
+				entry.hits++;
+				output = entry.path;
+				return true;
 			}
 		}
-		free( new_cmd );
-		free( path_cpy );
+	}
+	
+	/* Search without holding the lock, since this may take a while */
+	wcstring found;
+	bool result = path_search( cmd, path_var, found );
+	int err = errno;
+	
+	{
+		scoped_lock lock(s_command_cache_lock);
+		if( s_command_cache.usable && s_command_cache.path_var == path_var )
+		{
+			command_cache_entry_t &entry = s_command_cache.commands[cmd];
+			entry.path = found;
+			entry.err = err;
+			entry.hits++;
+		}
+	}
+	
+	if( result )
+		output = found;
+	errno = err;
+	return result;
+}
 
+bool path_get_path_string(const wcstring &cmd_str, wcstring &output, const env_vars &vars)
+{
+    debug( 3, L"path_get_path_string( '%ls' )", cmd_str.c_str() );
+    
+	if( cmd_str.find(L'/') != wcstring::npos )
+	{
+		return path_check_command( cmd_str, output );
 	}
+	
+	const wchar_t *path = vars.get(L"PATH");
+	return path_search_cached( cmd_str, path ? path : path_default_path(), false, output );
+}
 
-	errno = err;
-	return 0;
+wchar_t *path_get_path( const wchar_t *cmd )
+{
+	CHECK( cmd, 0 );
+
+	debug( 3, L"path_get_path( '%ls' )", cmd );
+
+	wcstring output;
+	bool found;
+	if(wcschr( cmd, L'/' ) != 0 )
+	{
+		found = path_check_command( cmd, output );
+	}
+	else
+	{
+		env_var_t path = env_get_string(L"PATH");
+		found = path_search_cached( cmd, path.missing() ? path_default_path() : path.c_str(), true, output );
+	}
+	return found ? wcsdup( output.c_str() ) : NULL;
 }
 
 bool path_get_path_string(const wcstring &cmd, wcstring &output)
@@ -262,104 +441,302 @@ bool path_get_path_string(const wcstring &cmd, wcstring &output)
     return success;
 }
 
+void path_get_cached_commands( std::vector<path_cached_command_t> &result )
+{
+	const env_var_t path = env_get_string(L"PATH");
+	scoped_lock lock(s_command_cache_lock);
+	validate_command_cache( path.missing() ? path_default_path() : path.c_str() );
+	std::map<wcstring, command_cache_entry_t>::const_iterator iter;
+	for( iter = s_command_cache.commands.begin(); iter != s_command_cache.commands.end(); ++iter )
+	{
+		if( ! iter->second.path.empty() )
+		{
+			path_cached_command_t item = { iter->first, iter->second.path, iter->second.hits };
+			result.push_back( item );
+		}
+	}
+}
 
-bool path_get_cdpath_string(const wcstring &dir_str, wcstring &result, const env_vars &vars)
+void path_clear_command_cache()
 {
-	wchar_t *res = 0;
-	int err = ENOENT;
-    bool success = false;
-    
-    const wchar_t *const dir = dir_str.c_str();
-	if( dir[0] == L'/'|| (wcsncmp( dir, L"./", 2 )==0) )
+	scoped_lock lock(s_command_cache_lock);
+	s_command_cache.commands.clear();
+}
+
+/**
+   Returns the string in lower case, the way wildcard_complete compares
+   characters when ignoring case
+*/
+static wcstring command_index_key( const wcstring &str )
+{
+	wcstring result = str;
+	for( size_t i=0; i<result.size(); i++ )
 	{
+		result[i] = towlower( result[i] );
+	}
+	return result;
+}
+
+/**
+   Get the directories of path_var and their listings from the directory
+   cache. This reads the directories that have changed, so it should be
+   called without s_command_index_lock held.
+*/
+static void command_index_get_listings( const wcstring &path_var, wcstring_list_t &dirs, std::vector<dir_listing_ref_t> &listings )
+{
+	wcstokenizer tokenizer(path_var, ARRAY_SEP_STR);
+	wcstring dir;
+	while (tokenizer.next(dir))
+	{
+		dir_listing_ref_t listing;
+		if( dir.empty() || ! dir_cache_get_listing( dir, &listing ) )
+			continue;
+
+		if( dir.at(dir.size()-1) != L'/' )
+			dir.push_back(L'/');
+		dirs.push_back(dir);
+		listings.push_back(listing);
+	}
+}
+
+/**
+   Make sure s_command_index holds the files of the specified
+   directories, rebuilding it if they or their listings changed. Since
+   the directory cache returns the same listing for a directory for as
+   long as it hasn't changed, comparing the listings is enough. Must be
+   called with s_command_index_lock held.
+*/
+static void command_index_update( wcstring_list_t &dirs, std::vector<dir_listing_ref_t> &listings )
+{
+	ASSERT_IS_LOCKED(s_command_index_lock);
+	command_index_t &index = s_command_index;
+	if( index.dirs == dirs && index.listings == listings )
+		return;
+
+	index.entries.clear();
+	for( size_t i=0; i<listings.size(); i++ )
+	{
+		const dir_listing_t &listing = *listings.at(i);
+		for( size_t j=0; j<listing.size(); j++ )
+		{
+			index.entries.push_back( command_index_entry_t() );
+			command_index_entry_t &entry = index.entries.back();
+			entry.key = command_index_key( listing.at(j).name );
+			entry.dir = i;
+			entry.entry = listing.at(j);
+		}
+	}
+	std::sort( index.entries.begin(), index.entries.end(), command_index_less_t() );
+	index.dirs.swap(dirs);
+	index.listings.swap(listings);
+}
+
+/**
+   Append the file of the specified command index entry to out
+*/
+static void command_index_append( const command_index_entry_t &entry, std::vector<dir_file_t> &out )
+{
+	out.push_back( dir_file_t() );
+	out.back().dir = s_command_index.dirs.at( entry.dir );
+	out.back().entry = entry.entry;
+}
+
+void path_find_commands( const wcstring &prefix, const wcstring &path_var, std::vector<dir_file_t> &out )
+{
+	wcstring_list_t dirs;
+	std::vector<dir_listing_ref_t> listings;
+	command_index_get_listings( path_var, dirs, listings );
+
+	scoped_lock lock(s_command_index_lock);
+	command_index_update( dirs, listings );
+
+	const std::vector<command_index_entry_t> &entries = s_command_index.entries;
+	command_index_entry_t start;
+	start.key = command_index_key( prefix );
+	start.dir = 0;
+	std::vector<command_index_entry_t>::const_iterator iter;
+	iter = std::lower_bound( entries.begin(), entries.end(), start, command_index_less_t() );
+	for( ; iter != entries.end() && string_prefixes_string( start.key, iter->key ); ++iter )
+	{
+		command_index_append( *iter, out );
+	}
+}
+
+void path_find_commands_fuzzy( const wcstring &search, const wcstring &path_var, std::vector<dir_file_t> &out )
+{
+	wcstring_list_t dirs;
+	std::vector<dir_listing_ref_t> listings;
+	command_index_get_listings( path_var, dirs, listings );
+
+	scoped_lock lock(s_command_index_lock);
+	command_index_update( dirs, listings );
+
+	const fuzzy_matcher_t matcher( search );
+	const std::vector<command_index_entry_t> &entries = s_command_index.entries;
+	for( size_t i=0; i<entries.size(); i++ )
+	{
+		const fuzzy_match_type_t type = matcher.match( entries.at(i).entry.name ).type;
+		if( type == FUZZY_MATCH_SUBSTRING || type == FUZZY_MATCH_SUBSEQUENCE )
+			command_index_append( entries.at(i), out );
+	}
+}
+
+
+/**
+   Get the directories of cdpath_var that relative directory names are
+   looked up in
+*/
+static void path_get_cdpath_dirs( const wcstring &cdpath_var, const wchar_t *wd, wcstring_list_t &out )
+{
+    wcstokenizer tokenizer(cdpath_var, ARRAY_SEP_STR);
+    wcstring next_path;
+    while (tokenizer.next(next_path))
+    {
+        if (next_path == L"." && wd != NULL) {
+            // next_path is just '.', and we have a working directory, so use the wd instead
+            // TODO: if next_path starts with ./ we need to replace the . with the wd
+            next_path = wd;
+        }
+        
+        expand_tilde(next_path);
+        if (next_path.empty())
+            continue;
+        out.push_back(next_path);
+    }
+}
+
+/**
+   Find the first of paths that is a directory. Sets errno on failure.
+*/
+static bool path_find_directory( const wcstring_list_t &paths, wcstring &result )
+{
+	int err = ENOENT;
+    for (wcstring_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
 		struct stat buf;
-		if( wstat( dir, &buf ) == 0 )
+		if( wstat( *iter, &buf ) == 0 )
 		{
 			if( S_ISDIR(buf.st_mode) )
 			{
-				result = dir_str;
-                success = true;
+				result = *iter;
+				return true;
 			}
 			else
 			{
 				err = ENOTDIR;
 			}
-            
 		}
-	}
-	else
+    }
+	errno = err;
+	return false;
+}
+
+/**
+   Make sure s_cdpath_cache matches cdpath_var, the working directory
+   and the current state of the directories, clearing it otherwise.
+   Must be called with s_cdpath_cache_lock held.
+*/
+static void validate_cdpath_cache( const wcstring &cdpath_var, const wcstring &wd, const wcstring_list_t &dirs )
+{
+	ASSERT_IS_LOCKED(s_cdpath_cache_lock);
+	cdpath_cache_t &cache = s_cdpath_cache;
+	const time_t now = time(NULL);
+	if( cache.cdpath_var == cdpath_var && cache.working_directory == wd && cache.usable && now - cache.validated < CDPATH_CACHE_VALIDATE_INTERVAL )
+		return;
+
+	std::vector<time_t> mtimes;
+	const bool usable = get_dir_mtimes( dirs, now, mtimes );
+
+	if( cache.cdpath_var != cdpath_var || cache.working_directory != wd || cache.dir_mtimes != mtimes || ! usable )
 	{
-        
-        const wchar_t *path = L".";
-                
-        // Respect CDPATH
-        env_var_t cdpath = env_get_string(L"CDPATH");
-        if (! cdpath.missing_or_empty()) {
-            path = cdpath.c_str();
-            printf("CDPATH: %ls\n", path);
-        }
-        
-        wcstokenizer tokenizer(path, ARRAY_SEP_STR);
-        wcstring next_path;
-        while (tokenizer.next(next_path))
+		cache.lookups.clear();
+	}
+	cache.cdpath_var = cdpath_var;
+	cache.working_directory = wd;
+	cache.dir_mtimes.swap(mtimes);
+	cache.validated = now;
+	cache.usable = usable;
+}
+
+/**
+   Look up the relative directory dir in the directories of
+   cdpath_var. Lookups on behalf of a working directory wd are cached
+   if dir is a single name. Lookups without one come from cd itself,
+   which must not be misled by a stale cache. Sets errno on failure.
+*/
+static bool path_cdpath_search( const wcstring &dir, const wcstring &cdpath_var, const wchar_t *wd, wcstring &result )
+{
+    wcstring_list_t dirs;
+    path_get_cdpath_dirs( cdpath_var, wd, dirs );
+    
+    wcstring_list_t paths;
+    for (size_t i=0; i < dirs.size(); i++) {
+        wcstring whole_path = dirs.at(i);
+        append_path_component(whole_path, dir);
+        paths.push_back(whole_path);
+    }
+    
+    const size_t name_end = dir.find_last_not_of(L'/');
+    const bool cacheable = wd != NULL && name_end != wcstring::npos && dir.rfind(L'/', name_end) == wcstring::npos;
+    if (! cacheable)
+        return path_find_directory( paths, result );
+    
+    {
+        scoped_lock lock(s_cdpath_cache_lock);
+        validate_cdpath_cache( cdpath_var, wd, dirs );
+        std::map<wcstring, cdpath_cache_entry_t>::const_iterator iter = s_cdpath_cache.lookups.find( dir );
+        if( iter != s_cdpath_cache.lookups.end() )
         {
-            expand_tilde(next_path);
-            if (next_path.size() == 0) continue;
-            
-            wcstring whole_path = next_path;
-            append_path_component(whole_path, dir);
-            
-			struct stat buf;
-			if( wstat( whole_path, &buf ) == 0 )
-			{
-				if( S_ISDIR(buf.st_mode) )
-				{
-                    result = whole_path;
-                    success = true;
-					break;
-				}
-				else
-				{
-					err = ENOTDIR;
-				}
-			}
-			else
-			{
-				if( lwstat( whole_path, &buf ) == 0 )
-				{
-					err = EROTTEN;
-				}
-			}
+            if( iter->second.path.empty() )
+            {
+                errno = iter->second.err;
+                return false;
+            }
+            result = iter->second.path;
+            return true;
         }
     }
-		
     
-	if( !success )
-	{
-		errno = err;
-	}
+    /* Search without holding the lock, since this may take a while */
+    wcstring found;
+    const bool success = path_find_directory( paths, found );
+    const int err = errno;
+    
+    {
+        scoped_lock lock(s_cdpath_cache_lock);
+        if( s_cdpath_cache.usable && s_cdpath_cache.cdpath_var == cdpath_var && s_cdpath_cache.working_directory == wd )
+        {
+            cdpath_cache_entry_t &entry = s_cdpath_cache.lookups[dir];
+            entry.path = found;
+            entry.err = err;
+        }
+    }
     
-	return res;
+    if( success )
+        result = found;
+    errno = err;
+    return success;
 }
 
-
-wchar_t *path_allocate_cdpath( const wcstring &dir, const wchar_t *wd )
+/**
+   Find the directory dir like path_allocate_cdpath, with cdpath_var as
+   the value of $CDPATH. Sets errno on failure.
+*/
+static bool path_cdpath_lookup( const wcstring &dir, const wchar_t *cdpath_var, const wchar_t *wd, wcstring &result )
 {
-	wchar_t *res = NULL;
-	int err = ENOENT;
 	if (dir.empty())
-		return NULL;
+	{
+		errno = ENOENT;
+		return false;
+	}
         
     if (wd) {
         size_t len = wcslen(wd);
         assert(wd[len - 1] == L'/');
     }
     
-    wcstring_list_t paths;
-    
     if (dir.at(0) == L'/') {
         /* Absolute path */
-        paths.push_back(dir);
+        return path_find_directory( wcstring_list_t(1, dir), result );
     } else if (string_prefixes_string(L"./", dir) ||
                string_prefixes_string(L"../", dir) ||
                dir == L"." || dir == L"..") {
@@ -368,68 +745,27 @@ wchar_t *path_allocate_cdpath( const wcstring &dir, const wchar_t *wd )
         if (wd)
             path.append(wd);
         path.append(dir);
-        paths.push_back(path);
+        return path_find_directory( wcstring_list_t(1, path), result );
     } else {
-        wchar_t *path_cpy;
-        wchar_t *state;
-
         // Respect CDPATH
-        env_var_t path = env_get_string(L"CDPATH");
-        if (path.missing_or_empty()) path = L"."; //We'll change this to the wd if we have one
-
-        path_cpy = wcsdup( path.c_str() );
-
-        for( const wchar_t *nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
-             nxt_path != NULL;
-             nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
-        {
-        
-            if (! wcscmp(nxt_path, L".") && wd != NULL) {
-                // nxt_path is just '.', and we have a working directory, so use the wd instead
-                // TODO: if nxt_path starts with ./ we need to replace the . with the wd
-                nxt_path = wd;
-            }
-            
-            wcstring expanded_path = nxt_path;
-            expand_tilde(expanded_path);
-
-//			debug( 2, L"woot %ls\n", expanded_path.c_str() );
-
-            if (expanded_path.empty())
-                continue;
-            
-            wcstring whole_path = expanded_path;
-            append_path_component(whole_path, dir);
-            paths.push_back(whole_path);
-        }
-        free( path_cpy );
-    }
-    
-    for (wcstring_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
-		struct stat buf;
-        const wcstring &dir = *iter;
-		if( wstat( dir, &buf ) == 0 )
-		{
-			if( S_ISDIR(buf.st_mode) )
-			{
-				res = wcsdup(dir.c_str());
-                break;
-			}
-			else
-			{
-				err = ENOTDIR;
-			}
-		}
+        if (cdpath_var == NULL || cdpath_var[0] == L'\0') cdpath_var = L"."; //We'll change this to the wd if we have one
+        return path_cdpath_search( dir, cdpath_var, wd, result );
     }
-     
-    if( !res )
-	{
-		errno = err;
-	}
+}
 
-	return res;
+bool path_get_cdpath_string(const wcstring &dir, wcstring &result, const env_vars &vars)
+{
+    return path_cdpath_lookup( dir, vars.get(L"CDPATH"), NULL, result );
 }
 
+wchar_t *path_allocate_cdpath( const wcstring &dir, const wchar_t *wd )
+{
+    const env_var_t cdpath = env_get_string(L"CDPATH");
+    wcstring result;
+    if (! path_cdpath_lookup( dir, cdpath.missing() ? NULL : cdpath.c_str(), wd, result ))
+        return NULL;
+    return wcsdup(result.c_str());
+}
 
 bool path_can_get_cdpath(const wcstring &in, const wchar_t *wd)
 {
@@ -38,6 +38,54 @@ class env_vars;
 bool path_get_path_string(const wcstring &cmd, wcstring &output);
 bool path_get_path_string(const wcstring &cmd, wcstring &output, const env_vars &vars);
 
+/**
+   A command remembered by the command cache, which path_get_path and
+   path_get_path_string use to avoid searching $PATH for every lookup.
+*/
+struct path_cached_command_t
+{
+	/** The name of the command */
+	wcstring command;
+
+	/** Where it was found */
+	wcstring path;
+
+	/** How many times it was looked up */
+	unsigned long hits;
+};
+
+/**
+   Get the commands that have been found in $PATH and cached, ordered by name
+*/
+void path_get_cached_commands( std::vector<path_cached_command_t> &result );
+
+/**
+   Forget all cached command locations
+*/
+void path_clear_command_cache();
+
+struct dir_file_t;
+
+/**
+   Find the files in the directories of path_var whose names start with
+   prefix, ignoring case. The names of all files in $PATH are kept in
+   an index sorted by name, which is rebuilt when a directory listing
+   changes, so this does not look at every file. The files are ordered
+   by name, and by the order of their directories in path_var for equal
+   names. They are not tested for being executable. This may be called
+   from any thread.
+*/
+void path_find_commands( const wcstring &prefix, const wcstring &path_var, std::vector<dir_file_t> &out );
+
+/**
+   Find the files in the directories of path_var whose names contain
+   the characters of search in the same order ignoring case, but don't
+   start with search. These are the substring and subsequence matches
+   of fuzzy_matcher_t. This looks at the name of every file in the
+   index, and returns them in the same order as path_find_commands.
+*/
+void path_find_commands_fuzzy( const wcstring &search, const wcstring &path_var, std::vector<dir_file_t> &out );
+
 /**
    Returns the full path of the specified directory, using the CDPATH
    variable as a list of base directories for relative paths. The
@@ -51,6 +99,13 @@ bool path_get_path_string(const wcstring &cmd, wcstring &output, const env_vars
    symlink and a file are found, it is undefined which error status
    will be returned.
    
+   Lookups of a single name in CDPATH on behalf of a working directory,
+   which highlighting and autosuggestion make, are cached for as long
+   as CDPATH, the working directory and the modification times of the
+   directories in CDPATH stay the same. The modification times are
+   checked at most once a second. Lookups without a working directory
+   are never cached.
+   
    \param in The name of the directory.
    \param wd The working directory, or NULL to use the default. The working directory should have a slash appended at the end.
    \return 0 if the command can not be found, the path of the command otherwise. The path should be free'd with free().
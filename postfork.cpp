@@ -8,6 +8,7 @@
 #include "postfork.h"
 #include "iothread.h"
 #include "exec.h"
+#include "wutil.h"
 
 
 /** The number of times to try to call fork() before giving up */
@@ -330,6 +331,7 @@ pid_t execute_fork(bool wait_for_threads_to_die)
 	int i;
 	
     g_fork_count++;
+    syscall_count(SYSCALL_FORK);
     
 	for( i=0; i<FORK_LAPS; i++ )
 	{
@@ -362,3 +364,234 @@ pid_t execute_fork(bool wait_for_threads_to_die)
 	FATAL_EXIT();
     return 0;
 }
+
+#if FISH_USE_POSIX_SPAWN
+bool fork_actions_make_spawn_properties( posix_spawnattr_t *attr, posix_spawn_file_actions_t *actions, job_t *j, process_t *p )
+{
+	/* The terminal must be handed over by the child itself, before it runs */
+	if( job_get_flag( j, JOB_TERMINAL ) && job_get_flag( j, JOB_FOREGROUND ) )
+		return false;
+	
+	io_data_t *io;
+	for( io = j->io; io; io=io->next )
+	{
+		/* We can't move pipes out of the way like free_fd does */
+		if( io->fd > 2 )
+			return false;
+		
+		/* If the spawn fails we fall back to fork, which must then be able to open the file again */
+		if( io->io_mode == IO_FILE && ( io->param2.flags & O_EXCL ) )
+			return false;
+	}
+	
+	if( posix_spawnattr_init( attr ) != 0 )
+		return false;
+	
+	if( posix_spawn_file_actions_init( actions ) != 0 )
+	{
+		posix_spawnattr_destroy( attr );
+		return false;
+	}
+	
+	bool ok = true;
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	
+	/* Put the child in the job's process group, like set_child_group. A pgid of 0 makes the child the group leader. */
+	if( job_get_flag( j, JOB_CONTROL ) )
+	{
+		flags |= POSIX_SPAWN_SETPGROUP;
+		ok = ok && ( 0 == posix_spawnattr_setpgroup( attr, j->pgid ) );
+	}
+	
+	/* Reset our signal handlers and remove all signal blocks, like setup_child_process */
+	sigset_t sigdefault, sigmask;
+	get_signals_with_handlers( &sigdefault );
+	sigemptyset( &sigmask );
+	ok = ok && ( 0 == posix_spawnattr_setsigdefault( attr, &sigdefault ) );
+	ok = ok && ( 0 == posix_spawnattr_setsigmask( attr, &sigmask ) );
+	ok = ok && ( 0 == posix_spawnattr_setflags( attr, flags ) );
+	
+	/* Now do the same as handle_child_io, in the same order */
+	std::vector<int> unused_fds;
+	get_unused_internal_pipes( unused_fds, j->io );
+	for( size_t i=0; ok && i < unused_fds.size(); i++ )
+	{
+		ok = ( 0 == posix_spawn_file_actions_addclose( actions, unused_fds.at(i) ) );
+	}
+	
+	for( io = j->io; ok && io; io=io->next )
+	{
+		switch( io->io_mode )
+		{
+			case IO_CLOSE:
+			{
+				ok = ( 0 == posix_spawn_file_actions_addclose( actions, io->fd ) );
+				break;
+			}
+			
+			case IO_FILE:
+			{
+				ok = ( 0 == posix_spawn_file_actions_addopen( actions, io->fd, io->filename_cstr, io->param2.flags, OPEN_MASK ) );
+				break;
+			}
+			
+			case IO_FD:
+			{
+				if( io->fd != io->param1.old_fd )
+					ok = ( 0 == posix_spawn_file_actions_adddup2( actions, io->param1.old_fd, io->fd ) );
+				break;
+			}
+			
+			case IO_BUFFER:
+			case IO_PIPE:
+			{
+				unsigned int write_pipe_idx = (io->is_input ? 0 : 1);
+				ok = ( 0 == posix_spawn_file_actions_adddup2( actions, io->param1.pipe_fd[write_pipe_idx], io->fd ) );
+				
+				if( write_pipe_idx > 0 )
+				{
+					ok = ok && ( 0 == posix_spawn_file_actions_addclose( actions, io->param1.pipe_fd[0] ) );
+					ok = ok && ( 0 == posix_spawn_file_actions_addclose( actions, io->param1.pipe_fd[1] ) );
+				}
+				else
+				{
+					ok = ok && ( 0 == posix_spawn_file_actions_addclose( actions, io->param1.pipe_fd[0] ) );
+				}
+				break;
+			}
+		}
+	}
+	
+	if( ! ok )
+	{
+		posix_spawnattr_destroy( attr );
+		posix_spawn_file_actions_destroy( actions );
+	}
+	return ok;
+}
+#endif
+
+#if FISH_USE_VFORK
+bool vfork_can_setup_child( job_t *j )
+{
+	for( io_data_t *io = j->io; io; io=io->next )
+	{
+		if( io->fd > 2 && ! ( io->io_mode == IO_FD && io->fd == io->param1.old_fd ) )
+			return false;
+	}
+	return true;
+}
+
+int setup_vforked_child_process( job_t *j, process_t *p, const std::vector<int> &unused_fds )
+{
+	/* Join the job's process group and take the terminal, like set_child_group. The parent records the group, since we must not. */
+	if( job_get_flag( j, JOB_CONTROL ) )
+	{
+		pid_t pgid = j->pgid ? j->pgid : getpid();
+		if( setpgid( 0, pgid ) && getpgid( 0 ) != pgid )
+		{
+			debug_safe( 1, "Could not send process '%s' in job '%s' to its process group", p->argv0_cstr(), j->command_cstr() );
+			perror( "setpgid" );
+			exit_without_destructors( 1 );
+		}
+		
+		if( job_get_flag( j, JOB_TERMINAL ) && job_get_flag( j, JOB_FOREGROUND ) && tcsetpgrp( 0, pgid ) )
+		{
+			debug_safe( 1, "Could not send job '%s' to foreground", j->command_cstr() );
+			perror( "tcsetpgrp" );
+		}
+	}
+	
+	/* Now do the same as handle_child_io, in the same order */
+	for( size_t i=0; i < unused_fds.size(); i++ )
+	{
+		close( unused_fds.at(i) );
+	}
+	
+	for( io_data_t *io = j->io; io; io=io->next )
+	{
+		switch( io->io_mode )
+		{
+			case IO_CLOSE:
+			{
+				if( close( io->fd ) )
+				{
+					debug_safe_int( 0, "Failed to close file descriptor %s", io->fd );
+					perror( "close" );
+				}
+				break;
+			}
+			
+			case IO_FILE:
+			{
+				int tmp = open( io->filename_cstr, io->param2.flags, OPEN_MASK );
+				if( tmp == -1 )
+				{
+					if( ( io->param2.flags & O_EXCL ) && ( errno == EEXIST ) )
+					{
+						debug_safe( 1, NOCLOB_ERROR, io->filename_cstr );
+					}
+					else
+					{
+						debug_safe( 1, FILE_ERROR, io->filename_cstr );
+						perror( "open" );
+					}
+					exit_without_destructors( 1 );
+				}
+				else if( tmp != io->fd )
+				{
+					close( io->fd );
+					if( dup2( tmp, io->fd ) == -1 )
+					{
+						debug_safe_int( 1, FD_ERROR, io->fd );
+						perror( "dup2" );
+						exit_without_destructors( 1 );
+					}
+					close( tmp );
+				}
+				break;
+			}
+			
+			case IO_FD:
+			{
+				if( io->fd == io->param1.old_fd )
+					break;
+				
+				close( io->fd );
+				if( dup2( io->param1.old_fd, io->fd ) == -1 )
+				{
+					debug_safe_int( 1, FD_ERROR, io->fd );
+					perror( "dup2" );
+					exit_without_destructors( 1 );
+				}
+				break;
+			}
+			
+			case IO_BUFFER:
+			case IO_PIPE:
+			{
+				unsigned int write_pipe_idx = (io->is_input ? 0 : 1);
+				if( dup2( io->param1.pipe_fd[write_pipe_idx], io->fd ) != io->fd )
+				{
+					debug_safe( 1, LOCAL_PIPE_ERROR );
+					perror( "dup2" );
+					exit_without_destructors( 1 );
+				}
+				
+				close( io->param1.pipe_fd[0] );
+				if( write_pipe_idx > 0 )
+					close( io->param1.pipe_fd[1] );
+				break;
+			}
+		}
+	}
+	
+	/* Set the handling for job control signals back to the default, and remove all signal blocks. signal_unblock would change our block count. */
+	signal_reset_handlers();
+	sigset_t sigmask;
+	sigemptyset( &sigmask );
+	sigprocmask( SIG_SETMASK, &sigmask, 0 );
+	
+	return 0;
+}
+#endif
@@ -19,6 +19,19 @@
 #include "wutil.h"
 #include "io.h"
 
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN)
+#include <spawn.h>
+#define FISH_USE_POSIX_SPAWN 1
+#else
+#define FISH_USE_POSIX_SPAWN 0
+#endif
+
+#if defined(HAVE_VFORK)
+#define FISH_USE_VFORK 1
+#else
+#define FISH_USE_VFORK 0
+#endif
+
 /**
    This function should be called by both the parent process and the
    child right after fork() has been called. If job control is
@@ -55,4 +68,40 @@ int setup_child_process( job_t *j, process_t *p );
 */
 pid_t execute_fork(bool wait_for_threads_to_die);
 
+#if FISH_USE_POSIX_SPAWN
+/**
+   Initializes posix_spawn attributes and file actions that do the
+   same work as setup_child_process, for launching the process p of
+   the job j without forking. This fails if the job's redirections
+   can't be expressed as spawn file actions, or if the job has to take
+   over the terminal before the process runs, which only a forked child
+   can do.
+
+   \return true on success, in which case the caller must destroy attr and actions
+*/
+bool fork_actions_make_spawn_properties( posix_spawnattr_t *attr, posix_spawn_file_actions_t *actions, job_t *j, process_t *p );
+#endif
+
+#if FISH_USE_VFORK
+/**
+   Returns whether a child created by vfork() can be set up to run a
+   process of the job j with setup_vforked_child_process. This is not
+   the case if a redirection may need pipes to be moved out of the way,
+   which changes our bookkeeping of open file descriptors.
+*/
+bool vfork_can_setup_child( job_t *j );
+
+/**
+   Does the same work as setup_child_process, but in a child created by
+   vfork(), which shares our memory until it execs. It therefore only
+   makes system calls and never modifies memory, which also means it
+   can't close fds through exec_close. The fds to close in the child
+   must instead be determined before calling vfork, with
+   get_unused_internal_pipes.
+
+   eturn 0 on sucess, -1 on failiure
+*/
+int setup_vforked_child_process( job_t *j, process_t *p, const std::vector<int> &unused_fds );
+#endif
+
 #endif
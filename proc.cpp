@@ -34,6 +34,8 @@ Some of the code in this file is based on code from the Glibc manual.
 #include <signal.h>
 #include <dirent.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 
 #if HAVE_NCURSES_H
 #include <ncurses.h>
@@ -73,7 +75,9 @@ Some of the code in this file is based on code from the Glibc manual.
 #include "event.h"
 
 #include <deque>
+#include <tr1/unordered_map>
 #include "output.h"
+#include "trace.h"
 
 /**
    Size of message buffer 
@@ -178,12 +182,65 @@ void job_promote(job_t *job)
 }
 
 
+/**
+   A process that has been started, and the job it is part of
+*/
+struct pid_index_entry_t
+{
+	job_t *job;
+	process_t *process;
+};
+
+typedef std::tr1::unordered_map<pid_t, pid_index_entry_t> pid_index_t;
+
+/**
+   The started processes of the jobs in the job list, by their
+   pid. This is read by the SIGCHLD handler, so it is only changed
+   while signals are blocked.
+*/
+static pid_index_t pid_index;
+
+void proc_index_job( job_t *j )
+{
+    ASSERT_IS_MAIN_THREAD();
+	signal_block();
+	for( process_t *p = j->first_process; p; p = p->next )
+	{
+		if( p->pid )
+		{
+			pid_index_entry_t &entry = pid_index[p->pid];
+			entry.job = j;
+			entry.process = p;
+		}
+	}
+	signal_unblock();
+}
+
+/**
+   Removes the processes of the specified job from pid_index. A pid
+   that has been reused by a process of a newer job is left alone.
+*/
+static void proc_unindex_job( const job_t *j )
+{
+	signal_block();
+	for( const process_t *p = j->first_process; p; p = p->next )
+	{
+		if( ! p->pid )
+			continue;
+		pid_index_t::iterator iter = pid_index.find( p->pid );
+		if( iter != pid_index.end() && iter->second.process == p )
+			pid_index.erase( iter );
+	}
+	signal_unblock();
+}
+
 /*
   Remove job from the job list and free all memory associated with
   it.
 */
 void job_free( job_t * j )
 {
+	proc_unindex_job( j );
 	job_remove( j );
     delete j;
 }
@@ -350,12 +407,13 @@ int job_signal( job_t *j, int signal )
 
 
 /**
-   Store the status of the process pid that was returned by waitpid.
-   Return 0 if all went well, nonzero otherwise.  
+   Store the status of the process pid that was returned by wait4,
+   along with its resource usage.
 */
 static void mark_process_status( const job_t *j,
 								 process_t *p,
-								 int status )
+								 int status,
+								 const struct rusage *usage )
 {
 //	debug( 0, L"Process %ls %ls", p->argv[0], WIFSTOPPED (status)?L"stopped":(WIFEXITED( status )?L"exited":(WIFSIGNALED( status )?L"signaled to exit":L"BLARGH")) );
 	p->status = status;
@@ -367,6 +425,8 @@ static void mark_process_status( const job_t *j,
 	else if (WIFSIGNALED(status) || WIFEXITED(status)) 
 	{
 		p->completed = 1;
+		p->rusage = *usage;
+		gettimeofday( &p->exit_time, 0 );
 	}
 	else
 	{
@@ -396,8 +456,9 @@ static void mark_process_status( const job_t *j,
 
    \param pid the pid of the process whose status changes
    \param status the status as returned by wait
+   \param usage the resource usage as returned by wait4
 */
-static void handle_child_status( pid_t pid, int status )
+static void handle_child_status( pid_t pid, int status, const struct rusage *usage )
 {
 	bool found_proc = false;
 	const job_t *j=0;
@@ -411,9 +472,18 @@ static void handle_child_status( pid_t pid, int status )
 	  write( 2, mess, strlen(mess ));
 	*/
 
+	/*
+	  Look the process up in the index. Only processes that changed
+	  state before their job was indexed, and keepalive processes,
+	  need a search of the whole job list.
+	*/
+	pid_index_t::const_iterator indexed = pid_index.find( pid );
+	const job_t *indexed_job = indexed == pid_index.end() ? 0 : indexed->second.job;
+
     job_iterator_t jobs;
-	while (! found_proc && (j = jobs.next()))
+	while (! found_proc && (j = indexed_job ? indexed_job : jobs.next()))
 	{
+		indexed_job = 0;
 		process_t *prev=0;
 		for( p=j->first_process; p; p=p->next )
 		{
@@ -426,7 +496,7 @@ static void handle_child_status( pid_t pid, int status )
   write( 2, mess, strlen(mess ));
 */		
 				
-				mark_process_status ( j, p, status);
+				mark_process_status ( j, p, status, usage );
 				if( p->completed && prev != 0  )
 				{
 					if( !prev->completed && prev->pid)
@@ -498,6 +568,7 @@ void job_handle_signal ( int signal, siginfo_t *info, void *con )
 {
 	
 	int status;
+	struct rusage usage;
 	pid_t pid;
 	int errno_old = errno;
 
@@ -507,7 +578,7 @@ void job_handle_signal ( int signal, siginfo_t *info, void *con )
 
 	while(1)
 	{
-		switch(pid=waitpid( -1,&status,WUNTRACED|WNOHANG ))
+		switch(pid=wait4( -1,&status,WUNTRACED|WNOHANG, &usage ))
 		{
 			case 0:
 			case -1:
@@ -517,7 +588,7 @@ void job_handle_signal ( int signal, siginfo_t *info, void *con )
 			}	
 			default:
 
-				handle_child_status( pid, status );
+				handle_child_status( pid, status, &usage );
 				break;
 		}
 	}	
@@ -553,9 +624,124 @@ void proc_fire_event( const wchar_t *msg, int type, pid_t pid, int status )
     event.arguments->resize(0);
 }				
 
+/**
+   The timing report of the last job to complete, see proc_get_last_job_timing
+*/
+static wcstring_list_t last_job_timing;
+
+/**
+   Returns the number of microseconds from before to after
+*/
+static long long proc_usec_between( const struct timeval &before, const struct timeval &after )
+{
+	return (after.tv_sec - before.tv_sec) * 1000000LL + (after.tv_usec - before.tv_usec);
+}
+
+/**
+   Returns a time in microseconds formatted as seconds
+*/
+static wcstring proc_format_usec( long long usec )
+{
+	return format_string( L"%lld.%03llds", usec / 1000000, (usec % 1000000) / 1000 );
+}
+
+/**
+   Record the wall time and resource usage of a completed job and its
+   processes, if the user asked for it by setting fish_job_timing. The
+   report can be printed with status --job-timing, and is appended to
+   the file named by fish_job_timing_log, if that is set.
+
+   Only external commands have CPU time, memory use and launch time,
+   since the rest runs inside fish.
+*/
+static void proc_record_job_timing( const job_t *j )
+{
+	if( j->start_time.tv_sec == 0 )
+		return;
+	if( env_get_string( L"fish_job_timing" ).missing() )
+		return;
+
+	struct timeval end;
+	gettimeofday( &end, 0 );
+
+	wcstring_list_t report;
+	report.push_back( wcstring() );
+
+	bool has_external = false;
+	for( const process_t *p = j->first_process; p; p=p->next )
+	{
+		const wchar_t *name = p->argv0() ? p->argv0() : L"";
+		switch( p->type )
+		{
+			case EXTERNAL:
+			{
+				if( ! has_external || proc_usec_between( end, p->exit_time ) > 0 )
+					end = p->exit_time;
+				has_external = true;
+
+				const struct rusage &usage = p->rusage;
+				report.push_back( format_string( L"\t%ls (pid %d): wall %ls, user %ls, sys %ls, max rss %ldkB, launch %ld.%03ldms",
+												name,
+												(int)p->pid,
+												proc_format_usec( proc_usec_between( p->launch_time, p->exit_time ) ).c_str(),
+												proc_format_usec( usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec ).c_str(),
+												proc_format_usec( usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec ).c_str(),
+												usage.ru_maxrss,
+												p->launch_usec / 1000,
+												p->launch_usec % 1000 ) );
+				break;
+			}
+
+			case INTERNAL_BUILTIN:
+				report.push_back( format_string( L"\t%ls: builtin", name ) );
+				break;
+
+			case INTERNAL_FUNCTION:
+				report.push_back( format_string( L"\t%ls: function", name ) );
+				break;
+
+			case INTERNAL_BLOCK:
+				report.push_back( L"\tblock" );
+				break;
+		}
+	}
+
+	report.at( 0 ) = format_string( L"job '%ls': wall %ls",
+								   j->command_wcstr(),
+								   proc_format_usec( proc_usec_between( j->start_time, end ) ).c_str() );
+	last_job_timing.swap( report );
+
+	const env_var_t log = env_get_string( L"fish_job_timing_log" );
+	if( ! log.missing_or_empty() )
+	{
+		int fd = wopen_cloexec( log, O_WRONLY | O_APPEND | O_CREAT, 0666 );
+		if( fd == -1 )
+		{
+			wperror( L"open" );
+			return;
+		}
+
+		wcstring str;
+		for( size_t i=0; i<last_job_timing.size(); i++ )
+		{
+			str.append( last_job_timing.at( i ) );
+			str.push_back( L'\n' );
+		}
+		const std::string narrow = wcs2string( str );
+		write_loop( fd, narrow.c_str(), narrow.size() );
+		close( fd );
+	}
+}
+
+const wcstring_list_t &proc_get_last_job_timing()
+{
+	return last_job_timing;
+}
+
 int job_reap( bool interactive )
 {
     ASSERT_IS_MAIN_THREAD();
+    TRACE_SCOPE( "job_reap" );
 	job_t *jnext;	
 	int found=0;
 	
@@ -659,6 +845,7 @@ int job_reap( bool interactive )
 			proc_fire_event( L"JOB_EXIT", EVENT_EXIT, -j->pgid, 0 );			
 			proc_fire_event( L"JOB_EXIT", EVENT_JOB_ID, j->job_id, 0 );			
 
+			proc_record_job_timing( j );
 			job_free(j);
 		}		
 		else if( job_is_stopped( j ) && !job_get_flag( j, JOB_NOTIFIED ) ) 
@@ -687,113 +874,71 @@ int job_reap( bool interactive )
 #ifdef HAVE__PROC_SELF_STAT
 
 /**
-   Maximum length of a /proc/[PID]/stat filename
+   Maximum length of the contents of a /proc/[PID]/stat file that we look at
 */
-#define FN_SIZE 256
+#define STAT_SIZE 1024
 
 /**
-   Get the CPU time for the specified process
+   Read the CPU time that a running process and its reaped children
+   have used from /proc/[PID]/stat, in microseconds
 */
-unsigned long proc_get_jiffies( process_t *p )
+static unsigned long long proc_read_cpu_time( pid_t pid )
 {
-	wchar_t fn[FN_SIZE];
+	static long ticks_per_second = 0;
+	if( ticks_per_second <= 0 )
+	{
+		ticks_per_second = sysconf( _SC_CLK_TCK );
+		if( ticks_per_second <= 0 )
+			return 0;
+	}
 
-	char state;
-	int pid, ppid, pgrp, 
-		session, tty_nr, tpgid,
-		exit_signal, processor;	
-	
-	long int cutime, cstime, priority, 
-		nice, placeholder, itrealvalue, 
-		rss;
-	unsigned long int flags, minflt, cminflt, 
-		majflt, cmajflt, utime, 
-		stime, starttime, vsize, 
-		rlim, startcode, endcode,
-		startstack, kstkesp, kstkeip,
-		signal, blocked, sigignore,
-		sigcatch, wchan, nswap, cnswap;
-	char comm[1024];
-	
-	if( p->pid <= 0 )
+	char fn[64];
+	snprintf( fn, sizeof fn, "/proc/%d/stat", (int)pid );
+	int fd = open( fn, O_RDONLY );
+	if( fd == -1 )
 		return 0;
-	
-	swprintf( fn, FN_SIZE, L"/proc/%d/stat", p->pid );
-	
-	FILE *f = wfopen( fn, "r" );
-	if( !f )
-		return 0;
-	
-	int count = fscanf( f, 
-						"%d %s %c " 
-						"%d %d %d "
-						"%d %d %lu "
-						
-						"%lu %lu %lu "
-						"%lu %lu %lu "
-						"%ld %ld %ld "
-
-						"%ld %ld %ld "
-						"%lu %lu %ld "
-						"%lu %lu %lu "
-
-						"%lu %lu %lu "
-						"%lu %lu %lu "
-						"%lu %lu %lu "
-
-						"%lu %d %d ",
-	
-						&pid, comm, &state, 
-						&ppid, &pgrp, &session, 
-						&tty_nr, &tpgid, &flags,
-
-						&minflt, &cminflt, &majflt,
-						&cmajflt, &utime, &stime,
-						&cutime, &cstime, &priority,
-			
-						&nice, &placeholder, &itrealvalue,
-						&starttime, &vsize, &rss,
-						&rlim, &startcode, &endcode,
 
-						&startstack, &kstkesp, &kstkeip,
-						&signal, &blocked, &sigignore,
-						&sigcatch, &wchan, &nswap,
-
-						&cnswap, &exit_signal, &processor
-		);
-
-	if( count < 17 )
-	{
+	char buff[STAT_SIZE];
+	ssize_t amt = read( fd, buff, sizeof buff - 1 );
+	close( fd );
+	if( amt <= 0 )
 		return 0;
-	}
+	buff[amt] = '\0';
 
 	/*
-	  Don't need to check exit status of fclose on read-only streams
+	  The command name is in parentheses and may contain spaces and
+	  parentheses itself, so the fields are counted from the last
+	  closing parenthesis
 	*/
-	fclose( f );
-	return utime+stime+cutime+cstime;
-	
+	const char *fields = strrchr( buff, ')' );
+	if( ! fields )
+		return 0;
+
+	unsigned long utime, stime;
+	long cutime, cstime;
+	if( sscanf( fields + 1,
+				" %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+				&utime, &stime, &cutime, &cstime ) != 4 )
+		return 0;
+
+	unsigned long long ticks = utime + stime + cutime + cstime;
+	return ticks * 1000000ULL / ticks_per_second;
 }
 
-/**
-   Update the CPU time for all jobs
-*/
-void proc_update_jiffies()
+unsigned long long proc_get_cpu_time( const process_t *p )
 {
-	job_t* job;
-	process_t *p;
-	job_iterator_t j;
+	if( p->pid <= 0 )
+		return 0;
 
-	for( job = j.next(); job; job = j.next() )
+	/* Reaped processes have their final usage, which saves looking them up */
+	if( p->completed )
 	{
-		for( p=job->first_process; p; p=p->next )
-		{
-			gettimeofday( &p->last_time, 0 );
-			p->last_jiffies = proc_get_jiffies( p );
-		}	
+		const struct rusage &usage = p->rusage;
+		return ( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000ULL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
 	}
-}
 
+	return proc_read_cpu_time( p->pid );
+}
 
 #endif
 
@@ -931,6 +1076,22 @@ static int terminal_give_to_job( job_t *j, int cont )
 	return 1;
 }
 
+/**
+   Returns whether the specified job was given a process group, or any
+   of its processes was forked, and so may have taken the terminal
+*/
+static bool job_has_forked( const job_t *j )
+{
+	if( j->pgid )
+		return true;
+	for( const process_t *p = j->first_process; p; p = p->next )
+	{
+		if( p->pid )
+			return true;
+	}
+	return false;
+}
+
 /**
    Returns contol of the terminal to the shell, and saves the terminal
    attribute state to the job, so that we can restore the terminal
@@ -1085,10 +1246,16 @@ void job_continue (job_t *j, int cont)
 							  short-lived jobs.
 							*/
 							int status;						
-							pid_t pid = waitpid(-1, &status, WUNTRACED );
+							struct rusage usage;
+							pid_t pid = wait4(-1, &status, WUNTRACED, &usage );
 							if( pid > 0 )
 							{
-								handle_child_status( pid, status );
+								/* Reap all the other children that are done as well, before looking at the job again */
+								do
+								{
+									handle_child_status( pid, status, &usage );
+								}
+								while( ( pid = wait4( -1, &status, WUNTRACED|WNOHANG, &usage ) ) > 0 );
 							}
 							else
 							{
@@ -1138,9 +1305,10 @@ void job_continue (job_t *j, int cont)
 			}			
 		}
 		/* 
-		   Put the shell back in the foreground.  
+		   Put the shell back in the foreground. A job that forked
+		   nothing, like a builtin, never had it.
 		*/
-		if( job_get_flag( j, JOB_TERMINAL ) && job_get_flag( j, JOB_FOREGROUND ) )
+		if( job_get_flag( j, JOB_TERMINAL ) && job_get_flag( j, JOB_FOREGROUND ) && job_has_forked( j ) )
 		{
 			int ok;
 			
@@ -1188,7 +1356,7 @@ void proc_sanity_check()
 		
 		
 		validate_pointer( j->first_process,
-						  _( L"Process list pointer" ),
+						  N_( L"Process list pointer" ),
 						  0 );
 
 		/*
@@ -1210,10 +1378,10 @@ void proc_sanity_check()
    		p = j->first_process;
 		while( p )
 		{			
-			validate_pointer( p->get_argv(), _( L"Process argument list" ), 0 );
-			validate_pointer( p->argv0(), _( L"Process name" ), 0 );
-			validate_pointer( p->next, _( L"Process list pointer" ), 1 );
-			validate_pointer( p->actual_cmd, _( L"Process command" ), 1 );
+			validate_pointer( p->get_argv(), N_( L"Process argument list" ), 0 );
+			validate_pointer( p->argv0(), N_( L"Process name" ), 0 );
+			validate_pointer( p->next, N_( L"Process list pointer" ), 1 );
+			validate_pointer( p->actual_cmd, N_( L"Process command" ), 1 );
 			
 			if ( (p->stopped & (~0x00000001)) != 0 )
 			{
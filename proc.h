@@ -15,6 +15,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <list>
 
 #include "util.h"
@@ -152,10 +153,14 @@ class process_t
         stopped(0),
         status(0),
         count_help_magic(0),
-        next(NULL)
+        next(NULL),
+        launch_time(),
+        launch_usec(0),
+        exit_time(),
+        rusage()
 #ifdef HAVE__PROC_SELF_STAT
         ,last_time(),
-        last_jiffies(0)
+        last_cpu_time(0)
 #endif
     {
     }
@@ -229,11 +234,23 @@ class process_t
 
 	/** Next process in pipeline. We own this and we are responsible for deleting it. */
 	process_t *next;
+
+	/** When fish started launching the process. Only set for external commands. */
+	struct timeval launch_time;
+
+	/** How many microseconds it took to fork or spawn the process */
+	long launch_usec;
+
+	/** When the process completed */
+	struct timeval exit_time;
+
+	/** Resource usage of the process as returned by wait4, valid once it has completed */
+	struct rusage rusage;
 #ifdef HAVE__PROC_SELF_STAT
 	/** Last time of cpu time check */
 	struct timeval last_time;
-	/** Number of jiffies spent in process at last cpu time check */
-	unsigned long last_jiffies;	
+	/** Microseconds of cpu time spent in process at last cpu time check */
+	unsigned long long last_cpu_time;
 #endif
 };
 
@@ -329,7 +346,8 @@ class job_t
         tmodes(),
         job_id(jobid),
         io(NULL),
-        flags(0)
+        flags(0),
+        start_time()
     {
     }
     
@@ -395,6 +413,11 @@ class job_t
 	   Bitset containing information about the job. A combination of the JOB_* constants.
 	*/
 	int flags;
+
+	/**
+	   When fish started executing the job
+	*/
+	struct timeval start_time;
 	
 };
 
@@ -508,6 +531,13 @@ void proc_set_last_status( int s );
 */
 int proc_get_last_status();
 
+/**
+   Adds the processes of the specified job that have been started to
+   the index that the SIGCHLD handler finds them by. Processes that
+   change state before this is done are found by a search of all jobs.
+*/
+void proc_index_job( job_t *j );
+
 /**
    Remove the specified job
 */
@@ -574,19 +604,22 @@ void job_handle_signal( int signal, siginfo_t *info, void *con );
 */
 int job_signal( job_t *j, int signal );
 
-#ifdef HAVE__PROC_SELF_STAT
 /**
-   Use the procfs filesystem to look up how many jiffies of cpu time
-   was used by this process. This function is only available on
-   systems with the procfs file entry 'stat', i.e. Linux.
+   Returns the timing report of the last job that completed while
+   fish_job_timing was set, one line for the job followed by one line
+   for each of its processes. It is empty if no job has been timed.
 */
-unsigned long proc_get_jiffies( process_t *p );
+const wcstring_list_t &proc_get_last_job_timing();
 
+#ifdef HAVE__PROC_SELF_STAT
 /**
-   Update process time usage for all processes by calling the
-   proc_get_jiffies function for every process of every job.
+   Returns how many microseconds of CPU time the specified process and
+   its reaped children have used. Processes that have been reaped are
+   answered from the resource usage wait4 returned for them, and running
+   ones are looked up in the procfs file entry 'stat', which is only
+   available on systems like Linux.
 */
-void proc_update_jiffies();
+unsigned long long proc_get_cpu_time( const process_t *p );
 
 #endif
 
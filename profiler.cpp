@@ -0,0 +1,550 @@
+/** \file profiler.cpp
+
+	Profiling of fish scripts.
+
+	The profiler keeps a stack with a frame for every job and function
+	call that is currently running. When a frame is popped, its
+	inclusive time is added to the nearest enclosing frame of the same
+	kind, so that the self time of a job excludes the jobs nested in it,
+	like the jobs of a function it calls, and the self time of a
+	function excludes the functions it calls.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "wutil.h"
+#include "env.h"
+#include "profiler.h"
+
+/**
+   The environment variable with the name of the startup trace file
+*/
+#define STARTUP_TRACE_VAR "FISH_STARTUP_TRACE"
+
+/**
+   The environment variable with the name of the exit stats file
+*/
+#define EXIT_STATS_VAR "FISH_EXIT_STATS"
+
+/**
+   The number of jobs that are remembered for profiler_write_recent
+*/
+#define PROFILE_RECENT_SIZE 1024
+
+/**
+   A job or function call that is being measured
+*/
+struct profile_frame_t
+{
+	/** Whether this is a function call rather than a job */
+	bool is_function;
+
+	/** Whether set_job was called for a job, i.e. whether it should be recorded */
+	bool is_set;
+
+	/** When the frame was pushed */
+	long long start;
+
+	/** The time spent in nested frames of the same kind */
+	long long nested;
+
+	/** The sequence number of the job in the list of recent jobs */
+	size_t seq;
+
+	/** The function name, or the name of the first command of the job and where it is */
+	wcstring label;
+
+	/** The source position of the job */
+	wcstring position;
+
+	/** The source text of the job */
+	wcstring cmd;
+};
+
+/**
+   Totals for a function or a source line
+*/
+struct profile_stats_t
+{
+	profile_stats_t() : calls(0), self(0), total(0) { }
+
+	/** The number of calls */
+	long long calls;
+
+	/** The time spent in the function or line itself */
+	long long self;
+
+	/** The time spent in the function or line, including what it called */
+	long long total;
+
+	/** The source text, for lines */
+	wcstring cmd;
+};
+
+/**
+   A job in the list of recent jobs
+*/
+struct profile_recent_t
+{
+	profile_recent_t() : seq(0), level(0), self(0), total(0), is_set(false) { }
+
+	size_t seq;
+	size_t level;
+	long long self;
+	long long total;
+	bool is_set;
+	wcstring cmd;
+};
+
+typedef std::map<wcstring, profile_stats_t> profile_stats_map_t;
+
+static bool s_enabled = false;
+
+/** The frames that are currently running, innermost last */
+static std::vector<profile_frame_t> s_frames;
+
+/** Totals per function name */
+static profile_stats_map_t s_functions;
+
+/** Totals per source position and job */
+static profile_stats_map_t s_lines;
+
+/** Self time per stack of jobs */
+static std::map<wcstring, long long> s_folded;
+
+/** The recent jobs, indexed by sequence number modulo PROFILE_RECENT_SIZE */
+static std::vector<profile_recent_t> s_recent;
+
+/** The sequence number to give the next job */
+static size_t s_next_seq = 1;
+
+bool profiler_is_enabled()
+{
+	return s_enabled;
+}
+
+void profiler_set_enabled( bool enabled )
+{
+	ASSERT_IS_MAIN_THREAD();
+	s_enabled = enabled;
+}
+
+void profiler_reset()
+{
+	ASSERT_IS_MAIN_THREAD();
+	s_functions.clear();
+	s_lines.clear();
+	s_folded.clear();
+	s_recent.clear();
+	s_next_seq = 1;
+
+	/* Frames that are running stay, but they no longer have a place among the recent jobs */
+	for( size_t i=0; i<s_frames.size(); i++ )
+	{
+		s_frames.at( i ).seq = 0;
+	}
+}
+
+/**
+   Push a frame for a job or function call
+*/
+static void profiler_push( bool is_function, const wchar_t *label )
+{
+	ASSERT_IS_MAIN_THREAD();
+	s_frames.push_back( profile_frame_t() );
+	profile_frame_t &frame = s_frames.back();
+	frame.is_function = is_function;
+	frame.is_set = is_function;
+	frame.start = get_time();
+	frame.nested = 0;
+	frame.seq = 0;
+	if( label )
+		frame.label = label;
+
+	if( ! is_function )
+	{
+		/* Take a place among the recent jobs now, so that they are listed in the order they started */
+		if( s_recent.empty() )
+			s_recent.resize( PROFILE_RECENT_SIZE );
+
+		size_t level = 0;
+		for( size_t i=0; i+1<s_frames.size(); i++ )
+		{
+			if( ! s_frames.at( i ).is_function )
+				level++;
+		}
+
+		frame.seq = s_next_seq++;
+		profile_recent_t &recent = s_recent.at( frame.seq % PROFILE_RECENT_SIZE );
+		recent = profile_recent_t();
+		recent.seq = frame.seq;
+		recent.level = level;
+	}
+}
+
+/**
+   Pop the innermost frame and record it
+*/
+static void profiler_pop()
+{
+	ASSERT_IS_MAIN_THREAD();
+	assert( ! s_frames.empty() );
+
+	profile_frame_t frame;
+	std::swap( frame, s_frames.back() );
+	s_frames.pop_back();
+
+	if( ! frame.is_set )
+		return;
+
+	long long total = get_time() - frame.start;
+	long long self = total - frame.nested;
+
+	/* The time counts as nested for the nearest enclosing frame of the same kind */
+	for( size_t i=s_frames.size(); i>0; i-- )
+	{
+		profile_frame_t &outer = s_frames.at( i-1 );
+		if( outer.is_function == frame.is_function )
+		{
+			outer.nested += total;
+			break;
+		}
+	}
+
+	if( frame.is_function )
+	{
+		profile_stats_t &stats = s_functions[frame.label];
+		stats.calls++;
+		stats.self += self;
+		stats.total += total;
+		return;
+	}
+
+	profile_stats_t &stats = s_lines[frame.position + L'\t' + frame.cmd];
+	if( stats.calls == 0 )
+		stats.cmd = frame.cmd;
+	stats.calls++;
+	stats.self += self;
+	stats.total += total;
+
+	wcstring stack;
+	for( size_t i=0; i<s_frames.size(); i++ )
+	{
+		const profile_frame_t &outer = s_frames.at( i );
+		if( outer.is_function || ! outer.is_set )
+			continue;
+		stack.append( outer.label );
+		stack.push_back( L';' );
+	}
+	stack.append( frame.label );
+	s_folded[stack] += self;
+
+	if( frame.seq && ! s_recent.empty() )
+	{
+		profile_recent_t &recent = s_recent.at( frame.seq % PROFILE_RECENT_SIZE );
+		if( recent.seq == frame.seq )
+		{
+			recent.is_set = true;
+			recent.self = self;
+			recent.total = total;
+			recent.cmd.swap( frame.cmd );
+		}
+	}
+}
+
+profile_job_scope_t::profile_job_scope_t() : pushed( s_enabled )
+{
+	if( pushed )
+		profiler_push( false, NULL );
+}
+
+void profile_job_scope_t::set_job( const wchar_t *cmd, const wchar_t *name, const wchar_t *filename, int lineno )
+{
+	if( ! pushed )
+		return;
+
+	profile_frame_t &frame = s_frames.back();
+	frame.is_set = true;
+	frame.cmd = cmd;
+	frame.position = format_string( L"%ls:%d", filename ? filename : _( L"Standard input" ), lineno );
+	frame.label = format_string( L"%ls (%ls)", name, frame.position.c_str() );
+
+	/* Semicolons separate the frames of the folded format */
+	std::replace( frame.label.begin(), frame.label.end(), L';', L',' );
+}
+
+profile_job_scope_t::~profile_job_scope_t()
+{
+	if( pushed )
+		profiler_pop();
+}
+
+profile_function_scope_t::profile_function_scope_t( const wchar_t *name ) : pushed( s_enabled )
+{
+	if( pushed )
+		profiler_push( true, name );
+}
+
+profile_function_scope_t::~profile_function_scope_t()
+{
+	if( pushed )
+		profiler_pop();
+}
+
+/**
+   Compares totals so that the largest total comes first
+*/
+static bool profile_total_greater( const profile_stats_map_t::const_iterator &a, const profile_stats_map_t::const_iterator &b )
+{
+	return a->second.total > b->second.total;
+}
+
+/**
+   Returns the entries of a map of totals, ordered by profile_total_greater
+*/
+static std::vector<profile_stats_map_t::const_iterator> profile_sorted( const profile_stats_map_t &map )
+{
+	std::vector<profile_stats_map_t::const_iterator> result;
+	result.reserve( map.size() );
+	for( profile_stats_map_t::const_iterator iter = map.begin(); iter != map.end(); ++iter )
+	{
+		result.push_back( iter );
+	}
+	std::stable_sort( result.begin(), result.end(), profile_total_greater );
+	return result;
+}
+
+void profiler_write_report( wcstring &out )
+{
+	std::vector<profile_stats_map_t::const_iterator> functions = profile_sorted( s_functions );
+	out.append( _( L"Calls\tSelf\tTotal\tFunction\n" ) );
+	for( size_t i=0; i<functions.size(); i++ )
+	{
+		const profile_stats_t &stats = functions.at( i )->second;
+		append_format( out, L"%lld\t%lld\t%lld\t%ls\n", stats.calls, stats.self, stats.total, functions.at( i )->first.c_str() );
+	}
+
+	out.push_back( L'\n' );
+
+	std::vector<profile_stats_map_t::const_iterator> lines = profile_sorted( s_lines );
+	out.append( _( L"Calls\tSelf\tTotal\tLine\tCommand\n" ) );
+	for( size_t i=0; i<lines.size(); i++ )
+	{
+		const wcstring &key = lines.at( i )->first;
+		const profile_stats_t &stats = lines.at( i )->second;
+		append_format( out, L"%lld\t%lld\t%lld\t", stats.calls, stats.self, stats.total );
+		out.append( key, 0, key.size() - stats.cmd.size() );
+		out.append( stats.cmd );
+		out.push_back( L'\n' );
+	}
+}
+
+void profiler_write_folded( wcstring &out )
+{
+	for( std::map<wcstring, long long>::const_iterator iter = s_folded.begin(); iter != s_folded.end(); ++iter )
+	{
+		append_format( out, L"%ls %lld\n", iter->first.c_str(), iter->second );
+	}
+}
+
+void profiler_write_recent( wcstring &out )
+{
+	out.append( _( L"Self\tTotal\tCommand\n" ) );
+	if( s_recent.empty() )
+		return;
+
+	size_t first = s_next_seq > PROFILE_RECENT_SIZE ? s_next_seq - PROFILE_RECENT_SIZE : 1;
+	for( size_t seq = first; seq < s_next_seq; seq++ )
+	{
+		const profile_recent_t &recent = s_recent.at( seq % PROFILE_RECENT_SIZE );
+		if( recent.seq != seq || ! recent.is_set )
+			continue;
+
+		append_format( out, L"%lld\t%lld\t", recent.self, recent.total );
+		out.append( recent.level, L'-' );
+		out.append( L"> " );
+		out.append( recent.cmd );
+		out.push_back( L'\n' );
+	}
+}
+
+/**
+   A phase of startup
+*/
+struct startup_phase_t
+{
+	const char *name;
+
+	/** The time spent in the phase */
+	long long total;
+
+	/** The number of scopes of the phase that have been entered and not left */
+	int depth;
+};
+
+/** The file that the startup trace is written to, or NULL if startup isn't being traced */
+static char *s_startup_trace_file = NULL;
+
+/** When startup_trace_init was called */
+static long long s_startup_start;
+
+/** The phases of startup, in the order they were first entered */
+static std::vector<startup_phase_t> s_startup_phases;
+
+/**
+   Returns the phase of startup with the specified name, adding it if
+   it hasn't been entered yet
+*/
+static startup_phase_t &startup_get_phase( const char *name )
+{
+	for( size_t i=0; i<s_startup_phases.size(); i++ )
+	{
+		if( ! strcmp( s_startup_phases.at( i ).name, name ) )
+			return s_startup_phases.at( i );
+	}
+
+	startup_phase_t phase;
+	phase.name = name;
+	phase.total = 0;
+	phase.depth = 0;
+	s_startup_phases.push_back( phase );
+	return s_startup_phases.back();
+}
+
+void startup_trace_init()
+{
+	const char *file = getenv( STARTUP_TRACE_VAR );
+	if( ! file || ! *file )
+		return;
+
+	s_startup_trace_file = strdup( file );
+	s_startup_start = get_time();
+
+	/* Only this fish is traced, not the ones it starts */
+	unsetenv( STARTUP_TRACE_VAR );
+}
+
+void startup_trace_finish( const char *name )
+{
+	if( ! s_startup_trace_file )
+		return;
+
+	long long now = get_time();
+	std::string out;
+	char buff[128];
+	for( size_t i=0; i<s_startup_phases.size(); i++ )
+	{
+		const startup_phase_t &phase = s_startup_phases.at( i );
+		snprintf( buff, sizeof buff, "%s %lld\n", phase.name, phase.total );
+		out.append( buff );
+	}
+	snprintf( buff, sizeof buff, "%s %lld\n", name, now - s_startup_start );
+	out.append( buff );
+
+	int fd = open( s_startup_trace_file, O_WRONLY | O_APPEND | O_CREAT, 0644 );
+	if( fd == -1 || write_loop( fd, out.data(), out.size() ) != (ssize_t)out.size() )
+	{
+		debug( 1, _( L"Could not write startup trace to '%s'" ), s_startup_trace_file );
+	}
+	if( fd != -1 )
+		close( fd );
+
+	free( s_startup_trace_file );
+	s_startup_trace_file = NULL;
+	s_startup_phases.clear();
+}
+
+startup_trace_scope_t::startup_trace_scope_t( const char *n ) : name( NULL ), start( 0 )
+{
+	if( ! s_startup_trace_file )
+		return;
+
+	name = n;
+	if( startup_get_phase( name ).depth++ == 0 )
+		start = get_time();
+}
+
+startup_trace_scope_t::~startup_trace_scope_t()
+{
+	if( ! name || ! s_startup_trace_file )
+		return;
+
+	/* Only the outermost scope of a phase is measured */
+	startup_phase_t &phase = startup_get_phase( name );
+	if( --phase.depth == 0 )
+		phase.total += get_time() - start;
+}
+
+/** The file that the exit stats are written to, or NULL if they aren't wanted */
+static char *s_exit_stats_file = NULL;
+
+/** When exit_stats_init was called */
+static long long s_exit_stats_start;
+
+/**
+   Returns the user and system time in a struct rusage in microseconds
+*/
+static long long rusage_cpu_time( const struct rusage &usage )
+{
+	return 1000000ll*( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+void exit_stats_init()
+{
+	const char *file = getenv( EXIT_STATS_VAR );
+	if( ! file || ! *file )
+		return;
+
+	s_exit_stats_file = strdup( file );
+	s_exit_stats_start = get_time();
+
+	/* Only this fish is measured, not the ones it starts */
+	unsetenv( EXIT_STATS_VAR );
+}
+
+void exit_stats_finish()
+{
+	if( ! s_exit_stats_file )
+		return;
+
+	struct rusage self, children;
+	getrusage( RUSAGE_SELF, &self );
+	getrusage( RUSAGE_CHILDREN, &children );
+
+	char buff[512];
+	snprintf( buff, sizeof buff,
+			  "wall %lld\ncpu %lld\nchild_cpu %lld\nforks %d\nmaxrss %ld\n",
+			  get_time() - s_exit_stats_start,
+			  rusage_cpu_time( self ),
+			  rusage_cpu_time( children ),
+			  g_fork_count,
+			  (long)self.ru_maxrss );
+
+	int fd = open( s_exit_stats_file, O_WRONLY | O_APPEND | O_CREAT, 0644 );
+	if( fd == -1 || write_loop( fd, buff, strlen( buff ) ) != (ssize_t)strlen( buff ) )
+	{
+		debug( 1, _( L"Could not write exit stats to '%s'" ), s_exit_stats_file );
+	}
+	if( fd != -1 )
+		close( fd );
+
+	free( s_exit_stats_file );
+	s_exit_stats_file = NULL;
+}
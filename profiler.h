@@ -0,0 +1,171 @@
+/** \file profiler.h
+
+	Profiling of fish scripts. While it is enabled, the profiler
+	records how long every job and every function call takes. It keeps
+	totals per function and per source line, the self time of every
+	stack of jobs, and the last few jobs that were run, so that the
+	memory it uses stays bounded however long fish runs.
+
+	The profiler is enabled by the --profile switch, which writes a
+	report when fish exits, and by the profile builtin.
+
+	Startup tracing is separate from the profiler. When the environment
+	variable FISH_STARTUP_TRACE names a file, fish appends to it how
+	long each phase of startup took, one <tt>NAME MICROSECONDS</tt> line
+	per phase, followed by a line for the time from the start of fish
+	to its first prompt, or to its exit if it never shows one. The
+	variable is not passed on to the programs fish runs. This is what
+	<tt>make bench-startup</tt> reads.
+
+	Similarly, when FISH_EXIT_STATS names a file, fish appends to it
+	what it used in total when it exits: the wall time, the CPU time of
+	fish and of the children it waited for in microseconds, the number
+	of forks and the peak resident set size as reported by getrusage.
+	This is what <tt>make bench-scripts</tt> reads.
+*/
+
+#ifndef FISH_PROFILER_H
+#define FISH_PROFILER_H
+
+#include "common.h"
+
+/**
+   Returns whether the profiler is enabled
+*/
+bool profiler_is_enabled();
+
+/**
+   Enables or disables the profiler. Jobs and function calls that are
+   running when the profiler is disabled are still recorded once they
+   finish.
+*/
+void profiler_set_enabled( bool enabled );
+
+/**
+   Forgets everything the profiler has recorded
+*/
+void profiler_reset();
+
+/**
+   Measures a job for the profiler, from before it is parsed until it
+   has been executed. Create one on the stack when starting to parse a
+   job; it does nothing if the profiler is disabled.
+*/
+class profile_job_scope_t
+{
+	/** Whether a frame was pushed for the job */
+	bool pushed;
+
+	/* No copying */
+	profile_job_scope_t( const profile_job_scope_t & );
+	void operator=( const profile_job_scope_t & );
+
+	public:
+
+	profile_job_scope_t();
+
+	/**
+	   Tells the profiler which job is being measured. This should be
+	   called once the job has been parsed, right before it is
+	   executed. Jobs for which it isn't called, like skipped ones, are
+	   not recorded.
+
+	   \param cmd the source text of the job
+	   \param name the name of the first command of the job
+	   \param filename the file the job is in, or NULL
+	   \param lineno the line number of the job
+	*/
+	void set_job( const wchar_t *cmd, const wchar_t *name, const wchar_t *filename, int lineno );
+
+	~profile_job_scope_t();
+};
+
+/**
+   Measures a function call for the profiler. Create one on the stack
+   around the evaluation of the function body.
+*/
+class profile_function_scope_t
+{
+	/** Whether a frame was pushed for the function call */
+	bool pushed;
+
+	/* No copying */
+	profile_function_scope_t( const profile_function_scope_t & );
+	void operator=( const profile_function_scope_t & );
+
+	public:
+
+	profile_function_scope_t( const wchar_t *name );
+	~profile_function_scope_t();
+};
+
+/**
+   Appends the totals per function and per source line, sorted by
+   total time, to out. Times are in microseconds.
+*/
+void profiler_write_report( wcstring &out );
+
+/**
+   Appends the self time of every stack of jobs to out, in the folded
+   format that flamegraph tools read: the frames separated by
+   semicolons, followed by the time in microseconds.
+*/
+void profiler_write_folded( wcstring &out );
+
+/**
+   Appends the last jobs that were run to out, in the order they were
+   started, indented by how deeply they were nested.
+*/
+void profiler_write_recent( wcstring &out );
+
+/**
+   Starts tracing startup if FISH_STARTUP_TRACE is set. This should be
+   called as early as possible, since it is where the time is counted
+   from.
+*/
+void startup_trace_init();
+
+/**
+   Records the time since startup_trace_init was called under the
+   specified name, writes the trace and stops tracing. Does nothing if
+   startup isn't being traced, or is no longer being traced.
+*/
+void startup_trace_finish( const char *name );
+
+/**
+   Starts measuring the resources fish uses if FISH_EXIT_STATS is set.
+   Like startup_trace_init, this should be called as early as possible.
+*/
+void exit_stats_init();
+
+/**
+   Writes the resources fish has used since exit_stats_init was called,
+   if FISH_EXIT_STATS was set. This should be called just before fish
+   exits.
+*/
+void exit_stats_finish();
+
+/**
+   Measures a phase of startup. The time spent in every scope with the
+   same name is added up, except for scopes nested in another one of
+   the same name, and only while startup is being traced.
+*/
+class startup_trace_scope_t
+{
+	/** The phase, or NULL if startup wasn't being traced */
+	const char *name;
+
+	/** When the scope was entered */
+	long long start;
+
+	/* No copying */
+	startup_trace_scope_t( const startup_trace_scope_t & );
+	void operator=( const startup_trace_scope_t & );
+
+	public:
+
+	startup_trace_scope_t( const char *name );
+	~startup_trace_scope_t();
+};
+
+#endif
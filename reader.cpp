@@ -29,6 +29,7 @@ commence.
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_SYS_TERMIOS_H
 #include <sys/termios.h>
@@ -76,6 +77,7 @@ commence.
 #include <wchar.h>
 
 #include <assert.h>
+#include <tr1/memory>
 
 
 #include "fallback.h"
@@ -104,6 +106,11 @@ commence.
 #include "iothread.h"
 #include "intern.h"
 #include "path.h"
+#include "profiler.h"
+#include "trace.h"
+#include "pager.h"
+#include "postfork.h"
+#include "env_universal.h"
 
 #include "parse_util.h"
 
@@ -125,6 +132,19 @@ commence.
  */
 #define PROMPT_FUNCTION_NAME L"fish_prompt"
 
+/**
+   The variable that makes the prompt be reused while the working
+   directory, the exit status, the terminal width and the variables it
+   names are unchanged
+*/
+#define PROMPT_CACHE_VAR L"fish_prompt_cache"
+
+/**
+   The variable that makes the prompt be evaluated in the background,
+   while the previous prompt is shown
+*/
+#define PROMPT_ASYNC_VAR L"fish_prompt_async"
+
 /**
    The default title for the reader. This is used by reader_readline.
 */
@@ -138,6 +158,12 @@ commence.
 */
 #define READAHEAD_MAX 256
 
+/**
+   The number of milliseconds to wait for a completion to expand its
+   files before showing the completions that have been found so far
+*/
+#define COMPLETE_LATENCY_BUDGET 100
+
 /**
    A mode for calling the reader_kill function. In this mode, the new
    string is appended to the current contents of the kill buffer.
@@ -175,7 +201,7 @@ commence.
 #define SEARCH_FORWARD 1
 
 /* Any time the contents of a buffer changes, we update the generation count. This allows for our background highlighting thread to notice it and skip doing work that it would otherwise have to do. */
-static unsigned int s_generation_count;
+static volatile unsigned int s_generation_count;
 
 /* A color is an int */
 typedef int color_t;
@@ -185,6 +211,8 @@ typedef int color_t;
    states can be stacked, in case reader_readline() calls are
    nested. This happens when the 'read' builtin is used.
 */
+struct prompt_request_t;
+
 class reader_data_t
 {
     public:
@@ -236,6 +264,15 @@ class reader_data_t
     /** Do what we need to do whenever our command line changes */
     void command_line_changed(void);
 
+    /** Returns an immutable copy of the command line for background requests. Requests made before the command line changes again share the same copy. */
+    std::tr1::shared_ptr<const wcstring> command_line_snapshot(void);
+
+    private:
+    /** The copy returned by command_line_snapshot, or empty if the command line has changed since */
+    std::tr1::shared_ptr<const wcstring> snapshot;
+
+    public:
+
 	/** The current position of the cursor in buff. */
 	size_t buff_pos;
 
@@ -247,6 +284,24 @@ class reader_data_t
 
 	/** The output of the last evaluation of the prompt command */
 	wcstring prompt_buff;
+
+	/** The output of the title function at the last evaluation of the prompt command */
+	wcstring title_buff;
+
+	/** Whether the terminal title was set at the last evaluation of the prompt command */
+	bool has_title;
+
+	/** What prompt_buff was made from, or empty if it can't be reused */
+	wcstring prompt_cache_key;
+
+	/** The evaluation of the prompt that is running in the background, or 0 */
+	prompt_request_t *prompt_request;
+
+	/** Whether the prompt should be evaluated again once prompt_request is done */
+	bool prompt_rerun;
+
+	/** Whether prompt_request landed, so the title and the prompt should be redrawn */
+	bool prompt_landed;
 	
 	/**
 	   Color is the syntax highlighting for buff.  The format is that
@@ -306,6 +361,12 @@ class reader_data_t
     
     /** Whether the a screen reset is needed after a repaint. */
     bool screen_reset_needed;
+
+    /** The value of parser_t::eval_count() at the last repaint */
+    unsigned long repaint_eval_count;
+
+    /** Whether there were jobs at the last repaint */
+    bool repaint_had_jobs;
 };
 
 /**
@@ -351,6 +412,7 @@ static int interrupted=0;
 static struct termios saved_modes;
 
 static void reader_super_highlight_me_plenty( int pos );
+static void prewarm_completions();
 
 /**
    Variable to keep track of forced exits - see \c reader_exit_forced();
@@ -358,13 +420,35 @@ static void reader_super_highlight_me_plenty( int pos );
 static int exit_forced;
 
 
+/**
+   Set while reader_run_command runs a command that has not been given
+   the terminal yet, see reader_donate_terminal()
+*/
+static bool term_donate_pending = false;
+
+/**
+   Set when reader_run_command has given the terminal to the command
+   it runs
+*/
+static bool term_donated = false;
+
+/**
+   Returns whether two sets of terminal modes are the same
+*/
+static bool term_modes_equal( const struct termios &a, const struct termios &b )
+{
+	return a.c_iflag == b.c_iflag &&
+		a.c_oflag == b.c_oflag &&
+		a.c_cflag == b.c_cflag &&
+		a.c_lflag == b.c_lflag &&
+		! memcmp( a.c_cc, b.c_cc, sizeof a.c_cc );
+}
+
 /**
    Give up control of terminal
 */
 static void term_donate()
 {
-	set_color(rgb_color_t::normal(), rgb_color_t::normal());
-
 	while( 1 )
 	{
 		if(	tcsetattr(0,TCSANOW,&saved_modes) )
@@ -408,6 +492,17 @@ static void term_steal()
 
 }
 
+bool reader_donate_terminal()
+{
+	if( ! term_donate_pending )
+		return false;
+
+	term_donate_pending = false;
+	term_donated = true;
+	term_donate();
+	return true;
+}
+
 int reader_exit_forced()
 {
 	return exit_forced;
@@ -442,6 +537,18 @@ static void reader_repaint()
     std::vector<int> indents = data->indents;
     indents.resize(len);
 
+	/*
+	  Only jobs and the code that fish runs write to the screen behind
+	  the back of s_write, so it need not look for their output if
+	  there were neither since the last repaint. Jobs are only started
+	  by code that fish runs.
+	*/
+	const unsigned long eval_count = parser_t::eval_count();
+	const bool has_jobs = ! job_list_is_empty();
+	data->screen.skip_status_check = ! has_jobs && ! data->repaint_had_jobs && eval_count == data->repaint_eval_count;
+	data->repaint_eval_count = eval_count;
+	data->repaint_had_jobs = has_jobs;
+
 	s_write( &data->screen,
 		 data->prompt_buff.c_str(),
 		 full_line.c_str(),
@@ -535,6 +642,17 @@ void reader_data_t::command_line_changed() {
     
     /* Update the gen count */
     s_generation_count++;
+    
+    /* Background requests made from now on need a new copy */
+    snapshot.reset();
+}
+
+std::tr1::shared_ptr<const wcstring> reader_data_t::command_line_snapshot() {
+    ASSERT_IS_MAIN_THREAD();
+    if (! snapshot) {
+        snapshot.reset(new wcstring(command_line));
+    }
+    return snapshot;
 }
 
 
@@ -552,11 +670,17 @@ int reader_interrupted()
 	return res;
 }
 
-void reader_write_title()
+/**
+   Runs the title function, and returns what it printed. Returns false
+   if the terminal is not believed to support setting the title.
+*/
+static bool exec_title( wcstring &title_out )
 {
 	const wchar_t *title;
 	const env_var_t term_str = env_get_string( L"TERM" );
 
+	title_out.clear();
+
 	/*
 	  This is a pretty lame heuristic for detecting terminals that do
 	  not support setting the title. If we recognise the terminal name
@@ -572,7 +696,7 @@ void reader_write_title()
 	  there is no way to fix this.
 	*/
 	if ( term_str.missing() )
-		return;
+		return false;
 
 	const wchar_t *term = term_str.c_str();
     bool recognized = false;
@@ -586,11 +710,11 @@ void reader_write_title()
 
 		if( contains( term, L"linux" ) )
 		{
-			return;
+			return false;
 		}
 
 		if( strstr( n, "tty" ) || strstr( n, "/vc/") )
-			return;
+			return false;
 		
 			
 	}
@@ -598,35 +722,80 @@ void reader_write_title()
 	title = function_exists( L"fish_title" )?L"fish_title":DEFAULT_TITLE;
 
 	if( wcslen( title ) ==0 )
-		return;
+		return false;
 
     wcstring_list_t lst;
 
 	proc_push_interactive(0);
 	if( exec_subshell( title, lst ) != -1 )
 	{
-		size_t i;
-		if( lst.size() > 0 )
+		for( size_t i=0; i<lst.size(); i++ )
 		{
-			writestr( L"\x1b];" );
-			for( i=0; i<lst.size(); i++ )
-			{
-				writestr( lst.at(i).c_str() );
-			}
-			writestr( L"\7" );
+			title_out.append( lst.at(i) );
 		}
 	}
 	proc_pop_interactive();		
+	return true;
+}
+
+/**
+   Sets the terminal title to the specified output of the title function
+*/
+static void write_title( const wcstring &title )
+{
+	if( ! title.empty() )
+	{
+		writestr( L"\x1b];" );
+		writestr( title.c_str() );
+		writestr( L"\7" );
+	}
 	set_color( rgb_color_t::reset(), rgb_color_t::reset() );
 }
 
+void reader_write_title()
+{
+	wcstring title;
+	if( exec_title( title ) )
+		write_title( title );
+}
+
 /**
-   Reexecute the prompt command. The output is inserted into data->prompt_buff.
+   Returns what the prompt depends on when it is cached, or an empty
+   string if it isn't
 */
-static void exec_prompt()
+static wcstring get_prompt_cache_key()
 {
-	size_t i;
+	wcstring key;
+	const env_var_t deps = env_get_string( PROMPT_CACHE_VAR );
+	if( deps.missing() || data->prompt.empty() )
+		return key;
 
+	const env_var_t pwd = env_get_string( L"PWD" );
+	append_format( key, L"%ls\n%d\n%d\n%ls", data->prompt.c_str(), proc_get_last_status(), common_get_width(), pwd.missing() ? L"" : pwd.c_str() );
+
+	wcstring_list_t names;
+	tokenize_variable_array( deps, names );
+	for( size_t i=0; i<names.size(); i++ )
+	{
+		const env_var_t val = env_get_string( names.at( i ) );
+		key.push_back( L'\n' );
+		key.append( names.at( i ) );
+		if( ! val.missing() )
+		{
+			key.push_back( L'=' );
+			key.append( val );
+		}
+	}
+	return key;
+}
+
+/**
+   Runs the prompt command and the title function, and stores what
+   they printed in prompt_out and title_out. Returns whether a title
+   should be set.
+*/
+static bool run_prompt( wcstring &prompt_out, wcstring &title_out )
+{
     wcstring_list_t prompt_list;
 	
 	if( data->prompt.size() )
@@ -641,15 +810,197 @@ static void exec_prompt()
 		proc_pop_interactive();
 	}
 	
-	reader_write_title();
-	
-    data->prompt_buff.clear();
+	const bool has_title = exec_title( title_out );
 	
-	for( i = 0; i < prompt_list.size(); i++ )
+    prompt_out.clear();
+	for( size_t i = 0; i < prompt_list.size(); i++ )
 	{
-        if (i > 0) data->prompt_buff += L'\n';
-        data->prompt_buff += prompt_list.at(i);
+        if (i > 0) prompt_out += L'\n';
+        prompt_out += prompt_list.at(i);
 	}	
+	return has_title;
+}
+
+/**
+   An evaluation of the prompt in a child process. The output of the
+   child is read by a background thread.
+*/
+struct prompt_request_t
+{
+	/** The reader that the prompt is for */
+	reader_data_t *reader;
+
+	/** What the prompt depends on, as returned by get_prompt_cache_key */
+	wcstring key;
+
+	/** The pipe that the child writes to */
+	int fd;
+
+	/** What the child wrote */
+	std::string output;
+
+	/** Set if the result is no longer wanted */
+	bool cancelled;
+};
+
+/**
+   Reads the output of a prompt child until it exits. Runs on a
+   background thread.
+*/
+static int threaded_read_prompt( prompt_request_t *req )
+{
+	char buff[4096];
+	while( 1 )
+	{
+		ssize_t len = read( req->fd, buff, sizeof buff );
+		if( len > 0 )
+		{
+			req->output.append( buff, len );
+		}
+		else if( len == 0 || errno != EINTR )
+		{
+			break;
+		}
+	}
+	close( req->fd );
+	return 0;
+}
+
+/**
+   Stores the output of a prompt child in the reader it was made for,
+   unless something else was asked for in the meantime. The title and
+   the prompt are redrawn by reader_repaint_if_needed, so that this
+   doesn't write to the terminal while a command is running. Runs on
+   the main thread.
+*/
+static void async_prompt_done( prompt_request_t *req, int ret )
+{
+	/* The prompt is terminated by a null character, so a child that died before it was done doesn't count */
+	const size_t sep = req->output.find( '\0' );
+	if( ! req->cancelled && req->reader == data && sep != std::string::npos && sep + 1 < req->output.size() )
+	{
+		data->prompt_buff = str2wcstring( req->output.data(), sep );
+		data->has_title = req->output.at( sep + 1 ) == '1';
+		data->title_buff = str2wcstring( req->output.data() + sep + 2, req->output.size() - sep - 2 );
+		data->prompt_cache_key = req->key;
+		data->prompt_landed = true;
+		data->repaint_needed = true;
+	}
+
+	if( ! req->cancelled && req->reader == data )
+		data->prompt_request = 0;
+	delete req;
+}
+
+/**
+   Evaluates the prompt in a child process, and shows the previous
+   prompt until it is done. Returns false if the child can't be
+   started.
+*/
+static bool start_async_prompt( const wcstring &key )
+{
+	int fd[2];
+	if( exec_pipe( fd ) == -1 )
+		return false;
+
+	pid_t pid = execute_fork( true );
+	if( pid == -1 )
+	{
+		exec_close( fd[0] );
+		exec_close( fd[1] );
+		return false;
+	}
+
+	if( pid == 0 )
+	{
+		/*
+		  The child keeps running fish code. It gets a process group
+		  of its own so that ^C doesn't stop it, no terminal, and no
+		  connection to fishd, so that it doesn't read the messages
+		  meant for the shell.
+		*/
+		setup_fork_guards();
+		setpgid( 0, 0 );
+		exec_close( fd[0] );
+
+		int null_fd = open( "/dev/null", O_RDWR );
+		if( null_fd != -1 )
+		{
+			dup2( null_fd, 0 );
+			dup2( null_fd, 1 );
+			dup2( null_fd, 2 );
+			if( null_fd > 2 )
+				close( null_fd );
+		}
+		if( env_universal_server.fd >= 0 )
+		{
+			close( env_universal_server.fd );
+			env_universal_server.fd = -1;
+		}
+
+		wcstring prompt, title;
+		const bool has_title = run_prompt( prompt, title );
+
+		std::string out = wcs2string( prompt );
+		out.push_back( '\0' );
+		out.push_back( has_title ? '1' : '0' );
+		out.append( wcs2string( title ) );
+		write_loop( fd[1], out.data(), out.size() );
+		exit_without_destructors( 0 );
+	}
+
+	exec_close( fd[1] );
+
+	prompt_request_t *req = new prompt_request_t();
+	req->reader = data;
+	req->key = key;
+	req->fd = fd[0];
+	req->cancelled = false;
+	data->prompt_request = req;
+	iothread_perform( threaded_read_prompt, async_prompt_done, req );
+	return true;
+}
+
+/**
+   Reexecute the prompt command. The output is inserted into
+   data->prompt_buff. The previous output is reused if the variables
+   named by fish_prompt_cache say it is still good, and the previous
+   prompt is shown while the new one is evaluated in the background if
+   fish_prompt_async is set.
+*/
+static void exec_prompt()
+{
+	TRACE_SCOPE( "exec_prompt" );
+
+	const wcstring key = get_prompt_cache_key();
+	if( ! key.empty() && key == data->prompt_cache_key )
+	{
+		/* A command may have changed the title */
+		if( data->has_title )
+			write_title( data->title_buff );
+		return;
+	}
+
+	if( data->prompt_request )
+	{
+		/* Once the running evaluation is done, another one is needed unless it is for the same state */
+		if( key.empty() || key != data->prompt_request->key )
+			data->prompt_rerun = true;
+		return;
+	}
+
+	data->prompt_rerun = false;
+	if( ! data->prompt_buff.empty() && ! env_get_string( PROMPT_ASYNC_VAR ).missing() && start_async_prompt( key ) )
+	{
+		if( data->has_title )
+			write_title( data->title_buff );
+		return;
+	}
+
+	data->has_title = run_prompt( data->prompt_buff, data->title_buff );
+	if( data->has_title )
+		write_title( data->title_buff );
+	data->prompt_cache_key = key;
 }
 
 void reader_init()
@@ -701,6 +1052,18 @@ void reader_repaint_needed()
 }
 
 void reader_repaint_if_needed() {
+    if (data && data->prompt_landed) {
+        data->prompt_landed = false;
+        if (data->has_title)
+            write_title(data->title_buff);
+        data->repaint_needed = true;
+    }
+
+    if (data && data->prompt_rerun && ! data->prompt_request) {
+        exec_prompt();
+        data->repaint_needed = true;
+    }
+
     if (data && data->screen_reset_needed) {
         s_reset( &data->screen, false);
         data->screen_reset_needed = false;
@@ -737,7 +1100,8 @@ static void remove_backward()
 
 	reader_super_highlight_me_plenty( data->buff_pos );
 
-	reader_repaint();
+	/* Repaint once all pending input has been handled */
+	reader_repaint_needed();
 
 }
 
@@ -760,7 +1124,8 @@ static int insert_string(const wcstring &str)
 	/* Syntax highlight  */
 	reader_super_highlight_me_plenty( data->buff_pos-1 );
 	
-	reader_repaint();
+	/* Repaint once all pending input has been handled, so that pasting a long command repaints it once */
+	reader_repaint_needed();
 	return 1;
 }
 
@@ -1063,43 +1428,22 @@ static void completion_insert( const wchar_t *val, int flags )
 }
 
 /**
-   Run the fish_pager command to display the completion list. If the
-   fish_pager outputs any text, it is inserted into the input
-   backbuffer.
+   Display the completion list in the pager. If the user leaves the
+   pager by pressing a key, it is inserted into the input backbuffer.
 
    \param prefix the string to display before every completion. 
-   \param is_quoted should be set if the argument is quoted. This will change the display style.
    \param comp the list of completions to display
+   \return whether the user left the pager by pressing a key
 */
 
-static void run_pager( const wcstring &prefix, int is_quoted, const std::vector<completion_t> &comp )
+static bool run_pager( const wcstring &prefix, const std::vector<completion_t> &comp )
 {
-    wcstring msg;
-	wcstring prefix_esc;
-	char *foo;
-	io_data_t *in;
-	wchar_t *escaped_separator;
 	int has_case_sensitive=0;
+	bool has_fuzzy = false;
+	int base_len=-1;
+	std::vector<completion_t> shown;
+	rgb_color_t colors[PAGER_COLOR_COUNT];
 
-	if (prefix.empty())
-	{
-		prefix_esc = L"\"\"";
-	}
-	else
-	{
-		prefix_esc = escape_string(prefix, 1);
-	}
-	
-    wcstring cmd = format_string(L"fish_pager -c 3 -r 4 %ls -p %ls",
-                                 // L"valgrind --track-fds=yes --log-file=pager.txt --leak-check=full ./fish_pager %d %ls",
-                                is_quoted?L"-q":L"",
-                                prefix_esc.c_str() );
-    
-	in= io_buffer_create( 1 );
-	in->fd = 3;
-
-	escaped_separator = escape( COMPLETE_SEP_STR, 1);
-	
 	for( size_t i=0; i< comp.size(); i++ )
 	{
 		const completion_t &el = comp.at( i );
@@ -1108,13 +1452,8 @@ static void run_pager( const wcstring &prefix, int is_quoted, const std::vector<
 	
 	for( size_t i=0; i< comp.size(); i++ )
 	{
-
-		int base_len=-1;
 		const completion_t &el = comp.at( i );
 
-		wchar_t *foo=0;
-		wchar_t *baz=0;
-
 		if( has_case_sensitive && (el.flags & COMPLETE_NO_CASE ))
 		{
 			continue;
@@ -1124,155 +1463,201 @@ static void run_pager( const wcstring &prefix, int is_quoted, const std::vector<
 			continue;
 		}
 		
-		if( el.flags & COMPLETE_NO_CASE )
-		  {
-		    if( base_len == -1 )
-            {
-                const wchar_t *begin, *buff = data->command_line.c_str();
-                
-                parse_util_token_extent( buff, data->buff_pos, &begin, 0, 0, 0 );
-                base_len = data->buff_pos - (begin-buff);
-            }
-								
-		    wcstring foo_wstr = escape_string( el.completion.c_str() + base_len, ESCAPE_ALL | ESCAPE_NO_QUOTED );
-		    foo = wcsdup(foo_wstr.c_str());
-		  }
-		else
-        {
-		    wcstring foo_wstr = escape_string( el.completion, ESCAPE_ALL | ESCAPE_NO_QUOTED );
-		    foo = wcsdup(foo_wstr.c_str());
-        }
-		
-	
-		if( !el.description.empty() )
-		{
-			wcstring baz_wstr = escape_string( el.description, 1 );
-			baz = wcsdup(baz_wstr.c_str());
-		}
-		
-		if( !foo )
+		if( el.flags & COMPLETE_FUZZY )
 		{
-			debug( 0, L"Run pager called with bad argument." );
-			bugreport();
-			show_stackframe();
+			/* Show the whole completion, since it doesn't start with the token */
+			shown.push_back( completion_t( el.completion, el.description ) );
+			has_fuzzy = true;
 		}
-		else if( baz )
+		else if( el.flags & COMPLETE_NO_CASE )
 		{
-			append_format(msg, L"%ls%ls%ls\n", foo, escaped_separator, baz);
+			if( base_len == -1 )
+			{
+				const wchar_t *begin, *buff = data->command_line.c_str();
+                
+				parse_util_token_extent( buff, data->buff_pos, &begin, 0, 0, 0 );
+				base_len = data->buff_pos - (begin-buff);
+			}
+			shown.push_back( completion_t( el.completion.c_str() + base_len, el.description ) );
 		}
 		else
 		{
-			append_format(msg, L"%ls\n", foo);
+			shown.push_back( completion_t( el.completion, el.description ) );
 		}
-
-		free( foo );		
-		free( baz );		
 	}
 
-	free( escaped_separator );		
-	
-	foo = wcs2str(msg.c_str());
-	in->out_buffer_append(foo, strlen(foo) );
-	free( foo );
-	
-	term_donate();
-	
-	io_data_t *out = io_buffer_create( 0 );
-	out->next = in;
-	out->fd = 4;
-	
-    parser_t &parser = parser_t::principal_parser();
-	parser.eval( cmd, out, TOP);
-	term_steal();
-
-	io_buffer_read( out );
-
-	int nil=0;
-    out->out_buffer_append((char *)&nil, 1);
+	for( int i=0; i<PAGER_COLOR_COUNT; i++ )
+	{
+		env_var_t val = env_get_string( pager_color_var[i] );
+		colors[i] = val.missing() ? rgb_color_t::normal() : parse_color( val, false );
+	}
 
-	wchar_t *tmp;
-	wchar_t *str = str2wcs(out->out_buffer_ptr());
+	const wcstring keys = pager_show( shown, has_fuzzy ? wcstring() : prefix, colors );
 
-	if( str )
+	for( size_t i=keys.size(); i>0; i-- )
 	{
-		for( tmp = str + wcslen(str)-1; tmp >= str; tmp-- )
-		{
-			input_unreadch( *tmp );
-		}
-		free( str );
+		input_unreadch( keys.at( i-1 ) );
 	}
+	return ! keys.empty();
+}
 
+/** Number of seconds for which the autosuggestion cache may be extended before its path results are thrown away */
+#define AUTOSUGGESTION_CACHE_SECONDS 5
 
-	io_buffer_destroy( out);
-	io_buffer_destroy( in);
-}
+/**
+   What earlier autosuggestion searches learned, so that the search for a longer command line can resume instead of scanning history again. Every item that starts with a longer command line also starts with the shorter one, so the items the shorter search rejected need not be looked at again.
+*/
+struct autosuggestion_cache_t {
+    /** The history that was searched, and how many items it had. Adding an item changes the indexes. */
+    const history_t *history;
+    size_t history_size;
+    
+    /** The working directory that paths were tested in */
+    wcstring working_directory;
+    
+    /** The command line that was searched for */
+    wcstring prefix;
+    
+    /** Every item up to and including this index that starts with prefix was rejected */
+    size_t rejected_through;
+    
+    /** Whether each tested path exists */
+    std::map<wcstring, bool> path_validity;
+    
+    /** When the path results were first collected */
+    double when;
+    
+    autosuggestion_cache_t() : history(NULL), history_size(0), rejected_through(0), when(0)
+    {
+    }
+};
+
+/** The autosuggestion cache, and the lock protecting it. The cache is used from background threads. */
+static autosuggestion_cache_t s_autosuggestion_cache;
+static pthread_mutex_t s_autosuggestion_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 struct autosuggestion_context_t {
-    wcstring search_string;
+    /** The command line, shared with other requests made for it */
+    const std::tr1::shared_ptr<const wcstring> command_line;
+    const wcstring &search_string;
     wcstring autosuggestion;
     size_t cursor_pos;
+    history_t * const history;
     history_search_t searcher;
-    file_detection_context_t detector;
     const wcstring working_directory;
     const env_vars vars;
     wcstring_list_t commands_to_load;
-    const unsigned int generation_count;
+    const generation_token_t generation;
     
     // don't reload more than once
     bool has_tried_reloading;
     
-    autosuggestion_context_t(history_t *history, const wcstring &term, size_t pos) :
-        search_string(term),
+    autosuggestion_context_t(history_t *history, const std::tr1::shared_ptr<const wcstring> &term, size_t pos) :
+        command_line(term),
+        search_string(*term),
         cursor_pos(pos),
-        searcher(*history, term, HISTORY_SEARCH_TYPE_PREFIX),
-        detector(history, term),
+        history(history),
+        searcher(*history, *term, HISTORY_SEARCH_TYPE_PREFIX),
         working_directory(get_working_directory()),
         vars(env_vars::highlighting_keys),
-        generation_count(s_generation_count),
+        generation(s_generation_count),
         has_tried_reloading(false)
     {
     }
     
-    /* The function run in the background thread to determine an autosuggestion */
-    int threaded_autosuggest(void) {
-        ASSERT_IS_BACKGROUND_THREAD();
-        
-        /* If the main thread has moved on, skip all the work */
-        if (generation_count != s_generation_count) {
-            return 0;
+    /* Returns whether all the paths exist, looking in and filling the cache */
+    bool paths_are_valid(const path_list_t &paths, std::map<wcstring, bool> &path_validity) {
+        for (path_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
+            std::map<wcstring, bool>::iterator known = path_validity.find(*iter);
+            if (known == path_validity.end())
+                known = path_validity.insert(std::make_pair(*iter, path_is_valid(*iter, working_directory))).first;
+            if (! known->second)
+                return false;
         }
-        
-        /* Let's make sure we aren't using the empty string */
-        if (search_string.empty()) {
-            return 0;
+        return true;
+    }
+    
+    /* Searches history for a valid item, resuming where an earlier search for a prefix of the command line stopped */
+    bool search_history(void) {
+        const size_t history_size = history->size();
+        std::map<wcstring, bool> path_validity;
+        size_t rejected_through = 0;
+        double when = timef();
+        {
+            scoped_lock locker(s_autosuggestion_cache_lock);
+            const autosuggestion_cache_t &cache = s_autosuggestion_cache;
+            if (cache.history == history && cache.history_size == history_size &&
+                cache.working_directory == working_directory &&
+                string_prefixes_string(cache.prefix, search_string) &&
+                when - cache.when < AUTOSUGGESTION_CACHE_SECONDS) {
+                path_validity = cache.path_validity;
+                rejected_through = cache.rejected_through;
+                when = cache.when;
+            }
         }
         
+        searcher.skip_items_through(rejected_through);
+        bool found = false;
         while (searcher.go_backwards()) {
-            history_item_t item = searcher.current_item();
+            /* Validating history items stats their paths, which may be slow, so check between items whether the main thread has moved on */
+            if (generation.is_stale())
+                break;
             
-            /* Skip items with newlines because they make terrible autosuggestions */
-            if (item.str().find('\n') != wcstring::npos)
-                continue;
+            history_item_t item = searcher.current_item();
             
             bool item_ok = false;
-            if (autosuggest_special_validate_from_history(item.str(), working_directory, &item_ok)) {
+            if (item.str().find('\n') != wcstring::npos) {
+                /* Skip items with newlines because they make terrible autosuggestions */
+            } else if (autosuggest_special_validate_from_history(item.str(), working_directory, &item_ok)) {
                 /* The command autosuggestion was handled specially, so we're done */
             } else {
                 /* See if the item has any required paths */
-                const path_list_t &paths = item.get_required_paths();
-                if (paths.empty()) {
-                    item_ok = true;
-                } else {
-                    detector.potential_paths = paths;
-                    item_ok = detector.paths_are_valid(paths);
-                }
+                item_ok = paths_are_valid(item.get_required_paths(), path_validity);
             }
             if (item_ok) {
                 this->autosuggestion = searcher.current_string();
-                return 1;
+                found = true;
+                break;
             }
+            rejected_through = searcher.current_index();
         }
         
+        /* If we got through all of history, everything was rejected */
+        if (! found && ! generation.is_stale())
+            rejected_through = history_size;
+        
+        scoped_lock locker(s_autosuggestion_cache_lock);
+        autosuggestion_cache_t &cache = s_autosuggestion_cache;
+        cache.history = history;
+        cache.history_size = history_size;
+        cache.working_directory = working_directory;
+        cache.prefix = search_string;
+        cache.rejected_through = rejected_through;
+        cache.path_validity.swap(path_validity);
+        cache.when = when;
+        return found;
+    }
+    
+    /* The function run in the background thread to determine an autosuggestion */
+    int threaded_autosuggest(void) {
+        ASSERT_IS_BACKGROUND_THREAD();
+        
+        /* If the main thread has moved on, skip all the work */
+        if (generation.is_stale()) {
+            return 0;
+        }
+        
+        /* Let's make sure we aren't using the empty string */
+        if (search_string.empty()) {
+            return 0;
+        }
+        
+        if (search_history())
+            return 1;
+        
+        if (generation.is_stale())
+            return 0;
+        
         /* Try handling a special command like cd */
         wcstring special_suggestion;
         if (autosuggest_suggest_special(search_string, working_directory, special_suggestion)) {
@@ -1289,6 +1674,9 @@ struct autosuggestion_context_t {
         if (line_ends_with_space && ! cursor_at_end)
             return 0;
 
+        if (generation.is_stale())
+            return 0;
+
         /* Try normal completions */
         std::vector<completion_t> completions;
         complete(search_string, completions, COMPLETE_AUTOSUGGEST, &this->commands_to_load);
@@ -1317,6 +1705,12 @@ static bool can_autosuggest(void) {
 
 static void autosuggest_completed(autosuggestion_context_t *ctx, int result) {
 
+    /* A newer autosuggestion request made this one obsolete */
+    if (result == IOTHREAD_CANCELLED) {
+        delete ctx;
+        return;
+    }
+
     /* Extract the commands to load */
     wcstring_list_t commands_to_load;
     ctx->commands_to_load.swap(commands_to_load);
@@ -1329,7 +1723,7 @@ static void autosuggest_completed(autosuggestion_context_t *ctx, int result) {
         {
             complete_load(*iter, false);
         }
-        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx);
+        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx, IOTHREAD_PRIORITY_INTERACTIVE, true);
         return;
     }
     
@@ -1340,8 +1734,12 @@ static void autosuggest_completed(autosuggestion_context_t *ctx, int result) {
         /* Autosuggestion is active and the search term has not changed, so we're good to go */
         data->autosuggestion = ctx->autosuggestion;
         sanity_check();
-        reader_repaint();
+        reader_repaint_needed();
     }
+    
+    /* The command line is idle until the user types again, so get ready for them pressing tab */
+    if (ctx->search_string == data->command_line)
+        prewarm_completions();
     delete ctx;
 }
 
@@ -1360,8 +1758,8 @@ static void update_autosuggestion(void) {
 #else
     data->autosuggestion.clear();
     if (! data->suppress_autosuggestion && ! data->command_line.empty() && data->history_search.is_at_end()) {
-        autosuggestion_context_t *ctx = new autosuggestion_context_t(data->history, data->command_line, data->buff_pos);
-        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx);
+        autosuggestion_context_t *ctx = new autosuggestion_context_t(data->history, data->command_line_snapshot(), data->buff_pos);
+        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx, IOTHREAD_PRIORITY_INTERACTIVE, true);
     }
 #endif
 }
@@ -1425,7 +1823,46 @@ static int reader_can_replace( const wcstring &in, int flags )
 		str++;
 	}
 
-	return 1;
+	return 1;
+}
+
+/**
+   Print the list of completions of the token under the cursor below
+   the command line, and repaint the command line after it.
+
+   \return whether the user left the pager by pressing a key
+*/
+static bool show_completion_list( const std::vector<completion_t> &comp )
+{
+	int len;
+	wcstring prefix;
+	const wchar_t * prefix_start;
+    const wchar_t *buff = data->command_line.c_str();
+	get_param( buff,
+			   data->buff_pos,
+			   0,
+			   &prefix_start,
+			   0,
+			   0 );
+
+	len = &buff[data->buff_pos]-prefix_start+1;
+
+	if( len <= PREFIX_MAX_LEN )
+	{
+        prefix.append(prefix_start, len);
+	}
+	else
+	{
+        prefix = wcstring(&ellipsis_char, 1);
+        prefix.append(prefix_start + (len - PREFIX_MAX_LEN));
+	}
+
+	write_loop(1, "\n", 1 );
+
+	bool left_by_key = run_pager( prefix, comp );
+	s_reset( &data->screen, true);
+	reader_repaint();
+	return left_by_key;
 }
 
 /**
@@ -1553,7 +1990,11 @@ static int handle_completions( const std::vector<completion_t> &comp )
 				if( !(c.flags & COMPLETE_NO_CASE) )
 					continue;
 			
-				if( !reader_can_replace( tok, c.flags ) )
+				/*
+				  Fuzzy completions don't start with the token, so
+				  there is no common part to insert. Show them instead.
+				*/
+				if( (c.flags & COMPLETE_FUZZY) || !reader_can_replace( tok, c.flags ) )
 				{
 					len=0;
 					break;
@@ -1596,44 +2037,7 @@ static int handle_completions( const std::vector<completion_t> &comp )
 		  There is no common prefix in the completions, and show_list
 		  is true, so we print the list
 		*/
-		int len;
-		wcstring prefix;
-		const wchar_t * prefix_start;
-        const wchar_t *buff = data->command_line.c_str();
-		get_param( buff,
-				   data->buff_pos,
-				   0,
-				   &prefix_start,
-				   0,
-				   0 );
-
-		len = &buff[data->buff_pos]-prefix_start+1;
-
-		if( len <= PREFIX_MAX_LEN )
-		{
-            prefix.append(prefix_start, len);
-		}
-		else
-		{
-            prefix = wcstring(&ellipsis_char, 1);
-            prefix.append(prefix_start + (len - PREFIX_MAX_LEN));
-		}
-
-		{
-			int is_quoted;
-
-			wchar_t quote;
-            const wchar_t *buff = data->command_line.c_str();
-			get_param( buff, data->buff_pos, &quote, 0, 0, 0 );
-			is_quoted = (quote != L'\0');
-			
-			write_loop(1, "\n", 1 );
-			
-			run_pager( prefix, is_quoted, comp );
-		}
-		s_reset( &data->screen, true);
-		reader_repaint();
-
+		show_completion_list( comp );
 	}		
 	return len;
 	
@@ -1641,6 +2045,7 @@ static int handle_completions( const std::vector<completion_t> &comp )
 }
 
 
+
 /**
    Initialize data for interactive use
 */
@@ -2194,11 +2599,69 @@ void set_env_cmd_duration(struct timeval *after, struct timeval *before)
 	}
 }
 
+/**
+   The count of operations when the last interactive command finished
+*/
+static syscall_counts_t s_command_end_counts;
+
+/**
+   The counts of operations made by the last interactive command
+*/
+static syscall_counts_t s_last_command_counts;
+
+/**
+   The counts of operations made at the prompt before the current interactive command
+*/
+static syscall_counts_t s_at_prompt_counts;
+
+void reader_get_syscall_counts( syscall_counts_t &last_command, syscall_counts_t &at_prompt )
+{
+	last_command = s_last_command_counts;
+	at_prompt = s_at_prompt_counts;
+}
+
+/**
+   Appends the counters that are not zero to \c out, like "stat 3, fork 1"
+*/
+static void append_syscall_counts( wcstring &out, const syscall_counts_t &counts )
+{
+	bool first = true;
+	for( int i=0; i<SYSCALL_COUNTER_COUNT; i++ )
+	{
+		if( ! counts.count[i] )
+			continue;
+		append_format( out, L"%ls%ls %lu", first ? L"" : L", ", syscall_counter_name( i ), counts.count[i] );
+		first = false;
+	}
+	if( first )
+		out.append( L"none" );
+}
+
+/**
+   Prints what the command that just finished and the prompt it was
+   typed at cost, if fish_syscall_summary is set
+*/
+static void print_syscall_summary()
+{
+	if( env_get_string( L"fish_syscall_summary" ).missing() )
+		return;
+
+	wcstring out = L"syscalls: ";
+	append_syscall_counts( out, s_last_command_counts );
+	out.append( L" (prompt: " );
+	append_syscall_counts( out, s_at_prompt_counts );
+	out.append( L")\n" );
+	fwprintf( stderr, L"%ls", out.c_str() );
+}
+
 void reader_run_command( parser_t &parser, const wchar_t *cmd )
 {
+	TRACE_SCOPE( "reader_run_command" );
 
 	wchar_t *ft;
 	struct timeval time_before, time_after;
+	const syscall_counts_t counts_before = syscall_counts();
+	s_at_prompt_counts = counts_before - s_command_end_counts;
 
 	ft= tok_first( cmd );
 
@@ -2208,23 +2671,35 @@ void reader_run_command( parser_t &parser, const wchar_t *cmd )
 
 	reader_write_title();
 
-	term_donate();
+	complete_forget_conditions();
+	complete_forget_prewarmed();
+
+	set_color(rgb_color_t::normal(), rgb_color_t::normal());
+
+	/*
+	  The terminal modes are only switched once the command starts a
+	  program, because builtins and functions don't care about them
+	*/
+	term_donate_pending = true;
+	term_donated = false;
 
 	gettimeofday(&time_before, NULL);
 
 	parser.eval( cmd, 0, TOP );
 	job_reap( 1 );
+	term_donate_pending = false;
 
 	gettimeofday(&time_after, NULL);
 	set_env_cmd_duration(&time_after, &time_before);
 
-	term_steal();
+	s_command_end_counts = syscall_counts();
+	s_last_command_counts = s_command_end_counts - counts_before;
+	print_syscall_summary();
 
-	env_set( L"_", program_name, ENV_GLOBAL );
+	if( term_donated )
+		term_steal();
 
-#ifdef HAVE__PROC_SELF_STAT
-	proc_update_jiffies();
-#endif
+	env_set( L"_", program_name, ENV_GLOBAL );
 
 
 }
@@ -2298,6 +2773,10 @@ void reader_pop()
 
 	data=data->next;
 	
+	/* A prompt that is still being evaluated is not wanted any more */
+	if( n->prompt_request )
+		n->prompt_request->cancelled = true;
+
     /* Invoke the destructor to balance our new */
     delete n;
 
@@ -2337,8 +2816,11 @@ void reader_set_test_function( int (*f)( const wchar_t * ) )
 /** A class as the context pointer for a background (threaded) highlight operation. */
 class background_highlight_context_t {
 public:
+    /** The command line, shared with other requests made for it */
+	const std::tr1::shared_ptr<const wcstring> command_line;
+
     /** The string to highlight */
-	const wcstring string_to_highlight;
+	const wcstring &string_to_highlight;
 	
 	/** Color buffer */
 	std::vector<color_t> colors;
@@ -2355,22 +2837,24 @@ public:
     /** When the request was made */
     const double when;
     
-    /** Gen count at the time the request was made */
-    const unsigned int generation_count;
+    /** Goes stale once the command line changes after the request was made */
+    const generation_token_t generation;
     
-    background_highlight_context_t(const wcstring &pbuff, int phighlight_pos, highlight_function_t phighlight_func) :
-        string_to_highlight(pbuff),
+    background_highlight_context_t(const std::tr1::shared_ptr<const wcstring> &pbuff, int phighlight_pos, highlight_function_t phighlight_func) :
+        command_line(pbuff),
+        string_to_highlight(*pbuff),
         match_highlight_pos(phighlight_pos),
         highlight_function(phighlight_func),
         vars(env_vars::highlighting_keys),
         when(timef()),
-        generation_count(s_generation_count)
+        generation(s_generation_count)
     {
         colors.resize(string_to_highlight.size(), 0);
     }
     
+    /* Returns 1 if the colors were computed, or 0 if the command line changed before we were done */
     int threaded_highlight() {
-        if (generation_count != s_generation_count) {
+        if (generation.is_stale()) {
             // The gen count has changed, so don't do anything
             return 0;
         }
@@ -2383,10 +2867,12 @@ public:
         if (secDelay > 0) usleep((useconds_t)(secDelay * 1E6));
         //write(0, "Start", 5);
         if (! string_to_highlight.empty()) {
-            highlight_function( string_to_highlight.c_str(), colors, match_highlight_pos, NULL /* error */, vars);
+            highlight_function( string_to_highlight.c_str(), colors, match_highlight_pos, NULL /* error */, vars, generation);
         }
         //write(0, "End", 3);
-        return 0;
+        
+        /* If we went stale while highlighting, the highlight function may have stopped early */
+        return generation.is_stale() ? 0 : 1;
     }
 };
 
@@ -2412,7 +2898,8 @@ static void highlight_search(void) {
 
 static void highlight_complete(background_highlight_context_t *ctx, int result) {
     ASSERT_IS_MAIN_THREAD();
-	if (ctx->string_to_highlight == data->command_line) {
+	/* Ignore cancelled requests (IOTHREAD_CANCELLED) and incomplete results (0) */
+	if (result > 0 && ctx->string_to_highlight == data->command_line) {
 		/* The data hasn't changed, so swap in our colors */
         assert(ctx->colors.size() == data->command_length());
         data->colors.swap(ctx->colors);
@@ -2423,7 +2910,7 @@ static void highlight_complete(background_highlight_context_t *ctx, int result)
         
         sanity_check();
         highlight_search();
-        reader_repaint();
+        reader_repaint_needed();
 	}
 	
 	/* Free our context */
@@ -2448,8 +2935,8 @@ static void reader_super_highlight_me_plenty( int match_highlight_pos )
 {
     reader_sanity_check();
     
-	background_highlight_context_t *ctx = new background_highlight_context_t(data->command_line, match_highlight_pos, data->highlight_function);
-	iothread_perform(threaded_highlight, highlight_complete, ctx);
+	background_highlight_context_t *ctx = new background_highlight_context_t(data->command_line_snapshot(), match_highlight_pos, data->highlight_function);
+	iothread_perform(threaded_highlight, highlight_complete, ctx, IOTHREAD_PRIORITY_INTERACTIVE, true);
     highlight_search();
     
     /* Here's a hack. Check to see if our autosuggestion still applies; if so, don't recompute it. Since the autosuggestion computation is asynchronous, this avoids "flashing" as you type into the autosuggestion. */
@@ -2550,6 +3037,7 @@ static int read_i()
 	parser_t &parser = parser_t::principal_parser();
     
 	data->prev_end_loop=0;
+	s_command_end_counts = syscall_counts();
 
 	while( (!data->end_loop) && (!sanity_check()) )
 	{
@@ -2613,6 +3101,170 @@ static int can_read( int fd )
     return select(fd + 1, &fds, 0, 0, &can_read_timeout) == 1;
 }
 
+/**
+   A completion whose files are being expanded on a background thread
+*/
+struct background_completion_t
+{
+    completer_t * const completer;
+
+    /** Whether complete_background has returned */
+    bool finished;
+
+    /** Whether the reader stopped waiting for the completion, in which case the completion callback frees it */
+    bool abandoned;
+
+    background_completion_t(completer_t *c) :
+        completer(c),
+        finished(false),
+        abandoned(false)
+    {
+    }
+};
+
+static int threaded_complete(background_completion_t *ctx)
+{
+    complete_background(ctx->completer);
+    return 0;
+}
+
+static void complete_completed(background_completion_t *ctx, int result)
+{
+    if (ctx->abandoned)
+    {
+        complete_discard(ctx->completer);
+        delete ctx;
+        return;
+    }
+    ctx->finished = true;
+}
+
+/**
+   Whether the user has typed something, which makes the completion
+   being computed useless. This is the stop function for
+   complete_begin.
+*/
+static bool complete_should_stop()
+{
+    return can_read(0);
+}
+
+/**
+   Wait for the files of a completion to be expanded, or for the user
+   to type something. Completion callbacks of other background work
+   are serviced meanwhile. If the files take longer than
+   COMPLETE_LATENCY_BUDGET, the other completions are shown until
+   they are done.
+
+   \return whether the files were expanded
+*/
+static bool wait_for_completion( background_completion_t *ctx )
+{
+	const double deadline = timef() + COMPLETE_LATENCY_BUDGET / 1000.0;
+	bool shown_partial = false;
+
+	while( ! ctx->finished )
+	{
+		struct timeval timeout;
+		struct timeval *timeout_ptr = NULL;
+		if( ! shown_partial )
+		{
+			double left = deadline - timef();
+			if( left < 0 )
+				left = 0;
+			timeout.tv_sec = (time_t)left;
+			timeout.tv_usec = (suseconds_t)((left - timeout.tv_sec) * 1000000);
+			timeout_ptr = &timeout;
+		}
+
+		const int ioport = iothread_port();
+		fd_set fds;
+		FD_ZERO( &fds );
+		FD_SET( 0, &fds );
+		FD_SET( ioport, &fds );
+
+		int res = select( maxi( 0, ioport ) + 1, &fds, 0, 0, timeout_ptr );
+		if( res == -1 )
+		{
+			if( errno == EINTR || errno == EAGAIN )
+				continue;
+			return false;
+		}
+
+		if( res == 0 )
+		{
+			/* Out of time, show what we have */
+			shown_partial = true;
+			std::vector<completion_t> partial = complete_get_partial( ctx->completer );
+			sort( partial.begin(), partial.end() );
+			remove_duplicates( partial );
+			if( partial.size() > 1 && show_completion_list( partial ) )
+				return false;
+			continue;
+		}
+
+		if( FD_ISSET( ioport, &fds ) )
+			iothread_service_completion();
+
+		if( FD_ISSET( 0, &fds ) )
+			break;
+	}
+	return ctx->finished;
+}
+
+/**
+   Complete the command line cmd without blocking on slow
+   filesystems. The parts needing the parser run right away,
+   and the files are expanded on a background thread. If the user
+   types something before the completion is done, it is abandoned.
+
+   \return whether the completion was done, and its results put into comps
+*/
+static bool complete_without_blocking( const wcstring &cmd, std::vector<completion_t> &comps )
+{
+	completer_t *completer = complete_begin( cmd, &complete_should_stop );
+	if( ! completer )
+		return false;
+
+	background_completion_t *ctx = new background_completion_t( completer );
+	iothread_perform( threaded_complete, complete_completed, ctx, IOTHREAD_PRIORITY_INTERACTIVE );
+
+	if( ! wait_for_completion( ctx ) )
+	{
+		/* The completion callback frees it */
+		ctx->abandoned = true;
+		return false;
+	}
+
+	delete ctx;
+	if( can_read( 0 ) )
+	{
+		complete_discard( completer );
+		return false;
+	}
+	complete_finish( completer, comps );
+	return true;
+}
+
+/**
+   Start expanding the files that completing the token under the
+   cursor would look for, unless the user has typed something already
+*/
+static void prewarm_completions()
+{
+	if( data->complete_func != &complete || can_read( 0 ) )
+		return;
+
+	const wchar_t *begin, *end;
+	const wchar_t *token_begin, *token_end;
+	const wchar_t *buff = data->command_line.c_str();
+
+	/* The same part of the command line that R_COMPLETE completes */
+	parse_util_cmdsubst_extent( buff, data->buff_pos, &begin, &end );
+	parse_util_token_extent( begin, data->buff_pos - (begin-buff), &token_begin, &token_end, 0, 0 );
+	complete_prewarm( wcstring( begin, token_end - begin ) );
+}
+
 /**
    Test if the specified character is in the private use area that
    fish uses to store internal characters
@@ -2664,14 +3316,15 @@ const wchar_t *reader_readline()
 	reader_super_highlight_me_plenty( data->buff_pos );
 	s_reset( &data->screen, true);
 	reader_repaint();
+	startup_trace_finish( "prompt" );
 
 	/* 
 	   get the current terminal modes. These will be restored when the
 	   function returns.
 	*/
 	tcgetattr(0,&old_modes);        
-	/* set the new modes */
-	if( tcsetattr(0,TCSANOW,&shell_modes))
+	/* set the new modes, unless the terminal is in them already, like after a builtin */
+	if( ! term_modes_equal( old_modes, shell_modes ) && tcsetattr(0,TCSANOW,&shell_modes))
 	{
 		wperror(L"tcsetattr");
     }
@@ -2728,6 +3381,8 @@ const wchar_t *reader_readline()
 			if( c != 0 )
 				break;
 		}
+
+		TRACE_SCOPE( "reader_handle_key" );
 /*
   if( (last_char == R_COMPLETE) && (c != R_COMPLETE) && (!comp_empty) )
   {
@@ -2837,12 +3492,28 @@ const wchar_t *reader_readline()
 					len = data->buff_pos - (begin-buff);
                     const wcstring buffcpy = wcstring(begin, len);
 
-					data->complete_func( buffcpy, comp, COMPLETE_DEFAULT, NULL);
+					bool done = true;
+					if( data->complete_func == &complete )
+					{
+						done = complete_without_blocking( buffcpy, comp );
+					}
+					else
+					{
+						data->complete_func( buffcpy, comp, COMPLETE_DEFAULT, NULL);
+					}
 					
-					sort(comp.begin(), comp.end());
-					remove_duplicates( comp );
+					if( done )
+					{
+						sort(comp.begin(), comp.end());
+						remove_duplicates( comp );
 					
-					comp_empty = handle_completions( comp );
+						comp_empty = handle_completions( comp );
+					}
+					else
+					{
+						/* The user typed something, so try again on the next tab */
+						comp_empty = 1;
+					}
 					comp.clear();
 				}
 
@@ -3305,7 +3976,7 @@ const wchar_t *reader_readline()
 */
 	if( !reader_exit_forced() )
 	{
-		if( tcsetattr(0,TCSANOW,&old_modes))      /* return to previous mode */
+		if( ! term_modes_equal( old_modes, shell_modes ) && tcsetattr(0,TCSANOW,&old_modes))      /* return to previous mode */
 		{
 			wperror(L"tcsetattr");
 		}
@@ -3327,17 +3998,159 @@ int reader_search_mode()
 }
 
 
+/**
+   Whether read_ni checks all of a script that is not read from a
+   regular file before running any of it
+*/
+static bool check_scripts_first = false;
+
+void reader_set_check_first( bool check_first )
+{
+	check_scripts_first = check_first;
+}
+
+/**
+   Runs a script while it is being read, for read_ni. The script is
+   taken a whole number of lines at a time, and the lines read so far
+   are run once they parse as a whole, i.e. once they are made of
+   complete top level jobs. Lines that don't parse yet wait for the
+   rest of the script, and are not tested again before they have
+   doubled in size or the input has run dry, so that a long block is
+   not parsed more than a few times.
+*/
+class script_streamer_t
+{
+	parser_t &parser;
+	io_data_t *io;
+
+	/** The bytes read after the last newline */
+	std::string bytes;
+
+	/** The lines read that have not been run yet */
+	wcstring pending;
+
+	/** The size that pending has to reach before it is tested again */
+	size_t retest_size;
+
+	/** Returns whether the last line of pending ends in an escaped newline, and so goes on in the next line */
+	bool pending_continues() const
+	{
+		size_t backslashes = 0;
+		for( size_t i = pending.size() - 1; i > 0 && pending.at( i - 1 ) == L'\\'; i-- )
+			backslashes++;
+		return backslashes % 2;
+	}
+
+	public:
+
+	/** The value read_ni returns */
+	int res;
+
+	script_streamer_t( parser_t &p, io_data_t *i ) : parser( p ), io( i ), retest_size( 0 ), res( 0 )
+	{
+	}
+
+	/**
+	   Adds the specified bytes to the script, and runs the lines that
+	   are complete. drained is whether no more input was waiting.
+	   Returns false if the script has exited, so that no more of it
+	   should be read.
+	*/
+	bool add( const char *buff, size_t len, bool drained )
+	{
+		bytes.append( buff, len );
+		size_t end = bytes.rfind( '\n' );
+		if( end != std::string::npos )
+		{
+			pending.append( str2wcstring( bytes.substr( 0, end + 1 ) ) );
+			bytes.erase( 0, end + 1 );
+		}
+
+		if( pending.empty() || pending_continues() || ( ! drained && pending.size() < retest_size ) )
+			return true;
+
+		if( parser.test( pending.c_str(), 0, 0, L"fish" ) )
+		{
+			retest_size = 2 * pending.size();
+			return true;
+		}
+
+		parser.eval( pending, io, TOP );
+		pending.clear();
+		retest_size = 0;
+		return ! exit_status();
+	}
+
+	/**
+	   Runs what is left of the script at the end of the input, or
+	   prints why it can't be run
+	*/
+	void finish()
+	{
+		pending.append( str2wcstring( bytes ) );
+		bytes.clear();
+		if( pending.empty() )
+			return;
+
+		wcstring sb;
+		if( ! parser.test( pending.c_str(), 0, &sb, L"fish" ) )
+		{
+			parser.eval( pending, io, TOP );
+		}
+		else
+		{
+			fwprintf( stderr, L"%ls", sb.c_str() );
+			res = 1;
+		}
+		pending.clear();
+	}
+};
+
+/**
+   Reads and runs a script from the specified file descriptor a part
+   at a time, for read_ni
+*/
+static int read_ni_streaming( int des, io_data_t *io )
+{
+	script_streamer_t streamer( parser_t::principal_parser(), io );
+	char buff[4096];
+
+	while( 1 )
+	{
+		ssize_t c = read( des, buff, sizeof buff );
+		if( c == 0 )
+		{
+			streamer.finish();
+			break;
+		}
+		if( c < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			/* The lines that have been run can't be taken back, but the rest is dropped */
+			debug( 1,
+				   _( L"Error while reading from file descriptor" ) );
+			streamer.res = 1;
+			break;
+		}
+		if( ! streamer.add( buff, c, c < (ssize_t)sizeof buff ) )
+			break;
+	}
+	return streamer.res;
+}
+
 /**
    Read non-interactively.  Read input from stdin without displaying
    the prompt, using syntax highlighting. This is used for reading
-   scripts and init files.
+   scripts and init files. Regular files are read and checked as a
+   whole before they are run. Other input, like a pipe, is run as it
+   is read, unless reader_set_check_first was called.
 */
 static int read_ni( int fd, io_data_t *io )
 {
     parser_t &parser = parser_t::principal_parser();
 	FILE *in_stream;
-	wchar_t *buff=0;
-	std::vector<char> acc;
 
 	int des = fd == 0 ? dup(0) : fd;
 	int res=0;
@@ -3349,37 +4162,66 @@ static int read_ni( int fd, io_data_t *io )
 	}
 
 	in_stream = fdopen( des, "r" );
-	if( in_stream != 0 )
+	struct stat st;
+	const bool regular = in_stream != 0 && ! fstat( des, &st ) && S_ISREG( st.st_mode );
+	if( in_stream != 0 && ! regular && ! check_scripts_first )
+	{
+		res = read_ni_streaming( des, io );
+		if(	fclose( in_stream ))
+		{
+			debug( 1,
+				   _( L"Error while closing input stream" ) );
+			wperror( L"fclose" );
+			res = 1;
+		}
+	}
+	else if( in_stream != 0 )
 	{
-		wchar_t *str;
-		int acc_used;
+		/*
+		  The script is shared with the functions defined in it, which
+		  refer to their definitions in it instead of copying them.
+		*/
+		wcstring *str = new wcstring();
+		const function_source_t source( str );
 
-		while(!feof( in_stream ))
+		/*
+		  Map regular files instead of reading them into a buffer that
+		  has to grow as it goes
+		*/
+		void *map = regular && st.st_size > 0 ? mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, des, 0 ) : MAP_FAILED;
+		if( map != MAP_FAILED )
+		{
+			*str = str2wcstring( (const char *)map, st.st_size );
+			munmap( map, st.st_size );
+		}
+		else
 		{
-			char buff[4096];
-			int c;
+			std::vector<char> acc;
+			while(!feof( in_stream ))
+			{
+				char buff[4096];
+				int c;
 
-			c = fread(buff, 1, 4096, in_stream);
+				c = fread(buff, 1, 4096, in_stream);
 			
-			if( ferror( in_stream ) && ( errno != EINTR ) )
-			{
-				debug( 1,
-					   _( L"Error while reading from file descriptor" ) );
+				if( ferror( in_stream ) && ( errno != EINTR ) )
+				{
+					debug( 1,
+						   _( L"Error while reading from file descriptor" ) );
 				
-				/*
-				  Reset buffer on error. We won't evaluate incomplete files.
-				*/
-				acc.clear();
-				break;
+					/*
+					  Reset buffer on error. We won't evaluate incomplete files.
+					*/
+					acc.clear();
+					break;
 				
-			}
+				}
 
-			acc.insert(acc.end(), buff, buff + c);
+				acc.insert(acc.end(), buff, buff + c);
+			}
+			if( ! acc.empty() )
+				*str = str2wcstring( &acc.at(0), acc.size() );
 		}
-        acc.push_back(0);
-		acc_used = acc.size();
-		str = str2wcs(&acc.at(0));
-        acc.clear();
 
 		if(	fclose( in_stream ))
 		{
@@ -3389,43 +4231,24 @@ static int read_ni( int fd, io_data_t *io )
 			res = 1;
 		}
 
-		if( str )
+		wcstring sb;
+		if( ! parser.test( str->c_str(), 0, &sb, L"fish" ) )
 		{
-			wcstring sb;
-			if( ! parser.test( str, 0, &sb, L"fish" ) )
-			{
-				parser.eval( str, io, TOP );
-			}
-			else
-			{
-				fwprintf( stderr, L"%ls", sb.c_str() );
-				res = 1;
-			}
-			free( str );
+			function_push_source( source );
+			parser.eval( *str, io, TOP );
+			function_pop_source();
 		}
 		else
 		{
-			if( acc_used > 1 )
-			{
-				debug( 1,
-					   _( L"Could not convert input. Read %d bytes." ),
-					   acc_used-1 );
-			}
-			else
-			{
-				debug( 1,
-					   _( L"Could not read input stream" ) );
-			}
-			res=1;
+			fwprintf( stderr, L"%ls", sb.c_str() );
+			res = 1;
 		}
-
 	}
 	else
 	{
 		debug( 1,
 			   _( L"Error while opening input stream" ) );
 		wperror( L"fdopen" );
-		free( buff );
 		res=1;
 	}
 	return res;
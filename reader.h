@@ -87,6 +87,16 @@ void reader_repaint_if_needed();
 */
 void reader_run_command( const wchar_t *buff );
 
+struct syscall_counts_t;
+
+/**
+   Returns how many of the operations counted by syscall_count the last
+   interactive command that finished made while it ran, and how many
+   were made between its end and the start of the current command,
+   i.e. by the prompt, highlighting and completions.
+*/
+void reader_get_syscall_counts( syscall_counts_t &last_command, syscall_counts_t &at_prompt );
+
 /**
    Get the string of character currently entered into the command
    buffer, or 0 if interactive mode is uninitialized.
@@ -146,7 +156,7 @@ void reader_set_complete_function( complete_function_t );
  The type of a highlight function.
  */
 class env_vars;
-typedef void (*highlight_function_t)( const wcstring &, std::vector<int> &, int, wcstring_list_t *, const env_vars &vars );
+typedef void (*highlight_function_t)( const wcstring &, std::vector<int> &, int, wcstring_list_t *, const env_vars &vars, const generation_token_t &token );
 
 /**
  Specify function for syntax highlighting. The function must take these arguments:
@@ -155,6 +165,8 @@ typedef void (*highlight_function_t)( const wcstring &, std::vector<int> &, int,
  - The color code of each character as an array of ints
  - The cursor position
  - An array_list_t used for storing error messages
+ - The environment variables to use
+ - A token that goes stale once the result is no longer wanted
  */
 void reader_set_highlight_function( highlight_function_t );
 
@@ -170,6 +182,23 @@ void reader_set_test_function( int (*f)( const wchar_t * ) );
 */
 void reader_set_prompt( const wchar_t *prompt );
 
+/**
+   Sets whether scripts that are not read from a regular file, like
+   the ones piped to fish, are checked as a whole before any of them
+   is run. By default they are run as they are read, a few complete
+   jobs at a time.
+*/
+void reader_set_check_first( bool check_first );
+
+/**
+   Gives the terminal the modes of the user, if a command run from the
+   command line is about to start a program and it hasn't been done
+   yet. Builtins and functions run with the terminal in the modes of
+   the shell, to spare the mode switches around them. Returns whether
+   the modes were switched.
+*/
+bool reader_donate_terminal();
+
 /**
    Returns true if the shell is exiting, 0 otherwise. 
 */
@@ -62,13 +62,13 @@ void validate_pointer( const void *ptr, const wchar_t *err, int null_ok )
 	
 	if( (0x00000003l & (long)ptr) != 0 )
 	{
-		debug( 0, _(L"The pointer '%ls' is invalid"), err );
+		debug( 0, _(L"The pointer '%ls' is invalid"), _(err) );
 		sanity_lose();		
 	}
 	
 	if((!null_ok) && (ptr==0))
 	{
-		debug( 0, _(L"The pointer '%ls' is null"), err );
+		debug( 0, _(L"The pointer '%ls' is null"), _(err) );
 		sanity_lose();		
 	}
 }
@@ -21,7 +21,7 @@ int sanity_check();
   Try and determine if ptr is a valid pointer. If not, loose sanity.
   
   \param ptr The pointer to validate
-  \param err A description of what the pointer refers to, for use in error messages
+  \param err A description of what the pointer refers to, for use in error messages. It is only translated if the pointer is bad, so it should be marked with N_ rather than translated by the caller.
   \param null_ok Wheter the pointer is allowed to point to 0
 */
 void validate_pointer( const void *ptr, const wchar_t *err, int null_ok );
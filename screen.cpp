@@ -53,12 +53,30 @@ efficient way for transforming that to the desired screen content.
 #include "highlight.h"
 #include "screen.h"
 #include "env.h"
+#include "trace.h"
 
 /**
    The number of characters to indent new blocks
  */
 #define INDENT_STEP 4
 
+/**
+   The cost of a terminfo string the terminal doesn't have. It is
+   larger than that of anything else fish writes.
+*/
+#define COST_MISSING 0x10000
+
+/**
+   The estimated number of bytes needed to change the pen color
+*/
+#define COST_COLOR 10
+
+/**
+   The estimated number of bytes needed to move the cursor a short
+   distance within a line
+*/
+#define COST_MOVE 4
+
 /**
    Ugly kludge. The internal buffer used to store output of
    tputs. Since tputs external function can only take an integer and
@@ -68,23 +86,25 @@ typedef std::vector<char> data_buffer_t;
 static data_buffer_t *s_writeb_buffer=0;
 
 static int s_writeb( char c );
+static void s_write_bytes( const char *buff, size_t len );
 
 /* Class to temporarily set s_writeb_buffer and the writer function in a scoped way */
 class scoped_buffer_t {
     data_buffer_t * const old_buff;
     int (* const old_writer)(char);
+    void (* const old_bytes_writer)(const char *, size_t);
     
     public:
-    scoped_buffer_t(data_buffer_t *buff) : old_buff(s_writeb_buffer), old_writer(output_get_writer())
+    scoped_buffer_t(data_buffer_t *buff) : old_buff(s_writeb_buffer), old_writer(output_get_writer()), old_bytes_writer(output_get_bytes_writer())
     {
         s_writeb_buffer = buff;
-        output_set_writer(s_writeb);
+        output_set_writer(s_writeb, s_write_bytes);
     }
     
     ~scoped_buffer_t()
     {
         s_writeb_buffer = old_buff;
-        output_set_writer(old_writer);
+        output_set_writer(old_writer, old_bytes_writer);
     }
 };
 
@@ -151,7 +171,7 @@ static int is_term256_escape(const wchar_t *str) {
    to detect common escape sequences that may be embeded in a prompt,
    such as color codes.
 */
-static int calc_prompt_width( const wchar_t *prompt )
+static int measure_prompt_width( const wchar_t *prompt )
 {
 	int res = 0;
 	size_t j, k;
@@ -300,12 +320,32 @@ static int calc_prompt_width( const wchar_t *prompt )
 			/*
 			  Ordinary decent character. Just add width.
 			*/
-			res += wcwidth( prompt[j] );
+			res += fish_wcwidth( prompt[j] );
 		}
 	}
 	return res;
 }
 
+/**
+   Returns the width of the specified prompt. The prompt is the same
+   on most redraws, so the width of the last one is remembered, along
+   with the terminal its escape sequences were recognized for.
+*/
+static int calc_prompt_width( const wchar_t *prompt )
+{
+	static wcstring last_prompt, last_term;
+	static int last_width = -1;
+	
+	const wcstring term = env_get_string( L"TERM" );
+	if( last_width < 0 || last_prompt != prompt || last_term != term )
+	{
+		last_width = measure_prompt_width( prompt );
+		last_prompt = prompt;
+		last_term = term;
+	}
+	return last_width;
+}
+
 /**
    Test if there is space between the time fields of struct stat to
    use for sub second information. If so, we assume this space
@@ -322,9 +362,12 @@ static int room_for_usec(struct stat *st)
    Stat stdout and stderr and save result.
 
    This should be done before calling a function that may cause output.
+   Unless both is set, stderr is not looked at if it was the same file
+   as stdout the last time, since only the code that fish runs can
+   change that.
 */
 
-static void s_save_status( screen_t *s)
+static void s_save_status( screen_t *s, bool both )
 {
 
 	/*
@@ -353,10 +396,18 @@ static void s_save_status( screen_t *s)
 	  impossible to do 100% reliably. We try, at least.
 	*/
 	futimes( 1, t );
-	futimes( 2, t );
-
 	fstat( 1, &s->prev_buff_1 );
-	fstat( 2, &s->prev_buff_2 );
+
+	if( both || ! s->status_fds_same )
+	{
+		futimes( 2, t );
+		fstat( 2, &s->prev_buff_2 );
+		s->status_fds_same = s->prev_buff_1.st_dev == s->prev_buff_2.st_dev && s->prev_buff_1.st_ino == s->prev_buff_2.st_ino;
+	}
+	else
+	{
+		s->prev_buff_2 = s->prev_buff_1;
+	}
 }
 
 /**
@@ -441,8 +492,8 @@ static void s_desired_append_char( screen_t *s,
 		default:
 		{
 			int screen_width = common_get_width();
-			int cw = wcwidth(b);
-			int ew = wcwidth( ellipsis_char );
+			int cw = fish_wcwidth(b);
+			int ew = fish_wcwidth( ellipsis_char );
 			int i;
 			
             s->desired.create_line(line_no);
@@ -487,6 +538,62 @@ static int s_writeb( char c )
 	return 0;
 }
 
+/**
+   The function for writing many bytes at once to s_writeb_buffer.
+*/
+static void s_write_bytes( const char *buff, size_t len )
+{
+    s_writeb_buffer->insert(s_writeb_buffer->end(), buff, buff + len);
+}
+
+/**
+   Returns the number of bytes in the specified terminfo string, or
+   COST_MISSING if the terminal doesn't have it.
+*/
+static int cap_cost( const char *str )
+{
+	return (str && str[0]) ? (int)strlen( str ) : COST_MISSING;
+}
+
+/**
+   Returns the number of bytes needed to do something count times,
+   either by repeating the terminfo string step, or by using the
+   parametrized terminfo string parm once.
+*/
+static int steps_cost( char *step, char *parm, int count )
+{
+	int result = count * cap_cost( step );
+	if( parm && parm[0] )
+	{
+		char *str = tparm( parm, count );
+		if( str && cap_cost( str ) < result )
+			result = cap_cost( str );
+	}
+	return result;
+}
+
+/**
+   Writes the shorter of count repetitions of the terminfo string step,
+   and the parametrized string parm. The output goes to the current
+   writer.
+
+   \return whether parm was used
+*/
+static bool s_write_steps( char *step, char *parm, int count )
+{
+	if( count * cap_cost( step ) > steps_cost( step, parm, count ) )
+	{
+		writembs( tparm( parm, count ) );
+		return true;
+	}
+
+	for( int i=0; i<count; i++ )
+	{
+		writembs( step );
+	}
+	return false;
+}
+
 /**
    Write the bytes needed to move screen cursor to the specified
    position to the specified buffer. The actual_cursor field of the
@@ -499,10 +606,8 @@ static int s_writeb( char c )
 */
 static void s_move( screen_t *s, data_buffer_t *b, int new_x, int new_y )
 {
-	int i;
 	int x_steps, y_steps;
 	
-	char *str;
 /*
   debug( 0, L"move from %d %d to %d %d", 
   s->screen_cursor[0], s->screen_cursor[1],  
@@ -512,56 +617,43 @@ static void s_move( screen_t *s, data_buffer_t *b, int new_x, int new_y )
     	
 	y_steps = new_y - s->actual.cursor[1];
 
-	if( y_steps > 0 && (strcmp( cursor_down, "\n")==0))
-	{	
-		/*
-		  This is very strange - it seems some (all?) consoles use a
-		  simple newline as the cursor down escape. This will of
-		  course move the cursor to the beginning of the line as well
-		  as moving it down one step. The cursor_up does not have this
-		  behaviour...
-		*/
-		s->actual.cursor[0]=0;
-	}
-	
 	if( y_steps < 0 )
 	{
-		str = cursor_up;
+		s_write_steps( cursor_up, parm_up_cursor, -y_steps );
 	}
-	else
+	else if( y_steps > 0 )
 	{
-		str = cursor_down;
-		
-	}
-	
-	for( i=0; i<abs(y_steps); i++)
-	{
-		writembs(str);
+		if( ! s_write_steps( cursor_down, parm_down_cursor, y_steps ) && (strcmp( cursor_down, "\n")==0))
+		{	
+			/*
+			  This is very strange - it seems some (all?) consoles use a
+			  simple newline as the cursor down escape. This will of
+			  course move the cursor to the beginning of the line as well
+			  as moving it down one step. The cursor_up does not have this
+			  behaviour...
+			*/
+			s->actual.cursor[0]=0;
+		}
 	}
 
-
 	x_steps = new_x - s->actual.cursor[0];
 	
-	if( x_steps && new_x == 0 )
+	if( x_steps < 0 && 1 + steps_cost( cursor_right, parm_right_cursor, new_x ) < steps_cost( cursor_left, parm_left_cursor, -x_steps ) )
 	{
+		/* Going back to the start of the line and then right is shorter */
         b->push_back('\r');
-		x_steps = 0;
+		x_steps = new_x;
 	}
 		
-	if( x_steps < 0 ){
-		str = cursor_left;
-	}
-	else
+	if( x_steps < 0 )
 	{
-		str = cursor_right;
+		s_write_steps( cursor_left, parm_left_cursor, -x_steps );
 	}
-	
-	for( i=0; i<abs(x_steps); i++)
+	else if( x_steps > 0 )
 	{
-		writembs(str);
+		s_write_steps( cursor_right, parm_right_cursor, x_steps );
 	}
 
-
 	s->actual.cursor[0] = new_x;
 	s->actual.cursor[1] = new_y;
 }
@@ -578,6 +670,43 @@ static void s_set_color( screen_t *s, data_buffer_t *b, int c )
 		   highlight_get_color( (uc>>16)&0xffff, true ) );	
 }
 
+/**
+   The pen color in s_update before the first s_set_pen, or after
+   writing something that changes the color without telling
+*/
+#define PEN_UNKNOWN (-2)
+
+/**
+   Returns whether a blank cell looks the same with both of the
+   specified colors, since they have the same background and neither
+   is underlined
+*/
+static bool s_blank_looks_same( int a, int b )
+{
+	if( a == b )
+		return true;
+	
+	unsigned int ua = (unsigned int)a, ub = (unsigned int)b;
+	if( a == PEN_UNKNOWN || b == PEN_UNKNOWN || (ua>>16) != (ub>>16) )
+		return false;
+	return ! highlight_get_color( ua & 0xffff, false ).is_underline() &&
+		! highlight_get_color( ub & 0xffff, false ).is_underline();
+}
+
+/**
+   Set the pen color for writing the character c in the color c_c,
+   unless c is a blank that looks the same with the current pen.
+
+   \param pen the current color of the pen, which is updated
+*/
+static void s_set_pen( screen_t *s, data_buffer_t *b, wchar_t c, int c_c, int *pen )
+{
+	if( c == L' ' && s_blank_looks_same( c_c, *pen ) )
+		return;
+	s_set_color( s, b, c_c );
+	*pen = c_c;
+}
+
 /**
    Convert a wide character to a multibyte string and append it to the
    buffer.
@@ -585,7 +714,7 @@ static void s_set_color( screen_t *s, data_buffer_t *b, int c )
 static void s_write_char( screen_t *s, data_buffer_t *b, wchar_t c )
 {
 	scoped_buffer_t scoped_buffer(b);
-	s->actual.cursor[0]+=wcwidth( c );	
+	s->actual.cursor[0]+=fish_wcwidth( c );	
 	writech( c );
 }
 
@@ -609,16 +738,136 @@ static void s_write_str( data_buffer_t *b, const wchar_t *s )
 	writestr( s );
 }
 
+/**
+   Returns whether two cells of a line show the same thing
+*/
+static bool entries_equal( const line_entry_t &a, const line_entry_t &b )
+{
+	return a.text == b.text && a.color == b.color;
+}
+
+/**
+   Estimates the number of bytes s_update writes to make the cells of
+   a line from the specified one onwards show what is desired, when
+   the terminal shows actual.
+*/
+static int line_update_cost( const std::vector<line_entry_t> &desired, const std::vector<line_entry_t> &actual, size_t from )
+{
+	int cost = 0;
+	int color = -1;
+	bool at_cell = false;
+	
+	for( size_t j=from; j<desired.size(); j++ )
+	{
+		const line_entry_t &o = desired.at( j );
+		if( ! o.text )
+			continue;
+		
+		if( j < actual.size() && entries_equal( o, actual.at( j ) ) )
+		{
+			at_cell = false;
+			continue;
+		}
+		
+		if( ! at_cell )
+			cost += COST_MOVE;
+		if( o.color != color )
+			cost += COST_COLOR;
+		cost += o.text < 0x80 ? 1 : 3;
+		color = o.color;
+		at_cell = true;
+	}
+	
+	if( actual.size() > desired.size() )
+		cost += COST_MOVE + cap_cost( clr_eol );
+	return cost;
+}
+
+/**
+   If the desired contents of a line are what the terminal shows with
+   some cells inserted or deleted, and shifting the rest of the line
+   with the terminal's insert or delete character capabilities costs
+   less than writing it again, do that. This makes typing and deleting
+   in the middle of a long command line cheap.
+
+   \param s the screen to operate on
+   \param b the buffer to send the output escape codes to
+   \param line_no the line to update
+   \param start_pos the first cell of the line that belongs to the command line
+   \param screen_width the width of the terminal
+*/
+static void s_shift_line( screen_t *s, data_buffer_t *b, size_t line_no, size_t start_pos, int screen_width )
+{
+	const std::vector<line_entry_t> &o = s->desired.line( line_no ).entries;
+	std::vector<line_entry_t> &a = s->actual.create_line( line_no ).entries;
+	const size_t o_len = o.size(), a_len = a.size();
+	
+	if( o_len == a_len || (int)maxi( o_len, a_len ) >= screen_width )
+		return;
+	
+	/* Find the first cell that differs */
+	size_t pos = start_pos;
+	while( pos < o_len && pos < a_len && entries_equal( o.at( pos ), a.at( pos ) ) )
+		pos++;
+	
+	/* The cells at pos must not be the right halves of wide characters */
+	if( pos >= o_len || pos >= a_len || ! o.at( pos ).text || ! a.at( pos ).text )
+		return;
+	
+	const bool insert = o_len > a_len;
+	const size_t count = insert ? o_len - a_len : a_len - o_len;
+	
+	/* The rest of the line must be what is already there, shifted */
+	const std::vector<line_entry_t> &longer = insert ? o : a;
+	const std::vector<line_entry_t> &shorter = insert ? a : o;
+	for( size_t j=pos; j<shorter.size(); j++ )
+	{
+		if( ! entries_equal( shorter.at( j ), longer.at( j + count ) ) )
+			return;
+	}
+	if( ! insert && pos + count < a_len && ! a.at( pos + count ).text )
+		return;
+	
+	/* See if shifting is cheaper than writing the rest of the line again */
+	std::vector<line_entry_t> shifted = a;
+	if( insert )
+	{
+		line_entry_t blank;
+		blank.text = L' ';
+		blank.color = -1;
+		shifted.insert( shifted.begin() + pos, count, blank );
+	}
+	else
+	{
+		shifted.erase( shifted.begin() + pos, shifted.begin() + pos + count );
+	}
+	
+	char *step = insert ? insert_character : delete_character;
+	char *parm = insert ? parm_ich : parm_dch;
+	const int shift_cost = COST_MOVE + steps_cost( step, parm, count ) + line_update_cost( o, shifted, pos );
+	if( shift_cost >= COST_MISSING || shift_cost >= line_update_cost( o, a, pos ) )
+		return;
+	
+	s_move( s, b, pos, line_no );
+	{
+		scoped_buffer_t scoped_buffer(b);
+		s_write_steps( step, parm, count );
+	}
+	a.swap( shifted );
+}
+
 /**
    Update the screen to match the desired output.
 */
 static void s_update( screen_t *scr, const wchar_t *prompt )
 {
+	TRACE_SCOPE( "s_update" );
 	size_t i, j;
 	int prompt_width = calc_prompt_width( prompt );
 	int current_width=0;
 	int screen_width = common_get_width();
 	int need_clear = scr->need_clear;
+	int pen = PEN_UNKNOWN;
 	data_buffer_t output;
 
 	scr->need_clear = 0;
@@ -652,6 +901,10 @@ static void s_update( screen_t *scr, const wchar_t *prompt )
 			s_write_mbs( &output, clr_eol);
             s_line.resize(0);
 		}
+		else
+		{
+			s_shift_line( scr, &output, i, start_pos, screen_width );
+		}
 
         for( j=start_pos; j<o_line.entry_count(); j++) 
 		{
@@ -664,7 +917,7 @@ static void s_update( screen_t *scr, const wchar_t *prompt )
 			if( s_line.entry_count() == j )
 			{
 				s_move( scr, &output, current_width, i );
-				s_set_color( scr, &output, o_c );
+				s_set_pen( scr, &output, o, o_c, &pen );
 				s_write_char( scr, &output, o );
                 s_line.create_entry(j).text = o;
                 s_line.create_entry(j).color = o_c;
@@ -675,20 +928,25 @@ static void s_update( screen_t *scr, const wchar_t *prompt )
                 wchar_t s = entry.text;
                 int s_c = entry.color;
 
-				if( o != s || o_c != s_c )
+				if( o == L' ' && s == L' ' && s_blank_looks_same( o_c, s_c ) )
+				{
+					/* Recoloring a blank changes nothing */
+					entry.color = o_c;
+				}
+				else if( o != s || o_c != s_c )
 				{
 					s_move( scr, &output, current_width, i );
-					s_set_color( scr, &output, o_c );
+					s_set_pen( scr, &output, o, o_c, &pen );
 					s_write_char( scr, &output, o );
                     
                     s_line.create_entry(current_width).text = o;
                     s_line.create_entry(current_width).color = o_c;
-					for( int k=1; k<wcwidth(o); k++ )
+					for( int k=1; k<fish_wcwidth(o); k++ )
                         s_line.create_entry(current_width+k).text = L'\0';
 						
 				}
 			}
-			current_width += wcwidth( o );
+			current_width += fish_wcwidth( o );
 		}
 
         if ( s_line.entry_count() > o_line.entry_count() )
@@ -750,6 +1008,9 @@ void s_write( screen_t *s,
 	CHECK( c, );
 	CHECK( indent, );
 
+	const bool check_status = ! s->skip_status_check;
+	s->skip_status_check = false;
+
 	/*
 	  If we are using a dumb terminal, don't try any fancy stuff,
 	  just print out the text.
@@ -772,7 +1033,8 @@ void s_write( screen_t *s,
 	prompt_width = calc_prompt_width( prompt );
 	screen_width = common_get_width();
 
-	s_check_status( s );
+	if( check_status )
+		s_check_status( s );
 
 	/*
 	  Ignore prompts wider than the screen - only print a two
@@ -809,7 +1071,7 @@ void s_write( screen_t *s,
 		}
 		else
 		{
-			current_line_width += wcwidth(b[i]);
+			current_line_width += fish_wcwidth(b[i]);
 		}
 	}
 	if( current_line_width > max_line_width )
@@ -862,7 +1124,7 @@ void s_write( screen_t *s,
 			   cursor won't be on the ellipsis which looks
 			   unintuitive.
 			*/
-			cursor_arr[0] = s->desired.cursor[0] - wcwidth(b[i]);
+			cursor_arr[0] = s->desired.cursor[0] - fish_wcwidth(b[i]);
 			cursor_arr[1] = s->desired.cursor[1];
 		}
 		
@@ -874,7 +1136,7 @@ void s_write( screen_t *s,
 	
 	memcpy( s->desired.cursor, cursor_arr, sizeof(int)*2 );
 	s_update( s, prompt );
-	s_save_status( s );
+	s_save_status( s, check_status );
 }
 
 void s_reset( screen_t *s, bool reset_cursor )
@@ -5,9 +5,9 @@
 	of the current screen contents and trying to find a reasonably
 	efficient way for transforming that to the desired screen content.
 
-	The current implementation is less smart than ncurses allows
-	and can not for example move blocks of text around to handle text
-	insertion.
+	The current implementation is less smart than ncurses allows. It
+	can shift the rest of a line to handle text insertion and deletion
+	within it, but can not for example move blocks of lines around.
   */
 #ifndef FISH_SCREEN_H
 #define FISH_SCREEN_H
@@ -124,6 +124,19 @@ class screen_t
 	   other than from fish's main loop, in which case we need to redraw.
 	*/
 	struct stat prev_buff_1, prev_buff_2, post_buff_1, post_buff_2;
+
+	/**
+	   Set when stdout and stderr were the same file the last time
+	   both were checked
+	*/
+	bool status_fds_same;
+
+	/**
+	   May be set before calling s_write when nothing but s_write can
+	   have written to the screen since the last call, to spare it
+	   the check for other output. Every call clears it.
+	*/
+	bool skip_status_check;
 };
 
 /**
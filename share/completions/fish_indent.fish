@@ -1,3 +1,4 @@
 complete -c fish_indent -s h -l help --description 'Display help and exit'
 complete -c fish_indent -s v -l version --description 'Display version and exit'
 complete -c fish_indent -s i -l no-indent --description 'Do not indent output, only reformat into one job per line'
+complete -c fish_indent -s w -l write --description 'Write the indented code back to the files'
@@ -55,33 +55,45 @@ complete -f -c git -n 'not __fish_git_needs_command' -l help -d 'Display the man
 
 #### fetch
 complete -f -c git -n '__fish_git_needs_command' -a fetch -d 'Download objects and refs from another repository'
-complete -f -c git -n '__fish_git_using_command fetch' -a '(__fish_git_remotes)' -d 'Remote'
-complete -f -c git -n '__fish_git_using_command fetch' -s q -l quiet -d 'Be quiet'
-complete -f -c git -n '__fish_git_using_command fetch' -s v -l verbose -d 'Be verbose'
-complete -f -c git -n '__fish_git_using_command fetch' -s a -l append -d 'Append ref names and object names'
-# TODO --upload-pack
-complete -f -c git -n '__fish_git_using_command fetch' -s f -l force -d 'Force update of local branches'
+function __fish_git_complete_fetch
+  complete -f -c git -n '__fish_git_using_command fetch' -a '(__fish_git_remotes)' -d 'Remote'
+  complete -f -c git -n '__fish_git_using_command fetch' -s q -l quiet -d 'Be quiet'
+  complete -f -c git -n '__fish_git_using_command fetch' -s v -l verbose -d 'Be verbose'
+  complete -f -c git -n '__fish_git_using_command fetch' -s a -l append -d 'Append ref names and object names'
+  # TODO --upload-pack
+  complete -f -c git -n '__fish_git_using_command fetch' -s f -l force -d 'Force update of local branches'
+end
+complete -c git -n '__fish_git_using_command fetch' --lazy __fish_git_complete_fetch
 # TODO other options
 
 ### remote
 complete -f -c git -n '__fish_git_needs_command' -a remote -d 'Manage set of tracked repositories'
-complete -f -c git -n '__fish_git_using_command remote' -a '(__fish_git_remotes)'
-complete -f -c git -n '__fish_git_using_command remote' -s v -l verbose -d 'Be verbose'
-complete -f -c git -n '__fish_git_using_command remote' -a add -d 'Adds a new remote'
-complete -f -c git -n '__fish_git_using_command remote' -a rm -d 'Removes a remote'
-complete -f -c git -n '__fish_git_using_command remote' -a show -d 'Shows a remote'
-complete -f -c git -n '__fish_git_using_command remote' -a prune -d 'Deletes all stale tracking branches'
-complete -f -c git -n '__fish_git_using_command remote' -a update -d 'Fetches updates'
+function __fish_git_complete_remote
+  complete -f -c git -n '__fish_git_using_command remote' -a '(__fish_git_remotes)'
+  complete -f -c git -n '__fish_git_using_command remote' -s v -l verbose -d 'Be verbose'
+  complete -f -c git -n '__fish_git_using_command remote' -a add -d 'Adds a new remote'
+  complete -f -c git -n '__fish_git_using_command remote' -a rm -d 'Removes a remote'
+  complete -f -c git -n '__fish_git_using_command remote' -a show -d 'Shows a remote'
+  complete -f -c git -n '__fish_git_using_command remote' -a prune -d 'Deletes all stale tracking branches'
+  complete -f -c git -n '__fish_git_using_command remote' -a update -d 'Fetches updates'
+end
+complete -c git -n '__fish_git_using_command remote' --lazy __fish_git_complete_remote
 # TODO options
 
 ### show
 complete -f -c git -n '__fish_git_needs_command' -a show -d 'Shows the last commit of a branch'
-complete -f -c git -n '__fish_git_using_command show' -a '(__fish_git_branches)' -d 'Branch'
+function __fish_git_complete_show
+  complete -f -c git -n '__fish_git_using_command show' -a '(__fish_git_branches)' -d 'Branch'
+end
+complete -c git -n '__fish_git_using_command show' --lazy __fish_git_complete_show
 # TODO options
 
 ### show-branch
 complete -f -c git -n '__fish_git_needs_command' -a show-branch -d 'Shows the commits on branches'
-complete -f -c git -n '__fish_git_using_command show-branch' -a '(__fish_git_heads)' --description 'Branch'
+function __fish_git_complete_show-branch
+  complete -f -c git -n '__fish_git_using_command show-branch' -a '(__fish_git_heads)' --description 'Branch'
+end
+complete -c git -n '__fish_git_using_command show-branch' --lazy __fish_git_complete_show-branch
 # TODO options
 
 ### add
@@ -90,9 +102,12 @@ complete -c git -n '__fish_git_needs_command'    -a add -d 'Add file contents to
 
 ### checkout
 complete -f -c git -n '__fish_git_needs_command'    -a checkout -d 'Checkout and switch to a branch'
-complete -f -c git -n '__fish_git_using_command checkout'  -a '(__fish_git_branches)' --description 'Branch'
-complete -f -c git -n '__fish_git_using_command checkout'  -a '(__fish_git_tags)' --description 'Tag'
-complete -f -c git -n '__fish_git_using_command checkout' -s b -d 'Create a new branch'
+function __fish_git_complete_checkout
+  complete -f -c git -n '__fish_git_using_command checkout'  -a '(__fish_git_branches)' --description 'Branch'
+  complete -f -c git -n '__fish_git_using_command checkout'  -a '(__fish_git_tags)' --description 'Tag'
+  complete -f -c git -n '__fish_git_using_command checkout' -s b -d 'Create a new branch'
+end
+complete -c git -n '__fish_git_using_command checkout' --lazy __fish_git_complete_checkout
 # TODO options
 
 ### apply
@@ -109,16 +124,22 @@ complete -f -c git -n '__fish_git_needs_command' -a bisect -d 'Find the change t
 
 ### branch
 complete -f -c git -n '__fish_git_needs_command' -a branch -d 'List, create, or delete branches'
-complete -f -c git -n '__fish_git_using_command branch' -a '(__fish_git_branches)' -d 'Branch'
-complete -f -c git -n '__fish_git_using_command branch' -s d -d 'Delete Branch'
-complete -f -c git -n '__fish_git_using_command branch' -s D -d 'Force deletion of branch'
-complete -f -c git -n '__fish_git_using_command branch' -s m -d 'Rename branch'
-complete -f -c git -n '__fish_git_using_command branch' -s M -d 'Force renaming branch'
-complete -f -c git -n '__fish_git_using_command branch' -s a -d 'Lists both local and remote branches'
+function __fish_git_complete_branch
+  complete -f -c git -n '__fish_git_using_command branch' -a '(__fish_git_branches)' -d 'Branch'
+  complete -f -c git -n '__fish_git_using_command branch' -s d -d 'Delete Branch'
+  complete -f -c git -n '__fish_git_using_command branch' -s D -d 'Force deletion of branch'
+  complete -f -c git -n '__fish_git_using_command branch' -s m -d 'Rename branch'
+  complete -f -c git -n '__fish_git_using_command branch' -s M -d 'Force renaming branch'
+  complete -f -c git -n '__fish_git_using_command branch' -s a -d 'Lists both local and remote branches'
+end
+complete -c git -n '__fish_git_using_command branch' --lazy __fish_git_complete_branch
 
 ### cherry-pick
 complete -f -c git -n '__fish_git_needs_command' -a cherry-pick -d 'Apply the change introduced by an existing commit'
-complete -f -c git -n '__fish_git_using_command cherry-pick' -a '(__fish_git_branches)' -d 'Branch'
+function __fish_git_complete_cherry-pick
+  complete -f -c git -n '__fish_git_using_command cherry-pick' -a '(__fish_git_branches)' -d 'Branch'
+end
+complete -c git -n '__fish_git_using_command cherry-pick' --lazy __fish_git_complete_cherry-pick
 # TODO options
 
 ### clone
@@ -127,13 +148,19 @@ complete -f -c git -n '__fish_git_needs_command' -a clone -d 'Clone a repository
 
 ### commit
 complete -c git -n '__fish_git_needs_command'    -a commit -d 'Record changes to the repository'
-complete -c git -n '__fish_git_using_command commit' -l amend -d 'Amend the log message of the last commit'
+function __fish_git_complete_commit
+  complete -c git -n '__fish_git_using_command commit' -l amend -d 'Amend the log message of the last commit'
+end
+complete -c git -n '__fish_git_using_command commit' --lazy __fish_git_complete_commit
 # TODO options
 
 ### diff
 complete -c git -n '__fish_git_needs_command'    -a diff -d 'Show changes between commits, commit and working tree, etc'
-complete -c git -n '__fish_git_using_command diff' -a '(__fish_git_ranges)' -d 'Branch'
-complete -c git -n '__fish_git_using_command diff' -l cached -d 'Show diff of changes in the index'
+function __fish_git_complete_diff
+  complete -c git -n '__fish_git_using_command diff' -a '(__fish_git_ranges)' -d 'Branch'
+  complete -c git -n '__fish_git_using_command diff' -l cached -d 'Show diff of changes in the index'
+end
+complete -c git -n '__fish_git_using_command diff' --lazy __fish_git_complete_diff
 # TODO options
 
 ### grep
@@ -146,21 +173,27 @@ complete -f -c git -n '__fish_git_needs_command' -a init -d 'Create an empty git
 
 ### log
 complete -c git -n '__fish_git_needs_command'    -a log -d 'Show commit logs'
-complete -c git -n '__fish_git_using_command log' -a '(__fish_git_heads) (__fish_git_ranges)' -d 'Branch'
-complete -f -c git -n '__fish_git_using_command log' -l pretty -a 'oneline short medium full fuller email raw format:'
+function __fish_git_complete_log
+  complete -c git -n '__fish_git_using_command log' -a '(__fish_git_heads) (__fish_git_ranges)' -d 'Branch'
+  complete -f -c git -n '__fish_git_using_command log' -l pretty -a 'oneline short medium full fuller email raw format:'
+end
+complete -c git -n '__fish_git_using_command log' --lazy __fish_git_complete_log
 # TODO options
 
 ### merge
 complete -f -c git -n '__fish_git_needs_command' -a merge -d 'Join two or more development histories together'
-complete -f -c git -n '__fish_git_using_command merge' -a '(__fish_git_branches)' -d 'Branch'
-complete -f -c git -n '__fish_git_using_command merge' -l commit -d "Autocommit the merge"
-complete -f -c git -n '__fish_git_using_command merge' -l no-commit -d "Don't autocommit the merge"
-complete -f -c git -n '__fish_git_using_command merge' -l stat -d "Show diffstat of the merge"
-complete -f -c git -n '__fish_git_using_command merge' -s n -l no-stat -d "Don't show diffstat of the merge"
-complete -f -c git -n '__fish_git_using_command merge' -l squash -d "Squash changes from other branch as a single commit"
-complete -f -c git -n '__fish_git_using_command merge' -l no-squash -d "Don't squash changes"
-complete -f -c git -n '__fish_git_using_command merge' -l ff -d "Don't generate a merge commit if merge is fast forward"
-complete -f -c git -n '__fish_git_using_command merge' -l no-ff -d "Generate a merge commit even if merge is fast forward"
+function __fish_git_complete_merge
+  complete -f -c git -n '__fish_git_using_command merge' -a '(__fish_git_branches)' -d 'Branch'
+  complete -f -c git -n '__fish_git_using_command merge' -l commit -d "Autocommit the merge"
+  complete -f -c git -n '__fish_git_using_command merge' -l no-commit -d "Don't autocommit the merge"
+  complete -f -c git -n '__fish_git_using_command merge' -l stat -d "Show diffstat of the merge"
+  complete -f -c git -n '__fish_git_using_command merge' -s n -l no-stat -d "Don't show diffstat of the merge"
+  complete -f -c git -n '__fish_git_using_command merge' -l squash -d "Squash changes from other branch as a single commit"
+  complete -f -c git -n '__fish_git_using_command merge' -l no-squash -d "Don't squash changes"
+  complete -f -c git -n '__fish_git_using_command merge' -l ff -d "Don't generate a merge commit if merge is fast forward"
+  complete -f -c git -n '__fish_git_using_command merge' -l no-ff -d "Generate a merge commit even if merge is fast forward"
+end
+complete -c git -n '__fish_git_using_command merge' --lazy __fish_git_complete_merge
 
 # TODO options
 
@@ -182,13 +215,19 @@ complete -f -c git -n '__fish_git_needs_command' -a push -d 'Update remote refs
 
 ### rebase
 complete -f -c git -n '__fish_git_needs_command' -a rebase -d 'Forward-port local commits to the updated upstream head'
-complete -f -c git -n '__fish_git_using_command rebase' -a '(__fish_git_branches)' -d 'Branch'
+function __fish_git_complete_rebase
+  complete -f -c git -n '__fish_git_using_command rebase' -a '(__fish_git_branches)' -d 'Branch'
+end
+complete -c git -n '__fish_git_using_command rebase' --lazy __fish_git_complete_rebase
 # TODO options
 
 ### reset
 complete -c git -n '__fish_git_needs_command'    -a reset -d 'Reset current HEAD to the specified state'
-complete -f -c git -n '__fish_git_using_command reset' -l hard -d 'Reset files in working directory'
-complete -c git -n '__fish_git_using_command reset' -a '(__fish_git_branches)'
+function __fish_git_complete_reset
+  complete -f -c git -n '__fish_git_using_command reset' -l hard -d 'Reset files in working directory'
+  complete -c git -n '__fish_git_using_command reset' -a '(__fish_git_branches)'
+end
+complete -c git -n '__fish_git_using_command reset' --lazy __fish_git_complete_reset
 # TODO options
 
 ### revert
@@ -197,32 +236,41 @@ complete -f -c git -n '__fish_git_needs_command' -a revert -d 'Revert an existin
 
 ### rm
 complete -c git -n '__fish_git_needs_command'    -a rm     -d 'Remove files from the working tree and from the index'
-complete -c git -n '__fish_git_using_command rm' -f
-complete -c git -n '__fish_git_using_command rm' -l cached -d 'Keep local copies'
-complete -c git -n '__fish_git_using_command rm' -l ignore-unmatch -d 'Exit with a zero status even if no files matched'
-complete -c git -n '__fish_git_using_command rm' -s r -d 'Allow recursive removal'
-complete -c git -n '__fish_git_using_command rm' -s q -l quiet -d 'Suppress the output'
-complete -c git -n '__fish_git_using_command rm' -s f -l force -d 'Override the up-to-date check'
-complete -c git -n '__fish_git_using_command rm' -s n -l dry-run -d 'Dry run'
+function __fish_git_complete_rm
+  complete -c git -n '__fish_git_using_command rm' -f
+  complete -c git -n '__fish_git_using_command rm' -l cached -d 'Keep local copies'
+  complete -c git -n '__fish_git_using_command rm' -l ignore-unmatch -d 'Exit with a zero status even if no files matched'
+  complete -c git -n '__fish_git_using_command rm' -s r -d 'Allow recursive removal'
+  complete -c git -n '__fish_git_using_command rm' -s q -l quiet -d 'Suppress the output'
+  complete -c git -n '__fish_git_using_command rm' -s f -l force -d 'Override the up-to-date check'
+  complete -c git -n '__fish_git_using_command rm' -s n -l dry-run -d 'Dry run'
+end
+complete -c git -n '__fish_git_using_command rm' --lazy __fish_git_complete_rm
 # TODO options
 
 ### status
 complete -f -c git -n '__fish_git_needs_command' -a status -d 'Show the working tree status'
-complete -f -c git -n '__fish_git_using_command status' -s s -l short -d 'Give the output in the short-format'
-complete -f -c git -n '__fish_git_using_command status' -s b -l branch -d 'Show the branch and tracking info even in short-format'
-complete -f -c git -n '__fish_git_using_command status'      -l porcelain -d 'Give the output in a stable, easy-to-parse format'
-complete -f -c git -n '__fish_git_using_command status' -s z -d 'Terminate entries with NUL character'
-complete -f -c git -n '__fish_git_using_command status' -s u -l untracked-files -x -a 'no normal all' -d 'The untracked files handling mode'
-complete -f -c git -n '__fish_git_using_command status' -l ignore-submodules -x -a 'none untracked dirty all' -d 'Ignore changes to submodules'
+function __fish_git_complete_status
+  complete -f -c git -n '__fish_git_using_command status' -s s -l short -d 'Give the output in the short-format'
+  complete -f -c git -n '__fish_git_using_command status' -s b -l branch -d 'Show the branch and tracking info even in short-format'
+  complete -f -c git -n '__fish_git_using_command status'      -l porcelain -d 'Give the output in a stable, easy-to-parse format'
+  complete -f -c git -n '__fish_git_using_command status' -s z -d 'Terminate entries with NUL character'
+  complete -f -c git -n '__fish_git_using_command status' -s u -l untracked-files -x -a 'no normal all' -d 'The untracked files handling mode'
+  complete -f -c git -n '__fish_git_using_command status' -l ignore-submodules -x -a 'none untracked dirty all' -d 'Ignore changes to submodules'
+end
+complete -c git -n '__fish_git_using_command status' --lazy __fish_git_complete_status
 # TODO options
 
 ### tag
 complete -f -c git -n '__fish_git_needs_command' -a tag -d 'Create, list, delete or verify a tag object signed with GPG'
 complete -f -c git -n '__fish_git_using_command tag; and __fish_not_contain_opt -s d; and __fish_not_contain_opt -s v; and test (count (commandline -opc | grep -v -e \'^-\')) -eq 3' -a '(__fish_git_branches)' -d 'Branch'
-complete -f -c git -n '__fish_git_using_command tag' -s d -d 'Remove a tag'
-complete -f -c git -n '__fish_git_using_command tag' -s v -d 'Verify signature of a tag'
-complete -f -c git -n '__fish_git_using_command tag' -s f -d 'Force overwriting exising tag'
-complete -f -c git -n '__fish_git_using_command tag' -s s -d 'Make a GPG-signed tag'
+function __fish_git_complete_tag
+  complete -f -c git -n '__fish_git_using_command tag' -s d -d 'Remove a tag'
+  complete -f -c git -n '__fish_git_using_command tag' -s v -d 'Verify signature of a tag'
+  complete -f -c git -n '__fish_git_using_command tag' -s f -d 'Force overwriting exising tag'
+  complete -f -c git -n '__fish_git_using_command tag' -s s -d 'Make a GPG-signed tag'
+end
+complete -c git -n '__fish_git_using_command tag' --lazy __fish_git_complete_tag
 complete -f -c git -n '__fish_contains_opt -s d' -a '(__fish_git_tags)' -d 'Tag'
 complete -f -c git -n '__fish_contains_opt -s v' -a '(__fish_git_tags)' -d 'Tag'
 # TODO options
@@ -233,11 +281,17 @@ complete -f -c git -n '__fish_git_needs_command' -a config -d 'Set and read git
 
 ### format-patch
 complete -f -c git -n '__fish_git_needs_command' -a format-patch -d 'Generate patch series to send upstream'
-complete -f -c git -n '__fish_git_using_command format-patch' -a '(__fish_git_branches)' -d 'Branch'
+function __fish_git_complete_format-patch
+  complete -f -c git -n '__fish_git_using_command format-patch' -a '(__fish_git_branches)' -d 'Branch'
+end
+complete -c git -n '__fish_git_using_command format-patch' --lazy __fish_git_complete_format-patch
 
 ## git submodule
 complete -f -c git -n '__fish_git_needs_command' -a submodule -d 'Initialize, update or inspect submodules'
-complete -f -c git -n '__fish_git_using_command submodule' -a 'add status init update summary foreach sync' -d 'Make a GPG-signed tag'
+function __fish_git_complete_submodule
+  complete -f -c git -n '__fish_git_using_command submodule' -a 'add status init update summary foreach sync' -d 'Make a GPG-signed tag'
+end
+complete -c git -n '__fish_git_using_command submodule' --lazy __fish_git_complete_submodule
 
 ## git whatchanged
 complete -f -c git -n '__fish_git_needs_command' -a whatchanged -d 'Show logs with difference each commit introduces'
@@ -0,0 +1,3 @@
+complete -c hash -s r -l reset --description "Forget all cached command locations"
+complete -c hash -s h -l help --description "Display help and exit"
+complete -c hash -x -a "(__fish_complete_command)"
@@ -1,5 +1,6 @@
 complete -c history -r -l prefix --description "Match history items that start with the given prefix"
 complete -c history -r -l contains --description "Match history items that contain the given string"
+complete -c history -r -l fuzzy --description "Match history items that contain the characters of the given string in order"
 complete -c history -l search --description "Print matching history items, which is the default behavior"
 complete -c history -l delete --description "Interactively delete matching history items"
 complete -c history -l clear --description "Clear your entire history"
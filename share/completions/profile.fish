@@ -0,0 +1,7 @@
+complete -c profile -s s -l start --description "Enable the profiler"
+complete -c profile -s S -l stop --description "Disable the profiler"
+complete -c profile -s r -l reset --description "Forget everything the profiler has recorded"
+complete -c profile -s f -l folded --description "Print stacks of jobs in folded format"
+complete -c profile -s R -l recent --description "Print the last jobs that were run"
+complete -c profile -s t -l trace --description "Control or print the trace points instead"
+complete -c profile -s h -l help --description "Display help and exit"
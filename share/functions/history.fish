@@ -7,6 +7,7 @@ function history --description "Deletes an item from history"
     set -l argc (count $argv)
     set -l prefix_args ""
     set -l contains_args ""
+    set -l fuzzy_args ""
 
 	set -l cmd print
 
@@ -23,6 +24,9 @@ function history --description "Deletes an item from history"
                 case --contains
                     set search_mode contains
                     set contains_args $argv[(math $i + 1)]
+                case --fuzzy
+                    set search_mode fuzzy
+                    set fuzzy_args $argv[(math $i + 1)]
                 case --save
                     set cmd save
                 case --clear
@@ -52,6 +56,8 @@ function history --description "Deletes an item from history"
 					set found_items (builtin history --search --prefix $prefix_args)
 				case contains
 					set found_items (builtin history --search --contains $contains_args)
+				case fuzzy
+					set found_items (builtin history --search --fuzzy $fuzzy_args)
 				case none
 					builtin history $argv
 					return 0 
@@ -14,6 +14,7 @@ The library for various signal related issues
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #ifdef HAVE_SIGINFO_H
 #include <siginfo.h>
@@ -55,6 +56,14 @@ struct lookup_entry
 */
 static int block_count=0;
 
+/**
+   The pipe that signal handlers write a byte to, so that the main
+   loop wakes up from select even if the signal arrived just before
+   it was called. Both ends are -1 until signal_pipe_init has
+   created it.
+*/
+static int signal_pipe[2] = { -1, -1 };
+
 
 /**
    Lookup table used to convert between signal names and signal ids,
@@ -422,6 +431,46 @@ const wchar_t *signal_get_desc( int sig )
 	return _(L"Unknown");
 }
 
+/**
+   Wake up the main loop by writing to the signal pipe. If the pipe is
+   full, enough wakeups are already pending.
+*/
+static void signal_notify()
+{
+	if( signal_pipe[1] < 0 )
+		return;
+	
+	int errno_old = errno;
+	char c = 0;
+	while( write( signal_pipe[1], &c, 1 ) < 0 && errno == EINTR )
+		;
+	errno = errno_old;
+}
+
+/**
+   Create the signal pipe, unless it already exists
+*/
+static void signal_pipe_init()
+{
+	if( signal_pipe[0] >= 0 )
+		return;
+	
+	int fds[2];
+	if( pipe( fds ) == -1 )
+	{
+		wperror( L"pipe" );
+		return;
+	}
+	
+	for( int i=0; i<2; i++ )
+	{
+		fcntl( fds[i], F_SETFD, FD_CLOEXEC );
+		fcntl( fds[i], F_SETFL, fcntl( fds[i], F_GETFL ) | O_NONBLOCK );
+	}
+	signal_pipe[0] = fds[0];
+	signal_pipe[1] = fds[1];
+}
+
 /**
    Standard signal handler
 */
@@ -431,6 +480,7 @@ static void default_handler(int signal, siginfo_t *info, void *context)
     {
 		event_fire_signal(signal);
 	}
+	signal_notify();
 }
 
 /**
@@ -455,6 +505,7 @@ static void handle_hup( int sig, siginfo_t *info, void *context )
 	else
 	{
 		reader_exit(1, 1);
+		signal_notify();
 	}	
 }
 
@@ -493,6 +544,22 @@ void signal_reset_handlers()
 }
 
 
+void get_signals_with_handlers( sigset_t *set )
+{
+	int i;
+	
+	sigemptyset( set );
+	for( i=0; lookup[i].desc ; i++ )
+	{
+		struct sigaction act;
+		if( sigaction( lookup[i].signal, 0, &act ) == 0 && act.sa_handler != SIG_DFL )
+		{
+			sigaddset( set, lookup[i].signal );
+		}
+	}
+}
+
+
 /**
    Sets appropriate signal handlers.
 */
@@ -503,6 +570,8 @@ void signal_set_handlers()
 	if( get_is_interactive() == -1 )
 		return;
 	
+	signal_pipe_init();
+	
 	sigemptyset( & act.sa_mask );
 	act.sa_flags=SA_SIGINFO;
 	act.sa_sigaction = &default_handler;
@@ -670,3 +739,9 @@ int signal_is_blocked()
 	return !!block_count;
 }
 
+int signal_port()
+{
+	signal_pipe_init();
+	return signal_pipe[0];
+}
+
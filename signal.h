@@ -6,6 +6,8 @@ The library for various signal related issues
 #ifndef FISH_SIGNALH
 #define FISH_SIGNALH
 
+#include <signal.h>
+
 /**
    Get the integer signal value representing the specified signal, or
    -1 of no signal was found
@@ -27,6 +29,13 @@ const wchar_t *signal_get_desc( int sig );
 */
 void signal_reset_handlers();
 
+/**
+   Get the set of signals that signal_reset_handlers would reset, i.e.
+   the signals that currently do not use the default action. This is
+   used to reset handlers in processes launched without fork.
+*/
+void get_signals_with_handlers( sigset_t *set );
+
 /**
    Set signal handlers to fish default handlers
 */
@@ -55,4 +64,12 @@ void signal_unblock();
 */
 int signal_is_blocked();
 
+/**
+   Returns the file descriptor that becomes readable when a signal
+   has been handled, so that it can be waited for in select together
+   with input. It is nonblocking, and should be read until empty once
+   it is readable. Returns -1 if it could not be created.
+*/
+int signal_port();
+
 #endif
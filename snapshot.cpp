@@ -0,0 +1,358 @@
+/** \file snapshot.cpp
+
+	Startup snapshots.
+
+	The snapshot is a fish script in the configuration directory. Its
+	first line holds a hash of everything the init files could reasonably
+	depend on, and the rest recreates the global variables, functions and
+	completions that the init files defined. It is made by comparing
+	these before and after the init files are evaluated.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "wutil.h"
+#include "env.h"
+#include "env_universal.h"
+#include "function.h"
+#include "exec.h"
+#include "parser.h"
+#include "proc.h"
+#include "path.h"
+#include "snapshot.h"
+
+/**
+   The variable that enables startup snapshots
+*/
+#define SNAPSHOT_VAR L"fish_startup_snapshot"
+
+/**
+   The name of the snapshot file in the configuration directory
+*/
+#define SNAPSHOT_FILE L"/fish_startup_snapshot"
+
+/**
+   The start of the first line of the snapshot, which is followed by the key
+*/
+#define SNAPSHOT_HEADER "# fish startup snapshot "
+
+extern char **environ;
+
+/**
+   A global variable
+*/
+struct snapshot_var_t
+{
+	wcstring val;
+	bool exportv;
+
+	bool operator==( const snapshot_var_t &other ) const
+	{
+		return val == other.val && exportv == other.exportv;
+	}
+};
+
+typedef std::map<wcstring, snapshot_var_t> snapshot_var_map_t;
+
+/**
+   The state that the init files change
+*/
+struct snapshot_state_t
+{
+	snapshot_var_map_t vars;
+	std::set<wcstring> functions;
+	std::set<wcstring> completions;
+};
+
+/**
+   Adds a string to a 64 bit FNV-1a hash
+*/
+static void snapshot_hash( unsigned long long *hash, const std::string &str )
+{
+	for( size_t i=0; i<str.size(); i++ )
+	{
+		*hash ^= (unsigned char)str.at( i );
+		*hash *= 1099511628211ULL;
+	}
+	/* Keep "ab", "c" apart from "a", "bc" */
+	*hash ^= 0xff;
+	*hash *= 1099511628211ULL;
+}
+
+static void snapshot_hash( unsigned long long *hash, const wcstring &str )
+{
+	snapshot_hash( hash, wcs2string( str ) );
+}
+
+/**
+   Computes the key of a snapshot of the init files in the current
+   circumstances
+*/
+static std::string snapshot_key( const wcstring_list_t &files )
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	snapshot_hash( &hash, std::string( PACKAGE_VERSION ) );
+	snapshot_hash( &hash, format_string( L"%d %d", is_login, is_interactive_session ) );
+
+	for( size_t i=0; i<files.size(); i++ )
+	{
+		struct stat buf;
+		const wcstring &file = files.at( i );
+		snapshot_hash( &hash, file );
+		if( wstat( file, &buf ) )
+		{
+			snapshot_hash( &hash, std::string( "missing" ) );
+		}
+		else
+		{
+			snapshot_hash( &hash, format_string( L"%llu %llu %lld %lld",
+												  (unsigned long long)buf.st_dev,
+												  (unsigned long long)buf.st_ino,
+												  (long long)buf.st_size,
+												  (long long)buf.st_mtime ) );
+		}
+	}
+
+	/* Environment variables arrive in no particular order */
+	std::vector<std::string> env;
+	for( char **var = environ; var && *var; var++ )
+	{
+		env.push_back( *var );
+	}
+	std::sort( env.begin(), env.end() );
+	for( size_t i=0; i<env.size(); i++ )
+	{
+		snapshot_hash( &hash, env.at( i ) );
+	}
+
+	wcstring_list_t names = env_get_names( ENV_UNIVERSAL );
+	std::sort( names.begin(), names.end() );
+	for( size_t i=0; i<names.size(); i++ )
+	{
+		const wchar_t *val = env_universal_get( names.at( i ) );
+		snapshot_hash( &hash, names.at( i ) );
+		snapshot_hash( &hash, val ? wcstring( val ) : wcstring() );
+	}
+
+	char cwd[PATH_MAX];
+	if( getcwd( cwd, sizeof cwd ) )
+		snapshot_hash( &hash, std::string( cwd ) );
+
+	char buff[32];
+	snprintf( buff, sizeof buff, "%016llx", hash );
+	return buff;
+}
+
+/**
+   Records the global variables, functions and completions
+*/
+static void snapshot_get_state( snapshot_state_t &state )
+{
+	wcstring_list_t names = env_get_names( ENV_GLOBAL );
+	wcstring_list_t exported = env_get_names( ENV_GLOBAL | ENV_EXPORT );
+	std::set<wcstring> exported_set( exported.begin(), exported.end() );
+
+	for( size_t i=0; i<names.size(); i++ )
+	{
+		const wcstring &name = names.at( i );
+		if( ! env_var_is_user_settable( name ) )
+			continue;
+
+		env_var_t val = env_get_string( name );
+		if( val.missing() )
+			continue;
+
+		snapshot_var_t &var = state.vars[name];
+		var.val = val;
+		var.exportv = exported_set.find( name ) != exported_set.end();
+	}
+
+	wcstring_list_t functions = function_get_names( 1 );
+	for( size_t i=0; i<functions.size(); i++ )
+	{
+		if( ! function_is_autoloaded( functions.at( i ) ) )
+			state.functions.insert( functions.at( i ) );
+	}
+
+	wcstring_list_t completions;
+	if( exec_subshell( L"complete", completions ) != -1 )
+	{
+		state.completions.insert( completions.begin(), completions.end() );
+	}
+}
+
+/**
+   Appends the commands that turn the state before into the state after
+   to out. Returns false if the difference can't be written down.
+*/
+static bool snapshot_get_script( const snapshot_state_t &before, const snapshot_state_t &after, wcstring &out )
+{
+	snapshot_var_map_t::const_iterator iter;
+	for( iter = after.vars.begin(); iter != after.vars.end(); ++iter )
+	{
+		snapshot_var_map_t::const_iterator old = before.vars.find( iter->first );
+		if( old != before.vars.end() && old->second == iter->second )
+			continue;
+
+		wcstring_list_t elements;
+		tokenize_variable_array( iter->second.val, elements );
+
+		out.append( iter->second.exportv ? L"set -gx " : L"set -g " );
+		out.append( escape_string( iter->first, 1 ) );
+		for( size_t i=0; i<elements.size(); i++ )
+		{
+			out.push_back( L' ' );
+			out.append( escape_string( elements.at( i ), 1 ) );
+		}
+		out.push_back( L'\n' );
+	}
+
+	for( iter = before.vars.begin(); iter != before.vars.end(); ++iter )
+	{
+		if( after.vars.find( iter->first ) == after.vars.end() )
+		{
+			out.append( L"set -e -g " );
+			out.append( escape_string( iter->first, 1 ) );
+			out.push_back( L'\n' );
+		}
+	}
+
+	std::set<wcstring>::const_iterator name;
+	for( name = before.functions.begin(); name != before.functions.end(); ++name )
+	{
+		if( after.functions.find( *name ) == after.functions.end() )
+		{
+			out.append( L"functions -e -- " );
+			out.append( escape_string( *name, 1 ) );
+			out.push_back( L'\n' );
+		}
+	}
+
+	for( name = after.functions.begin(); name != after.functions.end(); ++name )
+	{
+		if( before.functions.find( *name ) != before.functions.end() )
+			continue;
+
+		wcstring_list_t lines;
+		if( exec_subshell( L"functions -- " + escape_string( *name, 1 ), lines ) != 0 )
+			return false;
+
+		for( size_t i=0; i<lines.size(); i++ )
+		{
+			out.append( lines.at( i ) );
+			out.push_back( L'\n' );
+		}
+	}
+
+	for( name = after.completions.begin(); name != after.completions.end(); ++name )
+	{
+		if( before.completions.find( *name ) == before.completions.end() )
+		{
+			out.append( *name );
+			out.push_back( L'\n' );
+		}
+	}
+	return true;
+}
+
+/**
+   Returns whether the snapshot file starts with the specified key
+*/
+static bool snapshot_matches( const wcstring &path, const std::string &key )
+{
+	FILE *f = wfopen( path, "r" );
+	if( ! f )
+		return false;
+
+	const std::string header = SNAPSHOT_HEADER + key + "\n";
+	char buff[64];
+	bool res = fgets( buff, sizeof buff, f ) && header == buff;
+	fclose( f );
+	return res;
+}
+
+/**
+   Writes the snapshot file, replacing an existing one at once, so that
+   another fish starting at the same time never reads half of it
+*/
+static void snapshot_write( const wcstring &path, const std::string &key, const wcstring &script )
+{
+	const std::string contents = SNAPSHOT_HEADER + key + "\n" + wcs2string( script );
+	const wcstring tmp_path = path + format_string( L".tmp.%d", (int)getpid() );
+
+	int fd = wopen_cloexec( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+	if( fd == -1 )
+		return;
+
+	bool ok = write_loop( fd, contents.data(), contents.size() ) == (ssize_t)contents.size();
+	if( close( fd ) )
+		ok = false;
+
+	if( ! ok || wrename( tmp_path, path ) )
+	{
+		debug( 1, _( L"Could not write startup snapshot to '%ls'" ), path.c_str() );
+		wunlink( tmp_path );
+	}
+}
+
+/**
+   Evaluates the init files
+*/
+static void snapshot_eval_files( parser_t &parser, const wcstring_list_t &files )
+{
+	for( size_t i=0; i<files.size(); i++ )
+	{
+		wcstring cmd = L"builtin . " + escape_string( files.at( i ), 1 ) + L" 2>/dev/null";
+		parser.eval( cmd, 0, TOP );
+	}
+}
+
+void snapshot_eval_init_files( const wcstring_list_t &files )
+{
+	parser_t &parser = parser_t::principal_parser();
+	wcstring config_dir;
+
+	if( env_get_string( SNAPSHOT_VAR ).missing_or_empty() || ! path_get_config( config_dir ) )
+	{
+		snapshot_eval_files( parser, files );
+		return;
+	}
+
+	const wcstring path = config_dir + SNAPSHOT_FILE;
+	const std::string key = snapshot_key( files );
+
+	if( snapshot_matches( path, key ) )
+	{
+		debug( 3, L"Using startup snapshot %s", key.c_str() );
+		parser.eval( L"builtin . " + escape_string( path, 1 ), 0, TOP );
+		return;
+	}
+
+	snapshot_state_t before, after;
+	snapshot_get_state( before );
+	snapshot_eval_files( parser, files );
+	snapshot_get_state( after );
+
+	wcstring script;
+	if( snapshot_get_script( before, after, script ) )
+		snapshot_write( path, key, script );
+}
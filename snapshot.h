@@ -0,0 +1,29 @@
+/** \file snapshot.h
+
+	Startup snapshots. Evaluating the init files mostly defines the same
+	functions, completions and global variables on every start. When the
+	variable fish_startup_snapshot is set, fish saves what the init files
+	did as a script of plain \c set, \c function and \c complete
+	commands, and runs that script instead of the init files as long as
+	nothing they could depend on has changed.
+*/
+
+#ifndef FISH_SNAPSHOT_H
+#define FISH_SNAPSHOT_H
+
+#include "common.h"
+
+/**
+   Evaluates the specified init files, each as if by <tt>builtin
+   . FILE 2>/dev/null</tt>, or replays a snapshot of what they did.
+
+   A snapshot is only used if it was made from the same init files,
+   unchanged, with the same environment, universal variables, working
+   directory and login and interactive modes. Since it only restores
+   global variables, functions and completions, it is only made when
+   fish_startup_snapshot is set, by users whose init files don't do
+   anything else.
+*/
+void snapshot_eval_init_files( const wcstring_list_t &files );
+
+#endif
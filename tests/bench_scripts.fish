@@ -0,0 +1,53 @@
+#!/usr/local/bin/fish
+#
+# Measures how long fish takes to run the workload_*.fish scripts.
+# Every run of ../fish appends what it used to a file when it exits,
+# see FISH_EXIT_STATS in profiler.h, and the median wall and CPU time
+# in milliseconds, the number of forks and the largest peak RSS of
+# each workload are printed. The output of the workloads is discarded.
+#
+# Usage: ../fish bench_scripts.fish [RUNS] [WORKLOAD...]
+
+set -l runs 3
+if set -q argv[1]
+	set runs $argv[1]
+	set -e argv[1]
+end
+
+set -l workloads workload_*.fish
+if set -q argv[1]
+	set workloads
+	for i in $argv
+		set workloads $workloads workload_$i.fish
+	end
+end
+
+function bench_stat -d "Print the values of the stat given by the first argument in a stats file, sorted"
+	awk -v stat=$argv[1] '$1 == stat { print $2 }' $argv[2] | sort -n
+end
+
+function bench_median -d "Print the median of the arguments"
+	set -l count (count $argv)
+	set -l idx (math "($count + 1) / 2")
+	echo $argv[$idx]
+end
+
+set -l stats bench.tmp.stats
+
+printf "%-20s %10s %10s %10s %8s %10s\n" workload wall_ms cpu_ms child_ms forks maxrss_kb
+for workload in $workloads
+	rm -f $stats
+	for i in (seq $runs)
+		env FISH_EXIT_STATS=$stats ../fish $workload >/dev/null
+	end
+
+	printf "%-20s" (echo $workload | sed -e 's/^workload_//' -e 's/\.fish$//')
+	for stat in wall cpu child_cpu
+		printf " %10s" (math (bench_median (bench_stat $stat $stats)) / 1000)
+	end
+	printf " %8s" (bench_median (bench_stat forks $stats))
+	set -l rss (bench_stat maxrss $stats)
+	printf " %10s\n" $rss[-1]
+end
+
+rm -f $stats
@@ -0,0 +1,67 @@
+#!/usr/local/bin/fish
+#
+# Measures how long fish takes to start, both interactively and when
+# running a command. Every run of ../fish appends its startup trace to
+# a file, see FISH_STARTUP_TRACE in profiler.h, and the percentiles of
+# each phase are printed in microseconds.
+#
+# Usage: ../fish bench_startup.fish [RUNS]
+
+set -l runs 50
+if set -q argv[1]
+	set runs $argv[1]
+end
+
+function bench_percentile -d "Print the percentile given by the first argument of the other arguments"
+	set -l p $argv[1]
+	set -e argv[1]
+	set -l values (printf "%s\n" $argv | sort -n)
+	set -l count (count $values)
+	set -l idx (math "($count * $p + 99) / 100")
+	if test $idx -lt 1
+		set idx 1
+	end
+	echo $values[$idx]
+end
+
+function bench_report -d "Print the percentiles of every phase in a trace file"
+	printf "%-16s %8s %8s %8s %8s\n" phase p50 p90 p99 max
+	for phase in (cut -d ' ' -f 1 $argv[1] | awk '!seen[$0]++')
+		set -l values (awk -v phase=$phase '$1 == phase { print $2 }' $argv[1])
+		printf "%-16s" $phase
+		for p in 50 90 99 100
+			printf " %8s" (bench_percentile $p $values)
+		end
+		echo
+	end
+end
+
+function bench_interactive -d "Start ../fish on a terminal, let it show a prompt and exit, tracing to the given file"
+	# There is no prompt without a terminal, and script provides one.
+	# The util-linux one runs its command with $SHELL, the BSD one
+	# doesn't take -c.
+	if env SHELL=/bin/sh script -qec true /dev/null >/dev/null ^/dev/null
+		echo exit | env SHELL=/bin/sh FISH_STARTUP_TRACE=$argv[1] script -qec "../fish -i" /dev/null
+	else
+		echo exit | env FISH_STARTUP_TRACE=$argv[1] script -q /dev/null ../fish -i
+	end
+end
+
+set -l trace bench.tmp.trace
+
+echo Measuring $runs non-interactive starts
+rm -f $trace
+for i in (seq $runs)
+	env FISH_STARTUP_TRACE=$trace ../fish -c true
+end
+bench_report $trace
+
+echo
+echo Measuring $runs interactive starts
+rm -f $trace
+for i in (seq $runs)
+	bench_interactive $trace >/dev/null ^/dev/null
+end
+bench_report $trace
+
+rm -f $trace
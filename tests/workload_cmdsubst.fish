@@ -0,0 +1,17 @@
+# Iterating over the output of large command substitutions.
+
+set -l count 0
+for x in (seq 30000)
+	set count (math $count + 1)
+end
+
+for line in (seq 10000 | sed -e 's/^/line /')
+	set count (math $count - 1)
+end
+
+set -l words
+for i in (seq 200)
+	set words $words (echo word$i)
+end
+
+echo $count (count $words)
@@ -0,0 +1,24 @@
+# Storms of events with several handlers each.
+
+set -g bench_events 0
+set -g bench_variable_events 0
+
+for i in (seq 5)
+	function bench_handler_$i --on-event bench_event
+		set bench_events (math $bench_events + 1)
+	end
+end
+
+function bench_variable_handler --on-variable bench_watched
+	set bench_variable_events (math $bench_variable_events + 1)
+end
+
+for i in (seq 2000)
+	emit bench_event
+end
+
+for i in (seq 2000)
+	set -g bench_watched $i
+end
+
+echo $bench_events $bench_variable_events
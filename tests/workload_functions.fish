@@ -0,0 +1,31 @@
+# Deeply nested and recursive function calls.
+
+function bench_depth -d "Call itself until the argument reaches zero"
+	if test $argv[1] -gt 0
+		bench_depth (math $argv[1] - 1)
+	else
+		echo bottom
+	end
+end
+
+function bench_outer
+	bench_middle $argv
+end
+
+function bench_middle
+	bench_inner $argv
+end
+
+function bench_inner
+	echo $argv
+end
+
+for i in (seq 100)
+	bench_depth 50 >/dev/null
+end
+
+for i in (seq 2000)
+	bench_outer $i >/dev/null
+end
+
+echo done
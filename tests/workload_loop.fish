@@ -0,0 +1,21 @@
+# Loops of the builtins that scripts run the most: set, test, math
+# and contains.
+
+set -l i 0
+set -l total 0
+while test $i -lt 10000
+	set i (math $i + 1)
+	if test (math "$i % 3") -eq 0
+		set total (math $total + $i)
+	end
+end
+
+set -l list
+for i in (seq 500)
+	set list $list $i
+	if contains $i 13 250 499
+		set total (math $total - 1)
+	end
+end
+
+echo $total (count $list)
@@ -0,0 +1,42 @@
+# Function calls that build, split and compare strings.
+
+function bench_join -d "Join the arguments with commas"
+	set -l result
+	for arg in $argv
+		if test -z "$result"
+			set result $arg
+		else
+			set result "$result,$arg"
+		end
+	end
+	echo $result
+end
+
+function bench_classify -d "Print the kind of file name the argument is"
+	switch $argv[1]
+		case '*.c' '*.cpp' '*.h'
+			echo source
+		case '*.txt' '*.md'
+			echo text
+		case '*'
+			echo other
+	end
+end
+
+set -l words alpha beta gamma delta epsilon zeta eta theta iota kappa
+set -l extensions c txt h md sh cpp py
+set -l joined
+set -l kinds 0 0 0
+for i in (seq 2000)
+	set joined (bench_join $words $i)
+	switch (bench_classify file$i.$extensions[(math "$i % 7 + 1")])
+		case source
+			set kinds[1] (math $kinds[1] + 1)
+		case text
+			set kinds[2] (math $kinds[2] + 1)
+		case other
+			set kinds[3] (math $kinds[3] + 1)
+	end
+end
+
+echo $joined $kinds
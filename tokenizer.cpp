@@ -14,6 +14,7 @@ segments.
 #include <wctype.h>
 #include <string.h>
 #include <unistd.h>
+#include <algorithm>
 
 
 #include "fallback.h"
@@ -85,6 +86,9 @@ static const wchar_t *tok_desc[] =
 */
 static int check_size( tokenizer *tok, size_t len )
 {
+	/* The buffer is about to be written, so it no longer lags behind */
+	tok->last_pending = false;
+	
 	if( tok->last_len <= len )
 	{
 		wchar_t *tmp;
@@ -100,6 +104,35 @@ static int check_size( tokenizer *tok, size_t len )
 	return 1;
 }
 
+/**
+   Set the latest token string to be the specified part of the
+   original string, without copying it until tok_last is called
+*/
+static void tok_set_text( tokenizer *tok, const wchar_t *start, size_t len )
+{
+	tok->last_pending = true;
+	tok->last_text = start;
+	tok->last_text_len = len;
+}
+
+/**
+   Copy the latest token string to tok->last, if tok_set_text was used
+   to set it
+*/
+static void tok_copy_text( tokenizer *tok )
+{
+	if( !tok->last_pending )
+		return;
+	
+	const wchar_t *start = tok->last_text;
+	size_t len = tok->last_text_len;
+	if( !check_size( tok, len ))
+		return;
+	
+	memcpy( tok->last, start, sizeof(wchar_t)*len );
+	tok->last[len] = L'\0';
+}
+
 /**
    Set the latest tokens string to be the specified error message
 */
@@ -123,7 +156,11 @@ int tok_get_error( tokenizer *tok )
 }
 
 
-void tok_init( tokenizer *tok, const wchar_t *b, int flags )
+/**
+   Set up the tokenizer state for tokenizing the string b, without
+   reading the first token.
+*/
+static void tok_init_internal( tokenizer *tok, const wchar_t *b, int flags )
 {
 
     /* We can only generate error messages on the main thread due to wgettext() thread safety issues. */
@@ -145,13 +182,95 @@ void tok_init( tokenizer *tok, const wchar_t *b, int flags )
 
 	tok->has_next = (*b != L'\0');
 	tok->orig_buff = tok->buff = b;
+}
+
+void tok_init( tokenizer *tok, const wchar_t *b, int flags )
+{
+	tok_init_internal( tok, b, flags );
 	tok_next( tok );
 }
 
+void tok_init_cached( tokenizer *tok, const wchar_t *b, const tok_cache_t *cache, int flags )
+{
+	tok_init_internal( tok, b, flags );
+	if( b && cache && cache->flags == flags && cache->length == wcslen( b ) )
+	{
+		tok->cache = cache;
+	}
+	tok_next( tok );
+}
+
+/**
+   Find the offsets at which the lines of the string start
+*/
+static void find_line_starts( const wchar_t *b, std::vector<int> &line_starts )
+{
+	line_starts.clear();
+	line_starts.push_back( 0 );
+	for( const wchar_t *c = b; *c; c++ )
+	{
+		if( *c == L'\n' )
+			line_starts.push_back( (int)( c - b ) + 1 );
+	}
+}
+
+void tok_cache_build( tok_cache_t *cache, const wchar_t *b, int flags )
+{
+	tokenizer tok;
+
+	CHECK( cache, );
+	CHECK( b, );
+
+	cache->flags = flags;
+	cache->length = wcslen( b );
+	cache->tokens.clear();
+	find_line_starts( b, cache->line_starts );
+
+	tok_init_internal( &tok, b, flags );
+	while( tok.has_next && tok.last_type != TOK_ERROR )
+	{
+		tok_cache_entry_t entry;
+		entry.start = tok.buff - tok.orig_buff;
+
+		tok_next( &tok );
+
+		entry.end = tok.buff - tok.orig_buff;
+		entry.pos = tok.last_pos;
+		entry.type = tok.last_type;
+		entry.has_next = tok.has_next;
+		entry.quote = tok.last_quote;
+		entry.error = tok.error;
+		entry.has_text = ( tok.last_type != TOK_END && tok.last_type != TOK_BACKGROUND );
+		if( entry.has_text && tok.last_type != TOK_STRING && tok.last_type != TOK_COMMENT && tok_last( &tok ) )
+			entry.text = tok_last( &tok );
+		cache->tokens.push_back( entry );
+	}
+	tok_destroy( &tok );
+}
+
+void tok_cache_all( tokenizer *tok )
+{
+	CHECK( tok, );
+
+	if( tok->cache || !tok->orig_buff )
+		return;
+
+	tok->own_cache = new tok_cache_t();
+	tok_cache_build( tok->own_cache,
+					 tok->orig_buff,
+					 ( tok->accept_unfinished ? TOK_ACCEPT_UNFINISHED : 0 ) |
+					 ( tok->show_comments ? TOK_SHOW_COMMENTS : 0 ) |
+					 ( tok->squash_errors ? TOK_SQUASH_ERRORS : 0 ) );
+	tok->cache = tok->own_cache;
+	tok->cache_idx = 0;
+}
+
 void tok_destroy( tokenizer *tok )
 {
 	CHECK( tok, );
 	
+	delete tok->own_cache;
+	delete tok->own_line_starts;
 	free( tok->last );
 	if( tok->free_orig )
 		free( (void *)tok->orig_buff );
@@ -169,9 +288,44 @@ wchar_t *tok_last( tokenizer *tok )
 {
 	CHECK( tok, 0 );
 	
+	tok_copy_text( tok );
 	return tok->last;
 }
 
+size_t tok_last_length( tokenizer *tok )
+{
+	CHECK( tok, 0 );
+	
+	if( tok->last_pending )
+		return tok->last_text_len;
+	return tok->last ? wcslen( tok->last ) : 0;
+}
+
+const wchar_t *tok_last_view( tokenizer *tok )
+{
+	CHECK( tok, 0 );
+	
+	if( tok->last_pending )
+		return tok->last_text;
+	return tok->last ? tok->last : L"";
+}
+
+wcstring tok_last_string( tokenizer *tok )
+{
+	CHECK( tok, wcstring() );
+	
+	return wcstring( tok_last_view( tok ), tok_last_length( tok ) );
+}
+
+bool tok_last_equals( tokenizer *tok, const wchar_t *str )
+{
+	CHECK( tok, false );
+	CHECK( str, false );
+	
+	size_t len = tok_last_length( tok );
+	return wcslen( str ) == len && wmemcmp( tok_last_view( tok ), str, len ) == 0;
+}
+
 int tok_has_next( tokenizer *tok )
 {
 	/*
@@ -394,11 +548,7 @@ static void read_string( tokenizer *tok )
 
 	len = tok->buff - start;
 
-	if( !check_size( tok, len ))
-		return;
-
-	memcpy( tok->last, start, sizeof(wchar_t)*len );
-	tok->last[len] = L'\0';
+	tok_set_text( tok, start, len );
 	tok->last_type = TOK_STRING;
 }
 
@@ -415,11 +565,7 @@ static void read_comment( tokenizer *tok )
 		tok->buff++;
 
 	len = tok->buff - start;
-	if( !check_size( tok, len ))
-		return;
-
-	memcpy( tok->last, start, sizeof(wchar_t)*len );
-	tok->last[len] = L'\0';
+	tok_set_text( tok, start, len );
 	tok->last_type = TOK_COMMENT;
 }
 
@@ -521,6 +667,57 @@ const wchar_t *tok_get_desc( int type )
 }
 
 
+/**
+   Comparison function used to look up a cached token by start offset
+*/
+static bool tok_cache_entry_before( const tok_cache_entry_t &entry, int start )
+{
+	return entry.start < start;
+}
+
+/**
+   Read the next token from the tokenizer cache, if the current
+   position was recorded in it.
+
+   \return true if the token was found in the cache, false if it needs to be lexed
+*/
+static bool tok_replay( tokenizer *tok )
+{
+	const std::vector<tok_cache_entry_t> &tokens = tok->cache->tokens;
+	int start = tok->buff - tok->orig_buff;
+	size_t idx = tok->cache_idx;
+
+	if( idx >= tokens.size() || tokens[idx].start != start )
+	{
+		/* Not a sequential read, e.g. after tok_set_pos */
+		std::vector<tok_cache_entry_t>::const_iterator iter = std::lower_bound( tokens.begin(), tokens.end(), start, tok_cache_entry_before );
+		if( iter == tokens.end() || iter->start != start )
+			return false;
+		idx = iter - tokens.begin();
+	}
+
+	const tok_cache_entry_t &entry = tokens[idx];
+	if( entry.type == TOK_STRING || entry.type == TOK_COMMENT )
+	{
+		/* These are a part of the string, there is no need to copy them */
+		tok_set_text( tok, tok->orig_buff + entry.pos, entry.end - entry.pos );
+	}
+	else if( entry.has_text )
+	{
+		if( !check_size( tok, entry.text.size() ) )
+			return false;
+		wcscpy( tok->last, entry.text.c_str() );
+	}
+	tok->buff = tok->orig_buff + entry.end;
+	tok->last_pos = entry.pos;
+	tok->last_type = entry.type;
+	tok->has_next = entry.has_next;
+	tok->last_quote = entry.quote;
+	tok->error = entry.error;
+	tok->cache_idx = idx + 1;
+	return true;
+}
+
 void tok_next( tokenizer *tok )
 {
 
@@ -540,6 +737,9 @@ void tok_next( tokenizer *tok )
 		return;
 	}
 
+	if( tok->cache && tok_replay( tok ) )
+		return;
+
 	while( 1 )
 	{
 		if( my_iswspace(*(tok->buff) ) )
@@ -690,6 +890,33 @@ void tok_set_pos( tokenizer *tok, int pos )
 	tok_next( tok );
 }
 
+int tok_get_lineno( tokenizer *tok, int pos, int *line_start )
+{
+	CHECK( tok, 0 );
+	CHECK( tok->orig_buff, 0 );
+
+	const std::vector<int> *line_starts;
+	if( tok->cache )
+	{
+		line_starts = &tok->cache->line_starts;
+	}
+	else
+	{
+		if( ! tok->own_line_starts )
+		{
+			tok->own_line_starts = new std::vector<int>();
+			find_line_starts( tok->orig_buff, *tok->own_line_starts );
+		}
+		line_starts = tok->own_line_starts;
+	}
+
+	/* The line is the last one starting at or before pos */
+	const size_t lineno = std::upper_bound( line_starts->begin(), line_starts->end(), pos ) - line_starts->begin();
+	if( line_start )
+		*line_start = lineno ? line_starts->at( lineno - 1 ) : 0;
+	return lineno ? (int)lineno : 1;
+}
+
 
 #ifdef TOKENIZER_TEST
 
@@ -10,6 +10,9 @@
 #define FISH_TOKENIZER_H
 
 #include <wchar.h>
+#include <vector>
+
+#include "common.h"
 
 /**
    Token types
@@ -61,6 +64,50 @@ enum tokenizer_error
 */
 #define TOK_SQUASH_ERRORS 4
 
+/**
+   A single token recorded by tok_cache_build, together with the
+   tokenizer state needed to replay it without lexing the string again.
+*/
+struct tok_cache_entry_t
+{
+	/** Offset in the original string where tokenizing of this token started */
+	int start;
+	/** Offset in the original string where tokenizing of the next token starts */
+	int end;
+	/** Offset of the token itself, as returned by tok_get_pos */
+	int pos;
+	/** Type of the token */
+	int type;
+	/** Value of the has_next flag after reading this token */
+	int has_next;
+	/** Type of last quote */
+	wchar_t quote;
+	/** Error type, for TOK_ERROR tokens */
+	int error;
+	/** Whether reading this token assigns the token string */
+	bool has_text;
+	/** The token string. Empty for TOK_STRING and TOK_COMMENT tokens, which are read from the original string instead */
+	wcstring text;
+};
+
+/**
+   A pre-tokenized representation of a string. Strings that are
+   evaluated over and over again, like function definitions, can be
+   tokenized once using tok_cache_build and then replayed using
+   tok_init_cached.
+*/
+struct tok_cache_t
+{
+	/** The flags the string was tokenized with */
+	int flags;
+	/** Length of the tokenized string */
+	size_t length;
+	/** All tokens, ordered by start offset */
+	std::vector<tok_cache_entry_t> tokens;
+	/** The offsets at which the lines of the string start, for tok_get_lineno */
+	std::vector<int> line_starts;
+};
+
 
 /**
    The tokenizer struct. 
@@ -73,6 +120,12 @@ struct tokenizer
 	const wchar_t *orig_buff;
 	/** A pointer to the last token*/
 	wchar_t *last;
+	/** Whether the last token string has yet to be copied to last from last_text */
+	bool last_pending;
+	/** The last token string in orig_buff, if last_pending is set */
+	const wchar_t *last_text;
+	/** Length of last_text */
+	size_t last_text_len;
 	
 	/** Type of last token*/
 	int last_type;
@@ -95,6 +148,15 @@ struct tokenizer
     
     /* Whether we are squashing errors */
     bool squash_errors;
+    
+	/** Pre-tokenized representation of orig_buff, or null */
+	const tok_cache_t *cache;
+	/** The cache built by tok_cache_all, which the tokenizer frees, or null */
+	tok_cache_t *own_cache;
+	/** Index of the cached token expected to be read next */
+	size_t cache_idx;
+	/** The offsets at which the lines of orig_buff start, built by tok_get_lineno when there is no cache, or null */
+	std::vector<int> *own_line_starts;
 };
 
 /**
@@ -111,6 +173,28 @@ struct tokenizer
 */
 void tok_init( tokenizer *tok, const wchar_t *b, int flags );
 
+/**
+  Initialize the tokenizer like tok_init, but replay tokens from the
+  specified cache instead of lexing the string where possible. The
+  cache must have been built from the same string using the same
+  flags, otherwise it is ignored.
+*/
+void tok_init_cached( tokenizer *tok, const wchar_t *b, const tok_cache_t *cache, int flags );
+
+/**
+  Tokenize the whole string b and store the result in cache, for later
+  use with tok_init_cached.
+*/
+void tok_cache_build( tok_cache_t *cache, const wchar_t *b, int flags );
+
+/**
+  Tokenize the whole string of tok, unless its tokens are already
+  cached, and replay them from now on. This is used when parts of the
+  string are about to be read over and over again, like the body of a
+  loop.
+*/
+void tok_cache_all( tokenizer *tok );
+
 /**
   Jump to the next token.
 */
@@ -122,10 +206,40 @@ void tok_next( tokenizer *tok );
 int tok_last_type( tokenizer *tok );
 
 /**
-  Returns the last token string. The string should not be freed by the caller.
+  Returns the last token string. The string should not be freed by the
+  caller. String and comment tokens are copied out of the original
+  string the first time this is called for them, so when only the
+  length or a comparison is needed, use tok_last_length, tok_last_view
+  or tok_last_equals instead.
 */
 wchar_t *tok_last( tokenizer *tok );
 
+/**
+  Returns the length of the last token string. Unlike calling wcslen
+  on tok_last, this does not need the token to be copied out of the
+  original string.
+*/
+size_t tok_last_length( tokenizer *tok );
+
+/**
+  Returns the last token string without copying it. For string and
+  comment tokens, this points into the original string. The result is
+  not null terminated, its length is given by tok_last_length.
+*/
+const wchar_t *tok_last_view( tokenizer *tok );
+
+/**
+  Returns whether the last token string is equal to str, without
+  copying it
+*/
+bool tok_last_equals( tokenizer *tok, const wchar_t *str );
+
+/**
+  Returns a copy of the last token string, made directly from the
+  original string instead of going through tok_last
+*/
+wcstring tok_last_string( tokenizer *tok );
+
 /**
   Returns the type of quote from the last TOK_QSTRING
 */
@@ -167,6 +281,15 @@ wchar_t *tok_first( const wchar_t *str );
 */
 void tok_set_pos( tokenizer *tok, int pos );
 
+/**
+   Returns the number of the line, counting from 1, that the specified
+   position in the original string is on. If line_start is not null,
+   the position where that line starts is returned there. The line
+   starts are found once per string and kept with its cached tokens,
+   so this is a binary search.
+*/
+int tok_get_lineno( tokenizer *tok, int pos, int *line_start = NULL );
+
 /**
    Returns a string description of the specified token type
 */
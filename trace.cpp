@@ -0,0 +1,242 @@
+/** \file trace.cpp
+
+	Trace points with a ring buffer per thread.
+
+	Only the thread that owns a buffer writes to it. It fills in an
+	event before it counts it as written, and whoever reads the buffer
+	checks the count again afterwards, to drop the events that may have
+	been overwritten while they were being read.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <vector>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "common.h"
+#include "wutil.h"
+#include "trace.h"
+
+/**
+   The environment variable with the name of the trace file
+*/
+#define TRACE_VAR "FISH_TRACE"
+
+/**
+   An event recorded by a trace point
+*/
+struct trace_event_t
+{
+	/** The name of the trace point */
+	const char *name;
+
+	/** When it started, in microseconds */
+	long long start;
+
+	/** How long it took, in microseconds */
+	long long duration;
+};
+
+/**
+   The events of a thread
+*/
+struct trace_buffer_t
+{
+	/** The number the thread is shown as */
+	int tid;
+
+	/** Whether this is the buffer of the main thread */
+	bool main;
+
+	/** The number of events ever written. Event i is at index i % TRACE_BUFFER_SIZE. */
+	volatile unsigned long written;
+
+	/** The number of events that were written when the trace was last reset */
+	volatile unsigned long reset;
+
+	trace_event_t events[TRACE_BUFFER_SIZE];
+};
+
+bool g_trace_enabled = false;
+
+/** The buffers of all threads that have passed a trace point, in the order they did */
+static std::vector<trace_buffer_t *> s_buffers;
+
+/** The lock protecting s_buffers */
+static pthread_mutex_t s_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The key of the buffer of every thread */
+static pthread_key_t s_buffer_key;
+
+static pthread_once_t s_buffer_key_once = PTHREAD_ONCE_INIT;
+
+/** The file that the trace is written to on exit, or NULL */
+static char *s_trace_file = NULL;
+
+static void make_buffer_key()
+{
+	VOMIT_ON_FAILURE( pthread_key_create( &s_buffer_key, NULL ) );
+}
+
+/**
+   Returns the buffer of the calling thread, creating it if needed.
+   Threads in fish live as long as fish does, so buffers are never freed.
+*/
+static trace_buffer_t *get_buffer()
+{
+	VOMIT_ON_FAILURE( pthread_once( &s_buffer_key_once, make_buffer_key ) );
+	trace_buffer_t *buffer = static_cast<trace_buffer_t *>( pthread_getspecific( s_buffer_key ) );
+	if( ! buffer )
+	{
+		buffer = new trace_buffer_t();
+		buffer->written = 0;
+		buffer->reset = 0;
+		buffer->main = is_main_thread();
+
+		scoped_lock lock( s_buffers_lock );
+		buffer->tid = (int)s_buffers.size() + 1;
+		s_buffers.push_back( buffer );
+		VOMIT_ON_FAILURE( pthread_setspecific( s_buffer_key, buffer ) );
+	}
+	return buffer;
+}
+
+bool trace_is_supported()
+{
+#if USE_TRACE
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool trace_is_enabled()
+{
+	return g_trace_enabled;
+}
+
+void trace_set_enabled( bool enabled )
+{
+	g_trace_enabled = enabled && trace_is_supported();
+}
+
+void trace_reset()
+{
+	scoped_lock lock( s_buffers_lock );
+	for( size_t i=0; i<s_buffers.size(); i++ )
+	{
+		s_buffers.at( i )->reset = s_buffers.at( i )->written;
+	}
+}
+
+void trace_add( const char *name, long long start, long long duration )
+{
+	trace_buffer_t *buffer = get_buffer();
+	unsigned long idx = buffer->written;
+	trace_event_t &event = buffer->events[idx % TRACE_BUFFER_SIZE];
+	event.name = name;
+	event.start = start;
+	event.duration = duration;
+
+	/* Readers must not see the count before the event */
+	__sync_synchronize();
+	buffer->written = idx + 1;
+}
+
+void trace_write_json( wcstring &out )
+{
+	const long pid = (long)getpid();
+	std::vector<trace_event_t> events;
+
+	out.append( L"{\"traceEvents\":[\n" );
+	bool first = true;
+
+	scoped_lock lock( s_buffers_lock );
+	for( size_t i=0; i<s_buffers.size(); i++ )
+	{
+		const trace_buffer_t *buffer = s_buffers.at( i );
+
+		append_format( out, L"%ls{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%d,\"args\":{\"name\":\"%ls\"}}",
+					   first ? L"" : L",\n", pid, buffer->tid, buffer->main ? L"main" : L"thread" );
+		first = false;
+
+		/* Copy the events, then drop the ones that the thread may have overwritten in the meantime */
+		const unsigned long end = buffer->written;
+		__sync_synchronize();
+		unsigned long begin = end > TRACE_BUFFER_SIZE ? end - TRACE_BUFFER_SIZE : 0;
+		if( begin < buffer->reset )
+			begin = buffer->reset;
+
+		events.clear();
+		for( unsigned long idx = begin; idx < end; idx++ )
+		{
+			events.push_back( buffer->events[idx % TRACE_BUFFER_SIZE] );
+		}
+
+		__sync_synchronize();
+		const unsigned long now_written = buffer->written;
+		const unsigned long valid = now_written > TRACE_BUFFER_SIZE ? now_written - TRACE_BUFFER_SIZE : 0;
+
+		for( unsigned long idx = begin; idx < end; idx++ )
+		{
+			if( idx < valid )
+				continue;
+			const trace_event_t &event = events.at( idx - begin );
+			append_format( out, L",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+						   event.name, pid, buffer->tid, event.start, event.duration );
+		}
+	}
+
+	out.append( L"\n]}\n" );
+}
+
+void trace_init()
+{
+	const char *file = getenv( TRACE_VAR );
+	if( ! file || ! *file )
+		return;
+
+	if( ! trace_is_supported() )
+	{
+		debug( 1, _( L"This fish was built without trace points, %s is ignored" ), TRACE_VAR );
+		return;
+	}
+
+	s_trace_file = strdup( file );
+	trace_set_enabled( true );
+
+	/* Only this fish is traced, not the ones it starts */
+	unsetenv( TRACE_VAR );
+}
+
+void trace_finish()
+{
+	if( ! s_trace_file )
+		return;
+
+	trace_set_enabled( false );
+
+	wcstring json;
+	trace_write_json( json );
+	const std::string narrow = wcs2string( json );
+
+	int fd = open( s_trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd == -1 || write_loop( fd, narrow.data(), narrow.size() ) != (ssize_t)narrow.size() )
+	{
+		debug( 1, _( L"Could not write trace to '%s'" ), s_trace_file );
+	}
+	if( fd != -1 )
+		close( fd );
+
+	free( s_trace_file );
+	s_trace_file = NULL;
+}
@@ -0,0 +1,124 @@
+/** \file trace.h
+
+	Trace points in the hot paths of fish, like reading keys, redrawing
+	the screen, highlighting, completing and running jobs. While tracing
+	is enabled, every trace point that is passed records when it started
+	and how long it took in a ring buffer that belongs to the thread
+	that passed it, so that the threads never wait for each other. The
+	last TRACE_BUFFER_SIZE events of every thread can then be written in
+	the JSON format of the Chrome trace viewer, which Perfetto reads too.
+
+	Tracing is enabled by <tt>profile --trace --start</tt>, and from the
+	start when the environment variable FISH_TRACE names a file, which
+	the trace is written to when fish exits. Trace points can be
+	compiled out with <tt>./configure --without-trace</tt>, which leaves
+	a disabled trace that is always empty.
+*/
+
+#ifndef FISH_TRACE_H
+#define FISH_TRACE_H
+
+#include "config.h"
+#include "common.h"
+#include "util.h"
+
+/**
+   The number of events kept for every thread
+*/
+#define TRACE_BUFFER_SIZE 8192
+
+/**
+   Whether fish was built with trace points
+*/
+bool trace_is_supported();
+
+/**
+   Returns whether trace points are recording
+*/
+bool trace_is_enabled();
+
+/**
+   Starts or stops recording trace points. Does nothing if fish was
+   built without trace points.
+*/
+void trace_set_enabled( bool enabled );
+
+/**
+   Forgets the events recorded so far
+*/
+void trace_reset();
+
+/**
+   Appends the recorded events of all threads to out, as a JSON object
+   in the Chrome trace event format
+*/
+void trace_write_json( wcstring &out );
+
+/**
+   Enables tracing if FISH_TRACE is set. This should be called as early
+   as possible.
+*/
+void trace_init();
+
+/**
+   Writes the trace to the file named by FISH_TRACE when tracing was
+   enabled by trace_init. This should be called just before fish exits.
+*/
+void trace_finish();
+
+/**
+   Records an event with the specified name, which must be a string
+   constant, start and duration in microseconds. This may be called
+   from any thread.
+*/
+void trace_add( const char *name, long long start, long long duration );
+
+#if USE_TRACE
+
+/**
+   Whether trace points are recording. Only use this through
+   TRACE_SCOPE, which checks it before doing anything else.
+*/
+extern bool g_trace_enabled;
+
+/**
+   Records the time from its creation to its destruction as an event,
+   if tracing was enabled when it was created
+*/
+class trace_scope_t
+{
+	/** The name of the event, or NULL if tracing was disabled */
+	const char *name;
+
+	/** When the scope was entered */
+	long long start;
+
+	/* No copying */
+	trace_scope_t( const trace_scope_t & );
+	void operator=( const trace_scope_t & );
+
+	public:
+
+	trace_scope_t( const char *n ) : name( g_trace_enabled ? n : NULL ), start( name ? get_time() : 0 )
+	{
+	}
+
+	~trace_scope_t()
+	{
+		if( name )
+			trace_add( name, start, get_time() - start );
+	}
+};
+
+/**
+   A trace point that measures the rest of the enclosing block
+*/
+#define TRACE_SCOPE( name ) trace_scope_t trace_scope( name )
+
+#else
+
+#define TRACE_SCOPE( name )
+
+#endif
+
+#endif
@@ -18,6 +18,7 @@ wildcards using **.
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 
 #include "fallback.h"
@@ -31,7 +32,11 @@ wildcards using **.
 #include "reader.h"
 #include "expand.h"
 #include "exec.h"
+#include "mime.h"
+#include "iothread.h"
+#include "dir_cache.h"
 #include <map>
+#include <set>
 
 /**
    This flag is set in the flags parameter of wildcard_expand if the
@@ -41,15 +46,16 @@ wildcards using **.
 #define WILDCARD_RECURSIVE 64
 
 /**
-   The maximum length of a filename token. This is a fallback value,
-   an attempt to find the true value using patchconf is always made. 
+   The smallest number of files worth stating on a separate thread
+   when completing
 */
-#define MAX_FILE_LENGTH 1024
+#define WILDCARD_FILES_PER_THREAD 256
 
 /**
-   The command to run to get a description from a file suffix
+   The smallest number of subdirectories worth searching on a separate
+   thread
 */
-#define SUFFIX_CMD_STR L"mimedb 2>/dev/null -fd "
+#define WILDCARD_DIRS_PER_THREAD 2
 
 /**
    Description for generic executable
@@ -101,9 +107,6 @@ wildcards using **.
 */
 #define COMPLETE_DIRECTORY_DESC _( L"Directory" )
 
-/** Hashtable containing all descriptions that describe an executable */
-static std::map<wcstring, wcstring> suffix_map;
-
 
 int wildcard_has( const wchar_t *str, int internal )
 {
@@ -135,63 +138,122 @@ int wildcard_has( const wchar_t *str, int internal )
 	return 0;
 }
 
+/**
+   Returns whether the specified character of a wildcard matches any string
+*/
+static bool wildcard_is_any_string( wchar_t c )
+{
+	return c == ANY_STRING || c == ANY_STRING_RECURSIVE;
+}
+
 /**
    Check whether the string str matches the wildcard string wc.
+
+   This does not recurse. When a character doesn't match, it
+   backtracks to the most recent '*' and lets it swallow one more
+   character. Earlier '*'s never need to be retried, since whatever a
+   later '*' can't match, moving an earlier one won't fix. Matching
+   takes at most O(length of str * length of wc) steps.
   
    \param str String to be matched.
+   \param str_end End of the string to be matched.
    \param wc The wildcard.
+   \param wc_end End of the wildcard.
    \param is_first Whether files beginning with dots should not be matched against wildcards. 
 */
-static int wildcard_match2( const wcstring &str_str, 
-							const wcstring &wc_str, 
-							int is_first )
+static bool wildcard_match2( const wchar_t *str,
+							 const wchar_t *str_end,
+							 const wchar_t *wc,
+							 const wchar_t *wc_end,
+							 bool is_first )
 {
-    const wchar_t *str = str_str.c_str();
-    const wchar_t *wc = wc_str.c_str();
-	
-	if( *str == 0 && *wc==0 )
-		return 1;
+	/* Ignore hidden files */
+	if( is_first && str < str_end && *str == L'.' && wc < wc_end &&
+		( *wc == ANY_CHAR || wildcard_is_any_string( *wc ) ) )
+	{
+		return false;
+	}
+
+	/* The position after the last '*' seen, and the position in str it is currently matched up to */
+	const wchar_t *star_wc = NULL, *star_str = NULL;
 	
-	if( *wc == ANY_STRING || *wc == ANY_STRING_RECURSIVE)
-	{		
-		/* Ignore hidden file */
-		if( is_first && *str == L'.' )
+	while( str < str_end )
+	{
+		if( wc < wc_end && wildcard_is_any_string( *wc ) )
 		{
-			return 0;
+			/* Start by letting the '*' match nothing */
+			star_wc = ++wc;
+			star_str = str;
 		}
-		
-		/* Try all submatches */
-		do
+		else if( wc < wc_end && ( *wc == ANY_CHAR || *wc == *str ) )
 		{
-			if( wildcard_match2( str, wc+1, 0 ) )
-				return 1;
+			wc++;
+			str++;
+		}
+		else if( star_wc )
+		{
+			/* Let the last '*' match one more character and try again */
+			wc = star_wc;
+			str = ++star_str;
+		}
+		else
+		{
+			return false;
 		}
-		while( *(str++) != 0 );
-		return 0;
-	}
-	else if( *str == 0 )
-	{
-		/*
-		  End of string, but not end of wildcard, and the next wildcard
-		  element is not a '*', so this is not a match.
-		*/
-		return 0;
 	}
 
-	if( *wc == ANY_CHAR )
+	/* End of string. Any wildcard left must be all '*'s. */
+	while( wc < wc_end && wildcard_is_any_string( *wc ) )
+		wc++;
+	return wc == wc_end;
+}
+
+static bool wildcard_match2( const wcstring &str, const wcstring &wc, bool is_first )
+{
+	return wildcard_match2( str.c_str(), str.c_str() + str.size(), wc.c_str(), wc.c_str() + wc.size(), is_first );
+}
+
+wildcard_matcher_t::wildcard_matcher_t( const wcstring &w ) : wc(w), prefix_len(0), suffix_len(0), has_any_string(false)
+{
+	/* The literal prefix extends up to the first wildcard character */
+	while( prefix_len < wc.size() && wc.at(prefix_len) != ANY_CHAR && ! wildcard_is_any_string( wc.at(prefix_len) ) )
+		prefix_len++;
+
+	/* The literal suffix is whatever follows the last '*', if it contains no '?' */
+	size_t last = wc.size();
+	while( last > prefix_len && ! wildcard_is_any_string( wc.at(last - 1) ) )
+		last--;
+	if( last > prefix_len )
 	{
-		if( is_first && *str == L'.' )
-		{
-			return 0;
-		}
-		
-		return wildcard_match2( str+1, wc+1, 0 );
+		has_any_string = true;
+		if( wc.find( ANY_CHAR, last ) == wcstring::npos )
+			suffix_len = wc.size() - last;
 	}
+}
+
+bool wildcard_matcher_t::matches( const wcstring &str ) const
+{
+	if( str.size() < prefix_len + suffix_len )
+		return false;
+
+	/* Ignore hidden files */
+	if( prefix_len == 0 && ! wc.empty() && ! str.empty() && str.at(0) == L'.' )
+		return false;
+
+	/* Without '*', the string has to be as long as the wildcard */
+	if( ! has_any_string && str.size() != wc.size() )
+		return false;
 	
-	if( *wc == *str )
-		return wildcard_match2( str+1, wc+1, 0 );
+	if( wmemcmp( str.c_str(), wc.c_str(), prefix_len ) )
+		return false;
 
-	return 0;
+	if( suffix_len && wmemcmp( str.c_str() + str.size() - suffix_len, wc.c_str() + wc.size() - suffix_len, suffix_len ) )
+		return false;
+
+	/* Match what is left */
+	return wildcard_match2( str.c_str() + prefix_len, str.c_str() + str.size() - suffix_len,
+							wc.c_str() + prefix_len, wc.c_str() + wc.size() - suffix_len,
+							false );
 }
 
 /**
@@ -312,7 +374,7 @@ bool wildcard_complete(const wcstring &str,
 
 int wildcard_match( const wcstring &str, const wcstring &wc )
 {
-	return wildcard_match2( str, wc, 1 );	
+	return wildcard_match2( str, wc, true );	
 }
 
 /**
@@ -323,90 +385,34 @@ static wcstring make_path(const wcstring &base_dir, const wcstring &name) {
 }
 
 /**
-   Return a description of a file based on its suffix. This function
-   does not perform any caching, it directly calls the mimedb command
-   to do a lookup.
- */
-static wcstring complete_get_desc_suffix_internal( const wcstring &suff )
-{
-
-    wcstring cmd = wcstring(SUFFIX_CMD_STR) + suff;
-    
-    wcstring_list_t lst;
-    wcstring desc;
-	
-	if( exec_subshell( cmd, lst ) != -1 )
-	{
-		if( lst.size()>0 )
-		{
-            const wcstring & ln = lst.at(0);
-			if( ln.size() > 0 && ln != L"unknown" )
-			{
-				desc = ln;
-				/*
-				  I have decided I prefer to have the description
-				  begin in uppercase and the whole universe will just
-				  have to accept it. Hah!
-				*/
-				desc[0]=towupper(desc[0]);
-			}
-		}
-	}
-	
-	if( desc.empty() )
-	{
-		desc = COMPLETE_FILE_DESC;
-	}
-	
-    suffix_map[suff] = desc.c_str();
-	return desc;
-}
-
-
-/**
-   Use the mimedb command to look up a description for a given suffix
+   Returns the suffix that is looked up in the mime database to
+   describe the specified file, or the empty string if the file name
+   has no suffix.
 */
-static wcstring complete_get_desc_suffix( const wchar_t *suff_orig )
+static wcstring file_desc_suffix( const wchar_t *filename )
 {
-
-	int len;
-	wchar_t *suff;
-	wchar_t *pos;
-	wchar_t *tmp;
-
-	len = wcslen(suff_orig );
-	
-	if( len == 0 )
-		return COMPLETE_FILE_DESC;
-
-	suff = wcsdup(suff_orig);
+	const wchar_t *suffix = wcsrchr( filename, L'.' );
+	if( suffix == 0 || wcsrchr( suffix, L'/' ) )
+		return wcstring();
 
 	/*
 	  Drop characters that are commonly used as backup suffixes from the suffix
 	*/
-	for( pos=suff; *pos; pos++ )
-	{
-		if( wcschr( L"?;#~@&", *pos ) )
-		{
-			*pos=0;
-			break;
-		}
-	}
-    
-	tmp = escape( suff, 1 );
-	free(suff);
-	suff = tmp;
-    
-    std::map<wcstring, wcstring>::iterator iter = suffix_map.find(suff);
-    wcstring desc;
-    if (iter != suffix_map.end()) {
-        desc = iter->second;
-    } else {
-        desc = complete_get_desc_suffix_internal( suff );
-    }
-
-	free( suff );
+	wcstring suff = suffix;
+	size_t pos = suff.find_first_of( L"?;#~@&" );
+	if( pos != wcstring::npos )
+		suff.resize( pos );
+	return suff;
+}
 
+/**
+   Look up a description for a given suffix in the mime database
+*/
+static wcstring complete_get_desc_suffix( const wcstring &suff )
+{
+	wcstring desc = mime_describe_suffix( suff );
+	if( desc.empty() )
+		desc = COMPLETE_FILE_DESC;
 	return desc;
 }
 
@@ -431,8 +437,6 @@ static wcstring file_get_desc( const wchar_t *filename,
 									 struct stat buf, 
 									 int err )
 {
-	const wchar_t *suffix;
-
 	CHECK( filename, 0 );
 		
 	if( !lstat_res )
@@ -535,8 +539,8 @@ static wcstring file_get_desc( const wchar_t *filename,
 		}
 	}
 	
-	suffix = wcsrchr( filename, L'.' );
-	if( suffix != 0 && !wcsrchr( suffix, L'/' ) )
+	const wcstring suffix = file_desc_suffix( filename );
+	if( ! suffix.empty() )
 	{
 		return complete_get_desc_suffix( suffix );
 	}
@@ -556,13 +560,15 @@ static wcstring file_get_desc( const wchar_t *filename,
    \param fullname the full filename of the file
    \param completion the completion part of the file name
    \param wc the wildcard to match against
-   \param is_cmd whether we are performing command completion
+   \param expand_flags the flags of the expansion
+   \param is_dir whether the file is a directory, as reported by wreaddir_typed
 */
 static void wildcard_completion_allocate( std::vector<completion_t> &list, 
 					  const wcstring &fullname, 
 					  const wcstring &completion,
 					  const wchar_t *wc,
-                      expand_flags_t expand_flags)
+                      expand_flags_t expand_flags,
+					  int is_dir )
 {
 	struct stat buf, lbuf;
     wcstring sb;
@@ -574,6 +580,19 @@ static void wildcard_completion_allocate( std::vector<completion_t> &list,
 	
 	long long sz; 
 
+	/*
+	  Without descriptions, a directory is described by nothing at
+	  all. If readdir told us the file is a directory, it needs no
+	  stat.
+	*/
+	if( (expand_flags & EXPAND_NO_DESCRIPTIONS) && is_dir == 1 )
+	{
+		munged_completion = completion;
+		munged_completion.push_back(L'/');
+		wildcard_complete(munged_completion, wc, L"", NULL, list, COMPLETE_NO_SPACE);
+		return;
+	}
+
 	/*
 	  If the file is a symlink, we need to stat both the file itself
 	  _and_ the destination file. But we try to avoid this with
@@ -636,23 +655,34 @@ static void wildcard_completion_allocate( std::vector<completion_t> &list,
 	wildcard_complete(completion_to_use, wc, sb.c_str(), NULL, list, flags);
 }
 
+/**
+  Returns whether the specified file is a directory. \c is_dir is what
+  wreaddir_typed reported for the file; stat is only called if that is
+  unknown.
+*/
+static bool wildcard_is_dir( const wcstring &filename, int is_dir )
+{
+	if( is_dir == -1 )
+	{
+		struct stat buf;
+		return !wstat( filename, &buf ) && S_ISDIR( buf.st_mode );
+	}
+	return is_dir == 1;
+}
+
 /**
   Test if the file specified by the given filename matches the
   expansion flags specified. flags can be a combination of
-  EXECUTABLES_ONLY and DIRECTORIES_ONLY.
+  EXECUTABLES_ONLY and DIRECTORIES_ONLY. \c is_dir is what
+  wreaddir_typed reported for the file.
 */
 static int test_flags( const wchar_t *filename,
-					   int flags )
+					   int flags,
+					   int is_dir )
 {
 	if( flags & DIRECTORIES_ONLY )
 	{
-		struct stat buf;
-		if( wstat( filename, &buf ) == -1 )
-		{
-			return 0;
-		}
-
-		if( !S_ISDIR( buf.st_mode ) )
+		if( !wildcard_is_dir( filename, is_dir ) )
 		{
 			return 0;
 		}
@@ -668,6 +698,208 @@ static int test_flags( const wchar_t *filename,
 	return 1;
 }
 
+/**
+   A list of files to test and complete, whose stat calls are spread
+   over several threads when there are enough of them. This keeps
+   completing in large directories on slow file systems from taking
+   one round trip per file.
+*/
+class wildcard_batch_t
+{
+	/** A file to test and complete, and the resulting completions */
+	struct file_t
+	{
+		wcstring long_name;
+		wcstring name;
+		int is_dir;
+		std::vector<completion_t> completions;
+	};
+
+	std::vector<file_t> files;
+	const wchar_t * const wc;
+	const expand_flags_t flags;
+
+	/** Test and complete the file at the specified index. Called on several threads at once. */
+	static void complete_file( wildcard_batch_t *batch, size_t idx )
+	{
+		file_t &file = batch->files.at( idx );
+		if( test_flags( file.long_name.c_str(), batch->flags, file.is_dir ) )
+		{
+			wildcard_completion_allocate( file.completions,
+										  file.long_name,
+										  file.name,
+										  batch->wc,
+										  batch->flags,
+										  file.is_dir );
+		}
+	}
+
+public:
+	wildcard_batch_t( const wchar_t *w, expand_flags_t f ) : wc(w), flags(f)
+	{
+	}
+
+	/**
+	   Add a file to the batch. \c is_dir is whether the file is a
+	   directory, as reported by wreaddir_typed.
+	*/
+	void add( const wcstring &long_name, const wcstring &name, int is_dir )
+	{
+		/* Don't bother with files we already know won't pass */
+		if( (flags & DIRECTORIES_ONLY) && is_dir == 0 )
+			return;
+
+		files.push_back( file_t() );
+		files.back().long_name = long_name;
+		files.back().name = name;
+		files.back().is_dir = is_dir;
+	}
+
+	/**
+	   Look up the descriptions of all suffixes in the batch at once,
+	   so that the files don't look up new suffixes one by one
+	*/
+	void describe_suffixes()
+	{
+		std::set<wcstring> seen;
+		wcstring_list_t suffixes;
+		for( size_t i=0; i<files.size(); i++ )
+		{
+			if( files.at( i ).is_dir == 1 )
+				continue;
+			
+			const wcstring suffix = file_desc_suffix( files.at( i ).long_name.c_str() );
+			if( ! suffix.empty() && seen.insert( suffix ).second )
+				suffixes.push_back( suffix );
+		}
+		
+		wcstring_list_t descs;
+		if( suffixes.size() > 1 )
+			mime_describe_suffixes( suffixes, descs );
+	}
+
+	/** Test and complete all files, and append the completions to \c out in the order the files were added */
+	void run( std::vector<completion_t> &out )
+	{
+		if( ! ( flags & EXPAND_NO_DESCRIPTIONS ) )
+			describe_suffixes();
+		
+		iothread_perform_parallel( (void (*)(void *, size_t))complete_file, this, files.size(), WILDCARD_FILES_PER_THREAD );
+		for( size_t i=0; i<files.size(); i++ )
+		{
+			completions_append( out, files.at( i ).completions );
+		}
+		files.clear();
+	}
+};
+
+static int wildcard_expand_internal( const wchar_t *wc, 
+									 const wchar_t *base_dir,
+									 expand_flags_t flags,
+									 std::vector<completion_t> &out );
+
+/**
+   A list of subdirectories to expand wildcards in. The subdirectories
+   are searched in parallel, each one by a single thread, and the
+   results are put together in the order the subdirectories were
+   added, so the result is the same as searching them one at a time.
+*/
+class wildcard_walk_t
+{
+	/** A subdirectory to search, and the results of searching it */
+	struct subdir_t
+	{
+		/** The path of the subdirectory, ending in a slash */
+		wcstring dir;
+
+		/** The wildcard to match against the contents of the subdirectory, or NULL */
+		const wchar_t *wc;
+
+		/** The recursive wildcard to match against the contents of the subdirectory, or NULL */
+		const wchar_t *recursive_wc;
+
+		int res;
+		std::vector<completion_t> out;
+	};
+
+	std::vector<subdir_t> subdirs;
+	const expand_flags_t flags;
+
+	/** Lock protecting interrupted */
+	pthread_mutex_t lock;
+
+	/** Set when a search was interrupted, so no more searches are started */
+	bool interrupted;
+
+	bool check_interrupted( int res )
+	{
+		scoped_lock locker( lock );
+		if( res == -1 )
+			interrupted = true;
+		return interrupted;
+	}
+
+	/** Search the subdirectory at the specified index. Called on several threads at once. */
+	static void expand_subdir( wildcard_walk_t *walk, size_t idx )
+	{
+		subdir_t &sub = walk->subdirs.at( idx );
+		sub.res = 0;
+		if( sub.wc && ! walk->check_interrupted( sub.res ) )
+		{
+			sub.res = wildcard_expand_internal( sub.wc, sub.dir.c_str(), walk->flags, sub.out );
+		}
+		if( sub.recursive_wc && ! walk->check_interrupted( sub.res ) )
+		{
+			int new_res = wildcard_expand_internal( sub.recursive_wc, sub.dir.c_str(), walk->flags | WILDCARD_RECURSIVE, sub.out );
+			sub.res = ( new_res == -1 ) ? -1 : ( sub.res | new_res );
+		}
+		if( walk->check_interrupted( sub.res ) )
+		{
+			sub.res = -1;
+		}
+	}
+
+public:
+	wildcard_walk_t( expand_flags_t f ) : flags(f), interrupted(false)
+	{
+		VOMIT_ON_FAILURE(pthread_mutex_init(&lock, NULL));
+	}
+
+	~wildcard_walk_t()
+	{
+		VOMIT_ON_FAILURE(pthread_mutex_destroy(&lock));
+	}
+
+	/** Add a subdirectory to search with the specified regular and recursive wildcards, either of which may be NULL */
+	void add( const wcstring &dir, const wchar_t *wc, const wchar_t *recursive_wc )
+	{
+		subdirs.push_back( subdir_t() );
+		subdirs.back().dir = dir;
+		subdirs.back().wc = wc;
+		subdirs.back().recursive_wc = recursive_wc;
+	}
+
+	/**
+	   Search all subdirectories and append the results to \c out.
+	   Returns -1 if the search was interrupted, and otherwise whether
+	   anything matched.
+	*/
+	int run( std::vector<completion_t> &out )
+	{
+		iothread_perform_parallel( (void (*)(void *, size_t))expand_subdir, this, subdirs.size(), WILDCARD_DIRS_PER_THREAD );
+		int res = 0;
+		for( size_t i=0; i<subdirs.size(); i++ )
+		{
+			subdir_t &sub = subdirs.at( i );
+			if( sub.res == -1 )
+				return -1;
+			res |= sub.res;
+			completions_append( out, sub.out );
+		}
+		return res;
+	}
+};
+
 /**
    The real implementation of wildcard expansion is in this
    function. Other functions are just wrappers around this one.
@@ -685,15 +917,12 @@ static int wildcard_expand_internal( const wchar_t *wc,
 	/* Points to the end of the current wildcard segment */
 	const wchar_t *wc_end;
 
-	/* Variables for traversing a directory */
-	DIR *dir;
+	/* The contents of the directory */
+	dir_listing_ref_t listing;
 	
 	/* The result returned */
 	int res = 0;
 	
-	/* Length of the directory to search in */
-	int base_len;
-
 	/* Variables for testing for presense of recursive wildcards */
 	const wchar_t *wc_recursive;
 	int is_recursive;
@@ -736,13 +965,25 @@ static int wildcard_expand_internal( const wchar_t *wc,
 
 	dir_string = base_dir[0]==L'\0'?L".":base_dir;
 	
-	if( !(dir = wopendir( dir_string )))
+	if( wc[0]==L'\0' && !(flags & ACCEPT_INCOMPLETE) )
+	{
+		/*
+		  Only the directory itself is wanted, so there is no need to
+		  read it
+		*/
+		DIR *dir = wopendir( dir_string );
+		if( !dir )
+		{
+			return 0;
+		}
+		closedir( dir );
+	}
+	else if( !dir_cache_get_listing( dir_string, &listing ) )
 	{
 		return 0;
 	}
 
 	wc_end = wcschr(wc,L'/');
-	base_len = wcslen( base_dir );
 
 	/*
 	  Test for recursive match string in current segment
@@ -768,23 +1009,16 @@ static int wildcard_expand_internal( const wchar_t *wc,
 			*/
 			if( flags & ACCEPT_INCOMPLETE )
 			{
-                wcstring next;
-				while(wreaddir(dir, next))
+				wildcard_batch_t batch(L"", flags);
+				for( size_t i=0; i<listing->size(); i++ )
 				{
-					if( next[0] != L'.' )
+					const dir_entry_t &entry = listing->at( i );
+					if( entry.name[0] != L'.' )
 					{
-						wcstring long_name = make_path( base_dir, next );
-						
-						if( test_flags( long_name.c_str(), flags ) )
-						{
-							wildcard_completion_allocate( out,
-														  long_name,
-														  next,
-														  L"",
-                                                          flags);
-						}
+						batch.add( make_path( base_dir, entry.name ), entry.name, entry.is_dir );
 					}					
 				}
+				batch.run( out );
 			}
 			else
 			{								
@@ -800,15 +1034,15 @@ static int wildcard_expand_internal( const wchar_t *wc,
 			/*
 			  This is the last wildcard segment, and it is not empty. Match files/directories.
 			*/
-            wcstring next;
-			while (wreaddir(dir, next))
+			wildcard_batch_t batch(wc, flags);
+			const wildcard_matcher_t matcher( wc );
+			for( size_t i=0; i<listing->size(); i++ )
 			{
+				const wcstring &next = listing->at( i ).name;
+				const int is_dir = listing->at( i ).is_dir;
                 const wchar_t * const name = next.c_str();
 				if( flags & ACCEPT_INCOMPLETE )
 				{
-					
-					const wcstring long_name = make_path( base_dir, next );
-
 					/*
 					  Test for matches before stating file, so as to minimize the number of calls to the much slower stat function 
 					*/
@@ -820,20 +1054,12 @@ static int wildcard_expand_internal( const wchar_t *wc,
 										   test,
 										   0 ) )
 					{
-						if( test_flags( long_name.c_str(), flags ) )
-						{
-							wildcard_completion_allocate( out,
-														  long_name,
-                                                          name,
-														  wc,
-                                                          flags);
-							
-						}
+						batch.add( make_path( base_dir, next ), next, is_dir );
 					}					
 				}
 				else
 				{
-					if( wildcard_match2( name, wc, 1 ) )
+					if( matcher.matches( next ) )
 					{
                         const wcstring long_name = make_path(base_dir, next);
 						int skip = 0;
@@ -845,11 +1071,7 @@ static int wildcard_expand_internal( const wchar_t *wc,
 							  interested in adding files -directories
 							  will be added in the next pass.
 							*/
-							struct stat buf;
-							if( !wstat( long_name, &buf ) )
-							{
-								skip = S_ISDIR(buf.st_mode);
-							}							
+							skip = wildcard_is_dir( long_name, is_dir );
 						}
 						if (! skip)
 						{
@@ -859,6 +1081,7 @@ static int wildcard_expand_internal( const wchar_t *wc,
 					}
 				}
 			}
+			batch.run( out );
 		}
 	}
 
@@ -873,63 +1096,30 @@ static int wildcard_expand_internal( const wchar_t *wc,
 		  wc_str is the part of the wildcarded string from the
 		  beginning to the first slash
 		*/
-		wchar_t *wc_str;
-
-		/*
-		  new_dir is a scratch area containing the full path to a
-		  file/directory we are iterating over
-		*/
-		wchar_t *new_dir;
+		const wcstring wc_str = wc_end ? wcstring( wc, wc_end-wc ) : wcstring( wc );
 
 		/*
-		  The maximum length of a file element
+		  wc_sub is the part of the wildcarded string up to and
+		  including the recursive wildcard
 		*/
-		long ln=MAX_FILE_LENGTH;
-		char * narrow_dir_string = wcs2str( dir_string );
-
-		/*
-		  In recursive mode, we look through the direcotry twice. If
-		  so, this rewind is needed.
-		*/
-		rewinddir( dir );
-
-		if( narrow_dir_string )
+		wcstring wc_sub;
+		if( is_recursive )
 		{
-			/* 
-			   Find out how long the filename can be in a worst case
-			   scenario
-			*/
-			ln = pathconf( narrow_dir_string, _PC_NAME_MAX ); 
-
-			/*
-			  If not specified, use som large number as fallback
-			*/
-			if( ln < 0 )
-				ln = MAX_FILE_LENGTH;		
-			free( narrow_dir_string );
+			wc_sub.assign( wc, wc_recursive-wc+1 );
 		}
-		new_dir= (wchar_t *)malloc( sizeof(wchar_t)*(base_len+ln+2)  );
-
-		wc_str = wc_end?wcsndup(wc, wc_end-wc):wcsdup(wc);
 
-		if( (!new_dir) || (!wc_str) )
+		const wildcard_matcher_t whole_matcher( wc_str ), partial_matcher( wc_sub );
+		wildcard_walk_t walk( flags );
+		for( size_t i=0; i<listing->size(); i++ )
 		{
-			DIE_MEM();
-		}
+			const wcstring &next = listing->at( i ).name;
+			const int is_dir = listing->at( i ).is_dir;
 
-		wcscpy( new_dir, base_dir );
-		
-        wcstring next;
-		while (wreaddir(dir, next))
-		{
-			const wchar_t *name = next.c_str();
-			
 			/*
 			  Test if the file/directory name matches the whole
 			  wildcard element, i.e. regular matching.
 			*/
-			int whole_match = wildcard_match2( name, wc_str, 1 );
-			int partial_match = 0;
+			int whole_match = whole_matcher.matches( next );
 			
 			/* 
 			   If we are doing recursive matching, also check if this
@@ -937,100 +1127,56 @@ static int wildcard_expand_internal( const wchar_t *wc,
 			   wildcard, if so, then we can search all subdirectories
 			   for matches.
 			*/
-			if( is_recursive )
-			{
-				const wchar_t *end = wcschr( wc, ANY_STRING_RECURSIVE );
-				wchar_t *wc_sub = wcsndup( wc, end-wc+1);
-				partial_match = wildcard_match2( name, wc_sub, 1 );
-				free( wc_sub );
-			}			
+			int partial_match = is_recursive && partial_matcher.matches( next );
 
 			if( whole_match || partial_match )
 			{
-				int new_len;
-				struct stat buf;			
-				char *dir_str;
-				int stat_res;
-				int new_res;
-
-				wcscpy(&new_dir[base_len], name );
-				dir_str = wcs2str( new_dir );
+				wcstring new_dir = make_path( base_dir, next );
 				
-				if( dir_str )
+				if( wildcard_is_dir( new_dir, is_dir ) )
 				{
-					stat_res = stat( dir_str, &buf );
-					free( dir_str );
+					new_dir.push_back( L'/' );
 					
-					if( !stat_res )
+					/*
+					  Regular matching
+					*/
+					const wchar_t *new_wc = NULL;
+					if( whole_match )
 					{
-						if( S_ISDIR(buf.st_mode) )
+						new_wc = L"";
+						if( wc_end )
 						{
-							new_len = wcslen( new_dir );
-							new_dir[new_len] = L'/';
-							new_dir[new_len+1] = L'\0';
-							
+							new_wc=wc_end+1;
 							/*
-							  Regular matching
+							  Accept multiple '/' as a single direcotry separator
 							*/
-							if( whole_match )
+							while(*new_wc==L'/')
 							{
-								const wchar_t *new_wc = L"";
-								if( wc_end )
-								{
-									new_wc=wc_end+1;
-									/*
-									  Accept multiple '/' as a single direcotry separator
-									*/
-									while(*new_wc==L'/')
-									{
-										new_wc++;
-									}
-								}
-								
-								new_res = wildcard_expand_internal( new_wc,
-																	new_dir, 
-																	flags, 
-																	out );
-
-								if( new_res == -1 )
-								{
-									res = -1;
-									break;
-								}								
-								res |= new_res;
-								
+								new_wc++;
 							}
-							
-							/*
-							  Recursive matching
-							*/
-							if( partial_match )
-							{
-								
-								new_res = wildcard_expand_internal( wcschr( wc, ANY_STRING_RECURSIVE ), 
-																	new_dir,
-																	flags | WILDCARD_RECURSIVE, 
-																	out );
-
-								if( new_res == -1 )
-								{
-									res = -1;
-									break;
-								}								
-								res |= new_res;
-								
-							}
-						}								
+						}
 					}
-				}
+					
+					/*
+					  Recursive matching
+					*/
+					const wchar_t *recursive_wc = partial_match ? wc_recursive : NULL;
+
+					walk.add( new_dir, new_wc, recursive_wc );
+				}								
 			}
 		}
 		
-		free( wc_str );
-		free( new_dir );
+		int walk_res = walk.run( out );
+		if( walk_res == -1 )
+		{
+			res = -1;
+		}
+		else
+		{
+			res |= walk_res;
+		}
 	}
-	closedir( dir );
-
 	return res;
 }
 
@@ -1065,11 +1211,22 @@ int wildcard_expand( const wchar_t *wc,
 	return res;
 }
 
+void wildcard_complete_files( const wcstring &wc, const std::vector<dir_file_t> &files, expand_flags_t flags, std::vector<completion_t> &out )
+{
+	wildcard_batch_t batch(wc.c_str(), flags);
+	for( size_t i=0; i<files.size(); i++ )
+	{
+		const dir_file_t &file = files.at( i );
+		std::vector<completion_t> test;
+		if( wildcard_complete( file.entry.name, wc.c_str(), L"", 0, test, 0 ) )
+		{
+			batch.add( make_path( file.dir, file.entry.name ), file.entry.name, file.entry.is_dir );
+		}
+	}
+	batch.run( out );
+}
+
 int wildcard_expand_string(const wcstring &wc, const wcstring &base_dir, expand_flags_t flags, std::vector<completion_t> &outputs )
 {
-    std::vector<completion_t> lst;
-    
-    int res = wildcard_expand(wc.c_str(), base_dir.c_str(), flags, lst);    
-    outputs.insert(outputs.end(), lst.begin(), lst.end());
-    return res;
+    return wildcard_expand(wc.c_str(), base_dir.c_str(), flags, outputs);
 }
@@ -18,6 +18,7 @@
 #include "util.h"
 #include "common.h"
 #include "expand.h"
+#include "dir_cache.h"
 
 /*
   Use unencoded private-use keycodes for internal characters
@@ -68,6 +69,19 @@ enum
    
 */
 int wildcard_expand_string(const wcstring &wc, const wcstring &base_dir, expand_flags_t flags, std::vector<completion_t> &out );
+/**
+   Complete the specified files against the last segment of a wildcard
+   the way wildcard_expand_string does with ACCEPT_INCOMPLETE set for
+   the files of a directory. Files that don't match, or that fail the
+   EXECUTABLES_ONLY or DIRECTORIES_ONLY test, are skipped.
+
+	\param wc The wildcard, which may not contain a slash
+	\param files The files to complete
+	\param flags flags for the search
+	\param out The list in which to put the output
+*/
+void wildcard_complete_files( const wcstring &wc, const std::vector<dir_file_t> &files, expand_flags_t flags, std::vector<completion_t> &out );
+
 /**
    Test whether the given wildcard matches the string. Does not perform any I/O.
 
@@ -77,6 +91,32 @@ int wildcard_expand_string(const wcstring &wc, const wcstring &base_dir, expand_
 */
 int wildcard_match( const wcstring &str, const wcstring &wc );
 
+/**
+   A wildcard prepared for being matched against many strings. The
+   literal prefix and suffix of the wildcard are compared directly,
+   and only the part in between goes through the general matcher.
+*/
+class wildcard_matcher_t
+{
+	/** The wildcard */
+	const wcstring wc;
+
+	/** Length of the part of the wildcard before the first wildcard character */
+	size_t prefix_len;
+
+	/** Length of the part of the wildcard after the last ANY_STRING, or 0 if it contains an ANY_CHAR */
+	size_t suffix_len;
+
+	/** Whether the wildcard contains an ANY_STRING or ANY_STRING_RECURSIVE */
+	bool has_any_string;
+	
+public:
+	explicit wildcard_matcher_t( const wcstring &wc );
+
+	/** Test whether the wildcard matches the string, with the same result as wildcard_match */
+	bool matches( const wcstring &str ) const;
+};
+
 
 /**
    Check if the specified string contains wildcards
@@ -54,6 +54,9 @@ typedef std::string cstring;
 /* Lock to protect wgettext */
 static pthread_mutex_t wgettext_lock;
 
+/** The counts of the operations in the SYSCALL_ enum */
+static unsigned long s_syscall_counts[SYSCALL_COUNTER_COUNT];
+
 /* Maps string keys to (immortal) pointers to string values */
 typedef std::map<wcstring, wcstring *> wgettext_map_t;
 static std::map<wcstring, wcstring *> wgettext_map;
@@ -83,6 +86,7 @@ bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, std::wstring &ou
             fullpath.push_back('/');
             fullpath.append(d->d_name);
             struct stat buf;
+            syscall_count(SYSCALL_STAT);
             if (stat(fullpath.c_str(), &buf) != 0) {
                 is_dir = false;
             } else {
@@ -105,6 +109,27 @@ bool wreaddir(DIR *dir, std::wstring &out_name)
     return true;
 }
 
+bool wreaddir_typed(DIR *dir, std::wstring &out_name, int *out_is_dir)
+{
+    struct dirent *d = readdir( dir );
+    if ( !d ) return false;
+    
+    out_name = str2wcstring(d->d_name);
+    switch (d->d_type) {
+        case DT_DIR:
+            *out_is_dir = 1;
+            break;
+        case DT_LNK:
+        case DT_UNKNOWN:
+            *out_is_dir = -1;
+            break;
+        default:
+            *out_is_dir = 0;
+            break;
+    }
+    return true;
+}
+
 
 wchar_t *wgetcwd( wchar_t *buff, size_t sz )
 {
@@ -234,12 +259,14 @@ int wcreat(const wcstring &pathname, mode_t mode)
 
 DIR *wopendir(const wcstring &name)
 {
+    syscall_count(SYSCALL_OPENDIR);
     cstring tmp = wcs2string(name);
     return opendir(tmp.c_str());
 }
 
 int wstat(const wcstring &file_name, struct stat *buf)
 {
+    syscall_count(SYSCALL_STAT);
     cstring tmp = wcs2string(file_name);
     return stat(tmp.c_str(), buf);
 }
@@ -247,6 +274,7 @@ int wstat(const wcstring &file_name, struct stat *buf)
 int lwstat(const wcstring &file_name, struct stat *buf)
 {
    // fprintf(stderr, "%s\n", __PRETTY_FUNCTION__);
+    syscall_count(SYSCALL_STAT);
     cstring tmp = wcs2string(file_name);
     return lstat(tmp.c_str(), buf);
 }
@@ -254,6 +282,7 @@ int lwstat(const wcstring &file_name, struct stat *buf)
 
 int waccess(const wcstring &file_name, int mode)
 {
+    syscall_count(SYSCALL_ACCESS);
     cstring tmp = wcs2string(file_name);
     return access(tmp.c_str(), mode);
 }
@@ -423,3 +452,40 @@ int wrename( const wcstring &old, const wcstring &newv )
 	cstring new_narrow =wcs2string(newv);
 	return rename( old_narrow.c_str(), new_narrow.c_str() );
 }
+
+syscall_counts_t::syscall_counts_t()
+{
+	for( int i=0; i<SYSCALL_COUNTER_COUNT; i++ )
+		count[i] = 0;
+}
+
+syscall_counts_t syscall_counts_t::operator-( const syscall_counts_t &other ) const
+{
+	syscall_counts_t result;
+	for( int i=0; i<SYSCALL_COUNTER_COUNT; i++ )
+		result.count[i] = count[i] - other.count[i];
+	return result;
+}
+
+void syscall_count( int counter )
+{
+	/* Background threads stat files for highlighting and completions too */
+	__sync_fetch_and_add( &s_syscall_counts[counter], 1 );
+}
+
+syscall_counts_t syscall_counts()
+{
+	syscall_counts_t result;
+	for( int i=0; i<SYSCALL_COUNTER_COUNT; i++ )
+		result.count[i] = s_syscall_counts[i];
+	return result;
+}
+
+const wchar_t *syscall_counter_name( int counter )
+{
+	static const wchar_t * const names[SYSCALL_COUNTER_COUNT] =
+	{
+		L"fork", L"exec", L"stat", L"access", L"opendir", L"pipe", L"fishd"
+	};
+	return names[counter];
+}
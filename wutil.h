@@ -105,6 +105,15 @@ wchar_t *wrealpath(const wcstring &pathname, wchar_t *resolved_path);
 bool wreaddir(DIR *dir, std::wstring &out_name);
 bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, std::wstring &out_name, bool *out_is_dir);
 
+/**
+   Like wreaddir, but also reports whether the entry is a directory if
+   readdir says so, without calling stat. \c out_is_dir is set to 1 for
+   directories, 0 for other files and -1 if it is not known, which is
+   the case for symlinks and on file systems that do not report file
+   types.
+*/
+bool wreaddir_typed(DIR *dir, std::wstring &out_name, int *out_is_dir);
+
 /**
    Wide character version of dirname()
 */
@@ -141,4 +150,56 @@ int wmkdir( const wcstring &dir, int mode );
 */
 int wrename( const wcstring &oldName, const wcstring &newName );
 
+/**
+   The system calls and other expensive operations that fish counts,
+   so that status --syscalls can tell what a prompt or a command costs
+*/
+enum
+{
+	/** Forks and vforks */
+	SYSCALL_FORK,
+	/** External commands launched, however they were started */
+	SYSCALL_EXEC,
+	/** Calls of stat and lstat */
+	SYSCALL_STAT,
+	/** Calls of access */
+	SYSCALL_ACCESS,
+	/** Directories opened for reading */
+	SYSCALL_OPENDIR,
+	/** Pipes created */
+	SYSCALL_PIPE,
+	/** Barriers that had to wait for a reply from fishd */
+	SYSCALL_FISHD,
+
+	SYSCALL_COUNTER_COUNT
+};
+
+/**
+   Counts of the operations in the enum above
+*/
+struct syscall_counts_t
+{
+	unsigned long count[SYSCALL_COUNTER_COUNT];
+
+	syscall_counts_t();
+
+	/** Returns the counts in this that are not in \c other */
+	syscall_counts_t operator-( const syscall_counts_t &other ) const;
+};
+
+/**
+   Adds one to the specified counter. This may be called from any thread.
+*/
+void syscall_count( int counter );
+
+/**
+   Returns the counts since fish started
+*/
+syscall_counts_t syscall_counts();
+
+/**
+   Returns the name of the specified counter
+*/
+const wchar_t *syscall_counter_name( int counter );
+
 #endif
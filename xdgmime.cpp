@@ -35,6 +35,7 @@
 #include "xdgmimemagic.h"
 #include "xdgmimealias.h"
 #include "xdgmimeparent.h"
+#include "xdgmimecache.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -55,6 +56,7 @@ static XdgAliasList *alias_list = NULL;
 static XdgParentList *parent_list = NULL;
 static XdgDirTimeList *dir_time_list = NULL;
 static XdgCallbackList *callback_list = NULL;
+static int n_caches = 0;
 const char *xdg_mime_type_unknown = "application/octet-stream";
 
 
@@ -122,6 +124,32 @@ xdg_mime_init_from_directory (const char *directory)
 
   assert (directory != NULL);
 
+  /* A mime.cache holds everything the text files do, and mapping it is much
+   * cheaper than parsing them */
+  file_name = (char *)malloc (strlen (directory) + strlen ("/mime/mime.cache") + 1);
+  strcpy (file_name, directory); strcat (file_name, "/mime/mime.cache");
+  if (stat (file_name, &st) == 0)
+    {
+      XdgMimeCache *cache = _xdg_mime_cache_new_from_file (file_name);
+
+      if (cache != NULL)
+	{
+	  list = xdg_dir_time_list_new ();
+	  list->directory_name = file_name;
+	  list->mtime = st.st_mtime;
+	  list->next = dir_time_list;
+	  dir_time_list = list;
+
+	  _caches = (XdgMimeCache **)realloc (_caches, sizeof (XdgMimeCache *) * (n_caches + 2));
+	  _caches[n_caches] = cache;
+	  _caches[n_caches + 1] = NULL;
+	  n_caches++;
+
+	  return FALSE;
+	}
+    }
+  free (file_name);
+
   file_name = (char *)malloc (strlen (directory) + strlen ("/mime/globs") + 1);
   strcpy (file_name, directory); strcat (file_name, "/mime/globs");
   if (stat (file_name, &st) == 0)
@@ -247,12 +275,13 @@ xdg_run_command_on_dirs (XdgDirectoryFunc  func,
 
 /* Checks file_path to make sure it has the same mtime as last time it was
  * checked.  If it has a different mtime, or if the file doesn't exist, it
- * returns FALSE.
+ * returns FALSE.  exists is set to whether the file is there.
  *
  * FIXME: This doesn't protect against permission changes.
  */
 static int
-xdg_check_file (const char *file_path)
+xdg_check_file (const char *file_path,
+		int        *exists)
 {
   struct stat st;
 
@@ -261,6 +290,9 @@ xdg_check_file (const char *file_path)
     {
       XdgDirTimeList *list;
 
+      if (exists)
+	*exists = TRUE;
+
       for (list = dir_time_list; list; list = list->next)
 		{
 		  if (! strcmp (list->directory_name, file_path) &&
@@ -277,6 +309,8 @@ xdg_check_file (const char *file_path)
       return TRUE;
     }
 
+  if (exists)
+    *exists = FALSE;
   return FALSE;
 }
 
@@ -284,15 +318,28 @@ static int
 xdg_check_dir (const char *directory,
 			   int        *invalid_dir_list)
 {
-  int invalid;
+  int invalid, exists;
   char *file_name;
 
   assert (directory != NULL);
 
+  /* Check the mime.cache file, which is all that was read if it is there */
+  file_name = (char *)malloc (strlen (directory) + strlen ("/mime/mime.cache") + 1);
+  strcpy (file_name, directory); strcat (file_name, "/mime/mime.cache");
+  invalid = xdg_check_file (file_name, &exists);
+  free (file_name);
+  if (invalid)
+    {
+      *invalid_dir_list = TRUE;
+      return TRUE;
+    }
+  if (exists)
+    return FALSE;
+
   /* Check the globs file */
   file_name = (char *)malloc (strlen (directory) + strlen ("/mime/globs") + 1);
   strcpy (file_name, directory); strcat (file_name, "/mime/globs");
-  invalid = xdg_check_file (file_name);
+  invalid = xdg_check_file (file_name, NULL);
   free (file_name);
   if (invalid)
     {
@@ -303,7 +350,7 @@ xdg_check_dir (const char *directory,
   /* Check the magic file */
   file_name = (char *)malloc (strlen (directory) + strlen ("/mime/magic") + 1);
   strcpy (file_name, directory); strcat (file_name, "/mime/magic");
-  invalid = xdg_check_file (file_name);
+  invalid = xdg_check_file (file_name, NULL);
   free (file_name);
   if (invalid)
     {
@@ -395,7 +442,10 @@ xdg_mime_get_mime_type_for_data (const void *data,
 
   xdg_mime_init ();
 
-  mime_type = _xdg_mime_magic_lookup_data (global_magic, data, len);
+  if (_caches)
+    mime_type = _xdg_mime_cache_get_mime_type_for_data (data, len);
+  else
+    mime_type = _xdg_mime_magic_lookup_data (global_magic, data, len);
 
   if (mime_type)
     return mime_type;
@@ -436,7 +486,10 @@ xdg_mime_get_mime_type_for_file (const char *file_name)
   /* FIXME: Need to make sure that max_extent isn't totally broken.  This could
    * be large and need getting from a stream instead of just reading it all
    * in. */
-  max_extent = _xdg_mime_magic_get_buffer_extents (global_magic);
+  if (_caches)
+    max_extent = _xdg_mime_cache_get_max_buffer_extents ();
+  else
+    max_extent = _xdg_mime_magic_get_buffer_extents (global_magic);
   data = (unsigned char *)malloc (max_extent);
   if (data == NULL)
     return XDG_MIME_TYPE_UNKNOWN;
@@ -457,7 +510,10 @@ xdg_mime_get_mime_type_for_file (const char *file_name)
       return XDG_MIME_TYPE_UNKNOWN;
     }
 
-  mime_type = _xdg_mime_magic_lookup_data (global_magic, data, bytes_read);
+  if (_caches)
+    mime_type = _xdg_mime_cache_get_mime_type_for_data (data, bytes_read);
+  else
+    mime_type = _xdg_mime_magic_lookup_data (global_magic, data, bytes_read);
 
   free (data);
   fclose (file);
@@ -475,7 +531,10 @@ xdg_mime_get_mime_type_from_file_name (const char *file_name)
 
   xdg_mime_init ();
 
-  mime_type = _xdg_glob_hash_lookup_file_name (global_hash, file_name);
+  if (_caches)
+    mime_type = _xdg_mime_cache_get_mime_type_from_file_name (file_name);
+  else
+    mime_type = _xdg_glob_hash_lookup_file_name (global_hash, file_name);
   if (mime_type)
     return mime_type;
   else
@@ -523,6 +582,18 @@ xdg_mime_shutdown (void)
 	{
 	  _xdg_mime_parent_list_free ( parent_list);
 	}
+
+  if (_caches)
+    {
+      int i;
+
+      for (i = 0; i < n_caches; i++)
+	_xdg_mime_cache_free (_caches[i]);
+      free (_caches);
+      _caches = NULL;
+      n_caches = 0;
+      _xdg_mime_cache_free_parents ();
+    }
   
   
   for (list = callback_list; list; list = list->next)
@@ -536,6 +607,9 @@ xdg_mime_get_max_buffer_extents (void)
 {
   xdg_mime_init ();
   
+  if (_caches)
+    return _xdg_mime_cache_get_max_buffer_extents ();
+
   return _xdg_mime_magic_get_buffer_extents (global_magic);
 }
 
@@ -546,6 +620,9 @@ xdg_mime_unalias_mime_type (const char *mime_type)
 
   xdg_mime_init ();
 
+  if (_caches)
+    return _xdg_mime_cache_unalias_mime_type (mime_type);
+
   if ((lookup = _xdg_mime_alias_list_lookup (alias_list, mime_type)) != NULL)
     return lookup;
 
@@ -632,7 +709,10 @@ xdg_mime_mime_type_subclass (const char *mime,
   if (strcmp (ubase, "application/octet-stream") == 0)
     return 1;
   
-  parents = _xdg_mime_parent_list_lookup (parent_list, umime);
+  if (_caches)
+    parents = _xdg_mime_cache_get_mime_parents (umime);
+  else
+    parents = _xdg_mime_parent_list_lookup (parent_list, umime);
   for (; parents && *parents; parents++)
     {
       if (xdg_mime_mime_type_subclass (*parents, ubase))
@@ -651,6 +731,9 @@ xdg_mime_get_mime_parents (const char *mime)
 
   umime = xdg_mime_unalias_mime_type (mime);
 
+  if (_caches)
+    return _xdg_mime_cache_get_mime_parents (umime);
+
   return _xdg_mime_parent_list_lookup (parent_list, umime);
 }
 
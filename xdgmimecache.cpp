@@ -0,0 +1,682 @@
+/* -*- mode: C; c-file-style: "gnu" -*- */
+/* xdgmimecache.c: Private file.  mmappable caches for mime data
+ *
+ * More info can be found at http://www.freedesktop.org/standards/
+ *
+ * Copyright (C) 2005  Matthias Clasen <mclasen@redhat.com>
+ *
+ * Licensed under the Academic Free License version 2.0
+ * Or under the following terms:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "xdgmimecache.h"
+#include "xdgmimeint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#ifndef	FALSE
+#define	FALSE	(0)
+#endif
+
+#ifndef	TRUE
+#define	TRUE	(!FALSE)
+#endif
+
+#ifndef MAP_FAILED
+#define MAP_FAILED ((void *) -1)
+#endif
+
+/* The versions of the shared-mime-info cache format this understands */
+#define MAJOR_VERSION 1
+#define MINOR_VERSION_MIN 1
+#define MINOR_VERSION_MAX 2
+
+/* Offsets of the lists in the header */
+#define HEADER_SIZE 40
+#define ALIAS_LIST_OFFSET 4
+#define PARENT_LIST_OFFSET 8
+#define LITERAL_LIST_OFFSET 12
+#define REVERSE_SUFFIX_TREE_OFFSET 16
+#define GLOB_LIST_OFFSET 20
+#define MAGIC_LIST_OFFSET 24
+
+/* The weight of a glob is in the low byte of its weight field, and a flag
+ * above it says whether the glob is case sensitive */
+#define WEIGHT_MASK 0xff
+#define CASE_SENSITIVE_FLAG 0x100
+
+struct XdgMimeCache
+{
+  size_t  size;
+  char   *buffer;
+};
+
+/* A candidate mime type found while matching a file name */
+typedef struct
+{
+  const char *mime_type;
+  int         weight;
+  int         length;
+} XdgCacheMatch;
+
+XdgMimeCache **_caches = NULL;
+
+/* Parent lists handed out by _xdg_mime_cache_get_mime_parents, which are
+ * freed together by _xdg_mime_cache_free_parents */
+static const char ***parent_lists = NULL;
+static int n_parent_lists = 0;
+
+/* Reads the big endian number at offset, or 0 if the cache is too short */
+static xdg_uint32_t
+cache_uint32 (XdgMimeCache *cache,
+	      xdg_uint32_t  offset)
+{
+  const unsigned char *p;
+
+  if (offset > cache->size || cache->size - offset < 4)
+    return 0;
+
+  p = (const unsigned char *)cache->buffer + offset;
+  return ((xdg_uint32_t)p[0] << 24) | ((xdg_uint32_t)p[1] << 16) |
+	 ((xdg_uint32_t)p[2] << 8) | (xdg_uint32_t)p[3];
+}
+
+static xdg_uint16_t
+cache_uint16 (XdgMimeCache *cache,
+	      xdg_uint32_t  offset)
+{
+  const unsigned char *p;
+
+  if (offset > cache->size || cache->size - offset < 2)
+    return 0;
+
+  p = (const unsigned char *)cache->buffer + offset;
+  return (xdg_uint16_t)((p[0] << 8) | p[1]);
+}
+
+/* Returns the null terminated string at offset, or NULL if it runs past the
+ * end of the cache */
+static const char *
+cache_string (XdgMimeCache *cache,
+	      xdg_uint32_t  offset)
+{
+  if (offset >= cache->size)
+    return NULL;
+  if (memchr (cache->buffer + offset, '\0', cache->size - offset) == NULL)
+    return NULL;
+  return cache->buffer + offset;
+}
+
+XdgMimeCache *
+_xdg_mime_cache_new_from_file (const char *file_name)
+{
+  XdgMimeCache *cache;
+  struct stat st;
+  char *buffer;
+  int fd;
+
+  /* OK to not use CLO_EXEC here because mimedb is single threaded */
+  fd = open (file_name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0 || st.st_size < HEADER_SIZE)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  buffer = (char *)mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (buffer == MAP_FAILED)
+    return NULL;
+
+  cache = (XdgMimeCache *)malloc (sizeof (XdgMimeCache));
+  cache->buffer = buffer;
+  cache->size = st.st_size;
+
+  /* Use the text files instead of a cache we don't understand */
+  if (cache_uint16 (cache, 0) != MAJOR_VERSION ||
+      cache_uint16 (cache, 2) < MINOR_VERSION_MIN ||
+      cache_uint16 (cache, 2) > MINOR_VERSION_MAX)
+    {
+      _xdg_mime_cache_free (cache);
+      return NULL;
+    }
+
+  return cache;
+}
+
+void
+_xdg_mime_cache_free (XdgMimeCache *cache)
+{
+  munmap (cache->buffer, cache->size);
+  free (cache);
+}
+
+/* Magic
+ */
+
+static int
+cache_magic_matchlet_compare_to_data (XdgMimeCache *cache,
+				      xdg_uint32_t  offset,
+				      const unsigned char *data,
+				      size_t        len)
+{
+  xdg_uint32_t range_start = cache_uint32 (cache, offset);
+  xdg_uint32_t range_length = cache_uint32 (cache, offset + 4);
+  xdg_uint32_t data_length = cache_uint32 (cache, offset + 12);
+  xdg_uint32_t data_offset = cache_uint32 (cache, offset + 16);
+  xdg_uint32_t mask_offset = cache_uint32 (cache, offset + 20);
+  const unsigned char *value, *mask = NULL;
+  xdg_uint32_t i, j;
+
+  if (data_offset > cache->size || cache->size - data_offset < data_length)
+    return FALSE;
+  value = (const unsigned char *)cache->buffer + data_offset;
+
+  if (mask_offset)
+    {
+      if (mask_offset > cache->size || cache->size - mask_offset < data_length)
+	return FALSE;
+      mask = (const unsigned char *)cache->buffer + mask_offset;
+    }
+
+  for (i = range_start; i < range_start + range_length; i++)
+    {
+      int valid_matchlet = TRUE;
+
+      if (i + data_length > len)
+	return FALSE;
+
+      for (j = 0; j < data_length; j++)
+	{
+	  unsigned char m = mask ? mask[j] : 0xff;
+	  if ((value[j] & m) != (data[i + j] & m))
+	    {
+	      valid_matchlet = FALSE;
+	      break;
+	    }
+	}
+
+      if (valid_matchlet)
+	return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* A matchlet matches if its value is found and either it has no children
+ * or one of them matches too */
+static int
+cache_magic_matchlet_compare (XdgMimeCache *cache,
+			      xdg_uint32_t  offset,
+			      const unsigned char *data,
+			      size_t        len,
+			      int           depth)
+{
+  xdg_uint32_t n_children = cache_uint32 (cache, offset + 24);
+  xdg_uint32_t child_offset = cache_uint32 (cache, offset + 28);
+  xdg_uint32_t i;
+
+  /* Guard against corrupt caches that loop */
+  if (depth > 32)
+    return FALSE;
+
+  if (! cache_magic_matchlet_compare_to_data (cache, offset, data, len))
+    return FALSE;
+
+  if (n_children == 0)
+    return TRUE;
+
+  for (i = 0; i < n_children; i++)
+    {
+      if (cache_magic_matchlet_compare (cache, child_offset + 32 * i,
+					data, len, depth + 1))
+	return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Finds the first match, which is the one with the highest priority since
+ * matches are sorted by priority */
+static const char *
+cache_magic_lookup_data (XdgMimeCache *cache,
+			 const unsigned char *data,
+			 size_t        len,
+			 int          *prio)
+{
+  xdg_uint32_t list_offset = cache_uint32 (cache, MAGIC_LIST_OFFSET);
+  xdg_uint32_t n_entries = cache_uint32 (cache, list_offset);
+  xdg_uint32_t offset = cache_uint32 (cache, list_offset + 8);
+  xdg_uint32_t i, j;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      xdg_uint32_t match_offset = offset + 16 * i;
+      xdg_uint32_t n_matchlets = cache_uint32 (cache, match_offset + 8);
+      xdg_uint32_t matchlet_offset = cache_uint32 (cache, match_offset + 12);
+
+      for (j = 0; j < n_matchlets; j++)
+	{
+	  if (cache_magic_matchlet_compare (cache, matchlet_offset + 32 * j,
+					    data, len, 0))
+	    {
+	      *prio = cache_uint32 (cache, match_offset);
+	      return cache_string (cache, cache_uint32 (cache, match_offset + 4));
+	    }
+	}
+    }
+
+  return NULL;
+}
+
+const char *
+_xdg_mime_cache_get_mime_type_for_data (const void *data,
+					size_t      len)
+{
+  const char *mime_type = NULL;
+  int best_prio = -1;
+  int i;
+
+  for (i = 0; _caches[i]; i++)
+    {
+      int prio = 0;
+      const char *match = cache_magic_lookup_data (_caches[i], (const unsigned char *)data, len, &prio);
+      if (match && prio > best_prio)
+	{
+	  mime_type = match;
+	  best_prio = prio;
+	}
+    }
+
+  return mime_type;
+}
+
+int
+_xdg_mime_cache_get_max_buffer_extents (void)
+{
+  int max_extent = 0;
+  int i;
+
+  for (i = 0; _caches[i]; i++)
+    {
+      XdgMimeCache *cache = _caches[i];
+      xdg_uint32_t offset = cache_uint32 (cache, MAGIC_LIST_OFFSET);
+      int extent = (int)cache_uint32 (cache, offset + 4);
+
+      if (extent > max_extent)
+	max_extent = extent;
+    }
+
+  return max_extent;
+}
+
+/* Globs
+ */
+
+static void
+cache_match_consider (XdgCacheMatch *best,
+		      const char    *mime_type,
+		      int            weight,
+		      int            length)
+{
+  if (mime_type == NULL)
+    return;
+
+  /* A higher weight wins, then a longer glob */
+  if (best->mime_type == NULL || weight > best->weight ||
+      (weight == best->weight && length > best->length))
+    {
+      best->mime_type = mime_type;
+      best->weight = weight;
+      best->length = length;
+    }
+}
+
+/* Literals that aren't case sensitive are stored lowercase, so those are
+ * looked up again with the lowercased name */
+static const char *
+cache_glob_lookup_literal (XdgMimeCache *cache,
+			   const char   *file_name,
+			   int           ignore_case)
+{
+  xdg_uint32_t list_offset = cache_uint32 (cache, LITERAL_LIST_OFFSET);
+  xdg_uint32_t n_entries = cache_uint32 (cache, list_offset);
+  xdg_uint32_t min = 0, max = n_entries;
+
+  /* The literals are sorted */
+  while (min < max)
+    {
+      xdg_uint32_t mid = min + (max - min) / 2;
+      xdg_uint32_t offset = list_offset + 4 + 12 * mid;
+      const char *literal = cache_string (cache, cache_uint32 (cache, offset));
+      int cmp;
+
+      if (literal == NULL)
+	return NULL;
+
+      cmp = strcmp (literal, file_name);
+      if (cmp < 0)
+	min = mid + 1;
+      else if (cmp > 0)
+	max = mid;
+      else
+	{
+	  if (ignore_case && (cache_uint32 (cache, offset + 8) & CASE_SENSITIVE_FLAG))
+	    return NULL;
+	  return cache_string (cache, cache_uint32 (cache, offset + 4));
+	}
+    }
+
+  return NULL;
+}
+
+/* Follows the characters of name from its end down the reverse suffix
+ * tree.  Every glob ending at a node on the way matches a suffix of name. */
+static void
+cache_glob_node_lookup_suffix (XdgMimeCache        *cache,
+			       xdg_uint32_t         n_entries,
+			       xdg_uint32_t         offset,
+			       const xdg_unichar_t *name,
+			       int                  len,
+			       int                  ignore_case,
+			       int                  depth,
+			       XdgCacheMatch       *best)
+{
+  xdg_unichar_t character;
+  xdg_uint32_t min = 0, max = n_entries;
+
+  if (len <= 0 || depth > 255)
+    return;
+
+  character = name[len - 1];
+  if (ignore_case)
+    character = _xdg_ucs4_to_lower (character);
+
+  /* The nodes are sorted by character */
+  while (min < max)
+    {
+      xdg_uint32_t mid = min + (max - min) / 2;
+      xdg_uint32_t node = offset + 12 * mid;
+      xdg_unichar_t match_char = cache_uint32 (cache, node);
+
+      if (match_char < character)
+	min = mid + 1;
+      else if (match_char > character)
+	max = mid;
+      else
+	{
+	  xdg_uint32_t n_children = cache_uint32 (cache, node + 4);
+	  xdg_uint32_t child_offset = cache_uint32 (cache, node + 8);
+	  xdg_uint32_t i;
+
+	  /* Leaves, whose character is 0, come first among the children */
+	  for (i = 0; i < n_children; i++)
+	    {
+	      xdg_uint32_t child = child_offset + 12 * i;
+	      xdg_uint32_t flags;
+
+	      if (cache_uint32 (cache, child) != 0)
+		break;
+
+	      flags = cache_uint32 (cache, child + 8);
+	      if (ignore_case && (flags & CASE_SENSITIVE_FLAG))
+		continue;
+	      cache_match_consider (best,
+				    cache_string (cache, cache_uint32 (cache, child + 4)),
+				    flags & WEIGHT_MASK, depth + 1);
+	    }
+
+	  cache_glob_node_lookup_suffix (cache, n_children - i, child_offset + 12 * i,
+					 name, len - 1, ignore_case, depth + 1, best);
+	  return;
+	}
+    }
+}
+
+static void
+cache_glob_lookup_suffix (XdgMimeCache        *cache,
+			  const xdg_unichar_t *name,
+			  int                  len,
+			  XdgCacheMatch       *best)
+{
+  xdg_uint32_t tree_offset = cache_uint32 (cache, REVERSE_SUFFIX_TREE_OFFSET);
+  xdg_uint32_t n_roots = cache_uint32 (cache, tree_offset);
+  xdg_uint32_t first_root = cache_uint32 (cache, tree_offset + 4);
+
+  cache_glob_node_lookup_suffix (cache, n_roots, first_root, name, len, FALSE, 0, best);
+  cache_glob_node_lookup_suffix (cache, n_roots, first_root, name, len, TRUE, 0, best);
+}
+
+static void
+cache_glob_lookup_fnmatch (XdgMimeCache *cache,
+			   const char   *file_name,
+			   const char   *lower_file_name,
+			   XdgCacheMatch *best)
+{
+  xdg_uint32_t list_offset = cache_uint32 (cache, GLOB_LIST_OFFSET);
+  xdg_uint32_t n_entries = cache_uint32 (cache, list_offset);
+  xdg_uint32_t i;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      xdg_uint32_t offset = list_offset + 4 + 12 * i;
+      const char *glob = cache_string (cache, cache_uint32 (cache, offset));
+      xdg_uint32_t flags = cache_uint32 (cache, offset + 8);
+
+      if (glob == NULL)
+	continue;
+
+      /* FIXME: Not UTF-8 safe */
+      if (fnmatch (glob, file_name, 0) == 0 ||
+	  (! (flags & CASE_SENSITIVE_FLAG) && fnmatch (glob, lower_file_name, 0) == 0))
+	cache_match_consider (best,
+			      cache_string (cache, cache_uint32 (cache, offset + 4)),
+			      flags & WEIGHT_MASK, strlen (glob));
+    }
+}
+
+const char *
+_xdg_mime_cache_get_mime_type_from_file_name (const char *file_name)
+{
+  XdgCacheMatch best;
+  xdg_unichar_t *name;
+  char *lower_file_name;
+  const char *ptr;
+  int len, i;
+
+  assert (file_name != NULL);
+
+  lower_file_name = strdup (file_name);
+  for (i = 0; lower_file_name[i]; i++)
+    lower_file_name[i] = tolower ((unsigned char)lower_file_name[i]);
+
+  /* First, check the literals */
+  for (i = 0; _caches[i]; i++)
+    {
+      const char *mime_type = cache_glob_lookup_literal (_caches[i], file_name, FALSE);
+      if (mime_type == NULL)
+	mime_type = cache_glob_lookup_literal (_caches[i], lower_file_name, TRUE);
+      if (mime_type)
+	{
+	  free (lower_file_name);
+	  return mime_type;
+	}
+    }
+
+  /* Then the globs that are just a suffix, by walking the name backwards */
+  name = (xdg_unichar_t *)malloc (sizeof (xdg_unichar_t) * (strlen (file_name) + 1));
+  len = 0;
+  for (ptr = file_name; *ptr; ptr = _xdg_utf8_next_char (ptr))
+    name[len++] = _xdg_utf8_to_ucs4 (ptr);
+
+  best.mime_type = NULL;
+  best.weight = 0;
+  best.length = 0;
+  for (i = 0; _caches[i]; i++)
+    cache_glob_lookup_suffix (_caches[i], name, len, &best);
+  free (name);
+
+  /* Finally the other globs */
+  if (best.mime_type == NULL)
+    for (i = 0; _caches[i]; i++)
+      cache_glob_lookup_fnmatch (_caches[i], file_name, lower_file_name, &best);
+  free (lower_file_name);
+
+  return best.mime_type;
+}
+
+/* Aliases and parents
+ */
+
+const char *
+_xdg_mime_cache_unalias_mime_type (const char *mime)
+{
+  int i;
+
+  for (i = 0; _caches[i]; i++)
+    {
+      XdgMimeCache *cache = _caches[i];
+      xdg_uint32_t list_offset = cache_uint32 (cache, ALIAS_LIST_OFFSET);
+      xdg_uint32_t n_entries = cache_uint32 (cache, list_offset);
+      xdg_uint32_t min = 0, max = n_entries;
+
+      /* The aliases are sorted */
+      while (min < max)
+	{
+	  xdg_uint32_t mid = min + (max - min) / 2;
+	  xdg_uint32_t offset = list_offset + 4 + 8 * mid;
+	  const char *alias = cache_string (cache, cache_uint32 (cache, offset));
+	  int cmp;
+
+	  if (alias == NULL)
+	    break;
+
+	  cmp = strcmp (alias, mime);
+	  if (cmp < 0)
+	    min = mid + 1;
+	  else if (cmp > 0)
+	    max = mid;
+	  else
+	    {
+	      const char *mime_type = cache_string (cache, cache_uint32 (cache, offset + 4));
+	      if (mime_type)
+		return mime_type;
+	      break;
+	    }
+	}
+    }
+
+  return mime;
+}
+
+const char **
+_xdg_mime_cache_get_mime_parents (const char *mime)
+{
+  const char **parents = NULL;
+  int n_parents = 0;
+  int i;
+
+  for (i = 0; _caches[i]; i++)
+    {
+      XdgMimeCache *cache = _caches[i];
+      xdg_uint32_t list_offset = cache_uint32 (cache, PARENT_LIST_OFFSET);
+      xdg_uint32_t n_entries = cache_uint32 (cache, list_offset);
+      xdg_uint32_t min = 0, max = n_entries;
+
+      /* The entries are sorted by mime type */
+      while (min < max)
+	{
+	  xdg_uint32_t mid = min + (max - min) / 2;
+	  xdg_uint32_t offset = list_offset + 4 + 8 * mid;
+	  const char *mime_type = cache_string (cache, cache_uint32 (cache, offset));
+	  int cmp;
+
+	  if (mime_type == NULL)
+	    break;
+
+	  cmp = strcmp (mime_type, mime);
+	  if (cmp < 0)
+	    min = mid + 1;
+	  else if (cmp > 0)
+	    max = mid;
+	  else
+	    {
+	      xdg_uint32_t parents_offset = cache_uint32 (cache, offset + 4);
+	      xdg_uint32_t count = cache_uint32 (cache, parents_offset);
+	      xdg_uint32_t j;
+
+	      if (count > cache->size / 4)
+		break;
+
+	      parents = (const char **)realloc (parents, sizeof (char *) * (n_parents + count + 1));
+	      for (j = 0; j < count; j++)
+		{
+		  const char *parent = cache_string (cache, cache_uint32 (cache, parents_offset + 4 + 4 * j));
+		  int k;
+
+		  if (parent == NULL)
+		    continue;
+		  for (k = 0; k < n_parents; k++)
+		    if (strcmp (parents[k], parent) == 0)
+		      break;
+		  if (k == n_parents)
+		    parents[n_parents++] = parent;
+		}
+	      parents[n_parents] = NULL;
+	      break;
+	    }
+	}
+    }
+
+  /* Callers don't free the list, so keep it until the caches go away */
+  if (parents)
+    {
+      parent_lists = (const char ***)realloc (parent_lists, sizeof (char **) * (n_parent_lists + 1));
+      parent_lists[n_parent_lists++] = parents;
+    }
+
+  return parents;
+}
+
+void
+_xdg_mime_cache_free_parents (void)
+{
+  int i;
+
+  for (i = 0; i < n_parent_lists; i++)
+    free (parent_lists[i]);
+  free (parent_lists);
+  parent_lists = NULL;
+  n_parent_lists = 0;
+}
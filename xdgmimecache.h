@@ -0,0 +1,60 @@
+/* -*- mode: C; c-file-style: "gnu" -*- */
+/* xdgmimecache.h: Private file.  Datastructure for mmapped caches.
+ *
+ * More info can be found at http://www.freedesktop.org/standards/
+ *
+ * Copyright (C) 2005  Matthias Clasen <mclasen@redhat.com>
+ *
+ * Licensed under the Academic Free License version 2.0
+ * Or under the following terms:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __XDG_MIME_CACHE_H__
+#define __XDG_MIME_CACHE_H__
+
+#include "xdgmime.h"
+
+typedef struct XdgMimeCache XdgMimeCache;
+
+#ifdef XDG_PREFIX
+#define _xdg_mime_cache_new_from_file                 XDG_ENTRY(cache_new_from_file)
+#define _xdg_mime_cache_free                          XDG_ENTRY(cache_free)
+#define _xdg_mime_cache_get_mime_type_for_data        XDG_ENTRY(cache_get_mime_type_for_data)
+#define _xdg_mime_cache_get_mime_type_from_file_name  XDG_ENTRY(cache_get_mime_type_from_file_name)
+#define _xdg_mime_cache_get_max_buffer_extents        XDG_ENTRY(cache_get_max_buffer_extents)
+#define _xdg_mime_cache_unalias_mime_type             XDG_ENTRY(cache_unalias_mime_type)
+#define _xdg_mime_cache_get_mime_parents              XDG_ENTRY(cache_get_mime_parents)
+#define _xdg_mime_cache_free_parents                  XDG_ENTRY(cache_free_parents)
+#endif
+
+/* The caches that were loaded, terminated by NULL.  When there are any,
+ * lookups use them instead of the text files. */
+extern XdgMimeCache **_caches;
+
+XdgMimeCache *_xdg_mime_cache_new_from_file (const char   *file_name);
+void          _xdg_mime_cache_free          (XdgMimeCache *cache);
+
+const char   *_xdg_mime_cache_get_mime_type_for_data       (const void *data,
+							      size_t      len);
+const char   *_xdg_mime_cache_get_mime_type_from_file_name (const char *file_name);
+int           _xdg_mime_cache_get_max_buffer_extents       (void);
+const char   *_xdg_mime_cache_unalias_mime_type            (const char *mime);
+const char  **_xdg_mime_cache_get_mime_parents             (const char *mime);
+void          _xdg_mime_cache_free_parents                 (void);
+
+#endif /* __XDG_MIME_CACHE_H__ */
@@ -45,275 +45,302 @@
 #define	TRUE	(!FALSE)
 #endif
 
+/* The number of buckets a table starts out with.  Tables double in size
+ * when they have more nodes than buckets. */
+#define XDG_GLOB_TABLE_MIN_BUCKETS 64
+
+/* Only ASCII letters are matched without regard to case, which is all that
+ * _xdg_ucs4_to_lower does in a UTF-8 locale */
+#define XDG_GLOB_ASCII_LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+/* Whether c is the first byte of a UTF-8 character */
+#define XDG_GLOB_IS_CHAR_START(c) (((unsigned char)(c) & 0xc0) != 0x80)
+
 typedef struct XdgGlobHashNode XdgGlobHashNode;
-typedef struct XdgGlobList XdgGlobList;
+typedef struct XdgGlobTable XdgGlobTable;
+typedef struct XdgGlobFull XdgGlobFull;
 
+/* A literal file name or the suffix of a simple glob */
 struct XdgGlobHashNode
 {
-  xdg_unichar_t character;
+  const char *text;
+  int length;
+  unsigned int hash;
   const char *mime_type;
   XdgGlobHashNode *next;
-  XdgGlobHashNode *child;
 };
-struct XdgGlobList
+
+struct XdgGlobTable
+{
+  XdgGlobHashNode **buckets;
+  int n_buckets;
+  int n_nodes;
+};
+
+/* A glob that needs fnmatch.  The literal text the glob starts and ends
+ * with is compared first, so most globs are rejected without a call to
+ * fnmatch. */
+struct XdgGlobFull
 {
-  const char *data;
+  const char *glob;
   const char *mime_type;
-  XdgGlobList *next;
+  int prefix_length;
+  const char *suffix;
+  int suffix_length;
 };
 
 struct XdgGlobHash
 {
-  XdgGlobList *literal_list;
-  XdgGlobHashNode *simple_node;
-  XdgGlobList *full_list;
+  XdgGlobTable literal_table;
+  int max_literal_length;
+  XdgGlobTable simple_table;
+  /* simple_lengths[n] is TRUE if there is a simple glob whose suffix is n
+   * bytes long */
+  char *simple_lengths;
+  int max_simple_length;
+  /* simple_first[c] is FALSE if no suffix of a simple glob starts with a
+   * byte that lowercases to c */
+  char simple_first[256];
+  XdgGlobFull *full_globs;
+  int n_full_globs;
 };
 
 
-/* XdgGlobList
+/* XdgGlobTable
  */
-static XdgGlobList *
-_xdg_glob_list_new (void)
+
+/* The hash runs from the last byte to the first, so that the hashes of all
+ * suffixes of a name can be found in one pass over it */
+#define XDG_GLOB_HASH_INITIAL 5381
+#define XDG_GLOB_HASH_STEP(hash, c) ((hash) * 33 + (unsigned char)(c))
+
+static unsigned int
+_xdg_glob_text_hash (const char *text,
+		     int         length)
 {
-  XdgGlobList *new_element;
+  unsigned int hash = XDG_GLOB_HASH_INITIAL;
+  int i;
 
-  new_element = (XdgGlobList *)calloc (1, sizeof (XdgGlobList));
+  for (i = length - 1; i >= 0; i--)
+    hash = XDG_GLOB_HASH_STEP (hash, text[i]);
 
-  return new_element;
+  return hash;
 }
 
-/* Frees glob_list and all of it's children */
-static void
-_xdg_glob_list_free (XdgGlobList *glob_list)
+static XdgGlobHashNode *
+_xdg_glob_table_find (XdgGlobTable *table,
+		      const char   *text,
+		      int           length,
+		      unsigned int  hash)
 {
-  XdgGlobList *ptr, *next;
+  XdgGlobHashNode *node;
 
-  ptr = glob_list;
+  if (table->n_buckets == 0)
+    return NULL;
 
-  while (ptr != NULL)
+  for (node = table->buckets[hash % table->n_buckets]; node; node = node->next)
     {
-      next = ptr->next;
-
-      if (ptr->data)
-	free ((void *) ptr->data);
-      if (ptr->mime_type)
-	free ((void *) ptr->mime_type);
-      free (ptr);
-
-      ptr = next;
+      if (node->hash == hash && node->length == length &&
+	  memcmp (node->text, text, length) == 0)
+	return node;
     }
+
+  return NULL;
 }
 
-static XdgGlobList *
-_xdg_glob_list_append (XdgGlobList *glob_list,
-		       void        *data,
-		       const char  *mime_type)
+static void
+_xdg_glob_table_grow (XdgGlobTable *table)
 {
-  XdgGlobList *new_element;
-  XdgGlobList *tmp_element;
-
-  new_element = _xdg_glob_list_new ();
-  new_element->data = (const char *)data;
-  new_element->mime_type = mime_type;
-  if (glob_list == NULL)
-    return new_element;
-
-  tmp_element = glob_list;
-  while (tmp_element->next != NULL)
-    tmp_element = tmp_element->next;
+  XdgGlobHashNode **buckets;
+  int n_buckets;
+  int i;
 
-  tmp_element->next = new_element;
+  n_buckets = table->n_buckets ? table->n_buckets * 2 : XDG_GLOB_TABLE_MIN_BUCKETS;
+  buckets = (XdgGlobHashNode **)calloc (n_buckets, sizeof (XdgGlobHashNode *));
 
-  return glob_list;
-}
-
-#if 0
-static XdgGlobList *
-_xdg_glob_list_prepend (XdgGlobList *glob_list,
-			void        *data,
-			const char  *mime_type)
-{
-  XdgGlobList *new_element;
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      XdgGlobHashNode *node, *next;
 
-  new_element = _xdg_glob_list_new ();
-  new_element->data = data;
-  new_element->next = glob_list;
-  new_element->mime_type = mime_type;
+      for (node = table->buckets[i]; node; node = next)
+	{
+	  next = node->next;
+	  node->next = buckets[node->hash % n_buckets];
+	  buckets[node->hash % n_buckets] = node;
+	}
+    }
 
-  return new_element;
+  free (table->buckets);
+  table->buckets = buckets;
+  table->n_buckets = n_buckets;
 }
-#endif
 
-/* XdgGlobHashNode
- */
-
-static XdgGlobHashNode *
-_xdg_glob_hash_node_new (void)
+/* Adds a copy of text to the table, taking ownership of mime_type.  If text
+ * is already there, its mime type is replaced if replace is TRUE. */
+static void
+_xdg_glob_table_insert (XdgGlobTable *table,
+			const char   *text,
+			const char   *mime_type,
+			int           replace)
 {
-  XdgGlobHashNode *glob_hash_node;
+  XdgGlobHashNode *node;
+  unsigned int hash;
+  int length;
 
-  glob_hash_node = (XdgGlobHashNode *)calloc (1, sizeof (XdgGlobHashNode));
+  length = strlen (text);
+  hash = _xdg_glob_text_hash (text, length);
+  node = _xdg_glob_table_find (table, text, length, hash);
+  if (node != NULL)
+    {
+      if (replace)
+	{
+	  free ((void *) node->mime_type);
+	  node->mime_type = mime_type;
+	}
+      else
+	free ((void *) mime_type);
+      return;
+    }
 
-  return glob_hash_node;
+  if (table->n_nodes >= table->n_buckets)
+    _xdg_glob_table_grow (table);
+
+  node = (XdgGlobHashNode *)calloc (1, sizeof (XdgGlobHashNode));
+  node->text = strdup (text);
+  node->length = length;
+  node->hash = hash;
+  node->mime_type = mime_type;
+  node->next = table->buckets[hash % table->n_buckets];
+  table->buckets[hash % table->n_buckets] = node;
+  table->n_nodes++;
 }
 
 static void
-_xdg_glob_hash_node_dump (XdgGlobHashNode *glob_hash_node,
-			  int depth)
+_xdg_glob_table_free (XdgGlobTable *table)
 {
   int i;
-  for (i = 0; i < depth; i++)
-    printf (" ");
-
-  printf ("%c", (char)glob_hash_node->character);
-  if (glob_hash_node->mime_type)
-    printf (" - %s\n", glob_hash_node->mime_type);
-  else
-    printf ("\n");
-  if (glob_hash_node->child)
-    _xdg_glob_hash_node_dump (glob_hash_node->child, depth + 1);
-  if (glob_hash_node->next)
-    _xdg_glob_hash_node_dump (glob_hash_node->next, depth);
-}
 
-static XdgGlobHashNode *
-_xdg_glob_hash_insert_text (XdgGlobHashNode *glob_hash_node,
-			    const char      *text,
-			    const char      *mime_type)
-{
-  XdgGlobHashNode *node;
-  xdg_unichar_t character;
-
-  character = _xdg_utf8_to_ucs4 (text);
-
-  if ((glob_hash_node == NULL) ||
-      (character < glob_hash_node->character))
-    {
-      node = _xdg_glob_hash_node_new ();
-      node->character = character;
-      node->next = glob_hash_node;
-      glob_hash_node = node;
-    }
-  else if (character == glob_hash_node->character)
-    {
-      node = glob_hash_node;
-    }
-  else
+  for (i = 0; i < table->n_buckets; i++)
     {
-      XdgGlobHashNode *prev_node;
-      int found_node = FALSE;
+      XdgGlobHashNode *node, *next;
 
-      /* Look for the first character of text in glob_hash_node, and insert it if we
-       * have to.*/
-      prev_node = glob_hash_node;
-      node = prev_node->next;
-
-      while (node != NULL)
-	{
-	  if (character < node->character)
-	    {
-	      node = _xdg_glob_hash_node_new ();
-	      node->character = character;
-	      node->next = prev_node->next;
-	      prev_node->next = node;
-
-	      found_node = TRUE;
-	      break;
-	    }
-	  else if (character == node->character)
-	    {
-	      found_node = TRUE;
-	      break;
-	    }
-	  prev_node = node;
-	  node = node->next;
-	}
-
-      if (! found_node)
+      for (node = table->buckets[i]; node; node = next)
 	{
-	  node = _xdg_glob_hash_node_new ();
-	  node->character = character;
-	  node->next = prev_node->next;
-	  prev_node->next = node;
+	  next = node->next;
+	  free ((void *) node->text);
+	  free ((void *) node->mime_type);
+	  free (node);
 	}
     }
+  free (table->buckets);
+}
 
-  text = _xdg_utf8_next_char (text);
-  if (*text == '\000')
+static void
+_xdg_glob_table_dump (XdgGlobTable *table,
+		      const char   *prefix)
+{
+  int i;
+
+  if (table->n_nodes == 0)
     {
-      node->mime_type = mime_type;
+      printf ("    None\n");
+      return;
     }
-  else
+
+  for (i = 0; i < table->n_buckets; i++)
     {
-      node->child = _xdg_glob_hash_insert_text (node->child, text, mime_type);
+      XdgGlobHashNode *node;
+
+      for (node = table->buckets[i]; node; node = node->next)
+	printf ("    %s%s - %s\n", prefix, node->text, node->mime_type);
     }
-  return glob_hash_node;
 }
 
+/* Looks up the suffixes of file_name in the table of simple globs.  The
+ * longest suffix that matches wins, and a suffix matches if it is in the
+ * table as it is or in lowercase. */
 static const char *
-_xdg_glob_hash_node_lookup_file_name (XdgGlobHashNode *glob_hash_node,
-				      const char      *file_name,
-				      int              ignore_case)
+_xdg_glob_hash_lookup_suffix (XdgGlobHash *glob_hash,
+			      const char  *file_name,
+			      int          length)
 {
-  XdgGlobHashNode *node;
-  xdg_unichar_t character;
+  XdgGlobTable *table = &glob_hash->simple_table;
+  const char *mime_type = NULL;
+  unsigned int hash = XDG_GLOB_HASH_INITIAL;
+  unsigned int lower_hash = XDG_GLOB_HASH_INITIAL;
+  char lower_name[256];
+  int max, n;
+
+  max = length < glob_hash->max_simple_length ? length : glob_hash->max_simple_length;
+  if (max > (int) sizeof (lower_name))
+    max = sizeof (lower_name);
+
+  for (n = 1; n <= max; n++)
+    {
+      const char *suffix = file_name + length - n;
+      char *lower_suffix = lower_name + max - n;
+      XdgGlobHashNode *node;
 
-  if (glob_hash_node == NULL)
-    return NULL;
+      *lower_suffix = XDG_GLOB_ASCII_LOWER (*suffix);
+      hash = XDG_GLOB_HASH_STEP (hash, *suffix);
+      lower_hash = XDG_GLOB_HASH_STEP (lower_hash, *lower_suffix);
 
-  character = _xdg_utf8_to_ucs4 (file_name);
-  if (ignore_case)
-    character = _xdg_ucs4_to_lower(character);
+      if (! glob_hash->simple_lengths[n] ||
+	  ! glob_hash->simple_first[(unsigned char) *lower_suffix] ||
+	  ! XDG_GLOB_IS_CHAR_START (*suffix))
+	continue;
 
-  for (node = glob_hash_node; node && character >= node->character; node = node->next)
-    {
-      if (character == node->character)
-	{
-	  file_name = _xdg_utf8_next_char (file_name);
-	  if (*file_name == '\000')
-	    return node->mime_type;
-	  else
-	    return _xdg_glob_hash_node_lookup_file_name (node->child,
-							 file_name,
-							 ignore_case);
-	}
+      node = _xdg_glob_table_find (table, suffix, n, hash);
+      if (node == NULL)
+	node = _xdg_glob_table_find (table, lower_suffix, n, lower_hash);
+      if (node != NULL)
+	mime_type = node->mime_type;
     }
-  return NULL;
+
+  return mime_type;
 }
 
 const char *
 _xdg_glob_hash_lookup_file_name (XdgGlobHash *glob_hash,
 				 const char  *file_name)
 {
-  XdgGlobList *list;
+  XdgGlobHashNode *node;
   const char *mime_type;
-  const char *ptr;
-  /* First, check the literals */
+  int length, i;
 
   assert (file_name != NULL);
 
-  for (list = glob_hash->literal_list; list; list = list->next)
-    if (strcmp ((const char *)list->data, file_name) == 0)
-      return list->mime_type;
+  length = strlen (file_name);
 
-  ptr = strchr (file_name, '.');
-  while (ptr != NULL)
+  /* First, check the literals */
+  if (length <= glob_hash->max_literal_length)
     {
-      mime_type = (_xdg_glob_hash_node_lookup_file_name (glob_hash->simple_node, ptr, FALSE));
-      if (mime_type != NULL)
-        return mime_type;
-      
-      mime_type = (_xdg_glob_hash_node_lookup_file_name (glob_hash->simple_node, ptr, TRUE));
-      if (mime_type != NULL)
-        return mime_type;
-      
-      ptr = strchr (ptr+1, '.');
+      node = _xdg_glob_table_find (&glob_hash->literal_table, file_name, length,
+				   _xdg_glob_text_hash (file_name, length));
+      if (node != NULL)
+	return node->mime_type;
     }
 
+  /* Then the simple globs */
+  mime_type = _xdg_glob_hash_lookup_suffix (glob_hash, file_name, length);
+  if (mime_type != NULL)
+    return mime_type;
+
   /* FIXME: Not UTF-8 safe */
-  for (list = glob_hash->full_list; list; list = list->next)
-    if (fnmatch ((const char *)list->data, file_name, 0) == 0)
-      return list->mime_type;
+  for (i = 0; i < glob_hash->n_full_globs; i++)
+    {
+      XdgGlobFull *full = &glob_hash->full_globs[i];
+
+      if (full->prefix_length + full->suffix_length > length)
+	continue;
+      if (strncmp (file_name, full->glob, full->prefix_length) != 0)
+	continue;
+      if (strcmp (file_name + length - full->suffix_length, full->suffix) != 0)
+	continue;
+
+      if (fnmatch (full->glob, file_name, 0) == 0)
+	return full->mime_type;
+    }
 
   return NULL;
 }
@@ -334,27 +361,22 @@ _xdg_glob_hash_new (void)
 }
 
 
-static void
-_xdg_glob_hash_free_nodes (XdgGlobHashNode *node)
+void
+_xdg_glob_hash_free (XdgGlobHash *glob_hash)
 {
-  if (node)
+  int i;
+
+  _xdg_glob_table_free (&glob_hash->literal_table);
+  _xdg_glob_table_free (&glob_hash->simple_table);
+  free (glob_hash->simple_lengths);
+
+  for (i = 0; i < glob_hash->n_full_globs; i++)
     {
-      if (node->child)
-       _xdg_glob_hash_free_nodes (node->child);
-      if (node->next)
-       _xdg_glob_hash_free_nodes (node->next);
-      if (node->mime_type)
-	free ((void *) node->mime_type);
-      free (node);
+      free ((void *) glob_hash->full_globs[i].glob);
+      free ((void *) glob_hash->full_globs[i].mime_type);
     }
-}
+  free (glob_hash->full_globs);
 
-void
-_xdg_glob_hash_free (XdgGlobHash *glob_hash)
-{
-  _xdg_glob_list_free (glob_hash->literal_list);
-  _xdg_glob_list_free (glob_hash->full_list);
-  _xdg_glob_hash_free_nodes (glob_hash->simple_node);
   free (glob_hash);
 }
 
@@ -383,6 +405,33 @@ _xdg_glob_determine_type (const char *glob)
     return XDG_GLOB_LITERAL;
 }
 
+static void
+_xdg_glob_hash_append_full (XdgGlobHash *glob_hash,
+			    const char  *glob,
+			    const char  *mime_type)
+{
+  XdgGlobFull *full;
+  const char *ptr;
+
+  glob_hash->full_globs = (XdgGlobFull *)realloc (glob_hash->full_globs, sizeof (XdgGlobFull) * (glob_hash->n_full_globs + 1));
+  full = &glob_hash->full_globs[glob_hash->n_full_globs++];
+  full->glob = glob;
+  full->mime_type = mime_type;
+
+  /* Everything before the first special character must match literally, and
+   * so must everything after the last one.  Escapes are left to fnmatch. */
+  full->prefix_length = strcspn (glob, "*?[\\");
+  full->suffix = glob + strlen (glob);
+  full->suffix_length = 0;
+  if (strchr (glob, '\\') == NULL)
+    {
+      for (ptr = glob + strlen (glob); ptr > glob && ! strchr ("*?[]", ptr[-1]); ptr--)
+	;
+      full->suffix = ptr;
+      full->suffix_length = strlen (ptr);
+    }
+}
+
 /* glob must be valid UTF-8 */
 void
 _xdg_glob_hash_append_glob (XdgGlobHash *glob_hash,
@@ -390,6 +439,7 @@ _xdg_glob_hash_append_glob (XdgGlobHash *glob_hash,
 			    const char  *mime_type)
 {
   XdgGlobType type;
+  int length;
 
   assert (glob_hash != NULL);
   assert (glob != NULL);
@@ -399,13 +449,30 @@ _xdg_glob_hash_append_glob (XdgGlobHash *glob_hash,
   switch (type)
     {
     case XDG_GLOB_LITERAL:
-      glob_hash->literal_list = _xdg_glob_list_append (glob_hash->literal_list, strdup (glob), strdup (mime_type));
+      /* The first of several identical literals wins */
+      _xdg_glob_table_insert (&glob_hash->literal_table, glob, strdup (mime_type), FALSE);
+      length = strlen (glob);
+      if (length > glob_hash->max_literal_length)
+	glob_hash->max_literal_length = length;
       break;
     case XDG_GLOB_SIMPLE:
-      glob_hash->simple_node = _xdg_glob_hash_insert_text (glob_hash->simple_node, glob + 1, strdup (mime_type));
+      /* The last of several identical simple globs wins */
+      length = strlen (glob + 1);
+      if (length == 0)
+	break;
+      _xdg_glob_table_insert (&glob_hash->simple_table, glob + 1, strdup (mime_type), TRUE);
+      if (length > glob_hash->max_simple_length)
+	{
+	  glob_hash->simple_lengths = (char *)realloc (glob_hash->simple_lengths, length + 1);
+	  memset (glob_hash->simple_lengths + glob_hash->max_simple_length + 1, FALSE,
+		  length - glob_hash->max_simple_length);
+	  glob_hash->max_simple_length = length;
+	}
+      glob_hash->simple_lengths[length] = TRUE;
+      glob_hash->simple_first[(unsigned char) XDG_GLOB_ASCII_LOWER (glob[1])] = TRUE;
       break;
     case XDG_GLOB_FULL:
-      glob_hash->full_list = _xdg_glob_list_append (glob_hash->full_list, strdup (glob), strdup (mime_type));
+      _xdg_glob_hash_append_full (glob_hash, strdup (glob), strdup (mime_type));
       break;
     }
 }
@@ -413,29 +480,23 @@ _xdg_glob_hash_append_glob (XdgGlobHash *glob_hash,
 void
 _xdg_glob_hash_dump (XdgGlobHash *glob_hash)
 {
-  XdgGlobList *list;
+  int i;
+
   printf ("LITERAL STRINGS\n");
-  if (glob_hash->literal_list == NULL)
-    {
-      printf ("    None\n");
-    }
-  else
-    {
-      for (list = glob_hash->literal_list; list; list = list->next)
-	printf ("    %s - %s\n", (char *)list->data, list->mime_type);
-    }
+  _xdg_glob_table_dump (&glob_hash->literal_table, "");
+
   printf ("\nSIMPLE GLOBS\n");
-  _xdg_glob_hash_node_dump (glob_hash->simple_node, 4);
+  _xdg_glob_table_dump (&glob_hash->simple_table, "*");
 
   printf ("\nFULL GLOBS\n");
-  if (glob_hash->full_list == NULL)
+  if (glob_hash->n_full_globs == 0)
     {
       printf ("    None\n");
     }
   else
     {
-      for (list = glob_hash->full_list; list; list = list->next)
-	printf ("    %s - %s\n", (char *)list->data, list->mime_type);
+      for (i = 0; i < glob_hash->n_full_globs; i++)
+	printf ("    %s - %s\n", glob_hash->full_globs[i].glob, glob_hash->full_globs[i].mime_type);
     }
 }
 